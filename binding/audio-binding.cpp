@@ -24,6 +24,21 @@
 #include "binding-util.h"
 #include "exception.h"
 
+#include <SDL_mutex.h>
+#include <string>
+
+/* Guards the sound emitter: se_play runs without the GVL (decoding
+ * an uncached sound can take a while), so other Ruby threads may
+ * reach it concurrently. Never held while waiting for the GVL */
+static SDL_mutex *seMutex;
+
+#define SE_LOCKED(exp) \
+	{ \
+		SDL_LockMutex(seMutex); \
+		exp \
+		SDL_UnlockMutex(seMutex); \
+	}
+
 #define DEF_PLAY_STOP_POS(entity) \
 	RB_METHOD(audio_##entity##Play) \
 	{ \
@@ -155,7 +170,41 @@ RB_METHOD(audio_bgmFade)
 DEF_FADE( bgs )
 DEF_FADE( me )
 
-DEF_PLAY_STOP( se )
+RB_METHOD(audio_sePlay)
+{
+	RB_UNUSED_PARAM;
+
+	const char *filename;
+	int volume = 100;
+	int pitch = 100;
+	rb_get_args(argc, argv, "z|ii", &filename, &volume, &pitch RB_ARG_END);
+
+	std::string name(filename);
+
+	GUARD_EXC( callWithoutGVL([&]() {
+		SDL_LockMutex(seMutex);
+
+		try {
+			shState->audio().sePlay(name.c_str(), volume, pitch);
+		} catch (const Exception &) {
+			SDL_UnlockMutex(seMutex);
+			throw;
+		}
+
+		SDL_UnlockMutex(seMutex);
+	}); )
+
+	return Qnil;
+}
+
+RB_METHOD(audio_seStop)
+{
+	RB_UNUSED_PARAM;
+
+	SE_LOCKED( shState->audio().seStop(); )
+
+	return Qnil;
+}
 
 RB_METHOD(audioSetupMidi)
 {
@@ -166,11 +215,124 @@ RB_METHOD(audioSetupMidi)
 	return Qnil;
 }
 
+RB_METHOD(audioSePreload)
+{
+	RB_UNUSED_PARAM;
+
+	VALUE names;
+	rb_get_args(argc, argv, "o", &names RB_ARG_END);
+
+	if (!RB_TYPE_P(names, RUBY_T_ARRAY))
+		names = rb_ary_new_from_args(1, names);
+
+	for (long i = 0; i < RARRAY_LEN(names); ++i)
+	{
+		VALUE name = rb_ary_entry(names, i);
+		SafeStringValue(name);
+
+		SE_LOCKED( shState->audio().sePreload(RSTRING_PTR(name)); )
+	}
+
+	return Qnil;
+}
+
+RB_METHOD(audioBgmPrepare)
+{
+	RB_UNUSED_PARAM;
+
+	VALUE names;
+	rb_get_args(argc, argv, "o", &names RB_ARG_END);
+
+	if (!RB_TYPE_P(names, RUBY_T_ARRAY))
+		names = rb_ary_new_from_args(1, names);
+
+	for (long i = 0; i < RARRAY_LEN(names); ++i)
+	{
+		VALUE name = rb_ary_entry(names, i);
+		SafeStringValue(name);
+
+		shState->audio().bgmPrepare(RSTRING_PTR(name));
+	}
+
+	return Qnil;
+}
+
+RB_METHOD(audioSeLimit)
+{
+	RB_UNUSED_PARAM;
+
+	const char *filename;
+	int voiceLimit;
+	int priority = 0;
+
+	rb_get_args(argc, argv, "zi|i", &filename, &voiceLimit, &priority RB_ARG_END);
+
+	SE_LOCKED( shState->audio().seSetLimit(filename, voiceLimit, priority); )
+
+	return Qnil;
+}
+
+RB_METHOD(audioSeCacheStats)
+{
+	RB_UNUSED_PARAM;
+
+	Audio::SECacheStats stats;
+	SE_LOCKED( stats = shState->audio().seCacheStats(); )
+
+	VALUE entries = rb_hash_new();
+
+	for (size_t i = 0; i < stats.entries.size(); ++i)
+		rb_hash_aset(entries, rb_str_new_cstr(stats.entries[i].first.c_str()),
+		             UINT2NUM(stats.entries[i].second));
+
+	VALUE ret = rb_hash_new();
+
+	rb_hash_aset(ret, ID2SYM(rb_intern("bytes")), UINT2NUM(stats.bytes));
+	rb_hash_aset(ret, ID2SYM(rb_intern("budget")), UINT2NUM(stats.budget));
+	rb_hash_aset(ret, ID2SYM(rb_intern("hits")), UINT2NUM(stats.hits));
+	rb_hash_aset(ret, ID2SYM(rb_intern("misses")), UINT2NUM(stats.misses));
+	rb_hash_aset(ret, ID2SYM(rb_intern("entries")), entries);
+
+	return ret;
+}
+
+static VALUE streamStats2hash(const Audio::StreamStats &stats)
+{
+	VALUE ret = rb_hash_new();
+
+	rb_hash_aset(ret, ID2SYM(rb_intern("buffers")), INT2NUM(stats.buffers));
+	rb_hash_aset(ret, ID2SYM(rb_intern("buffer_size")), INT2NUM(stats.bufferSize));
+	rb_hash_aset(ret, ID2SYM(rb_intern("underruns")), UINT2NUM(stats.underruns));
+	rb_hash_aset(ret, ID2SYM(rb_intern("requeues")), UINT2NUM(stats.requeues));
+
+	return ret;
+}
+
+RB_METHOD(audioStreamStats)
+{
+	RB_UNUSED_PARAM;
+
+	Audio &audio = shState->audio();
+
+	VALUE bgm = rb_ary_new();
+
+	for (int i = 0; i < audio.bgmTrackCount(); ++i)
+		rb_ary_push(bgm, streamStats2hash(audio.bgmStats(i)));
+
+	VALUE ret = rb_hash_new();
+
+	rb_hash_aset(ret, ID2SYM(rb_intern("bgm")), bgm);
+	rb_hash_aset(ret, ID2SYM(rb_intern("bgs")), streamStats2hash(audio.bgsStats()));
+	rb_hash_aset(ret, ID2SYM(rb_intern("me")), streamStats2hash(audio.meStats()));
+
+	return ret;
+}
+
 RB_METHOD(audioReset)
 {
 	RB_UNUSED_PARAM;
 
-	shState->audio().reset();
+	SE_LOCKED( shState->audio().reset(); )
 
 	return Qnil;
 }
@@ -194,11 +356,14 @@ RB_METHOD(audioReset)
 void
 audioBindingInit()
 {
+	seMutex = SDL_CreateMutex();
+
 	VALUE module = rb_define_module("Audio");
 
 	BIND_PLAY_STOP_FADE( bgm );
     _rb_define_module_function(module, "bgm_volume", audio_bgmGetVolume);
     _rb_define_module_function(module, "bgm_set_volume", audio_bgmSetVolume);
+	_rb_define_module_function(module, "bgm_prepare", audioBgmPrepare);
 	BIND_PLAY_STOP_FADE( bgs );
 	BIND_PLAY_STOP_FADE( me  );
 
@@ -206,8 +371,12 @@ audioBindingInit()
 	BIND_POS( bgs );
 
 	_rb_define_module_function(module, "setup_midi", audioSetupMidi);
+	_rb_define_module_function(module, "stream_stats", audioStreamStats);
 
 	BIND_PLAY_STOP( se )
+	_rb_define_module_function(module, "se_preload", audioSePreload);
+	_rb_define_module_function(module, "se_cache_stats", audioSeCacheStats);
+	_rb_define_module_function(module, "se_limit", audioSeLimit);
 
 	_rb_define_module_function(module, "__reset__", audioReset);
 }
@@ -21,13 +21,19 @@
 
 #include "audio/audio.h"
 #include "filesystem/filesystem.h"
+#include "filesystem/savewriter.h"
+#include "filesystem/filesystemImpl.h"
 #include "display/graphics.h"
+#include "input/input.h"
 #include "display/font.h"
+#include "display/bitmap.h"
 #include "system/system.h"
 
 #include "util/util.h"
 #include "util/sdl-util.h"
 #include "util/debugwriter.h"
+#include "util/trace.h"
+#include "util/startup-timer.h"
 #include "util/boost-hash.h"
 #include "util/exception.h"
 #include "util/encoding.h"
@@ -41,6 +47,8 @@
 #include "eventthread.h"
 
 #include <vector>
+#include <map>
+#include <algorithm>
 
 extern "C" {
 #include <ruby.h>
@@ -48,8 +56,17 @@ extern "C" {
 #if RAPI_FULL >= 190
 #include <ruby/encoding.h>
 #endif
+
+#if RAPI_FULL >= 210
+#include <ruby/debug.h>
+#endif
 }
 
+#ifndef __WIN32__
+#include <pthread.h>
+#include <signal.h>
+#endif
+
 #ifdef __WIN32__
 #include "binding-mri-win32.h"
 #endif
@@ -62,6 +79,7 @@ extern "C" {
 #include <SDL_filesystem.h>
 #include <SDL_loadso.h>
 #include <SDL_power.h>
+#include <SDL_rwops.h>
 
 extern const char module_rpg1[];
 extern const char module_rpg2[];
@@ -77,12 +95,16 @@ ScriptBinding scriptBindingImpl = {mriBindingExecute, mriBindingTerminate,
 ScriptBinding *scriptBinding = &scriptBindingImpl;
 
 void tableBindingInit();
+void pathfinderBindingInit();
 void etcBindingInit();
 void fontBindingInit();
 void bitmapBindingInit();
 void spriteBindingInit();
 void viewportBindingInit();
 void planeBindingInit();
+void particleEmitterBindingInit();
+void textRunBindingInit();
+void textSpriteBindingInit();
 void windowBindingInit();
 void tilemapBindingInit();
 void windowVXBindingInit();
@@ -93,6 +115,7 @@ void audioBindingInit();
 void graphicsBindingInit();
 
 void fileIntBindingInit();
+void dataCacheClear();
 
 #ifdef MKXPZ_MINIFFI
 void MiniFFIBindingInit();
@@ -103,6 +126,9 @@ void CUSLBindingInit();
 #endif
 
 void httpBindingInit();
+void socketBindingInit();
+void rpgCacheBindingInit();
+void rpgSpriteBindingInit();
 
 RB_METHOD(mkxpDelta);
 RB_METHOD(mriPrint);
@@ -130,11 +156,20 @@ RB_METHOD(mkxpPowerState);
 RB_METHOD(mkxpSettingsMenu);
 RB_METHOD(mkxpCpuCount);
 RB_METHOD(mkxpSystemMemory);
+RB_METHOD(mkxpJITStats);
 RB_METHOD(mkxpReloadPathCache);
 RB_METHOD(mkxpAddPath);
 RB_METHOD(mkxpRemovePath);
 RB_METHOD(mkxpFileExists);
+RB_METHOD(mkxpFileMissStats);
+RB_METHOD(mkxpPrefetch);
 RB_METHOD(mkxpLaunch);
+RB_METHOD(mkxpSaveAsync);
+RB_METHOD(mkxpSaveWait);
+RB_METHOD(mkxpLoadSave);
+RB_METHOD(mkxpProfileStart);
+RB_METHOD(mkxpProfileStop);
+RB_METHOD(mkxpTraceZone);
 
 RB_METHOD(mkxpGetJSONSetting);
 RB_METHOD(mkxpSetJSONSetting);
@@ -154,12 +189,16 @@ json5pp::value rb2json(VALUE v);
 
 static void mriBindingInit() {
     tableBindingInit();
+    pathfinderBindingInit();
     etcBindingInit();
     fontBindingInit();
     bitmapBindingInit();
     spriteBindingInit();
     viewportBindingInit();
     planeBindingInit();
+    particleEmitterBindingInit();
+    textRunBindingInit();
+    textSpriteBindingInit();
     
     if (rgssVer == 1) {
         windowBindingInit();
@@ -184,6 +223,7 @@ static void mriBindingInit() {
 #endif
     
     httpBindingInit();
+    socketBindingInit();
     
     if (rgssVer >= 3) {
         _rb_define_module_function(rb_mKernel, "rgss_main", mriRgssMain);
@@ -202,9 +242,11 @@ static void mriBindingInit() {
         _rb_define_module_function(rb_mKernel, "caller", _kernelCaller);
     }
     
-    if (rgssVer == 1)
+    if (rgssVer == 1) {
         rb_eval_string(module_rpg1);
-    else if (rgssVer == 2)
+        rpgCacheBindingInit();
+        rpgSpriteBindingInit();
+    } else if (rgssVer == 2)
         rb_eval_string(module_rpg2);
     else if (rgssVer == 3)
         rb_eval_string(module_rpg3);
@@ -241,11 +283,20 @@ static void mriBindingInit() {
     _rb_define_module_function(mod, "power_state", mkxpPowerState);
     _rb_define_module_function(mod, "nproc", mkxpCpuCount);
     _rb_define_module_function(mod, "memory", mkxpSystemMemory);
+    _rb_define_module_function(mod, "jit_stats", mkxpJITStats);
     _rb_define_module_function(mod, "reload_cache", mkxpReloadPathCache);
     _rb_define_module_function(mod, "mount", mkxpAddPath);
     _rb_define_module_function(mod, "unmount", mkxpRemovePath);
     _rb_define_module_function(mod, "file_exist?", mkxpFileExists);
+    _rb_define_module_function(mod, "file_miss_stats", mkxpFileMissStats);
+    _rb_define_module_function(mod, "prefetch", mkxpPrefetch);
     _rb_define_module_function(mod, "launch", mkxpLaunch);
+    _rb_define_module_function(mod, "save_async", mkxpSaveAsync);
+    _rb_define_module_function(mod, "save_wait", mkxpSaveWait);
+    _rb_define_module_function(mod, "load_save", mkxpLoadSave);
+    _rb_define_module_function(mod, "profile_start", mkxpProfileStart);
+    _rb_define_module_function(mod, "profile_stop", mkxpProfileStop);
+    _rb_define_module_function(mod, "trace_zone", mkxpTraceZone);
     
     _rb_define_module_function(mod, "default_font_family=", mkxpSetDefaultFontFamily);
     
@@ -528,10 +579,89 @@ RB_METHOD(mkxpSystemMemory) {
     return INT2NUM(SDL_GetSystemRAM());
 }
 
+/* RubyVM::<name>, or nil if this Ruby doesn't have it */
+static VALUE rubyVMConst(const char *name) {
+    if (!rb_const_defined(rb_cObject, rb_intern("RubyVM")))
+        return Qnil;
+    
+    VALUE vm = rb_const_get(rb_cObject, rb_intern("RubyVM"));
+    
+    if (!rb_const_defined(vm, rb_intern(name)))
+        return Qnil;
+    
+    return rb_const_get(vm, rb_intern(name));
+}
+
+static bool jitEnabled(VALUE jit) {
+    return !NIL_P(jit) && rb_respond_to(jit, rb_intern("enabled?")) &&
+           RTEST(rb_funcall(jit, rb_intern("enabled?"), 0));
+}
+
+RB_METHOD(mkxpJITStats) {
+    RB_UNUSED_PARAM;
+    
+    VALUE ret = rb_hash_new();
+    
+    VALUE yjit = rubyVMConst("YJIT");
+    VALUE mjit = rubyVMConst("MJIT");
+    
+    VALUE active = Qnil;
+    
+    if (jitEnabled(yjit))
+        active = ID2SYM(rb_intern("yjit"));
+    else if (jitEnabled(mjit))
+        active = ID2SYM(rb_intern("mjit"));
+    
+    rb_hash_aset(ret, ID2SYM(rb_intern("jit")), active);
+    
+    /* Only YJIT reports anything about its work */
+    if (active != ID2SYM(rb_intern("yjit")) ||
+        !rb_respond_to(yjit, rb_intern("runtime_stats")))
+        return ret;
+    
+    VALUE stats = rb_funcall(yjit, rb_intern("runtime_stats"), 0);
+    
+    if (!RB_TYPE_P(stats, RUBY_T_HASH))
+        return ret;
+    
+    /* Side exits, by reason, as far as they happened */
+    VALUE exits = rb_hash_new();
+    VALUE keys = rb_funcall(stats, rb_intern("keys"), 0);
+    long inlineSize = 0, outlinedSize = 0;
+    
+    for (long i = 0; i < RARRAY_LEN(keys); ++i) {
+        VALUE key = rb_ary_entry(keys, i);
+        VALUE value = rb_hash_aref(stats, key);
+        VALUE name = rb_funcall(key, rb_intern("to_s"), 0);
+        const char *s = RSTRING_PTR(name);
+        
+        if (!RB_INTEGER_TYPE_P(value))
+            continue;
+        
+        if (!strncmp(s, "exit_", 5) && NUM2LONG(value) > 0)
+            rb_hash_aset(exits, ID2SYM(rb_intern(s + 5)), value);
+        else if (!strcmp(s, "compiled_iseq_count"))
+            rb_hash_aset(ret, ID2SYM(rb_intern("compiled_iseqs")), value);
+        else if (!strcmp(s, "inline_code_size"))
+            inlineSize = NUM2LONG(value);
+        else if (!strcmp(s, "outlined_code_size"))
+            outlinedSize = NUM2LONG(value);
+        else if (!strcmp(s, "side_exit_count"))
+            rb_hash_aset(ret, ID2SYM(rb_intern("side_exits")), value);
+    }
+    
+    rb_hash_aset(ret, ID2SYM(rb_intern("code_size")), LONG2NUM(inlineSize + outlinedSize));
+    rb_hash_aset(ret, ID2SYM(rb_intern("exits")), exits);
+    rb_hash_aset(ret, ID2SYM(rb_intern("raw")), stats);
+    
+    return ret;
+}
+
 RB_METHOD(mkxpReloadPathCache) {
     RB_UNUSED_PARAM;
     
     shState->fileSystem().reloadPathCache();
+    dataCacheClear();
     return Qnil;
 }
 
@@ -551,6 +681,7 @@ RB_METHOD(mkxpAddPath) {
             rb_bool_arg(reload, &rl);
         
         shState->fileSystem().addPath(RSTRING_PTR(path), mp, rl);
+        dataCacheClear();
     } catch (Exception &e) {
         raiseRbExc(e);
     }
@@ -570,6 +701,7 @@ RB_METHOD(mkxpRemovePath) {
             rb_bool_arg(reload, &rl);
         
         shState->fileSystem().removePath(RSTRING_PTR(path), rl);
+        dataCacheClear();
     } catch (Exception &e) {
         raiseRbExc(e);
     }
@@ -588,6 +720,38 @@ RB_METHOD(mkxpFileExists) {
     return Qfalse;
 }
 
+RB_METHOD(mkxpFileMissStats) {
+    RB_UNUSED_PARAM;
+    
+    FileSystem::MissCacheStats stats = shState->fileSystem().missCacheStats();
+    
+    VALUE ret = rb_hash_new();
+    rb_hash_aset(ret, ID2SYM(rb_intern("hits")), UINT2NUM(stats.hits));
+    rb_hash_aset(ret, ID2SYM(rb_intern("entries")), UINT2NUM(stats.entries));
+    
+    return ret;
+}
+
+RB_METHOD(mkxpPrefetch) {
+    RB_UNUSED_PARAM;
+    
+    VALUE paths;
+    rb_scan_args(argc, argv, "1", &paths);
+    
+    /* Takes a single path, or an array of them */
+    if (!RB_TYPE_P(paths, RUBY_T_ARRAY))
+        paths = rb_ary_new3(1, paths);
+    
+    for (long i = 0; i < RARRAY_LEN(paths); i++) {
+        VALUE path = rb_ary_entry(paths, i);
+        SafeStringValue(path);
+        
+        shState->fileSystem().prefetch(RSTRING_PTR(path));
+    }
+    
+    return Qnil;
+}
+
 RB_METHOD(mkxpSetDefaultFontFamily) {
     RB_UNUSED_PARAM;
     
@@ -680,6 +844,311 @@ RB_METHOD(mkxpLaunch) {
     return RUBY_Qnil;
 }
 
+/* [ticket, block] of saves whose completion a script waits for */
+static VALUE saveCallbacks = Qnil;
+
+RB_METHOD(mkxpSaveAsync) {
+    RB_UNUSED_PARAM;
+    
+    VALUE path, data, compress;
+    rb_scan_args(argc, argv, "21", &path, &data, &compress);
+    SafeStringValue(path);
+    SafeStringValue(data);
+    
+    bool comp = true;
+    if (compress != Qnil)
+        rb_bool_arg(compress, &comp);
+    
+    const bool notify = rb_block_given_p();
+    
+    unsigned int ticket =
+    shState->saveWriter().push(RSTRING_PTR(path), RSTRING_PTR(data),
+                               RSTRING_LEN(data), comp, notify);
+    
+    if (notify) {
+        if (NIL_P(saveCallbacks)) {
+            saveCallbacks = rb_ary_new();
+            rb_gc_register_address(&saveCallbacks);
+        }
+        
+        rb_ary_push(saveCallbacks, rb_ary_new3(2, UINT2NUM(ticket), rb_block_proc()));
+    }
+    
+    return Qnil;
+}
+
+RB_METHOD(mkxpSaveWait) {
+    RB_UNUSED_PARAM;
+    
+#if RAPI_MAJOR >= 2
+    rb_thread_call_without_gvl([](void*) -> void* {
+        shState->saveWriter().waitIdle();
+        return 0;
+    }, 0, 0, 0);
+#else
+    shState->saveWriter().waitIdle();
+#endif
+    
+    return Qnil;
+}
+
+RB_METHOD(mkxpLoadSave) {
+    RB_UNUSED_PARAM;
+    
+    VALUE path;
+    rb_scan_args(argc, argv, "1", &path);
+    SafeStringValue(path);
+    
+    /* A save that is still being written must not be read half done */
+    shState->saveWriter().waitIdle();
+    
+    std::string data;
+    
+    if (!SaveWriter::readFile(RSTRING_PTR(path), data))
+        raiseRbExc(Exception(Exception::NoFileError, "%s", RSTRING_PTR(path)));
+    
+    return rb_str_new(data.c_str(), data.size());
+}
+
+/* Runs the blocks of finished System.save_async calls with
+ * whether the save succeeded; called from Graphics.update */
+void saveProcessAsync() {
+    if (NIL_P(saveCallbacks) || RARRAY_LEN(saveCallbacks) == 0)
+        return;
+    
+    VALUE ready = rb_ary_new();
+    VALUE pending = rb_ary_new();
+    
+    for (long i = 0; i < RARRAY_LEN(saveCallbacks); ++i) {
+        VALUE entry = rb_ary_entry(saveCallbacks, i);
+        bool ok;
+        
+        if (shState->saveWriter().takeResult(NUM2UINT(rb_ary_entry(entry, 0)), ok))
+            rb_ary_push(ready, rb_ary_new3(2, rb_ary_entry(entry, 1), rb_bool_new(ok)));
+        else
+            rb_ary_push(pending, entry);
+    }
+    
+    /* Blocks may queue further saves */
+    saveCallbacks = pending;
+    
+    for (long i = 0; i < RARRAY_LEN(ready); ++i) {
+        VALUE entry = rb_ary_entry(ready, i);
+        rb_funcall(rb_ary_entry(entry, 0), rb_intern("call"), 1, rb_ary_entry(entry, 1));
+    }
+}
+
+/* Sampling profiler for Ruby code (System.profile_start/stop).
+ * A timer thread asks for a sample at a fixed interval; the
+ * sample itself has to be taken on the Ruby thread, so it is
+ * run as a postponed job. Ruby 3.3 can trigger one from any
+ * thread, before that the job has to be registered from a
+ * signal handler running on the Ruby thread */
+#if RAPI_FULL >= 330
+#define RUBY_SAMPLER_TRIGGER
+#elif RAPI_FULL >= 210 && !defined(__WIN32__)
+#define RUBY_SAMPLER_SIGNAL
+#endif
+
+#if defined(RUBY_SAMPLER_TRIGGER) || defined(RUBY_SAMPLER_SIGNAL)
+#define RUBY_SAMPLER
+
+#define SAMPLER_MAX_DEPTH 128
+
+static struct {
+    SDL_Thread *thread;
+    AtomicFlag running;
+    int interval;
+    
+    /* Prefix stacks with the Graphics frame they were taken in */
+    bool perFrame;
+    
+    /* Collapsed stack ("outer;...;inner") -> samples */
+    std::map<std::string, unsigned long> stacks;
+    
+#ifdef RUBY_SAMPLER_TRIGGER
+    rb_postponed_job_handle_t job;
+    bool jobRegistered;
+#else
+    pthread_t rubyThread;
+    bool handlerInstalled;
+#endif
+} sampler;
+
+static void samplerTakeSample(void*) {
+    if (!sampler.running)
+        return;
+    
+    VALUE frames[SAMPLER_MAX_DEPTH];
+    int lines[SAMPLER_MAX_DEPTH];
+    const int count = rb_profile_frames(0, SAMPLER_MAX_DEPTH, frames, lines);
+    
+    std::string stack;
+    
+    if (sampler.perFrame)
+        stack = "frame " + std::to_string(shState->graphics().logicalFrame());
+    
+    for (int i = count - 1; i >= 0; --i) {
+        VALUE label = rb_profile_frame_full_label(frames[i]);
+        
+        if (!stack.empty())
+            stack += ';';
+        
+        if (NIL_P(label))
+            stack += "(unknown)";
+        else
+            stack.append(RSTRING_PTR(label), RSTRING_LEN(label));
+    }
+    
+    if (!stack.empty())
+        sampler.stacks[stack]++;
+}
+
+#ifdef RUBY_SAMPLER_SIGNAL
+static void samplerSignal(int) {
+    if (sampler.running)
+        rb_postponed_job_register_one(0, samplerTakeSample, 0);
+}
+#endif
+
+static int samplerThread(void*) {
+    while (sampler.running) {
+        SDL_Delay(sampler.interval);
+        
+#ifdef RUBY_SAMPLER_TRIGGER
+        rb_postponed_job_trigger(sampler.job);
+#else
+        pthread_kill(sampler.rubyThread, SIGPROF);
+#endif
+    }
+    
+    return 0;
+}
+
+static void samplerStop() {
+    if (!sampler.thread)
+        return;
+    
+    sampler.running.clear();
+    SDL_WaitThread(sampler.thread, 0);
+    sampler.thread = 0;
+}
+#endif
+
+RB_METHOD(mkxpProfileStart) {
+    RB_UNUSED_PARAM;
+    
+#ifdef RUBY_SAMPLER
+    int interval = 1;
+    bool perFrame = false;
+    
+    rb_get_args(argc, argv, "|ib", &interval, &perFrame RB_ARG_END);
+    
+    if (sampler.thread)
+        raiseRbExc(Exception(Exception::MKXPError, "The profiler is already running"));
+    
+#ifdef RUBY_SAMPLER_TRIGGER
+    if (!sampler.jobRegistered) {
+        sampler.job = rb_postponed_job_preregister(0, samplerTakeSample, 0);
+        sampler.jobRegistered = true;
+    }
+#else
+    /* Left installed, it ignores signals while stopped */
+    if (!sampler.handlerInstalled) {
+        struct sigaction sa = {};
+        sa.sa_handler = samplerSignal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, 0);
+        
+        sampler.handlerInstalled = true;
+    }
+    
+    sampler.rubyThread = pthread_self();
+#endif
+    
+    sampler.interval = std::max(interval, 1);
+    sampler.perFrame = perFrame;
+    sampler.stacks.clear();
+    sampler.running.set();
+    sampler.thread = SDL_CreateThread(samplerThread, "rubysampler", 0);
+    
+    if (!sampler.thread) {
+        sampler.running.clear();
+        raiseRbExc(Exception(Exception::SDLError, "Failed to start the profiler: %s", SDL_GetError()));
+    }
+    
+    return Qnil;
+#else
+    raiseRbExc(Exception(Exception::MKXPError, "The profiler is not supported with this Ruby version"));
+    return Qnil;
+#endif
+}
+
+RB_METHOD(mkxpProfileStop) {
+    RB_UNUSED_PARAM;
+    
+#ifdef RUBY_SAMPLER
+    VALUE path = Qnil;
+    rb_scan_args(argc, argv, "01", &path);
+    
+    if (!sampler.thread)
+        return Qnil;
+    
+    samplerStop();
+    
+    /* One "stack count" line per stack, as read by flamegraph.pl,
+     * speedscope and the like */
+    std::string out;
+    
+    for (const auto &entry : sampler.stacks)
+        out += entry.first + " " + std::to_string(entry.second) + "\n";
+    
+    sampler.stacks.clear();
+    
+    if (!NIL_P(path)) {
+        SafeStringValue(path);
+        
+        if (!filesystemImpl::writeFileAtomic(RSTRING_PTR(path), out.data(), out.size()))
+            raiseRbExc(Exception(Exception::MKXPError, "Failed to write profile to %s", RSTRING_PTR(path)));
+    }
+    
+    return rb_str_new(out.data(), out.size());
+#else
+    return Qnil;
+#endif
+}
+
+static VALUE traceZoneYield(VALUE) {
+    return rb_yield(Qnil);
+}
+
+/* Runs the block inside a Tracy zone named 'name'. Without
+ * the 'tracy' build option, only runs the block */
+RB_METHOD(mkxpTraceZone) {
+    RB_UNUSED_PARAM;
+    
+    VALUE name;
+    rb_scan_args(argc, argv, "1", &name);
+    SafeStringValue(name);
+    
+    rb_need_block();
+    
+    int state = 0;
+    VALUE ret;
+    
+    {
+        /* Closed before any exception is passed on */
+        TRACE_ZONE_DYN(StringValueCStr(name));
+        ret = rb_protect(traceZoneYield, Qnil, &state);
+    }
+    
+    if (state)
+        rb_jump_tag(state);
+    
+    return ret;
+}
+
 json5pp::value loadUserSettings() {
     json5pp::value ret;
     VALUE cpath = rb_utf8_str_new_cstr(shState->config().userConfPath.c_str());
@@ -854,7 +1323,197 @@ static VALUE evalString(VALUE string, VALUE filename, int *state) {
     return rb_protect((VALUE(*)(VALUE))evalHelper, (VALUE)&arg, state);
 }
 
-static void runCustomScript(const std::string &filename) {
+#if RAPI_FULL >= 230
+#define ISEQ_CACHE_MAGIC "mkxpISQ1"
+
+/* Compiled scripts, kept in the user data directory so later
+ * boots can skip parsing. Entries are keyed by a hash of the
+ * Ruby build, the script's filename and its source; entries
+ * not used during a run are dropped when the cache is saved */
+struct ScriptCache {
+    std::string file;
+    
+    /* As loaded from disk */
+    BoostHash<uint64_t, std::string> stored;
+    /* Used during this run, to be saved */
+    BoostHash<uint64_t, std::string> used;
+    
+    bool dirty;
+    
+    ScriptCache() : dirty(false) {}
+    
+    static uint64_t keyFor(VALUE source, VALUE filename) {
+        uint64_t h = 14695981039346656037ULL;
+        
+        auto feed = [&](const char *data, size_t len) {
+            for (size_t i = 0; i < len; ++i) {
+                h ^= (uint8_t) data[i];
+                h *= 1099511628211ULL;
+            }
+            
+            /* Separator, so "ab"+"c" differs from "a"+"bc" */
+            h ^= 0xFF;
+            h *= 1099511628211ULL;
+        };
+        
+        feed(ruby_description, strlen(ruby_description));
+        feed(RSTRING_PTR(filename), RSTRING_LEN(filename));
+        feed(RSTRING_PTR(source), RSTRING_LEN(source));
+        
+        return h;
+    }
+    
+    void load(const std::string &dir) {
+        file = dir + "/scriptcache.bin";
+        
+        SDL_RWops *ops = SDL_RWFromFile(file.c_str(), "rb");
+        
+        if (!ops)
+            return;
+        
+        char magic[sizeof(ISEQ_CACHE_MAGIC) - 1];
+        
+        if (SDL_RWread(ops, magic, sizeof(magic), 1) != 1 ||
+            memcmp(magic, ISEQ_CACHE_MAGIC, sizeof(magic))) {
+            SDL_RWclose(ops);
+            return;
+        }
+        
+        uint32_t count = SDL_ReadLE32(ops);
+        
+        for (uint32_t i = 0; i < count; ++i) {
+            uint64_t key = SDL_ReadLE64(ops);
+            uint32_t size = SDL_ReadLE32(ops);
+            
+            std::string data(size, '\0');
+            
+            if (size == 0 || SDL_RWread(ops, &data[0], size, 1) != 1)
+                break;
+            
+            stored.insert(key, data);
+        }
+        
+        SDL_RWclose(ops);
+    }
+    
+    void save() {
+        /* Also rewrite if stale entries were left out */
+        if (file.empty() || (!dirty && used.size() == stored.size()))
+            return;
+        
+        SDL_RWops *ops = SDL_RWFromFile(file.c_str(), "wb");
+        
+        if (!ops)
+            return;
+        
+        SDL_RWwrite(ops, ISEQ_CACHE_MAGIC, sizeof(ISEQ_CACHE_MAGIC) - 1, 1);
+        SDL_WriteLE32(ops, used.size());
+        
+        for (BoostHash<uint64_t, std::string>::const_iterator iter = used.cbegin();
+             iter != used.cend(); ++iter) {
+            SDL_WriteLE64(ops, iter->first);
+            SDL_WriteLE32(ops, iter->second.size());
+            SDL_RWwrite(ops, iter->second.data(), 1, iter->second.size());
+        }
+        
+        SDL_RWclose(ops);
+        
+        dirty = false;
+    }
+    
+    static VALUE iseqClass() {
+        return rb_const_get(rb_const_get(rb_cObject, rb_intern("RubyVM")),
+                            rb_intern("InstructionSequence"));
+    }
+    
+    static VALUE loadHelper(VALUE binary) {
+        return rb_funcall(iseqClass(), rb_intern("load_from_binary"), 1, binary);
+    }
+    
+    static VALUE compileHelper(VALUE args) {
+        VALUE *a = reinterpret_cast<VALUE*>(args);
+        
+        return rb_funcall(iseqClass(), rb_intern("compile"), 4,
+                          a[0], a[1], a[1], INT2FIX(1));
+    }
+    
+    static VALUE toBinaryHelper(VALUE iseq) {
+        return rb_funcall(iseq, rb_intern("to_binary"), 0);
+    }
+    
+    /* Returns the compiled script, or nil if it doesn't compile.
+     * The error is dropped then, evaluating the source raises
+     * it again where it is expected */
+    VALUE compile(VALUE source, VALUE filename) {
+        const uint64_t key = keyFor(source, filename);
+        int state;
+        
+        if (stored.contains(key)) {
+            std::string data = stored.value(key);
+            VALUE binary = rb_str_new(data.data(), data.size());
+            VALUE iseq = rb_protect(loadHelper, binary, &state);
+            
+            if (!state) {
+                used.insert(key, data);
+                return iseq;
+            }
+            
+            rb_set_errinfo(Qnil);
+        }
+        
+        VALUE args[] = { source, filename };
+        VALUE iseq = rb_protect(compileHelper, (VALUE) args, &state);
+        
+        if (state) {
+            rb_set_errinfo(Qnil);
+            return Qnil;
+        }
+        
+        VALUE binary = rb_protect(toBinaryHelper, iseq, &state);
+        
+        if (state) {
+            rb_set_errinfo(Qnil);
+            return iseq;
+        }
+        
+        used.insert(key, std::string(RSTRING_PTR(binary), RSTRING_LEN(binary)));
+        dirty = true;
+        
+        return iseq;
+    }
+};
+
+static ScriptCache *scriptCache;
+
+static VALUE iseqEvalHelper(VALUE iseq) {
+    return rb_funcall(iseq, rb_intern("eval"), 0);
+}
+
+/* Same as evalString, going through the script cache if enabled.
+ * With 'save', the cache is written out before the script runs */
+static VALUE evalCached(VALUE string, VALUE filename, int *state, bool save = false) {
+    VALUE iseq = Qnil;
+    
+    if (scriptCache) {
+        iseq = scriptCache->compile(string, filename);
+        
+        if (save)
+            scriptCache->save();
+    }
+    
+    if (NIL_P(iseq))
+        return evalString(string, filename, state);
+    
+    return rb_protect(iseqEvalHelper, iseq, state);
+}
+#else
+static VALUE evalCached(VALUE string, VALUE filename, int *state, bool = false) {
+    return evalString(string, filename, state);
+}
+#endif
+
+/* 'main' is set for a script that runs the whole game */
+static void runCustomScript(const std::string &filename, bool main = false) {
     std::string scriptData;
     
     if (!readFileSDL(filename.c_str(), scriptData)) {
@@ -862,8 +1521,8 @@ static void runCustomScript(const std::string &filename) {
         return;
     }
     
-    evalString(newStringUTF8(scriptData.c_str(), scriptData.size()),
-               newStringUTF8(filename.c_str(), filename.size()), NULL);
+    evalCached(newStringUTF8(scriptData.c_str(), scriptData.size()),
+               newStringUTF8(filename.c_str(), filename.size()), NULL, main);
 }
 
 VALUE kernelLoadDataInt(const char *filename, bool rubyExc, bool raw);
@@ -884,6 +1543,24 @@ bool evalScript(VALUE string, const char *filename)
 
 #define SCRIPT_SECTION_FMT (rgssVer >= 3 ? "{%04ld}" : "Section%03ld")
 
+/* Ruby visible filename of script 'i' */
+static VALUE scriptFilename(VALUE script, long i, BacktraceData &btData) {
+    const Config &conf = shState->rtData().config;
+    
+    const char *scriptName = RSTRING_PTR(rb_ary_entry(script, 1));
+    char buf[512];
+    int len;
+    
+    if (conf.useScriptNames)
+        len = snprintf(buf, sizeof(buf), "%03ld:%s", i, scriptName);
+    else
+        len = snprintf(buf, sizeof(buf), SCRIPT_SECTION_FMT, i);
+    
+    btData.scriptNames.insert(buf, scriptName);
+    
+    return newStringUTF8(buf, len);
+}
+
 static void runRMXPScripts(BacktraceData &btData) {
     const Config &conf = shState->rtData().config;
     const std::string &scriptPack = conf.game.scripts;
@@ -914,6 +1591,8 @@ static void runRMXPScripts(BacktraceData &btData) {
         return;
     }
     
+    StartupTimer::mark("script data load");
+    
     rb_gv_set("$RGSS_SCRIPTS", scriptArray);
     
     long scriptCount = RARRAY_LEN(scriptArray);
@@ -965,34 +1644,60 @@ static void runRMXPScripts(BacktraceData &btData) {
         rb_ary_store(script, 3, rb_utf8_str_new_cstr(decodeBuffer.c_str()));
     }
     
+    StartupTimer::mark("script inflate");
+    
     /* Execute preloaded scripts */
     for (std::vector<std::string>::const_iterator i = conf.preloadScripts.begin();
          i != conf.preloadScripts.end(); ++i)
         runCustomScript(*i);
     
+    if (!conf.preloadScripts.empty())
+        StartupTimer::mark("preload scripts");
+    
     VALUE exc = rb_gv_get("$!");
     if (exc != Qnil)
         return;
     
-    while (true) {
+    /* Compiled scripts, nil for those that must be evaluated
+     * from source. Compiled after the preload scripts ran, as
+     * those may patch the sources */
+    VALUE iseqs = rb_ary_new();
+    
+#if RAPI_FULL >= 230
+    if (scriptCache) {
         for (long i = 0; i < scriptCount; ++i) {
             VALUE script = rb_ary_entry(scriptArray, i);
             VALUE scriptDecoded = rb_ary_entry(script, 3);
+            
+            if (!RB_TYPE_P(scriptDecoded, RUBY_T_STRING))
+                break;
+            
             VALUE string =
             newStringUTF8(RSTRING_PTR(scriptDecoded), RSTRING_LEN(scriptDecoded));
+            VALUE iseq = scriptCache->compile(string, scriptFilename(script, i, btData));
             
-            VALUE fname;
-            const char *scriptName = RSTRING_PTR(rb_ary_entry(script, 1));
-            char buf[512];
-            int len;
+            /* Scripts past a syntax error never run */
+            if (NIL_P(iseq))
+                break;
             
-            if (conf.useScriptNames)
-                len = snprintf(buf, sizeof(buf), "%03ld:%s", i, scriptName);
-            else
-                len = snprintf(buf, sizeof(buf), SCRIPT_SECTION_FMT, i);
+            rb_ary_store(iseqs, i, iseq);
+        }
+        
+        scriptCache->save();
+        StartupTimer::mark("script compile");
+    }
+#endif
+    
+    StartupTimer::report(conf.printStartupTimes);
+    
+    while (true) {
+        for (long i = 0; i < scriptCount; ++i) {
+            VALUE script = rb_ary_entry(scriptArray, i);
+            VALUE scriptDecoded = rb_ary_entry(script, 3);
+            VALUE string =
+            newStringUTF8(RSTRING_PTR(scriptDecoded), RSTRING_LEN(scriptDecoded));
             
-            fname = newStringUTF8(buf, len);
-            btData.scriptNames.insert(buf, scriptName);
+            VALUE fname = scriptFilename(script, i, btData);
             
             
             // if the script name starts with |s|, only execute
@@ -1021,7 +1726,15 @@ static void runRMXPScripts(BacktraceData &btData) {
             
             int state;
             
-            evalString(string, fname, &state);
+#if RAPI_FULL >= 230
+            VALUE iseq = rb_ary_entry(iseqs, i);
+            
+            if (!NIL_P(iseq))
+                rb_protect(iseqEvalHelper, iseq, &state);
+            else
+#endif
+                evalString(string, fname, &state);
+            
             if (state)
                 break;
         }
@@ -1032,6 +1745,8 @@ static void runRMXPScripts(BacktraceData &btData) {
         
         processReset();
     }
+    
+    RB_GC_GUARD(iseqs);
 }
 
 static void showExc(VALUE exc, const BacktraceData &btData) {
@@ -1102,10 +1817,45 @@ static void showExc(VALUE exc, const BacktraceData &btData) {
     showMsg(ms);
 }
 
+#if RAPI_MAJOR >= 2
+/* Hands the GC options to Ruby, which reads them from the
+ * environment while processing its options. Variables the
+ * user set explicitly are left alone */
+static void setGCParams(const Config &conf) {
+    char buf[32];
+    
+#define SET_GC_ENV(name, fmt, value) \
+    if ((value) > 0) { \
+        snprintf(buf, sizeof(buf), fmt, value); \
+        SDL_setenv("RUBY_GC_" name, buf, 0); \
+    }
+    
+    const long long mb = 1024 * 1024;
+    
+    SET_GC_ENV("HEAP_INIT_SLOTS", "%d", conf.gc.heapInitSlots);
+    SET_GC_ENV("HEAP_FREE_SLOTS", "%d", conf.gc.heapFreeSlots);
+    SET_GC_ENV("HEAP_GROWTH_FACTOR", "%f", conf.gc.heapGrowthFactor);
+    SET_GC_ENV("HEAP_GROWTH_MAX_SLOTS", "%d", conf.gc.heapGrowthMaxSlots);
+    SET_GC_ENV("MALLOC_LIMIT", "%lld", conf.gc.mallocLimit * mb);
+    SET_GC_ENV("OLDMALLOC_LIMIT", "%lld", conf.gc.oldMallocLimit * mb);
+    
+    /* Ruby caps the limits at 32 and 128 MB by default */
+    if (conf.gc.mallocLimit > 32)
+        SET_GC_ENV("MALLOC_LIMIT_MAX", "%lld", conf.gc.mallocLimit * mb);
+    
+    if (conf.gc.oldMallocLimit > 128)
+        SET_GC_ENV("OLDMALLOC_LIMIT_MAX", "%lld", conf.gc.oldMallocLimit * mb);
+    
+#undef SET_GC_ENV
+}
+#endif
+
 static void mriBindingExecute() {
     Config &conf = shState->rtData().config;
     
 #if RAPI_MAJOR >= 2
+    setGCParams(conf);
+    
     /* Normally only a ruby executable would do a sysinit,
      * but not doing it will lead to crashes due to closed
      * stdio streams on some platforms (eg. Windows) */
@@ -1141,8 +1891,23 @@ static void mriBindingExecute() {
         rubyArgsC.push_back(minCalls.c_str());
         node = ruby_options(rubyArgsC.size(), const_cast<char**>(rubyArgsC.data()));
     } else if (conf.yjit.enabled) {
+        std::string execMemSize("--yjit-exec-mem-size=");
+        std::string callThreshold("--yjit-call-threshold=");
         rubyArgsC.push_back("--yjit");
-        // TODO: Maybe support --yjit-exec-mem-size, --yjit-call-threshold
+        
+        if (conf.yjit.execMemSize > 0) {
+            execMemSize += std::to_string(conf.yjit.execMemSize);
+            rubyArgsC.push_back(execMemSize.c_str());
+        }
+        
+        if (conf.yjit.callThreshold > 0) {
+            callThreshold += std::to_string(conf.yjit.callThreshold);
+            rubyArgsC.push_back(callThreshold.c_str());
+        }
+        
+        if (conf.yjit.stats)
+            rubyArgsC.push_back("--yjit-stats");
+        
         node = ruby_options(rubyArgsC.size(), const_cast<char**>(rubyArgsC.data()));
     } else {
         node = ruby_options(rubyArgsC.size(), const_cast<char**>(rubyArgsC.data()));
@@ -1170,6 +1935,7 @@ static void mriBindingExecute() {
     }
     rb_enc_set_default_internal(rb_enc_from_encoding(rb_utf8_encoding()));
     rb_enc_set_default_external(rb_enc_from_encoding(rb_utf8_encoding()));
+    StartupTimer::mark("Ruby VM");
 #else
     ruby_init();
     rb_eval_string("$KCODE='U'");
@@ -1219,13 +1985,36 @@ static void mriBindingExecute() {
     BacktraceData btData;
     
     mriBindingInit();
+    StartupTimer::mark("binding init");
+    
+    /* Recorded input only plays back the same if the
+     * game rolls the same random numbers */
+    unsigned int seed;
+    if (shState->input().replaySeed(seed))
+        rb_funcall(rb_mKernel, rb_intern("srand"), 1, UINT2NUM(seed));
+    
+#if RAPI_FULL >= 230
+    ScriptCache iseqCache;
+    
+    if (conf.scriptCache && !conf.customDataPath.empty()) {
+        iseqCache.load(conf.customDataPath);
+        scriptCache = &iseqCache;
+        StartupTimer::mark("script cache load");
+    }
+#endif
     
     std::string &customScript = conf.customScript;
-    if (!customScript.empty())
-        runCustomScript(customScript);
+    if (!customScript.empty()) {
+        StartupTimer::report(conf.printStartupTimes);
+        runCustomScript(customScript, true);
+    }
     else
         runRMXPScripts(btData);
     
+#if RAPI_FULL >= 230
+    scriptCache = 0;
+#endif
+    
 #if RAPI_FULL > 187
     VALUE exc = rb_errinfo();
 #else
@@ -1234,6 +2023,13 @@ static void mriBindingExecute() {
     if (!NIL_P(exc) && !rb_obj_is_kind_of(exc, rb_eSystemExit))
         showExc(exc, btData);
     
+    /* Before the interpreter frees what's left */
+    Bitmap::dumpTrackReport();
+    
+#ifdef RUBY_SAMPLER
+    samplerStop();
+#endif
+    
     ruby_cleanup(0);
     
     shState->rtData().rqTermAck.set();
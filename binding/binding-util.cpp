@@ -136,6 +136,7 @@ int rb_get_args(int argc, VALUE *argv, const char *format, ...) {
         rb_raise(rb_eTypeError, "Argument %d: Expected string", argI);
 
       *str = tmp;
+      ++arg;
       ++argI;
 
       break;
@@ -155,6 +156,7 @@ int rb_get_args(int argc, VALUE *argv, const char *format, ...) {
 
       *s = RSTRING_PTR(tmp);
       *len = RSTRING_LEN(tmp);
+      ++arg;
       ++argI;
 
       break;
@@ -275,6 +277,10 @@ int rb_get_args(int argc, VALUE *argv, const char *format, ...) {
     case 'b':
       va_arg(ap, bool *);
       break;
+
+    case 'n':
+      va_arg(ap, ID *);
+      break;
     }
   }
 
@@ -30,6 +30,7 @@
 #endif
 
 #include "exception.h"
+#include "bindingslots.h"
 
 #ifdef RUBY_API_VERSION_MAJOR
 #define RAPI_MAJOR RUBY_API_VERSION_MAJOR
@@ -42,6 +43,10 @@
 #endif
 #define RAPI_FULL ((RAPI_MAJOR * 100) + (RAPI_MINOR * 10) + RAPI_TEENY)
 
+#if RAPI_MAJOR >= 2
+#include <ruby/thread.h>
+#endif
+
 enum RbException {
     RGSS = 0,
     Reset,
@@ -89,14 +94,17 @@ void raiseRbExc(const Exception &exc);
 
 #if RAPI_MAJOR > 1 || RAPI_MINOR <= 9
 #if RAPI_FULL < 270
-#define DEF_TYPE_CUSTOMNAME_AND_FREE(Klass, Name, Free)                        \
+#define DEF_TYPE_CUSTOMNAME_MARK_AND_FREE(Klass, Name, Mark, Free)             \
 rb_data_type_t Klass##Type = {                                               \
-Name, {0, Free, 0, {0, 0}}, 0, 0, DEF_TYPE_FLAGS}
+Name, {Mark, Free, 0, {0, 0}}, 0, 0, DEF_TYPE_FLAGS}
 #else
-#define DEF_TYPE_CUSTOMNAME_AND_FREE(Klass, Name, Free)                        \
-rb_data_type_t Klass##Type = {Name, {0, Free, 0, 0, 0}, 0, 0, DEF_TYPE_FLAGS}
+#define DEF_TYPE_CUSTOMNAME_MARK_AND_FREE(Klass, Name, Mark, Free)             \
+rb_data_type_t Klass##Type = {Name, {Mark, Free, 0, 0, 0}, 0, 0, DEF_TYPE_FLAGS}
 #endif
 
+#define DEF_TYPE_CUSTOMNAME_AND_FREE(Klass, Name, Free)                        \
+DEF_TYPE_CUSTOMNAME_MARK_AND_FREE(Klass, Name, 0, Free)
+
 #define DEF_TYPE_CUSTOMFREE(Klass, Free)                                       \
 DEF_TYPE_CUSTOMNAME_AND_FREE(Klass, #Klass, Free)
 
@@ -104,6 +112,13 @@ DEF_TYPE_CUSTOMNAME_AND_FREE(Klass, #Klass, Free)
 DEF_TYPE_CUSTOMNAME_AND_FREE(Klass, Name, freeInstance<Klass>)
 
 #define DEF_TYPE(Klass) DEF_TYPE_CUSTOMNAME(Klass, #Klass)
+
+/* For classes that keep property objects in their BindingSlots */
+#define DEF_TYPE_CUSTOMNAME_SLOTTED(Klass, Name)                               \
+DEF_TYPE_CUSTOMNAME_MARK_AND_FREE(Klass, Name, markInstanceSlots<Klass>,      \
+                                  freeInstance<Klass>)
+
+#define DEF_TYPE_SLOTTED(Klass) DEF_TYPE_CUSTOMNAME_SLOTTED(Klass, #Klass)
 #endif
 
 // Ruby 1.8 helper stuff
@@ -168,6 +183,12 @@ return Data_Wrap_Struct(klass, 0, free, 0);                                \
 
 #define DEF_ALLOCFUNC(type) DEF_ALLOCFUNC_CUSTOMFREE(type, freeInstance<type>)
 
+#define DEF_ALLOCFUNC_SLOTTED(type)                                            \
+static VALUE type##Allocate(VALUE klass) {                                   \
+return Data_Wrap_Struct(klass, markInstanceSlots<type>,                      \
+                        freeInstance<type>, 0);                              \
+}
+
 #define PRIsVALUE "s"
 
 #endif
@@ -194,6 +215,24 @@ template <class C> static void freeInstance(void *inst) {
     delete static_cast<C *>(inst);
 }
 
+template <class C> static void markInstanceSlots(void *inst) {
+    const BindingSlots &slots = static_cast<C *>(inst)->bindingSlots;
+    
+    for (int i = 0; i < BindingSlots::Count; ++i)
+        rb_gc_mark((VALUE)slots.slot[i]);
+}
+
+/* Property objects kept in BindingSlots. Empty slots read as nil */
+template <class C> inline VALUE getPropSlot(C *obj, int slot) {
+    VALUE value = (VALUE)obj->bindingSlots.slot[slot];
+    
+    return value ? value : Qnil;
+}
+
+template <class C> inline void setPropSlot(C *obj, int slot, VALUE value) {
+    obj->bindingSlots.slot[slot] = (uintptr_t)value;
+}
+
 void raiseDisposedAccess(VALUE self);
 
 template <class C> inline C *getPrivateData(VALUE self) {
@@ -278,6 +317,21 @@ inline VALUE wrapProperty(VALUE self, void *prop, const char *iv,
     return propObj;
 }
 
+template <class C>
+inline VALUE wrapProperty(C *owner, void *prop, int slot,
+#if RAPI_FULL > 187
+                          const rb_data_type_t &type,
+#else
+                          const char *type,
+#endif
+                          VALUE underKlass = rb_cObject) {
+    VALUE propObj = wrapObject(prop, type, underKlass);
+    
+    setPropSlot(owner, slot, propObj);
+    
+    return propObj;
+}
+
 /* Implemented: oSszfibn| */
 int rb_get_args(int argc, VALUE *argv, const char *format, ...);
 
@@ -327,14 +381,64 @@ raiseRbExc(exc);                                                         \
 GFX_UNLOCK;\
 }
 
+/* As above, for calls that leave GL alone (see GFX_STATE_LOCK) */
+#define GFX_STATE_GUARD_EXC(exp)                                                   \
+{\
+GFX_STATE_LOCK; \
+try {\
+exp                                                                      \
+} catch (const Exception &exc) {\
+GFX_STATE_UNLOCK; \
+raiseRbExc(exc);                                                         \
+}\
+GFX_STATE_UNLOCK;\
+}
 
-template <class C>
-static inline VALUE objectLoad(int argc, VALUE *argv, VALUE self) {
-    const char *data;
-    int dataLen;
-    rb_get_args(argc, argv, "s", &data, &dataLen RB_ARG_END);
+template<typename F>
+struct NoGVLCall {
+    F *func;
+    bool failed;
+    Exception exc;
     
-    VALUE obj = rb_obj_alloc(self);
+    NoGVLCall(F &func)
+    : func(&func), failed(false), exc(Exception::MKXPError, "") {}
+    
+    static void *run(void *arg) {
+        NoGVLCall *call = static_cast<NoGVLCall*>(arg);
+        
+        try {
+            (*call->func)();
+        } catch (const Exception &e) {
+            call->failed = true;
+            call->exc = e;
+        }
+        
+        return 0;
+    }
+};
+
+/* Runs 'func' with the GVL released, so other Ruby threads keep
+ * running through long CPU or IO bound work. 'func' must neither
+ * touch Ruby objects nor GL; exceptions thrown by it are rethrown
+ * once the GVL is held again */
+template<typename F>
+static inline void callWithoutGVL(F func) {
+#if RAPI_MAJOR >= 2
+    NoGVLCall<F> call(func);
+    
+    rb_thread_call_without_gvl(NoGVLCall<F>::run, &call, 0, 0);
+    
+    if (call.failed)
+        throw call.exc;
+#else
+    func();
+#endif
+}
+
+
+template <class C>
+static inline VALUE objectLoadData(VALUE klass, const char *data, int dataLen) {
+    VALUE obj = rb_obj_alloc(klass);
     
     C *c = 0;
     
@@ -345,9 +449,30 @@ static inline VALUE objectLoad(int argc, VALUE *argv, VALUE self) {
     return obj;
 }
 
+template <class C>
+static inline VALUE objectLoad(int argc, VALUE *argv, VALUE self) {
+    const char *data;
+    int dataLen;
+    rb_get_args(argc, argv, "s", &data, &dataLen RB_ARG_END);
+    
+    return objectLoadData<C>(self, data, dataLen);
+}
+
 static inline VALUE rb_bool_new(bool value) { return value ? Qtrue : Qfalse; }
 
 inline void rb_float_arg(VALUE arg, double *out, int argPos = 0) {
+#if RAPI_MAJOR >= 2
+    /* Immediate floats and fixnums skip the type dispatch */
+    if (FLONUM_P(arg)) {
+        *out = RFLOAT_VALUE(arg);
+        return;
+    }
+#endif
+    if (FIXNUM_P(arg)) {
+        *out = FIX2LONG(arg);
+        return;
+    }
+    
     switch (rb_type(arg)) {
         case RUBY_T_FLOAT:
             *out = RFLOAT_VALUE(arg);
@@ -363,6 +488,11 @@ inline void rb_float_arg(VALUE arg, double *out, int argPos = 0) {
 }
 
 inline void rb_int_arg(VALUE arg, int *out, int argPos = 0) {
+    if (FIXNUM_P(arg)) {
+        *out = FIX2INT(arg);
+        return;
+    }
+    
     switch (rb_type(arg)) {
         case RUBY_T_FLOAT:
             // FIXME check int range?
@@ -422,6 +552,54 @@ static inline VALUE rb_file_open_str(VALUE filename, const char *mode) {
 #endif
 #endif
 
+inline void rb_unpack_arg(VALUE arg, VALUE *out, int) { *out = arg; }
+
+inline void rb_unpack_arg(VALUE arg, int *out, int argPos) {
+    rb_int_arg(arg, out, argPos);
+}
+
+inline void rb_unpack_arg(VALUE arg, double *out, int argPos) {
+    rb_float_arg(arg, out, argPos);
+}
+
+inline void rb_unpack_arg(VALUE arg, bool *out, int argPos) {
+    rb_bool_arg(arg, out, argPos);
+}
+
+inline void rb_unpack_arg(VALUE arg, const char **out, int argPos) {
+    if (!RB_TYPE_P(arg, RUBY_T_STRING))
+        rb_raise(rb_eTypeError, "Argument %d: Expected string", argPos);
+    
+    *out = RSTRING_PTR(arg);
+}
+
+inline void rb_unpack_argv(VALUE *, int, int) {}
+
+template <typename T, typename... Rest>
+inline void rb_unpack_argv(VALUE *argv, int argc, int i, T *out,
+                           Rest *...rest) {
+    if (i >= argc)
+        return;
+    
+    rb_unpack_arg(argv[i], out, i);
+    rb_unpack_argv(argv, argc, i + 1, rest...);
+}
+
+/* Like rb_get_args, but without a format string to parse on every
+ * call: the expected types follow from the output pointers, ie.
+ * VALUE ('o'), int ('i'), double ('f'), bool ('b') and
+ * const char* ('z'). The first 'Required' arguments are mandatory,
+ * the remaining outputs optional. Returns the number of arguments */
+template <int Required, typename... T>
+inline int rb_unpack_args(int argc, VALUE *argv, T *...out) {
+    if (argc < Required || argc > (int)sizeof...(T))
+        rb_error_arity(argc, Required, sizeof...(T));
+    
+    rb_unpack_argv(argv, argc, 0, out...);
+    
+    return argc;
+}
+
 #define RB_METHOD(name) static VALUE name(int argc, VALUE *argv, VALUE self)
 
 #define RB_UNUSED_PARAM                                                        \
@@ -456,10 +634,10 @@ return self;                                                               \
 // Do not wait for Graphics.update
 // --------------
 #if RAPI_FULL > 187
-#define DEF_PROP_OBJ_REF(Klass, PropKlass, PropName, prop_iv)                  \
+#define DEF_PROP_OBJ_REF(Klass, PropKlass, PropName, prop_slot)                \
 RB_METHOD(Klass##Get##PropName) {                                            \
 RB_UNUSED_PARAM;                                                           \
-return rb_iv_get(self, prop_iv);                                           \
+return getPropSlot(getPrivateData<Klass>(self), prop_slot);                \
 }                                                                            \
 RB_METHOD(Klass##Set##PropName) {                                            \
 RB_UNUSED_PARAM;                                                           \
@@ -472,14 +650,14 @@ prop = 0;                                                                \
 else                                                                       \
 prop = getPrivateDataCheck<PropKlass>(propObj, PropKlass##Type);         \
 GUARD_EXC(k->set##PropName(prop);)                                         \
-rb_iv_set(self, prop_iv, propObj);                                         \
+setPropSlot(k, prop_slot, propObj);                                        \
 return propObj;                                                            \
 }
 #else
-#define DEF_PROP_OBJ_REF(Klass, PropKlass, PropName, prop_iv)                  \
+#define DEF_PROP_OBJ_REF(Klass, PropKlass, PropName, prop_slot)                \
 RB_METHOD(Klass##Get##PropName) {                                            \
 RB_UNUSED_PARAM;                                                           \
-return rb_iv_get(self, prop_iv);                                           \
+return getPropSlot(getPrivateData<Klass>(self), prop_slot);                \
 }                                                                            \
 RB_METHOD(Klass##Set##PropName) {                                            \
 RB_UNUSED_PARAM;                                                           \
@@ -492,18 +670,18 @@ prop = 0;                                                                \
 else                                                                       \
 prop = getPrivateDataCheck<PropKlass>(propObj, #PropKlass);              \
 GUARD_EXC(k->set##PropName(prop);)                                         \
-rb_iv_set(self, prop_iv, propObj);                                         \
+setPropSlot(k, prop_slot, propObj);                                        \
 return propObj;                                                            \
 }
 #endif
 
 /* Object property which is copied by value, not reference */
 #if RAPI_FULL > 187
-#define DEF_PROP_OBJ_VAL(Klass, PropKlass, PropName, prop_iv)                  \
+#define DEF_PROP_OBJ_VAL(Klass, PropKlass, PropName, prop_slot)                \
 RB_METHOD(Klass##Get##PropName) {                                            \
 RB_UNUSED_PARAM;                                                           \
 checkDisposed<Klass>(self);                                                \
-return rb_iv_get(self, prop_iv);                                           \
+return getPropSlot(getPrivateData<Klass>(self), prop_slot);                \
 }                                                                            \
 RB_METHOD(Klass##Set##PropName) {                                            \
 rb_check_argc(argc, 1);                                                    \
@@ -515,11 +693,11 @@ GUARD_EXC(k->set##PropName(*prop);)                                        \
 return propObj;                                                            \
 }
 #else
-#define DEF_PROP_OBJ_VAL(Klass, PropKlass, PropName, prop_iv)                  \
+#define DEF_PROP_OBJ_VAL(Klass, PropKlass, PropName, prop_slot)                \
 RB_METHOD(Klass##Get##PropName) {                                            \
 RB_UNUSED_PARAM;                                                           \
 checkDisposed<Klass>(self);                                                \
-return rb_iv_get(self, prop_iv);                                           \
+return getPropSlot(getPrivateData<Klass>(self), prop_slot);                \
 }                                                                            \
 RB_METHOD(Klass##Set##PropName) {                                            \
 rb_check_argc(argc, 1);                                                    \
@@ -568,10 +746,10 @@ _rb_define_method(klass, prop_name_s "=", Klass##Set##PropName);           \
 // Wait for Graphics.update
 // --------------
 #if RAPI_FULL > 187
-#define DEF_GFX_PROP_OBJ_REF(Klass, PropKlass, PropName, prop_iv)                  \
+#define DEF_GFX_PROP_OBJ_REF(Klass, PropKlass, PropName, prop_slot)                \
 RB_METHOD(Klass##Get##PropName) {                                            \
 RB_UNUSED_PARAM;                                                           \
-return rb_iv_get(self, prop_iv);                                           \
+return getPropSlot(getPrivateData<Klass>(self), prop_slot);                \
 }                                                                            \
 RB_METHOD(Klass##Set##PropName) {                                            \
 RB_UNUSED_PARAM;                                                           \
@@ -584,21 +762,21 @@ prop = 0;                                                                \
 else                                                                       \
 prop = getPrivateDataCheck<PropKlass>(propObj, PropKlass##Type);         \
 GFX_GUARD_EXC(k->set##PropName(prop);)                                         \
-rb_iv_set(self, prop_iv, propObj);                                         \
+setPropSlot(k, prop_slot, propObj);                                        \
 return propObj;                                                            \
 }
 #else
-#define DEF_GFX_PROP_OBJ_REF(Klass, PropKlass, PropName, prop_iv)                  \
-DEF_PROP_OBJ_REF(Klass, PropKlass, PropName, prop_iv)
+#define DEF_GFX_PROP_OBJ_REF(Klass, PropKlass, PropName, prop_slot)                \
+DEF_PROP_OBJ_REF(Klass, PropKlass, PropName, prop_slot)
 #endif
 
 /* Object property which is copied by value, not reference */
 #if RAPI_FULL > 187
-#define DEF_GFX_PROP_OBJ_VAL(Klass, PropKlass, PropName, prop_iv)                  \
+#define DEF_GFX_PROP_OBJ_VAL(Klass, PropKlass, PropName, prop_slot)                \
 RB_METHOD(Klass##Get##PropName) {                                            \
 RB_UNUSED_PARAM;                                                           \
 checkDisposed<Klass>(self);                                                \
-return rb_iv_get(self, prop_iv);                                           \
+return getPropSlot(getPrivateData<Klass>(self), prop_slot);                \
 }                                                                            \
 RB_METHOD(Klass##Set##PropName) {                                            \
 rb_check_argc(argc, 1);                                                    \
@@ -610,10 +788,12 @@ GFX_GUARD_EXC(k->set##PropName(*prop);)                                        \
 return propObj;                                                            \
 }
 #else
-#define DEF_GFX_PROP_OBJ_VAL(Klass, PropKlass, PropName, prop_iv)                  \
-DEF_PROP_OBJ_VAL(Klass, PropKlass, PropName, prop_iv)
+#define DEF_GFX_PROP_OBJ_VAL(Klass, PropKlass, PropName, prop_slot)                \
+DEF_PROP_OBJ_VAL(Klass, PropKlass, PropName, prop_slot)
 #endif
 
+/* Plain value setters only change state, any GL work
+ * they cause is left to the next frame's prepare */
 #define DEF_GFX_PROP(Klass, type, PropName, arg_fun, value_fun)                    \
 RB_METHOD(Klass##Get##PropName) {                                            \
 RB_UNUSED_PARAM;                                                           \
@@ -627,7 +807,7 @@ rb_check_argc(argc, 1);                                                    \
 Klass *k = getPrivateData<Klass>(self);                                    \
 type value;                                                                \
 rb_##arg_fun##_arg(*argv, &value);                                         \
-GFX_GUARD_EXC(k->set##PropName(value);)                                        \
+GFX_STATE_GUARD_EXC(k->set##PropName(value);)                                  \
 return *argv;                                                              \
 }
 
@@ -22,18 +22,50 @@
 #include "binding-types.h"
 #include "binding-util.h"
 #include "bitmap.h"
+#include "bitmaploader.h"
 #include "disposable-binding.h"
 #include "exception.h"
+#include "filesystem.h"
 #include "font.h"
 #include "sharedstate.h"
 #include "graphics.h"
 
+#include <SDL_surface.h>
+#include <string>
+#include <algorithm>
+
+#if RAPI_MAJOR >= 2
+#include <ruby/thread.h>
+
+#if RAPI_FULL >= 320
+#include <ruby/io/buffer.h>
+#endif
+#endif
+
 #if RAPI_FULL > 187
-DEF_TYPE(Bitmap);
+DEF_TYPE_SLOTTED(Bitmap);
 #else
-DEF_ALLOCFUNC(Bitmap);
+DEF_ALLOCFUNC_SLOTTED(Bitmap);
 #endif
 
+enum { BitmapFont };
+
+static void bitmapFutureFree(void *job) {
+    if (job)
+        shState->bitmapLoader().discard(static_cast<BitmapLoadJob*>(job));
+}
+
+#if RAPI_FULL > 187
+DEF_TYPE_CUSTOMNAME_AND_FREE(BitmapFuture, "Future", bitmapFutureFree);
+#else
+DEF_ALLOCFUNC_CUSTOMFREE(BitmapFuture, bitmapFutureFree);
+#endif
+
+/* Futures created with a block, polled on every Graphics.update */
+static VALUE asyncCallbacks = Qnil;
+
+static VALUE futureKlass = Qnil;
+
 static const char *objAsStringPtr(VALUE obj) {
     VALUE str = rb_obj_as_string(obj);
     return RSTRING_PTR(str);
@@ -48,17 +80,55 @@ void bitmapInitProps(Bitmap *b, VALUE self) {
     Font *font = getPrivateData<Font>(fontObj);
     b->setInitFont(font);
     
-    rb_iv_set(self, "font", fontObj);
+    setPropSlot(b, BitmapFont, fontObj);
+    
+    if (Bitmap::trackingEnabled())
+    {
+        /* Only the innermost frames, deep traces get long */
+        VALUE trace = rb_funcall(rb_mKernel, rb_intern("caller"), 0);
+        long count = std::min<long>(RARRAY_LEN(trace), 16);
+        std::string origin;
+        
+        for (long i = 0; i < count; ++i)
+        {
+            VALUE line = rb_ary_entry(trace, i);
+            
+            if (i > 0)
+                origin += "\n";
+            
+            origin += "    ";
+            origin += StringValueCStr(line);
+        }
+        
+        b->setTrackOrigin(origin);
+    }
 }
 
 RB_METHOD(bitmapInitialize) {
     Bitmap *b = 0;
     
-    if (argc == 1) {
+    if (argc == 1 || (argc == 2 && RB_TYPE_P(argv[0], RUBY_T_STRING))) {
         char *filename;
-        rb_get_args(argc, argv, "z", &filename RB_ARG_END);
+        bool reduce = false;
+        rb_get_args(argc, argv, "z|b", &filename, &reduce RB_ARG_END);
+        
+        /* Without the hint, the setting decides */
+        Bitmap::Storage storage = Bitmap::StorageAuto;
+        
+        if (argc == 2)
+            storage = reduce ? Bitmap::StorageReduced : Bitmap::StorageFull;
+        
+        /* Decode with the GVL released, only the
+         * texture upload has to wait for the GL lock */
+        std::string path(filename);
+        SDL_Surface *surf = 0;
         
-        GFX_GUARD_EXC(b = new Bitmap(filename);)
+        GUARD_EXC(callWithoutGVL([&]() { surf = Bitmap::decodeFile(path.c_str()); }););
+        
+        if (surf)
+            GFX_GUARD_EXC(b = new Bitmap(surf, path.c_str(), storage);)
+        else
+            GFX_GUARD_EXC(b = new Bitmap(path.c_str(), storage);)
     } else {
         int width, height;
         rb_get_args(argc, argv, "ii", &width, &height RB_ARG_END);
@@ -118,8 +188,7 @@ RB_METHOD(bitmapBlt) {
     Bitmap *src;
     Rect *srcRect;
     
-    rb_get_args(argc, argv, "iioo|i", &x, &y, &srcObj, &srcRectObj,
-                &opacity RB_ARG_END);
+    rb_unpack_args<4>(argc, argv, &x, &y, &srcObj, &srcRectObj, &opacity);
     
     src = getPrivateDataCheck<Bitmap>(srcObj, BitmapType);
     srcRect = getPrivateDataCheck<Rect>(srcRectObj, RectType);
@@ -140,8 +209,8 @@ RB_METHOD(bitmapStretchBlt) {
     Bitmap *src;
     Rect *destRect, *srcRect;
     
-    rb_get_args(argc, argv, "ooo|i", &destRectObj, &srcObj, &srcRectObj,
-                &opacity RB_ARG_END);
+    rb_unpack_args<3>(argc, argv, &destRectObj, &srcObj, &srcRectObj,
+                      &opacity);
     
     src = getPrivateDataCheck<Bitmap>(srcObj, BitmapType);
     destRect = getPrivateDataCheck<Rect>(destRectObj, RectType);
@@ -163,7 +232,7 @@ RB_METHOD(bitmapFillRect) {
         VALUE rectObj;
         Rect *rect;
         
-        rb_get_args(argc, argv, "oo", &rectObj, &colorObj RB_ARG_END);
+        rb_unpack_args<2>(argc, argv, &rectObj, &colorObj);
         
         rect = getPrivateDataCheck<Rect>(rectObj, RectType);
         color = getPrivateDataCheck<Color>(colorObj, ColorType);
@@ -172,8 +241,7 @@ RB_METHOD(bitmapFillRect) {
     } else {
         int x, y, width, height;
         
-        rb_get_args(argc, argv, "iiiio", &x, &y, &width, &height,
-                    &colorObj RB_ARG_END);
+        rb_unpack_args<5>(argc, argv, &x, &y, &width, &height, &colorObj);
         
         color = getPrivateDataCheck<Color>(colorObj, ColorType);
         
@@ -198,7 +266,7 @@ RB_METHOD(bitmapGetPixel) {
     
     int x, y;
     
-    rb_get_args(argc, argv, "ii", &x, &y RB_ARG_END);
+    rb_unpack_args<2>(argc, argv, &x, &y);
     
     Color value;
     GUARD_EXC(value = b->getPixel(x, y););
@@ -208,6 +276,23 @@ RB_METHOD(bitmapGetPixel) {
     return wrapObject(color, ColorType);
 }
 
+/* get_pixel, writing into an existing Color instead of
+ * allocating a new one */
+RB_METHOD(bitmapGetPixelInto) {
+    Bitmap *b = getPrivateData<Bitmap>(self);
+    
+    VALUE colorObj;
+    int x, y;
+    
+    rb_get_args(argc, argv, "oii", &colorObj, &x, &y RB_ARG_END);
+    
+    Color *color = getPrivateDataCheck<Color>(colorObj, ColorType);
+    
+    GUARD_EXC(*color = b->getPixel(x, y););
+    
+    return colorObj;
+}
+
 RB_METHOD(bitmapSetPixel) {
     Bitmap *b = getPrivateData<Bitmap>(self);
     
@@ -216,7 +301,7 @@ RB_METHOD(bitmapSetPixel) {
     
     Color *color;
     
-    rb_get_args(argc, argv, "iio", &x, &y, &colorObj RB_ARG_END);
+    rb_unpack_args<3>(argc, argv, &x, &y, &colorObj);
     
     color = getPrivateDataCheck<Color>(colorObj, ColorType);
     
@@ -301,7 +386,51 @@ RB_METHOD(bitmapTextSize) {
     return wrapObject(rect, RectType);
 }
 
-DEF_GFX_PROP_OBJ_VAL(Bitmap, Font, Font, "font")
+/* draw_text_wrapped(rect, str, align = 0, line_height = 0);
+ * returns the number of lines drawn */
+RB_METHOD(bitmapDrawTextWrapped) {
+    Bitmap *b = getPrivateData<Bitmap>(self);
+    
+    VALUE rectObj, strObj;
+    int align = Bitmap::Left;
+    int lineHeight = 0;
+    
+    rb_get_args(argc, argv, "oo|ii", &rectObj, &strObj, &align, &lineHeight RB_ARG_END);
+    
+    Rect *rect = getPrivateDataCheck<Rect>(rectObj, RectType);
+    const char *str = objAsStringPtr(strObj);
+    
+    int drawn = 0;
+    GFX_GUARD_EXC(drawn = b->drawTextWrapped(rect->toIntRect(), str, align, lineHeight););
+    
+    return INT2NUM(drawn);
+}
+
+/* text_size, writing into an existing Rect instead of
+ * allocating a new one */
+RB_METHOD(bitmapTextSizeInto) {
+    Bitmap *b = getPrivateData<Bitmap>(self);
+    
+    VALUE rectObj;
+    const char *str;
+    
+    if (rgssVer >= 2) {
+        VALUE strObj;
+        rb_get_args(argc, argv, "oo", &rectObj, &strObj RB_ARG_END);
+        
+        str = objAsStringPtr(strObj);
+    } else {
+        rb_get_args(argc, argv, "oz", &rectObj, &str RB_ARG_END);
+    }
+    
+    Rect *rect = getPrivateDataCheck<Rect>(rectObj, RectType);
+    
+    GUARD_EXC(*rect = b->textSize(str););
+    
+    return rectObj;
+}
+
+DEF_GFX_PROP_OBJ_VAL(Bitmap, Font, Font, BitmapFont)
 
 RB_METHOD(bitmapGradientFillRect) {
     Bitmap *b = getPrivateData<Bitmap>(self);
@@ -367,8 +496,11 @@ RB_METHOD(bitmapBlur) {
     
     Bitmap *b = getPrivateData<Bitmap>(self);
     
+    int radius = 0;
+    rb_get_args(argc, argv, "|i", &radius RB_ARG_END);
+    
     GFX_LOCK;
-    b->blur();
+    b->blur(radius);
     GFX_UNLOCK;
     
     return Qnil;
@@ -413,6 +545,84 @@ RB_METHOD(bitmapSetRawData) {
     return self;
 }
 
+#if RAPI_FULL >= 320
+struct RawBufferArgs {
+    VALUE self;
+    VALUE buffer;
+    SDL_Surface *surf;
+    bool modified;
+};
+
+static VALUE bitmapRawBufferYield(VALUE arg) {
+    RawBufferArgs *args = (RawBufferArgs*) arg;
+    
+    return rb_yield(args->buffer);
+}
+
+static VALUE bitmapRawBufferEnd(VALUE arg) {
+    RawBufferArgs *args = (RawBufferArgs*) arg;
+    
+    /* Anything the script kept of the buffer must not
+     * outlive the surface memory it points to */
+    rb_io_buffer_free(args->buffer);
+    
+    Bitmap *b = getPrivateData<Bitmap>(args->self);
+    
+    GFX_LOCK;
+    if (b)
+        b->endRawAccess(args->modified);
+    
+    SDL_FreeSurface(args->surf);
+    GFX_UNLOCK;
+    
+    return Qnil;
+}
+
+/* Yields an IO::Buffer over the pixels, without copying them.
+ * Writable unless 'readonly' is passed; changed rows are
+ * uploaded with 'commit_raw', or all at once after the block */
+RB_METHOD(bitmapRawBuffer) {
+    bool readonly = false;
+    rb_get_args(argc, argv, "|b", &readonly RB_ARG_END);
+    
+    rb_need_block();
+    
+    Bitmap *b = getPrivateData<Bitmap>(self);
+    
+    SDL_Surface *surf = 0;
+    GFX_GUARD_EXC(surf = b->beginRawAccess(););
+    
+    int flags = RB_IO_BUFFER_EXTERNAL;
+    
+    if (readonly)
+        flags |= RB_IO_BUFFER_READONLY;
+    
+    RawBufferArgs args;
+    args.self = self;
+    args.surf = surf;
+    args.modified = !readonly;
+    args.buffer = rb_io_buffer_new(surf->pixels, (size_t) surf->pitch * surf->h,
+                                   (enum rb_io_buffer_flags) flags);
+    
+    return rb_ensure(bitmapRawBufferYield, (VALUE) &args,
+                     bitmapRawBufferEnd, (VALUE) &args);
+}
+
+RB_METHOD(bitmapCommitRaw) {
+    Bitmap *b = getPrivateData<Bitmap>(self);
+    
+    int y = 0, h = -1;
+    rb_get_args(argc, argv, "|ii", &y, &h RB_ARG_END);
+    
+    if (h < 0)
+        h = b->height() - y;
+    
+    GFX_GUARD_EXC(b->commitRaw(y, h););
+    
+    return self;
+}
+#endif
+
 RB_METHOD(bitmapSaveToFile) {
     RB_UNUSED_PARAM;
     
@@ -422,7 +632,20 @@ RB_METHOD(bitmapSaveToFile) {
     
     Bitmap *b = getPrivateData<Bitmap>(self);
     
-    GFX_GUARD_EXC(b->saveToFile(RSTRING_PTR(str)););
+    SDL_Surface *surf = 0;
+    GFX_GUARD_EXC(surf = b->snapshot(););
+    
+    std::string path = shState->fileSystem().normalize(RSTRING_PTR(str), 1, 1);
+    
+    /* Encoding (PNG especially) is slow and needs no GL */
+    try {
+        callWithoutGVL([&]() { Bitmap::saveSurface(surf, path.c_str()); });
+    } catch (const Exception &exc) {
+        SDL_FreeSurface(surf);
+        raiseRbExc(exc);
+    }
+    
+    SDL_FreeSurface(surf);
     
     return RUBY_Qnil;
 }
@@ -441,6 +664,31 @@ RB_METHOD(bitmapGetMega){
     return ret;
 }
 
+RB_METHOD(bitmapGetMipmap){
+    RB_UNUSED_PARAM;
+    
+    rb_check_argc(argc, 0);
+    
+    Bitmap *b = getPrivateData<Bitmap>(self);
+    
+    bool ret;
+    GUARD_EXC(ret = b->getMipmap(););
+    return rb_bool_new(ret);
+}
+
+RB_METHOD(bitmapSetMipmap){
+    RB_UNUSED_PARAM;
+    
+    bool mipmap;
+    rb_get_args(argc, argv, "b", &mipmap RB_ARG_END);
+    
+    Bitmap *b = getPrivateData<Bitmap>(self);
+    
+    GFX_STATE_GUARD_EXC(b->setMipmap(mipmap););
+    
+    return rb_bool_new(mipmap);
+}
+
 RB_METHOD(bitmapGetAnimated){
     RB_UNUSED_PARAM;
     
@@ -707,6 +955,177 @@ RB_METHOD(bitmapGetMaxSize){
     return INT2NUM(Bitmap::maxSize());
 }
 
+static BitmapLoadJob *futureJob(VALUE self) {
+#if RAPI_FULL > 187
+    return static_cast<BitmapLoadJob*>(RTYPEDDATA_DATA(self));
+#else
+    return static_cast<BitmapLoadJob*>(DATA_PTR(self));
+#endif
+}
+
+static VALUE bitmapFutureResolve(VALUE self) {
+    BitmapLoadJob *job = futureJob(self);
+    
+    if (!job)
+        return rb_iv_get(self, "@value");
+    
+    /* Save futures have no Bitmap class to instantiate */
+    const bool save = NIL_P(rb_iv_get(self, "@klass"));
+    
+    /* The pixels may still be on their way back from the GPU */
+    if (save)
+        GFX_GUARD_EXC(shState->bitmapLoader().flush(job););
+    
+#if RAPI_MAJOR >= 2
+    /* Don't hold up other Ruby threads while decoding finishes */
+    rb_thread_call_without_gvl([](void *j) -> void* {
+        shState->bitmapLoader().wait(static_cast<BitmapLoadJob*>(j));
+        return 0;
+    }, job, 0, 0);
+#endif
+    
+    /* The job is gone after this, even if it failed */
+    setPrivateData(self, 0);
+    
+    if (save) {
+        GUARD_EXC(shState->bitmapLoader().finishSave(job););
+        rb_iv_set(self, "@value", Qtrue);
+        
+        return Qtrue;
+    }
+    
+    Bitmap *b = 0;
+    GFX_GUARD_EXC(b = shState->bitmapLoader().finish(job););
+    
+    VALUE ret = rb_obj_alloc(rb_iv_get(self, "@klass"));
+    
+    bitmapInitProps(b, ret);
+    setPrivateData(ret, b);
+    
+    rb_iv_set(self, "@value", ret);
+    
+    return ret;
+}
+
+static VALUE newFuture(BitmapLoadJob *job, VALUE klass) {
+    VALUE future = rb_obj_alloc(futureKlass);
+    
+    setPrivateData(future, job);
+    rb_iv_set(future, "@klass", klass);
+    
+    return future;
+}
+
+/* 'klass' is the Bitmap class to create, or nil for saves */
+VALUE bitmapWrapFuture(BitmapLoadJob *job, VALUE klass) {
+    VALUE future = newFuture(job, klass);
+    
+    if (rb_block_given_p()) {
+        rb_iv_set(future, "@callback", rb_block_proc());
+        rb_ary_push(asyncCallbacks, future);
+    }
+    
+    return future;
+}
+
+RB_METHOD(bitmapLoadAsync) {
+    char *filename;
+    rb_get_args(argc, argv, "z", &filename RB_ARG_END);
+    
+    BitmapLoadJob *job = 0;
+    GUARD_EXC(job = shState->bitmapLoader().request(filename););
+    
+    return bitmapWrapFuture(job, self);
+}
+
+/* Decodes all given files at once, either as arguments or
+ * in one array, and returns their Bitmaps in the same order */
+RB_METHOD(bitmapLoadAll) {
+    VALUE names = (argc == 1 && RB_TYPE_P(argv[0], RUBY_T_ARRAY))
+                ? argv[0] : rb_ary_new4(argc, argv);
+    
+    VALUE futures = rb_ary_new();
+    
+    /* Queue everything before waiting on anything; if a load
+     * fails, the futures left behind discard their jobs */
+    for (long i = 0; i < RARRAY_LEN(names); ++i) {
+        VALUE name = rb_ary_entry(names, i);
+        SafeStringValue(name);
+        
+        BitmapLoadJob *job = 0;
+        GUARD_EXC(job = shState->bitmapLoader().request(RSTRING_PTR(name)););
+        
+        rb_ary_push(futures, newFuture(job, self));
+    }
+    
+    VALUE ret = rb_ary_new();
+    
+    for (long i = 0; i < RARRAY_LEN(futures); ++i)
+        rb_ary_push(ret, bitmapFutureResolve(rb_ary_entry(futures, i)));
+    
+    return ret;
+}
+
+RB_METHOD(bitmapSaveToFileAsync) {
+    RB_UNUSED_PARAM;
+    
+    VALUE str;
+    rb_scan_args(argc, argv, "1", &str);
+    SafeStringValue(str);
+    
+    Bitmap *b = getPrivateData<Bitmap>(self);
+    
+    std::string path = shState->fileSystem().normalize(RSTRING_PTR(str), 1, 1);
+    
+    BitmapLoadJob *job = 0;
+    GFX_GUARD_EXC(job = shState->bitmapLoader().requestSave(*b, path.c_str()););
+    
+    return bitmapWrapFuture(job, Qnil);
+}
+
+RB_METHOD(bitmapFutureDone) {
+    RB_UNUSED_PARAM;
+    
+    BitmapLoadJob *job = futureJob(self);
+    
+    return rb_bool_new(!job || shState->bitmapLoader().isDone(job));
+}
+
+RB_METHOD(bitmapFutureValue) {
+    RB_UNUSED_PARAM;
+    
+    return bitmapFutureResolve(self);
+}
+
+/* Runs the blocks of all finished Bitmap.load_async calls */
+void bitmapProcessAsyncLoads() {
+    if (NIL_P(asyncCallbacks) || RARRAY_LEN(asyncCallbacks) == 0)
+        return;
+    
+    VALUE ready = rb_ary_new();
+    VALUE pending = rb_ary_new();
+    
+    for (long i = 0; i < RARRAY_LEN(asyncCallbacks); ++i) {
+        VALUE future = rb_ary_entry(asyncCallbacks, i);
+        BitmapLoadJob *job = futureJob(future);
+        
+        if (!job || shState->bitmapLoader().isDone(job))
+            rb_ary_push(ready, future);
+        else
+            rb_ary_push(pending, future);
+    }
+    
+    /* Blocks may queue further loads */
+    asyncCallbacks = pending;
+    
+    for (long i = 0; i < RARRAY_LEN(ready); ++i) {
+        VALUE future = rb_ary_entry(ready, i);
+        VALUE bitmap = bitmapFutureResolve(future);
+        
+        rb_funcall(rb_iv_get(future, "@callback"), rb_intern("call"), 1, bitmap);
+    }
+}
+
 RB_METHOD(bitmapInitializeCopy) {
     rb_check_argc(argc, 1);
     VALUE origObj = argv[0];
@@ -747,14 +1166,22 @@ void bitmapBindingInit() {
     _rb_define_method(klass, "fill_rect", bitmapFillRect);
     _rb_define_method(klass, "clear", bitmapClear);
     _rb_define_method(klass, "get_pixel", bitmapGetPixel);
+    _rb_define_method(klass, "get_pixel_into", bitmapGetPixelInto);
     _rb_define_method(klass, "set_pixel", bitmapSetPixel);
     _rb_define_method(klass, "hue_change", bitmapHueChange);
     _rb_define_method(klass, "draw_text", bitmapDrawText);
+    _rb_define_method(klass, "draw_text_wrapped", bitmapDrawTextWrapped);
     _rb_define_method(klass, "text_size", bitmapTextSize);
+    _rb_define_method(klass, "text_size_into", bitmapTextSizeInto);
     
     _rb_define_method(klass, "raw_data", bitmapGetRawData);
     _rb_define_method(klass, "raw_data=", bitmapSetRawData);
+#if RAPI_FULL >= 320
+    _rb_define_method(klass, "raw_buffer", bitmapRawBuffer);
+    _rb_define_method(klass, "commit_raw", bitmapCommitRaw);
+#endif
     _rb_define_method(klass, "to_file", bitmapSaveToFile);
+    _rb_define_method(klass, "to_file_async", bitmapSaveToFileAsync);
     
     _rb_define_method(klass, "gradient_fill_rect", bitmapGradientFillRect);
     _rb_define_method(klass, "clear_rect", bitmapClearRect);
@@ -762,8 +1189,25 @@ void bitmapBindingInit() {
     _rb_define_method(klass, "radial_blur", bitmapRadialBlur);
     
     _rb_define_method(klass, "mega?", bitmapGetMega);
+    _rb_define_method(klass, "mipmap", bitmapGetMipmap);
+    _rb_define_method(klass, "mipmap=", bitmapSetMipmap);
     rb_define_singleton_method(klass, "max_size", RUBY_METHOD_FUNC(bitmapGetMaxSize), -1);
     
+    rb_define_singleton_method(klass, "load_async", RUBY_METHOD_FUNC(bitmapLoadAsync), -1);
+    rb_define_singleton_method(klass, "load_all", RUBY_METHOD_FUNC(bitmapLoadAll), -1);
+    
+    futureKlass = rb_define_class_under(klass, "Future", rb_cObject);
+#if RAPI_FULL > 187
+    rb_define_alloc_func(futureKlass, classAllocate<&BitmapFutureType>);
+#else
+    rb_define_alloc_func(futureKlass, BitmapFutureAllocate);
+#endif
+    _rb_define_method(futureKlass, "done?", bitmapFutureDone);
+    _rb_define_method(futureKlass, "value", bitmapFutureValue);
+    
+    asyncCallbacks = rb_ary_new();
+    rb_gc_register_address(&asyncCallbacks);
+    
     _rb_define_method(klass, "animated?", bitmapGetAnimated);
     _rb_define_method(klass, "playing", bitmapGetPlaying);
     _rb_define_method(klass, "playing=", bitmapSetPlaying);
@@ -2,36 +2,206 @@
 #include "binding-util.h"
 #include "steamshim_child.h"
 
-#define STEAMSHIM_GETV(t, v, d)                                                \
-  while (STEAMSHIM_alive()) {                                                  \
-    const STEAMSHIM_Event *e = STEAMSHIM_pump();                               \
-    if (e && e->type == t) {                                                   \
-      d = e->v;                                                                \
-      break;                                                                   \
-    }                                                                          \
+#if RAPI_MAJOR >= 2
+#include <ruby/thread.h>
+#endif
+
+#include <deque>
+#include <vector>
+
+/* How a reply turns into a Ruby value */
+enum CUSLResult {
+  CUSLStatI,
+  CUSLStatF,
+  CUSLAchievement,
+  CUSLAchievementTime,
+  CUSLOkay
+};
+
+/* A get whose reply hasn't been handed out yet. The shim answers
+ * in order, so each reply goes to the oldest call of its type.
+ * Replies nobody asked for (eg. to SteamLite.set_stat) are dropped */
+struct CUSLCall {
+  unsigned int id;
+  STEAMSHIM_EventType type;
+  CUSLResult result;
+  /* Qnil for calls waited on in place */
+  VALUE callback;
+  bool done;
+  STEAMSHIM_Event ev;
+};
+
+static std::deque<CUSLCall> pendingCalls;
+static unsigned int nextCallId = 0;
+
+/* Keeps the blocks of pending async calls alive */
+static VALUE asyncCallbacks = Qnil;
+
+static unsigned int CUSLIssue(STEAMSHIM_EventType type, CUSLResult result,
+                              VALUE callback) {
+  CUSLCall call;
+  call.id = nextCallId++;
+  call.type = type;
+  call.result = result;
+  call.callback = callback;
+  call.done = false;
+  call.ev = STEAMSHIM_Event();
+
+  if (callback != Qnil)
+    rb_ary_push(asyncCallbacks, callback);
+
+  pendingCalls.push_back(call);
+  return call.id;
+}
+
+static void CUSLDispatch(const STEAMSHIM_Event &ev) {
+  for (size_t i = 0; i < pendingCalls.size(); ++i) {
+    CUSLCall &call = pendingCalls[i];
+
+    if (!call.done && call.type == ev.type) {
+      call.ev = ev;
+      call.done = true;
+      return;
+    }
+  }
+}
+
+static VALUE CUSLValue(const CUSLCall &call) {
+  const STEAMSHIM_Event &e = call.ev;
+
+  if (call.result == CUSLOkay)
+    return rb_bool_new(e.okay);
+
+  if (!e.okay)
+    return Qnil;
+
+  switch (call.result) {
+  case CUSLStatI:
+    return INT2NUM(e.ivalue);
+  case CUSLStatF:
+    return rb_float_new(e.fvalue);
+  case CUSLAchievement:
+    return rb_bool_new(e.ivalue);
+  default:
+    break;
   }
 
-#define STEAMSHIM_GETV_EXP(t, exp)                                             \
-  while (STEAMSHIM_alive()) {                                                  \
-    const STEAMSHIM_Event *e = STEAMSHIM_pump();                               \
-    if (e && e->type == t) {                                                   \
-      exp;                                                                     \
-      break;                                                                   \
-    }                                                                          \
+  VALUE ret = rb_ary_new();
+  rb_ary_push(ret, rb_bool_new(e.ivalue));
+
+  if (!e.epochsecs)
+    rb_ary_push(ret, Qnil);
+  else
+    rb_ary_push(ret, rb_funcall(rb_cTime, rb_intern("at"), 1,
+                                ULL2NUM(e.epochsecs)));
+
+  return ret;
+}
+
+#if RAPI_MAJOR >= 2
+struct CUSLWaitArgs {
+  STEAMSHIM_EventType type;
+  STEAMSHIM_Event *ev;
+  int found;
+};
+
+static void *CUSLWaitInternal(void *args) {
+  CUSLWaitArgs *a = (CUSLWaitArgs *)args;
+  a->found = STEAMSHIM_waitEvent(a->type, a->ev);
+
+  return 0;
+}
+#endif
+
+/* Blocks (without spinning, and letting other Ruby threads run)
+ * until the reply to the call just issued arrives. Replies to older
+ * async calls of the same type come first and are kept for them.
+ * If the shim died, the reply reads as a failed call */
+static VALUE CUSLWait(STEAMSHIM_EventType type, CUSLResult result) {
+  const unsigned int id = CUSLIssue(type, result, Qnil);
+
+  for (;;) {
+    STEAMSHIM_Event ev = STEAMSHIM_Event();
+
+#if RAPI_MAJOR >= 2
+    CUSLWaitArgs args = {type, &ev, 0};
+    rb_thread_call_without_gvl(CUSLWaitInternal, &args, 0, 0);
+    const int found = args.found;
+#else
+    const int found = STEAMSHIM_waitEvent(type, &ev);
+#endif
+
+    if (found)
+      CUSLDispatch(ev);
+
+    for (size_t i = 0; i < pendingCalls.size(); ++i) {
+      if (pendingCalls[i].id != id)
+        continue;
+
+      /* Dead shim: nothing further will come */
+      if (!pendingCalls[i].done && found)
+        break;
+
+      CUSLCall call = pendingCalls[i];
+      pendingCalls.erase(pendingCalls.begin() + i);
+
+      if (!call.done)
+        call.ev = STEAMSHIM_Event();
+
+      return CUSLValue(call);
+    }
   }
+}
+
+/* Async variants take a block, run from Graphics.update once the
+ * reply is in; they return right away */
+static VALUE CUSLAsync(STEAMSHIM_EventType type, CUSLResult result) {
+  rb_need_block();
+
+  CUSLIssue(type, result, rb_block_proc());
+  return Qnil;
+}
 
-#define STEAMSHIM_GET_OK(t, d) STEAMSHIM_GETV(t, okay, d)
+/* Hands replies to the blocks of async calls, in the order
+ * the calls were made */
+void CUSLProcessAsyncCalls() {
+  /* Another Ruby thread waiting on a reply takes it from the
+   * shim's queue itself; pumping now would leave it hanging */
+  bool syncWaiting = false;
 
-#define STEAMSHIM_GETV_AND_OK(t, v, dst, ok)                                   \
-  while (STEAMSHIM_alive()) {                                                  \
-    const STEAMSHIM_Event *e = STEAMSHIM_pump();                               \
-    if (e && e->type == t) {                                                   \
-      dst = e->v;                                                              \
-      ok = e->okay;                                                            \
-      break;                                                                   \
-    }                                                                          \
+  for (size_t i = 0; i < pendingCalls.size(); ++i)
+    if (pendingCalls[i].callback == Qnil && !pendingCalls[i].done)
+      syncWaiting = true;
+
+  if (!syncWaiting)
+    while (const STEAMSHIM_Event *ev = STEAMSHIM_pump())
+      CUSLDispatch(*ev);
+
+  const bool dead = !STEAMSHIM_alive();
+  std::vector<CUSLCall> ready;
+
+  for (size_t i = 0; i < pendingCalls.size();) {
+    CUSLCall &call = pendingCalls[i];
+
+    if (call.callback == Qnil || (!call.done && !dead)) {
+      ++i;
+      continue;
+    }
+
+    if (!call.done)
+      call.ev = STEAMSHIM_Event();
+
+    ready.push_back(call);
+    pendingCalls.erase(pendingCalls.begin() + i);
   }
 
+  /* Blocks may make further calls */
+  for (size_t i = 0; i < ready.size(); ++i) {
+    rb_ary_delete(asyncCallbacks, ready[i].callback);
+    rb_funcall(ready[i].callback, rb_intern("call"), 1, CUSLValue(ready[i]));
+  }
+}
+
 RB_METHOD(CUSLSetStat) {
   RB_UNUSED_PARAM;
 
@@ -39,18 +209,17 @@ RB_METHOD(CUSLSetStat) {
   rb_scan_args(argc, argv, "2", &name, &stat);
   SafeStringValue(name);
 
-  bool ret;
+  /* Queued without waiting for the reply; returns whether
+   * the shim is still there to take it */
   if (RB_TYPE_P(stat, RUBY_T_FLOAT)) {
     STEAMSHIM_setStatF(RSTRING_PTR(name), (float)RFLOAT_VALUE(stat));
-    STEAMSHIM_GET_OK(SHIMEVENT_SETSTATF, ret);
   } else if (RB_TYPE_P(stat, RUBY_T_FIXNUM)) {
     STEAMSHIM_setStatI(RSTRING_PTR(name), (int)NUM2INT(stat));
-    STEAMSHIM_GET_OK(SHIMEVENT_SETSTATI, ret);
   } else {
     rb_raise(rb_eTypeError,
              "Statistic value must be either an integer or float.");
   }
-  return rb_bool_new(ret);
+  return rb_bool_new(STEAMSHIM_alive());
 }
 
 RB_METHOD(CUSLGetStatI) {
@@ -60,16 +229,19 @@ RB_METHOD(CUSLGetStatI) {
   rb_scan_args(argc, argv, "1", &name);
   SafeStringValue(name);
 
-  int resi;
-  bool valid;
-
   STEAMSHIM_getStatI(RSTRING_PTR(name));
-  STEAMSHIM_GETV_AND_OK(SHIMEVENT_GETSTATI, ivalue, resi, valid);
+  return CUSLWait(SHIMEVENT_GETSTATI, CUSLStatI);
+}
 
-  if (!valid)
-    return Qnil;
+RB_METHOD(CUSLGetStatIAsync) {
+  RB_UNUSED_PARAM;
+
+  VALUE name;
+  rb_scan_args(argc, argv, "1", &name);
+  SafeStringValue(name);
 
-  return INT2NUM(resi);
+  STEAMSHIM_getStatI(RSTRING_PTR(name));
+  return CUSLAsync(SHIMEVENT_GETSTATI, CUSLStatI);
 }
 
 RB_METHOD(CUSLGetStatF) {
@@ -79,16 +251,19 @@ RB_METHOD(CUSLGetStatF) {
   rb_scan_args(argc, argv, "1", &name);
   SafeStringValue(name);
 
-  float resf;
-  bool valid;
+  STEAMSHIM_getStatF(RSTRING_PTR(name));
+  return CUSLWait(SHIMEVENT_GETSTATF, CUSLStatF);
+}
 
-  STEAMSHIM_getStatI(RSTRING_PTR(name));
-  STEAMSHIM_GETV_AND_OK(SHIMEVENT_GETSTATI, fvalue, resf, valid);
+RB_METHOD(CUSLGetStatFAsync) {
+  RB_UNUSED_PARAM;
 
-  if (!valid)
-    return Qnil;
+  VALUE name;
+  rb_scan_args(argc, argv, "1", &name);
+  SafeStringValue(name);
 
-  return rb_float_new(resf);
+  STEAMSHIM_getStatF(RSTRING_PTR(name));
+  return CUSLAsync(SHIMEVENT_GETSTATF, CUSLStatF);
 }
 
 RB_METHOD(CUSLGetAchievement) {
@@ -98,16 +273,19 @@ RB_METHOD(CUSLGetAchievement) {
   rb_scan_args(argc, argv, "1", &name);
   SafeStringValue(name);
 
-  bool ret;
-  bool valid;
-
   STEAMSHIM_getAchievement(RSTRING_PTR(name));
-  STEAMSHIM_GETV_AND_OK(SHIMEVENT_GETACHIEVEMENT, ivalue, ret, valid);
+  return CUSLWait(SHIMEVENT_GETACHIEVEMENT, CUSLAchievement);
+}
 
-  if (!valid)
-    return Qnil;
+RB_METHOD(CUSLGetAchievementAsync) {
+  RB_UNUSED_PARAM;
 
-  return rb_bool_new(ret);
+  VALUE name;
+  rb_scan_args(argc, argv, "1", &name);
+  SafeStringValue(name);
+
+  STEAMSHIM_getAchievement(RSTRING_PTR(name));
+  return CUSLAsync(SHIMEVENT_GETACHIEVEMENT, CUSLAchievement);
 }
 
 RB_METHOD(CUSLSetAchievement) {
@@ -117,10 +295,8 @@ RB_METHOD(CUSLSetAchievement) {
   rb_scan_args(argc, argv, "1", &name);
   SafeStringValue(name);
 
-  bool ret;
   STEAMSHIM_setAchievement(RSTRING_PTR(name), true);
-  STEAMSHIM_GET_OK(SHIMEVENT_SETACHIEVEMENT, ret);
-  return rb_bool_new(ret);
+  return rb_bool_new(STEAMSHIM_alive());
 }
 
 RB_METHOD(CUSLClearAchievement) {
@@ -131,10 +307,8 @@ RB_METHOD(CUSLClearAchievement) {
   rb_scan_args(argc, argv, "1", &name);
   SafeStringValue(name);
 
-  bool ret;
   STEAMSHIM_setAchievement(RSTRING_PTR(name), false);
-  STEAMSHIM_GET_OK(SHIMEVENT_SETACHIEVEMENT, ret);
-  return rb_bool_new(ret);
+  return rb_bool_new(STEAMSHIM_alive());
 }
 
 RB_METHOD(CUSLGetAchievementAndUnlockTime) {
@@ -145,42 +319,29 @@ RB_METHOD(CUSLGetAchievementAndUnlockTime) {
   rb_scan_args(argc, argv, "1", &name);
   SafeStringValue(name);
 
-  bool achieved;
-  unsigned long long time;
-  bool valid;
-
   STEAMSHIM_getAchievement(RSTRING_PTR(name));
-  STEAMSHIM_GETV_EXP(SHIMEVENT_GETACHIEVEMENT, {
-    valid = e->okay;
-    achieved = e->ivalue;
-    time = e->epochsecs;
-  });
+  return CUSLWait(SHIMEVENT_GETACHIEVEMENT, CUSLAchievementTime);
+}
 
-  if (!valid)
-    return Qnil;
+RB_METHOD(CUSLGetAchievementAndUnlockTimeAsync) {
+  RB_UNUSED_PARAM;
 
-  VALUE ret = rb_ary_new();
-  rb_ary_push(ret, rb_bool_new(achieved));
+  VALUE name;
 
-  if (!time) {
-    rb_ary_push(ret, Qnil);
-    return ret;
-  }
+  rb_scan_args(argc, argv, "1", &name);
+  SafeStringValue(name);
 
-  VALUE t = rb_funcall(rb_cTime, rb_intern("at"), 1, ULL2NUM(time));
-  rb_ary_push(ret, t);
-  return ret;
+  STEAMSHIM_getAchievement(RSTRING_PTR(name));
+  return CUSLAsync(SHIMEVENT_GETACHIEVEMENT, CUSLAchievementTime);
 }
 
 RB_METHOD(CUSLStoreStats) {
   RB_UNUSED_PARAM;
 
   rb_check_argc(argc, 0);
-  bool ok;
 
   STEAMSHIM_storeStats();
-  STEAMSHIM_GET_OK(SHIMEVENT_STATSSTORED, ok);
-  return rb_bool_new(ok);
+  return rb_bool_new(STEAMSHIM_alive());
 }
 
 RB_METHOD(CUSLResetAllStats) {
@@ -191,15 +352,26 @@ RB_METHOD(CUSLResetAllStats) {
   rb_get_args(argc, argv, "b", &achievementsToo);
 
   STEAMSHIM_resetStats(achievementsToo);
-  STEAMSHIM_GET_OK(SHIMEVENT_RESETSTATS, achievementsToo);
-  return rb_bool_new(achievementsToo);
+  return CUSLWait(SHIMEVENT_RESETSTATS, CUSLOkay);
+}
+
+RB_METHOD(CUSLResetAllStatsAsync) {
+  RB_UNUSED_PARAM;
+
+  bool achievementsToo;
+
+  rb_get_args(argc, argv, "b", &achievementsToo);
+
+  STEAMSHIM_resetStats(achievementsToo);
+  return CUSLAsync(SHIMEVENT_RESETSTATS, CUSLOkay);
 }
 
 void CUSLBindingInit() {
+  asyncCallbacks = rb_ary_new();
+  rb_gc_register_address(&asyncCallbacks);
 
   STEAMSHIM_requestStats();
-  bool ok;
-  STEAMSHIM_GET_OK(SHIMEVENT_STATSRECEIVED, ok);
+  CUSLWait(SHIMEVENT_STATSRECEIVED, CUSLOkay);
 
   VALUE mSteamLite = rb_define_module("SteamLite");
 
@@ -217,5 +389,15 @@ void CUSLBindingInit() {
                              CUSLGetAchievementAndUnlockTime);
 
   _rb_define_module_function(mSteamLite, "reset_all_stats", CUSLResetAllStats);
+
+  _rb_define_module_function(mSteamLite, "get_stat_i_async", CUSLGetStatIAsync);
+  _rb_define_module_function(mSteamLite, "get_stat_f_async", CUSLGetStatFAsync);
+  _rb_define_module_function(mSteamLite, "get_achievement_async",
+                             CUSLGetAchievementAsync);
+  _rb_define_module_function(mSteamLite,
+                             "get_achievement_and_unlock_time_async",
+                             CUSLGetAchievementAndUnlockTimeAsync);
+  _rb_define_module_function(mSteamLite, "reset_all_stats_async",
+                             CUSLResetAllStatsAsync);
 }
 #endif
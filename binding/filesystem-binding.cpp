@@ -22,6 +22,7 @@
 #include "src/config.h"
 
 #include "binding-util.h"
+#include "marshal-load.h"
 
 #include "filesystem.h"
 #include "sharedstate.h"
@@ -38,6 +39,10 @@
 #include <ruby/thread.h>
 #endif
 
+#include <list>
+#include <string>
+#include <unordered_map>
+
 static void fileIntFreeInstance(void *inst) {
     SDL_RWops *ops = static_cast<SDL_RWops *>(inst);
     
@@ -162,25 +167,111 @@ RB_METHOD(fileIntPos) {
 }
 #endif
 
+/* Raw bytes of recently loaded files under Data/, most recently
+ * used first. Every load_data call still unmarshals its own copy,
+ * so scripts are free to modify what they get back */
+struct DataCache {
+    typedef std::list<std::pair<std::string, std::string> > List;
+    
+    List entries;
+    std::unordered_map<std::string, List::iterator> index;
+    size_t size = 0;
+    
+    static std::string keyFor(const char *filename) {
+        std::string key(filename);
+        
+        for (size_t i = 0; i < key.size(); ++i) {
+            if (key[i] == '\\')
+                key[i] = '/';
+            else
+                key[i] = tolower((unsigned char) key[i]);
+        }
+        
+        return key;
+    }
+    
+    static bool wanted(const std::string &key) {
+        return key.compare(0, 5, "data/") == 0;
+    }
+    
+    const std::string *find(const std::string &key) {
+        auto iter = index.find(key);
+        
+        if (iter == index.end())
+            return 0;
+        
+        entries.splice(entries.begin(), entries, iter->second);
+        return &iter->second->second;
+    }
+    
+    void insert(const std::string &key, const char *data, size_t len, size_t budget) {
+        if (len > budget)
+            return;
+        
+        entries.emplace_front(key, std::string(data, len));
+        index[key] = entries.begin();
+        size += len;
+        
+        while (size > budget) {
+            size -= entries.back().second.size();
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+    
+    void clear() {
+        entries.clear();
+        index.clear();
+        size = 0;
+    }
+};
+
+static DataCache dataCache;
+
+void dataCacheClear() {
+    dataCache.clear();
+}
+
+static VALUE loadDataResult(VALUE data, bool raw) {
+    if (raw || NIL_P(data))
+        return data;
+    
+    VALUE marsh = rb_const_get(rb_cObject, rb_intern("Marshal"));
+    
+    // FIXME need to catch exceptions here with begin rescue
+    return rb_funcall2(marsh, rb_intern("load"), 1, &data);
+}
+
 VALUE
 kernelLoadDataInt(const char *filename, bool rubyExc, bool raw) {
     //rb_gc_start();
     
-    VALUE port = fileIntForPath(filename, rubyExc);
-    VALUE result;
-    if (!raw) {
-        VALUE marsh = rb_const_get(rb_cObject, rb_intern("Marshal"));
+    const size_t budget = shState->config().dataCache;
+    std::string key;
+    
+    if (budget > 0) {
+        key = DataCache::keyFor(filename);
+        
+        if (!DataCache::wanted(key))
+            key.clear();
+    }
+    
+    if (!key.empty()) {
+        const std::string *bytes = dataCache.find(key);
         
-        // FIXME need to catch exceptions here with begin rescue
-        VALUE data = fileIntRead(0, 0, port);
-        result = rb_funcall2(marsh, rb_intern("load"), 1, &data);
-    } else {
-        result = fileIntRead(0, 0, port);
+        if (bytes)
+            return loadDataResult(rb_str_new(bytes->data(), bytes->size()), raw);
     }
     
+    VALUE port = fileIntForPath(filename, rubyExc);
+    VALUE data = fileIntRead(0, 0, port);
+    
     rb_funcall2(port, rb_intern("close"), 0, NULL);
     
-    return result;
+    if (!key.empty() && !NIL_P(data))
+        dataCache.insert(key, RSTRING_PTR(data), RSTRING_LEN(data), budget);
+    
+    return loadDataResult(data, raw);
 }
 
 RB_METHOD(kernelLoadData) {
@@ -213,6 +304,9 @@ RB_METHOD(kernelSaveData) {
     
     rb_io_close(file);
     
+    /* The file might shadow one we hold on to */
+    dataCacheClear();
+    
     return Qnil;
 }
 #if RAPI_FULL > 187
@@ -247,6 +341,17 @@ RB_METHOD(_marshalLoad) {
     rb_get_args(argc, argv, "o", &port RB_ARG_END);
 #endif
     
+#if RAPI_FULL < 270
+    if (NIL_P(proc))
+#endif
+    {
+        /* Strings can skip Ruby's loader entirely */
+        VALUE result = marshalLoadFast(port);
+        
+        if (result != Qundef)
+            return result;
+    }
+    
     VALUE utf8Proc;
 #if RAPI_FULL < 270
     if (NIL_P(proc))
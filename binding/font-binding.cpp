@@ -44,11 +44,13 @@ static void collectStrings(VALUE obj, std::vector<std::string> &out) {
 }
 
 #if RAPI_FULL > 187
-DEF_TYPE(Font);
+DEF_TYPE_SLOTTED(Font);
 #else
-DEF_ALLOCFUNC(Font);
+DEF_ALLOCFUNC_SLOTTED(Font);
 #endif
 
+enum { FontName, FontColor, FontOutColor };
+
 RB_METHOD(fontDoesExist) {
   RB_UNUSED_PARAM;
 
@@ -86,17 +88,17 @@ RB_METHOD(fontInitialize) {
   /* This is semantically wrong; the new Font object should take
    * a dup'ed object here in case of an array. Ditto for the setters.
    * However the same bug/behavior exists in all RM versions. */
-  rb_iv_set(self, "name", namesObj);
+  setPropSlot(f, FontName, namesObj);
 
   setPrivateData(self, f);
 
   /* Wrap property objects */
   f->initDynAttribs();
 
-  wrapProperty(self, &f->getColor(), "color", ColorType);
+  wrapProperty(f, &f->getColor(), FontColor, ColorType);
 
   if (rgssVer >= 3)
-    wrapProperty(self, &f->getOutColor(), "out_color", ColorType);
+    wrapProperty(f, &f->getOutColor(), FontOutColor, ColorType);
 
   return self;
 }
@@ -112,21 +114,47 @@ RB_METHOD(fontInitializeCopy) {
   Font *f = new Font(*orig);
   setPrivateData(self, f);
 
+  /* Copies share the name object with the original */
+  setPropSlot(f, FontName, getPropSlot(orig, FontName));
+
   /* Wrap property objects */
   f->initDynAttribs();
 
-  wrapProperty(self, &f->getColor(), "color", ColorType);
+  wrapProperty(f, &f->getColor(), FontColor, ColorType);
 
   if (rgssVer >= 3)
-    wrapProperty(self, &f->getOutColor(), "out_color", ColorType);
+    wrapProperty(f, &f->getOutColor(), FontOutColor, ColorType);
 
   return self;
 }
 
+/* layout(text, width); returns the lines 'text'
+ * wraps into, as Bitmap#draw_text_wrapped draws them */
+RB_METHOD(fontLayout) {
+  Font *f = getPrivateData<Font>(self);
+
+  VALUE strObj;
+  int width;
+
+  rb_get_args(argc, argv, "oi", &strObj, &width RB_ARG_END);
+
+  strObj = rb_obj_as_string(strObj);
+
+  std::vector<std::string> lines;
+  GUARD_EXC(f->layout(RSTRING_PTR(strObj), width, lines););
+
+  VALUE ary = rb_ary_new2(lines.size());
+
+  for (size_t i = 0; i < lines.size(); ++i)
+    rb_ary_push(ary, rb_utf8_str_new(lines[i].c_str(), lines[i].size()));
+
+  return ary;
+}
+
 RB_METHOD(FontGetName) {
   RB_UNUSED_PARAM;
 
-  return rb_iv_get(self, "name");
+  return getPropSlot(getPrivateData<Font>(self), FontName);
 }
 
 RB_METHOD(FontSetName) {
@@ -138,15 +166,15 @@ RB_METHOD(FontSetName) {
   collectStrings(argv[0], namesObj);
 
   f->setName(namesObj);
-  rb_iv_set(self, "name", argv[0]);
+  setPropSlot(f, FontName, argv[0]);
 
   return argv[0];
 }
 
 template <class C> static void checkDisposed(VALUE) {}
 
-DEF_PROP_OBJ_VAL(Font, Color, Color, "color")
-DEF_PROP_OBJ_VAL(Font, Color, OutColor, "out_color")
+DEF_PROP_OBJ_VAL(Font, Color, Color, FontColor)
+DEF_PROP_OBJ_VAL(Font, Color, OutColor, FontOutColor)
 
 DEF_PROP_I(Font, Size)
 
@@ -285,6 +313,7 @@ void fontBindingInit() {
 
   _rb_define_method(klass, "initialize", fontInitialize);
   _rb_define_method(klass, "initialize_copy", fontInitializeCopy);
+  _rb_define_method(klass, "layout", fontLayout);
 
   INIT_PROP_BIND(Font, Name, "name");
   INIT_PROP_BIND(Font, Size, "size");
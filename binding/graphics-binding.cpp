@@ -21,25 +21,131 @@
 
 #include "graphics.h"
 #include "sharedstate.h"
+#include "profiler.h"
+#include "texpool.h"
+#include "bitmap.h"
 #include "binding-util.h"
 #include "binding-types.h"
 #include "exception.h"
+#include "config.h"
 
 #if RAPI_MAJOR >= 2
 #include <ruby/thread.h>
 #endif
 
+#include <string.h>
+#include <algorithm>
+
 RB_METHOD(graphicsDelta) {
     RB_UNUSED_PARAM;
-    GFX_LOCK;
+    GFX_STATE_LOCK;
     VALUE ret = rb_float_new(shState->graphics().getDelta());
-    GFX_UNLOCK;
+    GFX_STATE_UNLOCK;
     return ret;
 }
 
+void bitmapProcessAsyncLoads();
+void httpProcessAsyncRequests();
+void socketProcessMessages();
+#ifdef MKXPZ_STEAM
+void CUSLProcessAsyncCalls();
+#endif
+void saveProcessAsync();
+VALUE bitmapWrapFuture(BitmapLoadJob *job, VALUE klass);
+
+#if RAPI_FULL >= 220
+static size_t gcStat(const char *key) {
+    return rb_gc_stat(ID2SYM(rb_intern(key)));
+}
+
+/* True if 'value' has come within 10% of 'limit' */
+static bool gcNearLimit(size_t value, size_t limit) {
+    return limit > 0 && value >= limit - limit / 10;
+}
+
+/* Runs the collection Ruby is about to start on its own anyway
+ * while there is time left before the next frame, so it doesn't
+ * land in the middle of one. Old generation and old malloc growth
+ * lead to full collections, young ones to minor collections */
+static void gcIdleCollect() {
+    const Config &conf = shState->config();
+    
+    GFX_STATE_LOCK;
+    double timeLeft = shState->graphics().frameTimeLeft();
+    GFX_STATE_UNLOCK;
+    
+    if (timeLeft < conf.gc.idleMinTime)
+        return;
+    
+    bool major =
+        gcNearLimit(gcStat("old_objects"), gcStat("old_objects_limit")) ||
+        gcNearLimit(gcStat("oldmalloc_increase_bytes"),
+                    gcStat("oldmalloc_increase_bytes_limit"));
+    
+    bool minor = major ||
+        gcNearLimit(gcStat("malloc_increase_bytes"), gcStat("malloc_increase_bytes_limit")) ||
+        gcStat("heap_free_slots") < gcStat("heap_live_slots") / 10;
+    
+    if (!minor)
+        return;
+    
+    /* Sweeping is left to happen lazily during the next frames */
+    VALUE opts = rb_hash_new();
+    rb_hash_aset(opts, ID2SYM(rb_intern("full_mark")), major ? Qtrue : Qfalse);
+    rb_hash_aset(opts, ID2SYM(rb_intern("immediate_sweep")), Qfalse);
+    
+#if RAPI_FULL >= 270
+    rb_funcallv_kw(rb_mGC, rb_intern("start"), 1, &opts, RB_PASS_KEYWORDS);
+#else
+    rb_funcall2(rb_mGC, rb_intern("start"), 1, &opts);
+#endif
+}
+#endif
+
+#if RAPI_FULL >= 220
+/* Hands the GC.stat deltas since the last call to Graphics */
+static void graphicsCollectScriptStats()
+{
+    static size_t last[4];
+    static bool haveLast = false;
+    
+    static const char *keys[] = {
+        "minor_gc_count", "major_gc_count",
+        "total_allocated_objects", "heap_allocated_pages"
+    };
+    
+    size_t now[4];
+    
+    for (int i = 0; i < 4; ++i)
+        now[i] = rb_gc_stat(ID2SYM(rb_intern(keys[i])));
+    
+    Graphics::ScriptStats stats = Graphics::ScriptStats();
+    
+    if (haveLast)
+    {
+        stats.minorGCs = now[0] - last[0];
+        stats.majorGCs = now[1] - last[1];
+        stats.allocatedObjects = now[2] - last[2];
+        stats.heapPages = (int32_t) ((int64_t) now[3] - (int64_t) last[3]);
+    }
+    
+    memcpy(last, now, sizeof(last));
+    haveLast = true;
+    
+    shState->graphics().setScriptStats(stats);
+}
+#endif
+
 RB_METHOD(graphicsUpdate)
 {
     RB_UNUSED_PARAM;
+#if RAPI_FULL >= 220
+    if (shState->config().gc.idleCollect)
+        gcIdleCollect();
+#endif
+#if RAPI_FULL >= 220
+    graphicsCollectScriptStats();
+#endif
 #if RAPI_MAJOR >= 2
     rb_thread_call_without_gvl([](void*) -> void* {
         GFX_LOCK;
@@ -50,15 +156,31 @@ RB_METHOD(graphicsUpdate)
 #else
     shState->graphics().update();
 #endif
+    bitmapProcessAsyncLoads();
+    httpProcessAsyncRequests();
+    socketProcessMessages();
+#ifdef MKXPZ_STEAM
+    CUSLProcessAsyncCalls();
+#endif
+    saveProcessAsync();
     return Qnil;
 }
 
 RB_METHOD(graphicsAverageFrameRate)
 {
     RB_UNUSED_PARAM;
-    GFX_LOCK;
+    GFX_STATE_LOCK;
     VALUE ret = rb_float_new(shState->graphics().averageFrameRate());
-    GFX_UNLOCK;
+    GFX_STATE_UNLOCK;
+    return ret;
+}
+
+RB_METHOD(graphicsFrameTimeVariance)
+{
+    RB_UNUSED_PARAM;
+    GFX_STATE_LOCK;
+    VALUE ret = rb_float_new(shState->graphics().frameTimeVariance());
+    GFX_STATE_UNLOCK;
     return ret;
 }
 
@@ -88,6 +210,28 @@ RB_METHOD(graphicsTransition)
     return Qnil;
 }
 
+RB_METHOD(graphicsTransitionAsync)
+{
+    RB_UNUSED_PARAM;
+    
+    int duration = 8;
+    const char *filename = "";
+    int vague = 40;
+    
+    rb_get_args(argc, argv, "|izi", &duration, &filename, &vague RB_ARG_END);
+    
+    GFX_GUARD_EXC( shState->graphics().beginTransition(duration, filename, vague); )
+    
+    return Qnil;
+}
+
+RB_METHOD(graphicsTransitioning)
+{
+    RB_UNUSED_PARAM;
+    
+    return rb_bool_new(shState->graphics().isTransitioning());
+}
+
 RB_METHOD(graphicsFrameReset)
 {
     RB_UNUSED_PARAM;
@@ -231,9 +375,12 @@ RB_METHOD(graphicsSnapToBitmap)
 {
     RB_UNUSED_PARAM;
     
+    bool adopt = false;
+    rb_get_args(argc, argv, "|b", &adopt RB_ARG_END);
+    
     Bitmap *result = 0;
     
-    GFX_GUARD_EXC( result = shState->graphics().snapToBitmap(); );
+    GFX_GUARD_EXC( result = shState->graphics().snapToBitmap(adopt); );
     
     VALUE obj = wrapObject(result, BitmapType);
     bitmapInitProps(result, obj);
@@ -358,6 +505,189 @@ RB_METHOD(graphicsScreenshot)
     return Qnil;
 }
 
+RB_METHOD(graphicsScreenshotAsync)
+{
+    RB_UNUSED_PARAM;
+    
+    VALUE filename;
+    rb_scan_args(argc, argv, "1", &filename);
+    SafeStringValue(filename);
+    
+    BitmapLoadJob *job = 0;
+    GFX_GUARD_EXC(job = shState->graphics().screenshotAsync(RSTRING_PTR(filename)););
+    
+    return bitmapWrapFuture(job, Qnil);
+}
+
+RB_METHOD(graphicsDumpProfile)
+{
+    RB_UNUSED_PARAM;
+    
+    const char *filename;
+    rb_get_args(argc, argv, "z", &filename RB_ARG_END);
+    
+    Profiler &profiler = shState->profiler();
+    
+    if (!profiler.isEnabled())
+        raiseRbExc(Exception(Exception::MKXPError, "The frame profiler is not enabled"));
+    
+    return rb_bool_new(profiler.dumpTrace(filename));
+}
+
+static VALUE texPoolStats2hash(const TexPool::Stats &stats)
+{
+    VALUE ret = rb_hash_new();
+    
+#define STAT(key, value) \
+    rb_hash_aset(ret, ID2SYM(rb_intern(key)), UINT2NUM(value))
+    
+    STAT("hits", stats.hits);
+    STAT("misses", stats.misses);
+    STAT("evictions", stats.evictions);
+    STAT("cached_bytes", stats.cachedBytes);
+    STAT("live_bytes", stats.liveBytes);
+    STAT("resident_bytes", stats.cachedBytes + stats.liveBytes);
+    STAT("budget", stats.budget);
+    
+#undef STAT
+    
+    return ret;
+}
+
+RB_METHOD(graphicsTextureStats)
+{
+    RB_UNUSED_PARAM;
+    
+    static const char *categories[] = { "bitmaps", "intermediates", "atlases" };
+    
+    VALUE ret = rb_hash_new();
+    
+    GFX_STATE_LOCK;
+    for (int i = 0; i < TexPool::CategoryCount; ++i)
+    {
+        TexPool::Stats stats = shState->texPool().stats((TexPool::Category) i);
+        rb_hash_aset(ret, ID2SYM(rb_intern(categories[i])), texPoolStats2hash(stats));
+    }
+    GFX_STATE_UNLOCK;
+    
+    return ret;
+}
+
+RB_METHOD(graphicsRenderStats)
+{
+    RB_UNUSED_PARAM;
+    
+    const Graphics::RenderStats &stats = shState->graphics().renderStats();
+    
+    VALUE ret = rb_hash_new();
+    
+#define STAT(key, value) \
+    rb_hash_aset(ret, ID2SYM(rb_intern(key)), ULL2NUM(value))
+    
+    STAT("draws", stats.draws);
+    STAT("state_changes", stats.stateChanges);
+    STAT("state_changes_elided", stats.stateChangesElided);
+    STAT("fbo_binds", stats.fboBinds);
+    STAT("texture_uploads", stats.texUploads);
+    STAT("texture_upload_bytes", stats.texUploadBytes);
+    STAT("buffer_uploads", stats.bufferUploads);
+    STAT("buffer_upload_bytes", stats.bufferUploadBytes);
+    
+#undef STAT
+    
+    return ret;
+}
+
+RB_METHOD(graphicsFrameskipStats)
+{
+    RB_UNUSED_PARAM;
+    
+    const Graphics::FrameSkipStats stats = shState->graphics().frameSkipStats();
+    
+    VALUE ret = rb_hash_new();
+    
+    rb_hash_aset(ret, ID2SYM(rb_intern("skipped")), ULL2NUM(stats.skipped));
+    rb_hash_aset(ret, ID2SYM(rb_intern("drawn")), ULL2NUM(stats.drawn));
+    rb_hash_aset(ret, ID2SYM(rb_intern("longest_run")), UINT2NUM(stats.longestRun));
+    rb_hash_aset(ret, ID2SYM(rb_intern("draw_estimate")), rb_float_new(stats.drawEstimate));
+    
+    return ret;
+}
+
+RB_METHOD(graphicsFrameHistory)
+{
+    RB_UNUSED_PARAM;
+    
+    int count = 60;
+    rb_get_args(argc, argv, "|i", &count RB_ARG_END);
+    
+    std::vector<Graphics::FrameRecord> history;
+    shState->graphics().frameHistory(history, std::max(count, 0));
+    
+    VALUE ret = rb_ary_new2(history.size());
+    
+    for (size_t i = 0; i < history.size(); ++i)
+    {
+        const Graphics::FrameRecord &record = history[i];
+        VALUE entry = rb_hash_new();
+        
+#define ENTRY(key, value) \
+    rb_hash_aset(entry, ID2SYM(rb_intern(key)), value)
+        
+        ENTRY("frame", UINT2NUM(record.frame));
+        ENTRY("frame_time", rb_float_new(record.frameTime));
+        ENTRY("minor_gc", UINT2NUM(record.script.minorGCs));
+        ENTRY("major_gc", UINT2NUM(record.script.majorGCs));
+        ENTRY("allocated_objects", ULL2NUM(record.script.allocatedObjects));
+        ENTRY("heap_pages", INT2NUM(record.script.heapPages));
+        
+#undef ENTRY
+        
+        rb_ary_push(ret, entry);
+    }
+    
+    return ret;
+}
+
+RB_METHOD(graphicsBitmapReport)
+{
+    RB_UNUSED_PARAM;
+    
+    if (!Bitmap::trackingEnabled())
+        raiseRbExc(Exception(Exception::MKXPError, "The bitmap tracker is not enabled"));
+    
+    std::vector<Bitmap::TrackInfo> report;
+    
+    GFX_STATE_LOCK;
+    Bitmap::trackReport(report);
+    GFX_STATE_UNLOCK;
+    
+    VALUE ret = rb_ary_new2(report.size());
+    
+    for (size_t i = 0; i < report.size(); ++i)
+    {
+        const Bitmap::TrackInfo &info = report[i];
+        VALUE entry = rb_hash_new();
+        
+#define ENTRY(key, value) \
+    rb_hash_aset(entry, ID2SYM(rb_intern(key)), value)
+        
+        ENTRY("width", INT2NUM(info.width));
+        ENTRY("height", INT2NUM(info.height));
+        ENTRY("bytes", ULL2NUM(info.bytes));
+        ENTRY("shared", rb_bool_new(info.shared));
+        ENTRY("filename", info.filename.empty() ? Qnil : rb_str_new_cstr(info.filename.c_str()));
+        ENTRY("backtrace", info.origin.empty() ? Qnil : rb_str_new_cstr(info.origin.c_str()));
+        ENTRY("last_draw", info.lastDraw < 0 ? Qnil : INT2NUM(info.lastDraw));
+        
+#undef ENTRY
+        
+        rb_ary_push(ret, entry);
+    }
+    
+    return ret;
+}
+
 DEF_GRA_PROP_I(FrameRate)
 DEF_GRA_PROP_I(FrameCount)
 DEF_GRA_PROP_I(Brightness)
@@ -386,14 +716,24 @@ void graphicsBindingInit()
     _rb_define_module_function(module, "update", graphicsUpdate);
     _rb_define_module_function(module, "freeze", graphicsFreeze);
     _rb_define_module_function(module, "transition", graphicsTransition);
+    _rb_define_module_function(module, "transition_async", graphicsTransitionAsync);
+    _rb_define_module_function(module, "transitioning?", graphicsTransitioning);
     _rb_define_module_function(module, "frame_reset", graphicsFrameReset);
     _rb_define_module_function(module, "screenshot", graphicsScreenshot);
+    _rb_define_module_function(module, "screenshot_async", graphicsScreenshotAsync);
+    _rb_define_module_function(module, "dump_profile", graphicsDumpProfile);
+    _rb_define_module_function(module, "texture_stats", graphicsTextureStats);
+    _rb_define_module_function(module, "render_stats", graphicsRenderStats);
+    _rb_define_module_function(module, "bitmap_report", graphicsBitmapReport);
+    _rb_define_module_function(module, "frame_history", graphicsFrameHistory);
+    _rb_define_module_function(module, "frameskip_stats", graphicsFrameskipStats);
     
     _rb_define_module_function(module, "__reset__", graphicsReset);
     
     INIT_GRA_PROP_BIND( FrameRate,  "frame_rate"  );
     INIT_GRA_PROP_BIND( FrameCount, "frame_count" );
     _rb_define_module_function(module, "average_frame_rate", graphicsAverageFrameRate);
+    _rb_define_module_function(module, "frame_time_variance", graphicsFrameTimeVariance);
 
     _rb_define_module_function(module, "width", graphicsWidth);
     _rb_define_module_function(module, "height", graphicsHeight);
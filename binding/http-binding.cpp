@@ -6,6 +6,9 @@
 //
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
 
 #include "util/json5pp.hpp"
 #include "binding-util.h"
@@ -14,7 +17,16 @@
 #include <ruby/thread.h>
 #endif
 
+#if RAPI_FULL >= 190
+#include <ruby/encoding.h>
+#endif
+
 #include "net/net.h"
+#include "sharedstate.h"
+#include "filesystem.h"
+#include "config.h"
+
+void dataCacheClear();
 
 VALUE stringMap2hash(mkxp_net::StringMap &map) {
     VALUE ret = rb_hash_new();
@@ -201,7 +213,318 @@ RB_METHOD(httpPostBody) {
 #endif
 }
 
+using mkxp_net::HTTPTask;
+
+#if RAPI_FULL > 187
+DEF_TYPE_CUSTOMNAME(HTTPTask, "Request");
+#else
+DEF_ALLOCFUNC(HTTPTask);
+#endif
+
+static VALUE requestKlass;
+
+/* Requests made with a block, polled on every Graphics.update */
+static VALUE asyncCallbacks = Qnil;
+
+static mkxp_net::HTTPRequest makeRequest(VALUE path, VALUE rheaders, bool redirect) {
+    mkxp_net::HTTPRequest req(RSTRING_PTR(path), redirect);
+    if (rheaders != Qnil) {
+        auto headers = hash2StringMap(rheaders);
+        req.headers().insert(headers.begin(), headers.end());
+    }
+    return req;
+}
+
+static VALUE httpWrapTask(HTTPTask *task) {
+    task->start();
+    
+    VALUE request = rb_obj_alloc(requestKlass);
+    setPrivateData(request, task);
+    
+    if (rb_block_given_p()) {
+        rb_iv_set(request, "@callback", rb_block_proc());
+        rb_ary_push(asyncCallbacks, request);
+    }
+    
+    return request;
+}
+
+RB_METHOD(httpGetAsync) {
+    RB_UNUSED_PARAM;
+    
+    VALUE path, rheaders, redirect;
+    rb_scan_args(argc, argv, "12", &path, &rheaders, &redirect);
+    SafeStringValue(path);
+    
+    bool rd;
+    rb_bool_arg(redirect, &rd);
+    
+    HTTPTask *task = new HTTPTask(makeRequest(path, rheaders, rd), HTTPTask::Get);
+    
+    return httpWrapTask(task);
+}
+
+RB_METHOD(httpPostAsync) {
+    RB_UNUSED_PARAM;
+    
+    VALUE path, postDataHash, rheaders, redirect;
+    rb_scan_args(argc, argv, "22", &path, &postDataHash, &rheaders, &redirect);
+    SafeStringValue(path);
+    
+    bool rd;
+    rb_bool_arg(redirect, &rd);
+    
+    mkxp_net::StringMap postData = hash2StringMap(postDataHash);
+    
+    HTTPTask *task = new HTTPTask(makeRequest(path, rheaders, rd), HTTPTask::Post);
+    task->postData() = postData;
+    
+    return httpWrapTask(task);
+}
+
+RB_METHOD(httpPostBodyAsync) {
+    RB_UNUSED_PARAM;
+    
+    VALUE path, body, ctype, rheaders;
+    rb_scan_args(argc, argv, "31", &path, &body, &ctype, &rheaders);
+    SafeStringValue(path);
+    SafeStringValue(body);
+    SafeStringValue(ctype);
+    
+    HTTPTask *task = new HTTPTask(makeRequest(path, rheaders, true), HTTPTask::PostBody);
+    task->setBody(RSTRING_PTR(body), RSTRING_PTR(ctype));
+    
+    return httpWrapTask(task);
+}
+
+/* Options for downloads: :headers, :redirect, :resume, :crc32, :mount */
+struct DownloadOptions {
+    VALUE headers;
+    bool redirect;
+    bool resume;
+    bool mount;
+    bool checkCRC;
+    uint32_t crc;
+    
+    DownloadOptions(VALUE opts)
+    : headers(Qnil),
+      redirect(true),
+      resume(false),
+      mount(false),
+      checkCRC(false),
+      crc(0) {
+        if (NIL_P(opts))
+            return;
+        
+        Check_Type(opts, T_HASH);
+        
+        headers = rb_hash_aref(opts, ID2SYM(rb_intern("headers")));
+        
+        VALUE v = rb_hash_aref(opts, ID2SYM(rb_intern("redirect")));
+        if (v != Qnil) redirect = RTEST(v);
+        
+        resume = RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("resume"))));
+        mount = RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("mount"))));
+        
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("crc32")));
+        if (v != Qnil) {
+            checkCRC = true;
+            crc = NUM2UINT(v);
+        }
+    }
+};
+
+/* Makes a finished download available through the game's filesystem */
+static void httpMountDownload(const char *path) {
+    try {
+        shState->fileSystem().addPath(path, 0, true);
+        dataCacheClear();
+    } catch (Exception &e) {
+        raiseRbExc(e);
+    }
+}
+
+static bool httpStatusOK(int status) {
+    return status == 200 || status == 206;
+}
+
+#if RAPI_MAJOR >= 2
+typedef struct {
+    mkxp_net::HTTPRequest *req;
+    const char *path;
+    DownloadOptions *opts;
+} httpDownloadInternalArgs;
+
+void* httpDownloadInternal(void *args) {
+    VALUE ret;
+    
+    httpDownloadInternalArgs *a = (httpDownloadInternalArgs*)args;
+    
+    GUARD_EXC(
+              mkxp_net::HTTPResponse res = a->req->download(a->path, a->opts->resume,
+                                                            mkxp_net::DownloadProgress(),
+                                                            a->opts->checkCRC ? &a->opts->crc : 0);
+              ret = formResponse(res);
+              );
+    
+    return (void*)ret;
+}
+#endif
+
+RB_METHOD(httpDownload) {
+    RB_UNUSED_PARAM;
+    
+    VALUE url, path, ropts;
+    rb_scan_args(argc, argv, "21", &url, &path, &ropts);
+    SafeStringValue(url);
+    SafeStringValue(path);
+    
+    DownloadOptions opts(ropts);
+    mkxp_net::HTTPRequest req = makeRequest(url, opts.headers, opts.redirect);
+    
+    httpDownloadInternalArgs args {&req, RSTRING_PTR(path), &opts};
+#if RAPI_MAJOR >= 2
+    VALUE ret = (VALUE)rb_thread_call_without_gvl(httpDownloadInternal, &args, 0, 0);
+#else
+    VALUE ret = (VALUE)httpDownloadInternal(&args);
+#endif
+    
+    if (opts.mount && httpStatusOK(NUM2INT(rb_hash_aref(ret, ID2SYM(rb_intern("status"))))))
+        httpMountDownload(RSTRING_PTR(path));
+    
+    return ret;
+}
+
+RB_METHOD(httpDownloadAsync) {
+    RB_UNUSED_PARAM;
+    
+    VALUE url, path, ropts;
+    rb_scan_args(argc, argv, "21", &url, &path, &ropts);
+    SafeStringValue(url);
+    SafeStringValue(path);
+    
+    DownloadOptions opts(ropts);
+    
+    HTTPTask *task = new HTTPTask(makeRequest(url, opts.headers, opts.redirect), HTTPTask::Download);
+    task->setDownload(RSTRING_PTR(path), opts.resume, opts.checkCRC ? &opts.crc : 0);
+    
+    VALUE request = httpWrapTask(task);
+    
+    /* Mounted when the result is first looked at */
+    if (opts.mount)
+        rb_iv_set(request, "@mount", rb_str_dup(path));
+    
+    return request;
+}
+
+#if RAPI_MAJOR >= 2
+void* httpTaskWaitInternal(void *task) {
+    ((HTTPTask*)task)->wait();
+    
+    return 0;
+}
+#endif
+
+/* Waits for the response; raises if the request failed */
+static VALUE httpRequestResolve(VALUE self) {
+    VALUE ret = rb_iv_get(self, "@value");
+    
+    if (ret != Qnil)
+        return ret;
+    
+    HTTPTask *task = getPrivateData<HTTPTask>(self);
+    
+#if RAPI_MAJOR >= 2
+    rb_thread_call_without_gvl(httpTaskWaitInternal, task, 0, 0);
+#else
+    task->wait();
+#endif
+    
+    if (task->failed())
+        raiseRbExc(Exception(Exception::MKXPError, "%s", task->error().c_str()));
+    
+    VALUE mount = rb_iv_get(self, "@mount");
+    
+    if (mount != Qnil && httpStatusOK(task->response().status()))
+        httpMountDownload(RSTRING_PTR(mount));
+    
+    ret = formResponse(task->response());
+    rb_iv_set(self, "@value", ret);
+    
+    return ret;
+}
+
+RB_METHOD(httpRequestDone) {
+    RB_UNUSED_PARAM;
+    
+    return rb_bool_new(getPrivateData<HTTPTask>(self)->done());
+}
+
+RB_METHOD(httpRequestValue) {
+    RB_UNUSED_PARAM;
+    
+    return httpRequestResolve(self);
+}
+
+RB_METHOD(httpRequestError) {
+    RB_UNUSED_PARAM;
+    
+    HTTPTask *task = getPrivateData<HTTPTask>(self);
+    
+    if (!task->failed())
+        return Qnil;
+    
+    return rb_utf8_str_new_cstr(task->error().c_str());
+}
+
+RB_METHOD(httpRequestProgress) {
+    RB_UNUSED_PARAM;
+    
+    uint64_t received, total;
+    getPrivateData<HTTPTask>(self)->progress(received, total);
+    
+    return rb_ary_new3(2, ULL2NUM(received), ULL2NUM(total));
+}
+
+/* Runs the blocks of all finished async requests. Blocks
+ * of failed requests get nil (see HTTPLite::Request#error) */
+void httpProcessAsyncRequests() {
+    if (NIL_P(asyncCallbacks) || RARRAY_LEN(asyncCallbacks) == 0)
+        return;
+    
+    VALUE ready = rb_ary_new();
+    VALUE pending = rb_ary_new();
+    
+    for (long i = 0; i < RARRAY_LEN(asyncCallbacks); ++i) {
+        VALUE request = rb_ary_entry(asyncCallbacks, i);
+        
+        if (getPrivateData<HTTPTask>(request)->done())
+            rb_ary_push(ready, request);
+        else
+            rb_ary_push(pending, request);
+    }
+    
+    /* Blocks may start further requests */
+    asyncCallbacks = pending;
+    
+    for (long i = 0; i < RARRAY_LEN(ready); ++i) {
+        VALUE request = rb_ary_entry(ready, i);
+        VALUE res = Qnil;
+        
+        if (!getPrivateData<HTTPTask>(request)->failed())
+            res = httpRequestResolve(request);
+        
+        rb_funcall(rb_iv_get(request, "@callback"), rb_intern("call"), 1, res);
+    }
+}
+
+static VALUE json2rbKeys(json5pp::value const &v, bool symbolize);
+
 VALUE json2rb(json5pp::value const &v) {
+    return json2rbKeys(v, false);
+}
+
+static VALUE json2rbKeys(json5pp::value const &v, bool symbolize) {
     if (v.is_null())
         return Qnil;
     
@@ -221,7 +544,7 @@ VALUE json2rb(json5pp::value const &v) {
         auto &a = v.as_array();
         VALUE ret = rb_ary_new();
         for (auto item : a) {
-            rb_ary_push(ret, json2rb(item));
+            rb_ary_push(ret, json2rbKeys(item, symbolize));
         }
         return ret;
     }
@@ -230,7 +553,10 @@ VALUE json2rb(json5pp::value const &v) {
         auto &o = v.as_object();
         VALUE ret = rb_hash_new();
         for (auto const &pair : o) {
-            rb_hash_aset(ret, rb_utf8_str_new_cstr(pair.first.c_str()), json2rb(pair.second));
+            VALUE key = rb_utf8_str_new_cstr(pair.first.c_str());
+            if (symbolize)
+                key = rb_str_intern(key);
+            rb_hash_aset(ret, key, json2rbKeys(pair.second, symbolize));
         }
         return ret;
     }
@@ -286,13 +612,578 @@ json5pp::value rb2json(VALUE v) {
     return json5pp::value(0);
 }
 
+/* Scans 8 bytes at a time for a byte that ends a plain run
+ * of string characters: '"', '\\' or a control character */
+static inline bool jsonWordIsPlain(const char *p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    
+    const uint64_t quote = w ^ (ones * '"');
+    const uint64_t slash = w ^ (ones * '\\');
+    
+    const uint64_t special = ((quote - ones) & ~quote) |
+                             ((slash - ones) & ~slash) |
+                             ((w - ones * 0x20) & ~w);
+    
+    return (special & highs) == 0;
+}
+
+static inline bool jsonByteIsPlain(unsigned char c) {
+    return c != '"' && c != '\\' && c >= 0x20;
+}
+
+/* Returns the end of the run of plain characters starting at 'p' */
+static const char *jsonScanPlain(const char *p, const char *end) {
+    while (end - p >= 8 && jsonWordIsPlain(p))
+        p += 8;
+    
+    while (p < end && jsonByteIsPlain(*p))
+        ++p;
+    
+    return p;
+}
+
+/* Strict (ECMA-404) JSON straight to Ruby objects, without
+ * building an intermediate json5pp tree. Returns false on
+ * anything it doesn't accept, so the caller can fall back
+ * to the JSON5 parser (which also reports the error) */
+class FastJSONParser {
+public:
+    FastJSONParser(const char *str, long len, bool symbolize)
+    : p(str), end(str + len), symbolize(symbolize), depth(0) {}
+    
+    bool parse(VALUE &out) {
+        skipSpace();
+        
+        if (!parseValue(out))
+            return false;
+        
+        skipSpace();
+        return p == end;
+    }
+    
+private:
+    const char *p;
+    const char *end;
+    bool symbolize;
+    int depth;
+    
+    /* Reused for strings containing escapes */
+    std::string scratch;
+    
+    enum { MaxDepth = 512 };
+    
+    void skipSpace() {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+            ++p;
+    }
+    
+    bool literal(const char *word, size_t len) {
+        if ((size_t)(end - p) < len || memcmp(p, word, len))
+            return false;
+        
+        p += len;
+        return true;
+    }
+    
+    bool parseValue(VALUE &out) {
+        if (p == end)
+            return false;
+        
+        switch (*p) {
+            case '{':
+                return parseObject(out);
+            case '[':
+                return parseArray(out);
+            case '"':
+                return parseString(out);
+            case 't':
+                out = Qtrue;
+                return literal("true", 4);
+            case 'f':
+                out = Qfalse;
+                return literal("false", 5);
+            case 'n':
+                out = Qnil;
+                return literal("null", 4);
+            default:
+                return parseNumber(out);
+        }
+    }
+    
+    bool parseObject(VALUE &out) {
+        if (++depth > MaxDepth)
+            return false;
+        
+        ++p;
+        out = rb_hash_new();
+        skipSpace();
+        
+        if (p < end && *p == '}') {
+            ++p;
+            --depth;
+            return true;
+        }
+        
+        while (true) {
+            VALUE key, val;
+            
+            if (p == end || *p != '"' || !parseString(key))
+                return false;
+            
+            skipSpace();
+            if (p == end || *p++ != ':')
+                return false;
+            
+            skipSpace();
+            if (!parseValue(val))
+                return false;
+            
+            /* Frozen string keys are stored without another copy */
+            key = symbolize ? rb_str_intern(key) : rb_str_freeze(key);
+            rb_hash_aset(out, key, val);
+            
+            skipSpace();
+            if (p == end)
+                return false;
+            
+            if (*p == '}')
+                break;
+            
+            if (*p++ != ',')
+                return false;
+            
+            skipSpace();
+        }
+        
+        ++p;
+        --depth;
+        return true;
+    }
+    
+    bool parseArray(VALUE &out) {
+        if (++depth > MaxDepth)
+            return false;
+        
+        ++p;
+        out = rb_ary_new();
+        skipSpace();
+        
+        if (p < end && *p == ']') {
+            ++p;
+            --depth;
+            return true;
+        }
+        
+        while (true) {
+            VALUE val;
+            
+            if (!parseValue(val))
+                return false;
+            
+            rb_ary_push(out, val);
+            
+            skipSpace();
+            if (p == end)
+                return false;
+            
+            if (*p == ']')
+                break;
+            
+            if (*p++ != ',')
+                return false;
+            
+            skipSpace();
+        }
+        
+        ++p;
+        --depth;
+        return true;
+    }
+    
+    static int hexDigit(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+    
+    bool parseHex4(uint32_t &out) {
+        if (end - p < 4)
+            return false;
+        
+        out = 0;
+        for (int i = 0; i < 4; ++i) {
+            int d = hexDigit(*p++);
+            if (d < 0)
+                return false;
+            out = (out << 4) | d;
+        }
+        
+        return true;
+    }
+    
+    void appendUTF8(uint32_t c) {
+        if (c < 0x80) {
+            scratch += (char)c;
+        }
+        else if (c < 0x800) {
+            scratch += (char)(0xC0 | (c >> 6));
+            scratch += (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000) {
+            scratch += (char)(0xE0 | (c >> 12));
+            scratch += (char)(0x80 | ((c >> 6) & 0x3F));
+            scratch += (char)(0x80 | (c & 0x3F));
+        }
+        else {
+            scratch += (char)(0xF0 | (c >> 18));
+            scratch += (char)(0x80 | ((c >> 12) & 0x3F));
+            scratch += (char)(0x80 | ((c >> 6) & 0x3F));
+            scratch += (char)(0x80 | (c & 0x3F));
+        }
+    }
+    
+    bool parseEscape() {
+        if (p == end)
+            return false;
+        
+        switch (*p++) {
+            case '"':  scratch += '"';  return true;
+            case '\\': scratch += '\\'; return true;
+            case '/':  scratch += '/';  return true;
+            case 'b':  scratch += '\b'; return true;
+            case 'f':  scratch += '\f'; return true;
+            case 'n':  scratch += '\n'; return true;
+            case 'r':  scratch += '\r'; return true;
+            case 't':  scratch += '\t'; return true;
+            case 'u':
+                break;
+            default:
+                return false;
+        }
+        
+        uint32_t c;
+        if (!parseHex4(c))
+            return false;
+        
+        if (c >= 0xDC00 && c <= 0xDFFF)
+            return false;
+        
+        if (c >= 0xD800 && c <= 0xDBFF) {
+            uint32_t low;
+            
+            if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+                return false;
+            
+            p += 2;
+            if (!parseHex4(low) || low < 0xDC00 || low > 0xDFFF)
+                return false;
+            
+            c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+        }
+        
+        appendUTF8(c);
+        return true;
+    }
+    
+    bool parseString(VALUE &out) {
+        const char *start = ++p;
+        p = jsonScanPlain(p, end);
+        
+        if (p == end)
+            return false;
+        
+        /* Common case, no escapes: one copy straight into Ruby */
+        if (*p == '"') {
+            out = rb_utf8_str_new(start, p - start);
+            ++p;
+            return true;
+        }
+        
+        scratch.assign(start, p - start);
+        
+        while (true) {
+            if (p == end)
+                return false;
+            
+            if (*p == '"')
+                break;
+            
+            if (*p != '\\')
+                return false;
+            
+            ++p;
+            if (!parseEscape())
+                return false;
+            
+            start = p;
+            p = jsonScanPlain(p, end);
+            scratch.append(start, p - start);
+        }
+        
+        ++p;
+        out = rb_utf8_str_new(scratch.data(), scratch.size());
+        return true;
+    }
+    
+    static bool isDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+    
+    bool parseNumber(VALUE &out) {
+        const char *start = p;
+        
+        if (p < end && *p == '-')
+            ++p;
+        
+        if (p == end || !isDigit(*p))
+            return false;
+        
+        if (*p == '0')
+            ++p;
+        else
+            while (p < end && isDigit(*p))
+                ++p;
+        
+        if (p < end && *p == '.') {
+            ++p;
+            if (p == end || !isDigit(*p))
+                return false;
+            while (p < end && isDigit(*p))
+                ++p;
+        }
+        
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            ++p;
+            if (p < end && (*p == '+' || *p == '-'))
+                ++p;
+            if (p == end || !isDigit(*p))
+                return false;
+            while (p < end && isDigit(*p))
+                ++p;
+        }
+        
+        /* The input isn't necessarily terminated right after */
+        char buf[64];
+        const size_t len = p - start;
+        
+        if (len < sizeof(buf)) {
+            memcpy(buf, start, len);
+            buf[len] = 0;
+            out = rb_float_new(strtod(buf, 0));
+        }
+        else {
+            std::string num(start, len);
+            out = rb_float_new(strtod(num.c_str(), 0));
+        }
+        
+        return true;
+    }
+};
+
+/* Writes JSON into one growing Ruby string, in the
+ * same layout as json5pp's stringify5 with two space indent */
+class FastJSONWriter {
+public:
+    FastJSONWriter()
+    : out(rb_str_buf_new(4096)), depth(0) {
+#if RAPI_FULL >= 190
+        rb_enc_associate(out, rb_utf8_encoding());
+#endif
+    }
+    
+    VALUE result() const {
+        return out;
+    }
+    
+    void write(VALUE v) {
+        if (v == Qnil) {
+            cat("null");
+        }
+        else if (v == Qtrue) {
+            cat("true");
+        }
+        else if (v == Qfalse) {
+            cat("false");
+        }
+        else if (RB_TYPE_P(v, RUBY_T_STRING)) {
+            writeString(RSTRING_PTR(v), RSTRING_LEN(v));
+        }
+        else if (RB_TYPE_P(v, RUBY_T_FLOAT)) {
+            writeFloat(RFLOAT_VALUE(v));
+        }
+        else if (RB_TYPE_P(v, RUBY_T_FIXNUM) || RB_TYPE_P(v, RUBY_T_BIGNUM)) {
+            rb_str_buf_append(out, rb_obj_as_string(v));
+        }
+        else if (RB_TYPE_P(v, RUBY_T_ARRAY)) {
+            writeArray(v);
+        }
+        else if (RTEST(rb_funcall(v, rb_intern("is_a?"), 1, rb_cHash))) {
+            writeHash(v);
+        }
+        else {
+            raiseRbExc(Exception(Exception::MKXPError, "Invalid value for JSON: %s", RSTRING_PTR(rb_inspect(v))));
+        }
+    }
+    
+private:
+    VALUE out;
+    int depth;
+    
+    enum { MaxDepth = 512 };
+    
+    void cat(const char *str) {
+        rb_str_buf_cat(out, str, strlen(str));
+    }
+    
+    void newline() {
+        rb_str_buf_cat(out, "\n", 1);
+        
+        for (int i = 0; i < depth; ++i)
+            rb_str_buf_cat(out, "  ", 2);
+    }
+    
+    void enter() {
+        if (++depth > MaxDepth)
+            raiseRbExc(Exception(Exception::MKXPError, "JSON nesting too deep (circular reference?)"));
+    }
+    
+    void writeFloat(double d) {
+        if (isnan(d)) {
+            cat("NaN");
+            return;
+        }
+        
+        if (isinf(d)) {
+            cat(d > 0 ? "Infinity" : "-Infinity");
+            return;
+        }
+        
+        /* Shortest of the two that reads back exactly */
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.15g", d);
+        
+        if (strtod(buf, 0) != d)
+            snprintf(buf, sizeof(buf), "%.17g", d);
+        
+        cat(buf);
+    }
+    
+    void writeString(const char *str, long len) {
+        static const char hex[] = "0123456789abcdef";
+        const char *p = str;
+        const char *end = str + len;
+        
+        rb_str_buf_cat(out, "\"", 1);
+        
+        while (p < end) {
+            const char *run = p;
+            p = jsonScanPlain(p, end);
+            
+            if (p > run)
+                rb_str_buf_cat(out, run, p - run);
+            
+            if (p == end)
+                break;
+            
+            const unsigned char ch = *p++;
+            
+            switch (ch) {
+                case '"':  cat("\\\""); break;
+                case '\\': cat("\\\\"); break;
+                case '\b': cat("\\b");  break;
+                case '\f': cat("\\f");  break;
+                case '\n': cat("\\n");  break;
+                case '\r': cat("\\r");  break;
+                case '\t': cat("\\t");  break;
+                default: {
+                    char esc[7] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xf], 0 };
+                    cat(esc);
+                }
+            }
+        }
+        
+        rb_str_buf_cat(out, "\"", 1);
+    }
+    
+    void writeArray(VALUE ary) {
+        if (RARRAY_LEN(ary) == 0) {
+            cat("[]");
+            return;
+        }
+        
+        enter();
+        cat("[");
+        
+        for (long i = 0; i < RARRAY_LEN(ary); ++i) {
+            if (i > 0)
+                cat(",");
+            
+            newline();
+            write(rb_ary_entry(ary, i));
+        }
+        
+        --depth;
+        newline();
+        cat("]");
+    }
+    
+    void writeHash(VALUE hash) {
+        VALUE keys = rb_funcall(hash, rb_intern("keys"), 0);
+        
+        if (RARRAY_LEN(keys) == 0) {
+            cat("{}");
+            return;
+        }
+        
+        enter();
+        cat("{");
+        
+        for (long i = 0; i < RARRAY_LEN(keys); ++i) {
+            VALUE key = rb_ary_entry(keys, i);
+            VALUE val = rb_hash_aref(hash, key);
+            
+            if (SYMBOL_P(key))
+                key = rb_sym2str(key);
+            
+            SafeStringValue(key);
+            
+            if (i > 0)
+                cat(",");
+            
+            newline();
+            writeString(RSTRING_PTR(key), RSTRING_LEN(key));
+            cat(": ");
+            write(val);
+        }
+        
+        --depth;
+        newline();
+        cat("}");
+    }
+};
+
 RB_METHOD(httpJsonParse) {
     RB_UNUSED_PARAM;
     
-    VALUE jsonv;
-    rb_scan_args(argc, argv, "1", &jsonv);
+    VALUE jsonv, symbolize;
+    rb_scan_args(argc, argv, "11", &jsonv, &symbolize);
     SafeStringValue(jsonv);
     
+    const bool sym = RTEST(symbolize);
+    
+    /* Plain JSON (eg. anything written by stringify) takes the
+     * fast path, JSON5 extensions and errors go to json5pp */
+    FastJSONParser fast(RSTRING_PTR(jsonv), RSTRING_LEN(jsonv), sym);
+    VALUE ret;
+    
+    if (fast.parse(ret))
+        return ret;
+    
     json5pp::value v;
     try {
         v = json5pp::parse5(RSTRING_PTR(jsonv));
@@ -301,7 +1192,7 @@ RB_METHOD(httpJsonParse) {
         raiseRbExc(Exception(Exception::MKXPError, "Failed to parse JSON: %s", e.what()));
     }
     
-    return json2rb(v);
+    return json2rbKeys(v, sym);
 }
 
 RB_METHOD(httpJsonStringify) {
@@ -310,8 +1201,10 @@ RB_METHOD(httpJsonStringify) {
     VALUE obj;
     rb_scan_args(argc, argv, "1", &obj);
     
-    json5pp::value v = rb2json(obj);
-    return rb_utf8_str_new_cstr(v.stringify5(json5pp::rule::space_indent<>()).c_str());
+    FastJSONWriter writer;
+    writer.write(obj);
+    
+    return writer.result();
 }
 
 void httpBindingInit() {
@@ -320,6 +1213,36 @@ void httpBindingInit() {
     _rb_define_module_function(mNet, "post", httpPost);
     _rb_define_module_function(mNet, "post_body", httpPostBody);
     
+    _rb_define_module_function(mNet, "get_async", httpGetAsync);
+    _rb_define_module_function(mNet, "post_async", httpPostAsync);
+    _rb_define_module_function(mNet, "post_body_async", httpPostBodyAsync);
+    
+    _rb_define_module_function(mNet, "download", httpDownload);
+    _rb_define_module_function(mNet, "download_async", httpDownloadAsync);
+    
+    requestKlass = rb_define_class_under(mNet, "Request", rb_cObject);
+#if RAPI_FULL > 187
+    rb_define_alloc_func(requestKlass, classAllocate<&HTTPTaskType>);
+#else
+    rb_define_alloc_func(requestKlass, HTTPTaskAllocate);
+#endif
+    _rb_define_method(requestKlass, "done?", httpRequestDone);
+    _rb_define_method(requestKlass, "value", httpRequestValue);
+    _rb_define_method(requestKlass, "error", httpRequestError);
+    _rb_define_method(requestKlass, "progress", httpRequestProgress);
+    
+    asyncCallbacks = rb_ary_new();
+    rb_gc_register_address(&asyncCallbacks);
+    
+    const Config &conf = shState->config();
+    
+    if (conf.httpCache && !conf.customDataPath.empty()) {
+        const std::string dir = conf.customDataPath + "/HTTPCache";
+        
+        if (mkxp_fs::createDirectories(dir.c_str()))
+            mkxp_net::setHTTPCacheDirectory(dir.c_str());
+    }
+    
     VALUE mNetJSON = rb_define_module_under(mNet, "JSON");
     _rb_define_module_function(mNetJSON, "stringify", httpJsonStringify);
     _rb_define_module_function(mNetJSON, "parse", httpJsonParse);
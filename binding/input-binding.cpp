@@ -24,6 +24,8 @@
 
 
 #include "eventthread.h"
+#include "graphics.h"
+#include "config.h"
 
 #include "binding-util.h"
 #include "util/exception.h"
@@ -40,6 +42,19 @@ RB_METHOD(inputDelta) {
 RB_METHOD(inputUpdate) {
     RB_UNUSED_PARAM;
     
+    if (shState->config().inputLateLatch) {
+#if RAPI_MAJOR >= 2
+        rb_thread_call_without_gvl([](void*) -> void* {
+            GFX_LOCK;
+            shState->graphics().presentPending();
+            GFX_UNLOCK;
+            return 0;
+        }, 0, 0, 0);
+#else
+        shState->graphics().presentPending();
+#endif
+    }
+    
     shState->input().update();
     
     return Qnil;
@@ -172,6 +187,42 @@ RB_METHOD(inputRepeatTime) {
     return rb_float_new(shState->input().repeatTime(num));
 }
 
+RB_METHOD(inputPressTime) {
+    RB_UNUSED_PARAM;
+    
+    rb_check_argc(argc, 1);
+    
+    VALUE button;
+    rb_scan_args(argc, argv, "1", &button);
+    
+    int num = getButtonArg(&button);
+    
+    return rb_float_new(shState->input().pressTime(num));
+}
+
+RB_METHOD(inputEvents) {
+    RB_UNUSED_PARAM;
+    
+    static const char *sources[] = { "key", "controller", "mouse" };
+    
+    const std::vector<Input::Event> &events = shState->input().events();
+    VALUE ret = rb_ary_new2(events.size());
+    
+    for (size_t i = 0; i < events.size(); ++i) {
+        const Input::Event &ev = events[i];
+        
+        VALUE entry = rb_ary_new2(4);
+        rb_ary_push(entry, ID2SYM(rb_intern(sources[ev.source])));
+        rb_ary_push(entry, INT2FIX(ev.code));
+        rb_ary_push(entry, rb_bool_new(ev.down));
+        rb_ary_push(entry, rb_float_new(ev.time));
+        
+        rb_ary_push(ret, entry);
+    }
+    
+    return ret;
+}
+
 RB_METHOD(inputPressEx) {
     RB_UNUSED_PARAM;
     
@@ -575,6 +626,8 @@ void inputBindingInit() {
     _rb_define_module_function(module, "release?", inputRelease);
     _rb_define_module_function(module, "count", inputCount);
     _rb_define_module_function(module, "time?", inputRepeatTime);
+    _rb_define_module_function(module, "press_time", inputPressTime);
+    _rb_define_module_function(module, "events", inputEvents);
     _rb_define_module_function(module, "pressex?", inputPressEx);
     _rb_define_module_function(module, "triggerex?", inputTriggerEx);
     _rb_define_module_function(module, "repeatex?", inputRepeatEx);
@@ -0,0 +1,670 @@
+/*
+ ** marshal-load.cpp
+ **
+ ** This file is part of mkxp.
+ **
+ ** mkxp is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 2 of the License, or
+ ** (at your option) any later version.
+ **
+ ** mkxp is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "marshal-load.h"
+
+#include "binding-util.h"
+#include "binding-types.h"
+#include "etc.h"
+#include "table.h"
+
+#if RAPI_FULL > 187
+#include "ruby/encoding.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Covers everything RPG Maker's data files are made of: nil,
+ * booleans, fixnums, floats, strings, symbols, arrays, hashes,
+ * plain objects, classes/modules, and '_load'/'marshal_load'
+ * types. Table, Color, Tone and Rect are deserialized directly.
+ * Anything else (bignums, structs, regexps, extended objects,
+ * String/Array/Hash subclasses, non UTF-8 encodings) makes the
+ * whole load fall back to Ruby's own Marshal.
+ *
+ * Ruby errors may long jump out of any of this, so no state
+ * with destructors is kept on the stack */
+
+#define TYPE_NIL '0'
+#define TYPE_TRUE 'T'
+#define TYPE_FALSE 'F'
+#define TYPE_FIXNUM 'i'
+#define TYPE_IVAR 'I'
+#define TYPE_OBJECT 'o'
+#define TYPE_USERDEF 'u'
+#define TYPE_USRMARSHAL 'U'
+#define TYPE_FLOAT 'f'
+#define TYPE_STRING '"'
+#define TYPE_ARRAY '['
+#define TYPE_HASH '{'
+#define TYPE_HASH_DEF '}'
+#define TYPE_CLASS 'c'
+#define TYPE_MODULE 'm'
+#define TYPE_SYMBOL ':'
+#define TYPE_SYMLINK ';'
+#define TYPE_LINK '@'
+
+struct MarshalReader
+{
+	VALUE src;
+	long offset;
+	long size;
+
+	/* Ruby arrays, so the GC sees their contents */
+	VALUE objects;
+	VALUE symbols;
+	/* Maps class path symbols to the classes */
+	VALUE classCache;
+
+	bool unsupported;
+
+	VALUE tableKlass;
+	VALUE colorKlass;
+	VALUE toneKlass;
+	VALUE rectKlass;
+
+	ID idE;
+	ID idLoad;
+	ID idMarshalLoad;
+
+	/* Re-fetched on every access, in case the GC moves 'src' */
+	const char *ptr() const
+	{
+		return RSTRING_PTR(src) + offset;
+	}
+
+	bool fail()
+	{
+		unsupported = true;
+		return false;
+	}
+
+	bool readByte(int &c)
+	{
+		if (offset >= size)
+			return fail();
+
+		c = (unsigned char) *ptr();
+		++offset;
+
+		return true;
+	}
+
+	bool readLong(long &x)
+	{
+		int c;
+
+		if (!readByte(c))
+			return false;
+
+		c = (signed char) c;
+
+		if (c == 0)
+		{
+			x = 0;
+			return true;
+		}
+
+		if (c > 4)
+		{
+			x = c - 5;
+			return true;
+		}
+
+		if (c < -4)
+		{
+			x = c + 5;
+			return true;
+		}
+
+		const int n = (c > 0) ? c : -c;
+
+		if (offset + n > size)
+			return fail();
+
+		const unsigned char *b = (const unsigned char*) ptr();
+		offset += n;
+
+		if (c > 0)
+		{
+			x = 0;
+
+			for (int i = 0; i < n; ++i)
+				x |= (long) b[i] << (8 * i);
+		}
+		else
+		{
+			x = -1;
+
+			for (int i = 0; i < n; ++i)
+			{
+				x &= ~((long) 0xFF << (8 * i));
+				x |= (long) b[i] << (8 * i);
+			}
+		}
+
+		return true;
+	}
+
+	/* Returns the offset of 'len' bytes in 'src' */
+	bool readBytes(long &start, long &len)
+	{
+		if (!readLong(len) || len < 0 || len > size - offset)
+			return fail();
+
+		start = offset;
+		offset += len;
+
+		return true;
+	}
+
+	VALUE entry(VALUE obj)
+	{
+		rb_ary_push(objects, obj);
+
+		return obj;
+	}
+
+	/* An 'E' instance variable, other encodings aren't handled */
+	bool applyEncoding(VALUE obj, ID name, VALUE value)
+	{
+		if (name != idE)
+			return fail();
+
+		if (value == Qtrue)
+			rb_enc_associate_index(obj, rb_utf8_encindex());
+		else if (value == Qfalse)
+			rb_enc_associate_index(obj, rb_usascii_encindex());
+		else
+			return fail();
+
+		return true;
+	}
+
+	bool readSymbolReal(bool ivar, VALUE &sym)
+	{
+		long start, len;
+
+		if (!readBytes(start, len))
+			return false;
+
+		/* Takes its index before any of its instance variables */
+		const long index = RARRAY_LEN(symbols);
+		rb_ary_push(symbols, Qnil);
+
+		bool utf8 = false;
+
+		if (ivar)
+		{
+			long count;
+
+			if (!readLong(count))
+				return false;
+
+			for (long i = 0; i < count; ++i)
+			{
+				VALUE name, value;
+
+				if (!readSymbol(name) || !readValue(value))
+					return false;
+
+				if (SYM2ID(name) != idE || (value != Qtrue && value != Qfalse))
+					return fail();
+
+				utf8 = (value == Qtrue);
+			}
+		}
+
+		rb_encoding *enc = utf8 ? rb_utf8_encoding() : rb_ascii8bit_encoding();
+		sym = ID2SYM(rb_intern3(RSTRING_PTR(src) + start, len, enc));
+
+		rb_ary_store(symbols, index, sym);
+
+		return true;
+	}
+
+	bool readSymbol(VALUE &sym)
+	{
+		int type;
+
+		if (!readByte(type))
+			return false;
+
+		switch (type)
+		{
+		case TYPE_SYMBOL :
+			return readSymbolReal(false, sym);
+
+		case TYPE_SYMLINK :
+		{
+			long index;
+
+			if (!readLong(index) || index < 0 || index >= RARRAY_LEN(symbols))
+				return fail();
+
+			sym = rb_ary_entry(symbols, index);
+			return true;
+		}
+
+		case TYPE_IVAR :
+			if (!readByte(type) || type != TYPE_SYMBOL)
+				return fail();
+
+			return readSymbolReal(true, sym);
+		}
+
+		return fail();
+	}
+
+	bool readClass(VALUE &klass)
+	{
+		VALUE path;
+
+		if (!readSymbol(path))
+			return false;
+
+		klass = rb_hash_lookup2(classCache, path, Qundef);
+
+		if (klass == Qundef)
+		{
+			/* Raises the same ArgumentError Marshal would */
+			klass = rb_path_to_class(rb_sym2str(path));
+			rb_hash_aset(classCache, path, klass);
+		}
+
+		return true;
+	}
+
+	/* (count, name, value...) pairs following an object */
+	bool readIvars(VALUE obj)
+	{
+		long count;
+
+		if (!readLong(count))
+			return false;
+
+		for (long i = 0; i < count; ++i)
+		{
+			VALUE name, value;
+
+			if (!readSymbol(name) || !readValue(value))
+				return false;
+
+			rb_ivar_set(obj, SYM2ID(name), value);
+		}
+
+		return true;
+	}
+
+	/* Same, but only encoding markers are allowed */
+	bool readEncodingIvars(VALUE str)
+	{
+		long count;
+
+		if (!readLong(count))
+			return false;
+
+		for (long i = 0; i < count; ++i)
+		{
+			VALUE name, value;
+
+			if (!readSymbol(name) || !readValue(value))
+				return false;
+
+			if (!applyEncoding(str, SYM2ID(name), value))
+				return false;
+		}
+
+		return true;
+	}
+
+	bool readString(VALUE &str, bool ivar)
+	{
+		long start, len;
+
+		if (!readBytes(start, len))
+			return false;
+
+		/* Strings without an encoding are forced to UTF-8,
+		 * like the proc installed with Marshal.load does */
+		str = entry(rb_enc_str_new(RSTRING_PTR(src) + start, len, rb_utf8_encoding()));
+
+		return !ivar || readEncodingIvars(str);
+	}
+
+	bool readUserDef(VALUE &obj, bool ivar)
+	{
+		VALUE klass;
+		long start, len;
+
+		if (!readClass(klass) || !readBytes(start, len))
+			return false;
+
+		if (!ivar)
+		{
+			/* Our own types need no intermediate data string */
+			const char *data = RSTRING_PTR(src) + start;
+
+			if (klass == tableKlass)
+				obj = objectLoadData<Table>(klass, data, len);
+			else if (klass == colorKlass)
+				obj = objectLoadData<Color>(klass, data, len);
+			else if (klass == toneKlass)
+				obj = objectLoadData<Tone>(klass, data, len);
+			else if (klass == rectKlass)
+				obj = objectLoadData<Rect>(klass, data, len);
+			else
+				obj = Qundef;
+
+			if (obj != Qundef)
+			{
+				entry(obj);
+				return true;
+			}
+		}
+
+		if (!rb_respond_to(klass, idLoad))
+			return fail();
+
+		VALUE data = rb_str_new(RSTRING_PTR(src) + start, len);
+
+		if (ivar && !readEncodingIvars(data))
+			return false;
+
+		obj = entry(rb_funcall2(klass, idLoad, 1, &data));
+
+		return true;
+	}
+
+	bool readFloat(VALUE &obj)
+	{
+		long start, len;
+
+		if (!readBytes(start, len))
+			return false;
+
+		char buf[64];
+
+		if (len >= (long) sizeof(buf))
+			return fail();
+
+		memcpy(buf, RSTRING_PTR(src) + start, len);
+		buf[len] = '\0';
+
+		double d;
+
+		if (!strcmp(buf, "nan"))
+			d = NAN;
+		else if (!strcmp(buf, "inf"))
+			d = HUGE_VAL;
+		else if (!strcmp(buf, "-inf"))
+			d = -HUGE_VAL;
+		else
+			d = strtod(buf, 0);
+
+		obj = entry(DBL2NUM(d));
+
+		return true;
+	}
+
+	bool readValue(VALUE &obj)
+	{
+		int type;
+
+		if (!readByte(type))
+			return false;
+
+		switch (type)
+		{
+		case TYPE_NIL :
+			obj = Qnil;
+			return true;
+
+		case TYPE_TRUE :
+			obj = Qtrue;
+			return true;
+
+		case TYPE_FALSE :
+			obj = Qfalse;
+			return true;
+
+		case TYPE_FIXNUM :
+		{
+			long x;
+
+			if (!readLong(x))
+				return false;
+
+			obj = LONG2NUM(x);
+			return true;
+		}
+
+		case TYPE_SYMBOL :
+			return readSymbolReal(false, obj);
+
+		case TYPE_SYMLINK :
+			--offset;
+			return readSymbol(obj);
+
+		case TYPE_LINK :
+		{
+			long index;
+
+			if (!readLong(index) || index < 0 || index >= RARRAY_LEN(objects))
+				return fail();
+
+			obj = rb_ary_entry(objects, index);
+			return true;
+		}
+
+		case TYPE_IVAR :
+		{
+			if (!readByte(type))
+				return false;
+
+			if (type == TYPE_STRING)
+				return readString(obj, true);
+
+			if (type == TYPE_USERDEF)
+				return readUserDef(obj, true);
+
+			if (type == TYPE_SYMBOL)
+				return readSymbolReal(true, obj);
+
+			return fail();
+		}
+
+		case TYPE_STRING :
+			return readString(obj, false);
+
+		case TYPE_FLOAT :
+			return readFloat(obj);
+
+		case TYPE_ARRAY :
+		{
+			long len;
+
+			if (!readLong(len) || len < 0 || len > size - offset)
+				return fail();
+
+			obj = entry(rb_ary_new2(len));
+
+			for (long i = 0; i < len; ++i)
+			{
+				VALUE value;
+
+				if (!readValue(value))
+					return false;
+
+				rb_ary_push(obj, value);
+			}
+
+			return true;
+		}
+
+		case TYPE_HASH :
+		case TYPE_HASH_DEF :
+		{
+			long len;
+
+			if (!readLong(len) || len < 0 || len > size - offset)
+				return fail();
+
+			obj = entry(rb_hash_new());
+
+			for (long i = 0; i < len; ++i)
+			{
+				VALUE key, value;
+
+				if (!readValue(key) || !readValue(value))
+					return false;
+
+				rb_hash_aset(obj, key, value);
+			}
+
+			if (type == TYPE_HASH_DEF)
+			{
+				VALUE def;
+
+				if (!readValue(def))
+					return false;
+
+				RHASH_SET_IFNONE(obj, def);
+			}
+
+			return true;
+		}
+
+		case TYPE_OBJECT :
+		{
+			VALUE klass;
+
+			if (!readClass(klass))
+				return false;
+
+			if (!RB_TYPE_P(klass, RUBY_T_CLASS))
+				return fail();
+
+			obj = rb_obj_alloc(klass);
+
+			if (!RB_TYPE_P(obj, RUBY_T_OBJECT))
+				return fail();
+
+			entry(obj);
+
+			return readIvars(obj);
+		}
+
+		case TYPE_USERDEF :
+			return readUserDef(obj, false);
+
+		case TYPE_USRMARSHAL :
+		{
+			VALUE klass, data;
+
+			if (!readClass(klass))
+				return false;
+
+			obj = rb_obj_alloc(klass);
+
+			if (!rb_respond_to(obj, idMarshalLoad))
+				return fail();
+
+			entry(obj);
+
+			if (!readValue(data))
+				return false;
+
+			rb_funcall2(obj, idMarshalLoad, 1, &data);
+
+			return true;
+		}
+
+		case TYPE_CLASS :
+		case TYPE_MODULE :
+		{
+			long start, len;
+
+			if (!readBytes(start, len))
+				return false;
+
+			VALUE path = rb_str_new(RSTRING_PTR(src) + start, len);
+			obj = entry(rb_path_to_class(path));
+
+			if (!RB_TYPE_P(obj, type == TYPE_CLASS ? RUBY_T_CLASS : RUBY_T_MODULE))
+				return fail();
+
+			return true;
+		}
+		}
+
+		return fail();
+	}
+};
+
+VALUE marshalLoadFast(VALUE str)
+{
+	if (!RB_TYPE_P(str, RUBY_T_STRING) || RSTRING_LEN(str) < 2)
+		return Qundef;
+
+	const char *header = RSTRING_PTR(str);
+
+	if (header[0] != 4 || header[1] != 8)
+		return Qundef;
+
+	MarshalReader r;
+	r.src = str;
+	r.offset = 2;
+	r.size = RSTRING_LEN(str);
+	r.objects = rb_ary_new();
+	r.symbols = rb_ary_new();
+	r.classCache = rb_hash_new();
+	r.unsupported = false;
+
+	r.tableKlass = rb_const_get(rb_cObject, rb_intern("Table"));
+	r.colorKlass = rb_const_get(rb_cObject, rb_intern("Color"));
+	r.toneKlass = rb_const_get(rb_cObject, rb_intern("Tone"));
+	r.rectKlass = rb_const_get(rb_cObject, rb_intern("Rect"));
+
+	r.idE = rb_intern("E");
+	r.idLoad = rb_intern("_load");
+	r.idMarshalLoad = rb_intern("marshal_load");
+
+	VALUE result;
+
+	if (!r.readValue(result))
+		result = Qundef;
+
+	RB_GC_GUARD(r.src);
+	RB_GC_GUARD(r.objects);
+	RB_GC_GUARD(r.symbols);
+	RB_GC_GUARD(r.classCache);
+
+	return result;
+}
+
+#else
+
+VALUE marshalLoadFast(VALUE)
+{
+	return Qundef;
+}
+
+#endif
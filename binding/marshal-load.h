@@ -0,0 +1,32 @@
+/*
+ ** marshal-load.h
+ **
+ ** This file is part of mkxp.
+ **
+ ** mkxp is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 2 of the License, or
+ ** (at your option) any later version.
+ **
+ ** mkxp is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MARSHALLOAD_H
+#define MARSHALLOAD_H
+
+#include <ruby.h>
+
+/* Loads 'str' the way Marshal.load with the UTF-8 forcing
+ * proc would, without going through Ruby's generic loader.
+ * Returns Qundef if the stream uses anything this loader
+ * doesn't handle, in which case Marshal.load should be used.
+ * Errors raised by the loaded classes are passed on */
+VALUE marshalLoadFast(VALUE str);
+
+#endif // MARSHALLOAD_H
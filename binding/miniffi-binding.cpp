@@ -3,10 +3,12 @@
 
 #include <SDL.h>
 #include <cstdint>
+#include <string.h>
 
 #include "filesystem/filesystem.h"
 #include "miniffi.h"
 #include "binding-util.h"
+#include "util.h"
 
 #if RAPI_MAJOR >= 2
 #include <ruby/thread.h>
@@ -31,12 +33,144 @@
 #define _T_INTEGER 3
 #define _T_BOOL 4
 
+typedef mffi_value (*MiniFFIArgConv)(VALUE);
+
+static mffi_value MiniFFI_ArgNumber(VALUE v) {
+    return RB2MVAL(v);
+}
+
+static mffi_value MiniFFI_ArgInteger(VALUE v) {
+#if INTPTR_MAX == INT64_MAX
+    return RB2MVAL(v) & UINT32_MAX;
+#else
+    return RB2MVAL(v);
+#endif
+}
+
+static mffi_value MiniFFI_ArgPointer(VALUE v) {
+    if (NIL_P(v))
+        return 0;
+    
+    if (FIXNUM_P(v))
+        return RB2MVAL(v);
+    
+    StringValue(v);
+    rb_str_modify(v);
+    return (mffi_value)RSTRING_PTR(v);
+}
+
+static mffi_value MiniFFI_ArgBool(VALUE v) {
+    mffi_value ret = 0;
+    rb_bool_arg(v, (bool*)&ret);
+    return ret;
+}
+
+// The signature is parsed once, on creation; every call then
+// only runs the converter picked for each parameter
+struct MiniFFI {
+    void *lib;
+    MINIFFI_FUNC func;
+    int nimport;
+    MiniFFIArgConv imports[MINIFFI_MAX_ARGS];
+    int exports;
+    
+    // Whether calls let other Ruby threads run meanwhile. Not
+    // worth it for functions that return right away
+    bool releaseGVL;
+    
+    MiniFFI() : lib(0), func(0), nimport(0), exports(_T_VOID), releaseGVL(true) {}
+    
+    ~MiniFFI() {
+        if (lib)
+            SDL_UnloadObject(lib);
+    }
+};
+
 #if RAPI_FULL > 187
-DEF_TYPE_CUSTOMFREE(MiniFFI, SDL_UnloadObject);
+DEF_TYPE(MiniFFI);
 #else
-DEF_ALLOCFUNC_CUSTOMFREE(MiniFFI, SDL_UnloadObject);
+DEF_ALLOCFUNC(MiniFFI);
 #endif
 
+// Functions that merely read some state, often called every
+// frame, where releasing the GVL costs more than the call
+static const char *shortFunctions[] = {
+    "GetAsyncKeyState", "GetKeyState", "GetKeyboardState",
+    "GetCursorPos", "ScreenToClient", "ClientToScreen",
+    "GetForegroundWindow", "GetActiveWindow", "GetTickCount",
+    "QueryPerformanceCounter", "QueryPerformanceFrequency",
+    "GetSystemMetrics"
+};
+
+static bool MiniFFI_IsShort(const char *func) {
+    for (size_t i = 0; i < ARRAY_SIZE(shortFunctions); ++i)
+        if (!strcmp(func, shortFunctions[i]))
+            return true;
+    
+    return false;
+}
+
+static int MiniFFI_ParseType(char c, int fallback) {
+    switch (c) {
+        case 'V':
+        case 'v':
+            return _T_VOID;
+            
+        case 'N':
+        case 'n':
+        case 'L':
+        case 'l':
+            return _T_NUMBER;
+            
+        case 'P':
+        case 'p':
+            return _T_POINTER;
+            
+        case 'I':
+        case 'i':
+            return _T_INTEGER;
+            
+        case 'B':
+        case 'b':
+            return _T_BOOL;
+    }
+    
+    return fallback;
+}
+
+static void MiniFFI_AddImport(MiniFFI *ffi, VALUE ary_imports, char c) {
+    MiniFFIArgConv conv;
+    int type = MiniFFI_ParseType(c, -1);
+    
+    switch (type) {
+        case _T_NUMBER:
+            conv = MiniFFI_ArgNumber;
+            break;
+            
+        case _T_POINTER:
+            conv = MiniFFI_ArgPointer;
+            break;
+            
+        case _T_INTEGER:
+            conv = MiniFFI_ArgInteger;
+            break;
+            
+        case _T_BOOL:
+            conv = MiniFFI_ArgBool;
+            break;
+            
+        default:
+            return;
+    }
+    
+    if (ffi->nimport == MINIFFI_MAX_ARGS)
+        rb_raise(rb_eRuntimeError, "too many parameters: %ld/%ld\n",
+                 RARRAY_LEN(ary_imports) + 1, MINIFFI_MAX_ARGS);
+    
+    ffi->imports[ffi->nimport++] = conv;
+    rb_ary_push(ary_imports, INT2FIX(type));
+}
+
 static void *MiniFFI_GetFunctionHandle(void *libhandle, const char *func) {
     if (!libhandle)
         return 0;
@@ -51,23 +185,29 @@ RB_METHOD(MiniFFI_initialize) {
     rb_scan_args(argc, argv, "22", &libname, &func, &imports, &exports);
     SafeStringValue(libname);
     SafeStringValue(func);
+    
+    MiniFFI *ffi = new MiniFFI;
+    setPrivateData(self, ffi);
+    
 #ifdef __APPLE__
-    void *hlib = SDL_LoadObject(mkxp_fs::normalizePath(RSTRING_PTR(libname), 1, 1).c_str());
+    ffi->lib = SDL_LoadObject(mkxp_fs::normalizePath(RSTRING_PTR(libname), 1, 1).c_str());
 #else
-    void *hlib = SDL_LoadObject(RSTRING_PTR(libname));
+    ffi->lib = SDL_LoadObject(RSTRING_PTR(libname));
 #endif
-    setPrivateData(self, hlib);
-    void *hfunc = MiniFFI_GetFunctionHandle(hlib, RSTRING_PTR(func));
+    void *hfunc = MiniFFI_GetFunctionHandle(ffi->lib, RSTRING_PTR(func));
 #ifdef __WIN32__
-    if (hlib && !hfunc) {
+    if (ffi->lib && !hfunc) {
         VALUE func_a = rb_str_new3(func);
         func_a = rb_str_cat(func_a, "A", 1);
-        hfunc = SDL_LoadFunction(hlib, RSTRING_PTR(func_a));
+        hfunc = SDL_LoadFunction(ffi->lib, RSTRING_PTR(func_a));
     }
 #endif
     if (!hfunc)
         rb_raise(rb_eRuntimeError, "%s", SDL_GetError());
     
+    ffi->func = (MINIFFI_FUNC)hfunc;
+    ffi->releaseGVL = !MiniFFI_IsShort(RSTRING_PTR(func));
+    
     rb_iv_set(self, "_func", MVAL2RB((mffi_value)hfunc));
     rb_iv_set(self, "_funcname", func);
     rb_iv_set(self, "_libname", libname);
@@ -81,102 +221,24 @@ RB_METHOD(MiniFFI_initialize) {
             entry = RARRAY_PTR(imports);
             for (int i = 0; i < RARRAY_LEN(imports); i++) {
                 SafeStringValue(entry[i]);
-                switch (*(char *)RSTRING_PTR(entry[i])) {
-                    case 'N':
-                    case 'n':
-                    case 'L':
-                    case 'l':
-                        rb_ary_push(ary_imports, INT2FIX(_T_NUMBER));
-                        break;
-                        
-                    case 'P':
-                    case 'p':
-                        rb_ary_push(ary_imports, INT2FIX(_T_POINTER));
-                        break;
-                        
-                    case 'I':
-                    case 'i':
-                        rb_ary_push(ary_imports, INT2FIX(_T_INTEGER));
-                        break;
-                        
-                    case 'B':
-                    case 'b':
-                        rb_ary_push(ary_imports, INT2FIX(_T_BOOL));
-                        break;
-                }
+                MiniFFI_AddImport(ffi, ary_imports, *RSTRING_PTR(entry[i]));
             }
             break;
         default:
             SafeStringValue(imports);
             const char *s = RSTRING_PTR(imports);
-            for (int i = 0; i < RSTRING_LEN(imports); i++) {
-                switch (*s++) {
-                    case 'N':
-                    case 'n':
-                    case 'L':
-                    case 'l':
-                        rb_ary_push(ary_imports, INT2FIX(_T_NUMBER));
-                        break;
-                        
-                    case 'P':
-                    case 'p':
-                        rb_ary_push(ary_imports, INT2FIX(_T_POINTER));
-                        break;
-                        
-                    case 'I':
-                    case 'i':
-                        rb_ary_push(ary_imports, INT2FIX(_T_INTEGER));
-                        break;
-                        
-                    case 'B':
-                    case 'b':
-                        rb_ary_push(ary_imports, INT2FIX(_T_BOOL));
-                        break;
-                }
-            }
+            for (int i = 0; i < RSTRING_LEN(imports); i++)
+                MiniFFI_AddImport(ffi, ary_imports, *s++);
             break;
     }
     
-    if (MINIFFI_MAX_ARGS < RARRAY_LEN(ary_imports))
-        rb_raise(rb_eRuntimeError, "too many parameters: %ld/%ld\n",
-                 RARRAY_LEN(ary_imports), MINIFFI_MAX_ARGS);
-    
     rb_iv_set(self, "_imports", ary_imports);
-    int ex;
-    if (NIL_P(exports)) {
-        ex = _T_VOID;
-    } else {
+    
+    if (!NIL_P(exports)) {
         SafeStringValue(exports);
-        switch (*RSTRING_PTR(exports)) {
-            case 'V':
-            case 'v':
-                ex = _T_VOID;
-                break;
-                
-            case 'N':
-            case 'n':
-            case 'L':
-            case 'l':
-                ex = _T_NUMBER;
-                break;
-                
-            case 'P':
-            case 'p':
-                ex = _T_POINTER;
-                break;
-                
-            case 'I':
-            case 'i':
-                ex = _T_INTEGER;
-                break;
-                
-            case 'B':
-            case 'b':
-                ex = _T_BOOL;
-                break;
-        }
+        ffi->exports = MiniFFI_ParseType(*RSTRING_PTR(exports), _T_VOID);
     }
-    rb_iv_set(self, "_exports", INT2FIX(ex));
+    rb_iv_set(self, "_exports", INT2FIX(ffi->exports));
     if (rb_block_given_p())
         rb_yield(self);
     return Qnil;
@@ -196,59 +258,28 @@ void* miniffi_call_cb(void *args) {
 #endif
 
 RB_METHOD(MiniFFI_call) {
+    MiniFFI *ffi = getPrivateData<MiniFFI>(self);
     MiniFFIFuncArgs param;
-#define params param.params
-    VALUE func = rb_iv_get(self, "_func");
-    VALUE own_imports = rb_iv_get(self, "_imports");
-    VALUE own_exports = rb_iv_get(self, "_exports");
-    MINIFFI_FUNC ApiFunction = (MINIFFI_FUNC)RB2MVAL(func);
-    VALUE args;
-    int items = rb_scan_args(argc, argv, "0*", &args);
-    int nimport = RARRAY_LEN(own_imports);
-    if (items != nimport)
+    
+    if (argc != ffi->nimport)
         rb_raise(rb_eRuntimeError,
-                 "wrong number of parameters: expected %d, got %d", nimport, items);
+                 "wrong number of parameters: expected %d, got %d", ffi->nimport, argc);
     
-    for (int i = 0; i < nimport; i++) {
-        VALUE str = rb_ary_entry(args, i);
-        mffi_value lParam = 0;
-        switch (FIX2INT(rb_ary_entry(own_imports, i))) {
-            case _T_POINTER:
-                if (NIL_P(str)) {
-                    lParam = 0;
-                } else if (FIXNUM_P(str)) {
-                    lParam = RB2MVAL(str);
-                } else {
-                    StringValue(str);
-                    rb_str_modify(str);
-                    lParam = (mffi_value)RSTRING_PTR(str);
-                }
-                break;
-                
-            case _T_BOOL:
-                rb_bool_arg(rb_ary_entry(args, i), (bool*)&lParam);
-                break;
-                
-            case _T_INTEGER:
-#if INTPTR_MAX == INT64_MAX
-                lParam = RB2MVAL(rb_ary_entry(args, i)) & UINT32_MAX;
-                break;
-#endif
-            case _T_NUMBER:
-            default:
-                lParam = RB2MVAL(rb_ary_entry(args, i));
-                break;
-        }
-        params[i] = lParam;
-    }
+    for (int i = 0; i < ffi->nimport; i++)
+        param.params[i] = ffi->imports[i](argv[i]);
+    
+    mffi_value ret;
 #if RAPI_MAJOR >= 2
-    MFFICallCBArgs cb_args {ApiFunction, &param, nimport};
-    mffi_value ret = (mffi_value)rb_thread_call_without_gvl(miniffi_call_cb, &cb_args, 0, 0);
-#else
-    mffi_value ret = miniffi_call_intern(ApiFunction, &param, nimport);
+    if (ffi->releaseGVL) {
+        MFFICallCBArgs cb_args {ffi->func, &param, ffi->nimport};
+        ret = (mffi_value)rb_thread_call_without_gvl(miniffi_call_cb, &cb_args, 0, 0);
+    } else
 #endif
+    {
+        ret = miniffi_call_intern(ffi->func, &param, ffi->nimport);
+    }
     
-    switch (FIX2INT(own_exports)) {
+    switch (ffi->exports) {
         case _T_NUMBER:
         case _T_INTEGER:
             return MVAL2RB(ret);
@@ -265,6 +296,21 @@ RB_METHOD(MiniFFI_call) {
     }
 }
 
+RB_METHOD(MiniFFI_getReleaseGVL) {
+    RB_UNUSED_PARAM;
+    
+    return rb_bool_new(getPrivateData<MiniFFI>(self)->releaseGVL);
+}
+
+RB_METHOD(MiniFFI_setReleaseGVL) {
+    bool value;
+    rb_get_args(argc, argv, "b", &value RB_ARG_END);
+    
+    getPrivateData<MiniFFI>(self)->releaseGVL = value;
+    
+    return rb_bool_new(value);
+}
+
 void MiniFFIBindingInit() {
     VALUE cMiniFFI = rb_define_class("MiniFFI", rb_cObject);
 #if RAPI_FULL > 187
@@ -275,6 +321,8 @@ void MiniFFIBindingInit() {
     _rb_define_method(cMiniFFI, "initialize", MiniFFI_initialize);
     _rb_define_method(cMiniFFI, "call", MiniFFI_call);
     rb_define_alias(cMiniFFI, "Call", "call");
+    _rb_define_method(cMiniFFI, "release_gvl", MiniFFI_getReleaseGVL);
+    _rb_define_method(cMiniFFI, "release_gvl=", MiniFFI_setReleaseGVL);
     
     rb_define_const(rb_cObject, "Win32API", cMiniFFI);
 }
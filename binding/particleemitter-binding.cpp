@@ -0,0 +1,150 @@
+/*
+** particleemitter-binding.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "binding-types.h"
+#include "binding-util.h"
+#include "disposable-binding.h"
+#include "particleemitter.h"
+#include "viewportelement-binding.h"
+
+#if RAPI_FULL > 187
+DEF_TYPE_SLOTTED(ParticleEmitter);
+#else
+DEF_ALLOCFUNC_SLOTTED(ParticleEmitter);
+#endif
+
+enum {
+  ParticleBitmap = ViewportSlot + 1,
+  ParticleStartColor,
+  ParticleEndColor
+};
+
+RB_METHOD(particleEmitterInitialize) {
+  ParticleEmitter *e = viewportElementInitialize<ParticleEmitter>(argc, argv, self);
+
+  setPrivateData(self, e);
+
+  GFX_LOCK;
+  e->initDynAttribs();
+
+  wrapProperty(e, &e->getStartColor(), ParticleStartColor, ColorType);
+  wrapProperty(e, &e->getEndColor(), ParticleEndColor, ColorType);
+  GFX_UNLOCK;
+
+  return self;
+}
+
+RB_METHOD(particleEmitterUpdate) {
+  RB_UNUSED_PARAM;
+
+  ParticleEmitter *e = getPrivateData<ParticleEmitter>(self);
+
+  GFX_GUARD_EXC(e->update(););
+
+  return Qnil;
+}
+
+RB_METHOD(particleEmitterEmit) {
+  ParticleEmitter *e = getPrivateData<ParticleEmitter>(self);
+
+  int count;
+  rb_unpack_args<1>(argc, argv, &count);
+
+  GFX_GUARD_EXC(e->emit(count););
+
+  return self;
+}
+
+RB_METHOD(particleEmitterClear) {
+  RB_UNUSED_PARAM;
+
+  ParticleEmitter *e = getPrivateData<ParticleEmitter>(self);
+
+  GFX_GUARD_EXC(e->clear(););
+
+  return self;
+}
+
+RB_METHOD(particleEmitterCount) {
+  RB_UNUSED_PARAM;
+
+  ParticleEmitter *e = getPrivateData<ParticleEmitter>(self);
+
+  int value = 0;
+  GUARD_EXC(value = e->getCount(););
+
+  return INT2FIX(value);
+}
+
+DEF_GFX_PROP_OBJ_REF(ParticleEmitter, Bitmap, Bitmap, ParticleBitmap)
+DEF_GFX_PROP_OBJ_VAL(ParticleEmitter, Color, StartColor, ParticleStartColor)
+DEF_GFX_PROP_OBJ_VAL(ParticleEmitter, Color, EndColor, ParticleEndColor)
+
+DEF_GFX_PROP_F(ParticleEmitter, X)
+DEF_GFX_PROP_F(ParticleEmitter, Y)
+DEF_GFX_PROP_F(ParticleEmitter, Rate)
+DEF_GFX_PROP_I(ParticleEmitter, Life)
+DEF_GFX_PROP_I(ParticleEmitter, LifeVar)
+DEF_GFX_PROP_F(ParticleEmitter, Speed)
+DEF_GFX_PROP_F(ParticleEmitter, SpeedVar)
+DEF_GFX_PROP_F(ParticleEmitter, Direction)
+DEF_GFX_PROP_F(ParticleEmitter, Spread)
+DEF_GFX_PROP_F(ParticleEmitter, GravityX)
+DEF_GFX_PROP_F(ParticleEmitter, GravityY)
+DEF_GFX_PROP_F(ParticleEmitter, ZoomStart)
+DEF_GFX_PROP_F(ParticleEmitter, ZoomEnd)
+DEF_GFX_PROP_I(ParticleEmitter, BlendType)
+DEF_GFX_PROP_I(ParticleEmitter, MaxParticles)
+
+void particleEmitterBindingInit() {
+  VALUE klass = rb_define_class("ParticleEmitter", rb_cObject);
+#if RAPI_FULL > 187
+  rb_define_alloc_func(klass, classAllocate<&ParticleEmitterType>);
+#else
+  rb_define_alloc_func(klass, ParticleEmitterAllocate);
+#endif
+
+  disposableBindingInit<ParticleEmitter>(klass);
+  viewportElementBindingInit<ParticleEmitter>(klass);
+
+  _rb_define_method(klass, "initialize", particleEmitterInitialize);
+  _rb_define_method(klass, "update", particleEmitterUpdate);
+  _rb_define_method(klass, "emit", particleEmitterEmit);
+  _rb_define_method(klass, "clear", particleEmitterClear);
+  _rb_define_method(klass, "count", particleEmitterCount);
+
+  INIT_PROP_BIND(ParticleEmitter, Bitmap, "bitmap");
+  INIT_PROP_BIND(ParticleEmitter, X, "x");
+  INIT_PROP_BIND(ParticleEmitter, Y, "y");
+  INIT_PROP_BIND(ParticleEmitter, Rate, "rate");
+  INIT_PROP_BIND(ParticleEmitter, Life, "life");
+  INIT_PROP_BIND(ParticleEmitter, LifeVar, "life_var");
+  INIT_PROP_BIND(ParticleEmitter, Speed, "speed");
+  INIT_PROP_BIND(ParticleEmitter, SpeedVar, "speed_var");
+  INIT_PROP_BIND(ParticleEmitter, Direction, "direction");
+  INIT_PROP_BIND(ParticleEmitter, Spread, "spread");
+  INIT_PROP_BIND(ParticleEmitter, GravityX, "gravity_x");
+  INIT_PROP_BIND(ParticleEmitter, GravityY, "gravity_y");
+  INIT_PROP_BIND(ParticleEmitter, ZoomStart, "zoom_start");
+  INIT_PROP_BIND(ParticleEmitter, ZoomEnd, "zoom_end");
+  INIT_PROP_BIND(ParticleEmitter, StartColor, "start_color");
+  INIT_PROP_BIND(ParticleEmitter, EndColor, "end_color");
+  INIT_PROP_BIND(ParticleEmitter, BlendType, "blend_type");
+  INIT_PROP_BIND(ParticleEmitter, MaxParticles, "max_particles");
+}
@@ -0,0 +1,200 @@
+/*
+** pathfinder-binding.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "binding-types.h"
+#include "binding-util.h"
+#include "pathfinder.h"
+#include "table.h"
+
+#if RAPI_FULL > 187
+DEF_TYPE(Pathfinder);
+#else
+DEF_ALLOCFUNC(Pathfinder);
+#endif
+
+static VALUE pathToArray(const std::vector<uint8_t> &path) {
+  VALUE ary = rb_ary_new2(path.size());
+
+  for (size_t i = 0; i < path.size(); ++i)
+    rb_ary_push(ary, INT2FIX(path[i]));
+
+  return ary;
+}
+
+/* Reads the [sx, sy, tx, ty] entry of a batch query */
+static void queryCoords(VALUE query, int coords[4]) {
+  query = rb_convert_type(query, T_ARRAY, "Array", "to_ary");
+
+  if (RARRAY_LEN(query) != 4)
+    rb_raise(rb_eArgError, "queries must be [sx, sy, tx, ty]");
+
+  for (int i = 0; i < 4; ++i)
+    coords[i] = NUM2INT(rb_ary_entry(query, i));
+}
+
+RB_METHOD(pathfinderInitialize) {
+  VALUE gridObj;
+
+  rb_get_args(argc, argv, "o", &gridObj RB_ARG_END);
+
+  Table *grid = getPrivateDataCheck<Table>(gridObj, TableType);
+
+  Pathfinder *p = new Pathfinder(grid);
+
+  /* Keep the table alive for as long as we use it */
+  rb_iv_set(self, "grid", gridObj);
+
+  setPrivateData(self, p);
+
+  return self;
+}
+
+RB_METHOD(pathfinderGetMask) {
+  RB_UNUSED_PARAM;
+
+  Pathfinder *p = getPrivateData<Pathfinder>(self);
+
+  return INT2FIX(p->getMask());
+}
+
+RB_METHOD(pathfinderSetMask) {
+  Pathfinder *p = getPrivateData<Pathfinder>(self);
+
+  int value;
+  rb_get_args(argc, argv, "i", &value RB_ARG_END);
+
+  p->setMask(value);
+
+  return argv[0];
+}
+
+RB_METHOD(pathfinderFindPath) {
+  Pathfinder *p = getPrivateData<Pathfinder>(self);
+
+  int sx, sy, tx, ty, maxNodes = 0;
+  rb_unpack_args<4>(argc, argv, &sx, &sy, &tx, &ty, &maxNodes);
+
+  std::vector<uint8_t> path;
+
+  if (!p->findPath(sx, sy, tx, ty, path, maxNodes))
+    return Qnil;
+
+  return pathToArray(path);
+}
+
+RB_METHOD(pathfinderFindPaths) {
+  Pathfinder *p = getPrivateData<Pathfinder>(self);
+
+  VALUE queries;
+  int maxNodes = 0;
+  rb_get_args(argc, argv, "o|i", &queries, &maxNodes RB_ARG_END);
+
+  queries = rb_convert_type(queries, T_ARRAY, "Array", "to_ary");
+
+  long count = RARRAY_LEN(queries);
+  VALUE result = rb_ary_new2(count);
+  std::vector<uint8_t> path;
+
+  for (long i = 0; i < count; ++i) {
+    int c[4];
+    queryCoords(rb_ary_entry(queries, i), c);
+
+    if (p->findPath(c[0], c[1], c[2], c[3], path, maxNodes))
+      rb_ary_push(result, pathToArray(path));
+    else
+      rb_ary_push(result, Qnil);
+  }
+
+  return result;
+}
+
+RB_METHOD(pathfinderNextStep) {
+  Pathfinder *p = getPrivateData<Pathfinder>(self);
+
+  int sx, sy, tx, ty;
+  rb_unpack_args<4>(argc, argv, &sx, &sy, &tx, &ty);
+
+  return INT2FIX(p->nextStep(sx, sy, tx, ty));
+}
+
+RB_METHOD(pathfinderNextSteps) {
+  Pathfinder *p = getPrivateData<Pathfinder>(self);
+
+  VALUE queries;
+  rb_get_args(argc, argv, "o", &queries RB_ARG_END);
+
+  queries = rb_convert_type(queries, T_ARRAY, "Array", "to_ary");
+
+  long count = RARRAY_LEN(queries);
+  VALUE result = rb_ary_new2(count);
+
+  for (long i = 0; i < count; ++i) {
+    int c[4];
+    queryCoords(rb_ary_entry(queries, i), c);
+
+    rb_ary_push(result, INT2FIX(p->nextStep(c[0], c[1], c[2], c[3])));
+  }
+
+  return result;
+}
+
+RB_METHOD(pathfinderDistance) {
+  Pathfinder *p = getPrivateData<Pathfinder>(self);
+
+  int x, y, tx, ty;
+  rb_unpack_args<4>(argc, argv, &x, &y, &tx, &ty);
+
+  const std::vector<int32_t> &dist = p->distanceField(tx, ty);
+
+  if (x < 0 || x >= p->width() || y < 0 || y >= p->height())
+    return Qnil;
+
+  int32_t d = dist[y * p->width() + x];
+
+  return (d < 0) ? Qnil : INT2NUM(d);
+}
+
+RB_METHOD(pathfinderInvalidate) {
+  RB_UNUSED_PARAM;
+
+  Pathfinder *p = getPrivateData<Pathfinder>(self);
+
+  p->invalidate();
+
+  return Qnil;
+}
+
+void pathfinderBindingInit() {
+  VALUE klass = rb_define_class("Pathfinder", rb_cObject);
+#if RAPI_FULL > 187
+  rb_define_alloc_func(klass, classAllocate<&PathfinderType>);
+#else
+  rb_define_alloc_func(klass, PathfinderAllocate);
+#endif
+
+  _rb_define_method(klass, "initialize", pathfinderInitialize);
+  _rb_define_method(klass, "mask", pathfinderGetMask);
+  _rb_define_method(klass, "mask=", pathfinderSetMask);
+  _rb_define_method(klass, "find_path", pathfinderFindPath);
+  _rb_define_method(klass, "find_paths", pathfinderFindPaths);
+  _rb_define_method(klass, "next_step", pathfinderNextStep);
+  _rb_define_method(klass, "next_steps", pathfinderNextSteps);
+  _rb_define_method(klass, "distance", pathfinderDistance);
+  _rb_define_method(klass, "invalidate", pathfinderInvalidate);
+}
@@ -26,11 +26,13 @@
 #include "viewportelement-binding.h"
 
 #if RAPI_FULL > 187
-DEF_TYPE(Plane);
+DEF_TYPE_SLOTTED(Plane);
 #else
-DEF_ALLOCFUNC(Plane);
+DEF_ALLOCFUNC_SLOTTED(Plane);
 #endif
 
+enum { PlaneBitmap = ViewportSlot + 1, PlaneColor, PlaneTone };
+
 RB_METHOD(planeInitialize) {
   Plane *p = viewportElementInitialize<Plane>(argc, argv, self);
 
@@ -39,16 +41,16 @@ RB_METHOD(planeInitialize) {
     GFX_LOCK;
   p->initDynAttribs();
 
-  wrapProperty(self, &p->getColor(), "color", ColorType);
-  wrapProperty(self, &p->getTone(), "tone", ToneType);
+  wrapProperty(p, &p->getColor(), PlaneColor, ColorType);
+  wrapProperty(p, &p->getTone(), PlaneTone, ToneType);
     GFX_UNLOCK;
 
   return self;
 }
 
-DEF_GFX_PROP_OBJ_REF(Plane, Bitmap, Bitmap, "bitmap")
-DEF_GFX_PROP_OBJ_VAL(Plane, Color, Color, "color")
-DEF_GFX_PROP_OBJ_VAL(Plane, Tone, Tone, "tone")
+DEF_GFX_PROP_OBJ_REF(Plane, Bitmap, Bitmap, PlaneBitmap)
+DEF_GFX_PROP_OBJ_VAL(Plane, Color, Color, PlaneColor)
+DEF_GFX_PROP_OBJ_VAL(Plane, Tone, Tone, PlaneTone)
 
 DEF_GFX_PROP_I(Plane, OX)
 DEF_GFX_PROP_I(Plane, OY)
@@ -0,0 +1,315 @@
+/*
+ ** rpgcache-binding.cpp
+ **
+ ** This file is part of mkxp.
+ **
+ ** mkxp is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 2 of the License, or
+ ** (at your option) any later version.
+ **
+ ** mkxp is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "binding-util.h"
+#include "binding-types.h"
+#include "bitmap.h"
+#include "config.h"
+#include "filesystem.h"
+#include "sharedstate.h"
+#include "util/boost-hash.h"
+
+#include <algorithm>
+#include <list>
+#include <string>
+
+/* RPG::Cache (RGSS1), keyed by the normalized, lower case path
+ * and hue instead of the string the script passed in.
+ *
+ * Bitmaps are kept in LRU order within a byte budget. Evicting
+ * one only drops the cache's own reference: a bitmap a sprite
+ * still shows stays alive through that sprite, and is picked up
+ * again from a weak map when it is asked for next, rather than
+ * loaded a second time. Bitmaps nothing refers to anymore are
+ * freed by the GC. 'clear' works the same way on every entry */
+
+struct RpgCacheEntry
+{
+	std::string key;
+	VALUE bitmap;
+	size_t bytes;
+};
+
+typedef std::list<RpgCacheEntry> RpgCacheList;
+
+static RpgCacheList lruList;
+static BoostHash<std::string, RpgCacheList::iterator> lruIndex;
+
+/* Ids of keys that were evicted, in 'evictedBitmaps' */
+static BoostHash<std::string, long> evictedIds;
+static long nextEvictedId = 0;
+
+/* Keeps the cached bitmaps alive */
+static VALUE liveBitmaps = Qnil;
+/* ObjectSpace::WeakMap, id => bitmap */
+static VALUE evictedBitmaps = Qnil;
+
+static size_t cachedBytes = 0;
+static size_t budget = 0;
+
+static struct
+{
+	uint32_t hits;
+	uint32_t revivals;
+	uint32_t misses;
+	uint32_t evictions;
+} cacheStats;
+
+static bool bitmapUsable(VALUE bitmap)
+{
+	return !NIL_P(bitmap) && !RTEST(rb_funcall(bitmap, rb_intern("disposed?"), 0));
+}
+
+static size_t bitmapBytes(VALUE bitmap)
+{
+	Bitmap *b = getPrivateData<Bitmap>(bitmap);
+
+	return (size_t) b->width() * b->height() * 4;
+}
+
+static void evictEntry(RpgCacheList::iterator iter)
+{
+	VALUE key = rb_str_new(iter->key.data(), iter->key.size());
+
+	if (!evictedIds.contains(iter->key))
+		evictedIds.insert(iter->key, nextEvictedId++);
+
+	rb_funcall(evictedBitmaps, rb_intern("[]="), 2,
+	           LONG2NUM(evictedIds[iter->key]), iter->bitmap);
+	rb_hash_delete(liveBitmaps, key);
+
+	cachedBytes -= iter->bytes;
+	lruIndex.remove(iter->key);
+	lruList.erase(iter);
+}
+
+static void insertEntry(const std::string &key, VALUE bitmap)
+{
+	RpgCacheEntry entry;
+	entry.key = key;
+	entry.bitmap = bitmap;
+	entry.bytes = bitmapBytes(bitmap);
+
+	lruList.push_front(entry);
+	lruIndex.insert(key, lruList.begin());
+	rb_hash_aset(liveBitmaps, rb_str_new(key.data(), key.size()), bitmap);
+	cachedBytes += entry.bytes;
+
+	/* The entry just added is never evicted right away,
+	 * even if it alone is over budget */
+	while (budget > 0 && cachedBytes > budget && lruList.size() > 1)
+	{
+		evictEntry(--lruList.end());
+		++cacheStats.evictions;
+	}
+}
+
+/* Returns the cached bitmap for 'key', or nil */
+static VALUE lookupEntry(const std::string &key)
+{
+	if (lruIndex.contains(key))
+	{
+		RpgCacheList::iterator iter = lruIndex[key];
+
+		if (bitmapUsable(iter->bitmap))
+		{
+			lruList.splice(lruList.begin(), lruList, iter);
+			++cacheStats.hits;
+
+			return iter->bitmap;
+		}
+
+		/* Disposed by the script, load it anew */
+		cachedBytes -= iter->bytes;
+		rb_hash_delete(liveBitmaps, rb_str_new(key.data(), key.size()));
+		lruIndex.remove(key);
+		lruList.erase(iter);
+	}
+
+	if (evictedIds.contains(key))
+	{
+		VALUE bitmap = rb_funcall(evictedBitmaps, rb_intern("[]"), 1,
+		                          LONG2NUM(evictedIds[key]));
+
+		if (bitmapUsable(bitmap))
+		{
+			insertEntry(key, bitmap);
+			++cacheStats.revivals;
+
+			return bitmap;
+		}
+	}
+
+	++cacheStats.misses;
+
+	return Qnil;
+}
+
+static std::string pathKey(VALUE path)
+{
+	std::string key = shState->fileSystem().normalize(RSTRING_PTR(path), false, false);
+	std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+	return key;
+}
+
+static VALUE bitmapClass()
+{
+	return rb_const_get(rb_cObject, rb_intern("Bitmap"));
+}
+
+static VALUE hueChanged(VALUE source, int hue)
+{
+	VALUE bitmap = rb_funcall(source, rb_intern("clone"), 0);
+	rb_funcall(bitmap, rb_intern("hue_change"), 1, INT2NUM(hue));
+
+	return bitmap;
+}
+
+static VALUE loadBitmap(VALUE folder, VALUE filename, int hue)
+{
+	SafeStringValue(folder);
+	SafeStringValue(filename);
+
+	VALUE path = rb_str_plus(folder, filename);
+
+	std::string key = pathKey(path);
+	key += '\0';
+	key += std::to_string(hue);
+
+	VALUE bitmap = lookupEntry(key);
+
+	if (!NIL_P(bitmap))
+		return bitmap;
+
+	if (hue != 0)
+		bitmap = hueChanged(loadBitmap(folder, filename, 0), hue);
+	else if (RSTRING_LEN(filename) > 0)
+		bitmap = rb_funcall(bitmapClass(), rb_intern("new"), 1, path);
+	else
+		bitmap = rb_funcall(bitmapClass(), rb_intern("new"), 2, INT2NUM(32), INT2NUM(32));
+
+	insertEntry(key, bitmap);
+
+	return bitmap;
+}
+
+RB_METHOD(rpgCacheLoadBitmap)
+{
+	RB_UNUSED_PARAM;
+
+	VALUE folder, filename, hue;
+	rb_scan_args(argc, argv, "21", &folder, &filename, &hue);
+
+	return loadBitmap(folder, filename, NIL_P(hue) ? 0 : NUM2INT(hue));
+}
+
+RB_METHOD(rpgCacheTile)
+{
+	VALUE filename, tileId, hue;
+	rb_scan_args(argc, argv, "3", &filename, &tileId, &hue);
+	SafeStringValue(filename);
+
+	const int id = NUM2INT(tileId);
+	const int hueValue = NUM2INT(hue);
+
+	std::string key = "tile:";
+	key += pathKey(filename);
+	key += '\0';
+	key += std::to_string(id);
+	key += '\0';
+	key += std::to_string(hueValue);
+
+	VALUE bitmap = lookupEntry(key);
+
+	if (!NIL_P(bitmap))
+		return bitmap;
+
+	/* Through the module, in case scripts redefined 'tileset' */
+	VALUE tileset = rb_funcall(self, rb_intern("tileset"), 1, filename);
+
+	bitmap = rb_funcall(bitmapClass(), rb_intern("new"), 2, INT2NUM(32), INT2NUM(32));
+
+	VALUE rectClass = rb_const_get(rb_cObject, rb_intern("Rect"));
+	VALUE rect = rb_funcall(rectClass, rb_intern("new"), 4,
+	                        INT2NUM((id - 384) % 8 * 32), INT2NUM((id - 384) / 8 * 32),
+	                        INT2NUM(32), INT2NUM(32));
+
+	rb_funcall(bitmap, rb_intern("blt"), 4, INT2NUM(0), INT2NUM(0), tileset, rect);
+	rb_funcall(bitmap, rb_intern("hue_change"), 1, INT2NUM(hueValue));
+
+	insertEntry(key, bitmap);
+
+	return bitmap;
+}
+
+RB_METHOD(rpgCacheClear)
+{
+	RB_UNUSED_PARAM;
+
+	while (!lruList.empty())
+		evictEntry(--lruList.end());
+
+	rb_gc_start();
+
+	return Qnil;
+}
+
+RB_METHOD(rpgCacheStats)
+{
+	RB_UNUSED_PARAM;
+
+	VALUE ret = rb_hash_new();
+
+#define STAT(key, value) \
+	rb_hash_aset(ret, ID2SYM(rb_intern(key)), ULL2NUM(value))
+
+	STAT("hits", cacheStats.hits);
+	STAT("revivals", cacheStats.revivals);
+	STAT("misses", cacheStats.misses);
+	STAT("evictions", cacheStats.evictions);
+	STAT("entries", lruList.size());
+	STAT("cached_bytes", cachedBytes);
+	STAT("budget", budget);
+
+#undef STAT
+
+	return ret;
+}
+
+void rpgCacheBindingInit()
+{
+	budget = (size_t) shState->config().rpgCacheBudget * 1024 * 1024;
+
+	liveBitmaps = rb_hash_new();
+	rb_gc_register_address(&liveBitmaps);
+
+	VALUE weakMap = rb_const_get(rb_const_get(rb_cObject, rb_intern("ObjectSpace")),
+	                             rb_intern("WeakMap"));
+	evictedBitmaps = rb_funcall(weakMap, rb_intern("new"), 0);
+	rb_gc_register_address(&evictedBitmaps);
+
+	VALUE module = rb_define_module("RPG");
+	VALUE cache = rb_define_module_under(module, "Cache");
+
+	_rb_define_module_function(cache, "load_bitmap", rpgCacheLoadBitmap);
+	_rb_define_module_function(cache, "tile", rpgCacheTile);
+	_rb_define_module_function(cache, "clear", rpgCacheClear);
+	_rb_define_module_function(cache, "stats", rpgCacheStats);
+}
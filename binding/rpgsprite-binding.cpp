@@ -0,0 +1,221 @@
+/*
+ ** rpgsprite-binding.cpp
+ **
+ ** This file is part of mkxp.
+ **
+ ** mkxp is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 2 of the License, or
+ ** (at your option) any later version.
+ **
+ ** mkxp is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "binding-types.h"
+#include "binding-util.h"
+#include "disposable-binding.h"
+#include "etc.h"
+#include "exception.h"
+#include "sprite.h"
+#include "table.h"
+#include "viewport.h"
+
+#include <algorithm>
+
+/* The parts of RPG::Sprite (RGSS1) that run for every animation
+ * cell each frame. They behave like the Ruby they replace, but
+ * go to the sprites directly instead of through one method call
+ * per property */
+
+/* Number of cells every animation has sprites for */
+static const int AnimationCells = 16;
+
+/* Cell sprites of 'ary', or 0 if 'ary' is not an array */
+static long cellCount(VALUE ary)
+{
+	if (!RB_TYPE_P(ary, RUBY_T_ARRAY))
+		return 0;
+
+	return std::min<long>(RARRAY_LEN(ary), AnimationCells);
+}
+
+static void checkCellsDisposed(VALUE ary)
+{
+	for (long i = 0; i < cellCount(ary); ++i)
+	{
+		VALUE cell = rb_ary_entry(ary, i);
+
+		if (!NIL_P(cell))
+			checkDisposed<Sprite>(cell);
+	}
+}
+
+static void shiftCells(VALUE ary, int dx, int dy)
+{
+	for (long i = 0; i < cellCount(ary); ++i)
+	{
+		VALUE cell = rb_ary_entry(ary, i);
+
+		if (NIL_P(cell))
+			continue;
+
+		Sprite *s = getPrivateDataCheck<Sprite>(cell, SpriteType);
+
+		if (dx != 0)
+			s->setX(s->getX() + dx);
+		if (dy != 0)
+			s->setY(s->getY() + dy);
+	}
+}
+
+static VALUE moveWithCells(int argc, VALUE *argv, VALUE self, bool horizontal)
+{
+	rb_check_argc(argc, 1);
+
+	Sprite *s = getPrivateData<Sprite>(self);
+	checkDisposed<Sprite>(self);
+
+	int value;
+	rb_int_arg(*argv, &value);
+
+	VALUE animCells = rb_iv_get(self, "@_animation_sprites");
+	VALUE loopCells = rb_iv_get(self, "@_loop_animation_sprites");
+
+	checkCellsDisposed(animCells);
+	checkCellsDisposed(loopCells);
+
+	const int delta = value - (horizontal ? s->getX() : s->getY());
+
+	if (delta != 0)
+	{
+		const int dx = horizontal ? delta : 0;
+		const int dy = horizontal ? 0 : delta;
+
+		GFX_STATE_GUARD_EXC(
+			shiftCells(animCells, dx, dy);
+			shiftCells(loopCells, dx, dy);
+		)
+	}
+
+	return rb_call_super(argc, argv);
+}
+
+RB_METHOD(rpgSpriteSetX)
+{
+	return moveWithCells(argc, argv, self, true);
+}
+
+RB_METHOD(rpgSpriteSetY)
+{
+	return moveWithCells(argc, argv, self, false);
+}
+
+/* Cell data columns: pattern, x, y, zoom, angle,
+ * mirror, opacity, blend type */
+static const int CellDataColumns = 8;
+
+static void placeCells(Sprite *s, VALUE sprites, Table *cellData, int position)
+{
+	IntRect src = s->getSrcRect().toIntRect();
+	const int opacity = s->getOpacity();
+
+	/* Where cell offsets are relative to */
+	int baseX;
+	int baseY;
+
+	if (position == 3)
+	{
+		if (Viewport *vp = s->getViewport())
+		{
+			IntRect vpRect = vp->getRect().toIntRect();
+			baseX = vpRect.w / 2;
+			baseY = vpRect.h - 160;
+		}
+		else
+		{
+			baseX = 320;
+			baseY = 240;
+		}
+	}
+	else
+	{
+		baseX = s->getX() - s->getOX() + src.w / 2;
+		baseY = s->getY() - s->getOY() + src.h / 2;
+
+		if (position == 0)
+			baseY -= src.h / 4;
+		else if (position == 2)
+			baseY += src.h / 4;
+	}
+
+	for (long i = 0; i < cellCount(sprites); ++i)
+	{
+		VALUE cellObj = rb_ary_entry(sprites, i);
+
+		if (NIL_P(cellObj))
+			continue;
+
+		Sprite *cell = getPrivateDataCheck<Sprite>(cellObj, SpriteType);
+
+		/* Cells past the end of the table are unused, like -1 */
+		const int pattern = (i < cellData->xSize()) ? cellData->get(i, 0) : -1;
+
+		if (pattern == -1)
+		{
+			cell->setVisible(false);
+			continue;
+		}
+
+		cell->setVisible(true);
+		cell->getSrcRect().set(pattern % 5 * 192, pattern / 5 * 192, 192, 192);
+
+		cell->setX(baseX + cellData->get(i, 1));
+		cell->setY(baseY + cellData->get(i, 2));
+		cell->setZ(2000);
+		cell->setOX(96);
+		cell->setOY(96);
+		cell->setZoomX(cellData->get(i, 3) / 100.0f);
+		cell->setZoomY(cellData->get(i, 3) / 100.0f);
+		cell->setAngle(cellData->get(i, 4));
+		cell->setMirror(cellData->get(i, 5) == 1);
+		cell->setOpacity((int) (cellData->get(i, 6) * opacity / 255.0));
+		cell->setBlendType(cellData->get(i, 7));
+	}
+}
+
+RB_METHOD(rpgSpriteAnimationSetSprites)
+{
+	VALUE sprites, cellDataObj, positionObj;
+	rb_scan_args(argc, argv, "3", &sprites, &cellDataObj, &positionObj);
+
+	Sprite *s = getPrivateData<Sprite>(self);
+	checkDisposed<Sprite>(self);
+
+	Table *cellData = getPrivateDataCheck<Table>(cellDataObj, TableType);
+	const int position = NUM2INT(positionObj);
+
+	if (cellData->ySize() < CellDataColumns)
+		rb_raise(rb_eArgError, "Cell data has %d columns, expected %d",
+		         cellData->ySize(), CellDataColumns);
+
+	checkCellsDisposed(sprites);
+
+	GFX_STATE_GUARD_EXC( placeCells(s, sprites, cellData, position); )
+
+	return Qnil;
+}
+
+void rpgSpriteBindingInit()
+{
+	VALUE klass = rb_path2class("RPG::Sprite");
+
+	_rb_define_method(klass, "x=", rpgSpriteSetX);
+	_rb_define_method(klass, "y=", rpgSpriteSetY);
+	_rb_define_method(klass, "animation_set_sprites", rpgSpriteAnimationSetSprites);
+}
@@ -45,7 +45,7 @@ RB_METHOD(sceneElementSetZ)
 	SceneElement *se = getPrivateData<C>(self);
 
 	int z;
-	rb_get_args(argc, argv, "i", &z RB_ARG_END);
+	rb_unpack_args<1>(argc, argv, &z);
 
 	GFX_GUARD_EXC( se->setZ(z); );
 
@@ -71,7 +71,7 @@ RB_METHOD(sceneElementSetVisible)
 	SceneElement *se = getPrivateData<C>(self);
 
 	bool visible;
-	rb_get_args(argc, argv, "b", &visible RB_ARG_END);
+	rb_unpack_args<1>(argc, argv, &visible);
 
 	GFX_GUARD_EXC( se->setVisible(visible); );
 
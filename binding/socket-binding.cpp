@@ -0,0 +1,216 @@
+//
+//  socket-binding.cpp
+//  mkxp-z
+//
+//  HTTPLite::Socket, for UDP and WebSocket connections.
+//
+
+#include "binding-util.h"
+
+#include "net/net.h"
+
+using mkxp_net::Socket;
+
+/* From http-binding.cpp */
+mkxp_net::StringMap hash2StringMap(VALUE hash);
+
+#if RAPI_FULL > 187
+DEF_TYPE_CUSTOMNAME(Socket, "Socket");
+#else
+DEF_ALLOCFUNC(Socket);
+#endif
+
+static VALUE socketKlass;
+
+/* Sockets made with a block, drained on every Graphics.update */
+static VALUE socketCallbacks = Qnil;
+
+static VALUE socketWrap(Socket *socket) {
+    VALUE self = rb_obj_alloc(socketKlass);
+    setPrivateData(self, socket);
+    
+    if (rb_block_given_p()) {
+        rb_iv_set(self, "@callback", rb_block_proc());
+        rb_ary_push(socketCallbacks, self);
+    }
+    
+    return self;
+}
+
+static VALUE socketMessage(Socket::Message &msg) {
+    if (msg.binary)
+        return rb_str_new(msg.data.c_str(), msg.data.length());
+    
+    return rb_utf8_str_new(msg.data.c_str(), msg.data.length());
+}
+
+/* HTTPLite::Socket.udp(host, port, local_port = 0) { |data| } */
+RB_METHOD(socketUDP) {
+    RB_UNUSED_PARAM;
+    
+    VALUE host, port, localPort;
+    rb_scan_args(argc, argv, "21", &host, &port, &localPort);
+    SafeStringValue(host);
+    
+    Socket *socket = 0;
+    GUARD_EXC(socket = new Socket(RSTRING_PTR(host), NUM2INT(port),
+                                  NIL_P(localPort) ? 0 : NUM2INT(localPort)););
+    
+    return socketWrap(socket);
+}
+
+/* HTTPLite::Socket.websocket(url, headers = nil) { |data| } */
+RB_METHOD(socketWebSocket) {
+    RB_UNUSED_PARAM;
+    
+    VALUE url, rheaders;
+    rb_scan_args(argc, argv, "11", &url, &rheaders);
+    SafeStringValue(url);
+    
+    mkxp_net::StringMap headers;
+    if (rheaders != Qnil)
+        headers = hash2StringMap(rheaders);
+    
+    Socket *socket = 0;
+    GUARD_EXC(socket = new Socket(RSTRING_PTR(url), headers););
+    
+    return socketWrap(socket);
+}
+
+/* Queues 'data', sent as a text frame over WebSockets if 'text'.
+ * Returns false if the socket is closed or too far behind */
+RB_METHOD(socketWrite) {
+    RB_UNUSED_PARAM;
+    
+    VALUE data, text;
+    rb_scan_args(argc, argv, "11", &data, &text);
+    SafeStringValue(data);
+    
+    Socket *socket = getPrivateData<Socket>(self);
+    
+    return rb_bool_new(socket->send(RSTRING_PTR(data), RSTRING_LEN(data), !RTEST(text)));
+}
+
+/* The oldest received message, or nil */
+RB_METHOD(socketRead) {
+    RB_UNUSED_PARAM;
+    
+    Socket::Message msg;
+    
+    if (!getPrivateData<Socket>(self)->receive(msg))
+        return Qnil;
+    
+    return socketMessage(msg);
+}
+
+RB_METHOD(socketReadAll) {
+    RB_UNUSED_PARAM;
+    
+    Socket *socket = getPrivateData<Socket>(self);
+    Socket::Message msg;
+    VALUE ret = rb_ary_new();
+    
+    while (socket->receive(msg))
+        rb_ary_push(ret, socketMessage(msg));
+    
+    return ret;
+}
+
+RB_METHOD(socketState) {
+    RB_UNUSED_PARAM;
+    
+    switch (getPrivateData<Socket>(self)->state()) {
+        case Socket::Connecting:
+            return ID2SYM(rb_intern("connecting"));
+        case Socket::Open:
+            return ID2SYM(rb_intern("open"));
+        default:
+            return ID2SYM(rb_intern("closed"));
+    }
+}
+
+RB_METHOD(socketIsOpen) {
+    RB_UNUSED_PARAM;
+    
+    return rb_bool_new(getPrivateData<Socket>(self)->state() == Socket::Open);
+}
+
+RB_METHOD(socketIsClosed) {
+    RB_UNUSED_PARAM;
+    
+    return rb_bool_new(getPrivateData<Socket>(self)->state() == Socket::Closed);
+}
+
+/* Why the connection went down; nil if it's up or was closed normally */
+RB_METHOD(socketError) {
+    RB_UNUSED_PARAM;
+    
+    const std::string &error = getPrivateData<Socket>(self)->error();
+    
+    if (error.empty())
+        return Qnil;
+    
+    return rb_utf8_str_new_cstr(error.c_str());
+}
+
+RB_METHOD(socketClose) {
+    RB_UNUSED_PARAM;
+    
+    getPrivateData<Socket>(self)->close();
+    
+    return Qnil;
+}
+
+/* Hands the messages received since the last frame to the blocks
+ * of their sockets. Closed sockets are let go once drained */
+void socketProcessMessages() {
+    if (NIL_P(socketCallbacks) || RARRAY_LEN(socketCallbacks) == 0)
+        return;
+    
+    /* Blocks may open further sockets */
+    VALUE sockets = socketCallbacks;
+    socketCallbacks = rb_ary_new();
+    
+    Socket::Message msg;
+    
+    for (long i = 0; i < RARRAY_LEN(sockets); ++i) {
+        VALUE obj = rb_ary_entry(sockets, i);
+        Socket *socket = getPrivateData<Socket>(obj);
+        
+        /* Checked first, so nothing arriving in between is lost */
+        const bool closed = (socket->state() == Socket::Closed);
+        
+        VALUE callback = rb_iv_get(obj, "@callback");
+        
+        while (socket->receive(msg))
+            rb_funcall(callback, rb_intern("call"), 1, socketMessage(msg));
+        
+        if (!closed)
+            rb_ary_push(socketCallbacks, obj);
+    }
+}
+
+void socketBindingInit() {
+    VALUE mNet = rb_define_module("HTTPLite");
+    
+    socketKlass = rb_define_class_under(mNet, "Socket", rb_cObject);
+#if RAPI_FULL > 187
+    rb_define_alloc_func(socketKlass, classAllocate<&SocketType>);
+#else
+    rb_define_alloc_func(socketKlass, SocketAllocate);
+#endif
+    rb_define_singleton_method(socketKlass, "udp", RUBY_METHOD_FUNC(socketUDP), -1);
+    rb_define_singleton_method(socketKlass, "websocket", RUBY_METHOD_FUNC(socketWebSocket), -1);
+    
+    _rb_define_method(socketKlass, "write", socketWrite);
+    _rb_define_method(socketKlass, "read", socketRead);
+    _rb_define_method(socketKlass, "read_all", socketReadAll);
+    _rb_define_method(socketKlass, "state", socketState);
+    _rb_define_method(socketKlass, "open?", socketIsOpen);
+    _rb_define_method(socketKlass, "closed?", socketIsClosed);
+    _rb_define_method(socketKlass, "error", socketError);
+    _rb_define_method(socketKlass, "close", socketClose);
+    
+    socketCallbacks = rb_ary_new();
+    rb_gc_register_address(&socketCallbacks);
+}
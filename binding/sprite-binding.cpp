@@ -28,12 +28,25 @@
 #include "sprite.h"
 #include "viewportelement-binding.h"
 
+#include <string.h>
+#include <vector>
+
 #if RAPI_FULL > 187
-DEF_TYPE(Sprite);
+DEF_TYPE_SLOTTED(Sprite);
 #else
-DEF_ALLOCFUNC(Sprite);
+DEF_ALLOCFUNC_SLOTTED(Sprite);
 #endif
 
+enum {
+    SpriteBitmap = ViewportSlot + 1,
+    SpritePattern,
+    SpriteSrcRect,
+    SpriteColor,
+    SpriteTone,
+    /* The wrapper itself, for Viewport#pick */
+    SpriteSelf
+};
+
 RB_METHOD(spriteInitialize) {
     GFX_LOCK;
     Sprite *s = viewportElementInitialize<Sprite>(argc, argv, self);
@@ -43,19 +56,21 @@ RB_METHOD(spriteInitialize) {
     /* Wrap property objects */
     s->initDynAttribs();
     
-    wrapProperty(self, &s->getSrcRect(), "src_rect", RectType);
-    wrapProperty(self, &s->getColor(), "color", ColorType);
-    wrapProperty(self, &s->getTone(), "tone", ToneType);
+    wrapProperty(s, &s->getSrcRect(), SpriteSrcRect, RectType);
+    wrapProperty(s, &s->getColor(), SpriteColor, ColorType);
+    wrapProperty(s, &s->getTone(), SpriteTone, ToneType);
+    
+    setPropSlot(s, SpriteSelf, self);
     
     GFX_UNLOCK;
     return self;
 }
 
-DEF_GFX_PROP_OBJ_REF(Sprite, Bitmap, Bitmap, "bitmap")
-DEF_GFX_PROP_OBJ_REF(Sprite, Bitmap, Pattern, "pattern")
-DEF_GFX_PROP_OBJ_VAL(Sprite, Rect, SrcRect, "src_rect")
-DEF_GFX_PROP_OBJ_VAL(Sprite, Color, Color, "color")
-DEF_GFX_PROP_OBJ_VAL(Sprite, Tone, Tone, "tone")
+DEF_GFX_PROP_OBJ_REF(Sprite, Bitmap, Bitmap, SpriteBitmap)
+DEF_GFX_PROP_OBJ_REF(Sprite, Bitmap, Pattern, SpritePattern)
+DEF_GFX_PROP_OBJ_VAL(Sprite, Rect, SrcRect, SpriteSrcRect)
+DEF_GFX_PROP_OBJ_VAL(Sprite, Color, Color, SpriteColor)
+DEF_GFX_PROP_OBJ_VAL(Sprite, Tone, Tone, SpriteTone)
 
 DEF_GFX_PROP_I(Sprite, X)
 DEF_GFX_PROP_I(Sprite, Y)
@@ -72,6 +87,7 @@ DEF_GFX_PROP_I(Sprite, PatternScrollY)
 DEF_GFX_PROP_I(Sprite, WaveAmp)
 DEF_GFX_PROP_I(Sprite, WaveLength)
 DEF_GFX_PROP_I(Sprite, WaveSpeed)
+DEF_GFX_PROP_I(Sprite, Hue)
 
 DEF_GFX_PROP_F(Sprite, ZoomX)
 DEF_GFX_PROP_F(Sprite, ZoomY)
@@ -95,6 +111,22 @@ RB_METHOD(spriteWidth) {
     return rb_fix_new(value);
 }
 
+VALUE spriteObject(Sprite *s) {
+    return getPropSlot(s, SpriteSelf);
+}
+
+RB_METHOD(spriteHit) {
+    Sprite *s = getPrivateData<Sprite>(self);
+    
+    int x, y;
+    rb_get_args(argc, argv, "ii", &x, &y RB_ARG_END);
+    
+    bool hit = false;
+    GFX_GUARD_EXC(hit = s->hitTest(x, y););
+    
+    return rb_bool_new(hit);
+}
+
 RB_METHOD(spriteHeight) {
     RB_UNUSED_PARAM;
     
@@ -106,6 +138,177 @@ RB_METHOD(spriteHeight) {
     return rb_fix_new(value);
 }
 
+/* Attributes settable through Sprite.batch_update */
+struct SpriteBatchAttr {
+    const char *name;
+    
+    /* 'i' int, 'f' float, 'b' bool */
+    char type;
+    
+    void (Sprite::*setInt)(int);
+    void (Sprite::*setFloat)(float);
+    void (Sprite::*setBool)(bool);
+};
+
+static const SpriteBatchAttr spriteBatchAttrs[] = {
+    { "x",          'i', &Sprite::setX,         0, 0 },
+    { "y",          'i', &Sprite::setY,         0, 0 },
+    { "z",          'i', &Sprite::setZ,         0, 0 },
+    { "ox",         'i', &Sprite::setOX,        0, 0 },
+    { "oy",         'i', &Sprite::setOY,        0, 0 },
+    { "opacity",    'i', &Sprite::setOpacity,   0, 0 },
+    { "bush_depth", 'i', &Sprite::setBushDepth, 0, 0 },
+    { "blend_type", 'i', &Sprite::setBlendType, 0, 0 },
+    { "hue",        'i', &Sprite::setHue,       0, 0 },
+    { "zoom_x",     'f', 0, &Sprite::setZoomX,     0 },
+    { "zoom_y",     'f', 0, &Sprite::setZoomY,     0 },
+    { "angle",      'f', 0, &Sprite::setAngle,     0 },
+    { "wave_phase", 'f', 0, &Sprite::setWavePhase, 0 },
+    { "visible",    'b', 0, 0, &Sprite::setVisible },
+    { "mirror",     'b', 0, 0, &Sprite::setMirror  }
+};
+
+/* One attribute's values for every sprite of a batch */
+struct SpriteBatchColumn {
+    const SpriteBatchAttr *attr;
+    
+    std::vector<double> values;
+    
+    /* Sprites whose entry was nil keep their value */
+    std::vector<bool> skip;
+};
+
+static const SpriteBatchAttr *spriteBatchAttr(VALUE key) {
+    const char *name;
+    
+    if (SYMBOL_P(key))
+        name = rb_id2name(SYM2ID(key));
+    else
+        name = StringValueCStr(key);
+    
+    for (size_t i = 0; i < ARRAY_SIZE(spriteBatchAttrs); ++i)
+        if (!strcmp(spriteBatchAttrs[i].name, name))
+            return &spriteBatchAttrs[i];
+    
+    rb_raise(rb_eArgError, "Sprite.batch_update: unknown attribute '%s'", name);
+    
+    return 0;
+}
+
+static void spriteBatchRead(SpriteBatchColumn &col, VALUE valuesObj, long count) {
+    const char type = col.attr->type;
+    
+    col.values.resize(count);
+    col.skip.assign(count, false);
+    
+    /* Packed native data: int32 for ints, double for
+     * floats and one byte for bools, as in Array#pack
+     * with "l*", "d*" and "C*" */
+    if (RB_TYPE_P(valuesObj, RUBY_T_STRING)) {
+        const size_t size = (type == 'i') ? 4 : (type == 'f') ? 8 : 1;
+        
+        if ((size_t)RSTRING_LEN(valuesObj) != size * count)
+            rb_raise(rb_eArgError, "Sprite.batch_update: '%s' data is %ld bytes, "
+                     "expected %ld", col.attr->name, (long)RSTRING_LEN(valuesObj),
+                     (long)(size * count));
+        
+        const char *data = RSTRING_PTR(valuesObj);
+        
+        for (long i = 0; i < count; ++i) {
+            if (type == 'i') {
+                int32_t v;
+                memcpy(&v, data + i * 4, 4);
+                col.values[i] = v;
+            } else if (type == 'f') {
+                memcpy(&col.values[i], data + i * 8, 8);
+            } else {
+                col.values[i] = data[i] != 0;
+            }
+        }
+        
+        return;
+    }
+    
+    valuesObj = rb_convert_type(valuesObj, RUBY_T_ARRAY, "Array", "to_ary");
+    
+    if (RARRAY_LEN(valuesObj) != count)
+        rb_raise(rb_eArgError, "Sprite.batch_update: '%s' has %ld values for %ld sprites",
+                 col.attr->name, (long)RARRAY_LEN(valuesObj), count);
+    
+    for (long i = 0; i < count; ++i) {
+        VALUE v = rb_ary_entry(valuesObj, i);
+        
+        if (NIL_P(v)) {
+            col.skip[i] = true;
+            continue;
+        }
+        
+        if (type == 'i') {
+            int iv;
+            rb_int_arg(v, &iv, i);
+            col.values[i] = iv;
+        } else if (type == 'f') {
+            rb_float_arg(v, &col.values[i], i);
+        } else {
+            col.values[i] = RTEST(v);
+        }
+    }
+}
+
+/* Sets attributes of many sprites at once, eg.
+ *   Sprite.batch_update(sprites, x: xs, y: ys, opacity: os)
+ * Each value is an Array with one entry per sprite (nil leaves
+ * that sprite's attribute alone) or a packed String. Everything
+ * is validated up front, then applied under one graphics lock */
+RB_METHOD(spriteBatchUpdate) {
+    RB_UNUSED_PARAM;
+    
+    VALUE spritesObj, attrsObj;
+    rb_unpack_args<2>(argc, argv, &spritesObj, &attrsObj);
+    
+    spritesObj = rb_convert_type(spritesObj, RUBY_T_ARRAY, "Array", "to_ary");
+    attrsObj = rb_convert_type(attrsObj, RUBY_T_HASH, "Hash", "to_hash");
+    
+    const long count = RARRAY_LEN(spritesObj);
+    std::vector<Sprite *> sprites(count);
+    
+    for (long i = 0; i < count; ++i)
+        sprites[i] = getPrivateDataCheck<Sprite>(rb_ary_entry(spritesObj, i), SpriteType);
+    
+    VALUE keys = rb_funcall(attrsObj, rb_intern("keys"), 0);
+    std::vector<SpriteBatchColumn> columns(RARRAY_LEN(keys));
+    
+    for (size_t c = 0; c < columns.size(); ++c) {
+        VALUE key = rb_ary_entry(keys, c);
+        
+        columns[c].attr = spriteBatchAttr(key);
+        spriteBatchRead(columns[c], rb_hash_aref(attrsObj, key), count);
+    }
+    
+    GFX_GUARD_EXC(
+        for (size_t c = 0; c < columns.size(); ++c) {
+            const SpriteBatchColumn &col = columns[c];
+            const SpriteBatchAttr &attr = *col.attr;
+            
+            for (long i = 0; i < count; ++i) {
+                if (col.skip[i])
+                    continue;
+                
+                Sprite *s = sprites[i];
+                
+                if (attr.type == 'i')
+                    (s->*attr.setInt)((int)col.values[i]);
+                else if (attr.type == 'f')
+                    (s->*attr.setFloat)((float)col.values[i]);
+                else
+                    (s->*attr.setBool)(col.values[i] != 0);
+            }
+        }
+    );
+    
+    return spritesObj;
+}
+
 void spriteBindingInit() {
     VALUE klass = rb_define_class("Sprite", rb_cObject);
 #if RAPI_FULL > 187
@@ -120,6 +323,8 @@ void spriteBindingInit() {
     
     _rb_define_method(klass, "initialize", spriteInitialize);
     
+    rb_define_class_method(klass, "batch_update", spriteBatchUpdate);
+    
     INIT_PROP_BIND(Sprite, Bitmap, "bitmap");
     INIT_PROP_BIND(Sprite, SrcRect, "src_rect");
     INIT_PROP_BIND(Sprite, X, "x");
@@ -138,6 +343,7 @@ void spriteBindingInit() {
     
     _rb_define_method(klass, "width", spriteWidth);
     _rb_define_method(klass, "height", spriteHeight);
+    _rb_define_method(klass, "hit?", spriteHit);
     
     INIT_PROP_BIND(Sprite, BushOpacity, "bush_opacity");
     
@@ -150,6 +356,7 @@ void spriteBindingInit() {
     INIT_PROP_BIND(Sprite, PatternZoomX, "pattern_zoom_x");
     INIT_PROP_BIND(Sprite, PatternZoomY, "pattern_zoom_y");
     INIT_PROP_BIND(Sprite, Invert, "invert");
+    INIT_PROP_BIND(Sprite, Hue, "hue");
     
     INIT_PROP_BIND(Sprite, WaveAmp, "wave_amp");
     INIT_PROP_BIND(Sprite, WaveLength, "wave_length");
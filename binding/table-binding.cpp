@@ -19,8 +19,10 @@
 ** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "binding-types.h"
 #include "binding-util.h"
 #include "serializable-binding.h"
+#include "etc.h"
 #include "table.h"
 #include <algorithm>
 
@@ -147,6 +149,94 @@ RB_METHOD(tableSetAt) {
   return argv[argc - 1];
 }
 
+RB_METHOD(tableFill) {
+  Table *t = getPrivateData<Table>(self);
+
+  int value, x, y, width, height, z = -1;
+
+  if (argc == 1) {
+    rb_get_args(argc, argv, "i", &value RB_ARG_END);
+
+    t->fill(value);
+  } else {
+    rb_unpack_args<5>(argc, argv, &value, &x, &y, &width, &height, &z);
+
+    t->fill(value, x, y, width, height, z);
+  }
+
+  return self;
+}
+
+RB_METHOD(tableCopyRect) {
+  Table *t = getPrivateData<Table>(self);
+
+  int dx, dy, sx, sy, width, height;
+  VALUE srcObj;
+
+  if (argc == 4) {
+    VALUE srcRectObj;
+
+    rb_unpack_args<4>(argc, argv, &dx, &dy, &srcObj, &srcRectObj);
+
+    Rect *rect = getPrivateDataCheck<Rect>(srcRectObj, RectType);
+    sx = rect->x;
+    sy = rect->y;
+    width = rect->width;
+    height = rect->height;
+  } else {
+    rb_unpack_args<7>(argc, argv, &dx, &dy, &srcObj, &sx, &sy, &width,
+                      &height);
+  }
+
+  Table *src = getPrivateDataCheck<Table>(srcObj, TableType);
+
+  t->copyRect(dx, dy, *src, sx, sy, width, height);
+
+  return self;
+}
+
+RB_METHOD(tableToStr) {
+  RB_UNUSED_PARAM;
+
+  Table *t = getPrivateData<Table>(self);
+
+  return rb_str_new((const char *)t->raw(), t->rawSize());
+}
+
+RB_METHOD(tableFromStr) {
+  Table *t = getPrivateData<Table>(self);
+
+  const char *data;
+  int dataLen;
+
+  rb_get_args(argc, argv, "s", &data, &dataLen RB_ARG_END);
+
+  if ((size_t)dataLen != t->rawSize())
+    rb_raise(rb_eArgError, "string is %d bytes, table data is %d",
+             dataLen, (int)t->rawSize());
+
+  t->assignRaw(data);
+
+  return self;
+}
+
+RB_METHOD(tableEachIndex) {
+  RB_UNUSED_PARAM;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  Table *t = getPrivateData<Table>(self);
+
+  /* Sizes are read on every iteration, as
+   * the block might resize the table */
+  for (int z = 0; z < t->zSize(); ++z)
+    for (int y = 0; y < t->ySize(); ++y)
+      for (int x = 0; x < t->xSize(); ++x)
+        rb_yield_values(3, INT2FIX(x), INT2FIX(y), INT2FIX(z));
+
+  return self;
+}
+
 MARSH_LOAD_FUN(Table)
 INITCOPY_FUN(Table)
 
@@ -170,4 +260,9 @@ void tableBindingInit() {
   _rb_define_method(klass, "zsize", tableZSize);
   _rb_define_method(klass, "[]", tableGetAt);
   _rb_define_method(klass, "[]=", tableSetAt);
+  _rb_define_method(klass, "fill", tableFill);
+  _rb_define_method(klass, "copy_rect", tableCopyRect);
+  _rb_define_method(klass, "to_str", tableToStr);
+  _rb_define_method(klass, "from_str", tableFromStr);
+  _rb_define_method(klass, "each_index", tableEachIndex);
 }
@@ -0,0 +1,123 @@
+/*
+** textrun-binding.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "binding-types.h"
+#include "binding-util.h"
+#include "bitmap.h"
+#include "font.h"
+#include "textrun.h"
+
+#if RAPI_FULL > 187
+DEF_TYPE(TextRun);
+#else
+DEF_ALLOCFUNC(TextRun);
+#endif
+
+void bitmapInitProps(Bitmap *b, VALUE self);
+
+/* TextRun.new(text, font) */
+RB_METHOD(textRunInitialize) {
+  VALUE strObj, fontObj;
+
+  rb_get_args(argc, argv, "oo", &strObj, &fontObj RB_ARG_END);
+
+  strObj = rb_obj_as_string(strObj);
+  const char *str = RSTRING_PTR(strObj);
+  Font *font = getPrivateDataCheck<Font>(fontObj, FontType);
+
+  Bitmap *bitmap = 0;
+  TextRun *run = 0;
+
+  GFX_GUARD_EXC(
+    Vec2i size = TextRun::bitmapSize(str, *font);
+    bitmap = new Bitmap(size.x, size.y);
+  );
+
+  VALUE bitmapObj = wrapObject(bitmap, BitmapType);
+  bitmapInitProps(bitmap, bitmapObj);
+
+  /* The run draws from it for as long as it lives */
+  rb_iv_set(self, "bitmap", bitmapObj);
+
+  GFX_GUARD_EXC(run = new TextRun(str, *font, bitmap););
+
+  setPrivateData(self, run);
+
+  return self;
+}
+
+RB_METHOD(textRunGetBitmap) {
+  RB_UNUSED_PARAM;
+
+  return rb_iv_get(self, "bitmap");
+}
+
+RB_METHOD(textRunLength) {
+  RB_UNUSED_PARAM;
+
+  TextRun *run = getPrivateData<TextRun>(self);
+
+  return INT2FIX(run->length());
+}
+
+/* width(count = length); for revealing through a Sprite's src_rect */
+RB_METHOD(textRunWidth) {
+  TextRun *run = getPrivateData<TextRun>(self);
+
+  int count = run->length();
+  rb_get_args(argc, argv, "|i", &count RB_ARG_END);
+
+  int width = 0;
+  GUARD_EXC(width = run->revealWidth(count););
+
+  return INT2FIX(width);
+}
+
+/* draw(bitmap, x, y, count = length, opacity = 255) */
+RB_METHOD(textRunDraw) {
+  TextRun *run = getPrivateData<TextRun>(self);
+
+  VALUE destObj;
+  int x, y;
+  int count = run->length();
+  int opacity = 255;
+
+  rb_get_args(argc, argv, "oii|ii", &destObj, &x, &y, &count, &opacity RB_ARG_END);
+
+  Bitmap *dest = getPrivateDataCheck<Bitmap>(destObj, BitmapType);
+
+  GFX_GUARD_EXC(run->draw(*dest, x, y, count, opacity););
+
+  return self;
+}
+
+void textRunBindingInit() {
+  VALUE klass = rb_define_class("TextRun", rb_cObject);
+#if RAPI_FULL > 187
+  rb_define_alloc_func(klass, classAllocate<&TextRunType>);
+#else
+  rb_define_alloc_func(klass, TextRunAllocate);
+#endif
+
+  _rb_define_method(klass, "initialize", textRunInitialize);
+  _rb_define_method(klass, "bitmap", textRunGetBitmap);
+  _rb_define_method(klass, "length", textRunLength);
+  _rb_define_method(klass, "width", textRunWidth);
+  _rb_define_method(klass, "draw", textRunDraw);
+}
@@ -0,0 +1,143 @@
+/*
+** textsprite-binding.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "binding-types.h"
+#include "binding-util.h"
+#include "disposable-binding.h"
+#include "font.h"
+#include "textsprite.h"
+#include "viewportelement-binding.h"
+
+#if RAPI_FULL > 187
+DEF_TYPE_SLOTTED(TextSprite);
+#else
+DEF_ALLOCFUNC_SLOTTED(TextSprite);
+#endif
+
+enum {
+  TextSpriteFont = ViewportSlot + 1
+};
+
+/* TextSprite.new(viewport = nil) */
+RB_METHOD(textSpriteInitialize) {
+  TextSprite *t = viewportElementInitialize<TextSprite>(argc, argv, self);
+
+  setPrivateData(self, t);
+
+  VALUE fontKlass = rb_const_get(rb_cObject, rb_intern("Font"));
+  VALUE fontObj = rb_obj_alloc(fontKlass);
+  rb_obj_call_init(fontObj, 0, 0);
+
+  GFX_LOCK;
+  t->setInitFont(getPrivateData<Font>(fontObj));
+  setPropSlot(t, TextSpriteFont, fontObj);
+  GFX_UNLOCK;
+
+  return self;
+}
+
+RB_METHOD(textSpriteGetText) {
+  RB_UNUSED_PARAM;
+
+  TextSprite *t = getPrivateData<TextSprite>(self);
+
+  VALUE str = Qnil;
+  GUARD_EXC(
+    const std::string &text = t->getText();
+    str = rb_utf8_str_new(text.c_str(), text.size());
+  );
+
+  return str;
+}
+
+RB_METHOD(textSpriteSetText) {
+  rb_check_argc(argc, 1);
+
+  TextSprite *t = getPrivateData<TextSprite>(self);
+
+  VALUE str = rb_obj_as_string(*argv);
+  const std::string text(RSTRING_PTR(str), RSTRING_LEN(str));
+
+  GFX_STATE_GUARD_EXC(t->setText(text););
+
+  return *argv;
+}
+
+RB_METHOD(textSpriteWidth) {
+  RB_UNUSED_PARAM;
+
+  TextSprite *t = getPrivateData<TextSprite>(self);
+
+  int value = 0;
+  GFX_GUARD_EXC(value = t->getWidth(););
+
+  return INT2FIX(value);
+}
+
+RB_METHOD(textSpriteHeight) {
+  RB_UNUSED_PARAM;
+
+  TextSprite *t = getPrivateData<TextSprite>(self);
+
+  int value = 0;
+  GFX_GUARD_EXC(value = t->getHeight(););
+
+  return INT2FIX(value);
+}
+
+DEF_GFX_PROP_OBJ_VAL(TextSprite, Font, Font, TextSpriteFont)
+
+DEF_GFX_PROP_I(TextSprite, X)
+DEF_GFX_PROP_I(TextSprite, Y)
+DEF_GFX_PROP_I(TextSprite, OX)
+DEF_GFX_PROP_I(TextSprite, OY)
+DEF_GFX_PROP_F(TextSprite, ZoomX)
+DEF_GFX_PROP_F(TextSprite, ZoomY)
+DEF_GFX_PROP_F(TextSprite, Angle)
+DEF_GFX_PROP_I(TextSprite, Opacity)
+DEF_GFX_PROP_I(TextSprite, BlendType)
+
+void textSpriteBindingInit() {
+  VALUE klass = rb_define_class("TextSprite", rb_cObject);
+#if RAPI_FULL > 187
+  rb_define_alloc_func(klass, classAllocate<&TextSpriteType>);
+#else
+  rb_define_alloc_func(klass, TextSpriteAllocate);
+#endif
+
+  disposableBindingInit<TextSprite>(klass);
+  viewportElementBindingInit<TextSprite>(klass);
+
+  _rb_define_method(klass, "initialize", textSpriteInitialize);
+  _rb_define_method(klass, "text", textSpriteGetText);
+  _rb_define_method(klass, "text=", textSpriteSetText);
+  _rb_define_method(klass, "width", textSpriteWidth);
+  _rb_define_method(klass, "height", textSpriteHeight);
+
+  INIT_PROP_BIND(TextSprite, Font, "font");
+  INIT_PROP_BIND(TextSprite, X, "x");
+  INIT_PROP_BIND(TextSprite, Y, "y");
+  INIT_PROP_BIND(TextSprite, OX, "ox");
+  INIT_PROP_BIND(TextSprite, OY, "oy");
+  INIT_PROP_BIND(TextSprite, ZoomX, "zoom_x");
+  INIT_PROP_BIND(TextSprite, ZoomY, "zoom_y");
+  INIT_PROP_BIND(TextSprite, Angle, "angle");
+  INIT_PROP_BIND(TextSprite, Opacity, "opacity");
+  INIT_PROP_BIND(TextSprite, BlendType, "blend_type");
+}
@@ -66,11 +66,22 @@ RB_METHOD(tilemapAutotilesGet) {
 }
 
 #if RAPI_FULL > 187
-DEF_TYPE(Tilemap);
+DEF_TYPE_SLOTTED(Tilemap);
 #else
-DEF_ALLOCFUNC(Tilemap);
+DEF_ALLOCFUNC_SLOTTED(Tilemap);
 #endif
 
+enum {
+    TilemapViewport,
+    TilemapAutotiles,
+    TilemapTileset,
+    TilemapMapData,
+    TilemapFlashData,
+    TilemapPriorities,
+    TilemapColor,
+    TilemapTone
+};
+
 RB_METHOD(tilemapInitialize) {
     Tilemap *t;
     
@@ -87,18 +98,17 @@ RB_METHOD(tilemapInitialize) {
     /* Construct object */
     t = new Tilemap(viewport);
     
-    rb_iv_set(self, "viewport", viewportObj);
+    setPropSlot(t, TilemapViewport, viewportObj);
     
     setPrivateData(self, t);
     
     t->initDynAttribs();
     
-    wrapProperty(self, &t->getAutotiles(), "autotiles", TilemapAutotilesType);
-    
-    wrapProperty(self, &t->getColor(), "color", ColorType);
-    wrapProperty(self, &t->getTone(), "tone", ToneType);
+    VALUE autotilesObj = wrapProperty(t, &t->getAutotiles(), TilemapAutotiles,
+                                      TilemapAutotilesType);
     
-    VALUE autotilesObj = rb_iv_get(self, "autotiles");
+    wrapProperty(t, &t->getColor(), TilemapColor, ColorType);
+    wrapProperty(t, &t->getTone(), TilemapTone, ToneType);
     
     VALUE ary = rb_ary_new2(7);
     for (int i = 0; i < 7; ++i)
@@ -119,7 +129,7 @@ RB_METHOD(tilemapGetAutotiles) {
     
     checkDisposed<Tilemap>(self);
     
-    return rb_iv_get(self, "autotiles");
+    return getPropSlot(getPrivateData<Tilemap>(self), TilemapAutotiles);
 }
 
 RB_METHOD(tilemapUpdate) {
@@ -139,16 +149,16 @@ RB_METHOD(tilemapGetViewport) {
     
     checkDisposed<Tilemap>(self);
     
-    return rb_iv_get(self, "viewport");
+    return getPropSlot(getPrivateData<Tilemap>(self), TilemapViewport);
 }
 
-DEF_GFX_PROP_OBJ_REF(Tilemap, Bitmap, Tileset, "tileset")
-DEF_GFX_PROP_OBJ_REF(Tilemap, Table, MapData, "map_data")
-DEF_GFX_PROP_OBJ_REF(Tilemap, Table, FlashData, "flash_data")
-DEF_GFX_PROP_OBJ_REF(Tilemap, Table, Priorities, "priorities")
+DEF_GFX_PROP_OBJ_REF(Tilemap, Bitmap, Tileset, TilemapTileset)
+DEF_GFX_PROP_OBJ_REF(Tilemap, Table, MapData, TilemapMapData)
+DEF_GFX_PROP_OBJ_REF(Tilemap, Table, FlashData, TilemapFlashData)
+DEF_GFX_PROP_OBJ_REF(Tilemap, Table, Priorities, TilemapPriorities)
 
-DEF_GFX_PROP_OBJ_VAL(Tilemap, Color, Color, "color")
-DEF_GFX_PROP_OBJ_VAL(Tilemap, Tone, Tone, "tone")
+DEF_GFX_PROP_OBJ_VAL(Tilemap, Color, Color, TilemapColor)
+DEF_GFX_PROP_OBJ_VAL(Tilemap, Tone, Tone, TilemapTone)
 
 DEF_GFX_PROP_B(Tilemap, Visible)
 
@@ -30,14 +30,22 @@
 #include "disposable-binding.h"
 
 #if RAPI_FULL > 187
-DEF_TYPE_CUSTOMNAME(TilemapVX, "Tilemap");
+DEF_TYPE_CUSTOMNAME_SLOTTED(TilemapVX, "Tilemap");
 
 DEF_TYPE_CUSTOMFREE(BitmapArray, RUBY_TYPED_NEVER_FREE);
 #else
-DEF_ALLOCFUNC(TilemapVX);
+DEF_ALLOCFUNC_SLOTTED(TilemapVX);
 #define BitmapArrayType "BitmapArray"
 #endif
 
+enum {
+    TilemapVXViewport,
+    TilemapVXBitmapArray,
+    TilemapVXMapData,
+    TilemapVXFlashData,
+    TilemapVXFlags
+};
+
 RB_METHOD(tilemapVXInitialize) {
     TilemapVX *t;
     
@@ -56,12 +64,11 @@ RB_METHOD(tilemapVXInitialize) {
     
     setPrivateData(self, t);
     
-    rb_iv_set(self, "viewport", viewportObj);
-    
-    wrapProperty(self, &t->getBitmapArray(), "bitmap_array", BitmapArrayType,
-                 rb_const_get(rb_cObject, rb_intern("Tilemap")));
+    setPropSlot(t, TilemapVXViewport, viewportObj);
     
-    VALUE autotilesObj = rb_iv_get(self, "bitmap_array");
+    VALUE autotilesObj =
+        wrapProperty(t, &t->getBitmapArray(), TilemapVXBitmapArray, BitmapArrayType,
+                     rb_const_get(rb_cObject, rb_intern("Tilemap")));
     
     VALUE ary = rb_ary_new2(9);
     for (int i = 0; i < 9; ++i)
@@ -82,7 +89,7 @@ RB_METHOD(tilemapVXGetBitmapArray) {
     
     checkDisposed<TilemapVX>(self);
     
-    return rb_iv_get(self, "bitmap_array");
+    return getPropSlot(getPrivateData<TilemapVX>(self), TilemapVXBitmapArray);
 }
 
 RB_METHOD(tilemapVXUpdate) {
@@ -95,10 +102,10 @@ RB_METHOD(tilemapVXUpdate) {
     return Qnil;
 }
 
-DEF_GFX_PROP_OBJ_REF(TilemapVX, Viewport, Viewport, "viewport")
-DEF_GFX_PROP_OBJ_REF(TilemapVX, Table, MapData, "map_data")
-DEF_GFX_PROP_OBJ_REF(TilemapVX, Table, FlashData, "flash_data")
-DEF_GFX_PROP_OBJ_REF(TilemapVX, Table, Flags, "flags")
+DEF_GFX_PROP_OBJ_REF(TilemapVX, Viewport, Viewport, TilemapVXViewport)
+DEF_GFX_PROP_OBJ_REF(TilemapVX, Table, MapData, TilemapVXMapData)
+DEF_GFX_PROP_OBJ_REF(TilemapVX, Table, FlashData, TilemapVXFlashData)
+DEF_GFX_PROP_OBJ_REF(TilemapVX, Table, Flags, TilemapVXFlags)
 
 DEF_GFX_PROP_B(TilemapVX, Visible)
 
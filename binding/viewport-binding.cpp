@@ -28,11 +28,13 @@
 #include "viewport.h"
 
 #if RAPI_FULL > 187
-DEF_TYPE(Viewport);
+DEF_TYPE_SLOTTED(Viewport);
 #else
-DEF_ALLOCFUNC(Viewport);
+DEF_ALLOCFUNC_SLOTTED(Viewport);
 #endif
 
+enum { ViewportRect, ViewportColor, ViewportTone };
+
 RB_METHOD(viewportInitialize) {
     Viewport *v;
     
@@ -64,9 +66,9 @@ RB_METHOD(viewportInitialize) {
     /* Wrap property objects */
     v->initDynAttribs();
     
-    wrapProperty(self, &v->getRect(), "rect", RectType);
-    wrapProperty(self, &v->getColor(), "color", ColorType);
-    wrapProperty(self, &v->getTone(), "tone", ToneType);
+    wrapProperty(v, &v->getRect(), ViewportRect, RectType);
+    wrapProperty(v, &v->getColor(), ViewportColor, ColorType);
+    wrapProperty(v, &v->getTone(), ViewportTone, ToneType);
     
     /* 'elements' holds all SceneElements that become children
      * of this viewport, so we can dispose them when the viewport
@@ -91,13 +93,57 @@ RB_METHOD(viewportSpriteFinalize)
     return Qnil;
 }
 
-DEF_GFX_PROP_OBJ_VAL(Viewport, Rect, Rect, "rect")
-DEF_GFX_PROP_OBJ_VAL(Viewport, Color, Color, "color")
-DEF_GFX_PROP_OBJ_VAL(Viewport, Tone, Tone, "tone")
+VALUE spriteObject(Sprite *s);
+
+/* pick(x, y); the topmost sprite hit at that screen pixel, or nil */
+RB_METHOD(viewportPick)
+{
+    Viewport *v = getPrivateData<Viewport>(self);
+    
+    int x, y;
+    rb_get_args(argc, argv, "ii", &x, &y RB_ARG_END);
+    
+    Sprite *s = 0;
+    GFX_GUARD_EXC(s = v->pick(x, y););
+    
+    return s ? spriteObject(s) : Qnil;
+}
+
+DEF_GFX_PROP_OBJ_VAL(Viewport, Rect, Rect, ViewportRect)
+DEF_GFX_PROP_OBJ_VAL(Viewport, Color, Color, ViewportColor)
+DEF_GFX_PROP_OBJ_VAL(Viewport, Tone, Tone, ViewportTone)
 
 DEF_GFX_PROP_I(Viewport, OX)
 DEF_GFX_PROP_I(Viewport, OY)
 
+RB_METHOD(ViewportGetCache)
+{
+    RB_UNUSED_PARAM;
+    
+    Viewport *v = getPrivateData<Viewport>(self);
+    
+    bool value = false;
+    GUARD_EXC(value = v->getCache(););
+    
+    return rb_bool_new(value);
+}
+
+/* Turning the cache off frees its texture right away,
+ * so unlike the other attributes this takes GL */
+RB_METHOD(ViewportSetCache)
+{
+    rb_check_argc(argc, 1);
+    
+    Viewport *v = getPrivateData<Viewport>(self);
+    
+    bool value;
+    rb_bool_arg(*argv, &value);
+    
+    GFX_GUARD_EXC(v->setCache(value););
+    
+    return *argv;
+}
+
 void viewportBindingInit() {
     VALUE klass = rb_define_class("Viewport", rb_cObject);
 #if RAPI_FULL > 187
@@ -112,10 +158,12 @@ void viewportBindingInit() {
     
     _rb_define_method(klass, "initialize", viewportInitialize);
     _rb_define_method(klass, "_sprite_finalizer", viewportSpriteFinalize);
+    _rb_define_method(klass, "pick", viewportPick);
     
     INIT_PROP_BIND(Viewport, Rect, "rect");
     INIT_PROP_BIND(Viewport, OX, "ox");
     INIT_PROP_BIND(Viewport, OY, "oy");
     INIT_PROP_BIND(Viewport, Color, "color");
     INIT_PROP_BIND(Viewport, Tone, "tone");
+    INIT_PROP_BIND(Viewport, Cache, "cache");
 }
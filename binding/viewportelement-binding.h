@@ -31,6 +31,10 @@
 #include "sceneelement-binding.h"
 #include "disposable-binding.h"
 
+/* Binding slot holding the viewport object, the
+ * other property slots of elements follow it */
+enum { ViewportSlot = 0 };
+
 template<class C>
 RB_METHOD(viewportElementGetViewport)
 {
@@ -38,7 +42,7 @@ RB_METHOD(viewportElementGetViewport)
 
 	checkDisposed<C>(self);
 
-	return rb_iv_get(self, "viewport");
+	return getPropSlot(getPrivateData<C>(self), ViewportSlot);
 }
 
 template<class C>
@@ -46,7 +50,7 @@ RB_METHOD(viewportElementSetViewport)
 {
 	RB_UNUSED_PARAM;
 
-	ViewportElement *ve = getPrivateData<C>(self);
+	C *ve = getPrivateData<C>(self);
 
 	VALUE viewportObj = Qnil;
 	Viewport *viewport = 0;
@@ -64,7 +68,7 @@ RB_METHOD(viewportElementSetViewport)
 
 	GFX_GUARD_EXC( ve->setViewport(viewport); );
 
-	rb_iv_set(self, "viewport", viewportObj);
+	setPropSlot(ve, ViewportSlot, viewportObj);
 
 	return viewportObj;
 }
@@ -93,7 +97,7 @@ viewportElementInitialize(int argc, VALUE *argv, VALUE self)
 
     
 	/* Set property objects */
-	rb_iv_set(self, "viewport", viewportObj);
+	setPropSlot(ve, ViewportSlot, viewportObj);
     GFX_UNLOCK;
 	return ve;
 }
@@ -25,11 +25,17 @@
 #include "window.h"
 
 #if RAPI_FULL > 187
-DEF_TYPE(Window);
+DEF_TYPE_SLOTTED(Window);
 #else
-DEF_ALLOCFUNC(Window);
+DEF_ALLOCFUNC_SLOTTED(Window);
 #endif
 
+enum {
+    WindowWindowskin = ViewportSlot + 1,
+    WindowContents,
+    WindowCursorRect
+};
+
 RB_METHOD(windowInitialize) {
     GFX_LOCK;
     Window *w = viewportElementInitialize<Window>(argc, argv, self);
@@ -38,7 +44,7 @@ RB_METHOD(windowInitialize) {
     
     w->initDynAttribs();
     
-    wrapProperty(self, &w->getCursorRect(), "cursor_rect", RectType);
+    wrapProperty(w, &w->getCursorRect(), WindowCursorRect, RectType);
     
     GFX_UNLOCK;
     return self;
@@ -54,9 +60,9 @@ RB_METHOD(windowUpdate) {
     return Qnil;
 }
 
-DEF_GFX_PROP_OBJ_REF(Window, Bitmap, Windowskin, "windowskin")
-DEF_GFX_PROP_OBJ_REF(Window, Bitmap, Contents, "contents")
-DEF_GFX_PROP_OBJ_VAL(Window, Rect, CursorRect, "cursor_rect")
+DEF_GFX_PROP_OBJ_REF(Window, Bitmap, Windowskin, WindowWindowskin)
+DEF_GFX_PROP_OBJ_REF(Window, Bitmap, Contents, WindowContents)
+DEF_GFX_PROP_OBJ_VAL(Window, Rect, CursorRect, WindowCursorRect)
 
 DEF_GFX_PROP_B(Window, Stretch)
 DEF_GFX_PROP_B(Window, Active)
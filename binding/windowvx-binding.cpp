@@ -28,11 +28,18 @@
 #include "graphics.h"
 
 #if RAPI_FULL > 187
-DEF_TYPE_CUSTOMNAME(WindowVX, "Window");
+DEF_TYPE_CUSTOMNAME_SLOTTED(WindowVX, "Window");
 #else
-DEF_ALLOCFUNC(WindowVX);
+DEF_ALLOCFUNC_SLOTTED(WindowVX);
 #endif
 
+enum {
+  WindowVXWindowskin = ViewportSlot + 1,
+  WindowVXContents,
+  WindowVXCursorRect,
+  WindowVXTone
+};
+
 void bitmapInitProps(Bitmap *b, VALUE self);
 
 RB_METHOD(windowVXInitialize) {
@@ -55,15 +62,15 @@ RB_METHOD(windowVXInitialize) {
 
   w->initDynAttribs();
 
-  wrapProperty(self, &w->getCursorRect(), "cursor_rect", RectType);
+  wrapProperty(w, &w->getCursorRect(), WindowVXCursorRect, RectType);
 
   if (rgssVer >= 3)
-    wrapProperty(self, &w->getTone(), "tone", ToneType);
+    wrapProperty(w, &w->getTone(), WindowVXTone, ToneType);
 
   Bitmap *contents = new Bitmap(1, 1);
   VALUE contentsObj = wrapObject(contents, BitmapType);
   bitmapInitProps(contents, contentsObj);
-  rb_iv_set(self, "contents", contentsObj);
+  setPropSlot(w, WindowVXContents, contentsObj);
 
     GFX_UNLOCK;
   return self;
@@ -85,7 +92,7 @@ RB_METHOD(windowVXMove) {
   WindowVX *w = getPrivateData<WindowVX>(self);
 
   int x, y, width, height;
-  rb_get_args(argc, argv, "iiii", &x, &y, &width, &height RB_ARG_END);
+  rb_unpack_args<4>(argc, argv, &x, &y, &width, &height);
 
     GFX_LOCK;
   w->move(x, y, width, height);
@@ -110,11 +117,11 @@ RB_METHOD(windowVXIsClosed) {
   return rb_bool_new(w->isClosed());
 }
 
-DEF_GFX_PROP_OBJ_REF(WindowVX, Bitmap, Windowskin, "windowskin")
-DEF_GFX_PROP_OBJ_REF(WindowVX, Bitmap, Contents, "contents")
+DEF_GFX_PROP_OBJ_REF(WindowVX, Bitmap, Windowskin, WindowVXWindowskin)
+DEF_GFX_PROP_OBJ_REF(WindowVX, Bitmap, Contents, WindowVXContents)
 
-DEF_GFX_PROP_OBJ_VAL(WindowVX, Rect, CursorRect, "cursor_rect")
-DEF_GFX_PROP_OBJ_VAL(WindowVX, Tone, Tone, "tone")
+DEF_GFX_PROP_OBJ_VAL(WindowVX, Rect, CursorRect, WindowVXCursorRect)
+DEF_GFX_PROP_OBJ_VAL(WindowVX, Tone, Tone, WindowVXTone)
 
 DEF_GFX_PROP_I(WindowVX, X)
 DEF_GFX_PROP_I(WindowVX, Y)
@@ -0,0 +1,223 @@
+# Microbenchmarks of the engine primitives scripts lean on.
+#
+# Runs headless through the mkxp.json next to this file (on Linux,
+# point SRCDIR at this folder; 'meson test --benchmark' does that).
+# Every result is reported in ns per operation, on the console and
+# as JSON in $MKXPZ_BENCH_OUT (default: bench-results.json). Work
+# queued on the GPU is waited for before the clock is stopped.
+
+$results = []
+
+def now_ns
+  Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+end
+
+# Runs the block 'iterations' times, after a warmup of a tenth as
+# many. 'sync' is called before the clock starts and stops
+def bench(name, iterations, params = {}, sync = nil)
+  [iterations / 10, 1].max.times { |i| yield i }
+  sync.call if sync
+  GC.start
+
+  start = now_ns
+  iterations.times { |i| yield i }
+  sync.call if sync
+  elapsed = now_ns - start
+
+  ns = elapsed.to_f / iterations
+  $results << { "name" => name, "params" => params,
+                "iterations" => iterations, "ns_per_op" => ns.round(1) }
+
+  desc = params.map { |k, v| "#{k}=#{v}" }.join(" ")
+  puts format("%-24s %-16s %14.1f ns/op", name, desc, ns)
+rescue StandardError => e
+  $results << { "name" => name, "params" => params, "error" => e.message }
+  puts "#{name}: #{e.message}"
+end
+
+def to_json(value)
+  case value
+  when Hash
+    "{" + value.map { |k, v| "#{to_json(k.to_s)}: #{to_json(v)}" }.join(", ") + "}"
+  when Array
+    "[" + value.map { |v| to_json(v) }.join(", ") + "]"
+  when String
+    "\"" + value.gsub(/["\\]/) { |c| "\\" + c }.gsub("\n", "\\n") + "\""
+  when nil
+    "null"
+  else
+    value.to_s
+  end
+end
+
+# Waits until everything drawn into 'bitmap' is done
+def gpu_sync(bitmap)
+  -> { bitmap.get_pixel(0, 0) }
+end
+
+def frame_sync
+  -> { Graphics.snap_to_bitmap.dispose }
+end
+
+srand(1234)
+
+# Bitmap operations
+
+dst = Bitmap.new(640, 480)
+src = Bitmap.new(32, 32)
+src.fill_rect(src.rect, Color.new(255, 128, 0, 200))
+
+bench("bitmap_blt", 20000, { "size" => 32 }, gpu_sync(dst)) do |i|
+  dst.blt((i * 37) % 608, (i * 53) % 448, src, src.rect)
+end
+
+bench("bitmap_fill_rect", 20000, { "size" => 32 }, gpu_sync(dst)) do |i|
+  dst.fill_rect((i * 37) % 608, (i * 53) % 448, 32, 32, Color.new(i % 256, 64, 128))
+end
+
+bench("bitmap_draw_text", 2000, {}, gpu_sync(dst)) do |i|
+  dst.draw_text((i * 37) % 400, (i * 53) % 448, 240, 32, "The quick brown fox #{i}")
+end
+
+dst.clear
+bench("bitmap_get_pixel", 100000) do |i|
+  dst.get_pixel((i * 37) % 640, (i * 53) % 480)
+end
+
+bench("bitmap_get_pixel_modified", 2000) do |i|
+  dst.set_pixel(0, 0, Color.new(i % 256, 0, 0))
+  dst.get_pixel((i * 37) % 640, (i * 53) % 480)
+end
+
+src.dispose
+dst.dispose
+
+# Sprites
+
+sprite_bmp = Bitmap.new(32, 32)
+sprite_bmp.fill_rect(sprite_bmp.rect, Color.new(0, 200, 255))
+
+[100, 1000, 5000].each do |count|
+  sprites = []
+
+  bench("sprite_create", count, { "count" => count }) do
+    sprites << Sprite.new.tap { |s| s.bitmap = sprite_bmp }
+  end
+
+  sprites.each(&:dispose)
+  sprites = Array.new(count) do
+    Sprite.new.tap do |s|
+      s.bitmap = sprite_bmp
+      s.x = rand(Graphics.width)
+      s.y = rand(Graphics.height)
+    end
+  end
+
+  bench("sprite_draw", 120, { "count" => count }, frame_sync) do |i|
+    sprites.each { |s| s.x = (s.x + 1) % Graphics.width }
+    Graphics.update
+  end
+
+  sprites.each(&:dispose)
+end
+
+sprite_bmp.dispose
+
+# Tilemap scrolling over a synthetic map, one tile
+# in each layer everywhere
+
+tiles = Array.new(9) do |i|
+  Bitmap.new(512, 512).tap do |b|
+    b.fill_rect(b.rect, Color.new(i * 28, 255 - i * 28, 128))
+  end
+end
+
+map = Table.new(200, 200, 4)
+200.times do |x|
+  200.times do |y|
+    map[x, y, 0] = 1536 + (x * 7 + y) % 128
+    map[x, y, 2] = (x + y * 3) % 256 if (x + y) % 5 == 0
+  end
+end
+
+tilemap = Tilemap.new
+9.times { |i| tilemap.bitmaps[i] = tiles[i] }
+tilemap.map_data = map
+
+bench("tilemap_scroll", 300, { "map" => "200x200" }, frame_sync) do |i|
+  tilemap.ox = (i * 3) % 3200
+  tilemap.oy = (i * 2) % 3200
+  tilemap.update
+  Graphics.update
+end
+
+tilemap.dispose
+tiles.each(&:dispose)
+
+# Reads out of an RGSSAD archive
+
+def write_rgssad(path, files)
+  key = 0xDEADCAFE
+  advance = ->(k) { (k * 7 + 3) & 0xFFFFFFFF }
+  out = "RGSSAD\0\x01".b
+
+  files.each do |name, data|
+    out << [name.bytesize ^ key].pack("V")
+    key = advance.call(key)
+
+    name.each_byte do |c|
+      out << (c ^ (key & 0xFF)).chr
+      key = advance.call(key)
+    end
+
+    out << [data.bytesize ^ key].pack("V")
+    key = advance.call(key)
+
+    file_key = key
+    padded = data + "\0" * ((4 - data.bytesize % 4) % 4)
+    words = padded.unpack("V*").map do |w|
+      x = w ^ file_key
+      file_key = advance.call(file_key)
+      x
+    end
+    out << words.pack("V*")[0, data.bytesize]
+  end
+
+  File.open(path, "wb") { |f| f.write(out) }
+end
+
+out_path = ENV["MKXPZ_BENCH_OUT"] || "bench-results.json"
+archive = File.join(File.dirname(File.expand_path(out_path)), "bench.rgssad")
+
+begin
+  blob = Marshal.dump("x" * 16384)
+  write_rgssad(archive, Array.new(64) { |i| ["Bench\\file#{i}.rxdata", blob] })
+  System.mount(archive)
+
+  bench("rgssad_read", 2000, { "size" => 16384 }) do |i|
+    load_data("Bench/file#{i % 64}.rxdata")
+  end
+rescue StandardError => e
+  puts "rgssad_read: #{e.message}"
+end
+
+# Marshal loads of a data-like structure
+
+items = Array.new(1000) do |i|
+  { :id => i, :name => "Item #{i}", :params => [i, i * 2, i * 3, i * 4],
+    :rate => i / 3.0, :note => "<tag: #{i}>" }
+end
+dump = Marshal.dump(items)
+
+bench("marshal_load", 200, { "bytes" => dump.bytesize }) do
+  Marshal.load(dump)
+end
+
+File.open(out_path, "wb") do |f|
+  f.write(to_json({ "rgss_version" => defined?(RGSS_VERSION) ? RGSS_VERSION : nil,
+                    "ruby_version" => RUBY_VERSION,
+                    "results" => $results }))
+  f.write("\n")
+end
+
+puts "Results written to #{out_path}"
@@ -1,9 +1,14 @@
 
+uniform sampler2D texture;
+
 uniform lowp float alpha;
 
-varying lowp vec4 v_color;
+varying vec2 v_texCoord;
 
 void main()
 {
-	gl_FragColor = vec4(v_color.rgb * alpha, 1);
+	/* Texels of cells that don't flash are all zero */
+	lowp vec4 flash = texture2D(texture, v_texCoord);
+
+	gl_FragColor = vec4(flash.rgb * alpha, flash.a);
 }
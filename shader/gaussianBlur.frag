@@ -0,0 +1,45 @@
+/* One direction of a separable gaussian blur. Neighbouring
+ * kernel weights are merged into single bilinear samples
+ * placed between the two texels, halving the fetch count */
+
+uniform sampler2D texture;
+
+/* One texel along the blur direction */
+uniform highp vec2 direction;
+uniform highp float sigma;
+/* Merged samples on either side of the center */
+uniform int taps;
+/* Inverse of the kernel's total weight */
+uniform highp float norm;
+
+varying highp vec2 v_texCoord;
+
+const int maxTaps = 16;
+
+highp float weight(highp float x)
+{
+	return exp(-(x * x) / (2.0 * sigma * sigma));
+}
+
+void main()
+{
+	mediump vec4 frag = texture2D(texture, v_texCoord);
+
+	for (int i = 0; i < maxTaps; ++i)
+	{
+		if (i >= taps)
+			break;
+
+		highp float k = float(i) * 2.0 + 1.0;
+		highp float w1 = weight(k);
+		highp float w2 = weight(k + 1.0);
+		highp float w = w1 + w2;
+
+		highp vec2 delta = direction * ((k * w1 + (k + 1.0) * w2) / w);
+
+		frag += texture2D(texture, v_texCoord + delta) * w;
+		frag += texture2D(texture, v_texCoord - delta) * w;
+	}
+
+	gl_FragColor = frag * norm;
+}
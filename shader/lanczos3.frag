@@ -1,10 +1,16 @@
-// From https://raw.githubusercontent.com/Sentmoraap/doing-sdl-right/93a52a0db0ff2da5066cce12f5b9a2ac62e6f401/assets/lanczos3.frag
+// Based on https://raw.githubusercontent.com/Sentmoraap/doing-sdl-right/93a52a0db0ff2da5066cce12f5b9a2ac62e6f401/assets/lanczos3.frag
 // Copyright 2020 Lilian Gimenez (Sentmoraap).
 // MIT license.
 
+/* One direction of a separable Lanczos3 upscale. Run once
+ * horizontally into an intermediate buffer and once vertically
+ * from it, for 12 fetches per output pixel instead of 36 */
+
 uniform sampler2D texture;
 uniform vec2 sourceSize;
 uniform vec2 texSizeInv;
+/* (1, 0) for the horizontal pass, (0, 1) for the vertical one */
+uniform vec2 direction;
 varying vec2 v_texCoord;
 
 float lanczos3(float x)
@@ -17,32 +23,20 @@ float lanczos3(float x)
 void main()
 {
 	vec2 pixel = v_texCoord * sourceSize + 0.5;
-	vec2 frac = fract(pixel);
-	vec2 onePixel = texSizeInv;
-	pixel = floor(pixel) * texSizeInv - onePixel / 2.0;
+	float frac = dot(fract(pixel), direction);
+	/* Across the pass direction, this is the texel center */
+	vec2 base = (floor(pixel) - 0.5) * texSizeInv;
+	vec2 onePixel = direction * texSizeInv;
 
-	float lanczosX[6];
+	vec4 colour = vec4(0);
 	float sum = 0.0;
-	for(int x = 0; x < 6; x++)
-	{
-		lanczosX[x] = lanczos3(float(x) - 2.0 - frac.x);
-		sum += lanczosX[x];
-	}
-	for(int x = 0; x < 6; x++) lanczosX[x] /= sum;
-	sum = 0.0;
-	float lanczosY[6];
-	for(int y = 0; y < 6; y++)
-	{
-		lanczosY[y] = lanczos3(float(y) - 2.0 - frac.y);
-		sum += lanczosY[y];
-	}
-	for(int y = 0; y < 6; y++) lanczosY[y] /= sum;
-	gl_FragColor = vec4(0);
-	for(int y = -2; y <= 3; y++)
+
+	for(int i = 0; i < 6; i++)
 	{
-		vec4 colour = vec4(0);
-		for(int x = -2; x <= 3; x++)
-				colour += texture2D(texture, pixel + vec2(float(x) * onePixel.x, float(y) * onePixel.y)).rgba * lanczosX[x + 2];
-		gl_FragColor += colour * lanczosY[y + 2];
+		float weight = lanczos3(float(i) - 2.0 - frac);
+		colour += texture2D(texture, base + float(i - 2) * onePixel) * weight;
+		sum += weight;
 	}
+
+	gl_FragColor = colour / sum;
 }
@@ -7,6 +7,9 @@ uniform lowp float opacity;
 uniform lowp vec4 color;
 uniform lowp vec4 flash;
 
+/* Repeats the texture where GL_REPEAT is unavailable */
+uniform bool wrap;
+
 varying vec2 v_texCoord;
 
 const vec3 lumaF = vec3(.299, .587, .114);
@@ -14,7 +17,7 @@ const vec3 lumaF = vec3(.299, .587, .114);
 void main()
 {
 	/* Sample source color */
-	vec4 frag = texture2D(texture, v_texCoord);
+	vec4 frag = texture2D(texture, wrap ? fract(v_texCoord) : v_texCoord);
 	
 	/* Apply gray */
 	float luma = dot(frag.rgb, lumaF);
@@ -0,0 +1,54 @@
+/* Averages copies of the image rotated around its center in
+ * a single pass. Beyond the edges, the image is mirrored along
+ * one axis, but not both */
+
+uniform sampler2D texture;
+
+uniform highp vec2 imageSize;
+
+/* Rotation of the first copy, and between two copies,
+ * each as (cos, sin) */
+uniform highp vec2 rotStart;
+uniform highp vec2 rotStep;
+uniform int divisions;
+
+varying highp vec2 v_texCoord;
+
+const int maxDivisions = 100;
+
+highp float mirror(highp float x)
+{
+	return x < 0.0 ? -x : (x > 1.0 ? 2.0 - x : x);
+}
+
+void main()
+{
+	highp vec2 center = imageSize * 0.5;
+	highp vec2 pos = v_texCoord * imageSize - center;
+	highp vec2 rot = rotStart;
+
+	mediump vec4 acc = vec4(0.0);
+
+	for (int i = 0; i < maxDivisions; ++i)
+	{
+		if (i >= divisions)
+			break;
+
+		highp vec2 coord = (vec2(rot.x * pos.x + rot.y * pos.y,
+		                         rot.x * pos.y - rot.y * pos.x) + center) / imageSize;
+
+		bool outX = coord.x < 0.0 || coord.x > 1.0;
+		bool outY = coord.y < 0.0 || coord.y > 1.0;
+
+		if (!(outX && outY))
+		{
+			lowp vec4 src = texture2D(texture, vec2(mirror(coord.x), mirror(coord.y)));
+			acc += vec4(src.rgb * src.a, src.a);
+		}
+
+		rot = vec2(rot.x * rotStep.x - rot.y * rotStep.y,
+		           rot.x * rotStep.y + rot.y * rotStep.x);
+	}
+
+	gl_FragColor = acc / float(divisions);
+}
@@ -0,0 +1,30 @@
+/* Fragment shader applying the effects of a viewport
+ * covering the whole screen (gray and color tone, color,
+ * flash) and the screen brightness in a single pass */
+
+uniform sampler2D texture;
+uniform lowp vec4 tone;
+uniform lowp vec4 color;
+uniform lowp vec4 flash;
+uniform lowp float brightness;
+
+varying vec2 v_texCoord;
+
+const vec3 lumaF = vec3(.299, .587, .114);
+
+void main()
+{
+	vec4 frag = texture2D(texture, v_texCoord);
+
+	/* Same order the separate passes are drawn in */
+	float luma = dot(frag.rgb, lumaF);
+	frag.rgb = mix(frag.rgb, vec3(luma), tone.w);
+	frag.rgb = clamp(frag.rgb + tone.rgb, 0.0, 1.0);
+
+	frag.rgb = mix(frag.rgb, color.rgb, color.a);
+	frag.rgb = mix(frag.rgb, flash.rgb, flash.a);
+
+	frag.rgb *= brightness;
+
+	gl_FragColor = frag;
+}
@@ -0,0 +1,29 @@
+/* Fragment shader for text drawn from a signed distance
+ * field glyph atlas (see SdfAtlas); 0.5 is the glyph edge */
+
+uniform sampler2D texture;
+
+uniform lowp vec4 color;
+uniform lowp vec4 outColor;
+uniform lowp float opacity;
+
+/* Half the width of the antialiased edge, in field units */
+uniform float smoothing;
+
+/* Field value where the outline ends, 0.5 without one */
+uniform float outlineEdge;
+
+varying vec2 v_texCoord;
+
+void main()
+{
+	float dist = texture2D(texture, v_texCoord).r;
+
+	float fill = smoothstep(0.5 - smoothing, 0.5 + smoothing, dist);
+	float cover = smoothstep(outlineEdge - smoothing, outlineEdge + smoothing, dist);
+
+	vec4 frag = mix(outColor, color, fill);
+	frag.a *= cover * opacity;
+
+	gl_FragColor = frag;
+}
@@ -0,0 +1,24 @@
+/* Fragment shader scaling the game screen to the window in
+ * one pass, looking like a nearest neighbor upscale by an
+ * integer factor that is then scaled linearly to the final
+ * size. Needs the source texture to be sampled linearly */
+
+uniform sampler2D texture;
+uniform vec2 sourceSize;
+uniform vec2 scale;
+
+varying vec2 v_texCoord;
+
+void main()
+{
+	vec2 texel = v_texCoord * sourceSize;
+	vec2 texelFloored = floor(texel);
+
+	/* Only blend within half an upscaled pixel of
+	 * each texel edge, everything else is flat */
+	vec2 centerDist = fract(texel) - 0.5;
+	vec2 regionRange = 0.5 - 0.5 / scale;
+	vec2 f = (centerDist - clamp(centerDist, -regionRange, regionRange)) * scale + 0.5;
+
+	gl_FragColor = texture2D(texture, (texelFloored + f) / sourceSize);
+}
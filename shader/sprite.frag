@@ -1,20 +1,38 @@
 
+/* Each effect below is only compiled in if its SPRITE_* macro
+ * is defined, see SpriteShader::Features */
+
 uniform sampler2D texture;
 
+uniform lowp float opacity;
+
+#ifdef SPRITE_TONE
 uniform lowp vec4 tone;
+#endif
 
-uniform lowp float opacity;
+#ifdef SPRITE_COLOR
 uniform lowp vec4 color;
+#endif
 
+#ifdef SPRITE_BUSH
 uniform float bushDepth;
 uniform lowp float bushOpacity;
+#endif
 
+#ifdef SPRITE_PATTERN
 uniform sampler2D pattern;
 uniform int patternBlendType;
 uniform lowp float patternOpacity;
 uniform bool renderPattern;
+#endif
 
+#ifdef SPRITE_INVERT
 uniform bool invert;
+#endif
+
+#ifdef SPRITE_HUE
+uniform mediump float hueAdjust;
+#endif
 
 varying vec2 v_texCoord;
 varying vec2 v_patCoord;
@@ -22,6 +40,7 @@ varying vec2 v_patCoord;
 const vec3 lumaF = vec3(.299, .587, .114);
 const vec2 repeat = vec2(1, 1);
 
+#ifdef SPRITE_PATTERN
 
 // = = = = = = = = = = =
 // mixing functions, from https://github.com/jamieowen/glsl-blend
@@ -64,11 +83,47 @@ vec3 blendSubtract(vec3 base, vec3 blend, float opacity) {
 
 // = = = = = = = = = = =
 
+#endif
+
+#ifdef SPRITE_HUE
+
+/* Same as in hue.frag */
+vec3 rgb2hsv(vec3 c)
+{
+	const vec4 K = vec4(0.0, -1.0 / 3.0, 2.0 / 3.0, -1.0);
+	vec4 p = mix(vec4(c.bg, K.wz), vec4(c.gb, K.xy), step(c.b, c.g));
+	vec4 q = mix(vec4(p.xyw, c.r), vec4(c.r, p.yzx), step(p.x, c.r));
+
+	float d = q.x - min(q.w, q.y);
+	const float eps = 1.0e-10;
+
+	return vec3(abs(q.z + (q.w - q.y) / (6.0 * d + eps)), d / (q.x + eps), q.x);
+}
+
+vec3 hsv2rgb(vec3 c)
+{
+	const vec4 K = vec4(1.0, 2.0 / 3.0, 1.0 / 3.0, 3.0);
+	vec3 p = abs(fract(c.xxx + K.xyz) * 6.0 - K.www);
+	return c.z * mix(K.xxx, clamp(p - K.xxx, 0.0, 1.0), c.y);
+}
+
+#endif
+
 void main()
 {
 	/* Sample source color */
 	vec4 frag = texture2D(texture, v_texCoord);
     
+#ifdef SPRITE_HUE
+    /* Apply hue */
+    if (hueAdjust != 0.0) {
+        vec3 hsv = rgb2hsv(frag.rgb);
+        hsv.x += hueAdjust;
+        frag.rgb = hsv2rgb(hsv);
+    }
+#endif
+    
+#ifdef SPRITE_PATTERN
     /* Apply pattern */
     if (renderPattern) {
         vec4 pattfrag = texture2D(pattern, mod(v_patCoord, repeat));
@@ -82,28 +137,37 @@ void main()
             frag.rgb = blendNormal(frag.rgb, pattfrag.rgb, pattfrag.a * patternOpacity);
         }
     }
+#endif
 	
+#ifdef SPRITE_TONE
 	/* Apply gray */
 	float luma = dot(frag.rgb, lumaF);
 	frag.rgb = mix(frag.rgb, vec3(luma), tone.w);
 	
 	/* Apply tone */
 	frag.rgb += tone.rgb;
+#endif
 
 	/* Apply opacity */
 	frag.a *= opacity;
 	
+#ifdef SPRITE_COLOR
 	/* Apply color */
 	frag.rgb = mix(frag.rgb, color.rgb, color.a);
+#endif
     
+#ifdef SPRITE_INVERT
     /* Apply color inversion */
     if (invert) {
         frag.rgb = vec3(1.0 - frag.r, 1.0 - frag.g, 1.0 - frag.b);
     }
+#endif
 
+#ifdef SPRITE_BUSH
 	/* Apply bush alpha by mathematical if */
 	lowp float underBush = float(v_texCoord.y < bushDepth);
 	frag.a *= clamp(bushOpacity + underBush, 0.0, 1.0);
+#endif
 	
 	gl_FragColor = frag;
 }
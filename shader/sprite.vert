@@ -10,6 +10,12 @@ uniform vec2 patternZoom;
 uniform bool renderPattern;
 uniform bool patternTile;
 
+/* Wave effect; 'position.y' of each strip vertex holds
+ * the strip's top edge, the phase is in radians */
+uniform float waveAmp;
+uniform float wavePhase;
+uniform float waveFreq;
+
 attribute vec2 position;
 attribute vec2 texCoord;
 
@@ -18,7 +24,13 @@ varying vec2 v_patCoord;
 
 void main()
 {
-	gl_Position = projMat * spriteMat * vec4(position, 0, 1);
+	vec2 pos = position;
+	
+	if (waveAmp != 0.0)
+		pos = vec2(position.x + sin(wavePhase + position.y * waveFreq) * waveAmp,
+		           texCoord.y);
+	
+	gl_Position = projMat * spriteMat * vec4(pos, 0, 1);
     
     v_texCoord = texCoord * texSizeInv;
     
@@ -7,12 +7,25 @@ uniform lowp vec4 color;
 
 varying vec2 v_texCoord;
 
+#ifdef TILEMAP_DEPTH
+/* 1: only opaque texels, 2: only translucent ones, else all */
+uniform lowp int alphaPass;
+#endif
+
 const vec3 lumaF = vec3(.299, .587, .114);
 
 void main() {
   /* Sample source color */
   vec4 frag = texture2D(texture, v_texCoord);
 
+#ifdef TILEMAP_DEPTH
+  if (alphaPass == 1 && frag.a < 1.0)
+    discard;
+
+  if (alphaPass == 2 && (frag.a == 1.0 || frag.a == 0.0))
+    discard;
+#endif
+
   /* Apply gray */
   float luma = dot(frag.rgb, lumaF);
   frag.rgb = mix(frag.rgb, vec3(luma), tone.w);
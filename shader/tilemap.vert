@@ -22,9 +22,22 @@ const float atAniOffsetY = tileH;
 
 uniform lowp int atFrames[nAutotiles];
 
+#ifdef TILEMAP_DEPTH
+/* Clip space depth distance between two zlayers */
+uniform float depthStep;
+#endif
+
 void main()
 {
+    vec2 pos = position;
     vec2 tex = texCoord;
+
+#ifdef TILEMAP_DEPTH
+    /* The zlayer index is carried in 64ths of a pixel */
+    float layer = floor(fract(pos.y) * 64.0 + 0.5);
+    pos.y -= layer / 64.0;
+#endif
+
     lowp int atIndex = int(tex.y / autotileH);
 
     lowp int pred = int(tex.x <= atAreaW && tex.y <= atAreaH);
@@ -34,7 +47,12 @@ void main()
     tex.x += atAniOffsetX * float(col * pred);
     tex.y += atAniOffsetY * float(row * pred);
 
-    gl_Position = projMat * vec4(position + translation, 0, 1);
+    gl_Position = projMat * vec4(pos + translation, 0, 1);
+
+#ifdef TILEMAP_DEPTH
+    /* Higher zlayers end up closer */
+    gl_Position.z = (1.0 - (2.0 * layer + 1.0) * depthStep) * gl_Position.w;
+#endif
 
     v_texCoord = tex * texSizeInv;
 }
@@ -0,0 +1,131 @@
+/* Resolves the ground layer of a Tilemap per fragment.
+ * 'mapData' holds the tile index of every map cell (z layers
+ * stacked vertically, non ground tiles zeroed), 'tileLookup'
+ * the atlas origin of each quarter of every tile index */
+
+uniform sampler2D texture;
+uniform sampler2D mapData;
+uniform sampler2D tileLookup;
+
+uniform highp vec2 atlasSizeInv;
+uniform highp vec2 mapSize;
+uniform highp vec2 mapTexSizeInv;
+uniform highp vec2 lookupSize;
+uniform highp float layers;
+
+uniform highp int aniIndex;
+
+uniform lowp vec4 tone;
+
+uniform lowp float opacity;
+uniform lowp vec4 color;
+
+/* Map pixel coordinates */
+varying highp vec2 v_texCoord;
+
+const int nAutotiles = 7;
+const int maxLayers = 4;
+const highp float tileW = 32.0;
+const highp float tileH = 32.0;
+const highp float autotileW = 3.0*tileW;
+const highp float autotileH = 4.0*tileW;
+const highp float atAreaW = autotileW;
+const highp float atAreaH = autotileH*float(nAutotiles);
+const highp float atAniOffsetX = 3.0*tileW;
+const highp float atAniOffsetY = tileH;
+
+uniform lowp int atFrames[nAutotiles];
+
+const vec3 lumaF = vec3(.299, .587, .114);
+
+highp float decode16(lowp vec2 v)
+{
+	return floor(v.x * 255.0 + 0.5) + floor(v.y * 255.0 + 0.5) * 256.0;
+}
+
+vec4 sampleLayer(highp vec2 tile, highp vec2 inTile, highp float z)
+{
+	highp vec2 mapCoord = vec2(tile.x + 0.5, tile.y + z * mapSize.y + 0.5);
+	highp float tileInd = decode16(texture2D(mapData, mapCoord * mapTexSizeInv).rg);
+
+	/* Empty, or not part of the ground layer */
+	if (tileInd < 48.0)
+		return vec4(0.0);
+
+	highp vec2 quarter = step(16.0, inTile);
+	highp float entry = tileInd * 4.0 + quarter.x + quarter.y * 2.0;
+	highp float entryY = floor(entry / lookupSize.x);
+
+	if (entryY >= lookupSize.y)
+		return vec4(0.0);
+
+	highp vec2 lookupCoord = vec2(entry - entryY * lookupSize.x, entryY) + 0.5;
+	lowp vec4 lookup = texture2D(tileLookup, lookupCoord / lookupSize);
+
+	highp vec2 origin = vec2(decode16(lookup.rg), decode16(lookup.ba)) * 16.0;
+
+	/* Animated autotiles, see tilemap.vert */
+	if (origin.x < atAreaW && origin.y < atAreaH)
+	{
+		highp float atIndex = floor(origin.y / autotileH);
+		highp float frames = 1.0;
+
+		for (int i = 0; i < nAutotiles; ++i)
+			if (float(i) == atIndex)
+				frames = float(atFrames[i]);
+
+		highp float frame = mod(float(aniIndex), frames);
+		highp float row = floor(frame / 8.0);
+		highp float col = frame - 8.0 * row;
+
+		origin += vec2(atAniOffsetX * col, atAniOffsetY * row);
+	}
+
+	highp vec2 texel = origin + floor(mod(inTile, 16.0)) + 0.5;
+
+	return texture2D(texture, texel * atlasSizeInv);
+}
+
+void main()
+{
+	highp vec2 tile = floor(v_texCoord / tileW);
+
+	if (tile.x < 0.0 || tile.y < 0.0 || tile.x >= mapSize.x || tile.y >= mapSize.y)
+		discard;
+
+	highp vec2 inTile = v_texCoord - tile * tileW;
+
+	/* Blend the layers over each other, premultiplied */
+	vec4 acc = vec4(0.0);
+
+	for (int z = 0; z < maxLayers; ++z)
+	{
+		if (float(z) >= layers)
+			break;
+
+		vec4 src = sampleLayer(tile, inTile, float(z));
+
+		acc.rgb = src.rgb * src.a + acc.rgb * (1.0 - src.a);
+		acc.a = src.a + acc.a * (1.0 - src.a);
+	}
+
+	if (acc.a <= 0.0)
+		discard;
+
+	vec4 frag = vec4(acc.rgb / acc.a, acc.a);
+
+	/* Apply gray */
+	float luma = dot(frag.rgb, lumaF);
+	frag.rgb = mix(frag.rgb, vec3(luma), tone.w);
+
+	/* Apply tone */
+	frag.rgb += tone.rgb;
+
+	/* Apply opacity */
+	frag.a *= opacity;
+
+	/* Apply color */
+	frag.rgb = mix(frag.rgb, color.rgb, color.a);
+
+	gl_FragColor = frag;
+}
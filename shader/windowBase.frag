@@ -0,0 +1,42 @@
+
+uniform sampler2D texture;
+
+uniform lowp vec4 tone;
+uniform lowp float backOpacity;
+
+/* From a texel of the stretched layer to the matching texel
+ * of the tiled layer, and twice that to the frame's */
+uniform vec2 layerStep;
+
+varying vec2 v_texCoord;
+varying lowp vec4 v_color;
+
+const vec3 lumaF = vec3(.299, .587, .114);
+
+vec4 applyTone(vec4 frag)
+{
+	float luma = dot(frag.rgb, lumaF);
+	frag.rgb = mix(frag.rgb, vec3(luma), tone.w);
+	frag.rgb += tone.rgb;
+	frag.a *= backOpacity;
+
+	return frag;
+}
+
+/* Composes a WindowVX base from its three prerendered layers,
+ * so tone and back_opacity don't require redrawing them */
+void main()
+{
+	vec4 stretched = applyTone(texture2D(texture, v_texCoord));
+	vec4 tiled = applyTone(texture2D(texture, v_texCoord + layerStep));
+	vec4 frame = texture2D(texture, v_texCoord + layerStep * 2.0);
+
+	vec4 bg = vec4(mix(stretched.rgb, tiled.rgb, tiled.a), stretched.a);
+
+	vec4 frag;
+	frag.rgb = mix(bg.rgb, frame.rgb, frame.a);
+	frag.a = frame.a + bg.a * (1.0 - frame.a);
+	frag.a *= v_color.a;
+
+	gl_FragColor = frag;
+}
@@ -0,0 +1,38 @@
+
+uniform sampler2D texture;
+
+uniform lowp vec4 tone;
+uniform lowp float opacity;
+
+/* Tiled layer source rect, and the size of the
+ * windowskin, in pixels */
+uniform vec4 tileSrc;
+uniform vec2 skinSize;
+
+varying vec2 v_texCoord;
+varying vec2 v_bgPos;
+
+const vec3 lumaF = vec3(.299, .587, .114);
+
+vec4 applyTone(vec4 frag)
+{
+	float luma = dot(frag.rgb, lumaF);
+	frag.rgb = mix(frag.rgb, vec3(luma), tone.w);
+	frag.rgb += tone.rgb;
+	frag.a *= opacity;
+
+	return frag;
+}
+
+/* Both background layers of a VX windowskin in one pass: the
+ * tiled layer is blended over the stretched one, keeping the
+ * stretched layer's alpha */
+void main()
+{
+	vec4 stretched = applyTone(texture2D(texture, v_texCoord));
+
+	vec2 tilePos = tileSrc.xy + mod(v_bgPos, tileSrc.zw);
+	vec4 tiled = applyTone(texture2D(texture, tilePos / skinSize));
+
+	gl_FragColor = vec4(mix(stretched.rgb, tiled.rgb, tiled.a), stretched.a);
+}
@@ -0,0 +1,21 @@
+
+uniform mat4 projMat;
+
+uniform vec2 texSizeInv;
+uniform vec2 translation;
+
+uniform vec2 bgOrigin;
+
+attribute vec2 position;
+attribute vec2 texCoord;
+
+varying vec2 v_texCoord;
+varying vec2 v_bgPos;
+
+void main()
+{
+	gl_Position = projMat * vec4(position + translation, 0, 1);
+
+	v_texCoord = texCoord * texSizeInv;
+	v_bgPos = position - bgOrigin;
+}
@@ -0,0 +1,22 @@
+/* Fragment shader converting planar Y'CbCr 4:2:0 video
+ * frames (one luminance texture per plane) to RGB */
+
+uniform sampler2D texture;
+uniform sampler2D texU;
+uniform sampler2D texV;
+
+varying vec2 v_texCoord;
+
+void main()
+{
+	/* Theora uses studio swing BT.601, see the spec, chapter 4.2 */
+	float y = (texture2D(texture, v_texCoord).r * 255.0 - 16.0) / 219.0;
+	float u = (texture2D(texU, v_texCoord).r * 255.0 - 128.0) / 224.0;
+	float v = (texture2D(texV, v_texCoord).r * 255.0 - 128.0) / 224.0;
+
+	vec3 rgb = vec3(y + 1.402 * v,
+	                y - 0.344136 * u - 0.714136 * v,
+	                y + 1.772 * u);
+
+	gl_FragColor = vec4(clamp(rgb, 0.0, 1.0), 1.0);
+}
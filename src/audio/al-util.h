@@ -93,6 +93,11 @@ namespace Buffer
 	{
 		return getInteger(id, AL_CHANNELS);
 	}
+
+	inline ALint getFrequency(Buffer::ID id)
+	{
+		return getInteger(id, AL_FREQUENCY);
+	}
 }
 
 namespace Source
@@ -176,6 +181,16 @@ namespace Source
 		alSourcef(id.al, AL_PITCH, value);
 	}
 
+	inline void setSecOffset(Source::ID id, float value)
+	{
+		alSourcef(id.al, AL_SEC_OFFSET, value);
+	}
+
+	inline void setLooping(Source::ID id, bool value)
+	{
+		alSourcei(id.al, AL_LOOPING, value ? AL_TRUE : AL_FALSE);
+	}
+
 	inline void play(Source::ID id)
 	{
 		alSourcePlay(id.al);
@@ -59,9 +59,25 @@ ALDataSource *createSDLSource(SDL_RWops &ops,
 			                  bool looped);
 
 ALDataSource *createVorbisSource(SDL_RWops &ops,
+                                 uint32_t bufSize,
                                  bool looped);
 
+#ifdef MKXPZ_OPUS
+ALDataSource *createOpusSource(SDL_RWops &ops,
+                               uint32_t bufSize,
+                               bool looped);
+#endif
+
+#ifdef MKXPZ_FLAC
+ALDataSource *createFlacSource(SDL_RWops &ops,
+                               uint32_t bufSize,
+                               bool looped);
+#endif
+
+/* 'filename' identifies the file in the parsed midi cache */
 ALDataSource *createMidiSource(SDL_RWops &ops,
+                               const char *filename,
+                               uint32_t bufSize,
                                bool looped);
 
 #endif // ALDATASOURCE_H
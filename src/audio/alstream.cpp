@@ -30,32 +30,50 @@
 #include "fluid-fun.h"
 #include "sdl-util.h"
 #include "debugwriter.h"
+#include "profiler.h"
+#include "trace.h"
+#include "util.h"
 
 #include <SDL_mutex.h>
-#include <SDL_thread.h>
-#include <SDL_timer.h>
+
+#include <math.h>
 
 ALStream::ALStream(LoopMode loopMode,
-		           const std::string &threadId)
+		           AudioScheduler &scheduler,
+		           int bufCount,
+		           uint32_t bufSize,
+		           int staticLoopSecs)
 	: looped(loopMode == Looped),
 	  state(Closed),
 	  source(0),
-	  thread(0),
+	  scheduler(scheduler),
+	  streaming(false),
 	  preemptPause(false),
-      pitch(1.0f)
+      pitch(1.0f),
+	  bufSize(bufSize),
+	  staticLoopSecs(staticLoopSecs),
+	  adoptedOps(0),
+	  streamTask(this),
+	  queueFilled(false),
+	  bufferMs(0)
 {
+	SDL_AtomicSet(&posSeq, 0);
+	SDL_AtomicSet(&underruns, 0);
+	SDL_AtomicSet(&requeues, 0);
+
 	alSrc = AL::Source::gen();
 
 	AL::Source::setVolume(alSrc, 1.0f);
 	AL::Source::setPitch(alSrc, 1.0f);
 	AL::Source::detachBuffer(alSrc);
 
-	for (int i = 0; i < STREAM_BUFS; ++i)
+	alBuf.resize(bufCount);
+	staticBuf = AL::Buffer::ID(0);
+
+	for (size_t i = 0; i < alBuf.size(); ++i)
 		alBuf[i] = AL::Buffer::gen();
 
 	pauseMut = SDL_CreateMutex();
-
-	threadName = std::string("al_stream (") + threadId + ")";
 }
 
 ALStream::~ALStream()
@@ -65,7 +83,7 @@ ALStream::~ALStream()
 	AL::Source::clearQueue(alSrc);
 	AL::Source::del(alSrc);
 
-	for (int i = 0; i < STREAM_BUFS; ++i)
+	for (size_t i = 0; i < alBuf.size(); ++i)
 		AL::Buffer::del(alBuf[i]);
 
 	SDL_DestroyMutex(pauseMut);
@@ -106,6 +124,24 @@ void ALStream::open(const std::string &filename)
 	state = Stopped;
 }
 
+void ALStream::open(ALStreamPrepared &prepared)
+{
+	checkStopped();
+
+	switch (state)
+	{
+	case Playing:
+	case Paused:
+		stopStream();
+	case Stopped:
+		closeSource();
+	case Closed:
+		adoptSource(prepared);
+	}
+
+	state = Stopped;
+}
+
 void ALStream::stop()
 {
 	checkStopped();
@@ -189,25 +225,75 @@ float ALStream::queryOffset()
 	if (state == Closed || !source)
 		return 0;
 
-	float procOffset = static_cast<float>(procFrames) / source->sampleRate();
+	/* Read without locking. If the stream task unqueued a buffer
+	 * meanwhile, its frames might be counted twice or not at all,
+	 * so try again */
+	uint64_t frames;
+	float secOffset;
+	int seq;
+
+	do
+	{
+		seq = SDL_AtomicGet(&posSeq);
+		frames = procFrames;
+		secOffset = AL::Source::getSecOffset(alSrc);
+	}
+	while ((seq & 1) || seq != SDL_AtomicGet(&posSeq));
 
-	return procOffset + AL::Source::getSecOffset(alSrc);
+	return static_cast<float>(frames) / source->sampleRate() + secOffset;
 }
 
 void ALStream::closeSource()
 {
 	delete source;
+
+	if (staticBuf.al != 0)
+	{
+		AL::Source::detachBuffer(alSrc);
+		AL::Source::setLooping(alSrc, false);
+		AL::Buffer::del(staticBuf);
+		staticBuf = AL::Buffer::ID(0);
+	}
+
+	/* Only freed once the source has closed it */
+	delete adoptedOps;
+	adoptedOps = 0;
+
+	prefilled.clear();
 }
 
+#ifdef MKXPZ_OPUS
+/* Ogg only tells its codec in the first packet, which
+ * starts right after the first page header */
+static bool oggHoldsOpus(SDL_RWops *ops)
+{
+	char head[64];
+	const size_t len = SDL_RWread(ops, head, 1, sizeof(head));
+	SDL_RWseek(ops, 0, RW_SEEK_SET);
+
+	for (size_t i = 0; i + 8 <= len; ++i)
+		if (!memcmp(&head[i], "OpusHead", 8))
+			return true;
+
+	return false;
+}
+#endif
+
 struct ALStreamOpenHandler : FileSystem::OpenHandler
 {
 	SDL_RWops *srcOps;
+	const std::string &filename;
+	uint32_t bufSize;
 	bool looped;
+	/* Off the RGSS thread, MIDI is left alone */
+	bool allowMidi;
 	ALDataSource *source;
 	std::string errorMsg;
 
-	ALStreamOpenHandler(SDL_RWops &srcOps, bool looped)
-	    : srcOps(&srcOps), looped(looped), source(0)
+	ALStreamOpenHandler(SDL_RWops &srcOps, const std::string &filename,
+	                    uint32_t bufSize, bool looped, bool allowMidi = true)
+	    : srcOps(&srcOps), filename(filename), bufSize(bufSize),
+	      looped(looped), allowMidi(allowMidi), source(0)
 	{}
 
 	bool tryRead(SDL_RWops &ops, const char *ext)
@@ -223,24 +309,47 @@ struct ALStreamOpenHandler : FileSystem::OpenHandler
 
 		try
 		{
+#ifdef MKXPZ_OPUS
+			if (!strcmp(sig, "OggS") && oggHoldsOpus(srcOps))
+			{
+				source = createOpusSource(*srcOps, bufSize, looped);
+				return true;
+			}
+#endif
+
 			if (!strcmp(sig, "OggS"))
 			{
-				source = createVorbisSource(*srcOps, looped);
+				source = createVorbisSource(*srcOps, bufSize, looped);
 				return true;
 			}
 
+#ifdef MKXPZ_FLAC
+			/* Without libFLAC these go through SDL_sound */
+			if (!strcmp(sig, "fLaC"))
+			{
+				source = createFlacSource(*srcOps, bufSize, looped);
+				return true;
+			}
+#endif
+
 			if (!strcmp(sig, "MThd"))
 			{
+				if (!allowMidi)
+				{
+					SDL_RWclose(srcOps);
+					return true;
+				}
+
 				shState->midiState().initIfNeeded(shState->config());
 
 				if (HAVE_FLUID)
 				{
-					source = createMidiSource(*srcOps, looped);
+					source = createMidiSource(*srcOps, filename.c_str(), bufSize, looped);
 					return true;
 				}
 			}
 
-			source = createSDLSource(*srcOps, ext, STREAM_BUF_SIZE, looped);
+			source = createSDLSource(*srcOps, ext, bufSize, looped);
 		}
 		catch (const Exception &e)
 		{
@@ -256,7 +365,7 @@ struct ALStreamOpenHandler : FileSystem::OpenHandler
 
 void ALStream::openSource(const std::string &filename)
 {
-	ALStreamOpenHandler handler(srcOps, looped);
+	ALStreamOpenHandler handler(srcOps, filename, bufSize, looped);
 	shState->fileSystem().openRead(handler, filename.c_str());
 	source = handler.source;
 	needsRewind.clear();
@@ -268,42 +377,223 @@ void ALStream::openSource(const std::string &filename)
 		         filename.c_str(), handler.errorMsg.c_str());
 
 		Debug() << buf;
+
+		return;
+	}
+
+	if (looped && staticLoopSecs > 0 && source->loopStartFrames() == 0)
+		openStaticLoop(filename);
+}
+
+void ALStream::openStaticLoop(const std::string &filename)
+{
+	TRACE_ZONE("ALStream::openStaticLoop");
+
+	/* Room for the longest source taken, in stereo. For SDL_sound
+	 * sources this counts bytes, so they have to be shorter still */
+	const uint32_t size = (uint32_t) staticLoopSecs * source->sampleRate() * 2;
+
+	/* A second, unlooped source, so the end of the file shows */
+	SDL_RWops ops;
+	ALStreamOpenHandler handler(ops, filename, size, false, false);
+
+	try
+	{
+		shState->fileSystem().openRead(handler, filename.c_str());
 	}
+	catch (const Exception &)
+	{
+		return;
+	}
+
+	if (!handler.source)
+		return;
+
+	AL::Buffer::ID buf = AL::Buffer::gen();
+	ALDataSource::Status status;
+
+	{
+		ProfileScope profile(Profiler::Audio);
+		status = handler.source->fillBuffer(buf);
+	}
+
+	delete handler.source;
+
+	/* Too long (or broken); streamed as usual */
+	if (status != ALDataSource::EndOfStream)
+	{
+		AL::Buffer::del(buf);
+		return;
+	}
+
+	staticBuf = buf;
+}
+
+void ALStream::adoptSource(ALStreamPrepared &prepared)
+{
+	source = prepared.source;
+	adoptedOps = prepared.ops;
+	prepared.source = 0;
+	prepared.ops = 0;
+	needsRewind.clear();
+
+	/* Prepared with another buffer setup; the source
+	 * is simply rewound on start then */
+	if (prepared.bufs.size() != alBuf.size())
+		return;
+
+	/* Our buffers might still be queued up */
+	AL::Source::clearQueue(alSrc);
+
+	alBuf.swap(prepared.bufs);
+	prefilled.swap(prepared.status);
+}
+
+ALStreamPrepared::~ALStreamPrepared()
+{
+	delete source;
+	delete ops;
+
+	for (size_t i = 0; i < bufs.size(); ++i)
+		AL::Buffer::del(bufs[i]);
+}
+
+ALStreamPrepared *ALStream::prepare(const std::string &filename,
+                                    LoopMode loopMode,
+                                    int bufCount,
+                                    uint32_t bufSize)
+{
+	TRACE_ZONE("ALStream::prepare");
+
+	ALStreamPrepared *prepared = new ALStreamPrepared;
+	prepared->filename = filename;
+	prepared->ops = new SDL_RWops;
+
+	for (int i = 0; i < bufCount; ++i)
+		prepared->bufs.push_back(AL::Buffer::gen());
+
+	ALStreamOpenHandler handler(*prepared->ops, filename, bufSize,
+	                            loopMode == Looped, false);
+
+	try
+	{
+		shState->fileSystem().openRead(handler, filename.c_str());
+	}
+	catch (const Exception &)
+	{
+		/* Reported again when opened by name */
+		return prepared;
+	}
+
+	prepared->source = handler.source;
+
+	if (!prepared->source)
+		return prepared;
+
+	/* Same as the start of fillQueue() */
+	for (size_t i = 0; i < prepared->bufs.size(); ++i)
+	{
+		ALDataSource::Status status;
+
+		{
+			ProfileScope profile(Profiler::Audio);
+			status = prepared->source->fillBuffer(prepared->bufs[i]);
+		}
+
+		prepared->status.push_back(status);
+
+		if (status == ALDataSource::Error || status == ALDataSource::EndOfStream)
+			break;
+	}
+
+	return prepared;
 }
 
 void ALStream::stopStream()
 {
-	threadTermReq.set();
+	termReq.set();
 
-	if (thread)
+	if (streaming)
 	{
-		SDL_WaitThread(thread, 0);
-		thread = 0;
+		scheduler.remove(&streamTask);
+		streaming = false;
 		needsRewind.set();
 	}
 
-	/* Need to stop the source _after_ the thread has terminated,
+	/* Need to stop the source _after_ the task has been removed,
 	 * because it might have accidentally started it again before
 	 * seeing the term request */
-	AL::Source::stop(alSrc);
+	SDL_AtomicIncRef(&posSeq);
 
+	AL::Source::stop(alSrc);
 	procFrames = 0;
+
+	SDL_AtomicIncRef(&posSeq);
 }
 
 void ALStream::startStream(float offset)
 {
+	if (staticBuf.al != 0)
+	{
+		startStaticLoop(offset);
+		return;
+	}
+
+	SDL_AtomicIncRef(&posSeq);
+
 	AL::Source::clearQueue(alSrc);
+	procFrames = offset * source->sampleRate();
+
+	SDL_AtomicIncRef(&posSeq);
 
 	preemptPause = false;
 	streamInited.clear();
 	sourceExhausted.clear();
-	threadTermReq.clear();
+	termReq.clear();
 
 	startOffset = offset;
-	procFrames = offset * source->sampleRate();
 
-	thread = createSDLThread
-		<ALStream, &ALStream::streamData>(this, threadName);
+	queueFilled = false;
+	bufferMs = 0;
+
+	streaming = true;
+	scheduler.add(&streamTask);
+}
+
+void ALStream::startStaticLoop(float offset)
+{
+	SDL_AtomicIncRef(&posSeq);
+
+	AL::Source::clearQueue(alSrc);
+	procFrames = 0;
+
+	SDL_AtomicIncRef(&posSeq);
+
+	preemptPause = false;
+	sourceExhausted.clear();
+	termReq.clear();
+
+	AL::Source::attachBuffer(alSrc, staticBuf);
+	AL::Source::setLooping(alSrc, true);
+
+	/* Offsets past the end wrap around, like the stream would */
+	ALint bits = AL::Buffer::getBits(staticBuf);
+	ALint size = AL::Buffer::getSize(staticBuf);
+	ALint chan = AL::Buffer::getChannels(staticBuf);
+	ALint freq = AL::Buffer::getFrequency(staticBuf);
+
+	if (offset > 0 && bits != 0 && chan != 0 && freq != 0)
+	{
+		const float length = (float) ((size / (bits / 8)) / chan) / freq;
+
+		if (length > 0)
+			AL::Source::setSecOffset(alSrc, fmodf(offset, length));
+	}
+
+	AL::Source::play(alSrc);
+
+	/* Never runs dry, so checkStopped() leaves it be */
+	streamInited.set();
 }
 
 void ALStream::pauseStream()
@@ -357,33 +647,63 @@ void ALStream::checkStopped()
 	state = Stopped;
 }
 
-/* thread func */
-void ALStream::streamData()
+void ALStream::fillQueue()
 {
-	/* Fill up queue */
 	bool firstBuffer = true;
 	ALDataSource::Status status;
 
-	if (threadTermReq)
-		return;
+	/* Buffers that came decoded with a prepared stream
+	 * only match a start from the beginning, once */
+	std::vector<ALDataSource::Status> ready;
 
-	//if (needsRewind)
+	if (startOffset == 0)
+		ready.swap(prefilled);
+	else
+		prefilled.clear();
+
+	if (ready.empty())
 		source->seekToOffset(startOffset);
 
-	for (int i = 0; i < STREAM_BUFS; ++i)
+	for (size_t i = 0; i < alBuf.size(); ++i)
 	{
-		if (threadTermReq)
+		if (termReq)
 			return;
 
 		AL::Buffer::ID buf = alBuf[i];
 
-		status = source->fillBuffer(buf);
+		if (i < ready.size())
+		{
+			status = ready[i];
+		}
+		else
+		{
+			ProfileScope profile(Profiler::Audio);
+			status = source->fillBuffer(buf);
+		}
 
 		if (status == ALDataSource::Error)
+		{
+			sourceExhausted.set();
 			return;
+		}
 
 		AL::Source::queueBuffer(alSrc, buf);
 
+		/* Buffers are refilled in time based on the
+		 * shortest one, which is usually the last */
+		ALint bits = AL::Buffer::getBits(buf);
+		ALint size = AL::Buffer::getSize(buf);
+		ALint chan = AL::Buffer::getChannels(buf);
+		ALint freq = AL::Buffer::getFrequency(buf);
+
+		if (bits != 0 && chan != 0 && freq != 0)
+		{
+			int ms = (int64_t) ((size / (bits / 8)) / chan) * 1000 / freq;
+
+			if (bufferMs == 0 || (ms > 0 && ms < bufferMs))
+				bufferMs = ms;
+		}
+
 		if (firstBuffer)
 		{
 			resumeStream();
@@ -392,7 +712,7 @@ void ALStream::streamData()
 			streamInited.set();
 		}
 
-		if (threadTermReq)
+		if (termReq)
 			return;
 
 		if (status == ALDataSource::EndOfStream)
@@ -401,77 +721,115 @@ void ALStream::streamData()
 			break;
 		}
 	}
+}
+
+int ALStream::refillDelay() const
+{
+	/* Checking four times per buffer leaves the rest of
+	 * the queue as headroom, even when played back at
+	 * raised pitch */
+	return clamp(bufferMs / 4, AUDIO_SLEEP, AUDIO_SLEEP * 10);
+}
+
+/* scheduler task */
+int ALStream::streamData()
+{
+	TRACE_ZONE("ALStream::streamData");
+
+	if (termReq)
+		return -1;
 
-	/* Wait for buffers to be consumed, then
-	 * refill and queue them up again */
-	while (true)
+	/* Fill up queue */
+	if (!queueFilled)
 	{
-		shState->rtData().syncPoint.passSecondarySync();
+		queueFilled = true;
+		fillQueue();
 
-		ALint procBufs = AL::Source::getProcBufferCount(alSrc);
+		if (termReq || (sourceExhausted && !streamInited))
+			return -1;
 
-		while (procBufs--)
-		{
-			if (threadTermReq)
-				break;
+		return refillDelay();
+	}
 
-			AL::Buffer::ID buf = AL::Source::unqueueBuffer(alSrc);
+	/* Refill and queue up the consumed buffers again */
+	ALDataSource::Status status;
+	ALint procBufs = AL::Source::getProcBufferCount(alSrc);
 
-			/* If something went wrong, try again later */
-			if (buf == AL::Buffer::ID(0))
-				break;
+	while (procBufs--)
+	{
+		if (termReq)
+			break;
 
-			if (buf == lastBuf)
-			{
-				/* Reset the processed sample count so
-				 * querying the playback offset returns 0.0 again */
-				procFrames = source->loopStartFrames();
-				lastBuf = AL::Buffer::ID(0);
-			}
-			else
-			{
-				/* Add the frame count contained in this
-				 * buffer to the total count */
-				ALint bits = AL::Buffer::getBits(buf);
-				ALint size = AL::Buffer::getSize(buf);
-				ALint chan = AL::Buffer::getChannels(buf);
-
-				if (bits != 0 && chan != 0)
-					procFrames += ((size / (bits / 8)) / chan);
-			}
+		SDL_AtomicIncRef(&posSeq);
 
-			if (sourceExhausted)
-				continue;
+		AL::Buffer::ID buf = AL::Source::unqueueBuffer(alSrc);
 
-			status = source->fillBuffer(buf);
+		/* If something went wrong, try again later */
+		if (buf == AL::Buffer::ID(0))
+		{
+			SDL_AtomicIncRef(&posSeq);
+			break;
+		}
 
-			if (status == ALDataSource::Error)
-			{
-				sourceExhausted.set();
-				return;
-			}
+		if (buf == lastBuf)
+		{
+			/* Reset the processed sample count so
+			 * querying the playback offset returns 0.0 again */
+			procFrames = source->loopStartFrames();
+			lastBuf = AL::Buffer::ID(0);
+		}
+		else
+		{
+			/* Add the frame count contained in this
+			 * buffer to the total count */
+			ALint bits = AL::Buffer::getBits(buf);
+			ALint size = AL::Buffer::getSize(buf);
+			ALint chan = AL::Buffer::getChannels(buf);
+
+			if (bits != 0 && chan != 0)
+				procFrames += ((size / (bits / 8)) / chan);
+		}
+
+		SDL_AtomicIncRef(&posSeq);
 
-			AL::Source::queueBuffer(alSrc, buf);
+		if (sourceExhausted)
+			continue;
+
+		{
+			ProfileScope profile(Profiler::Audio);
+			status = source->fillBuffer(buf);
+		}
 
-			/* In case of buffer underrun,
-			 * start playing again */
-			if (AL::Source::getState(alSrc) == AL_STOPPED)
-				AL::Source::play(alSrc);
+		if (status == ALDataSource::Error)
+		{
+			sourceExhausted.set();
+			return -1;
+		}
 
-			/* If this was the last buffer before the data
-			 * source loop wrapped around again, mark it as
-			 * such so we can catch it and reset the processed
-			 * sample count once it gets unqueued */
-			if (status == ALDataSource::WrapAround)
-				lastBuf = buf;
+		AL::Source::queueBuffer(alSrc, buf);
+		SDL_AtomicIncRef(&requeues);
 
-			if (status == ALDataSource::EndOfStream)
-				sourceExhausted.set();
+		/* In case of buffer underrun,
+		 * start playing again */
+		if (AL::Source::getState(alSrc) == AL_STOPPED)
+		{
+			AL::Source::play(alSrc);
+			SDL_AtomicIncRef(&underruns);
 		}
 
-		if (threadTermReq)
-			break;
+		/* If this was the last buffer before the data
+		 * source loop wrapped around again, mark it as
+		 * such so we can catch it and reset the processed
+		 * sample count once it gets unqueued */
+		if (status == ALDataSource::WrapAround)
+			lastBuf = buf;
 
-		SDL_Delay(AUDIO_SLEEP);
+		if (status == ALDataSource::EndOfStream)
+			sourceExhausted.set();
 	}
+
+	if (termReq)
+		return -1;
+
+	return refillDelay();
 }
@@ -23,15 +23,42 @@
 #define ALSTREAM_H
 
 #include "al-util.h"
+#include "aldatasource.h"
+#include "audioscheduler.h"
 #include "sdl-util.h"
 
 #include <string>
+#include <vector>
+#include <SDL_atomic.h>
 #include <SDL_rwops.h>
 
-struct ALDataSource;
-
+/* Default buffer count, see Config */
 #define STREAM_BUFS 3
 
+/* A stream opened, and its first buffers decoded, ahead of
+ * time by ALStream::prepare(), which may run on any thread.
+ * Handed to ALStream::open() to start without the wait */
+struct ALStreamPrepared
+{
+	std::string filename;
+
+	/* Read from by 'source', so it can't move */
+	SDL_RWops *ops;
+	ALDataSource *source;
+
+	/* Decoded from the start, in order; one status per
+	 * buffer filled (the last one may be an error) */
+	std::vector<AL::Buffer::ID> bufs;
+	std::vector<ALDataSource::Status> status;
+
+	ALStreamPrepared()
+	    : ops(0),
+	      source(0)
+	{}
+
+	~ALStreamPrepared();
+};
+
 /* State-machine like audio playback stream.
  * This class is NOT thread safe */
 struct ALStream
@@ -48,9 +75,11 @@ struct ALStream
 	State state;
 
 	ALDataSource *source;
-	SDL_Thread *thread;
 
-	std::string threadName;
+	AudioScheduler &scheduler;
+
+	/* The stream task is scheduled */
+	bool streaming;
 
 	SDL_mutex *pauseMut;
 	bool preemptPause;
@@ -61,7 +90,8 @@ struct ALStream
 	AtomicFlag streamInited;
 	AtomicFlag sourceExhausted;
 
-	AtomicFlag threadTermReq;
+	/* Requests the stream task to stop */
+	AtomicFlag termReq;
 
 	AtomicFlag needsRewind;
 	float startOffset;
@@ -69,13 +99,39 @@ struct ALStream
 	float pitch;
 
 	AL::Source::ID alSrc;
-	AL::Buffer::ID alBuf[STREAM_BUFS];
+	std::vector<AL::Buffer::ID> alBuf;
+
+	/* Passed on to the data source, usually in samples */
+	uint32_t bufSize;
+
+	int staticLoopSecs;
+	/* Holds the whole source while it is played from memory */
+	AL::Buffer::ID staticBuf;
+
+	/* Times the source ran dry while the data
+	 * source still had data, and was restarted */
+	SDL_atomic_t underruns;
+	/* Buffers refilled and queued up again */
+	SDL_atomic_t requeues;
 
 	uint64_t procFrames;
 	AL::Buffer::ID lastBuf;
 
+	/* Odd while 'procFrames' and the source queue are being
+	 * changed, so queryOffset() can run from any thread */
+	SDL_atomic_t posSeq;
+
 	SDL_RWops srcOps;
 
+	/* Read from instead of 'srcOps' by a source
+	 * taken from a prepared stream */
+	SDL_RWops *adoptedOps;
+
+	/* Statuses of the buffers a prepared stream came with,
+	 * queued as they are on the first start from the
+	 * beginning (see fillQueue()) */
+	std::vector<ALDataSource::Status> prefilled;
+
 	struct
 	{
 		ALenum format;
@@ -88,12 +144,21 @@ struct ALStream
 		NotLooped
 	};
 
+	/* Looped sources shorter than 'staticLoopSecs' (and without
+	 * loop points of their own) are decoded once into a single
+	 * buffer that loops in OpenAL, instead of being streamed */
 	ALStream(LoopMode loopMode,
-	         const std::string &threadId);
+	         AudioScheduler &scheduler,
+	         int bufCount = STREAM_BUFS,
+	         uint32_t bufSize = STREAM_BUF_SIZE,
+	         int staticLoopSecs = 0);
 	~ALStream();
 
 	void close();
 	void open(const std::string &filename);
+	/* Takes over the source and decoded buffers of 'prepared',
+	 * which is left to be deleted by the caller */
+	void open(ALStreamPrepared &prepared);
 	void stop();
 	void play(float offset = 0);
 	void pause();
@@ -101,22 +166,45 @@ struct ALStream
 	void setVolume(float value);
 	void setPitch(float value);
 	State queryState();
+	/* Safe to call while the stream task is running */
 	float queryOffset();
 	bool queryNativePitch();
 
+	/* Does the work of open() without touching any stream.
+	 * Sources that can't be opened off the RGSS thread (MIDI)
+	 * come back without one, as do ones that failed; open()
+	 * the file by name then to report the error */
+	static ALStreamPrepared *prepare(const std::string &filename,
+	                                 LoopMode loopMode,
+	                                 int bufCount = STREAM_BUFS,
+	                                 uint32_t bufSize = STREAM_BUF_SIZE);
+
 private:
 	void closeSource();
 	void openSource(const std::string &filename);
+	void adoptSource(ALStreamPrepared &prepared);
+	void openStaticLoop(const std::string &filename);
 
 	void stopStream();
 	void startStream(float offset);
+	void startStaticLoop(float offset);
 	void pauseStream();
 	void resumeStream();
 
 	void checkStopped();
 
-	/* thread func */
-	void streamData();
+	void fillQueue();
+	int refillDelay() const;
+
+	/* scheduler task */
+	int streamData();
+
+	AudioTask<ALStream, &ALStream::streamData> streamTask;
+
+	/* The initial buffers have been queued */
+	bool queueFilled;
+	/* Playback time of the shortest buffer, in ms */
+	int bufferMs;
 };
 
 #endif // ALSTREAM_H
@@ -22,37 +22,245 @@
 #include "audio.h"
 
 #include "audiostream.h"
+#include "audioscheduler.h"
 #include "soundemitter.h"
 #include "sharedstate.h"
 #include "sharedmidistate.h"
 #include "eventthread.h"
+#include "ioscheduler.h"
 #include "sdl-util.h"
 #include "exception.h"
 
 #include <string>
 #include <vector>
+#include <deque>
 
+#include <SDL_mutex.h>
 #include <SDL_thread.h>
 #include <SDL_timer.h>
 
+/* Opens BGMs queued by Audio::bgmPrepare() on a worker
+ * thread, decoding their first buffers, so bgm_play only
+ * has to swap them in */
+struct StreamPreparer
+{
+	struct Job
+	{
+		std::string filename;
+		ALStreamPrepared *prepared;
+		bool done;
+	};
+
+	/* Both queued and finished jobs, in order */
+	std::deque<Job*> jobs;
+
+	/* Each prepared stream holds an open file
+	 * and its decoded buffers */
+	enum { MaxJobs = 4 };
+
+	SDL_Thread *thread;
+	SDL_mutex *mutex;
+	/* Signaled when jobs are queued, or on shutdown */
+	SDL_cond *jobCond;
+	/* Signaled whenever a job is done */
+	SDL_cond *doneCond;
+
+	const int bufCount;
+	const uint32_t bufSize;
+	bool quit;
+
+	StreamPreparer(int bufCount, uint32_t bufSize)
+	    : thread(0),
+	      bufCount(bufCount),
+	      bufSize(bufSize),
+	      quit(false)
+	{
+		mutex = SDL_CreateMutex();
+		jobCond = SDL_CreateCond();
+		doneCond = SDL_CreateCond();
+	}
+
+	~StreamPreparer()
+	{
+		SDL_LockMutex(mutex);
+		quit = true;
+		SDL_CondSignal(jobCond);
+		SDL_UnlockMutex(mutex);
+
+		if (thread)
+			SDL_WaitThread(thread, 0);
+
+		for (size_t i = 0; i < jobs.size(); ++i)
+		{
+			delete jobs[i]->prepared;
+			delete jobs[i];
+		}
+
+		SDL_DestroyCond(doneCond);
+		SDL_DestroyCond(jobCond);
+		SDL_DestroyMutex(mutex);
+	}
+
+	/* Must be called with the mutex held */
+	Job *find(const std::string &filename)
+	{
+		for (size_t i = 0; i < jobs.size(); ++i)
+			if (jobs[i]->filename == filename)
+				return jobs[i];
+
+		return 0;
+	}
+
+	Job *nextQueued()
+	{
+		for (size_t i = 0; i < jobs.size(); ++i)
+			if (!jobs[i]->done)
+				return jobs[i];
+
+		return 0;
+	}
+
+	/* Drops the oldest finished job */
+	bool evict()
+	{
+		for (size_t i = 0; i < jobs.size(); ++i)
+			if (jobs[i]->done)
+			{
+				delete jobs[i]->prepared;
+				delete jobs[i];
+				jobs.erase(jobs.begin() + i);
+
+				return true;
+			}
+
+		return false;
+	}
+
+	void request(const std::string &filename)
+	{
+		SDL_LockMutex(mutex);
+
+		if (!find(filename) && (jobs.size() < (size_t) MaxJobs || evict()))
+		{
+			Job *job = new Job;
+			job->filename = filename;
+			job->prepared = 0;
+			job->done = false;
+			jobs.push_back(job);
+
+			/* The thread is only spawned once it's needed */
+			if (!thread)
+				thread = createSDLThread
+					<StreamPreparer, &StreamPreparer::work>(this, "bgm_prepare");
+
+			SDL_CondSignal(jobCond);
+		}
+
+		SDL_UnlockMutex(mutex);
+	}
+
+	/* Removes and returns the stream prepared for 'filename',
+	 * waiting for it if necessary. Returns null if there is none */
+	ALStreamPrepared *take(const std::string &filename)
+	{
+		SDL_LockMutex(mutex);
+
+		ALStreamPrepared *prepared = 0;
+		Job *job = find(filename);
+
+		if (job)
+		{
+			while (!job->done)
+				SDL_CondWait(doneCond, mutex);
+
+			for (size_t i = 0; i < jobs.size(); ++i)
+				if (jobs[i] == job)
+				{
+					jobs.erase(jobs.begin() + i);
+					break;
+				}
+
+			prepared = job->prepared;
+			delete job;
+		}
+
+		SDL_UnlockMutex(mutex);
+
+		return prepared;
+	}
+
+	/* Drops everything, waiting for work in flight */
+	void clear()
+	{
+		SDL_LockMutex(mutex);
+
+		while (!jobs.empty())
+		{
+			if (!evict())
+				SDL_CondWait(doneCond, mutex);
+		}
+
+		SDL_UnlockMutex(mutex);
+	}
+
+	void work()
+	{
+		IOScheduler::setThreadPriority(IOScheduler::Visible);
+
+		SDL_LockMutex(mutex);
+
+		while (true)
+		{
+			Job *job;
+
+			while (!quit && !(job = nextQueued()))
+				SDL_CondWait(jobCond, mutex);
+
+			if (quit)
+				break;
+
+			/* The job stays in the list (and is only
+			 * taken once done), so it is safe to use */
+			std::string filename = job->filename;
+
+			SDL_UnlockMutex(mutex);
+
+			ALStreamPrepared *prepared =
+				ALStream::prepare(filename, ALStream::Looped, bufCount, bufSize);
+
+			SDL_LockMutex(mutex);
+
+			job->prepared = prepared;
+			job->done = true;
+
+			SDL_CondBroadcast(doneCond);
+		}
+
+		SDL_UnlockMutex(mutex);
+	}
+};
+
 struct AudioPrivate
 {
-    
+	/* Must outlive all streams */
+	AudioScheduler scheduler;
+
     std::vector<AudioStream*> bgmTracks;
 	AudioStream bgs;
 	AudioStream me;
 
 	SoundEmitter se;
 
-	SyncPoint &syncPoint;
-    
+	StreamPreparer bgmPreparer;
+
     float volumeRatio;
 
 	/* The 'MeWatch' is responsible for detecting
 	 * a playing ME, quickly fading out the BGM and
 	 * keeping it paused/stopped while the ME plays,
 	 * and unpausing/fading the BGM back in again
-	 * afterwards */
+	 * afterwards. It only runs while an ME
+	 * is playing, and is woken up by mePlay() */
 	enum MeWatchState
 	{
 		MeNotPlaying,
@@ -63,32 +271,32 @@ struct AudioPrivate
 
 	struct
 	{
-		SDL_Thread *thread;
-		AtomicFlag termReq;
 		MeWatchState state;
 	} meWatch;
 
 	AudioPrivate(RGSSThreadData &rtData)
-	    : bgs(ALStream::Looped, "bgs"),
-	      me(ALStream::NotLooped, "me"),
+	    : scheduler(rtData.syncPoint),
+	      bgs(ALStream::Looped, scheduler,
+	          rtData.config.BGS.streamBufs, rtData.config.BGS.streamBufSize,
+	          rtData.config.BGS.staticLoop),
+	      me(ALStream::NotLooped, scheduler,
+	         rtData.config.ME.streamBufs, rtData.config.ME.streamBufSize),
 	      se(rtData.config),
-	      syncPoint(rtData.syncPoint),
-          volumeRatio(1)
+	      bgmPreparer(rtData.config.BGM.streamBufs, rtData.config.BGM.streamBufSize),
+          volumeRatio(1),
+	      meWatchTask(this)
 	{
-        for (int i = 0; i < rtData.config.BGM.trackCount; i++) {
-            std::string id = std::string("bgm" + std::to_string(i));
-            bgmTracks.push_back(new AudioStream(ALStream::Looped, id.c_str()));
-        }
+        for (int i = 0; i < rtData.config.BGM.trackCount; i++)
+            bgmTracks.push_back(new AudioStream(ALStream::Looped, scheduler,
+                                                rtData.config.BGM.streamBufs,
+                                                rtData.config.BGM.streamBufSize));
         
 		meWatch.state = MeNotPlaying;
-		meWatch.thread = createSDLThread
-			<AudioPrivate, &AudioPrivate::meWatchFun>(this, "audio_mewatch");
 	}
 
 	~AudioPrivate()
 	{
-		meWatch.termReq.set();
-		SDL_WaitThread(meWatch.thread, 0);
+		scheduler.remove(&meWatchTask);
         for (auto track : bgmTracks)
             delete track;
 	}
@@ -101,50 +309,44 @@ struct AudioPrivate
         return bgmTracks[index];
     }
 
-	void meWatchFun()
+	/* scheduler task */
+	int meWatchFun()
 	{
 		const float fadeOutStep = 1.f / (200  / AUDIO_SLEEP);
 		const float fadeInStep  = 1.f / (1000 / AUDIO_SLEEP);
 
-		while (true)
+		switch (meWatch.state)
 		{
-			syncPoint.passSecondarySync();
-
-			if (meWatch.termReq)
-				return;
+		case MeNotPlaying:
+		{
+			me.lockStream();
 
-			switch (meWatch.state)
-			{
-			case MeNotPlaying:
+			if (me.stream.queryState() == ALStream::Playing)
 			{
-				me.lockStream();
-
-				if (me.stream.queryState() == ALStream::Playing)
-				{
-					/* ME playing detected. -> FadeOutBGM */
+				/* ME playing detected. -> FadeOutBGM */
                     for (auto track : bgmTracks)
                         track->extPaused = true;
                     
-					meWatch.state = BgmFadingOut;
-				}
+				meWatch.state = BgmFadingOut;
+			}
 
-				me.unlockStream();
+			me.unlockStream();
 
-				break;
-			}
+			break;
+		}
 
-			case BgmFadingOut :
-			{
-				me.lockStream();
+		case BgmFadingOut :
+		{
+			me.lockStream();
 
-				if (me.stream.queryState() != ALStream::Playing)
-				{
-					/* ME has ended while fading OUT BGM. -> FadeInBGM */
-					me.unlockStream();
-					meWatch.state = BgmFadingIn;
+			if (me.stream.queryState() != ALStream::Playing)
+			{
+				/* ME has ended while fading OUT BGM. -> FadeInBGM */
+				me.unlockStream();
+				meWatch.state = BgmFadingIn;
 
-					break;
-				}
+				break;
+			}
                 
                 bool shouldBreak = false;
                 
@@ -184,16 +386,16 @@ struct AudioPrivate
                     break;
                 }
                 
-				me.unlockStream();
+			me.unlockStream();
 
-				break;
-			}
+			break;
+		}
 
-			case MePlaying :
-			{
-				me.lockStream();
+		case MePlaying :
+		{
+			me.lockStream();
 
-				if (me.stream.queryState() != ALStream::Playing)
+			if (me.stream.queryState() != ALStream::Playing)
                 {
                     /* ME has ended */
                     for (auto track : bgmTracks) {
@@ -219,69 +421,74 @@ struct AudioPrivate
                         
                         track->unlockStream();
                     }
-				}
+			}
 
                 me.unlockStream();
 
-				break;
-			}
+			break;
+		}
 
-			case BgmFadingIn :
-			{
+		case BgmFadingIn :
+		{
                 for (auto track : bgmTracks)
                     track->lockStream();
 
-				if (bgmTracks[0]->stream.queryState() == ALStream::Stopped)
-				{
-					/* BGM stopped midway fade in. -> MeNotPlaying */
+			if (bgmTracks[0]->stream.queryState() == ALStream::Stopped)
+			{
+				/* BGM stopped midway fade in. -> MeNotPlaying */
                     for (auto track : bgmTracks)
                         track->setVolume(AudioStream::External, 1.0f);
-					meWatch.state = MeNotPlaying;
+				meWatch.state = MeNotPlaying;
                     for (auto track : bgmTracks)
                         track->unlockStream();
 
-					break;
-				}
+				break;
+			}
 
-				me.lockStream();
+			me.lockStream();
 
-				if (me.stream.queryState() == ALStream::Playing)
-				{
-					/* ME started playing midway BGM fade in. -> FadeOutBGM */
+			if (me.stream.queryState() == ALStream::Playing)
+			{
+				/* ME started playing midway BGM fade in. -> FadeOutBGM */
                     for (auto track : bgmTracks)
                         track->extPaused = true;
-					meWatch.state = BgmFadingOut;
-					me.unlockStream();
+				meWatch.state = BgmFadingOut;
+				me.unlockStream();
                     for (auto track : bgmTracks)
                         track->unlockStream();
 
-					break;
-				}
+				break;
+			}
 
-				float vol = bgmTracks[0]->getVolume(AudioStream::External);
-				vol += fadeInStep;
+			float vol = bgmTracks[0]->getVolume(AudioStream::External);
+			vol += fadeInStep;
 
-				if (vol >= 1)
-				{
-					/* BGM fully faded in. -> MeNotPlaying */
-					vol = 1.0f;
-					meWatch.state = MeNotPlaying;
-				}
+			if (vol >= 1)
+			{
+				/* BGM fully faded in. -> MeNotPlaying */
+				vol = 1.0f;
+				meWatch.state = MeNotPlaying;
+			}
 
                 for (auto track : bgmTracks)
                     track->setVolume(AudioStream::External, vol);
 
-				me.unlockStream();
+			me.unlockStream();
                 for (auto track : bgmTracks)
                     track->unlockStream();
 
-				break;
-			}
-			}
-
-			SDL_Delay(AUDIO_SLEEP);
+			break;
 		}
+		}
+
+		/* Nothing to do until the next ME starts */
+		if (meWatch.state == MeNotPlaying)
+			return -1;
+
+		return AUDIO_SLEEP;
 	}
+
+	AudioTask<AudioPrivate, &AudioPrivate::meWatchFun> meWatchTask;
 };
 
 Audio::Audio(RGSSThreadData &rtData)
@@ -305,7 +512,13 @@ void Audio::bgmPlay(const char *filename,
         
         track = 0;
     }
-	p->getTrackByIndex(track)->play(filename, volume, pitch, pos);
+	AudioStream *stream = p->getTrackByIndex(track);
+	stream->play(filename, volume, pitch, pos, p->bgmPreparer.take(filename));
+}
+
+void Audio::bgmPrepare(const char *filename)
+{
+	p->bgmPreparer.request(filename);
 }
 
 void Audio::bgmStop(int track)
@@ -377,6 +590,7 @@ void Audio::mePlay(const char *filename,
                    int pitch)
 {
 	p->me.play(filename, volume, pitch);
+	p->scheduler.add(&p->meWatchTask);
 }
 
 void Audio::meStop()
@@ -402,6 +616,35 @@ void Audio::seStop()
 	p->se.stop();
 }
 
+void Audio::sePreload(const char *filename)
+{
+	p->se.preload(filename);
+}
+
+void Audio::seSetLimit(const char *filename, int voiceLimit, int priority)
+{
+	p->se.setRule(filename, voiceLimit, priority);
+}
+
+void Audio::seTrimCache()
+{
+	p->se.trim();
+}
+
+Audio::SECacheStats Audio::seCacheStats()
+{
+	SoundEmitter::Stats stats = p->se.stats();
+
+	SECacheStats ret;
+	ret.bytes = stats.bytes;
+	ret.budget = stats.budget;
+	ret.hits = stats.hits;
+	ret.misses = stats.misses;
+	ret.entries.swap(stats.entries);
+
+	return ret;
+}
+
 void Audio::setupMidi()
 {
 	shState->midiState().initIfNeeded(shState->config());
@@ -417,6 +660,37 @@ float Audio::bgsPos()
 	return p->bgs.playingOffset();
 }
 
+static Audio::StreamStats streamStats(ALStream &stream)
+{
+	Audio::StreamStats stats;
+	stats.buffers = stream.alBuf.size();
+	stats.bufferSize = stream.bufSize;
+	stats.underruns = SDL_AtomicGet(&stream.underruns);
+	stats.requeues = SDL_AtomicGet(&stream.requeues);
+
+	return stats;
+}
+
+Audio::StreamStats Audio::bgmStats(int track)
+{
+	return streamStats(p->getTrackByIndex(track)->stream);
+}
+
+int Audio::bgmTrackCount()
+{
+	return p->bgmTracks.size();
+}
+
+Audio::StreamStats Audio::bgsStats()
+{
+	return streamStats(p->bgs.stream);
+}
+
+Audio::StreamStats Audio::meStats()
+{
+	return streamStats(p->me.stream);
+}
+
 void Audio::reset()
 {
     for (auto track : p->bgmTracks) {
@@ -426,6 +700,8 @@ void Audio::reset()
 	p->bgs.stop();
 	p->me.stop();
 	p->se.stop();
+
+	p->bgmPreparer.clear();
 }
 
 Audio::~Audio() { delete p; }
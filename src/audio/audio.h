@@ -22,6 +22,10 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#include <stdint.h>
+#include <string>
+#include <vector>
+
 /* Concerning the 'pos' parameter:
  *   RGSS3 actually doesn't specify a format for this,
  *   it's only implied that it is a numerical value
@@ -47,6 +51,9 @@ public:
 	void bgmFade(int time, int track = -127);
     int bgmGetVolume(int track = -127);
     void bgmSetVolume(int volume = 100, int track = -127);
+	/* Opens 'filename' and decodes its first buffers in the
+	 * background, so a bgm_play call later on starts at once */
+	void bgmPrepare(const char *filename);
 
 	void bgsPlay(const char *filename,
 	             int volume = 100,
@@ -65,11 +72,54 @@ public:
 	            int volume = 100,
 	            int pitch = 100);
 	void seStop();
+	/* Decodes 'filename' in the background, for
+	 * an se_play call later on */
+	void sePreload(const char *filename);
+
+	/* At most 'voiceLimit' copies of 'filename' play at once (0 for
+	 * no limit), and it only cuts off SEs of at most 'priority'
+	 * when out of sources */
+	void seSetLimit(const char *filename, int voiceLimit, int priority);
+
+	/* Cache usage of decoded SEs */
+	struct SECacheStats
+	{
+		uint32_t bytes;
+		uint32_t budget;
+
+		uint32_t hits;
+		uint32_t misses;
+
+		/* Cached SEs with their hit counts */
+		std::vector<std::pair<std::string, uint32_t> > entries;
+	};
+
+	SECacheStats seCacheStats();
+
+	/* Frees the decoded SEs kept for reuse */
+	void seTrimCache();
 
 	void setupMidi();
 	float bgmPos(int track = 0);
 	float bgsPos();
 
+	/* Buffer setup and refill counters of one stream */
+	struct StreamStats
+	{
+		int buffers;
+		int bufferSize;
+
+		/* Times the stream ran dry and had to be restarted */
+		unsigned int underruns;
+		/* Buffers refilled and queued up again */
+		unsigned int requeues;
+	};
+
+	StreamStats bgmStats(int track = 0);
+	int bgmTrackCount();
+	StreamStats bgsStats();
+	StreamStats meStats();
+
 	void reset();
 
 private:
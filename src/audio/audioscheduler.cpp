@@ -0,0 +1,248 @@
+/*
+** audioscheduler.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "audioscheduler.h"
+
+#include "eventthread.h"
+#include "ioscheduler.h"
+#include "sdl-util.h"
+#include "trace.h"
+
+#include <SDL_mutex.h>
+#include <SDL_thread.h>
+#include <SDL_timer.h>
+
+#include <vector>
+
+struct AudioSchedulerPrivate
+{
+	struct Entry
+	{
+		AudioScheduler::Task *task;
+		uint32_t due;
+
+		/* Set by remove() while it waits for the task to return */
+		bool cancelled;
+		/* Set by add() while the task is running, so
+		 * it is run again even if it unschedules itself */
+		bool rerun;
+	};
+
+	std::vector<Entry> entries;
+
+	/* Task currently running on the thread, if any */
+	AudioScheduler::Task *current;
+
+	SDL_mutex *mutex;
+	/* Signaled when entries change, or on shutdown */
+	SDL_cond *wakeCond;
+	/* Signaled whenever a task returns */
+	SDL_cond *doneCond;
+
+	SDL_Thread *thread;
+	SDL_threadID threadId;
+
+	SyncPoint &syncPoint;
+	bool quit;
+
+	AudioSchedulerPrivate(SyncPoint &syncPoint)
+	    : current(0),
+	      threadId(0),
+	      syncPoint(syncPoint),
+	      quit(false)
+	{
+		mutex = SDL_CreateMutex();
+		wakeCond = SDL_CreateCond();
+		doneCond = SDL_CreateCond();
+
+		thread = createSDLThread
+			<AudioSchedulerPrivate, &AudioSchedulerPrivate::run>(this, "audio");
+
+		threadId = SDL_GetThreadID(thread);
+	}
+
+	~AudioSchedulerPrivate()
+	{
+		SDL_LockMutex(mutex);
+		quit = true;
+		SDL_CondSignal(wakeCond);
+		SDL_UnlockMutex(mutex);
+
+		SDL_WaitThread(thread, 0);
+
+		SDL_DestroyCond(doneCond);
+		SDL_DestroyCond(wakeCond);
+		SDL_DestroyMutex(mutex);
+	}
+
+	Entry *find(AudioScheduler::Task *task)
+	{
+		for (size_t i = 0; i < entries.size(); ++i)
+			if (entries[i].task == task)
+				return &entries[i];
+
+		return 0;
+	}
+
+	void erase(AudioScheduler::Task *task)
+	{
+		for (size_t i = 0; i < entries.size(); ++i)
+			if (entries[i].task == task)
+			{
+				entries.erase(entries.begin() + i);
+				return;
+			}
+	}
+
+	/* Ticks are compared through their difference
+	 * to stay correct across wrap around */
+	static bool before(uint32_t a, uint32_t b)
+	{
+		return (int32_t) (a - b) < 0;
+	}
+
+	void run()
+	{
+		TRACE_THREAD("Audio");
+		IOScheduler::setThreadPriority(IOScheduler::RealTime);
+
+		SDL_LockMutex(mutex);
+
+		while (!quit)
+		{
+			Entry *next = 0;
+
+			for (size_t i = 0; i < entries.size(); ++i)
+			{
+				if (entries[i].cancelled)
+					continue;
+
+				if (!next || before(entries[i].due, next->due))
+					next = &entries[i];
+			}
+
+			if (!next)
+			{
+				SDL_CondWait(wakeCond, mutex);
+				continue;
+			}
+
+			const uint32_t now = SDL_GetTicks();
+
+			if (before(now, next->due))
+			{
+				SDL_CondWaitTimeout(wakeCond, mutex, next->due - now);
+				continue;
+			}
+
+			AudioScheduler::Task *task = next->task;
+			next->rerun = false;
+			current = task;
+
+			SDL_UnlockMutex(mutex);
+
+			/* Halted while the window is in the background */
+			syncPoint.passSecondarySync();
+
+			const int delay = task->service();
+
+			SDL_LockMutex(mutex);
+
+			current = 0;
+
+			/* 'next' may have been invalidated
+			 * by add() in the meantime */
+			Entry *entry = find(task);
+
+			if (entry && !entry->cancelled)
+			{
+				if (entry->rerun)
+					entry->due = SDL_GetTicks();
+				else if (delay < 0)
+					erase(task);
+				else
+					entry->due = SDL_GetTicks() + delay;
+			}
+
+			SDL_CondBroadcast(doneCond);
+		}
+
+		SDL_UnlockMutex(mutex);
+	}
+};
+
+AudioScheduler::AudioScheduler(SyncPoint &syncPoint)
+{
+	p = new AudioSchedulerPrivate(syncPoint);
+}
+
+AudioScheduler::~AudioScheduler()
+{
+	delete p;
+}
+
+void AudioScheduler::add(Task *task)
+{
+	SDL_LockMutex(p->mutex);
+
+	AudioSchedulerPrivate::Entry *entry = p->find(task);
+
+	if (entry)
+	{
+		entry->due = SDL_GetTicks();
+		entry->cancelled = false;
+		entry->rerun = (p->current == task);
+	}
+	else
+	{
+		AudioSchedulerPrivate::Entry newEntry =
+			{ task, SDL_GetTicks(), false, false };
+		p->entries.push_back(newEntry);
+	}
+
+	SDL_CondSignal(p->wakeCond);
+	SDL_UnlockMutex(p->mutex);
+}
+
+bool AudioScheduler::remove(Task *task)
+{
+	SDL_LockMutex(p->mutex);
+
+	AudioSchedulerPrivate::Entry *entry = p->find(task);
+
+	if (!entry)
+	{
+		SDL_UnlockMutex(p->mutex);
+		return false;
+	}
+
+	entry->cancelled = true;
+
+	/* From within another task, 'task'
+	 * can't be running at the same time */
+	if (SDL_ThreadID() != p->threadId)
+		while (p->current == task)
+			SDL_CondWait(p->doneCond, p->mutex);
+
+	p->erase(task);
+
+	SDL_UnlockMutex(p->mutex);
+
+	return true;
+}
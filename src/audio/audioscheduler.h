@@ -0,0 +1,75 @@
+/*
+** audioscheduler.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AUDIOSCHEDULER_H
+#define AUDIOSCHEDULER_H
+
+struct AudioSchedulerPrivate;
+struct SyncPoint;
+
+/* Runs the periodic work of all audio streams (buffer refills,
+ * fades) on one shared thread. Each task states when it wants
+ * to run next, and the thread sleeps until the earliest of
+ * those deadlines instead of polling */
+class AudioScheduler
+{
+public:
+	struct Task
+	{
+		virtual ~Task() {}
+
+		/* Called on the scheduler thread. Returns the delay in ms
+		 * until the next call, or a negative value to unschedule */
+		virtual int service() = 0;
+	};
+
+	AudioScheduler(SyncPoint &syncPoint);
+	~AudioScheduler();
+
+	/* Runs 'task' as soon as possible. If it is already
+	 * scheduled, its next call is moved up to now */
+	void add(Task *task);
+
+	/* Once this returns, 'task' isn't running and won't be
+	 * called again. Returns false if it wasn't scheduled.
+	 * May be called from within a task, but not on the
+	 * calling task itself */
+	bool remove(Task *task);
+
+private:
+	AudioSchedulerPrivate *p;
+};
+
+/* Forwards the scheduler call to 'func' on 'obj' */
+template<class C, int (C::*func)()>
+struct AudioTask : AudioScheduler::Task
+{
+	C *obj;
+
+	AudioTask(C *obj)
+	    : obj(obj)
+	{}
+
+	int service()
+	{
+		return (obj->*func)();
+	}
+};
+
+#endif // AUDIOSCHEDULER_H
@@ -25,43 +25,33 @@
 #include "exception.h"
 
 #include <SDL_mutex.h>
-#include <SDL_thread.h>
 #include <SDL_timer.h>
 
 AudioStream::AudioStream(ALStream::LoopMode loopMode,
-                         const std::string &threadId)
+                         AudioScheduler &scheduler,
+                         int bufCount,
+                         uint32_t bufSize,
+                         int staticLoopSecs)
 	: extPaused(false),
 	  noResumeStop(false),
-	  stream(loopMode, threadId)
+	  stream(loopMode, scheduler, bufCount, bufSize, staticLoopSecs),
+	  scheduler(scheduler),
+	  fadeOutTask(this),
+	  fadeInTask(this)
 {
 	current.volume = 1.0f;
 	current.pitch = 1.0f;
 
 	for (size_t i = 0; i < VolumeTypeCount; ++i)
-		volumes[i] = 1.0f;
-
-	fade.thread = 0;
-	fade.threadName = std::string("audio_fadeout (") + threadId + ")";
-
-	fadeIn.thread = 0;
-	fadeIn.threadName = std::string("audio_fadein (") + threadId + ")";
+		volumes[i].set(1.0f);
 
 	streamMut = SDL_CreateMutex();
 }
 
 AudioStream::~AudioStream()
 {
-	if (fade.thread)
-	{
-		fade.reqTerm.set();
-		SDL_WaitThread(fade.thread, 0);
-	}
-
-	if (fadeIn.thread)
-	{
-		fadeIn.rqTerm.set();
-		SDL_WaitThread(fadeIn.thread, 0);
-	}
+	scheduler.remove(&fadeOutTask);
+	scheduler.remove(&fadeInTask);
 
 	lockStream();
 
@@ -76,7 +66,8 @@ AudioStream::~AudioStream()
 void AudioStream::play(const std::string &filename,
                        int volume,
                        int pitch,
-                       float offset)
+                       float offset,
+                       ALStreamPrepared *prepared)
 {
 	finiFadeOutInt();
 
@@ -95,6 +86,7 @@ void AudioStream::play(const std::string &filename,
 	&&  (sState == ALStream::Playing || sState == ALStream::Paused))
 	{
 		unlockStream();
+		delete prepared;
 		return;
 	}
 
@@ -107,6 +99,7 @@ void AudioStream::play(const std::string &filename,
 		setVolume(Base, _volume);
 		current.volume = _volume;
 		unlockStream();
+		delete prepared;
 		return;
 	}
 
@@ -128,11 +121,15 @@ void AudioStream::play(const std::string &filename,
 			{
 				/* This will throw on errors while
 				 * opening the data source */
-				stream.open(filename);
+				if (prepared && prepared->source)
+					stream.open(*prepared);
+				else
+					stream.open(filename);
 			}
 			catch (const Exception &e)
 			{
 				unlockStream();
+				delete prepared;
 				throw e;
 			}
 		}
@@ -159,6 +156,9 @@ void AudioStream::play(const std::string &filename,
 		noResumeStop = false;
 
 	unlockStream();
+
+	/* Holds the buffers it was swapped for */
+	delete prepared;
 }
 
 void AudioStream::stop()
@@ -203,21 +203,15 @@ void AudioStream::fadeOut(int duration)
 		return;
 	}
 
-	if (fade.thread)
-	{
-		fade.reqFini.set();
-		SDL_WaitThread(fade.thread, 0);
-		fade.thread = 0;
-	}
+	/* A previous fade that is just wrapping up */
+	scheduler.remove(&fadeOutTask);
 
 	fade.active.set();
 	fade.msStep = 1.0f / duration;
 	fade.reqFini.clear();
-	fade.reqTerm.clear();
 	fade.startTicks = SDL_GetTicks();
 
-	fade.thread = createSDLThread
-		<AudioStream, &AudioStream::fadeOutThread>(this, fade.threadName);
+	scheduler.add(&fadeOutTask);
 
 	unlockStream();
 }
@@ -244,7 +238,7 @@ void AudioStream::unlockStream()
 
 void AudioStream::setVolume(VolumeType type, float value)
 {
-	volumes[type] = value;
+	volumes[type].set(value);
 	updateVolume();
 }
 
@@ -259,114 +253,108 @@ float AudioStream::playingOffset()
 }
 
 void AudioStream::updateVolume()
+{
+	float vol;
+
+	/* If another thread changed a factor while we were
+	 * applying ours, whoever applies last has to see it */
+	do
+	{
+		vol = combinedVolume();
+		stream.setVolume(vol);
+	}
+	while (combinedVolume() != vol);
+}
+
+float AudioStream::combinedVolume() const
 {
 	float vol = GLOBAL_VOLUME;
 
 	for (size_t i = 0; i < VolumeTypeCount; ++i)
 		vol *= volumes[i];
 
-	stream.setVolume(vol);
+	return vol;
 }
 
 void AudioStream::finiFadeOutInt()
 {
-	if (fade.thread)
-	{
-		fade.reqFini.set();
-		SDL_WaitThread(fade.thread, 0);
-		fade.thread = 0;
-	}
+	/* Fades still in progress are finished right away */
+	fade.reqFini.set();
 
-	if (fadeIn.thread)
-	{
-		fadeIn.rqFini.set();
-		SDL_WaitThread(fadeIn.thread, 0);
-		fadeIn.thread = 0;
-	}
+	if (scheduler.remove(&fadeOutTask))
+		fadeOutStep();
+
+	fadeIn.rqFini.set();
+
+	if (scheduler.remove(&fadeInTask))
+		fadeInStep();
 }
 
 void AudioStream::startFadeIn()
 {
 	/* Previous fadein should always be terminated in play() */
-	assert(!fadeIn.thread);
-
 	fadeIn.rqFini.clear();
-	fadeIn.rqTerm.clear();
 	fadeIn.startTicks = SDL_GetTicks();
 
-	fadeIn.thread = createSDLThread
-		<AudioStream, &AudioStream::fadeInThread>(this, fadeIn.threadName);
+	scheduler.add(&fadeInTask);
 }
 
-void AudioStream::fadeOutThread()
+int AudioStream::fadeOutStep()
 {
-	while (true)
-	{
-		/* Just immediately terminate on request */
-		if (fade.reqTerm)
-			break;
+	lockStream();
 
-		lockStream();
+	uint32_t curDur = SDL_GetTicks() - fade.startTicks;
+	float resVol = 1.0f - (curDur*fade.msStep);
 
-		uint32_t curDur = SDL_GetTicks() - fade.startTicks;
-		float resVol = 1.0f - (curDur*fade.msStep);
+	ALStream::State state = stream.queryState();
 
-		ALStream::State state = stream.queryState();
+	if (state != ALStream::Playing
+	|| resVol < 0
+	|| fade.reqFini)
+	{
+		if (state != ALStream::Paused)
+			stream.stop();
 
-		if (state != ALStream::Playing
-		|| resVol < 0
-		|| fade.reqFini)
-		{
-			if (state != ALStream::Paused)
-				stream.stop();
+		setVolume(FadeOut, 1.0f);
+		unlockStream();
 
-			setVolume(FadeOut, 1.0f);
-			unlockStream();
+		fade.active.clear();
 
-			break;
-		}
-
-		setVolume(FadeOut, resVol);
+		return -1;
+	}
 
-		unlockStream();
+	setVolume(FadeOut, resVol);
 
-		SDL_Delay(AUDIO_SLEEP);
-	}
+	unlockStream();
 
-	fade.active.clear();
+	return AUDIO_SLEEP;
 }
 
-void AudioStream::fadeInThread()
+int AudioStream::fadeInStep()
 {
-	while (true)
-	{
-		if (fadeIn.rqTerm)
-			break;
-
-		lockStream();
+	lockStream();
 
-		/* Fade in duration is always 1 second */
-		uint32_t cur = SDL_GetTicks() - fadeIn.startTicks;
-		float prog = cur / 1000.0f;
+	/* Fade in duration is always 1 second */
+	uint32_t cur = SDL_GetTicks() - fadeIn.startTicks;
+	float prog = cur / 1000.0f;
 
-		ALStream::State state = stream.queryState();
+	ALStream::State state = stream.queryState();
 
-		if (state != ALStream::Playing
-		||  prog >= 1.0f
-		||  fadeIn.rqFini)
-		{
-			setVolume(FadeIn, 1.0f);
-			unlockStream();
+	if (state != ALStream::Playing
+	||  prog >= 1.0f
+	||  fadeIn.rqFini)
+	{
+		setVolume(FadeIn, 1.0f);
+		unlockStream();
 
-			break;
-		}
+		return -1;
+	}
 
-		/* Quadratic increase (not really the same as
-		 * in RMVXA, but close enough) */
-		setVolume(FadeIn, prog*prog);
+	/* Quadratic increase (not really the same as
+	 * in RMVXA, but close enough) */
+	setVolume(FadeIn, prog*prog);
 
-		unlockStream();
+	unlockStream();
 
-		SDL_Delay(AUDIO_SLEEP);
-	}
+	return AUDIO_SLEEP;
 }
@@ -24,6 +24,7 @@
 
 #include "al-util.h"
 #include "alstream.h"
+#include "audioscheduler.h"
 #include "sdl-util.h"
 
 #include <string>
@@ -37,7 +38,7 @@ struct AudioStream
 		float pitch;
 	} current;
 
-	/* Volumes set by external threads,
+	/* Volumes set by external tasks,
 	 * such as for fade-in/out.
 	 * Multiplied together for final
 	 * playback volume. Used with setVolume().
@@ -89,17 +90,10 @@ struct AudioStream
 		/* Fade out is in progress */
 		AtomicFlag active;
 
-		/* Request fade thread to finish and
+		/* Request fade task to finish and
 		 * cleanup (like it normally would) */
 		AtomicFlag reqFini;
 
-		/* Request fade thread to terminate
-		 * immediately */
-		AtomicFlag reqTerm;
-
-		SDL_Thread *thread;
-		std::string threadName;
-
 		/* Amount of reduced absolute volume
 		 * per ms of fade time */
 		float msStep;
@@ -112,29 +106,33 @@ struct AudioStream
 	struct
 	{
 		AtomicFlag rqFini;
-		AtomicFlag rqTerm;
-
-		SDL_Thread *thread;
-		std::string threadName;
 
 		uint32_t startTicks;
 	} fadeIn;
 
 	AudioStream(ALStream::LoopMode loopMode,
-	            const std::string &threadId);
+	            AudioScheduler &scheduler,
+	            int bufCount = STREAM_BUFS,
+	            uint32_t bufSize = STREAM_BUF_SIZE,
+	            int staticLoopSecs = 0);
 	~AudioStream();
 
+	/* Takes ownership of 'prepared', which if set was made
+	 * for 'filename' and is opened instead of the file */
 	void play(const std::string &filename,
 	          int volume,
 	          int pitch,
-	          float offset = 0);
+	          float offset = 0,
+	          ALStreamPrepared *prepared = 0);
 	void stop();
 	void fadeOut(int duration);
 	void seek(float offset);
 
 	/* Any access to this classes 'stream' member,
 	 * whether state query or modification, must be
-	 * protected by a 'lock'/'unlock' pair */
+	 * protected by a 'lock'/'unlock' pair.
+	 * setVolume(), getVolume() and playingOffset()
+	 * don't need the lock */
 	void lockStream();
 	void unlockStream();
 
@@ -144,14 +142,23 @@ struct AudioStream
 	float playingOffset();
 
 private:
-	float volumes[VolumeTypeCount];
+	/* Set from both the script and the audio thread
+	 * without taking the stream lock */
+	AtomicFloat volumes[VolumeTypeCount];
 	void updateVolume();
+	float combinedVolume() const;
 
 	void finiFadeOutInt();
 	void startFadeIn();
 
-	void fadeOutThread();
-	void fadeInThread();
+	/* scheduler tasks */
+	int fadeOutStep();
+	int fadeInStep();
+
+	AudioScheduler &scheduler;
+
+	AudioTask<AudioStream, &AudioStream::fadeOutStep> fadeOutTask;
+	AudioTask<AudioStream, &AudioStream::fadeInStep> fadeInTask;
 };
 
 #endif // AUDIOSTREAM_H
@@ -0,0 +1,443 @@
+/*
+** flacsource.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "aldatasource.h"
+#include "exception.h"
+#include "resampler.h"
+
+#include <FLAC/stream_decoder.h>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+struct FlacSource : ALDataSource
+{
+	SDL_RWops &src;
+
+	FLAC__StreamDecoder *dec;
+
+	struct
+	{
+		int channels;
+		int rate;
+		int bitsPerSample;
+		ALenum alFormat;
+	} info;
+
+	uint32_t currentFrame;
+
+	struct
+	{
+		uint32_t start;
+		uint32_t length;
+		uint32_t end;
+		bool valid;
+		bool requested;
+	} loop;
+
+	/* Decoded by the last FLAC frame, interleaved, not yet
+	 * handed out. FLAC frames are a few thousand samples
+	 * long, so this stays small */
+	std::vector<int16_t> pending;
+	size_t pendingPos;
+
+	bool decodeError;
+
+	std::vector<int16_t> sampleBuf;
+
+	/* Null if the output stays at the source rate */
+	Resampler *resampler;
+	std::vector<int16_t> resampled;
+
+	FlacSource(SDL_RWops &ops,
+	           uint32_t bufSize,
+	           bool looped)
+	    : src(ops),
+	      currentFrame(0),
+	      pendingPos(0),
+	      decodeError(false),
+	      resampler(0)
+	{
+		info.channels = 0;
+		info.rate = 0;
+		info.bitsPerSample = 0;
+
+		loop.requested = looped;
+		loop.valid = false;
+		loop.start = loop.length = 0;
+
+		dec = FLAC__stream_decoder_new();
+
+		if (!dec)
+		{
+			SDL_RWclose(&src);
+			throw Exception(Exception::MKXPError, "FLAC: Out of memory");
+		}
+
+		FLAC__stream_decoder_set_metadata_respond(dec, FLAC__METADATA_TYPE_VORBIS_COMMENT);
+
+		if (FLAC__stream_decoder_init_stream(dec, readCB, seekCB, tellCB, lengthCB,
+		                                     eofCB, writeCB, metadataCB, errorCB, this)
+		    != FLAC__STREAM_DECODER_INIT_STATUS_OK
+		    || !FLAC__stream_decoder_process_until_end_of_metadata(dec)
+		    || info.rate == 0)
+		{
+			FLAC__stream_decoder_delete(dec);
+			SDL_RWclose(&src);
+			throw Exception(Exception::MKXPError,
+			                "FLAC: Cannot read flac file");
+		}
+
+		if (info.channels > 2)
+		{
+			FLAC__stream_decoder_delete(dec);
+			SDL_RWclose(&src);
+			throw Exception(Exception::MKXPError,
+			                "Cannot handle audio with more than 2 channels");
+		}
+
+		info.alFormat = chooseALFormat(sizeof(int16_t), info.channels);
+
+		if (Resampler::wanted(info.rate))
+			resampler = new Resampler(info.channels, info.rate,
+			                          Resampler::deviceRate());
+
+		sampleBuf.resize(bufSize);
+
+		loop.end = loop.start + loop.length;
+		loop.valid = (loop.requested && loop.start && loop.length);
+	}
+
+	~FlacSource()
+	{
+		delete resampler;
+		FLAC__stream_decoder_delete(dec);
+		SDL_RWclose(&src);
+	}
+
+	static FLAC__StreamDecoderReadStatus
+	readCB(const FLAC__StreamDecoder *, FLAC__byte buffer[], size_t *bytes, void *data)
+	{
+		FlacSource *self = static_cast<FlacSource*>(data);
+
+		*bytes = SDL_RWread(&self->src, buffer, 1, *bytes);
+
+		return *bytes > 0 ? FLAC__STREAM_DECODER_READ_STATUS_CONTINUE
+		                  : FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+	}
+
+	static FLAC__StreamDecoderSeekStatus
+	seekCB(const FLAC__StreamDecoder *, FLAC__uint64 offset, void *data)
+	{
+		FlacSource *self = static_cast<FlacSource*>(data);
+
+		return SDL_RWseek(&self->src, offset, RW_SEEK_SET) < 0
+		     ? FLAC__STREAM_DECODER_SEEK_STATUS_ERROR
+		     : FLAC__STREAM_DECODER_SEEK_STATUS_OK;
+	}
+
+	static FLAC__StreamDecoderTellStatus
+	tellCB(const FLAC__StreamDecoder *, FLAC__uint64 *offset, void *data)
+	{
+		FlacSource *self = static_cast<FlacSource*>(data);
+		const Sint64 pos = SDL_RWtell(&self->src);
+
+		if (pos < 0)
+			return FLAC__STREAM_DECODER_TELL_STATUS_ERROR;
+
+		*offset = pos;
+
+		return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+	}
+
+	static FLAC__StreamDecoderLengthStatus
+	lengthCB(const FLAC__StreamDecoder *, FLAC__uint64 *length, void *data)
+	{
+		FlacSource *self = static_cast<FlacSource*>(data);
+		const Sint64 size = SDL_RWsize(&self->src);
+
+		if (size < 0)
+			return FLAC__STREAM_DECODER_LENGTH_STATUS_ERROR;
+
+		*length = size;
+
+		return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
+	}
+
+	static FLAC__bool eofCB(const FLAC__StreamDecoder *, void *data)
+	{
+		FlacSource *self = static_cast<FlacSource*>(data);
+
+		return SDL_RWtell(&self->src) >= SDL_RWsize(&self->src);
+	}
+
+	/* Converts the frame to 16 bit and queues it up */
+	static FLAC__StreamDecoderWriteStatus
+	writeCB(const FLAC__StreamDecoder *, const FLAC__Frame *frame,
+	        const FLAC__int32 *const buffer[], void *data)
+	{
+		FlacSource *self = static_cast<FlacSource*>(data);
+		const int channels = self->info.channels;
+		const int bits = frame->header.bits_per_sample;
+		const uint32_t frames = frame->header.blocksize;
+
+		if ((int) frame->header.channels != channels)
+			return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+		std::vector<int16_t> &out = self->pending;
+
+		/* Anything left over goes first */
+		out.erase(out.begin(), out.begin() + self->pendingPos);
+		self->pendingPos = 0;
+
+		const size_t base = out.size();
+		out.resize(base + frames * channels);
+
+		for (int c = 0; c < channels; ++c)
+		{
+			const FLAC__int32 *in = buffer[c];
+			int16_t *dst = &out[base + c];
+
+			if (bits >= 16)
+				for (uint32_t i = 0; i < frames; ++i)
+					dst[i * channels] = in[i] >> (bits - 16);
+			else
+				for (uint32_t i = 0; i < frames; ++i)
+					dst[i * channels] = in[i] << (16 - bits);
+		}
+
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+	}
+
+	static void metadataCB(const FLAC__StreamDecoder *,
+	                       const FLAC__StreamMetadata *meta, void *data)
+	{
+		FlacSource *self = static_cast<FlacSource*>(data);
+
+		if (meta->type == FLAC__METADATA_TYPE_STREAMINFO)
+		{
+			self->info.channels = meta->data.stream_info.channels;
+			self->info.rate = meta->data.stream_info.sample_rate;
+			self->info.bitsPerSample = meta->data.stream_info.bits_per_sample;
+
+			return;
+		}
+
+		if (meta->type != FLAC__METADATA_TYPE_VORBIS_COMMENT)
+			return;
+
+		/* Same loop tags as in Ogg Vorbis files */
+		const FLAC__StreamMetadata_VorbisComment &vc = meta->data.vorbis_comment;
+
+		for (FLAC__uint32 i = 0; i < vc.num_comments; ++i)
+		{
+			const char *comment = (const char*) vc.comments[i].entry;
+			const char *sep = strchr(comment, '=');
+
+			if (!sep || !*(sep+1))
+				continue;
+
+			const size_t keyLen = sep - comment;
+
+			if (keyLen == 9 && !strncmp(comment, "LOOPSTART", keyLen))
+				self->loop.start = strtol(sep+1, 0, 10);
+
+			if (keyLen == 10 && !strncmp(comment, "LOOPLENGTH", keyLen))
+				self->loop.length = strtol(sep+1, 0, 10);
+		}
+	}
+
+	static void errorCB(const FLAC__StreamDecoder *,
+	                    FLAC__StreamDecoderErrorStatus, void *data)
+	{
+		/* Lost sync and bad frames are skipped by libFLAC;
+		 * only give up if no audio comes out at all */
+		static_cast<FlacSource*>(data)->decodeError = true;
+	}
+
+	int sampleRate()
+	{
+		return resampler ? resampler->outputRate() : info.rate;
+	}
+
+	void seekToOffset(float seconds)
+	{
+		if (resampler)
+			resampler->reset();
+
+		uint32_t frame = std::max(seconds, 0.0f) * info.rate;
+
+		if (loop.valid && frame > loop.end)
+			frame = loop.start;
+
+		seekFrame(frame);
+	}
+
+	/* Keeps the resampler history so wrapping around stays seamless */
+	void seekFrame(uint32_t frame)
+	{
+		pending.clear();
+		pendingPos = 0;
+		currentFrame = frame;
+
+		/* The frame holding 'frame' is written out from there on */
+		if (FLAC__stream_decoder_seek_absolute(dec, frame))
+			return;
+
+		/* If seeking fails, just seek back to start */
+		FLAC__stream_decoder_flush(dec);
+		FLAC__stream_decoder_reset(dec);
+		pending.clear();
+		pendingPos = 0;
+		currentFrame = 0;
+	}
+
+	/* Decodes more if nothing is pending. Returns false at the end */
+	bool refill()
+	{
+		while (pendingPos == pending.size())
+		{
+			if (FLAC__stream_decoder_get_state(dec) == FLAC__STREAM_DECODER_END_OF_STREAM)
+				return false;
+
+			if (!FLAC__stream_decoder_process_single(dec))
+				return false;
+		}
+
+		return true;
+	}
+
+	Status fillBuffer(AL::Buffer::ID alBuffer)
+	{
+		const int channels = info.channels;
+		const uint32_t bufFrames = sampleBuf.size() / channels;
+		uint32_t usedFrames = 0;
+
+		Status retStatus = ALDataSource::NoError;
+
+		bool readAgain = false;
+
+		while (usedFrames < bufFrames)
+		{
+			uint32_t canRead = bufFrames - usedFrames;
+
+			if (loop.valid)
+				canRead = std::min(canRead, loop.end - std::min(currentFrame, loop.end));
+
+			uint32_t res = 0;
+
+			if (canRead > 0 && refill())
+			{
+				res = std::min<uint32_t>(canRead, (pending.size() - pendingPos) / channels);
+
+				memcpy(&sampleBuf[usedFrames * channels], &pending[pendingPos],
+				       res * channels * sizeof(int16_t));
+
+				pendingPos += res * channels;
+			}
+			else if (canRead > 0 && FLAC__stream_decoder_get_state(dec)
+			                        != FLAC__STREAM_DECODER_END_OF_STREAM)
+			{
+				retStatus = ALDataSource::Error;
+				break;
+			}
+
+			usedFrames += res;
+			currentFrame += res;
+
+			if (loop.valid && currentFrame >= loop.end)
+			{
+				retStatus = ALDataSource::WrapAround;
+				seekFrame(loop.start);
+
+				break;
+			}
+
+			if (res > 0)
+				continue;
+
+			/* EOF */
+			if (loop.requested)
+			{
+				retStatus = ALDataSource::WrapAround;
+				seekFrame(0);
+			}
+			else
+			{
+				retStatus = ALDataSource::EndOfStream;
+			}
+
+			/* Right at the end after a seek; a buffer
+			 * mustn't come back empty, so read on */
+			if (usedFrames > 0)
+				break;
+
+			if (readAgain)
+			{
+				retStatus = ALDataSource::Error;
+				break;
+			}
+
+			readAgain = true;
+		}
+
+		if (retStatus != ALDataSource::Error)
+			upload(alBuffer, usedFrames * channels);
+
+		return retStatus;
+	}
+
+	/* Uploads the first 'samples' of 'sampleBuf' */
+	void upload(AL::Buffer::ID alBuffer, int samples)
+	{
+		if (!resampler)
+		{
+			AL::Buffer::uploadData(alBuffer, info.alFormat, sampleBuf.data(),
+			                       samples*sizeof(int16_t), info.rate);
+			return;
+		}
+
+		resampled.clear();
+		resampler->process(sampleBuf.data(), samples / info.channels, resampled);
+
+		AL::Buffer::uploadData(alBuffer, info.alFormat, resampled.data(),
+		                       resampled.size()*sizeof(int16_t), resampler->outputRate());
+	}
+
+	uint32_t loopStartFrames()
+	{
+		if (!loop.valid)
+			return 0;
+
+		return resampler ? resampler->toOutputFrames(loop.start) : loop.start;
+	}
+
+	bool setPitch(float)
+	{
+		return false;
+	}
+};
+
+ALDataSource *createFlacSource(SDL_RWops &ops,
+                               uint32_t bufSize,
+                               bool looped)
+{
+	return new FlacSource(ops, bufSize, looped);
+}
@@ -9,6 +9,7 @@
 
 typedef struct _fluid_hashtable_t fluid_settings_t;
 typedef struct _fluid_synth_t fluid_synth_t;
+typedef struct _fluid_sfont_t fluid_sfont_t;
 
 typedef int (*FLUIDSETTINGSSETNUMPROC)(fluid_settings_t* settings, const char *name, double val);
 typedef int (*FLUIDSETTINGSSETINTPROC)(fluid_settings_t* settings, const char *name, int val);
@@ -22,6 +23,8 @@ typedef int (*FLUIDSYNTHCHANNELPRESSUREPROC)(fluid_synth_t* synth, int chan, int
 typedef int (*FLUIDSYNTHPITCHBENDPROC)(fluid_synth_t* synth, int chan, int val);
 typedef int (*FLUIDSYNTHCCPROC)(fluid_synth_t* synth, int chan, int ctrl, int val);
 typedef int (*FLUIDSYNTHPROGRAMCHANGEPROC)(fluid_synth_t* synth, int chan, int program);
+typedef fluid_sfont_t* (*FLUIDSYNTHGETSFONTBYIDPROC)(fluid_synth_t* synth, int id);
+typedef int (*FLUIDSYNTHADDSFONTPROC)(fluid_synth_t* synth, fluid_sfont_t* sfont);
 
 typedef fluid_settings_t* (*NEWFLUIDSETTINGSPROC)(void);
 typedef fluid_synth_t* (*NEWFLUIDSYNTHPROC)(fluid_settings_t* settings);
@@ -29,8 +32,10 @@ typedef void (*DELETEFLUIDSETTINGSPROC)(fluid_settings_t* settings);
 
 #if FLUIDSYNTH_VERSION_MAJOR == 1
 typedef int (*DELETEFLUIDSYNTHPROC)(fluid_synth_t* synth);
+typedef void (*FLUIDSYNTHREMOVESFONTPROC)(fluid_synth_t* synth, fluid_sfont_t* sfont);
 #else
 typedef void (*DELETEFLUIDSYNTHPROC)(fluid_synth_t* synth);
+typedef int (*FLUIDSYNTHREMOVESFONTPROC)(fluid_synth_t* synth, fluid_sfont_t* sfont);
 #endif
 
 #define FLUID_FUNCS \
@@ -45,7 +50,10 @@ typedef void (*DELETEFLUIDSYNTHPROC)(fluid_synth_t* synth);
 	FLUID_FUN(synth_channel_pressure, FLUIDSYNTHCHANNELPRESSUREPROC) \
 	FLUID_FUN(synth_pitch_bend, FLUIDSYNTHPITCHBENDPROC) \
 	FLUID_FUN(synth_cc, FLUIDSYNTHCCPROC) \
-	FLUID_FUN(synth_program_change, FLUIDSYNTHPROGRAMCHANGEPROC)
+	FLUID_FUN(synth_program_change, FLUIDSYNTHPROGRAMCHANGEPROC) \
+	FLUID_FUN(synth_get_sfont_by_id, FLUIDSYNTHGETSFONTBYIDPROC) \
+	FLUID_FUN(synth_add_sfont, FLUIDSYNTHADDSFONTPROC) \
+	FLUID_FUN(synth_remove_sfont, FLUIDSYNTHREMOVESFONTPROC)
 
 /* Functions that don't fit into the default prefix naming scheme */
 #define FLUID_FUNCS2 \
@@ -28,13 +28,22 @@
 #include "util.h"
 #include "debugwriter.h"
 #include "fluid-fun.h"
+#include "config.h"
+#include "sdl-util.h"
+#include "boost-hash.h"
+#include "intrulist.h"
 
+#include <SDL_atomic.h>
+
+#include <SDL_mutex.h>
 #include <SDL_rwops.h>
+#include <SDL_thread.h>
 
 #include <assert.h>
 #include <math.h>
 #include <vector>
 #include <algorithm>
+#include <deque>
 #include <string>
 
 /* Vocabulary:
@@ -53,7 +62,6 @@
  */
 
 #define TICK_FRAMES 32
-#define BUF_TICKS (STREAM_BUF_SIZE / TICK_FRAMES)
 #define DEFAULT_BPM 120
 #define MAX_CHANNELS 16
 
@@ -63,6 +71,9 @@
 
 #define CC_VAL_DEFAULT 127
 
+/* Parsed files kept around for replaying */
+#define MIDI_CACHE_SIZE 8
+
 enum MidiEventType
 {
 	NoteOff,
@@ -445,6 +456,7 @@ void readMidi(MidiReadHandler *handler, const std::vector<uint8_t> &data)
 		readMidiTrack(handler, chunk);
 }
 
+/* Events of one track, only used while reading a file */
 struct Track
 {
 	std::vector<MidiEvent> events;
@@ -452,33 +464,8 @@ struct Track
 	/* Combined deltas of all events */
 	uint64_t length;
 
-	/* Event index that is resumed from after loop wraparound */
-	int32_t loopI;
-
-	/* Difference between last event's position and length of
-	 * the longest overall track / song length */
-	uint32_t loopOffsetEnd;
-
-	/* Delta offset from the loop beginning to event[loopI] */
-	uint32_t loopOffsetStart;
-
-	bool valid;
-	MidiEvent event;
-	int32_t remDeltas;
-
-	uint32_t index;
-	bool wrapAroundFlag;
-	bool atEnd;
-
 	Track()
-	    : length(0),
-	      loopI(-1),
-	      loopOffsetEnd(0),
-	      loopOffsetStart(0),
-	      valid(false),
-	      index(0),
-	      wrapAroundFlag(false),
-	      atEnd(false)
+	    : length(0)
 	{}
 
 	void appendEvent(const MidiEvent &e)
@@ -486,46 +473,6 @@ struct Track
 		length += e.delta;
 		events.push_back(e);
 	}
-
-	void scheduleEvent(bool looped)
-	{
-		if (valid)
-			return;
-
-		/* At end and not looped? */
-		if (index == events.size() && ((!looped || loopI < 0) || length == 0))
-		{
-			valid = false;
-			atEnd = true;
-			return;
-		}
-
-		MidiEvent &e = events[index++];
-
-		event = e;
-		remDeltas = e.delta;
-		valid = true;
-
-		if (wrapAroundFlag)
-		{
-			remDeltas = loopOffsetEnd + loopOffsetStart;
-			wrapAroundFlag = false;
-		}
-
-		if (looped && (index == events.size()) && loopI >= 0)
-		{
-			index = loopI;
-			wrapAroundFlag = true;
-		}
-	}
-
-	void reset()
-	{
-		valid = false;
-		index = 0;
-		wrapAroundFlag = false;
-		atEnd = false;
-	}
 };
 
 /* Some songs use CC events for effects like fade-out,
@@ -581,128 +528,508 @@ struct CCResetter
 	}
 };
 
-struct MidiSource : ALDataSource, MidiReadHandler
+/* All tracks of a song merged into one sorted event list,
+ * with each event's delta relative to the one before it.
+ * Immutable once built, and shared between every source
+ * playing the same file */
+struct MidiTimeline
 {
-	const uint16_t freq;
-	fluid_synth_t *synth;
+	std::string key;
 
-	int16_t synthBuf[BUF_TICKS*TICK_FRAMES*2];
+	std::vector<MidiEvent> events;
 
-	std::vector<Track> tracks;
-	CCResetter<CC_CTRL_VOLUME>     volReset;
-	CCResetter<CC_CTRL_EXPRESSION> expReset;
+	/* Deltas per beat */
+	uint16_t dpb;
 
-	/* Index of longest track */
-	uint8_t longestI;
+	/* Event index that is resumed from after loop wraparound,
+	 * or -1 if the song can't loop */
+	int32_t loopI;
 
-	bool looped;
+	/* Delta from the end of the song to events[loopI] when wrapping */
+	uint32_t loopOffset;
 
-	/* Absolute delta at which we received the LOOP_MARKER CC event */
-	uint32_t loopDelta;
+	/* Link into the timeline cache priority list */
+	IntruListLink<MidiTimeline> link;
 
-	/* Deltas per beat */
-	uint16_t dpb;
+	SDL_atomic_t refCount;
 
-	int8_t pitchShift;
+	MidiTimeline()
+	    : dpb(480),
+	      loopI(-1),
+	      loopOffset(0),
+	      link(this)
+	{
+		SDL_AtomicSet(&refCount, 1);
+	}
 
-	/* Deltas per tick */
-	float playbackSpeed;
+	static MidiTimeline *ref(MidiTimeline *timeline)
+	{
+		SDL_AtomicIncRef(&timeline->refCount);
 
-	float genDeltasCarry;
+		return timeline;
+	}
+
+	static void deref(MidiTimeline *timeline)
+	{
+		if (SDL_AtomicDecRef(&timeline->refCount))
+			delete timeline;
+	}
+};
+
+struct MidiTimelineBuilder : MidiReadHandler
+{
+	std::vector<Track> tracks;
+	CCResetter<CC_CTRL_VOLUME>     volReset;
+	CCResetter<CC_CTRL_EXPRESSION> expReset;
+
+	uint16_t dpb;
 
-	/* MidiReadHandler (track that's currently being read) */
+	/* Absolute delta at which we received the LOOP_MARKER CC event */
+	uint32_t loopDelta;
+
+	/* Track that's currently being read */
 	int16_t curTrack;
 
-	MidiSource(SDL_RWops &ops,
-	           bool looped)
-	    : freq(SYNTH_SAMPLERATE),
-	      looped(looped),
-	      dpb(480),
-	      pitchShift(0),
-	      genDeltasCarry(0),
+	MidiTimelineBuilder()
+	    : dpb(480),
+	      loopDelta(0),
 	      curTrack(-1)
+	{}
+
+	struct SortEvent
 	{
-		size_t dataLen = SDL_RWsize(&ops);
-		std::vector<uint8_t> data(dataLen);
+		uint64_t absDelta;
 
-		if (SDL_RWread(&ops, &data[0], 1, dataLen) < dataLen)
-		{
-			SDL_RWclose(&ops);
-			throw Exception(Exception::MKXPError, "Reading midi data failed");
-		}
+		/* Events of empty tracks are only played once, and thus
+		 * sort before everything else that happens at delta 0 */
+		bool repeats;
 
-		try
-		{
-			readMidi(this, data);
-		}
-		catch (const Exception &)
+		MidiEvent e;
+
+		bool operator<(const SortEvent &o) const
 		{
-			SDL_RWclose(&ops);
-			throw;
-		}
+			if (absDelta != o.absDelta)
+				return absDelta < o.absDelta;
 
-		synth = shState->midiState().allocateSynth();
+			return repeats < o.repeats;
+		}
+	};
 
+	void build(MidiTimeline &timeline)
+	{
 		uint64_t longest = 0;
+		size_t eventCount = 0;
 
 		for (size_t i = 0; i < tracks.size(); ++i)
-			if (tracks[i].length > longest)
-			{
-				longest = tracks[i].length;
-				longestI = i;
-			}
-
-		for (size_t i = 0; i < tracks.size(); ++i)
-			tracks[i].loopOffsetEnd = longest - tracks[i].length;
+		{
+			longest = std::max(longest, tracks[i].length);
+			eventCount += tracks[i].events.size();
+		}
 
 		/* Enterbrain likes to be funny and put loop markers at
 		 * the very end of ME tracks */
 		if (loopDelta >= longest)
 			loopDelta = 0;
 
+		std::vector<SortEvent> sorted;
+		sorted.reserve(eventCount);
+
 		for (size_t i = 0; i < tracks.size(); ++i)
 		{
-			Track &track = tracks[i];
+			const Track &track = tracks[i];
+			uint64_t base = 0;
 
-			int64_t base = 0;
 			for (size_t j = 0; j < track.events.size(); ++j)
 			{
-				MidiEvent &e = track.events[j];
-				base += e.delta;
+				base += track.events[j].delta;
 
-				if (base < loopDelta)
-					continue;
+				SortEvent se;
+				se.absDelta = base;
+				se.repeats = (track.length > 0);
+				se.e = track.events[j];
+				sorted.push_back(se);
+			}
+		}
 
-				/* Don't make the last event loop eternally */
-				if (j < track.events.size())
-				{
-					track.loopI = j;
-					track.loopOffsetStart = base - loopDelta;
-				}
+		/* Simultaneous events keep their track order */
+		std::stable_sort(sorted.begin(), sorted.end());
 
-				break;
+		timeline.dpb = dpb;
+		timeline.events.resize(sorted.size());
+
+		uint64_t prev = 0;
+
+		for (size_t i = 0; i < sorted.size(); ++i)
+		{
+			const SortEvent &se = sorted[i];
+
+			timeline.events[i] = se.e;
+			timeline.events[i].delta = se.absDelta - prev;
+			prev = se.absDelta;
+
+			if (timeline.loopI < 0 && se.repeats && se.absDelta >= loopDelta)
+			{
+				timeline.loopI = i;
+				timeline.loopOffset = se.absDelta - loopDelta;
 			}
 		}
+	}
+
+	/* MidiReadHandler */
+	void onMidiHeader(uint16_t midiType, uint16_t trackCount, uint16_t division)
+	{
+		if (midiType != 0 && midiType != 1)
+			throw Exception(Exception::MKXPError, "Midi: Type 2 not supported");
+
+		tracks.resize(trackCount);
+
+		// SMTP unhandled
+		if (division & 0x8000)
+			throw Exception(Exception::MKXPError, "Midi: SMTP parameters not supported");
+		else
+			dpb = division;
+	}
+
+	void onMidiTrackBegin()
+	{
+		++curTrack;
+	}
+
+	void onMidiEvent(const MidiEvent &e, uint32_t absDelta)
+	{
+		assert(curTrack >= 0 && curTrack < (int16_t) tracks.size());
+
+		Track &track = tracks[curTrack];
+
+		track.appendEvent(e);
+		volReset.handleEvent(e, track);
+		expReset.handleEvent(e, track);
+
+		if (e.type == CC && e.e.cc.ctrl == CC_CTRL_LOOP)
+			loopDelta = absDelta;
+	}
+};
+
+/* Keeps the timelines of the most recently opened files around, so
+ * that replaying a song, which RPG Maker does a lot, skips parsing.
+ * Files are assumed not to change while the game is running */
+struct MidiTimelineCache
+{
+	typedef BoostHash<std::string, MidiTimeline*> TimelineHash;
+
+	TimelineHash hash;
+
+	/* Most recently used first */
+	IntruList<MidiTimeline> timelines;
+	size_t count;
+
+	SDL_mutex *mutex;
+
+	MidiTimelineCache()
+	    : count(0)
+	{
+		mutex = SDL_CreateMutex();
+	}
+
+	~MidiTimelineCache()
+	{
+		while (!timelines.isEmpty())
+			evictOldest();
+
+		SDL_DestroyMutex(mutex);
+	}
+
+	/* Returns a new reference, or null */
+	MidiTimeline *get(const std::string &key)
+	{
+		SDL_LockMutex(mutex);
+
+		MidiTimeline *timeline = hash.value(key, 0);
+
+		if (timeline)
+		{
+			timelines.remove(timeline->link);
+			timelines.prepend(timeline->link);
+			MidiTimeline::ref(timeline);
+		}
+
+		SDL_UnlockMutex(mutex);
+
+		return timeline;
+	}
+
+	void insert(MidiTimeline *timeline)
+	{
+		SDL_LockMutex(mutex);
+
+		/* Someone else might have parsed the same file meanwhile */
+		if (!hash.contains(timeline->key))
+		{
+			if (count == MIDI_CACHE_SIZE)
+				evictOldest();
+
+			hash.insert(timeline->key, MidiTimeline::ref(timeline));
+			timelines.prepend(timeline->link);
+			++count;
+		}
+
+		SDL_UnlockMutex(mutex);
+	}
+
+private:
+	void evictOldest()
+	{
+		MidiTimeline *last = timelines.tail();
+
+		hash.remove(last->key);
+		timelines.remove(last->link);
+		--count;
+
+		MidiTimeline::deref(last);
+	}
+};
+
+static MidiTimelineCache timelineCache;
+
+static MidiTimeline *
+loadTimeline(SDL_RWops &ops, const char *filename)
+{
+	MidiTimeline *timeline = timelineCache.get(filename);
 
+	if (timeline)
+		return timeline;
+
+	size_t dataLen = SDL_RWsize(&ops);
+	std::vector<uint8_t> data(dataLen);
+
+	if (SDL_RWread(&ops, &data[0], 1, dataLen) < dataLen)
+	{
+		SDL_RWclose(&ops);
+		throw Exception(Exception::MKXPError, "Reading midi data failed");
+	}
+
+	MidiTimelineBuilder builder;
+
+	try
+	{
+		readMidi(&builder, data);
+	}
+	catch (const Exception &)
+	{
+		SDL_RWclose(&ops);
+		throw;
+	}
+
+	timeline = new MidiTimeline;
+	timeline->key = filename;
+	builder.build(*timeline);
+
+	timelineCache.insert(timeline);
+
+	return timeline;
+}
+
+struct MidiSource : ALDataSource
+{
+	const uint16_t freq;
+	fluid_synth_t *synth;
+
+	/* Ticks that fit into one buffer */
+	const size_t bufTicks;
+	std::vector<int16_t> synthBuf;
+
+	/* Buffers rendered ahead of time on a worker thread,
+	 * so a slow synth doesn't starve the stream */
+	struct Chunk
+	{
+		std::vector<int16_t> samples;
+		Status status;
+	};
+
+	struct
+	{
+		/* Oldest first */
+		std::deque<Chunk> chunks;
+		size_t depth;
+
+		/* The last queued chunk ended the stream */
+		bool atEnd;
+		bool quit;
+
+		/* Null if rendering ahead is disabled */
+		SDL_Thread *thread;
+
+		/* Held while the synth and playback state is used */
+		SDL_mutex *stateMut;
+		/* Protects the rest of this struct */
+		SDL_mutex *queueMut;
+		/* Signaled whenever 'chunks' changes, or on shutdown */
+		SDL_cond *queueCond;
+	} ahead;
+
+	MidiTimeline *timeline;
+
+	bool looped;
+
+	/* Index of the next event to be scheduled */
+	size_t nextI;
+
+	/* The scheduled event, valid if 'scheduled' is set */
+	const MidiEvent *event;
+	int32_t remDeltas;
+	bool scheduled;
+	bool atEnd;
+
+	int8_t pitchShift;
+
+	/* Deltas per tick */
+	float playbackSpeed;
+
+	float genDeltasCarry;
+
+	MidiSource(SDL_RWops &ops,
+	           const char *filename,
+	           uint32_t bufSize,
+	           bool looped)
+	    : freq(SYNTH_SAMPLERATE),
+	      bufTicks(std::max<uint32_t>(bufSize / TICK_FRAMES, 1)),
+	      synthBuf(bufTicks*TICK_FRAMES*2),
+	      looped(looped),
+	      pitchShift(0),
+	      genDeltasCarry(0)
+	{
+		timeline = loadTimeline(ops, filename);
+
+		synth = shState->midiState().allocateSynth();
+
+		resetPlayback();
 		updatePlaybackSpeed(DEFAULT_BPM);
 
-		// FIXME: It would make the code in 'fillBuffer' a lot nicer if
-		// we could combine all tracks into one giant one on construction,
-		// instead of having to constantly iterate through all of them
+		startRenderAhead();
 	}
 
 	~MidiSource()
 	{
+		if (ahead.thread)
+		{
+			SDL_LockMutex(ahead.queueMut);
+			ahead.quit = true;
+			SDL_CondBroadcast(ahead.queueCond);
+			SDL_UnlockMutex(ahead.queueMut);
+
+			SDL_WaitThread(ahead.thread, 0);
+		}
+
+		SDL_DestroyCond(ahead.queueCond);
+		SDL_DestroyMutex(ahead.queueMut);
+		SDL_DestroyMutex(ahead.stateMut);
+
 		shState->midiState().releaseSynth(synth);
+
+		MidiTimeline::deref(timeline);
+	}
+
+	void startRenderAhead()
+	{
+		ahead.atEnd = false;
+		ahead.quit = false;
+		ahead.thread = 0;
+
+		ahead.stateMut = SDL_CreateMutex();
+		ahead.queueMut = SDL_CreateMutex();
+		ahead.queueCond = SDL_CreateCond();
+
+		const int aheadMs = shState->config().midi.renderAhead;
+
+		if (aheadMs <= 0)
+			return;
+
+		const size_t bufFrames = bufTicks * TICK_FRAMES;
+		ahead.depth = std::max<size_t>(((uint64_t) aheadMs * freq / 1000 + bufFrames - 1) / bufFrames, 1);
+
+		ahead.thread = createSDLThread
+			<MidiSource, &MidiSource::renderAheadFun>(this, "midi_render");
+	}
+
+	void renderAheadFun()
+	{
+		SDL_LockMutex(ahead.queueMut);
+
+		while (true)
+		{
+			while (!ahead.quit && (ahead.atEnd || ahead.chunks.size() >= ahead.depth))
+				SDL_CondWait(ahead.queueCond, ahead.queueMut);
+
+			if (ahead.quit)
+				break;
+
+			SDL_UnlockMutex(ahead.queueMut);
+
+			/* A seek in the meantime only changes where we render from */
+			SDL_LockMutex(ahead.stateMut);
+
+			Chunk chunk;
+			chunk.status = render(chunk.samples);
+
+			SDL_LockMutex(ahead.queueMut);
+			SDL_UnlockMutex(ahead.stateMut);
+
+			ahead.atEnd = (chunk.status == EndOfStream);
+			ahead.chunks.push_back(std::move(chunk));
+
+			SDL_CondBroadcast(ahead.queueCond);
+		}
+
+		SDL_UnlockMutex(ahead.queueMut);
 	}
 
 
 	void updatePlaybackSpeed(uint32_t bpm)
 	{
-		float deltaLength = 60.0f / (dpb * bpm);
+		float deltaLength = 60.0f / (timeline->dpb * bpm);
 		playbackSpeed = TICK_FRAMES / (deltaLength * freq);
 	}
 
+	void scheduleEvent()
+	{
+		if (scheduled || atEnd)
+			return;
+
+		const std::vector<MidiEvent> &events = timeline->events;
+		uint32_t delta;
+
+		if (nextI < events.size())
+		{
+			delta = events[nextI].delta;
+		}
+		else if (looped && timeline->loopI >= 0)
+		{
+			nextI = timeline->loopI;
+			delta = timeline->loopOffset;
+		}
+		else
+		{
+			atEnd = true;
+			return;
+		}
+
+		event = &events[nextI++];
+		scheduled = true;
+
+		/* Negative deltas from the previous event have to
+		 * be carried over into the next to stay in sync */
+		remDeltas += delta;
+	}
+
+	void resetPlayback()
+	{
+		nextI = 0;
+		event = 0;
+		remDeltas = 0;
+		scheduled = false;
+		atEnd = false;
+	}
+
 	void activateEvent(const MidiEvent &e)
 	{
 		int16_t key = e.e.note.key;
@@ -745,123 +1072,51 @@ struct MidiSource : ALDataSource, MidiReadHandler
 		}
 	}
 
-	void renderTicks(size_t count, size_t offset)
+	void renderTicks(std::vector<int16_t> &out, size_t count, size_t offset)
 	{
 		size_t bufOffset = offset * TICK_FRAMES * 2;
 		int len = count * TICK_FRAMES;
-		void *buffer = &synthBuf[bufOffset];
+		void *buffer = &out[bufOffset];
 
 		fluid.synth_write_s16(synth, len, buffer, 0, 2, buffer, 1, 2);
 	}
 
-	/* MidiReadHandler */
-	void onMidiHeader(uint16_t midiType, uint16_t trackCount, uint16_t division)
-	{
-		if (midiType != 0 && midiType != 1)
-			throw Exception(Exception::MKXPError, "Midi: Type 2 not supported");
-
-		tracks.resize(trackCount);
-
-		// SMTP unhandled
-		if (division & 0x8000)
-			throw Exception(Exception::MKXPError, "Midi: SMTP parameters not supported");
-		else
-			dpb = division;
-	}
-
-	void onMidiTrackBegin()
-	{
-		++curTrack;
-	}
-
-	void onMidiEvent(const MidiEvent &e, uint32_t absDelta)
+	/* Synthesizes one buffer worth of samples into 'out' */
+	Status render(std::vector<int16_t> &out)
 	{
-		assert(curTrack >= 0 && curTrack < (int16_t) tracks.size());
+		out.resize(bufTicks*TICK_FRAMES*2);
 
-		Track &track = tracks[curTrack];
-
-		track.appendEvent(e);
-		volReset.handleEvent(e, track);
-		expReset.handleEvent(e, track);
-
-		if (e.type == CC && e.e.cc.ctrl == CC_CTRL_LOOP)
-			loopDelta = absDelta;
-	}
-
-	/* ALDataSource */
-	Status fillBuffer(AL::Buffer::ID buf)
-	{
 		/* In case there is no currently scheduled one */
-		for (size_t i = 0; i < tracks.size(); ++i)
-			tracks[i].scheduleEvent(looped);
+		scheduleEvent();
 
-		size_t remTicks = BUF_TICKS;
+		size_t remTicks = bufTicks;
 
 		/* Iterate until all ticks that fit into the buffer
 		 * have been rendered */
 		while (remTicks > 0)
 		{
-			/* Check for events that have to be activated now, activate them,
-			 * and schedule new ones if the queue isn't empty */
-			for (size_t i = 0; i < tracks.size(); ++i)
+			/* Activate all events that are due, multiple
+			 * ones might have to be activated at once */
+			while (scheduled && remDeltas <= 0)
 			{
-				Track &track = tracks[i];
-
-				/* We have to loop and ensure that the final scheduled
-				 * event lies in the future, as multiple events might
-				 * have to be activated at once */
-				while (true)
-				{
-					if (!track.valid || track.remDeltas > 0)
-						break;
-
-					int32_t prevOffset = track.remDeltas;
-
-					activateEvent(track.event);
-
-					track.valid = false;
-					track.scheduleEvent(looped);
-
-					/* Negative deltas from the previous event have to
-					 * be carried over into the next to stay in sync */
-					if (prevOffset < 0)
-						track.remDeltas += prevOffset;
+				activateEvent(*event);
 
-					/* Ensure it lies in the future */
-					if (track.remDeltas > 0)
-						break;
-				}
+				scheduled = false;
+				scheduleEvent();
 			}
 
-			size_t nextEvent = (size_t) -1;
-			bool allInvalid = true;
+			/* We need to render at least one tick regardless to
+			 * avoid an endless loop of waiting for the next event
+			 * to become current */
+			size_t genTicks = remTicks;
 
-			/* Search all tracks for the temporally nearest event */
-			for (size_t i = 0; i < tracks.size(); ++i)
+			if (scheduled)
 			{
-				Track &track = tracks[i];
-
-				if (!track.valid)
-					continue;
-
-				allInvalid = false;
-
-				uint32_t remDelta = track.remDeltas / playbackSpeed;
-
-				/* We need to render at least one tick regardless to
-				 * avoid an endless loop of waiting for the next event
-				 * to become current */
-				if (remDelta < nextEvent)
-					nextEvent = std::max<uint32_t>(remDelta, 1);
+				size_t nextEvent = std::max<uint32_t>(remDeltas / playbackSpeed, 1);
+				genTicks = std::min(remTicks, nextEvent);
 			}
 
-			/* Calculate amount of ticks we'll render next */
-			size_t genTicks = allInvalid ? remTicks : std::min(remTicks, nextEvent);
-
-			if (genTicks == 0)
-				continue;
-
-			renderTicks(genTicks, BUF_TICKS - remTicks);
+			renderTicks(out, genTicks, bufTicks - remTicks);
 			remTicks -= genTicks;
 
 			float genDeltas = (genTicks * playbackSpeed) + genDeltasCarry;
@@ -871,20 +1126,58 @@ struct MidiSource : ALDataSource, MidiReadHandler
 
 			/* Substract integer part of consumed deltas while carrying
 			 * over the fractional amount into the next iteration */
-			for (size_t i = 0; i < tracks.size(); ++i)
-				if (tracks[i].valid)
-					tracks[i].remDeltas -= intDeltas;
+			if (scheduled)
+				remDeltas -= intDeltas;
 		}
 
-		/* Fill AL buffer */
-		AL::Buffer::uploadData(buf, AL_FORMAT_STEREO16, synthBuf, sizeof(synthBuf), freq);
-
-		if (tracks[longestI].atEnd)
+		if (atEnd)
 			return EndOfStream;
 
 		return NoError;
 	}
 
+	/* ALDataSource */
+	Status fillBuffer(AL::Buffer::ID buf)
+	{
+		Status status;
+		const std::vector<int16_t> *samples = &synthBuf;
+
+		SDL_LockMutex(ahead.queueMut);
+
+		while (ahead.thread && ahead.chunks.empty() && !ahead.atEnd)
+			SDL_CondWait(ahead.queueCond, ahead.queueMut);
+
+		Chunk chunk;
+
+		if (!ahead.chunks.empty())
+		{
+			chunk.samples.swap(ahead.chunks.front().samples);
+			chunk.status = ahead.chunks.front().status;
+			ahead.chunks.pop_front();
+
+			SDL_CondBroadcast(ahead.queueCond);
+			SDL_UnlockMutex(ahead.queueMut);
+
+			status = chunk.status;
+			samples = &chunk.samples;
+		}
+		else
+		{
+			/* Rendering ahead is disabled, or has run past the end */
+			SDL_UnlockMutex(ahead.queueMut);
+
+			SDL_LockMutex(ahead.stateMut);
+			status = render(synthBuf);
+			SDL_UnlockMutex(ahead.stateMut);
+		}
+
+		/* Fill AL buffer */
+		AL::Buffer::uploadData(buf, AL_FORMAT_STEREO16, samples->data(),
+		                       samples->size()*sizeof(int16_t), freq);
+
+		return status;
+	}
+
 	int sampleRate()
 	{
 		return freq;
@@ -893,6 +1186,15 @@ struct MidiSource : ALDataSource, MidiReadHandler
 	/* Midi sources cannot seek, and so always reset to beginning */
 	void seekToOffset(float)
 	{
+		SDL_LockMutex(ahead.stateMut);
+
+		/* Drop everything rendered from the old position */
+		SDL_LockMutex(ahead.queueMut);
+		ahead.chunks.clear();
+		ahead.atEnd = false;
+		SDL_CondBroadcast(ahead.queueCond);
+		SDL_UnlockMutex(ahead.queueMut);
+
 		/* Reset synth */
 		fluid.synth_system_reset(synth);
 
@@ -900,9 +1202,9 @@ struct MidiSource : ALDataSource, MidiReadHandler
 		genDeltasCarry = 0;
 		updatePlaybackSpeed(DEFAULT_BPM);
 
-		/* Reset tracks */
-		for (size_t i = 0; i < tracks.size(); ++i)
-			tracks[i].reset();
+		resetPlayback();
+
+		SDL_UnlockMutex(ahead.stateMut);
 	}
 
 	uint32_t loopStartFrames() { return 0; }
@@ -910,14 +1212,18 @@ struct MidiSource : ALDataSource, MidiReadHandler
 	bool setPitch(float value)
 	{
 		// not completely correct, but close
+		SDL_LockMutex(ahead.stateMut);
 		pitchShift = round((value > 1.0f ? 14 : 24) * (value - 1.0f));
+		SDL_UnlockMutex(ahead.stateMut);
 
 		return true;
 	}
 };
 
 ALDataSource *createMidiSource(SDL_RWops &ops,
+                               const char *filename,
+                               uint32_t bufSize,
                                bool looped)
 {
-	return new MidiSource(ops, looped);
+	return new MidiSource(ops, filename, bufSize, looped);
 }
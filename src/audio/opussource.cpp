@@ -0,0 +1,294 @@
+/*
+** opussource.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "aldatasource.h"
+#include "exception.h"
+#include "resampler.h"
+
+#include <opusfile.h>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+
+/* Opus always decodes at this rate, whatever the input was */
+#define OPUS_RATE 48000
+
+static int ofRead(void *ops, unsigned char *ptr, int nbytes)
+{
+	return SDL_RWread(static_cast<SDL_RWops*>(ops), ptr, 1, nbytes);
+}
+
+static int ofSeek(void *ops, opus_int64 offset, int whence)
+{
+	return SDL_RWseek(static_cast<SDL_RWops*>(ops), offset, whence) < 0 ? -1 : 0;
+}
+
+static opus_int64 ofTell(void *ops)
+{
+	return SDL_RWtell(static_cast<SDL_RWops*>(ops));
+}
+
+static const OpusFileCallbacks OfCallbacks =
+{
+	ofRead,
+	ofSeek,
+	ofTell,
+	0
+};
+
+struct OpusSource : ALDataSource
+{
+	SDL_RWops &src;
+
+	OggOpusFile *of;
+
+	/* Files with more than 2 channels are mixed down to stereo */
+	int channels;
+	ALenum alFormat;
+
+	uint32_t currentFrame;
+
+	struct
+	{
+		uint32_t start;
+		uint32_t length;
+		uint32_t end;
+		bool valid;
+		bool requested;
+	} loop;
+
+	std::vector<int16_t> sampleBuf;
+
+	/* Null if the output stays at the source rate */
+	Resampler *resampler;
+	std::vector<int16_t> resampled;
+
+	OpusSource(SDL_RWops &ops,
+	           uint32_t bufSize,
+	           bool looped)
+	    : src(ops),
+	      currentFrame(0),
+	      resampler(0)
+	{
+		int error;
+		of = op_open_callbacks(&src, &OfCallbacks, 0, 0, &error);
+
+		if (!of)
+		{
+			SDL_RWclose(&src);
+			throw Exception(Exception::MKXPError,
+			                "Opusfile: Cannot read opus file");
+		}
+
+		channels = std::min(op_channel_count(of, -1), 2);
+		alFormat = chooseALFormat(sizeof(int16_t), channels);
+
+		if (Resampler::wanted(OPUS_RATE))
+			resampler = new Resampler(channels, OPUS_RATE,
+			                          Resampler::deviceRate());
+
+		sampleBuf.resize(bufSize);
+
+		loop.requested = looped;
+		loop.valid = false;
+		loop.start = loop.length = 0;
+
+		if (!loop.requested)
+			return;
+
+		/* Same tags as in Ogg Vorbis files, in 48 kHz frames */
+		const OpusTags *tags = op_tags(of, -1);
+		const char *value;
+
+		if ((value = opus_tags_query(tags, "LOOPSTART", 0)))
+			loop.start = strtol(value, 0, 10);
+
+		if ((value = opus_tags_query(tags, "LOOPLENGTH", 0)))
+			loop.length = strtol(value, 0, 10);
+
+		loop.end = loop.start + loop.length;
+		loop.valid = (loop.start && loop.length);
+	}
+
+	~OpusSource()
+	{
+		delete resampler;
+		op_free(of);
+		SDL_RWclose(&src);
+	}
+
+	int sampleRate()
+	{
+		return resampler ? resampler->outputRate() : OPUS_RATE;
+	}
+
+	void seekToOffset(float seconds)
+	{
+		if (resampler)
+			resampler->reset();
+
+		seekDecoder(seconds);
+	}
+
+	/* Unlike seekToOffset, keeps the resampler history
+	 * so wrapping around stays seamless */
+	void seekDecoder(float seconds)
+	{
+		uint32_t frame = std::max(seconds, 0.0f) * OPUS_RATE;
+
+		if (loop.valid && frame > loop.end)
+			frame = loop.start;
+
+		seekFrame(frame);
+	}
+
+	void seekFrame(uint32_t frame)
+	{
+		currentFrame = frame;
+
+		/* If seeking fails, just seek back to start */
+		if (op_pcm_seek(of, currentFrame) != 0)
+		{
+			op_raw_seek(of, 0);
+			currentFrame = 0;
+		}
+	}
+
+	/* Returns frames read, or a negative error code */
+	int decode(int16_t *dst, int frames)
+	{
+		if (channels == 2)
+			return op_read_stereo(of, dst, frames * 2);
+
+		return op_read(of, dst, frames, 0);
+	}
+
+	Status fillBuffer(AL::Buffer::ID alBuffer)
+	{
+		const int bufFrames = sampleBuf.size() / channels;
+		int usedFrames = 0;
+
+		Status retStatus = ALDataSource::NoError;
+
+		bool readAgain = false;
+
+		while (usedFrames < bufFrames)
+		{
+			int canRead = bufFrames - usedFrames;
+
+			if (loop.valid)
+				canRead = std::min<int>(canRead, loop.end - currentFrame);
+
+			int res = 0;
+
+			if (canRead > 0)
+				res = decode(&sampleBuf[usedFrames * channels], canRead);
+
+			if (res < 0)
+			{
+				/* Skip over a damaged page, like vorbisfile's holes */
+				if (res == OP_HOLE)
+					continue;
+
+				retStatus = ALDataSource::Error;
+				break;
+			}
+
+			usedFrames += res;
+			currentFrame += res;
+
+			if (loop.valid && currentFrame >= loop.end)
+			{
+				retStatus = ALDataSource::WrapAround;
+				seekFrame(loop.start);
+
+				break;
+			}
+
+			if (res > 0)
+				continue;
+
+			/* EOF */
+			if (loop.requested)
+			{
+				retStatus = ALDataSource::WrapAround;
+				seekFrame(0);
+			}
+			else
+			{
+				retStatus = ALDataSource::EndOfStream;
+			}
+
+			/* Right at the end after a seek; a buffer
+			 * mustn't come back empty, so read on */
+			if (usedFrames > 0)
+				break;
+
+			if (readAgain)
+			{
+				retStatus = ALDataSource::Error;
+				break;
+			}
+
+			readAgain = true;
+		}
+
+		if (retStatus != ALDataSource::Error)
+			upload(alBuffer, usedFrames * channels);
+
+		return retStatus;
+	}
+
+	/* Uploads the first 'samples' of 'sampleBuf' */
+	void upload(AL::Buffer::ID alBuffer, int samples)
+	{
+		if (!resampler)
+		{
+			AL::Buffer::uploadData(alBuffer, alFormat, sampleBuf.data(),
+			                       samples*sizeof(int16_t), OPUS_RATE);
+			return;
+		}
+
+		resampled.clear();
+		resampler->process(sampleBuf.data(), samples / channels, resampled);
+
+		AL::Buffer::uploadData(alBuffer, alFormat, resampled.data(),
+		                       resampled.size()*sizeof(int16_t), resampler->outputRate());
+	}
+
+	uint32_t loopStartFrames()
+	{
+		if (!loop.valid)
+			return 0;
+
+		return resampler ? resampler->toOutputFrames(loop.start) : loop.start;
+	}
+
+	bool setPitch(float)
+	{
+		return false;
+	}
+};
+
+ALDataSource *createOpusSource(SDL_RWops &ops,
+                               uint32_t bufSize,
+                               bool looped)
+{
+	return new OpusSource(ops, bufSize, looped);
+}
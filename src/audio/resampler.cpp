@@ -0,0 +1,216 @@
+/*
+** resampler.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "resampler.h"
+
+#include "sharedstate.h"
+#include "eventthread.h"
+#include "config.h"
+#include "util.h"
+
+#include <alc.h>
+
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+# include <emmintrin.h>
+# define RESAMPLER_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+# include <arm_neon.h>
+# define RESAMPLER_NEON
+#endif
+
+/* Filter length in input frames. Keeping this a multiple of 4
+ * lets the dot products run on whole vectors for any channel count */
+#define TAPS 16
+#define PHASE_BITS 6
+#define PHASES (1 << PHASE_BITS)
+
+Resampler::Resampler(int channels, int inRate, int outRate)
+    : channels(channels),
+      inRate(inRate),
+      outRate(outRate),
+      table(PHASES * TAPS * channels)
+{
+	step = ((uint64_t) inRate << 32) / outRate;
+
+	/* Lower the cutoff when downsampling to avoid aliasing,
+	 * and keep some headroom below Nyquist either way */
+	const double cutoff = std::min(1.0, (double) outRate / inRate) * 0.95;
+
+	for (int p = 0; p < PHASES; ++p)
+	{
+		const double frac = (double) p / PHASES;
+		float coeffs[TAPS];
+		double sum = 0;
+
+		for (int t = 0; t < TAPS; ++t)
+		{
+			/* Distance of this tap to the interpolated position */
+			const double d = t - (TAPS/2 - 1) - frac;
+			const double x = M_PI * cutoff * d;
+
+			double sinc = (d == 0) ? 1 : sin(x) / x;
+			double window = 0.42 + 0.5 * cos(2 * M_PI * d / TAPS)
+			                     + 0.08 * cos(4 * M_PI * d / TAPS);
+
+			coeffs[t] = cutoff * sinc * window;
+			sum += coeffs[t];
+		}
+
+		/* Unity gain at DC for every phase */
+		for (int t = 0; t < TAPS; ++t)
+			for (int c = 0; c < channels; ++c)
+				table[(p * TAPS + t) * channels + c] = coeffs[t] / sum;
+	}
+
+	reset();
+}
+
+void Resampler::reset()
+{
+	pos = 0;
+
+	/* Start out on silence, so the first output frames
+	 * already have a full filter history */
+	hist.assign((TAPS/2 - 1) * channels, 0);
+}
+
+size_t Resampler::process(const int16_t *in, size_t frames, std::vector<int16_t> &out)
+{
+	size_t base = hist.size();
+	hist.resize(base + frames * channels);
+
+	for (size_t i = 0; i < frames * channels; ++i)
+		hist[base + i] = in[i] * (1.0f / 32768);
+
+	const size_t histFrames = hist.size() / channels;
+	size_t produced = 0;
+
+	out.reserve(out.size() + (toOutputFrames(frames) + 1) * channels);
+
+	while ((pos >> 32) + TAPS <= histFrames)
+	{
+		size_t index = pos >> 32;
+		size_t phase = (pos >> (32 - PHASE_BITS)) & (PHASES - 1);
+
+		filter(&hist[index * channels], &table[phase * TAPS * channels], out);
+
+		pos += step;
+		++produced;
+	}
+
+	/* Drop what no future output frame needs anymore */
+	size_t consumed = std::min<size_t>(pos >> 32, histFrames);
+	hist.erase(hist.begin(), hist.begin() + consumed * channels);
+	pos -= (uint64_t) consumed << 32;
+
+	return produced;
+}
+
+size_t Resampler::drain(std::vector<int16_t> &out)
+{
+	std::vector<int16_t> silence(TAPS * channels, 0);
+
+	return process(silence.data(), TAPS, out);
+}
+
+uint64_t Resampler::toOutputFrames(uint64_t frames) const
+{
+	return frames * outRate / inRate;
+}
+
+static inline int16_t
+toS16(float sample)
+{
+	return clamp<float>(sample * 32768, -32768, 32767);
+}
+
+void Resampler::filter(const float *in, const float *coeffs, std::vector<int16_t> &out)
+{
+	const int n = TAPS * channels;
+
+	/* Lane i accumulates the samples of channel (i % channels),
+	 * as long as there are at most two of them */
+	float acc[4];
+
+#if defined(RESAMPLER_SSE)
+	__m128 sum = _mm_setzero_ps();
+
+	for (int i = 0; i < n; i += 4)
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(in + i), _mm_loadu_ps(coeffs + i)));
+
+	_mm_storeu_ps(acc, sum);
+#elif defined(RESAMPLER_NEON)
+	float32x4_t sum = vdupq_n_f32(0);
+
+	for (int i = 0; i < n; i += 4)
+		sum = vmlaq_f32(sum, vld1q_f32(in + i), vld1q_f32(coeffs + i));
+
+	vst1q_f32(acc, sum);
+#else
+	acc[0] = acc[1] = acc[2] = acc[3] = 0;
+
+	for (int i = 0; i < n; i += 4)
+		for (int j = 0; j < 4; ++j)
+			acc[j] += in[i + j] * coeffs[i + j];
+#endif
+
+	switch (channels)
+	{
+	case 1 :
+		out.push_back(toS16(acc[0] + acc[1] + acc[2] + acc[3]));
+		break;
+
+	case 2 :
+		out.push_back(toS16(acc[0] + acc[2]));
+		out.push_back(toS16(acc[1] + acc[3]));
+		break;
+
+	default :
+		/* Rare enough to not bother vectorizing */
+		for (int c = 0; c < channels; ++c)
+		{
+			float s = 0;
+
+			for (int i = c; i < n; i += channels)
+				s += in[i] * coeffs[i];
+
+			out.push_back(toS16(s));
+		}
+	}
+}
+
+int Resampler::deviceRate()
+{
+	ALCint freq = 0;
+	alcGetIntegerv(shState->rtData().alcDev, ALC_FREQUENCY, 1, &freq);
+
+	return freq;
+}
+
+bool Resampler::wanted(int rate)
+{
+	if (!shState->config().resampleAudio)
+		return false;
+
+	int devRate = deviceRate();
+
+	return devRate > 0 && rate > 0 && rate != devRate;
+}
@@ -0,0 +1,78 @@
+/*
+** resampler.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* Streaming polyphase sinc resampler for interleaved s16 audio.
+ * Decoded sources pass their output through it to arrive at the
+ * device rate, so OpenAL can mix them without resampling of its
+ * own while they play at unity pitch */
+class Resampler
+{
+public:
+	Resampler(int channels, int inRate, int outRate);
+
+	/* Forgets all buffered input, eg. after a seek */
+	void reset();
+
+	/* Resamples 'frames' frames from 'in', appending the result
+	 * to 'out'. Returns the number of frames appended */
+	size_t process(const int16_t *in, size_t frames, std::vector<int16_t> &out);
+
+	/* Pushes the frames still held back by the filter into 'out',
+	 * followed by some silence. Used at the end of finite input */
+	size_t drain(std::vector<int16_t> &out);
+
+	int inputRate() const { return inRate; }
+	int outputRate() const { return outRate; }
+
+	/* Converts an input frame count to the output rate */
+	uint64_t toOutputFrames(uint64_t frames) const;
+
+	/* Output rate of the audio device, or 0 if unknown */
+	static int deviceRate();
+
+	/* Whether sources at 'rate' should be resampled */
+	static bool wanted(int rate);
+
+private:
+	void filter(const float *in, const float *coeffs, std::vector<int16_t> &out);
+
+	int channels;
+	int inRate;
+	int outRate;
+
+	/* Input frames per output frame, 32.32 fixed point */
+	uint64_t step;
+	uint64_t pos;
+
+	/* Input not consumed yet, converted to float */
+	std::vector<float> hist;
+
+	/* Coefficients of each phase, repeated for every channel
+	 * so they line up with the interleaved input */
+	std::vector<float> table;
+};
+
+#endif // RESAMPLER_H
@@ -21,9 +21,14 @@
 
 #include "aldatasource.h"
 #include "exception.h"
+#include "resampler.h"
+#include "sharedstate.h"
+#include "config.h"
 
 #include <SDL_sound.h>
 
+#include <vector>
+
 struct SDLSoundSource : ALDataSource
 {
 	Sound_Sample *sample;
@@ -34,14 +39,24 @@ struct SDLSoundSource : ALDataSource
 	ALenum alFormat;
 	ALsizei alFreq;
 
+	/* Null if the output stays at the source rate */
+	Resampler *resampler;
+	std::vector<int16_t> resampled;
+
 	SDLSoundSource(SDL_RWops &ops,
 	               const char *extension,
 	               uint32_t maxBufSize,
 	               bool looped)
 	    : srcOps(ops),
-	      looped(looped)
+	      looped(looped),
+	      resampler(0)
 	{
-		sample = Sound_NewSample(&srcOps, extension, 0, maxBufSize);
+		/* The resampler only takes 16 bit samples */
+		Sound_AudioInfo s16Info = { AUDIO_S16SYS, 0, 0 };
+		const bool resample = shState->config().resampleAudio;
+
+		sample = Sound_NewSample(&srcOps, extension,
+		                         resample ? &s16Info : 0, maxBufSize);
 
 		if (!sample)
 		{
@@ -49,14 +64,24 @@ struct SDLSoundSource : ALDataSource
 			throw Exception(Exception::SDLError, "SDL_sound: %s", Sound_GetError());
 		}
 
-		sampleSize = formatSampleSize(sample->actual.format);
+		const Sound_AudioInfo &out = resample ? sample->desired : sample->actual;
+		sampleSize = formatSampleSize(out.format);
 
 		alFormat = chooseALFormat(sampleSize, sample->actual.channels);
 		alFreq = sample->actual.rate;
+
+		if (resample && Resampler::wanted(alFreq))
+		{
+			resampler = new Resampler(sample->actual.channels, alFreq,
+			                          Resampler::deviceRate());
+			alFreq = resampler->outputRate();
+		}
 	}
 
 	~SDLSoundSource()
 	{
+		delete resampler;
+
 		/* This also closes 'srcOps' */
 		Sound_FreeSample(sample);
 	}
@@ -78,7 +103,19 @@ struct SDLSoundSource : ALDataSource
 		if (sample->flags & SOUND_SAMPLEFLAG_ERROR)
 			return ALDataSource::Error;
 
-		AL::Buffer::uploadData(alBuffer, alFormat, sample->buffer, decoded, alFreq);
+		if (resampler)
+		{
+			resampled.clear();
+			resampler->process(static_cast<const int16_t*>(sample->buffer),
+			                   decoded / (sampleSize * sample->actual.channels), resampled);
+
+			AL::Buffer::uploadData(alBuffer, alFormat, resampled.data(),
+			                       resampled.size()*sizeof(int16_t), alFreq);
+		}
+		else
+		{
+			AL::Buffer::uploadData(alBuffer, alFormat, sample->buffer, decoded, alFreq);
+		}
 
 		if (sample->flags & SOUND_SAMPLEFLAG_EOF)
 		{
@@ -98,11 +135,14 @@ struct SDLSoundSource : ALDataSource
 
 	int sampleRate()
 	{
-		return sample->actual.rate;
+		return alFreq;
 	}
 
 	void seekToOffset(float seconds)
 	{
+		if (resampler)
+			resampler->reset();
+
 		if (seconds <= 0)
 			Sound_Rewind(sample);
 		else
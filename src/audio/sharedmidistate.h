@@ -25,6 +25,10 @@
 #include "config.h"
 #include "debugwriter.h"
 #include "fluid-fun.h"
+#include "sdl-util.h"
+
+#include <SDL_mutex.h>
+#include <SDL_thread.h>
 
 #include <assert.h>
 #include <vector>
@@ -39,6 +43,10 @@ struct Synth
 	bool inUse;
 };
 
+/* The SoundFont is parsed only once, into the first synth of the
+ * pool, and shared with every other synth from there. Loading
+ * happens on a background thread, so only allocating the first
+ * synth can block on it */
 struct SharedMidiState
 {
 	bool inited;
@@ -46,25 +54,53 @@ struct SharedMidiState
 	const std::string &soundFont;
 	fluid_settings_t *flSettings;
 
+	/* Owned by synths[0], null if none could be loaded */
+	fluid_sfont_t *sfont;
+
+	SDL_Thread *loadThread;
+	bool loaded;
+
+	/* Protects 'synths', 'sfont' and 'loaded' */
+	SDL_mutex *mutex;
+	/* Signaled once loading is done */
+	SDL_cond *loadCond;
+
 	SharedMidiState(const Config &conf)
 	    : inited(false),
-	      soundFont(conf.midi.soundFont)
-	{}
+	      soundFont(conf.midi.soundFont),
+	      sfont(0),
+	      loadThread(0),
+	      loaded(false)
+	{
+		mutex = SDL_CreateMutex();
+		loadCond = SDL_CreateCond();
+	}
 
 	~SharedMidiState()
 	{
 		/* We might have initialized, but if the consecutive libfluidsynth
 		 * load failed, no resources will have been allocated */
-		if (!inited || !HAVE_FLUID)
-			return;
+		if (inited && HAVE_FLUID)
+		{
+			if (loadThread)
+				SDL_WaitThread(loadThread, 0);
 
-		fluid.delete_settings(flSettings);
+			/* The owning synth must go last, as it frees the SoundFont */
+			for (size_t i = synths.size(); i-- > 0;)
+			{
+				assert(!synths[i].inUse);
 
-		for (size_t i = 0; i < synths.size(); ++i)
-		{
-			assert(!synths[i].inUse);
-			fluid.delete_synth(synths[i].synth);
+				if (i > 0 && sfont)
+					fluid.synth_remove_sfont(synths[i].synth, sfont);
+
+				fluid.delete_synth(synths[i].synth);
+			}
+
+			fluid.delete_settings(flSettings);
 		}
+
+		SDL_DestroyCond(loadCond);
+		SDL_DestroyMutex(mutex);
 	}
 
 	void initIfNeeded(const Config &conf)
@@ -84,9 +120,13 @@ struct SharedMidiState
 		fluid.settings_setnum(flSettings, "synth.sample-rate", SYNTH_SAMPLERATE);
 		fluid.settings_setint(flSettings, "synth.chorus.active", conf.midi.chorus);
 		fluid.settings_setint(flSettings, "synth.reverb.active", conf.midi.reverb);
+		fluid.settings_setint(flSettings, "synth.cpu-cores", conf.midi.cpuCores);
+
+		loadThread = createSDLThread
+			<SharedMidiState, &SharedMidiState::loadFun>(this, "midi_sfload");
 
-		for (size_t i = 0; i < SYNTH_INIT_COUNT; ++i)
-			addSynth(false);
+		if (!loadThread)
+			loadFun();
 	}
 
 	fluid_synth_t *allocateSynth()
@@ -94,28 +134,41 @@ struct SharedMidiState
 		assert(HAVE_FLUID);
 		assert(inited);
 
+		SDL_LockMutex(mutex);
+
+		while (!loaded)
+			SDL_CondWait(loadCond, mutex);
+
 		size_t i;
 
 		for (i = 0; i < synths.size(); ++i)
 			if (!synths[i].inUse)
 				break;
 
+		fluid_synth_t *syn;
+
 		if (i < synths.size())
 		{
-			fluid_synth_t *syn = synths[i].synth;
+			syn = synths[i].synth;
 			fluid.synth_system_reset(syn);
 			synths[i].inUse = true;
-
-			return syn;
 		}
 		else
 		{
-			return addSynth(true);
+			/* Cheap, the SoundFont is already in memory */
+			syn = newSharingSynth();
+			addSynth(syn, true);
 		}
+
+		SDL_UnlockMutex(mutex);
+
+		return syn;
 	}
 
 	void releaseSynth(fluid_synth_t *synth)
 	{
+		SDL_LockMutex(mutex);
+
 		size_t i;
 
 		for (i = 0; i < synths.size(); ++i)
@@ -125,24 +178,60 @@ struct SharedMidiState
 		assert(i < synths.size());
 
 		synths[i].inUse = false;
+
+		SDL_UnlockMutex(mutex);
 	}
 
 private:
-	fluid_synth_t *addSynth(bool usedNow)
+	void loadFun()
 	{
-		fluid_synth_t *syn = fluid.new_synth(flSettings);
+		fluid_synth_t *owner = fluid.new_synth(flSettings);
+		fluid_sfont_t *sf = 0;
 
 		if (!soundFont.empty())
-			fluid.synth_sfload(syn, soundFont.c_str(), 1);
+		{
+			int id = fluid.synth_sfload(owner, soundFont.c_str(), 1);
+
+			if (id != -1)
+				sf = fluid.synth_get_sfont_by_id(owner, id);
+			else
+				Debug() << "Warning: Failed to load soundfont" << soundFont;
+		}
 		else
+		{
 			Debug() << "Warning: No soundfont specified, sound might be mute";
+		}
+
+		SDL_LockMutex(mutex);
+
+		sfont = sf;
+		addSynth(owner, false);
+
+		for (size_t i = 1; i < SYNTH_INIT_COUNT; ++i)
+			addSynth(newSharingSynth(), false);
+
+		loaded = true;
+		SDL_CondBroadcast(loadCond);
+
+		SDL_UnlockMutex(mutex);
+	}
+
+	fluid_synth_t *newSharingSynth()
+	{
+		fluid_synth_t *syn = fluid.new_synth(flSettings);
+
+		if (sfont)
+			fluid.synth_add_sfont(syn, sfont);
 
+		return syn;
+	}
+
+	void addSynth(fluid_synth_t *syn, bool usedNow)
+	{
 		Synth synth;
 		synth.inUse = usedNow;
 		synth.synth = syn;
 		synths.push_back(synth);
-
-		return syn;
 	}
 };
 
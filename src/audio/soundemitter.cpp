@@ -23,14 +23,19 @@
 
 #include "sharedstate.h"
 #include "filesystem.h"
+#include "ioscheduler.h"
 #include "exception.h"
 #include "config.h"
 #include "util.h"
 #include "debugwriter.h"
+#include "sdl-util.h"
+#include "resampler.h"
 
+#include <SDL_mutex.h>
 #include <SDL_sound.h>
+#include <SDL_thread.h>
 
-#define SE_CACHE_MEM (10*1024*1024) // 10 MB
+#include <deque>
 
 struct SoundBuffer
 {
@@ -45,11 +50,15 @@ struct SoundBuffer
 	/* Buffer byte count */
 	uint32_t bytes;
 
+	/* Times this buffer was found in the cache */
+	uint32_t hits;
+
 	/* Reference count */
 	uint8_t refCount;
 
 	SoundBuffer()
 	    : link(this),
+	      hits(0),
 	      refCount(1)
 
 	{
@@ -88,12 +97,314 @@ arrayPushBack(std::vector<size_t> &array, size_t size, size_t index)
 	array[size-1] = v;
 }
 
+struct SoundOpenHandler : FileSystem::OpenHandler
+{
+	SoundBuffer *buffer;
+	bool compact;
+	std::string error;
+
+	SoundOpenHandler(bool compact)
+	    : buffer(0),
+	      compact(compact)
+	{}
+
+	bool tryRead(SDL_RWops &ops, const char *ext)
+	{
+		Sound_Sample *sample = Sound_NewSample(&ops, ext, 0, STREAM_BUF_SIZE);
+
+		if (!sample)
+		{
+			error = Sound_GetError();
+			SDL_RWclose(&ops);
+			return false;
+		}
+
+		/* Do all of the decoding in the handler so we don't have
+		 * to keep the source ops around */
+		uint32_t decBytes = Sound_DecodeAll(sample);
+		uint8_t sampleSize = formatSampleSize(sample->actual.format);
+		uint32_t sampleCount = decBytes / sampleSize;
+
+		const void *data = sample->buffer;
+		std::vector<int16_t> narrowed;
+		ALsizei rate = sample->actual.rate;
+
+		const bool resample = Resampler::wanted(rate) &&
+			(sample->actual.format == AUDIO_S16SYS || sample->actual.format == AUDIO_F32SYS);
+
+		/* Sounds are stored in the format they were decoded in,
+		 * but float samples don't need more than 16 bits */
+		if ((compact || resample) && sample->actual.format == AUDIO_F32SYS)
+		{
+			const float *src = static_cast<const float*>(sample->buffer);
+			narrowed.resize(sampleCount);
+
+			for (uint32_t i = 0; i < sampleCount; ++i)
+				narrowed[i] = clamp<float>(src[i], -1, 1) * 32767;
+
+			data = narrowed.data();
+			sampleSize = sizeof(int16_t);
+		}
+
+		/* Done once here, so OpenAL gets buffers at the device rate */
+		std::vector<int16_t> resampled;
+
+		if (resample)
+		{
+			const uint8_t channels = sample->actual.channels;
+			Resampler resampler(channels, rate, Resampler::deviceRate());
+
+			const int16_t *src = static_cast<const int16_t*>(data);
+			resampler.process(src, sampleCount / channels, resampled);
+
+			/* Don't cut off the tail, but also don't keep the silence */
+			resampler.drain(resampled);
+			resampled.resize(std::min<size_t>(resampled.size(),
+				(resampler.toOutputFrames(sampleCount / channels) + 1) * channels));
+
+			data = resampled.data();
+			sampleCount = resampled.size();
+			rate = resampler.outputRate();
+		}
+
+		buffer = new SoundBuffer;
+		buffer->bytes = sampleSize * sampleCount;
+
+		ALenum alFormat = chooseALFormat(sampleSize, sample->actual.channels);
+
+		AL::Buffer::uploadData(buffer->alBuffer, alFormat, data,
+							   buffer->bytes, rate);
+
+		Sound_FreeSample(sample);
+
+		return true;
+	}
+};
+
+/* Returns null on failure, with 'error' set */
+static SoundBuffer *decodeSound(const std::string &filename,
+                                bool compact, std::string &error)
+{
+	SoundOpenHandler handler(compact);
+
+	try
+	{
+		shState->fileSystem().openRead(handler, filename.c_str());
+	}
+	catch (const Exception &e)
+	{
+		error = e.msg;
+		return 0;
+	}
+
+	if (!handler.buffer)
+		error = handler.error;
+
+	return handler.buffer;
+}
+
+/* Decodes sounds queued by SoundEmitter::preload()
+ * on a worker thread. Finished buffers are picked up
+ * into the cache on the next SoundEmitter call */
+struct SoundPreloader
+{
+	struct Job
+	{
+		std::string filename;
+		SoundBuffer *buffer;
+		std::string error;
+		bool done;
+	};
+
+	/* Both queued and finished jobs, in order */
+	std::deque<Job*> jobs;
+
+	SDL_Thread *thread;
+	SDL_mutex *mutex;
+	/* Signaled when jobs are queued, or on shutdown */
+	SDL_cond *jobCond;
+	/* Signaled whenever a job is done */
+	SDL_cond *doneCond;
+
+	const bool compact;
+	bool quit;
+
+	SoundPreloader(bool compact)
+	    : thread(0),
+	      compact(compact),
+	      quit(false)
+	{
+		mutex = SDL_CreateMutex();
+		jobCond = SDL_CreateCond();
+		doneCond = SDL_CreateCond();
+	}
+
+	~SoundPreloader()
+	{
+		SDL_LockMutex(mutex);
+		quit = true;
+		SDL_CondSignal(jobCond);
+		SDL_UnlockMutex(mutex);
+
+		if (thread)
+			SDL_WaitThread(thread, 0);
+
+		for (size_t i = 0; i < jobs.size(); ++i)
+		{
+			if (jobs[i]->buffer)
+				SoundBuffer::deref(jobs[i]->buffer);
+
+			delete jobs[i];
+		}
+
+		SDL_DestroyCond(doneCond);
+		SDL_DestroyCond(jobCond);
+		SDL_DestroyMutex(mutex);
+	}
+
+	/* Must be called with the mutex held */
+	Job *find(const std::string &filename)
+	{
+		for (size_t i = 0; i < jobs.size(); ++i)
+			if (jobs[i]->filename == filename)
+				return jobs[i];
+
+		return 0;
+	}
+
+	Job *nextQueued()
+	{
+		for (size_t i = 0; i < jobs.size(); ++i)
+			if (!jobs[i]->done)
+				return jobs[i];
+
+		return 0;
+	}
+
+	void request(const std::string &filename)
+	{
+		SDL_LockMutex(mutex);
+
+		if (!find(filename))
+		{
+			Job *job = new Job;
+			job->filename = filename;
+			job->buffer = 0;
+			job->done = false;
+			jobs.push_back(job);
+
+			/* The thread is only spawned once it's needed */
+			if (!thread)
+				thread = createSDLThread
+					<SoundPreloader, &SoundPreloader::work>(this, "se_preload");
+
+			SDL_CondSignal(jobCond);
+		}
+
+		SDL_UnlockMutex(mutex);
+	}
+
+	/* Removes and returns the job for 'filename', waiting for it
+	 * to finish if necessary. Returns null if there is none */
+	Job *take(const std::string &filename)
+	{
+		SDL_LockMutex(mutex);
+
+		Job *job = find(filename);
+
+		if (job)
+		{
+			while (!job->done)
+				SDL_CondWait(doneCond, mutex);
+
+			remove(job);
+		}
+
+		SDL_UnlockMutex(mutex);
+
+		return job;
+	}
+
+	/* Removes all finished jobs into 'out' */
+	void takeFinished(std::vector<Job*> &out)
+	{
+		SDL_LockMutex(mutex);
+
+		for (size_t i = 0; i < jobs.size();)
+		{
+			if (jobs[i]->done)
+			{
+				out.push_back(jobs[i]);
+				jobs.erase(jobs.begin() + i);
+			}
+			else
+			{
+				++i;
+			}
+		}
+
+		SDL_UnlockMutex(mutex);
+	}
+
+	void remove(Job *job)
+	{
+		for (size_t i = 0; i < jobs.size(); ++i)
+			if (jobs[i] == job)
+			{
+				jobs.erase(jobs.begin() + i);
+				return;
+			}
+	}
+
+	void work()
+	{
+		IOScheduler::setThreadPriority(IOScheduler::Visible);
+
+		SDL_LockMutex(mutex);
+
+		while (true)
+		{
+			Job *job;
+
+			while (!quit && !(job = nextQueued()))
+				SDL_CondWait(jobCond, mutex);
+
+			if (quit)
+				break;
+
+			/* The job stays in the list (and is only
+			 * taken once done), so it is safe to use */
+			std::string filename = job->filename;
+
+			SDL_UnlockMutex(mutex);
+
+			std::string error;
+			SoundBuffer *buffer = decodeSound(filename, compact, error);
+
+			SDL_LockMutex(mutex);
+
+			job->buffer = buffer;
+			job->error = error;
+			job->done = true;
+
+			SDL_CondBroadcast(doneCond);
+		}
+
+		SDL_UnlockMutex(mutex);
+	}
+};
+
 SoundEmitter::SoundEmitter(const Config &conf)
     : bufferBytes(0),
+      bufferBudget(conf.SE.cacheBudget),
+      hits(0),
+      misses(0),
       srcCount(conf.SE.sourceCount),
       alSrcs(srcCount),
       atchBufs(srcCount),
-      srcPrio(srcCount)
+      srcPrio(srcCount),
+      srcImportance(srcCount, 0),
+      defaultVoiceLimit(conf.SE.voiceLimit)
 {
 	for (size_t i = 0; i < srcCount; ++i)
 	{
@@ -101,10 +412,14 @@ SoundEmitter::SoundEmitter(const Config &conf)
 		atchBufs[i] = 0;
 		srcPrio[i] = i;
 	}
+
+	preloader = new SoundPreloader(conf.SE.compactStorage);
 }
 
 SoundEmitter::~SoundEmitter()
 {
+	delete preloader;
+
 	for (size_t i = 0; i < srcCount; ++i)
 	{
 		AL::Source::stop(alSrcs[i]);
@@ -131,22 +446,55 @@ void SoundEmitter::play(const std::string &filename,
 	if (!buffer)
 		return;
 
+	Rule rule;
+	rule.voiceLimit = defaultVoiceLimit;
+	rule.priority = 0;
+	rule = rules.value(filename, rule);
+
+	std::vector<bool> playing(srcCount);
+	size_t i = srcCount;
+	int copies = 0;
+
+	for (size_t j = 0; j < srcCount; ++j)
+	{
+		size_t k = srcPrio[j];
+		playing[j] = (AL::Source::getState(alSrcs[k]) == AL_PLAYING);
+
+		if (playing[j] && atchBufs[k] == buffer)
+			++copies;
+	}
+
+	/* Over the limit, restart the oldest copy of this sound
+	 * instead of adding yet another one to the mix */
+	if (rule.voiceLimit > 0 && copies >= rule.voiceLimit)
+		for (size_t j = 0; j < srcCount && i == srcCount; ++j)
+			if (playing[j] && atchBufs[srcPrio[j]] == buffer)
+				i = j;
+
 	/* Try to find first free source */
-	size_t i;
-	for (i = 0; i < srcCount; ++i)
-		if (AL::Source::getState(alSrcs[srcPrio[i]]) != AL_PLAYING)
-			break;
+	for (size_t j = 0; j < srcCount && i == srcCount; ++j)
+		if (!playing[j])
+			i = j;
 
-	/* If we didn't find any, try to find the lowest priority source
-	 * with the same buffer to overtake */
+	/* If we didn't find any, overtake the sound with the lowest
+	 * priority, the oldest one among equals. Never cut off
+	 * sounds more important than this one */
 	if (i == srcCount)
+	{
 		for (size_t j = 0; j < srcCount; ++j)
-			if (atchBufs[srcPrio[j]] == buffer)
+		{
+			int imp = srcImportance[srcPrio[j]];
+
+			if (imp > rule.priority)
+				continue;
+
+			if (i == srcCount || imp < srcImportance[srcPrio[i]])
 				i = j;
+		}
 
-	/* If we didn't find any, overtake the one with lowest priority */
-	if (i == srcCount)
-		i = 0;
+		if (i == srcCount)
+			return;
+	}
 
 	size_t srcIndex = srcPrio[i];
 
@@ -168,6 +516,7 @@ void SoundEmitter::play(const std::string &filename,
 		SoundBuffer::deref(old);
 
 	atchBufs[srcIndex] = SoundBuffer::ref(buffer);
+	srcImportance[srcIndex] = rule.priority;
 
 	if (switchBuffer)
 		AL::Source::attachBuffer(src, buffer->alBuffer);
@@ -184,46 +533,116 @@ void SoundEmitter::stop()
 		AL::Source::stop(alSrcs[i]);
 }
 
-struct SoundOpenHandler : FileSystem::OpenHandler
+void SoundEmitter::setRule(const std::string &filename, int voiceLimit, int priority)
 {
-	SoundBuffer *buffer;
+	Rule rule;
+	rule.voiceLimit = std::max(voiceLimit, 0);
+	rule.priority = priority;
 
-	SoundOpenHandler()
-	    : buffer(0)
-	{}
+	rules.insert(filename, rule);
+}
 
-	bool tryRead(SDL_RWops &ops, const char *ext)
+void SoundEmitter::preload(const std::string &filename)
+{
+	collectPreloaded();
+
+	if (bufferHash.contains(filename))
+		return;
+
+	preloader->request(filename);
+}
+
+SoundEmitter::Stats SoundEmitter::stats()
+{
+	collectPreloaded();
+
+	Stats stats;
+	stats.bytes = bufferBytes;
+	stats.budget = bufferBudget;
+	stats.hits = hits;
+	stats.misses = misses;
+
+	BufferHash::const_iterator iter;
+	for (iter = bufferHash.cbegin(); iter != bufferHash.cend(); ++iter)
+		stats.entries.push_back(std::make_pair(iter->first, iter->second->hits));
+
+	return stats;
+}
+
+void SoundEmitter::collectPreloaded()
+{
+	std::vector<SoundPreloader::Job*> finished;
+	preloader->takeFinished(finished);
+
+	for (size_t i = 0; i < finished.size(); ++i)
 	{
-		Sound_Sample *sample = Sound_NewSample(&ops, ext, 0, STREAM_BUF_SIZE);
+		SoundPreloader::Job *job = finished[i];
 
-		if (!sample)
+		if (!job->buffer)
 		{
-			SDL_RWclose(&ops);
-			return false;
+			char buf[512];
+			snprintf(buf, sizeof(buf), "Unable to preload sound: %s: %s",
+			         job->filename.c_str(), job->error.c_str());
+			Debug() << buf;
+		}
+		else if (bufferHash.contains(job->filename))
+		{
+			/* Was loaded synchronously in the meantime */
+			SoundBuffer::deref(job->buffer);
+		}
+		else
+		{
+			job->buffer->key = job->filename;
+			insertBuffer(job->buffer);
 		}
 
-		/* Do all of the decoding in the handler so we don't have
-		 * to keep the source ops around */
-		uint32_t decBytes = Sound_DecodeAll(sample);
-		uint8_t sampleSize = formatSampleSize(sample->actual.format);
-		uint32_t sampleCount = decBytes / sampleSize;
+		delete job;
+	}
+}
 
-		buffer = new SoundBuffer;
-		buffer->bytes = sampleSize * sampleCount;
+void SoundEmitter::trim()
+{
+	collectPreloaded();
 
-		ALenum alFormat = chooseALFormat(sampleSize, sample->actual.channels);
+	while (!buffers.isEmpty())
+	{
+		SoundBuffer *last = buffers.tail();
+		bufferHash.remove(last->key);
+		buffers.remove(last->link);
 
-		AL::Buffer::uploadData(buffer->alBuffer, alFormat, sample->buffer,
-							   buffer->bytes, sample->actual.rate);
+		bufferBytes -= last->bytes;
 
-		Sound_FreeSample(sample);
+		SoundBuffer::deref(last);
+	}
+}
 
-		return true;
+void SoundEmitter::insertBuffer(SoundBuffer *buffer)
+{
+	uint32_t wouldBeBytes = bufferBytes + buffer->bytes;
+
+	/* If memory limit is reached, delete lowest priority buffer
+	 * until there is room or no buffers left */
+	while (wouldBeBytes > bufferBudget && !buffers.isEmpty())
+	{
+		SoundBuffer *last = buffers.tail();
+		bufferHash.remove(last->key);
+		buffers.remove(last->link);
+
+		wouldBeBytes -= last->bytes;
+
+		SoundBuffer::deref(last);
 	}
-};
+
+	bufferHash.insert(buffer->key, buffer);
+	buffers.prepend(buffer->link);
+
+	bufferBytes = wouldBeBytes;
+}
 
 SoundBuffer *SoundEmitter::allocateBuffer(const std::string &filename)
 {
+	collectPreloaded();
+
 	SoundBuffer *buffer = bufferHash.value(filename, 0);
 
 	if (buffer)
@@ -233,45 +652,43 @@ SoundBuffer *SoundEmitter::allocateBuffer(const std::string &filename)
 		buffers.remove(buffer->link);
 		buffers.append(buffer->link);
 
+		++hits;
+		++buffer->hits;
+
 		return buffer;
 	}
 	else
 	{
-		/* Buffer not in cache, needs to be loaded */
-		SoundOpenHandler handler;
-		shState->fileSystem().openRead(handler, filename.c_str());
-		buffer = handler.buffer;
+		++misses;
+
+		/* Buffer not in cache, needs to be loaded,
+		 * unless it's already being preloaded */
+		std::string error;
+		SoundPreloader::Job *job = preloader->take(filename);
+
+		if (job)
+		{
+			buffer = job->buffer;
+			error = job->error;
+			delete job;
+		}
+		else
+		{
+			buffer = decodeSound(filename, preloader->compact, error);
+		}
 
 		if (!buffer)
 		{
 			char buf[512];
 			snprintf(buf, sizeof(buf), "Unable to decode sound: %s: %s",
-			         filename.c_str(), Sound_GetError());
+			         filename.c_str(), error.c_str());
 			Debug() << buf;
 
 			return 0;
 		}
 
 		buffer->key = filename;
-		uint32_t wouldBeBytes = bufferBytes + buffer->bytes;
-
-		/* If memory limit is reached, delete lowest priority buffer
-		 * until there is room or no buffers left */
-		while (wouldBeBytes > SE_CACHE_MEM && !buffers.isEmpty())
-		{
-			SoundBuffer *last = buffers.tail();
-			bufferHash.remove(last->key);
-			buffers.remove(last->link);
-
-			wouldBeBytes -= last->bytes;
-
-			SoundBuffer::deref(last);
-		}
-
-		bufferHash.insert(filename, buffer);
-		buffers.prepend(buffer->link);
-
-		bufferBytes = wouldBeBytes;
+		insertBuffer(buffer);
 
 		return buffer;
 	}
@@ -30,6 +30,7 @@
 #include <vector>
 
 struct SoundBuffer;
+struct SoundPreloader;
 struct Config;
 
 struct SoundEmitter
@@ -41,6 +42,9 @@ struct SoundEmitter
 
 	/* Byte count sum of all cached / playing buffers */
 	uint32_t bufferBytes;
+	const uint32_t bufferBudget;
+
+	uint32_t hits, misses;
 
 	const size_t srcCount;
 	std::vector<AL::Source::ID> alSrcs;
@@ -49,6 +53,21 @@ struct SoundEmitter
 	/* Indices of sources, sorted by priority (lowest first) */
 	std::vector<size_t> srcPrio;
 
+	/* Priority of the sound each source last played */
+	std::vector<int> srcImportance;
+
+	/* Limits how many copies of a sound may play at once, and which
+	 * sounds it may take a source from once all of them are busy */
+	struct Rule
+	{
+		/* 0 means unlimited */
+		int voiceLimit;
+		int priority;
+	};
+
+	BoostHash<std::string, Rule> rules;
+	const int defaultVoiceLimit;
+
 	SoundEmitter(const Config &conf);
 	~SoundEmitter();
 
@@ -58,8 +77,37 @@ struct SoundEmitter
 
 	void stop();
 
+	/* Drops all cached buffers; those still
+	 * playing are freed once they finish */
+	void trim();
+
+	/* Sets the rule for sounds played as 'filename' */
+	void setRule(const std::string &filename, int voiceLimit, int priority);
+
+	/* Queues 'filename' for decoding in the background,
+	 * so its first play() doesn't have to wait for it */
+	void preload(const std::string &filename);
+
+	struct Stats
+	{
+		uint32_t bytes;
+		uint32_t budget;
+
+		uint32_t hits;
+		uint32_t misses;
+
+		/* Cached sounds with their hit counts */
+		std::vector<std::pair<std::string, uint32_t> > entries;
+	};
+
+	Stats stats();
+
 private:
 	SoundBuffer *allocateBuffer(const std::string &filename);
+	void insertBuffer(SoundBuffer *buffer);
+	void collectPreloaded();
+
+	SoundPreloader *preloader;
 };
 
 #endif // SOUNDEMITTER_H
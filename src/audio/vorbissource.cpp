@@ -21,11 +21,17 @@
 
 #include "aldatasource.h"
 #include "exception.h"
+#include "resampler.h"
 
 #define OV_EXCLUDE_STATIC_CALLBACKS
 #include <vorbis/vorbisfile.h>
 #include <vector>
 #include <algorithm>
+#include <string.h>
+
+/* Length of the decoded audio kept around from the
+ * loop start on, so wrapping around needs no seek */
+#define LOOP_HEAD_MS 500
 
 static size_t vfRead(void *ptr, size_t size, size_t nmemb, void *ops)
 {
@@ -68,6 +74,26 @@ struct VorbisSource : ALDataSource
 		bool requested;
 	} loop;
 
+	/* The first frames after the loop start. On loop end, these
+	 * are served from memory, and the decoder only has to seek
+	 * past them in the following fillBuffer() */
+	struct
+	{
+		std::vector<int16_t> samples;
+		uint32_t frames;
+
+		/* Frames already served since the last wrap
+		 * around, while serving from the cache */
+		uint32_t pos;
+		bool serving;
+
+		/* The decoder still has to seek behind the cache */
+		bool seekPending;
+
+		/* Cache frames in the buffer that wrapped last */
+		uint32_t wrapFrames;
+	} loopHead;
+
 	struct
 	{
 		int channels;
@@ -78,10 +104,16 @@ struct VorbisSource : ALDataSource
 
 	std::vector<int16_t> sampleBuf;
 
+	/* Null if the output stays at the source rate */
+	Resampler *resampler;
+	std::vector<int16_t> resampled;
+
 	VorbisSource(SDL_RWops &ops,
+	             uint32_t bufSize,
 	             bool looped)
 	    : src(ops),
-	      currentFrame(0)
+	      currentFrame(0),
+	      resampler(0)
 	{
 		int error = ov_open_callbacks(&src, &vf, 0, 0, OvCallbacks);
 
@@ -107,7 +139,11 @@ struct VorbisSource : ALDataSource
 		info.alFormat = chooseALFormat(sizeof(int16_t), info.channels);
 		info.frameSize = sizeof(int16_t) * info.channels;
 
-		sampleBuf.resize(STREAM_BUF_SIZE);
+		if (Resampler::wanted(info.rate))
+			resampler = new Resampler(info.channels, info.rate,
+			                          Resampler::deviceRate());
+
+		sampleBuf.resize(bufSize);
 
 		loop.requested = looped;
 		loop.valid = false;
@@ -143,21 +179,100 @@ struct VorbisSource : ALDataSource
 
 		loop.end = loop.start + loop.length;
 		loop.valid = (loop.start && loop.length);
+
+		loopHead.frames = 0;
+		loopHead.pos = 0;
+		loopHead.serving = false;
+		loopHead.seekPending = false;
+		loopHead.wrapFrames = 0;
+
+		if (loop.valid)
+			fillLoopHead();
+	}
+
+	void fillLoopHead()
+	{
+		const uint32_t frames =
+			std::min<uint32_t>(loop.length, (uint64_t) info.rate * LOOP_HEAD_MS / 1000);
+
+		if (ov_pcm_seek(&vf, loop.start) != 0)
+		{
+			ov_raw_seek(&vf, 0);
+			return;
+		}
+
+		std::vector<int16_t> &samples = loopHead.samples;
+		samples.resize(frames * info.channels);
+
+		const size_t bytes = samples.size() * sizeof(int16_t);
+		size_t read = 0;
+
+		while (read < bytes)
+		{
+			long res = ov_read(&vf, reinterpret_cast<char*>(samples.data()) + read,
+			                   bytes - read, 0, sizeof(int16_t), 1, 0);
+
+			if (res <= 0)
+				break;
+
+			read += res;
+		}
+
+		loopHead.frames = read / info.frameSize;
+		samples.resize(loopHead.frames * info.channels);
+
+		ov_raw_seek(&vf, 0);
+	}
+
+	/* Copies cached loop head frames to the end of the
+	 * buffer. Returns the number of samples added */
+	int serveLoopHead(int bufUsed)
+	{
+		const uint32_t space = (sampleBuf.size() - bufUsed) / info.channels;
+		const uint32_t count = std::min(space, loopHead.frames - loopHead.pos);
+
+		memcpy(&sampleBuf[bufUsed], &loopHead.samples[loopHead.pos * info.channels],
+		       count * info.frameSize);
+
+		loopHead.pos += count;
+		currentFrame += count;
+
+		if (loopHead.pos == loopHead.frames)
+		{
+			loopHead.serving = false;
+			loopHead.seekPending = true;
+		}
+
+		return count * info.channels;
 	}
 
 	~VorbisSource()
 	{
+		delete resampler;
 		ov_clear(&vf);
 		SDL_RWclose(&src);
 	}
 
 	int sampleRate()
 	{
-		return info.rate;
+		return resampler ? resampler->outputRate() : info.rate;
 	}
 
 	void seekToOffset(float seconds)
 	{
+		if (resampler)
+			resampler->reset();
+
+		seekDecoder(seconds);
+	}
+
+	/* Unlike seekToOffset, keeps the resampler history
+	 * so wrapping around stays seamless */
+	void seekDecoder(float seconds)
+	{
+		loopHead.serving = false;
+		loopHead.seekPending = false;
+
 		if (seconds <= 0)
 		{
 			ov_raw_seek(&vf, 0);
@@ -186,6 +301,25 @@ struct VorbisSource : ALDataSource
 
 		bool readAgain = false;
 
+		if (loopHead.serving)
+		{
+			/* Still behind the last wrap around */
+			bufUsed = serveLoopHead(0);
+
+			/* Delay the seek to the next buffer */
+			upload(alBuffer, bufUsed);
+
+			return retStatus;
+		}
+
+		if (loopHead.seekPending)
+		{
+			loopHead.seekPending = false;
+
+			if (ov_pcm_seek(&vf, loop.start + loopHead.frames) != 0)
+				return ALDataSource::Error;
+		}
+
 		if (loop.valid)
 		{
 			int tilLoopEnd = loop.end * info.frameSize;
@@ -212,7 +346,7 @@ struct VorbisSource : ALDataSource
 				if (loop.requested)
 				{
 					retStatus = ALDataSource::WrapAround;
-					seekToOffset(0);
+					seekDecoder(0);
 				}
 				else
 				{
@@ -249,9 +383,22 @@ struct VorbisSource : ALDataSource
 				bufUsed -= discardFrames * info.channels;
 
 				retStatus = ALDataSource::WrapAround;
+				currentFrame = loop.start;
+
+				if (loopHead.frames > 0)
+				{
+					/* Continue right after the loop point */
+					loopHead.pos = 0;
+					loopHead.serving = true;
+
+					int served = serveLoopHead(bufUsed);
+					bufUsed += served;
+					loopHead.wrapFrames = served / info.channels;
+
+					break;
+				}
 
 				/* Seek to loop start */
-				currentFrame = loop.start;
 				if (ov_pcm_seek(&vf, currentFrame) != 0)
 					retStatus = ALDataSource::Error;
 
@@ -262,18 +409,37 @@ struct VorbisSource : ALDataSource
 		}
 
 		if (retStatus != ALDataSource::Error)
-			AL::Buffer::uploadData(alBuffer, info.alFormat, sampleBuf.data(),
-			                       bufUsed*sizeof(int16_t), info.rate);
+			upload(alBuffer, bufUsed);
 
 		return retStatus;
 	}
 
+	/* Uploads the first 'samples' of 'sampleBuf' */
+	void upload(AL::Buffer::ID alBuffer, int samples)
+	{
+		if (!resampler)
+		{
+			AL::Buffer::uploadData(alBuffer, info.alFormat, sampleBuf.data(),
+			                       samples*sizeof(int16_t), info.rate);
+			return;
+		}
+
+		resampled.clear();
+		resampler->process(sampleBuf.data(), samples / info.channels, resampled);
+
+		AL::Buffer::uploadData(alBuffer, info.alFormat, resampled.data(),
+		                       resampled.size()*sizeof(int16_t), resampler->outputRate());
+	}
+
 	uint32_t loopStartFrames()
 	{
-		if (loop.valid)
-			return loop.start;
-		else
+		/* The wrapping buffer may also hold frames past the loop start */
+		if (!loop.valid)
 			return 0;
+
+		uint32_t frames = loop.start + loopHead.wrapFrames;
+
+		return resampler ? resampler->toOutputFrames(frames) : frames;
 	}
 
 	bool setPitch(float)
@@ -283,7 +449,8 @@ struct VorbisSource : ALDataSource
 };
 
 ALDataSource *createVorbisSource(SDL_RWops &ops,
+                                 uint32_t bufSize,
                                  bool looped)
 {
-	return new VorbisSource(ops, looped);
+	return new VorbisSource(ops, bufSize, looped);
 }
@@ -10,6 +10,7 @@
 #include <assert.h>
 
 #include <stdint.h>
+#include <algorithm>
 #include <vector>
 
 #include "filesystem/filesystem.h"
@@ -84,6 +85,11 @@ bool copyObject(json::value &dest, json::value &src, const char *objectName = ""
     return true;
 }
 
+/* Whether either config file sets 'key' */
+static bool confHasKey(json::value &base, json::value &user, const char *key) {
+    return base.as_object().count(key) || user.as_object().count(key);
+}
+
 bool getEnvironmentBool(const char *env, bool defaultValue) {
     const char *e = SDL_getenv(env);
     if (!e)
@@ -130,6 +136,7 @@ void Config::read(int argc, char *argv[]) {
         {"rgssVersion", 0},
         {"debugMode", false},
         {"printFPS", false},
+        {"printStartupTimes", false},
         {"winResizable", true},
         {"fullscreen", false},
         {"fixedAspectRatio", true},
@@ -141,7 +148,10 @@ void Config::read(int argc, char *argv[]) {
         {"windowTitle", ""},
         {"fixedFramerate", 0},
         {"frameSkip", false},
+        {"frameSkipMax", 4},
         {"syncToRefreshrate", false},
+        {"backgroundFramerate", 0},
+        {"frameInterpolation", false},
         {"solidFonts", json::array({})},
 #if defined(__APPLE__) && defined(__aarch64__)
         {"preferMetalRenderer", true},
@@ -154,9 +164,35 @@ void Config::read(int argc, char *argv[]) {
 #else
         {"enableBlitting", true},
 #endif
+        {"spriteBatching", true},
+        {"imageCache", false},
+        {"textureAtlas", false},
+        {"textureCompression", false},
+        {"frameProfiler", false},
+        {"bitmapTracker", false},
+        {"gpuTilemap", false},
+        {"tilemapDepth", false},
+        {"streamMegaSurfaces", false},
+        {"damageTracking", false},
+        {"dynamicResolution", 0},
+        {"deferPresent", false},
+        {"inputLateLatch", false},
+        {"inputRecord", ""},
+        {"inputReplay", ""},
+        {"replayReport", ""},
+        {"headless", false},
         {"integerScalingActive", false},
         {"integerScalingLastMile", true},
         {"maxTextureSize", 0},
+        {"textureUploadBudget", 0},
+        {"mipmapZoom", 0},
+        {"textureReduction", 0},
+        {"sharedUploadContext", false},
+        {"texPoolBitmapBudget", 20},
+        {"texPoolIntermediateBudget", 10},
+        {"texPoolAtlasBudget", 0},
+        {"memoryBudget", 0},
+        {"rpgCacheBudget", 128},
         {"gameFolder", ""},
         {"anyAltToggleFS", false},
         {"enableReset", true},
@@ -169,11 +205,38 @@ void Config::read(int argc, char *argv[]) {
         {"midiSoundFont", ""},
         {"midiChorus", false},
         {"midiReverb", false},
+        {"midiRenderAhead", 250},
+        {"midiCpuCores", 1},
         {"SESourceCount", 6},
+        {"SEVoiceLimit", 0},
+        {"SECacheBudget", 10},
+        {"SECompactStorage", false},
         {"BGMTrackCount", 1},
+        {"BGMStreamBuffers", 3},
+        {"BGMStreamBufferSize", 32768},
+        {"BGSStreamBuffers", 3},
+        {"BGSStreamBufferSize", 32768},
+        {"BGSStaticLoop", 10},
+        {"MEStreamBuffers", 3},
+        {"MEStreamBufferSize", 32768},
+        {"resampleAudio", false},
+        {"audioFrequency", 0},
+        {"audioPeriodSize", 0},
+        {"audioLowLatency", false},
         {"customScript", ""},
         {"pathCache", true},
+        {"readAhead", 64},
+        {"mapFiles", true},
+        {"archiveCache", 16},
+        {"dataCache", 0},
+        {"ioLoadBandwidth", 0},
+        {"ioPrefetchBandwidth", 0},
         {"useScriptNames", 1},
+        {"scriptCache", false},
+        {"shaderCache", true},
+        {"gpuProfile", true},
+        {"httpCache", true},
+        {"shaderPrewarm", json::array({})},
         {"preloadScript", json::array({})},
         {"RTP", json::array({})},
         {"fontSub", json::array({})},
@@ -183,6 +246,17 @@ void Config::read(int argc, char *argv[]) {
         {"JITMaxCache", 100},
         {"JITMinCalls", 10000},
         {"YJITEnable", false},
+        {"YJITExecMemSize", 0},
+        {"YJITCallThreshold", 0},
+        {"YJITStats", false},
+        {"GCHeapInitSlots", 0},
+        {"GCHeapFreeSlots", 0},
+        {"GCHeapGrowthFactor", 0},
+        {"GCHeapGrowthMaxSlots", 0},
+        {"GCMallocLimit", 0},
+        {"GCOldMallocLimit", 0},
+        {"GCIdleCollect", false},
+        {"GCIdleMinTime", 4},
         {"bindingNames", json::object({
             {"a", "A"},
             {"b", "B"},
@@ -230,11 +304,28 @@ try { exp } catch (...) {}
     SET_STRINGOPT(execName, execName);
     SET_OPT(allowSymlinks, boolean);
     SET_OPT(pathCache, boolean);
+    SET_OPT(readAhead, integer);
+    SET_OPT(mapFiles, boolean);
+    SET_OPT(archiveCache, integer);
+    SET_OPT(dataCache, integer);
+    SET_OPT_CUSTOMKEY(ioBandwidth.visible, ioLoadBandwidth, integer);
+    SET_OPT_CUSTOMKEY(ioBandwidth.speculative, ioPrefetchBandwidth, integer);
     SET_OPT_CUSTOMKEY(jit.enabled, JITEnable, boolean);
     SET_OPT_CUSTOMKEY(jit.verboseLevel, JITVerboseLevel, integer);
     SET_OPT_CUSTOMKEY(jit.maxCache, JITMaxCache, integer);
     SET_OPT_CUSTOMKEY(jit.minCalls, JITMinCalls, integer);
     SET_OPT_CUSTOMKEY(yjit.enabled, YJITEnable, boolean);
+    SET_OPT_CUSTOMKEY(yjit.execMemSize, YJITExecMemSize, integer);
+    SET_OPT_CUSTOMKEY(yjit.callThreshold, YJITCallThreshold, integer);
+    SET_OPT_CUSTOMKEY(yjit.stats, YJITStats, boolean);
+    SET_OPT_CUSTOMKEY(gc.heapInitSlots, GCHeapInitSlots, integer);
+    SET_OPT_CUSTOMKEY(gc.heapFreeSlots, GCHeapFreeSlots, integer);
+    SET_OPT_CUSTOMKEY(gc.heapGrowthFactor, GCHeapGrowthFactor, number);
+    SET_OPT_CUSTOMKEY(gc.heapGrowthMaxSlots, GCHeapGrowthMaxSlots, integer);
+    SET_OPT_CUSTOMKEY(gc.mallocLimit, GCMallocLimit, integer);
+    SET_OPT_CUSTOMKEY(gc.oldMallocLimit, GCOldMallocLimit, integer);
+    SET_OPT_CUSTOMKEY(gc.idleCollect, GCIdleCollect, boolean);
+    SET_OPT_CUSTOMKEY(gc.idleMinTime, GCIdleMinTime, integer);
     SET_OPT(rgssVersion, integer);
     SET_OPT(defScreenW, integer);
     SET_OPT(defScreenH, integer);
@@ -251,10 +342,15 @@ try { exp } catch (...) {}
     json::value userConf = readConfFile(userConfPath.c_str());
     copyObject(optsJ, userConf);
     
+    profileDefaults.smoothScaling = !confHasKey(baseConf, userConf, "smoothScaling");
+    profileDefaults.lanczos3Scaling = !confHasKey(baseConf, userConf, "lanczos3Scaling");
+    profileDefaults.frameSkip = !confHasKey(baseConf, userConf, "frameSkip");
+    
     // now RESUME
     
     SET_OPT(debugMode, boolean);
     SET_OPT(printFPS, boolean);
+    SET_OPT(printStartupTimes, boolean);
     SET_OPT(fullscreen, boolean);
     SET_OPT(fixedAspectRatio, boolean);
     SET_OPT(smoothScaling, boolean);
@@ -264,26 +360,76 @@ try { exp } catch (...) {}
     SET_STRINGOPT(windowTitle, windowTitle);
     SET_OPT(fixedFramerate, integer);
     SET_OPT(frameSkip, boolean);
+    SET_OPT(frameSkipMax, integer);
     SET_OPT(syncToRefreshrate, boolean);
+    SET_OPT(backgroundFramerate, integer);
+    SET_OPT(frameInterpolation, boolean);
     fillStringVec(opts["solidFonts"], solidFonts);
 #ifdef __APPLE__
     SET_OPT(preferMetalRenderer, boolean);
 #endif
     SET_OPT(subImageFix, boolean);
     SET_OPT(enableBlitting, boolean);
+    SET_OPT(spriteBatching, boolean);
+    SET_OPT(imageCache, boolean);
+    SET_OPT(textureAtlas, boolean);
+    SET_OPT(textureCompression, boolean);
+    SET_OPT(frameProfiler, boolean);
+    SET_OPT(bitmapTracker, boolean);
+    SET_OPT(gpuTilemap, boolean);
+    SET_OPT(tilemapDepth, boolean);
+    SET_OPT(streamMegaSurfaces, boolean);
+    SET_OPT(damageTracking, boolean);
+    SET_OPT(dynamicResolution, integer);
+    SET_OPT(deferPresent, boolean);
+    SET_OPT(inputLateLatch, boolean);
+    SET_STRINGOPT(inputRecord, inputRecord);
+    SET_STRINGOPT(inputReplay, inputReplay);
+    SET_STRINGOPT(replayReport, replayReport);
+    SET_OPT(headless, boolean);
     SET_OPT_CUSTOMKEY(integerScaling.active, integerScalingActive, boolean);
     SET_OPT_CUSTOMKEY(integerScaling.lastMileScaling, integerScalingLastMile, boolean);
     SET_OPT(maxTextureSize, integer);
+    SET_OPT(textureUploadBudget, integer);
+    SET_OPT(mipmapZoom, number);
+    SET_OPT(textureReduction, integer);
+    SET_OPT(sharedUploadContext, boolean);
+    SET_OPT_CUSTOMKEY(texPoolBudget.bitmaps, texPoolBitmapBudget, integer);
+    SET_OPT_CUSTOMKEY(texPoolBudget.intermediates, texPoolIntermediateBudget, integer);
+    SET_OPT_CUSTOMKEY(texPoolBudget.atlases, texPoolAtlasBudget, integer);
+    SET_OPT(memoryBudget, integer);
+    SET_OPT(rpgCacheBudget, integer);
     SET_OPT(anyAltToggleFS, boolean);
     SET_OPT(enableReset, boolean);
     SET_OPT(enableSettings, boolean);
     SET_STRINGOPT(midi.soundFont, midiSoundFont);
     SET_OPT_CUSTOMKEY(midi.chorus, midiChorus, boolean);
     SET_OPT_CUSTOMKEY(midi.reverb, midiReverb, boolean);
+    SET_OPT_CUSTOMKEY(midi.renderAhead, midiRenderAhead, integer);
+    SET_OPT_CUSTOMKEY(midi.cpuCores, midiCpuCores, integer);
     SET_OPT_CUSTOMKEY(SE.sourceCount, SESourceCount, integer);
+    SET_OPT_CUSTOMKEY(SE.voiceLimit, SEVoiceLimit, integer);
+    SET_OPT_CUSTOMKEY(SE.cacheBudget, SECacheBudget, integer);
+    SET_OPT_CUSTOMKEY(SE.compactStorage, SECompactStorage, boolean);
     SET_OPT_CUSTOMKEY(BGM.trackCount, BGMTrackCount, integer);
+    SET_OPT_CUSTOMKEY(BGM.streamBufs, BGMStreamBuffers, integer);
+    SET_OPT_CUSTOMKEY(BGM.streamBufSize, BGMStreamBufferSize, integer);
+    SET_OPT_CUSTOMKEY(BGS.streamBufs, BGSStreamBuffers, integer);
+    SET_OPT_CUSTOMKEY(BGS.streamBufSize, BGSStreamBufferSize, integer);
+    SET_OPT_CUSTOMKEY(BGS.staticLoop, BGSStaticLoop, integer);
+    SET_OPT_CUSTOMKEY(ME.streamBufs, MEStreamBuffers, integer);
+    SET_OPT_CUSTOMKEY(ME.streamBufSize, MEStreamBufferSize, integer);
+    SET_OPT(resampleAudio, boolean);
+    SET_OPT_CUSTOMKEY(audioDevice.frequency, audioFrequency, integer);
+    SET_OPT_CUSTOMKEY(audioDevice.periodSize, audioPeriodSize, integer);
+    SET_OPT_CUSTOMKEY(audioDevice.lowLatency, audioLowLatency, boolean);
     SET_STRINGOPT(customScript, customScript);
     SET_OPT(useScriptNames, boolean);
+    SET_OPT(scriptCache, boolean);
+    SET_OPT(shaderCache, boolean);
+    SET_OPT(gpuProfile, boolean);
+    SET_OPT(httpCache, boolean);
+    fillStringVec(opts["shaderPrewarm"], shaderPrewarm);
     
     fillStringVec(opts["preloadScript"], preloadScripts);
     fillStringVec(opts["RTP"], rtps);
@@ -303,8 +449,44 @@ try { exp } catch (...) {}
     BINDING_NAME(r);
     
     rgssVersion = clamp(rgssVersion, 0, 3);
+    readAhead = clamp(readAhead, 0, 16384);
+    archiveCache = clamp(archiveCache, 0, 1024);
+    dataCache = clamp(dataCache, 0, 1024) * 1024 * 1024;
+    ioBandwidth.visible = clamp(ioBandwidth.visible, 0, 1024 * 1024);
+    ioBandwidth.speculative = clamp(ioBandwidth.speculative, 0, 1024 * 1024);
+    rpgCacheBudget = clamp(rpgCacheBudget, 0, 4096);
+    mipmapZoom = clamp(mipmapZoom, 0.0, 1.0);
+    textureReduction = clamp(textureReduction, 0, 2);
+    yjit.execMemSize = clamp(yjit.execMemSize, 0, 2048);
+    yjit.callThreshold = std::max(yjit.callThreshold, 0);
+    gc.heapInitSlots = std::max(gc.heapInitSlots, 0);
+    gc.heapFreeSlots = std::max(gc.heapFreeSlots, 0);
+    gc.heapGrowthFactor = std::max(gc.heapGrowthFactor, 0.0);
+    gc.heapGrowthMaxSlots = std::max(gc.heapGrowthMaxSlots, 0);
+    gc.mallocLimit = clamp(gc.mallocLimit, 0, 4096);
+    gc.oldMallocLimit = clamp(gc.oldMallocLimit, 0, 4096);
+    gc.idleMinTime = clamp(gc.idleMinTime, 0, 1000);
     SE.sourceCount = clamp(SE.sourceCount, 1, 64);
+    SE.voiceLimit = clamp(SE.voiceLimit, 0, SE.sourceCount);
+    midi.renderAhead = clamp(midi.renderAhead, 0, 5000);
+    midi.cpuCores = clamp(midi.cpuCores, 1, 256);
+    SE.cacheBudget = clamp(SE.cacheBudget, 1, 1024) * 1024 * 1024;
     BGM.trackCount = clamp(BGM.trackCount, 1, 16);
+    BGM.streamBufs = clamp(BGM.streamBufs, 2, 16);
+    BGM.streamBufSize = clamp(BGM.streamBufSize, 4096, 1048576);
+    BGS.streamBufs = clamp(BGS.streamBufs, 2, 16);
+    BGS.streamBufSize = clamp(BGS.streamBufSize, 4096, 1048576);
+    BGS.staticLoop = clamp(BGS.staticLoop, 0, 60);
+    
+    if (audioDevice.frequency != 0)
+        audioDevice.frequency = clamp(audioDevice.frequency, 8000, 192000);
+    
+    if (audioDevice.periodSize != 0)
+        audioDevice.periodSize = clamp(audioDevice.periodSize, 64, 8192);
+    else if (audioDevice.lowLatency)
+        audioDevice.periodSize = 256;
+    ME.streamBufs = clamp(ME.streamBufs, 2, 16);
+    ME.streamBufSize = clamp(ME.streamBufSize, 4096, 1048576);
     
     // Determine whether to open a console window on... Windows
     winConsole = getEnvironmentBool("MKXPZ_WINDOWS_CONSOLE", editor.debug);
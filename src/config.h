@@ -38,6 +38,7 @@ struct Config {
     bool winConsole;
     bool preferMetalRenderer;
     bool printFPS;
+    bool printStartupTimes;
     
     bool winResizable;
     bool fullscreen;
@@ -52,19 +53,67 @@ struct Config {
     
     int fixedFramerate;
     bool frameSkip;
+    int frameSkipMax;
     bool syncToRefreshrate;
+    int backgroundFramerate;
+    bool frameInterpolation;
     
     std::vector<std::string> solidFonts;
     
     bool subImageFix;
     bool enableBlitting;
+    bool spriteBatching;
+    bool imageCache;
+    bool textureAtlas;
+    bool textureCompression;
+    bool frameProfiler;
+    bool bitmapTracker;
+    bool gpuTilemap;
+    bool tilemapDepth;
+    bool streamMegaSurfaces;
+    bool damageTracking;
+    int dynamicResolution;
+    bool deferPresent;
+    bool inputLateLatch;
+    std::string inputRecord;
+    std::string inputReplay;
+    std::string replayReport;
+    bool headless;
     int maxTextureSize;
+    int textureUploadBudget;
+    
+    /* Sprites and planes zoomed to this or less sample
+     * from mipmaps, flagged bitmaps or not; 0 disables */
+    double mipmapZoom;
+    
+    /* Images loaded from files kept at reduced precision:
+     * 0 none, 1 opaque ones (RGB565), 2 all (RGBA4444 for
+     * translucent ones) */
+    int textureReduction;
+    
+    /* Bitmaps loaded in the background are uploaded on
+     * a second GL context sharing objects with the main one */
+    bool sharedUploadContext;
     
     struct {
         bool active;
         bool lastMileScaling;
     } integerScaling;
     
+    /* In megabytes, 0 means unlimited for atlases */
+    struct {
+        int bitmaps;
+        int intermediates;
+        int atlases;
+    } texPoolBudget;
+    
+    /* In megabytes, 0 disables the check */
+    int memoryBudget;
+    
+    /* In megabytes, of bitmaps RPG::Cache holds on to;
+     * 0 means unlimited */
+    int rpgCacheBudget;
+    
     std::string gameFolder;
     bool manualFolderSelect;
     
@@ -73,6 +122,17 @@ struct Config {
     bool enableSettings;
     bool allowSymlinks;
     bool pathCache;
+    int readAhead;
+    bool mapFiles;
+    int archiveCache;
+    int dataCache;
+    
+    /* Bandwidth limits of background loads and prefetches,
+     * in KiB/s; 0 for none (see IOScheduler) */
+    struct {
+        int visible;
+        int speculative;
+    } ioBandwidth;
     
     std::string dataPathOrg;
     std::string dataPathApp;
@@ -85,17 +145,59 @@ struct Config {
         std::string soundFont;
         bool chorus;
         bool reverb;
+        int renderAhead;
+        int cpuCores;
     } midi;
     
     struct {
         int sourceCount;
+        int voiceLimit;
+        int cacheBudget;
+        bool compactStorage;
     } SE;
     
     struct {
         int trackCount;
+        int streamBufs;
+        int streamBufSize;
     } BGM;
     
+    struct {
+        int streamBufs;
+        int streamBufSize;
+        /* Seconds */
+        int staticLoop;
+    } BGS;
+    
+    struct {
+        int streamBufs;
+        int streamBufSize;
+    } ME;
+    
+    bool resampleAudio;
+    
+    struct {
+        /* 0 leaves these to OpenAL */
+        int frequency;
+        int periodSize;
+        bool lowLatency;
+    } audioDevice;
+    
     bool useScriptNames;
+    bool scriptCache;
+    bool shaderCache;
+    bool httpCache;
+    bool gpuProfile;
+    
+    /* Set for the options neither config file gives,
+     * so the GPU profile may pick them */
+    struct {
+        bool smoothScaling;
+        bool lanczos3Scaling;
+        bool frameSkip;
+    } profileDefaults;
+    
+    std::vector<std::string> shaderPrewarm;
     
     std::string customScript;
     
@@ -130,7 +232,28 @@ struct Config {
     // YJIT Options
     struct {
         bool enabled;
+        /* In MB, 0 for Ruby's default */
+        int execMemSize;
+        /* 0 for Ruby's default */
+        int callThreshold;
+        bool stats;
     } yjit;
+    
+    // Ruby GC options
+    struct {
+        int heapInitSlots;
+        int heapFreeSlots;
+        double heapGrowthFactor;
+        int heapGrowthMaxSlots;
+        /* In MB */
+        int mallocLimit;
+        int oldMallocLimit;
+        
+        /* Collect in the time left over before frames */
+        bool idleCollect;
+        /* In ms */
+        int idleMinTime;
+    } gc;
 
     // Keybinding action name mappings
     struct {
@@ -0,0 +1,231 @@
+/*
+** archivetoc.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "archivetoc.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+static uint32_t
+hashPath(const char *path)
+{
+	/* FNV-1a */
+	uint32_t hash = 0x811C9DC5;
+
+	for (; *path; ++path)
+		hash = (hash ^ (uint8_t) *path) * 0x01000193;
+
+	return hash;
+}
+
+void ArchiveToc::addFile(const char *path, uint32_t file)
+{
+	Item item;
+	item.path = path;
+	item.isFile = true;
+	item.file = file;
+
+	items.push_back(item);
+}
+
+void ArchiveToc::finish()
+{
+	/* Add every directory containing files, and the root */
+	const size_t fileCount = items.size();
+
+	Item dir;
+	dir.isFile = false;
+	dir.file = 0;
+
+	std::vector<Item> dirs(1, dir);
+
+	for (size_t i = 0; i < fileCount; ++i)
+	{
+		const std::string &path = items[i].path;
+
+		for (size_t pos = path.find('/'); pos != std::string::npos;
+		     pos = path.find('/', pos + 1))
+		{
+			dir.path = path.substr(0, pos);
+			dirs.push_back(dir);
+		}
+	}
+
+	items.insert(items.end(), dirs.begin(), dirs.end());
+
+	/* Stable, so the last of several files with the
+	 * same path wins, like it did with a map */
+	std::stable_sort(items.begin(), items.end(),
+	                 [](const Item &a, const Item &b) { return a.path < b.path; });
+
+	entries.clear();
+	names.clear();
+
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		const Item &item = items[i];
+
+		if (i > 0 && item.path == items[i-1].path)
+		{
+			Entry &prev = entries.back();
+
+			if (item.isFile)
+				prev.file = item.file;
+
+			prev.isFile |= item.isFile;
+			prev.isDir |= !item.isFile;
+
+			continue;
+		}
+
+		Entry entry;
+		size_t slash = item.path.rfind('/');
+
+		entry.nameOffset = names.size();
+		entry.baseOffset = (slash == std::string::npos) ? 0 : slash + 1;
+		entry.isFile = item.isFile;
+		entry.isDir = !item.isFile;
+		entry.file = item.file;
+		entry.firstChild = entry.childCount = 0;
+
+		names.insert(names.end(), item.path.begin(), item.path.end());
+		names.push_back('\0');
+		entries.push_back(entry);
+	}
+
+	std::vector<Item>().swap(items);
+
+	buildHash();
+	buildChildren();
+}
+
+void ArchiveToc::buildHash()
+{
+	size_t size = 16;
+
+	while (size < entries.size() * 2)
+		size *= 2;
+
+	slots.assign(size, 0);
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		size_t slot = hashPath(path(entries[i])) & (size - 1);
+
+		while (slots[slot])
+			slot = (slot + 1) & (size - 1);
+
+		slots[slot] = i + 1;
+	}
+}
+
+/* Siblings end up in path order, as the entries are sorted */
+void ArchiveToc::buildChildren()
+{
+	std::vector<uint32_t> parents(entries.size());
+
+	for (size_t i = 1; i < entries.size(); ++i)
+	{
+		const Entry &entry = entries[i];
+
+		if (entry.baseOffset > 0)
+		{
+			std::string parent(path(entry), entry.baseOffset - 1);
+			parents[i] = find(parent.c_str()) - &entries[0];
+		}
+
+		entries[parents[i]].childCount++;
+	}
+
+	uint32_t first = 0;
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		entries[i].firstChild = first;
+		first += entries[i].childCount;
+		entries[i].childCount = 0;
+	}
+
+	children.resize(first);
+
+	for (size_t i = 1; i < entries.size(); ++i)
+	{
+		Entry &parent = entries[parents[i]];
+		children[parent.firstChild + parent.childCount++] = i;
+	}
+}
+
+const ArchiveToc::Entry *ArchiveToc::find(const char *filename) const
+{
+	if (slots.empty())
+		return 0;
+
+	const size_t mask = slots.size() - 1;
+
+	for (size_t i = hashPath(filename) & mask; slots[i]; i = (i + 1) & mask)
+	{
+		const Entry &entry = entries[slots[i] - 1];
+
+		if (!strcmp(path(entry), filename))
+			return &entry;
+	}
+
+	return 0;
+}
+
+PHYSFS_EnumerateCallbackResult
+ArchiveToc::enumerate(const char *dirname, PHYSFS_EnumerateCallback cb,
+                      const char *origdir, void *callbackdata) const
+{
+	const Entry *dir = find(dirname);
+
+	if (!dir || !dir->isDir)
+		return PHYSFS_ENUM_STOP;
+
+	for (uint32_t i = 0; i < dir->childCount; ++i)
+	{
+		const Entry &entry = entries[children[dir->firstChild + i]];
+		cb(callbackdata, origdir, path(entry) + entry.baseOffset);
+	}
+
+	return PHYSFS_ENUM_OK;
+}
+
+bool ArchiveToc::stat(const char *filename, PHYSFS_Stat *stat, const Entry **entry) const
+{
+	*entry = find(filename);
+
+	if (!*entry)
+	{
+		PHYSFS_setErrorCode(PHYSFS_ERR_NOT_FOUND);
+		return false;
+	}
+
+	stat->modtime    =
+	stat->createtime =
+	stat->accesstime = 0;
+	stat->readonly   = 1;
+	stat->filesize   = 0;
+
+	stat->filetype = (*entry)->isFile ? PHYSFS_FILETYPE_REGULAR
+	                                  : PHYSFS_FILETYPE_DIRECTORY;
+
+	return true;
+}
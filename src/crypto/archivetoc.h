@@ -0,0 +1,102 @@
+/*
+** archivetoc.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARCHIVETOC_H
+#define ARCHIVETOC_H
+
+#include <physfs.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Table of contents shared by the archivers. It is built once
+ * when mounting, all lookups afterwards go through an open
+ * addressed hash table of entry indices and don't allocate.
+ * Files are referred to by an index into the archiver's own
+ * list of file data */
+class ArchiveToc
+{
+public:
+	/* One file and/or directory of the archive */
+	struct Entry
+	{
+		/* Full path in 'names' */
+		uint32_t nameOffset;
+		/* Start of the last path component, relative to the path */
+		uint32_t baseOffset;
+
+		bool isFile;
+		bool isDir;
+
+		uint32_t file;
+
+		/* Contained entries, as a range of 'children' */
+		uint32_t firstChild;
+		uint32_t childCount;
+	};
+
+	/* Adding several files with the same path keeps the last one */
+	void addFile(const char *path, uint32_t file);
+
+	/* Call after the last 'addFile()' */
+	void finish();
+
+	const Entry *find(const char *path) const;
+
+	const char *path(const Entry &entry) const
+	{
+		return &names[entry.nameOffset];
+	}
+
+	/* Lists the contents of 'dirname' the way
+	 * PHYSFS_Archiver::enumerate does */
+	PHYSFS_EnumerateCallbackResult
+	enumerate(const char *dirname, PHYSFS_EnumerateCallback cb,
+	          const char *origdir, void *callbackdata) const;
+
+	/* Fills in everything but the size of files */
+	bool stat(const char *filename, PHYSFS_Stat *stat, const Entry **entry) const;
+
+private:
+	void buildHash();
+	void buildChildren();
+
+	struct Item
+	{
+		std::string path;
+		bool isFile;
+		uint32_t file;
+	};
+
+	/* Only used until 'finish()' */
+	std::vector<Item> items;
+
+	/* Null terminated paths of all entries */
+	std::vector<char> names;
+
+	/* Sorted by path, the root directory comes first */
+	std::vector<Entry> entries;
+	std::vector<uint32_t> children;
+
+	/* Entry index + 1 per slot, zero for empty ones */
+	std::vector<uint32_t> slots;
+};
+
+#endif // ARCHIVETOC_H
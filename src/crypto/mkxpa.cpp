@@ -0,0 +1,476 @@
+/*
+** mkxpa.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "mkxpa.h"
+#include "archivetoc.h"
+
+#include <zlib.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+struct MKXPA_chunk
+{
+	uint64_t offset;
+	uint32_t storedSize;
+	uint8_t method;
+};
+
+struct MKXPA_file
+{
+	uint64_t size;
+	uint32_t firstChunk;
+	uint32_t chunkCount;
+};
+
+struct MKXPA_archiveData
+{
+	PHYSFS_Io *archiveIo;
+	uint32_t chunkSize;
+
+	ArchiveToc toc;
+	std::vector<MKXPA_file> files;
+	std::vector<MKXPA_chunk> chunks;
+};
+
+struct MKXPA_entryHandle
+{
+	const MKXPA_archiveData *archive;
+	const MKXPA_file &file;
+	PHYSFS_Io *io;
+
+	uint64_t currentOffset;
+
+	/* The most recently inflated chunk */
+	int64_t cachedChunk;
+	std::vector<uint8_t> chunkBuf;
+	std::vector<uint8_t> storedBuf;
+
+	MKXPA_entryHandle(const MKXPA_archiveData *archive, const MKXPA_file &file)
+	    : archive(archive),
+	      file(file),
+	      currentOffset(0),
+	      cachedChunk(-1)
+	{
+		io = archive->archiveIo->duplicate(archive->archiveIo);
+	}
+
+	MKXPA_entryHandle(const MKXPA_entryHandle &other)
+	    : archive(other.archive),
+	      file(other.file),
+	      currentOffset(other.currentOffset),
+	      cachedChunk(-1)
+	{
+		io = other.io->duplicate(other.io);
+	}
+
+	~MKXPA_entryHandle()
+	{
+		io->destroy(io);
+	}
+
+	bool loadChunk(uint32_t index)
+	{
+		if (cachedChunk == index)
+			return true;
+
+		const MKXPA_chunk &chunk = archive->chunks[file.firstChunk + index];
+		const uint64_t start = (uint64_t) index * archive->chunkSize;
+		const size_t size = std::min<uint64_t>(archive->chunkSize, file.size - start);
+
+		cachedChunk = -1;
+		chunkBuf.resize(size);
+
+		if (!io->seek(io, chunk.offset))
+			return false;
+
+		if (chunk.method == MKXPA_Stored)
+		{
+			if (chunk.storedSize != size ||
+			    io->read(io, chunkBuf.data(), size) != (PHYSFS_sint64) size)
+			{
+				PHYSFS_setErrorCode(PHYSFS_ERR_CORRUPT);
+				return false;
+			}
+		}
+		else
+		{
+			storedBuf.resize(chunk.storedSize);
+
+			if (io->read(io, storedBuf.data(), chunk.storedSize) != (PHYSFS_sint64) chunk.storedSize)
+			{
+				PHYSFS_setErrorCode(PHYSFS_ERR_CORRUPT);
+				return false;
+			}
+
+			uLongf destLen = size;
+
+			if (uncompress(chunkBuf.data(), &destLen, storedBuf.data(), chunk.storedSize) != Z_OK
+			    || destLen != size)
+			{
+				PHYSFS_setErrorCode(PHYSFS_ERR_CORRUPT);
+				return false;
+			}
+		}
+
+		cachedChunk = index;
+
+		return true;
+	}
+};
+
+#define PHYSFS_ALLOC(type) \
+	static_cast<type*>(PHYSFS_getAllocator()->Malloc(sizeof(type)))
+
+static PHYSFS_sint64
+MKXPA_ioRead(PHYSFS_Io *self, void *buffer, PHYSFS_uint64 len)
+{
+	MKXPA_entryHandle *entry = static_cast<MKXPA_entryHandle*>(self->opaque);
+
+	const uint32_t chunkSize = entry->archive->chunkSize;
+	uint64_t toRead = std::min<uint64_t>(entry->file.size - entry->currentOffset, len);
+	uint64_t done = 0;
+
+	uint8_t *bBufferP = static_cast<uint8_t*>(buffer);
+
+	while (done < toRead)
+	{
+		uint32_t index = entry->currentOffset / chunkSize;
+		uint32_t offset = entry->currentOffset % chunkSize;
+
+		if (!entry->loadChunk(index))
+			return done ? (PHYSFS_sint64) done : -1;
+
+		uint64_t count = std::min<uint64_t>(entry->chunkBuf.size() - offset, toRead - done);
+		memcpy(bBufferP + done, &entry->chunkBuf[offset], count);
+
+		entry->currentOffset += count;
+		done += count;
+	}
+
+	return done;
+}
+
+static int
+MKXPA_ioSeek(PHYSFS_Io *self, PHYSFS_uint64 offset)
+{
+	MKXPA_entryHandle *entry = static_cast<MKXPA_entryHandle*>(self->opaque);
+
+	if (offset > entry->file.size)
+		return 0;
+
+	/* Chunks are located on demand */
+	entry->currentOffset = offset;
+
+	return 1;
+}
+
+static PHYSFS_sint64
+MKXPA_ioTell(PHYSFS_Io *self)
+{
+	const MKXPA_entryHandle *entry = static_cast<MKXPA_entryHandle*>(self->opaque);
+
+	return entry->currentOffset;
+}
+
+static PHYSFS_sint64
+MKXPA_ioLength(PHYSFS_Io *self)
+{
+	const MKXPA_entryHandle *entry = static_cast<MKXPA_entryHandle*>(self->opaque);
+
+	return entry->file.size;
+}
+
+static PHYSFS_Io*
+MKXPA_ioDuplicate(PHYSFS_Io *self)
+{
+	const MKXPA_entryHandle *entry = static_cast<MKXPA_entryHandle*>(self->opaque);
+	MKXPA_entryHandle *entryDup = new MKXPA_entryHandle(*entry);
+
+	PHYSFS_Io *dup = PHYSFS_ALLOC(PHYSFS_Io);
+	*dup = *self;
+	dup->opaque = entryDup;
+
+	return dup;
+}
+
+static void
+MKXPA_ioDestroy(PHYSFS_Io *self)
+{
+	MKXPA_entryHandle *entry = static_cast<MKXPA_entryHandle*>(self->opaque);
+
+	delete entry;
+
+	PHYSFS_getAllocator()->Free(self);
+}
+
+static const PHYSFS_Io MKXPA_IoTemplate =
+{
+    0, /* version */
+    0, /* opaque */
+    MKXPA_ioRead,
+    0, /* write */
+    MKXPA_ioSeek,
+    MKXPA_ioTell,
+    MKXPA_ioLength,
+    MKXPA_ioDuplicate,
+    0, /* flush */
+    MKXPA_ioDestroy
+};
+
+/* Little endian reads from a memory buffer */
+struct MKXPA_reader
+{
+	const uint8_t *p;
+	const uint8_t *end;
+
+	bool readBytes(void *dst, size_t len)
+	{
+		if ((size_t) (end - p) < len)
+			return false;
+
+		memcpy(dst, p, len);
+		p += len;
+
+		return true;
+	}
+
+	template<typename T>
+	bool read(T &result)
+	{
+		uint8_t buff[sizeof(T)];
+
+		if (!readBytes(buff, sizeof(buff)))
+			return false;
+
+		result = 0;
+
+		for (size_t i = 0; i < sizeof(T); ++i)
+			result |= (T) buff[i] << (8 * i);
+
+		return true;
+	}
+};
+
+static bool
+parseToc(MKXPA_archiveData *data, const std::vector<uint8_t> &toc,
+         uint32_t entryCount, uint64_t archiveSize)
+{
+	MKXPA_reader reader = { toc.data(), toc.data() + toc.size() };
+
+	data->files.reserve(entryCount);
+
+	for (uint32_t i = 0; i < entryCount; ++i)
+	{
+		uint32_t nameLen;
+		MKXPA_file file;
+
+		if (!reader.read(nameLen) || nameLen > (size_t) (reader.end - reader.p))
+			return false;
+
+		std::string name((const char*) reader.p, nameLen);
+		reader.p += nameLen;
+
+		if (!reader.read(file.size) || !reader.read(file.chunkCount))
+			return false;
+
+		const uint64_t expected = (file.size + data->chunkSize - 1) / data->chunkSize;
+
+		if (file.chunkCount != expected)
+			return false;
+
+		file.firstChunk = data->chunks.size();
+
+		for (uint32_t j = 0; j < file.chunkCount; ++j)
+		{
+			MKXPA_chunk chunk;
+
+			if (!reader.read(chunk.offset) || !reader.read(chunk.storedSize) ||
+			    !reader.read(chunk.method))
+				return false;
+
+			if (chunk.method > MKXPA_Deflate ||
+			    chunk.offset + chunk.storedSize > archiveSize)
+				return false;
+
+			data->chunks.push_back(chunk);
+		}
+
+		data->toc.addFile(name.c_str(), data->files.size());
+		data->files.push_back(file);
+	}
+
+	return true;
+}
+
+static void*
+MKXPA_openArchive(PHYSFS_Io *io, const char *, int forWrite, int *claimed)
+{
+	if (forWrite)
+		return NULL;
+
+	uint8_t header[MKXPA_HEADER_SIZE];
+
+	if (io->read(io, header, sizeof(header)) != sizeof(header))
+		return NULL;
+
+	if (memcmp(header, MKXPA_HEADER, sizeof(MKXPA_HEADER)) ||
+	    header[7] != MKXPA_VERSION)
+		return NULL;
+
+	*claimed = 1;
+
+	MKXPA_reader reader = { header + 8, header + sizeof(header) };
+	uint32_t chunkSize, entryCount, tocStoredSize, tocSize;
+	uint64_t tocOffset;
+
+	reader.read(chunkSize);
+	reader.read(entryCount);
+	reader.read(tocOffset);
+	reader.read(tocStoredSize);
+	reader.read(tocSize);
+
+	const PHYSFS_sint64 archiveSize = io->length(io);
+
+	if (chunkSize == 0 || archiveSize < 0 ||
+	    tocOffset + tocStoredSize > (uint64_t) archiveSize)
+	{
+		PHYSFS_setErrorCode(PHYSFS_ERR_CORRUPT);
+		return NULL;
+	}
+
+	std::vector<uint8_t> storedToc(tocStoredSize);
+	std::vector<uint8_t> toc(tocSize);
+	uLongf tocLen = tocSize;
+
+	if (!io->seek(io, tocOffset) ||
+	    io->read(io, storedToc.data(), tocStoredSize) != (PHYSFS_sint64) tocStoredSize ||
+	    uncompress(toc.data(), &tocLen, storedToc.data(), tocStoredSize) != Z_OK ||
+	    tocLen != tocSize)
+	{
+		PHYSFS_setErrorCode(PHYSFS_ERR_CORRUPT);
+		return NULL;
+	}
+
+	MKXPA_archiveData *data = new MKXPA_archiveData;
+	data->archiveIo = io;
+	data->chunkSize = chunkSize;
+
+	if (!parseToc(data, toc, entryCount, archiveSize))
+	{
+		PHYSFS_setErrorCode(PHYSFS_ERR_CORRUPT);
+		delete data;
+		return NULL;
+	}
+
+	data->toc.finish();
+
+	return data;
+}
+
+static PHYSFS_EnumerateCallbackResult
+MKXPA_enumerateFiles(void *opaque, const char *dirname,
+                     PHYSFS_EnumerateCallback cb,
+                     const char *origdir, void *callbackdata)
+{
+	MKXPA_archiveData *data = static_cast<MKXPA_archiveData*>(opaque);
+
+	return data->toc.enumerate(dirname, cb, origdir, callbackdata);
+}
+
+static PHYSFS_Io*
+MKXPA_openRead(void *opaque, const char *filename)
+{
+	MKXPA_archiveData *data = static_cast<MKXPA_archiveData*>(opaque);
+
+	const ArchiveToc::Entry *tocEntry = data->toc.find(filename);
+
+	if (!tocEntry || !tocEntry->isFile)
+		return 0;
+
+	MKXPA_entryHandle *entry =
+	        new MKXPA_entryHandle(data, data->files[tocEntry->file]);
+
+	PHYSFS_Io *io = PHYSFS_ALLOC(PHYSFS_Io);
+
+	*io = MKXPA_IoTemplate;
+	io->opaque = entry;
+
+	return io;
+}
+
+static int
+MKXPA_stat(void *opaque, const char *filename, PHYSFS_Stat *stat)
+{
+	MKXPA_archiveData *data = static_cast<MKXPA_archiveData*>(opaque);
+	const ArchiveToc::Entry *entry;
+
+	if (!data->toc.stat(filename, stat, &entry))
+		return 0;
+
+	if (entry->isFile)
+		stat->filesize = data->files[entry->file].size;
+
+	return 1;
+}
+
+static void
+MKXPA_closeArchive(void *opaque)
+{
+	MKXPA_archiveData *data = static_cast<MKXPA_archiveData*>(opaque);
+
+	delete data;
+}
+
+static PHYSFS_Io*
+MKXPA_noop1(void*, const char*)
+{
+	return 0;
+}
+
+static int
+MKXPA_noop2(void*, const char*)
+{
+	return 0;
+}
+
+const PHYSFS_Archiver MKXPA_Archiver =
+{
+	0,
+	{
+		"MKXPA",
+		"mkxp-z indexed compressed archive format",
+		"", /* Author */
+		"", /* Website */
+		0 /* symlinks not supported */
+	},
+	MKXPA_openArchive,
+	MKXPA_enumerateFiles,
+	MKXPA_openRead,
+	MKXPA_noop1, /* openWrite */
+	MKXPA_noop1, /* openAppend */
+	MKXPA_noop2, /* remove */
+	MKXPA_noop2, /* mkdir */
+	MKXPA_stat,
+	MKXPA_closeArchive
+};
@@ -0,0 +1,59 @@
+/*
+** mkxpa.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MKXPA_H
+#define MKXPA_H
+
+#include <physfs.h>
+
+/* Indexed, compressed archive format, as written by the
+ * mkxpz-pack tool. All integers are little endian.
+ *
+ * Header:
+ *   char[8]  "MKXPAR\0" followed by the version byte
+ *   uint32   chunk size, in uncompressed bytes
+ *   uint32   entry count
+ *   uint64   TOC offset
+ *   uint32   stored TOC size
+ *   uint32   TOC size (the TOC is always deflated)
+ *
+ * TOC, for each entry:
+ *   uint32   path length, followed by the path ('/' separated)
+ *   uint64   file size
+ *   uint32   chunk count, followed by each chunk as
+ *            uint64 offset, uint32 stored size, uint8 method
+ *
+ * Files are split into chunks that are compressed on their own,
+ * so random access only ever has to inflate one of them. Every
+ * chunk but the last of a file holds exactly 'chunk size' bytes */
+
+#define MKXPA_HEADER "MKXPAR"
+#define MKXPA_VERSION 1
+#define MKXPA_HEADER_SIZE 32
+#define MKXPA_CHUNK_SIZE (64 * 1024)
+
+enum MKXPA_Method
+{
+	MKXPA_Stored = 0,
+	MKXPA_Deflate = 1
+};
+
+extern const PHYSFS_Archiver MKXPA_Archiver;
+
+#endif // MKXPA_H
@@ -20,12 +20,32 @@
 */
 
 #include "rgssad.h"
-#include "boost-hash.h"
+#include "archivetoc.h"
 
 #include <stdint.h>
 #include <string.h>
 
+#include <algorithm>
 #include <string>
+#include <vector>
+
+#ifdef __WIN32__
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+# include <emmintrin.h>
+# define RGSS_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+# include <arm_neon.h>
+# define RGSS_NEON
+#endif
 
 /* Equivalent Linear Congruential Generator (LCG) constants for iteration 2^n
  * all the way up to 2^32/4 (the largest dword offset possible in
@@ -60,38 +80,187 @@ struct RGSS_entryData
 	uint32_t startMagic;
 };
 
+/* Read-only view of a whole archive file on disk */
+struct RGSS_mapping
+{
+	const uint8_t *base;
+	uint64_t size;
+
+#ifdef __WIN32__
+	HANDLE file;
+	HANDLE handle;
+#endif
+
+	RGSS_mapping()
+	    : base(0),
+	      size(0)
+	{}
+
+	/* Returns false if 'path' can't be mapped, eg.
+	 * because it isn't a file on the host system */
+	bool map(const char *path, uint64_t expectedSize)
+	{
+		if (!path || expectedSize == 0 || expectedSize > SIZE_MAX)
+			return false;
+
+#ifdef __WIN32__
+		int wlen = MultiByteToWideChar(CP_UTF8, 0, path, -1, 0, 0);
+
+		if (wlen <= 0)
+			return false;
+
+		std::wstring wpath(wlen, 0);
+		MultiByteToWideChar(CP_UTF8, 0, path, -1, &wpath[0], wlen);
+
+		file = CreateFileW(wpath.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+		                   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER fileSize;
+
+		if (!GetFileSizeEx(file, &fileSize) || (uint64_t) fileSize.QuadPart != expectedSize)
+		{
+			CloseHandle(file);
+			return false;
+		}
+
+		handle = CreateFileMappingW(file, 0, PAGE_READONLY, 0, 0, 0);
+
+		if (!handle)
+		{
+			CloseHandle(file);
+			return false;
+		}
+
+		base = static_cast<const uint8_t*>(MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0));
+
+		if (!base)
+		{
+			CloseHandle(handle);
+			CloseHandle(file);
+			return false;
+		}
+#else
+		int fd = open(path, O_RDONLY);
+
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+
+		/* A mismatch means the archive didn't come
+		 * from this file, eg. it is nested in another one */
+		if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+		    (uint64_t) st.st_size != expectedSize)
+		{
+			close(fd);
+			return false;
+		}
+
+		void *addr = mmap(0, expectedSize, PROT_READ, MAP_SHARED, fd, 0);
+
+		/* The mapping stays valid past this */
+		close(fd);
+
+		if (addr == MAP_FAILED)
+			return false;
+
+		base = static_cast<const uint8_t*>(addr);
+#endif
+
+		size = expectedSize;
+
+		return true;
+	}
+
+	~RGSS_mapping()
+	{
+		if (!base)
+			return;
+
+#ifdef __WIN32__
+		UnmapViewOfFile(base);
+		CloseHandle(handle);
+		CloseHandle(file);
+#else
+		munmap(const_cast<uint8_t*>(base), size);
+#endif
+	}
+};
+
 struct RGSS_entryHandle
 {
 	const RGSS_entryData data;
 	uint32_t currentMagic;
 	uint64_t currentOffset;
+
+	/* Entries of mapped archives are read straight from
+	 * memory and don't need an io of their own */
+	const RGSS_mapping *mapping;
 	PHYSFS_Io *io;
 
-	RGSS_entryHandle(const RGSS_entryData &data, PHYSFS_Io *archIo)
+	RGSS_entryHandle(const RGSS_entryData &data, PHYSFS_Io *archIo,
+	                 const RGSS_mapping *mapping)
 	    : data(data),
 	      currentMagic(data.startMagic),
-	      currentOffset(0)
+	      currentOffset(0),
+	      mapping(mapping),
+	      io(0)
 	{
-		io = archIo->duplicate(archIo);
+		/* Entries reaching past the end of the file
+		 * are left to fail like they did before */
+		if (!mapping->base || data.offset + data.size > mapping->size)
+		{
+			this->mapping = 0;
+			io = archIo->duplicate(archIo);
+		}
+	}
+
+	RGSS_entryHandle(const RGSS_entryHandle &other)
+	    : data(other.data),
+	      currentMagic(other.currentMagic),
+	      currentOffset(other.currentOffset),
+	      mapping(other.mapping),
+	      io(0)
+	{
+		if (other.io)
+		{
+			io = other.io->duplicate(other.io);
+			io->seek(io, data.offset + currentOffset);
+		}
 	}
 
 	~RGSS_entryHandle()
 	{
-		io->destroy(io);
+		if (io)
+			io->destroy(io);
+	}
+
+	/* Copies 'len' undecrypted bytes at the current offset */
+	void readRaw(void *dst, uint64_t len)
+	{
+		if (io)
+			io->read(io, dst, len);
+		else
+			memcpy(dst, mapping->base + data.offset + currentOffset, len);
 	}
 };
 
 struct RGSS_archiveData
 {
 	PHYSFS_Io *archiveIo;
+	RGSS_mapping mapping;
 
-	/* Maps: file path
-	 * to:   entry data */
-	BoostHash<std::string, RGSS_entryData> entryHash;
+	ArchiveToc toc;
+	std::vector<RGSS_entryData> files;
 
-	/* Maps: directory path,
-	 * to:   list of contained entries */
-	BoostHash<std::string, BoostSet<std::string> > dirHash;
+	void addFile(const char *path, const RGSS_entryData &entry)
+	{
+		toc.addFile(path, files.size());
+		files.push_back(entry);
+	}
 };
 
 static bool
@@ -142,17 +311,105 @@ advanceMagicN(uint32_t &magic, uint32_t n) {
     return old;
 }
 
+#ifdef RGSS_SSE
+/* SSE2 lacks a 32 bit low multiply */
+static inline __m128i
+mullo32(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+	                          _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
+
+/* Writes 'dwords' decrypted dwords from 'src' to 'dst' (which may
+ * be the same), advancing 'magic' past them. Neither needs to be
+ * aligned. Each lane holds every fourth magic of the sequence, so
+ * all four advance in one step using the LCG constants for 4 */
+static void
+xorMagic(uint8_t *dst, const uint8_t *src, uint64_t dwords, uint32_t &magic)
+{
+	uint64_t i = 0;
+
+	if (dwords >= 4)
+	{
+		uint32_t lanes[4];
+
+		for (int j = 0; j < 4; ++j)
+			lanes[j] = advanceMagic(magic);
+
+		const uint32_t mul = LCG_TABLE[2][0];
+		const uint32_t add = LCG_TABLE[2][1];
+
+#if defined(RGSS_SSE)
+		__m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes));
+		const __m128i vmul = _mm_set1_epi32(mul);
+		const __m128i vadd = _mm_set1_epi32(add);
+
+		for (; i + 4 <= dwords; i += 4)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i*4));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i*4), _mm_xor_si128(v, m));
+
+			m = _mm_add_epi32(mullo32(m, vmul), vadd);
+		}
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), m);
+#elif defined(RGSS_NEON)
+		uint32x4_t m = vld1q_u32(lanes);
+		const uint32x4_t vmul = vdupq_n_u32(mul);
+		const uint32x4_t vadd = vdupq_n_u32(add);
+
+		for (; i + 4 <= dwords; i += 4)
+		{
+			uint8x16_t v = vld1q_u8(src + i*4);
+			vst1q_u8(dst + i*4, veorq_u8(v, vreinterpretq_u8_u32(m)));
+
+			m = vmlaq_u32(vadd, m, vmul);
+		}
+
+		vst1q_u32(lanes, m);
+#else
+		for (; i + 4 <= dwords; i += 4)
+		{
+			uint32_t v[4];
+			memcpy(v, src + i*4, sizeof(v));
+
+			for (int j = 0; j < 4; ++j)
+			{
+				v[j] ^= lanes[j];
+				lanes[j] = lanes[j] * mul + add;
+			}
+
+			memcpy(dst + i*4, v, sizeof(v));
+		}
+#endif
+
+		/* First lane is the magic of the next dword */
+		magic = lanes[0];
+	}
+
+	for (; i < dwords; ++i)
+	{
+		uint32_t v;
+		memcpy(&v, src + i*4, 4);
+		v ^= advanceMagic(magic);
+		memcpy(dst + i*4, &v, 4);
+	}
+}
+
 static PHYSFS_sint64
 RGSS_ioRead(PHYSFS_Io *self, void *buffer, PHYSFS_uint64 len)
 {
 	RGSS_entryHandle *entry = static_cast<RGSS_entryHandle*>(self->opaque);
 
-	PHYSFS_Io *io = entry->io;
-
 	uint64_t toRead = std::min<uint64_t>(entry->data.size - entry->currentOffset, len);
 	uint64_t offs = entry->currentOffset;
 
-	io->seek(io, entry->data.offset + offs);
+	if (entry->io)
+		entry->io->seek(entry->io, entry->data.offset + offs);
 
 	/* We divide up the bytes to be read in 3 categories:
 	 *
@@ -170,26 +427,28 @@ RGSS_ioRead(PHYSFS_Io *self, void *buffer, PHYSFS_uint64 len)
 	 * Treating the pre- and post aligned reads specially,
 	 * we can read all aligned dwords in one syscall directly
 	 * into the write buffer and then run the xor chain on
-	 * it afterwards. */
+	 * it afterwards. For mapped archives, the aligned dwords
+	 * are decrypted while being copied out of the mapping. */
 
 	uint8_t preAlign = 4 - (offs % 4);
 
 	if (preAlign == 4)
 		preAlign = 0;
 	else
-		preAlign = std::min<uint64_t>(preAlign, len);
+		preAlign = std::min<uint64_t>(preAlign, toRead);
 
-	uint8_t postAlign = (len > preAlign) ? (offs + len) % 4 : 0;
+	uint8_t postAlign = (toRead > preAlign) ? (offs + toRead) % 4 : 0;
 
-	uint64_t align = len - (preAlign + postAlign);
+	uint64_t align = toRead - (preAlign + postAlign);
 
 	/* Byte buffer pointer */
 	uint8_t *bBufferP = static_cast<uint8_t*>(buffer);
 
 	if (preAlign > 0)
 	{
-		uint32_t dword;
-		io->read(io, &dword, preAlign);
+		uint32_t dword = 0;
+		entry->readRaw(&dword, preAlign);
+		entry->currentOffset += preAlign;
 
 		/* Need to align the bytes with the
 		 * magic before xoring */
@@ -210,31 +469,33 @@ RGSS_ioRead(PHYSFS_Io *self, void *buffer, PHYSFS_uint64 len)
 
 	if (align > 0)
 	{
-		/* Double word buffer pointer */
-		uint32_t *dwBufferP = reinterpret_cast<uint32_t*>(bBufferP);
-
-		/* Read aligned dwords in one go */
-		io->read(io, bBufferP, align);
-
-		/* Then xor them */
-		for (uint64_t i = 0; i < (align / 4); ++i)
-			dwBufferP[i] ^= advanceMagic(entry->currentMagic);
+		if (entry->io)
+		{
+			/* Read aligned dwords in one go, then xor them */
+			entry->io->read(entry->io, bBufferP, align);
+			xorMagic(bBufferP, bBufferP, align / 4, entry->currentMagic);
+		}
+		else
+		{
+			const uint8_t *src = entry->mapping->base + entry->data.offset + entry->currentOffset;
+			xorMagic(bBufferP, src, align / 4, entry->currentMagic);
+		}
 
+		entry->currentOffset += align;
 		bBufferP += align;
 	}
 
 	if (postAlign > 0)
 	{
-		uint32_t dword;
-		io->read(io, &dword, postAlign);
+		uint32_t dword = 0;
+		entry->readRaw(&dword, postAlign);
+		entry->currentOffset += postAlign;
 
 		/* Bytes are already aligned with magic */
 		dword ^= entry->currentMagic;
 		memcpy(bBufferP, &dword, postAlign);
 	}
 
-	entry->currentOffset += toRead;
-
 	return toRead;
 }
 
@@ -264,7 +525,9 @@ RGSS_ioSeek(PHYSFS_Io *self, PHYSFS_uint64 offset)
 	advanceMagicN(entry->currentMagic, (uint32_t) dwordsSought);
 
 	entry->currentOffset = offset;
-	entry->io->seek(entry->io, entry->data.offset + entry->currentOffset);
+
+	if (entry->io)
+		entry->io->seek(entry->io, entry->data.offset + entry->currentOffset);
 
 	return 1;
 }
@@ -322,42 +585,6 @@ static const PHYSFS_Io RGSS_IoTemplate =
     RGSS_ioDestroy
 };
 
-static void
-processDirectories(RGSS_archiveData *data, BoostSet<std::string> &topLevel,
-                   char *nameBuf, uint32_t nameLen)
-{
-	/* Check for top level entries */
-	for (uint32_t i = 0; i < nameLen; ++i)
-	{
-		bool slash = nameBuf[i] == '/';
-		if (!slash && i+1 < nameLen)
-			continue;
-
-		if (slash)
-			nameBuf[i] = '\0';
-
-		topLevel.insert(nameBuf);
-
-		if (slash)
-			nameBuf[i] = '/';
-
-		break;
-	}
-
-	/* Check for more entries */
-	for (uint32_t i = nameLen; i > 0; i--)
-		if (nameBuf[i] == '/')
-		{
-			nameBuf[i] = '\0';
-
-			const char *dir = nameBuf;
-			const char *entry = &nameBuf[i+1];
-
-			BoostSet<std::string> &entryList = data->dirHash[dir];
-			entryList.insert(entry);
-		}
-}
-
 static bool
 verifyHeader(PHYSFS_Io *io, char version)
 {
@@ -376,7 +603,7 @@ verifyHeader(PHYSFS_Io *io, char version)
 }
 
 static void*
-RGSS_openArchive(PHYSFS_Io *io, const char *, int forWrite, int *claimed)
+RGSS_openArchive(PHYSFS_Io *io, const char *name, int forWrite, int *claimed)
 {
 	if (forWrite)
 		return NULL;
@@ -389,12 +616,10 @@ RGSS_openArchive(PHYSFS_Io *io, const char *, int forWrite, int *claimed)
 
 	RGSS_archiveData *data = new RGSS_archiveData;
 	data->archiveIo = io;
+	data->mapping.map(name, io->length(io));
 
 	uint32_t magic = RGSS_MAGIC;
 
-	/* Top level entry list */
-	BoostSet<std::string> &topLevel = data->dirHash[""];
-
 	while (true)
 	{
 		/* Read filename length,
@@ -406,12 +631,14 @@ RGSS_openArchive(PHYSFS_Io *io, const char *, int forWrite, int *claimed)
 
 		nameLen ^= advanceMagic(magic);
 
-		static char nameBuf[512];
+		char nameBuf[512];
+
+		if (nameLen >= sizeof(nameBuf) || !IO_READ(io, nameBuf, nameLen))
+			break;
+
 		for (uint32_t i = 0; i < nameLen; ++i)
 		{
-			char c;
-			io->read(io, &c, 1);
-			nameBuf[i] = c ^ (advanceMagic(magic) & 0xFF);
+			nameBuf[i] ^= (advanceMagic(magic) & 0xFF);
 			if (nameBuf[i] == '\\')
 				nameBuf[i] = '/';
 		}
@@ -427,12 +654,13 @@ RGSS_openArchive(PHYSFS_Io *io, const char *, int forWrite, int *claimed)
 		entry.size = entrySize;
 		entry.startMagic = magic;
 
-		data->entryHash.insert(nameBuf, entry);
-		processDirectories(data, topLevel, nameBuf, nameLen);
+		data->addFile(nameBuf, entry);
 
 		io->seek(io, entry.offset + entry.size);
 	}
 
+	data->toc.finish();
+
 	return data;
 }
 
@@ -443,18 +671,7 @@ RGSS_enumerateFiles(void *opaque, const char *dirname,
 {
 	RGSS_archiveData *data = static_cast<RGSS_archiveData*>(opaque);
 
-	std::string _dirname(dirname);
-
-	if (!data->dirHash.contains(_dirname))
-		return PHYSFS_ENUM_STOP;
-
-	const BoostSet<std::string> &entries = data->dirHash[_dirname];
-
-	BoostSet<std::string>::const_iterator iter;
-	for (iter = entries.cbegin(); iter != entries.cend(); ++iter)
-		cb(callbackdata, origdir, iter->c_str());
-
-	return PHYSFS_ENUM_OK;
+	return data->toc.enumerate(dirname, cb, origdir, callbackdata);
 }
 
 static PHYSFS_Io*
@@ -462,11 +679,13 @@ RGSS_openRead(void *opaque, const char *filename)
 {
 	RGSS_archiveData *data = static_cast<RGSS_archiveData*>(opaque);
 
-	if (!data->entryHash.contains(filename))
+	const ArchiveToc::Entry *tocEntry = data->toc.find(filename);
+
+	if (!tocEntry || !tocEntry->isFile)
 		return 0;
 
 	RGSS_entryHandle *entry =
-	        new RGSS_entryHandle(data->entryHash[filename], data->archiveIo);
+	        new RGSS_entryHandle(data->files[tocEntry->file], data->archiveIo, &data->mapping);
 
 	PHYSFS_Io *io = PHYSFS_ALLOC(PHYSFS_Io);
 
@@ -480,33 +699,13 @@ static int
 RGSS_stat(void *opaque, const char *filename, PHYSFS_Stat *stat)
 {
 	RGSS_archiveData *data = static_cast<RGSS_archiveData*>(opaque);
+	const ArchiveToc::Entry *entry;
 
-	bool hasFile = data->entryHash.contains(filename);
-	bool hasDir  = data->dirHash.contains(filename);
-
-	if (!hasFile && !hasDir)
-	{
-		PHYSFS_setErrorCode(PHYSFS_ERR_NOT_FOUND);
+	if (!data->toc.stat(filename, stat, &entry))
 		return 0;
-	}
-
-	stat->modtime    =
-	stat->createtime =
-	stat->accesstime = 0;
-	stat->readonly   = 1;
-
-	if (hasFile)
-	{
-		const RGSS_entryData &entry = data->entryHash[filename];
 
-		stat->filesize = entry.size;
-		stat->filetype = PHYSFS_FILETYPE_REGULAR;
-	}
-	else
-	{
-		stat->filesize = 0;
-		stat->filetype = PHYSFS_FILETYPE_DIRECTORY;
-	}
+	if (entry->isFile)
+		stat->filesize = data->files[entry->file].size;
 
 	return 1;
 }
@@ -585,7 +784,7 @@ readUint32AndXor(PHYSFS_Io *io, uint32_t &result, uint32_t key)
 }
 
 static void*
-RGSS3_openArchive(PHYSFS_Io *io, const char *, int forWrite, int *claimed)
+RGSS3_openArchive(PHYSFS_Io *io, const char *name, int forWrite, int *claimed)
 {
 	if (forWrite)
 		return NULL;
@@ -605,9 +804,7 @@ RGSS3_openArchive(PHYSFS_Io *io, const char *, int forWrite, int *claimed)
 
 	RGSS_archiveData *data = new RGSS_archiveData;
 	data->archiveIo = io;
-
-	/* Top level entry list */
-	BoostSet<std::string> &topLevel = data->dirHash[""];
+	data->mapping.map(name, io->length(io));
 
 	while (true)
 	{
@@ -631,6 +828,9 @@ RGSS3_openArchive(PHYSFS_Io *io, const char *, int forWrite, int *claimed)
 
 		char nameBuf[512];
 
+		if (nameLen >= sizeof(nameBuf))
+			goto error;
+
 		if (!IO_READ(io, nameBuf, nameLen))
 			goto error;
 
@@ -649,8 +849,7 @@ RGSS3_openArchive(PHYSFS_Io *io, const char *, int forWrite, int *claimed)
 		entry.size = size;
 		entry.startMagic = magic;
 
-		data->entryHash.insert(nameBuf, entry);
-		processDirectories(data, topLevel, nameBuf, nameLen);
+		data->addFile(nameBuf, entry);
 
 		continue;
 
@@ -659,6 +858,8 @@ RGSS3_openArchive(PHYSFS_Io *io, const char *, int forWrite, int *claimed)
 		return NULL;
 	}
 
+	data->toc.finish();
+
 	return data;
 }
 
@@ -31,6 +31,7 @@
 
 #include "gl-util.h"
 #include "gl-meta.h"
+#include "compressedtex.h"
 #include "quad.h"
 #include "quadarray.h"
 #include "transform.h"
@@ -40,19 +41,39 @@
 #include "glstate.h"
 #include "texpool.h"
 #include "shader.h"
+#include "scene.h"
+#include "preparable.h"
 #include "filesystem.h"
+#include "imagecache.h"
+#include "mappedsurface.h"
+#include "profiler.h"
+#include "trace.h"
 #include "font.h"
 #include "eventthread.h"
 #include "graphics.h"
 #include "system.h"
 #include "util/util.h"
+#include "intrulist.h"
 
 #include "debugwriter.h"
+#include "sdl-util.h"
 
 #include "sigslot/signal.hpp"
 
 #include <math.h>
+#include <stdio.h>
+#include <string.h>
 #include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+# include <emmintrin.h>
+# define SHADOW_SSE
+#elif defined(__aarch64__)
+/* ARMv7 NEON has no float division */
+# include <arm_neon.h>
+# define SHADOW_NEON
+#endif
 
 extern "C" {
 #include "libnsgif/libnsgif.h"
@@ -81,6 +102,47 @@ throw Exception(Exception::MKXPError, \
 
 #define OUTLINE_SIZE 1
 
+/* Past this many boxes, the tainted region is coarsened
+ * to its bounding box to keep queries on it cheap */
+#define TAINT_MAX_RECTS 16
+
+/* Recorded fills are drawn once this many pile up,
+ * staying below what QuadStream takes per draw */
+#define FILL_BATCH_QUADS 256
+
+/* Textures kept for the frames of a GIF animation,
+ * counting from the current frame onwards */
+#define GIF_WINDOW 4
+
+/* Loaded images at least this large are uploaded in bands
+ * when there is an upload budget (see 'textureUploadBudget') */
+#define UPLOAD_DEFER_MIN (256 * 1024)
+
+/* Largest tile of a mega surface uploaded at once when
+ * blitting from it; also bounds the scratch texture */
+#define MEGA_BLT_TILE 2048
+
+/* Extra pixels around the wanted part of a mega surface
+ * uploaded for display, so small scrolls don't re-upload */
+#define MEGA_WINDOW_MARGIN 128
+
+/* Decoded images at least this large are converted to the
+ * texture format on several threads, in bands of rows */
+#define CONVERT_PARALLEL_MIN (1024 * 1024)
+
+struct BitmapPrivate;
+
+/* Bitmaps with part of their image still to be uploaded,
+ * oldest first */
+static IntruList<BitmapPrivate> pendingUploads;
+
+/* Bitmaps holding a RAM copy of their texture, so
+ * the copies can be dropped under memory pressure */
+static IntruList<BitmapPrivate> surfaceHolders;
+
+/* All live bitmaps while 'bitmapTracker' is enabled */
+static IntruList<BitmapPrivate> trackedBitmaps;
+
 /* Normalize (= ensure width and
  * height are positive) */
 static IntRect normalizedRect(const IntRect &rect)
@@ -103,6 +165,76 @@ static IntRect normalizedRect(const IntRect &rect)
 }
 
 
+/* One band of rows of a surface being converted */
+struct ConvertBand
+{
+    const SDL_Surface *src;
+    SDL_Surface *dst;
+    int y, h;
+    int result;
+    
+    void run()
+    {
+        const uint8_t *srcPx = (const uint8_t*) src->pixels + y * src->pitch;
+        uint8_t *dstPx = (uint8_t*) dst->pixels + y * dst->pitch;
+        
+        result = SDL_ConvertPixels(src->w, h, src->format->format, srcPx, src->pitch,
+                                   dst->format->format, dstPx, dst->pitch);
+    }
+};
+
+/* Like SDL_ConvertSurfaceFormat(), split across one thread
+ * per core. Palettes and color keys aren't handled by
+ * SDL_ConvertPixels(), so null is returned for those */
+static SDL_Surface *convertSurfaceParallel(SDL_Surface *surf, Uint32 format)
+{
+    if (SDL_ISPIXELFORMAT_INDEXED(surf->format->format) || SDL_HasColorKey(surf))
+        return 0;
+    
+    SDL_Surface *conv = SDL_CreateRGBSurfaceWithFormat(0, surf->w, surf->h, 32, format);
+    
+    if (!conv)
+        return 0;
+    
+    const int bandCount = clamp(SDL_GetCPUCount(), 1, 8);
+    const int bandH = (surf->h + bandCount - 1) / bandCount;
+    
+    std::vector<ConvertBand> bands;
+    
+    for (int y = 0; y < surf->h; y += bandH) {
+        ConvertBand band = { surf, conv, y, std::min(bandH, surf->h - y), 0 };
+        bands.push_back(band);
+    }
+    
+    std::vector<SDL_Thread*> threads(bands.size(), 0);
+    
+    /* The first band is converted right here */
+    for (size_t i = 1; i < bands.size(); ++i)
+        threads[i] = createSDLThread<ConvertBand, &ConvertBand::run>(&bands[i], "convert");
+    
+    bands[0].run();
+    
+    bool failed = false;
+    
+    for (size_t i = 0; i < bands.size(); ++i) {
+        if (i > 0 && threads[i])
+            SDL_WaitThread(threads[i], 0);
+        else if (i > 0)
+            bands[i].run();
+        
+        if (bands[i].result != 0)
+            failed = true;
+    }
+    
+    if (failed) {
+        SDL_FreeSurface(conv);
+        return 0;
+    }
+    
+    return conv;
+}
+
+
 // libnsgif loading callbacks, taken pretty much straight from their tests
 
 static void *gif_bitmap_create(int width, int height)
@@ -151,7 +283,7 @@ static void gif_bitmap_modified(void *bitmap)
 
 // --------------------
 
-struct BitmapPrivate
+struct BitmapPrivate : public Preparable
 {
     Bitmap *self;
     
@@ -179,23 +311,101 @@ struct BitmapPrivate
             return (loop) ? fmod(i, frames.size()) : (i > (int)frames.size() - 1) ? (int)frames.size() - 1 : i;
         }
         
+        /* Set when the frames come from a GIF, which is decoded
+         * on demand. Only the frames within GIF_WINDOW of the
+         * current one hold a texture, all others are empty */
+        gif_animation *gif;
+        unsigned char *gifData;
+        
         inline TEXFBO &currentFrame() {
             int i = currentFrameI();
+            decodeFrame(i, i);
             return frames[i];
         }
         
+        /* Gives frame 'i' a texture holding its image. Textures
+         * of frames outside the window starting at 'base' are
+         * reused, a negative 'base' keeps all of them */
+        void decodeFrame(int i, int base) {
+            if (!gif || frames[i].tex != TEX::ID(0)) return;
+            
+            /* libnsgif composes every frame onto the one before,
+             * so going back means starting over from the first */
+            int start = (gif->decoded_frame < 0 || gif->decoded_frame > i) ? 0 : gif->decoded_frame + 1;
+            
+            for (int j = start; j <= i; ++j) {
+                int status = gif_decode_frame(gif, j);
+                if (status != GIF_OK && status != GIF_WORKING) {
+                    Debug() << "Failed to decode GIF frame" << j + 1 << "(Status" << status << ")";
+                    break;
+                }
+            }
+            
+            TEXFBO tex;
+            
+            if (base >= 0) {
+                const int count = (int)frames.size();
+                int resident = 0;
+                int victim = -1;
+                
+                for (int j = 0; j < count; ++j) {
+                    if (frames[j].tex == TEX::ID(0)) continue;
+                    
+                    resident++;
+                    if ((j - base + count) % count >= GIF_WINDOW)
+                        victim = j;
+                }
+                
+                if (resident >= GIF_WINDOW && victim >= 0) {
+                    tex = frames[victim];
+                    frames[victim] = TEXFBO();
+                }
+            }
+            
+            if (tex.tex == TEX::ID(0))
+                tex = shState->texPool().request(width, height);
+            
+            TEX::bind(tex.tex);
+            TEX::uploadImage(width, height, gif->frame_image, GL_RGBA);
+            frames[i] = tex;
+        }
+        
+        /* Decodes all remaining frames and drops the GIF, for
+         * operations that modify or hand out the frame list */
+        void decodeAll() {
+            if (!gif) return;
+            
+            for (int i = 0; i < (int)frames.size(); ++i)
+                decodeFrame(i, -1);
+            
+            closeGif();
+        }
+        
+        void closeGif() {
+            if (!gif) return;
+            
+            gif_finalise(gif);
+            delete gif;
+            delete[] gifData;
+            gif = 0;
+            gifData = 0;
+        }
+        
         inline void play() {
             playing = true;
             needsReset = true;
+            Scene::damageScreen();
         }
         
         inline void stop() {
             lastFrame = currentFrameI();
             playing = false;
+            Scene::damageScreen();
         }
         
         inline void seek(int frame) {
             lastFrame = clamp(frame, 0, (int)frames.size());
+            Scene::damageScreen();
         }
         
         void updateTimer() {
@@ -212,24 +422,151 @@ struct BitmapPrivate
         }
     } animation;
     
-    sigslot::connection prepareCon;
+    /* Quads of fillRect / gradientFillRect / clearRect calls not
+     * drawn yet. They are drawn together before anything else
+     * touches the texture (see 'ensureUncompressed()'), or on
+     * the next prepareDraw, instead of one draw per call */
+    std::vector<Vertex> pendingFills;
     
     TEXFBO gl;
     
+    /* Number of bitmaps holding 'gl' while it is shared with
+     * copies made through dup / clone, which only get their own
+     * texture once either side is modified. Null while the
+     * texture is ours alone */
+    int *glShare;
+    
+    /* 'gl' holds a GPU compressed texture loaded from a KTX2 file,
+     * or one with reduced precision (see 'Bitmap::Storage'), without
+     * an FBO. It is expanded into a regular texture before the
+     * first operation that draws into or reads from it */
+    bool compressed;
+    
+    /* Of 'gl'; less than 4 for reduced precision textures */
+    int texelBytes;
+    
+    /* Every pixel is known to have full alpha. Only established
+     * for images loaded from files, and lost on any change that
+     * could introduce transparency */
+    bool opaque;
+    
+    /* See 'Bitmap::setMipmap()' */
+    bool mipmap;
+    
+    /* Texture and generation the mipmaps were last built for;
+     * they're rebuilt on the next zoomed out draw if either
+     * changed since */
+    struct
+    {
+        GLuint tex;
+        unsigned int generation;
+    } mipmaps;
+    
+    /* A large loaded image going up to 'gl' a band of rows per
+     * frame, through a staging buffer (see 'streamUploads()').
+     * Whatever is left is uploaded right away once anything
+     * samples, draws into or reads from the texture */
+    struct
+    {
+        SDL_Surface *surf;
+        /* First row not uploaded yet */
+        int row;
+        UPBO::ID pbo;
+    } upload;
+    
+    /* In 'pendingUploads' while 'upload.surf' is set */
+    IntruListLink<BitmapPrivate> uploadLink;
+    
+    /* In 'surfaceHolders' while 'surface' is set */
+    IntruListLink<BitmapPrivate> surfaceLink;
+    
+    /* In 'trackedBitmaps' if the tracker is enabled */
+    IntruListLink<BitmapPrivate> trackLink;
+    
+    /* See 'Bitmap::trackReport()' */
+    struct
+    {
+        std::string filename;
+        std::string origin;
+        bool drawn;
+        unsigned int lastDraw;
+    } track;
+    
     Font *font;
     
     /* "Mega surfaces" are a hack to allow Tilesets to be used
      * whose Bitmaps don't fit into a regular texture. They're
-     * kept in RAM and will throw an error if they're used in
-     * any context other than as Tilesets */
+     * kept in RAM (or a mapped file, see 'setMegaSurface') and
+     * will throw an error if they're used in any context other
+     * than as Tilesets */
     SDL_Surface *megaSurface;
     
+    /* The part of 'megaSurface' last asked for by a sprite,
+     * uploaded to a texture (see 'Bitmap::getMegaWindow()') */
+    struct
+    {
+        TEXFBO tex;
+        IntRect region;
+    } megaWindow;
+    
     /* A cached version of the bitmap in client memory, for
-     * getPixel calls. Is invalidated any time the bitmap
-     * is modified */
+     * getPixel calls. Rows touched by modifications are marked
+     * stale and fetched again from the texture on next access */
     SDL_Surface *surface;
     SDL_PixelFormat *format;
     
+    /* Image file the contents came from, cleared on first
+     * modification. See 'Bitmap::contentKey()' */
+    std::string sourcePath;
+    /* Renewed on every modification */
+    unsigned int generation;
+    
+    /* One bit per pixel, set where it isn't fully transparent,
+     * for hit tests. Valid while 'maskGeneration' is current */
+    std::vector<uint32_t> alphaMask;
+    unsigned int maskGeneration;
+    
+    /* Copy of the bitmap inside a shared atlas page, so sprites
+     * using different small bitmaps can still be drawn in one
+     * batch. Only unmodified bitmaps loaded from image files
+     * qualify, and the copy is dropped on first modification */
+    struct
+    {
+        bool eligible;
+        /* A sprite asked for the copy, it is made on next prepare */
+        bool wanted;
+        bool active;
+        TEXFBO page;
+        IntRect region;
+    } atlas;
+    
+    /* Stale rows of 'surface', as the range [begin, end) */
+    struct
+    {
+        int begin, end;
+    } stale;
+    
+    /* Rows of 'surface' holding set_pixel writes that haven't
+     * reached the texture yet, as the range [begin, end). They
+     * are uploaded in one go before the texture is next used */
+    struct
+    {
+        int begin, end;
+    } pixelWrites;
+    
+    /* Raw access is open and 'commitRaw()' was called */
+    bool rawCommitted;
+    
+    /* Stale rows are read back asynchronously into a pixel pack
+     * buffer once per frame, and only copied into 'surface'
+     * when the pixels are actually accessed */
+    struct
+    {
+        PBO::ID pbo;
+        bool pending;
+        int begin, end;
+    } readback;
+    
     /* The 'tainted' area describes which parts of the
      * bitmap are not cleared, ie. don't have 0 opacity.
      * If we're blitting / drawing text to a cleared part
@@ -238,13 +575,45 @@ struct BitmapPrivate
      * ourselves the expensive blending calculation */
     pixman_region16_t tainted;
     
+    /* The tainted area covers the whole bitmap,
+     * further additions and queries are trivial */
+    bool fullyTainted;
+    
     BitmapPrivate(Bitmap *self)
     : self(self),
+    compressed(false),
+    texelBytes(4),
+    opaque(false),
+    mipmap(false),
+    uploadLink(this),
+    surfaceLink(this),
+    trackLink(this),
+    glShare(0),
     megaSurface(0),
-    surface(0)
+    surface(0),
+    generation(shState->genTimeStamp()),
+    maskGeneration(0),
+    fullyTainted(false)
     {
         format = SDL_AllocFormat(SDL_PIXELFORMAT_ABGR8888);
         
+        atlas.eligible = false;
+        atlas.wanted = false;
+        atlas.active = false;
+        
+        mipmaps.tex = 0;
+        mipmaps.generation = 0;
+        
+        upload.surf = 0;
+        upload.row = 0;
+        upload.pbo = UPBO::ID(0);
+        
+        stale.begin = stale.end = 0;
+        pixelWrites.begin = pixelWrites.end = 0;
+        rawCommitted = false;
+        readback.pbo = PBO::ID(0);
+        readback.pending = false;
+        
         animation.width = 0;
         animation.height = 0;
         animation.enabled = false;
@@ -254,29 +623,530 @@ struct BitmapPrivate
         animation.startTime = 0;
         animation.fps = 0;
         animation.lastFrame = 0;
-        
-        prepareCon = shState->prepareDraw.connect(&BitmapPrivate::prepare, this);
+        animation.gif = 0;
+        animation.gifData = 0;
         
         font = &shState->defaultFont();
         pixman_region_init(&tainted);
+        
+        track.drawn = false;
+        track.lastDraw = 0;
+        
+        if (shState->config().bitmapTracker)
+            trackedBitmaps.append(trackLink);
     }
     
     ~BitmapPrivate()
     {
-        prepareCon.disconnect();
+        endUpload();
+        
+        if (readback.pbo != PBO::ID(0))
+            PBO::del(readback.pbo);
+        
+        /* The texture is gone already */
+        pixelWrites.begin = pixelWrites.end = 0;
+        dropSurface();
+        
+        trackedBitmaps.remove(trackLink);
+        
         SDL_FreeFormat(format);
         pixman_region_fini(&tainted);
     }
     
+    /* Takes ownership of 'surf' */
+    void setMegaSurface(SDL_Surface *surf)
+    {
+        if (shState->config().streamMegaSurfaces)
+        {
+            SDL_Surface *mapped = MappedSurface::create(surf);
+            
+            if (mapped)
+            {
+                SDL_FreeSurface(surf);
+                surf = mapped;
+            }
+        }
+        
+        megaSurface = surf;
+        SDL_SetSurfaceBlendMode(megaSurface, SDL_BLENDMODE_NONE);
+    }
+    
     TEXFBO &getGLTypes() {
+        finishUpload();
+        
         return (animation.enabled) ? animation.currentFrame() : gl;
     }
     
-    void prepare()
+    /* Takes over 'surf' and uploads it to 'gl' over the next
+     * frames, if it is large enough to be worth it */
+    bool deferUpload(SDL_Surface *surf)
     {
-        if (!animation.enabled || !animation.playing) return;
+        const size_t budget = shState->config().textureUploadBudget;
+        
+        if (budget == 0 || (size_t) surf->pitch * surf->h < UPLOAD_DEFER_MIN)
+            return false;
+        
+        upload.surf = surf;
+        upload.row = 0;
+        pendingUploads.append(uploadLink);
+        
+        return true;
+    }
+    
+    /* Uploads up to 'budget' bytes worth of the next rows, at
+     * least one, and returns the bytes uploaded. 'staged' goes
+     * through the staging buffer, so the copy to the texture
+     * happens asynchronously instead of stalling the driver */
+    size_t uploadBand(size_t budget, bool staged)
+    {
+        SDL_Surface *surf = upload.surf;
+        const int left = surf->h - upload.row;
+        const int rows = std::max<int>(1, std::min<size_t>(budget / surf->pitch, left));
+        const size_t bytes = (size_t) rows * surf->pitch;
+        const uint8_t *src = (const uint8_t*) surf->pixels + upload.row * surf->pitch;
+        
+        TEX::bind(gl.tex);
+        
+        if (staged && ::gl.unpack_buffer)
+        {
+            if (upload.pbo == UPBO::ID(0))
+                upload.pbo = UPBO::gen();
+            
+            UPBO::bind(upload.pbo);
+            UPBO::uploadData(bytes, src, GL_STREAM_DRAW);
+            TEX::uploadSubImage(0, upload.row, surf->w, rows, 0, GL_RGBA);
+            UPBO::unbind();
+        }
+        else
+        {
+            TEX::uploadSubImage(0, upload.row, surf->w, rows, src, GL_RGBA);
+        }
+        
+        upload.row += rows;
+        
+        if (upload.row >= surf->h)
+            endUpload();
+        
+        return bytes;
+    }
+    
+    void finishUpload()
+    {
+        if (upload.surf)
+            uploadBand((size_t) upload.surf->pitch * upload.surf->h, false);
+        
+        flushPixels();
+    }
+    
+    /* Whether set_pixel can write row 'y' of 'surface' and
+     * leave the upload for later, ie. the row is up to date */
+    bool canDeferPixel(int y)
+    {
+        /* Nothing drawn yet, so a fresh (zeroed)
+         * surface matches the texture */
+        if (!surface && !pixman_region_not_empty(&tainted))
+            allocSurface();
+        
+        if (!surface)
+            return false;
+        
+        if (y >= stale.begin && y < stale.end)
+            return false;
+        
+        if (readback.pending && y >= readback.begin && y < readback.end)
+            return false;
+        
+        return true;
+    }
+    
+    /* Rows [begin, end) of 'surface' were written to */
+    void recordPixelWrite(int begin, int end)
+    {
+        if (pixelWrites.begin >= pixelWrites.end)
+        {
+            pixelWrites.begin = begin;
+            pixelWrites.end = end;
+            
+            requestPrepare();
+        }
+        else
+        {
+            pixelWrites.begin = std::min(pixelWrites.begin, begin);
+            pixelWrites.end = std::max(pixelWrites.end, end);
+        }
+    }
+    
+    void flushPixels()
+    {
+        if (pixelWrites.begin >= pixelWrites.end)
+            return;
+        
+        /* Whole rows, so the data is contiguous in 'surface' */
+        TEX::bind(gl.tex);
+        TEX::uploadSubImage(0, pixelWrites.begin, gl.width,
+                            pixelWrites.end - pixelWrites.begin,
+                            surfaceRow(pixelWrites.begin), GL_RGBA);
+        
+        pixelWrites.begin = pixelWrites.end = 0;
+    }
+    
+    void endUpload()
+    {
+        if (!upload.surf)
+            return;
+        
+        pendingUploads.remove(uploadLink);
+        
+        if (upload.pbo != UPBO::ID(0))
+            UPBO::del(upload.pbo);
+        
+        SDL_FreeSurface(upload.surf);
+        upload.surf = 0;
+        upload.pbo = UPBO::ID(0);
+    }
+    
+    /* Only enrolled while there are fills, pixel writes or
+     * stale rows pending, an atlas copy was asked for, or an
+     * animation is playing */
+    bool prepare()
+    {
+        flushPixels();
+        flushFills();
+        startReadback();
+        
+        if (atlas.wanted)
+            copyToAtlas();
+        
+        if (!animation.enabled || !animation.playing) return false;
+        
+        const unsigned int prevFrame = animation.currentFrameI();
         
         animation.updateTimer();
+        
+        const unsigned int frame = animation.currentFrameI();
+        
+        if (frame != prevFrame)
+            Scene::damageScreen();
+        
+        /* Decode ahead, so drawing the next frame only
+         * has to bind a texture that is already there */
+        if (animation.gif) {
+            const unsigned int next = frame + 1;
+            
+            animation.decodeFrame(frame, frame);
+            
+            if (next < animation.frames.size())
+                animation.decodeFrame(next, frame);
+            else if (animation.loop)
+                animation.decodeFrame(0, frame);
+        }
+        
+        return true;
+    }
+    
+    void copyToAtlas()
+    {
+        atlas.wanted = false;
+        
+        if (!atlas.eligible || atlas.active)
+            return;
+        
+        finishUpload();
+        
+        if (!shState->texPool().requestAtlas(gl.width, gl.height,
+                                             atlas.page, atlas.region))
+        {
+            /* Don't bother trying again */
+            atlas.eligible = false;
+            return;
+        }
+        
+        GLMeta::blitBegin(atlas.page);
+        GLMeta::blitSource(gl);
+        GLMeta::blitRectangle(IntRect(0, 0, gl.width, gl.height), atlas.region.pos());
+        GLMeta::blitEnd();
+        
+        atlas.active = true;
+    }
+    
+    /* To be called before touching the texture in any way
+     * other than recording fills; draws pending ones first */
+    void ensureUncompressed()
+    {
+        finishUpload();
+        flushFills();
+        decompress();
+    }
+    
+    /* As above, for writing to the texture in place */
+    void ensureWritable()
+    {
+        ensureUncompressed();
+        unshare();
+    }
+    
+    /* Gives up 'gl'; only the last bitmap sharing
+     * it returns the texture */
+    void releaseGL()
+    {
+        if (glShare && --*glShare > 0)
+        {
+            glShare = 0;
+            return;
+        }
+        
+        delete glShare;
+        glShare = 0;
+        
+        if (compressed)
+            TEX::del(gl.tex);
+        else
+            shState->texPool().release(gl);
+    }
+    
+    /* Trades a shared 'gl' for a copy of our own */
+    void unshare()
+    {
+        if (!glShare)
+            return;
+        
+        /* The others have let go of it already */
+        if (*glShare == 1)
+        {
+            delete glShare;
+            glShare = 0;
+            return;
+        }
+        
+        /* Ends up with a texture of our own anyway */
+        if (compressed)
+        {
+            decompress();
+            return;
+        }
+        
+        TEXFBO tex = shState->texPool().request(gl.width, gl.height);
+        
+        GLMeta::blitBegin(tex);
+        GLMeta::blitSource(gl);
+        GLMeta::blitRectangle(IntRect(0, 0, gl.width, gl.height), Vec2i());
+        GLMeta::blitEnd();
+        
+        releaseGL();
+        gl = tex;
+    }
+    
+    void decompress()
+    {
+        if (!compressed)
+            return;
+        
+        TEXFBO tex = shState->texPool().request(gl.width, gl.height);
+        
+        FloatRect texRect(0, 0, gl.width, gl.height);
+        
+        Quad &quad = shState->gpQuad();
+        quad.setTexPosRect(texRect, texRect);
+        quad.setColor(Vec4(1, 1, 1, 1));
+        
+        SimpleShader &shader = shState->shaders().simple;
+        shader.bind();
+        shader.setTranslation(Vec2i());
+        
+        FBO::bind(tex.fbo);
+        pushSetViewport(shader);
+        bindTexture(shader);
+        
+        blitQuad(quad);
+        
+        popViewport();
+        
+        releaseGL();
+        gl = tex;
+        compressed = false;
+        texelBytes = 4;
+    }
+    
+    void releaseAtlas()
+    {
+        atlas.eligible = false;
+        
+        if (!atlas.active)
+            return;
+        
+        shState->texPool().releaseAtlas(atlas.page, atlas.region);
+        atlas.active = false;
+    }
+    
+    void markStale(int y, int h)
+    {
+        if (!surface)
+            return;
+        
+        int begin = clamp(y, 0, gl.height);
+        int end = clamp(y + h, 0, gl.height);
+        
+        if (begin >= end)
+            return;
+        
+        if (stale.begin >= stale.end)
+        {
+            stale.begin = begin;
+            stale.end = end;
+        }
+        else
+        {
+            stale.begin = std::min(stale.begin, begin);
+            stale.end = std::max(stale.end, end);
+        }
+        
+        /* To be read back asynchronously */
+        requestPrepare();
+    }
+    
+    uint8_t *surfaceRow(int y)
+    {
+        return (uint8_t*) surface->pixels + y * surface->pitch;
+    }
+    
+    /* Queue a non-blocking read of the stale rows */
+    void startReadback()
+    {
+        if (!surface || stale.begin >= stale.end || animation.enabled)
+            return;
+        
+        if (!::gl.async_readback || readback.pending)
+            return;
+        
+        /* The read back rows replace those in 'surface' */
+        flushPixels();
+        
+        if (readback.pbo == PBO::ID(0))
+            readback.pbo = PBO::gen();
+        
+        readback.begin = stale.begin;
+        readback.end = stale.end;
+        
+        PBO::bind(readback.pbo);
+        PBO::allocEmpty((readback.end - readback.begin) * surface->pitch, GL_STREAM_READ);
+        
+        FBO::bind(gl.fbo);
+        ::gl.ReadPixels(0, readback.begin, gl.width, readback.end - readback.begin,
+                        GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        
+        PBO::unbind();
+        
+        readback.pending = true;
+        stale.begin = stale.end = 0;
+    }
+    
+    /* Bring 'surface' up to date with the texture */
+    void syncSurface()
+    {
+        if (!surface)
+            return;
+        
+        flushFills();
+        
+        if (readback.pending || stale.begin < stale.end)
+            flushPixels();
+        
+        if (readback.pending)
+        {
+            GLsizeiptr size = (readback.end - readback.begin) * surface->pitch;
+            
+            PBO::bind(readback.pbo);
+            void *data = ::gl.MapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+            
+            if (data)
+            {
+                memcpy(surfaceRow(readback.begin), data, size);
+                ::gl.UnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            }
+            else
+            {
+                /* Mapping failed, read the same rows synchronously */
+                markStale(readback.begin, readback.end - readback.begin);
+            }
+            
+            PBO::unbind();
+            readback.pending = false;
+        }
+        
+        /* Anything modified after the readback was queued
+         * has to be fetched synchronously */
+        if (stale.begin < stale.end)
+        {
+            FBO::bind(gl.fbo);
+            ::gl.ReadPixels(0, stale.begin, gl.width, stale.end - stale.begin,
+                            GL_RGBA, GL_UNSIGNED_BYTE, surfaceRow(stale.begin));
+            
+            stale.begin = stale.end = 0;
+        }
+    }
+    
+    /* Applies a solid fill to 'surface' as well, so the rows
+     * under it needn't be read back from the texture. Returns
+     * false if they have to be marked stale after all */
+    bool mirrorFill(const IntRect &rect, const Vec4 &color)
+    {
+        if (!surface)
+            return false;
+        
+        IntRect norm = normalizedRect(rect);
+        
+        /* The pending read predates the fill and would undo it */
+        if (readback.pending && norm.y < readback.end && norm.y + norm.h > readback.begin)
+            return false;
+        
+        const uint32_t pixel =
+            SDL_MapRGBA(format,
+                        (uint8_t) clamp<float>(color.x * 255.0f + 0.5f, 0, 255),
+                        (uint8_t) clamp<float>(color.y * 255.0f + 0.5f, 0, 255),
+                        (uint8_t) clamp<float>(color.z * 255.0f + 0.5f, 0, 255),
+                        (uint8_t) clamp<float>(color.w * 255.0f + 0.5f, 0, 255));
+        
+        SDL_FillRect(surface, &norm, pixel);
+        
+        return true;
+    }
+    
+    void buildAlphaMask()
+    {
+        SDL_Surface *src = megaSurface;
+        
+        /* One readback, after which masks of bitmaps
+         * that don't change are free to query */
+        if (!src)
+        {
+            ensureUncompressed();
+            
+            if (!surface)
+            {
+                allocSurface();
+                markStale(0, gl.height);
+            }
+            
+            syncSurface();
+            src = surface;
+        }
+        
+        const int stride = (src->w + 31) / 32;
+        const uint32_t amask = src->format->Amask;
+        
+        alphaMask.assign(stride * src->h, 0);
+        
+        for (int y = 0; y < src->h; ++y)
+        {
+            const uint32_t *row = (const uint32_t*) ((const uint8_t*) src->pixels + y * src->pitch);
+            uint32_t *bits = &alphaMask[y * stride];
+            
+            for (int x = 0; x < src->w; ++x)
+                if (row[x] & amask)
+                    bits[x / 32] |= 1u << (x % 32);
+        }
+        
+        maskGeneration = generation;
     }
     
     void allocSurface()
@@ -284,19 +1154,60 @@ struct BitmapPrivate
         surface = SDL_CreateRGBSurface(0, gl.width, gl.height, format->BitsPerPixel,
                                        format->Rmask, format->Gmask,
                                        format->Bmask, format->Amask);
+        
+        if (surface)
+            surfaceHolders.append(surfaceLink);
+    }
+    
+    /* Frees the RAM copy; it is read back
+     * from the texture when needed again */
+    void dropSurface()
+    {
+        if (!surface)
+            return;
+        
+        flushPixels();
+        surfaceHolders.remove(surfaceLink);
+        
+        SDL_FreeSurface(surface);
+        surface = 0;
+        
+        stale.begin = stale.end = 0;
+        readback.pending = false;
     }
     
     void clearTaintedArea()
     {
         pixman_region_fini(&tainted);
         pixman_region_init(&tainted);
+        fullyTainted = false;
     }
     
     void addTaintedArea(const IntRect &rect)
     {
+        if (fullyTainted)
+            return;
+        
         IntRect norm = normalizedRect(rect);
         pixman_region_union_rect
         (&tainted, &tainted, norm.x, norm.y, norm.w, norm.h);
+        
+        /* Many small draws fragment the region. Taking in more
+         * than was drawn only makes blits take the slow path */
+        if (pixman_region_n_rects(&tainted) > TAINT_MAX_RECTS)
+        {
+            const pixman_box16_t ext = *pixman_region_extents(&tainted);
+            
+            pixman_region_fini(&tainted);
+            pixman_region_init_rect(&tainted, ext.x1, ext.y1,
+                                    ext.x2 - ext.x1, ext.y2 - ext.y1);
+        }
+        
+        const pixman_box16_t *ext = pixman_region_extents(&tainted);
+        
+        fullyTainted = pixman_region_n_rects(&tainted) == 1 &&
+                       ext->x1 <= 0 && ext->y1 <= 0 &&
+                       ext->x2 >= gl.width && ext->y2 >= gl.height;
     }
     
     void substractTaintedArea(const IntRect &rect)
@@ -304,16 +1215,26 @@ struct BitmapPrivate
         if (!touchesTaintedArea(rect))
             return;
         
+        IntRect norm = normalizedRect(rect);
+        
         pixman_region16_t m_reg;
-        pixman_region_init_rect(&m_reg, rect.x, rect.y, rect.w, rect.h);
+        pixman_region_init_rect(&m_reg, norm.x, norm.y, norm.w, norm.h);
         
-        pixman_region_subtract(&tainted, &m_reg, &tainted);
+        pixman_region_subtract(&tainted, &tainted, &m_reg);
         
         pixman_region_fini(&m_reg);
+        
+        fullyTainted = false;
     }
     
     bool touchesTaintedArea(const IntRect &rect)
     {
+        if (fullyTainted)
+            return true;
+        
+        if (!pixman_region_not_empty(&tainted))
+            return false;
+        
         pixman_box16_t box;
         box.x1 = rect.x;
         box.y1 = rect.y;
@@ -328,6 +1249,9 @@ struct BitmapPrivate
     
     void bindTexture(ShaderBase &shader)
     {
+        finishUpload();
+        markDrawn();
+        
         if (animation.enabled) {
             TEXFBO cframe = animation.currentFrame();
             TEX::bind(cframe.tex);
@@ -338,43 +1262,220 @@ struct BitmapPrivate
         shader.setTexSize(Vec2i(gl.width, gl.height));
     }
     
+    void markDrawn()
+    {
+        if (!trackLink.next)
+            return;
+        
+        track.drawn = true;
+        track.lastDraw = shState->graphics().logicalFrame();
+    }
+    
+    /* Estimate, compressed textures take less */
+    size_t vramBytes() const
+    {
+        if (megaSurface)
+            return (size_t) megaWindow.tex.width * megaWindow.tex.height * 4;
+        
+        if (animation.enabled)
+        {
+            size_t bytes = 0;
+            
+            for (const TEXFBO &frame : animation.frames)
+                bytes += (size_t) frame.width * frame.height * 4;
+            
+            return bytes;
+        }
+        
+        return (size_t) gl.width * gl.height * texelBytes;
+    }
+    
     void bindFBO()
     {
+        finishUpload();
+        
         FBO::bind((animation.enabled) ? animation.currentFrame().fbo : gl.fbo);
     }
     
-    void pushSetViewport(ShaderBase &shader) const
+    void pushSetViewport(ShaderBase &shader) const
+    {
+        glState.viewport.pushSet(IntRect(0, 0, gl.width, gl.height));
+        shader.applyViewportProj();
+    }
+    
+    void popViewport() const
+    {
+        glState.viewport.pop();
+    }
+    
+    void blitQuad(Quad &quad)
+    {
+        glState.blend.pushSet(false);
+        quad.draw();
+        glState.blend.pop();
+    }
+    
+    /* Stretch blits a part of a mega surface, which has no
+     * texture: the source is streamed through the shared
+     * scratch texture in tiles, each drawn like a regular blt */
+    void bltFromMega(const IntRect &destRect, SDL_Surface *srcSurf,
+                     const IntRect &sourceRect, int opacity)
+    {
+        if (destRect.w <= 0 || destRect.h <= 0 || sourceRect.w <= 0 || sourceRect.h <= 0)
+            return;
+        
+        /* Source pixels per destination pixel */
+        const float sx = (float) sourceRect.w / destRect.w;
+        const float sy = (float) sourceRect.h / destRect.h;
+        
+        /* Destination pixels per tile, leaving room
+         * for the partial source pixels at the edges */
+        const int tileSrc = std::min(glState.caps.maxTexSize, MEGA_BLT_TILE) - 2;
+        const int stepX = std::max(1, (int) (tileSrc / sx));
+        const int stepY = std::max(1, (int) (tileSrc / sy));
+        
+        const int x0 = std::max(destRect.x, 0);
+        const int y0 = std::max(destRect.y, 0);
+        const int x1 = std::min(destRect.x + destRect.w, gl.width);
+        const int y1 = std::min(destRect.y + destRect.h, gl.height);
+        
+        const float normOpacity = (float) opacity / 255.0f;
+        
+        for (int y = y0; y < y1; y += stepY)
+            for (int x = x0; x < x1; x += stepX)
+            {
+                const IntRect tile(x, y, std::min(stepX, x1 - x), std::min(stepY, y1 - y));
+                
+                /* The exact source area, and the whole
+                 * pixels covering it that get uploaded */
+                const FloatRect src(sourceRect.x + (x - destRect.x) * sx,
+                                    sourceRect.y + (y - destRect.y) * sy,
+                                    tile.w * sx, tile.h * sy);
+                
+                const int ix = clamp((int) floorf(src.x), 0, srcSurf->w);
+                const int iy = clamp((int) floorf(src.y), 0, srcSurf->h);
+                const int iw = clamp((int) ceilf(src.x + src.w), 0, srcSurf->w) - ix;
+                const int ih = clamp((int) ceilf(src.y + src.h), 0, srcSurf->h) - iy;
+                
+                if (iw <= 0 || ih <= 0)
+                    continue;
+                
+                Vec2i gpTexSize;
+                shState->ensureTexSize(iw, ih, gpTexSize);
+                shState->bindTex();
+                
+                GLMeta::subRectImageUpload(srcSurf->w, ix, iy, 0, 0, iw, ih, srcSurf, GL_RGBA);
+                GLMeta::subRectImageEnd();
+                
+                const FloatRect texRect(src.x - ix, src.y - iy, src.w, src.h);
+                
+                Quad &quad = shState->gpQuad();
+                quad.setTexPosRect(texRect, tile);
+                quad.setColor(Vec4(1, 1, 1, normOpacity));
+                
+                if (opacity == 255 && !touchesTaintedArea(tile))
+                {
+                    SimpleShader &shader = shState->shaders().simple;
+                    shader.bind();
+                    shader.setTranslation(Vec2i());
+                    shader.setTexSize(gpTexSize);
+                    
+                    bindFBO();
+                    pushSetViewport(shader);
+                    blitQuad(quad);
+                    popViewport();
+                    
+                    continue;
+                }
+                
+                /* Same as the fragment pipeline in 'stretchBlt()' */
+                TEXFBO &gpTex = shState->gpTexFBO(tile.w, tile.h);
+                
+                GLMeta::blitBegin(gpTex);
+                GLMeta::blitSource(gl);
+                GLMeta::blitRectangle(tile, Vec2i());
+                GLMeta::blitEnd();
+                
+                FloatRect bltSubRect(texRect.x / gpTexSize.x,
+                                     texRect.y / gpTexSize.y,
+                                     (gpTexSize.x / texRect.w) * ((float) tile.w / gpTex.width),
+                                     (gpTexSize.y / texRect.h) * ((float) tile.h / gpTex.height));
+                
+                BltShader &shader = shState->shaders().blt;
+                shader.bind();
+                shader.setDestination(gpTex.tex);
+                shader.setSubRect(bltSubRect);
+                shader.setOpacity(normOpacity);
+                shader.setTexSize(gpTexSize);
+                
+                /* Blitting into the scratch FBO unbound our tile */
+                shState->bindTex();
+                bindFBO();
+                pushSetViewport(shader);
+                blitQuad(quad);
+                popViewport();
+            }
+    }
+    
+    /* Records a quad replacing the contents under it */
+    void recordFill(const FloatRect &rect, const Vec4 &color1, const Vec4 &color2,
+                    bool vertical)
     {
-        glState.viewport.pushSet(IntRect(0, 0, gl.width, gl.height));
-        shader.applyViewportProj();
+        /* The fill has to land on top of the image */
+        finishUpload();
+        unshare();
+        
+        if (pendingFills.size() >= FILL_BATCH_QUADS * 4)
+            flushFills();
+        
+        requestPrepare();
+        
+        pendingFills.resize(pendingFills.size() + 4);
+        Vertex *vert = &pendingFills[pendingFills.size() - 4];
+        
+        Quad::setPosRect(vert, rect);
+        
+        vert[0].color = color1;
+        vert[1].color = vertical ? color1 : color2;
+        vert[2].color = color2;
+        vert[3].color = vertical ? color2 : color1;
     }
     
-    void popViewport() const
+    void fillRect(const IntRect &rect,
+                  const Vec4 &color)
     {
-        glState.viewport.pop();
+        recordFill(normalizedRect(rect), color, color, false);
     }
     
-    void blitQuad(Quad &quad)
+    void flushFills()
     {
+        if (pendingFills.empty())
+            return;
+        
+        /* Can be reached halfway into a blit reading from us
+         * (via 'getGLTypes()'), so keep the bindings intact */
+        const FBO::ID drawFBO(glBindings.drawFBO);
+        const FBO::ID readFBO(glBindings.readFBO);
+        
+        SimpleColorShader &shader = shState->shaders().simpleColor;
+        shader.bind();
+        shader.setTranslation(Vec2i());
+        
+        FBO::bind(gl.fbo);
+        pushSetViewport(shader);
+        
         glState.blend.pushSet(false);
-        quad.draw();
+        shState->quadStream().draw(&pendingFills[0], pendingFills.size() / 4);
         glState.blend.pop();
-    }
-    
-    void fillRect(const IntRect &rect,
-                  const Vec4 &color)
-    {
-        bindFBO();
         
-        glState.scissorTest.pushSet(true);
-        glState.scissorBox.pushSet(normalizedRect(rect));
-        glState.clearColor.pushSet(color);
+        popViewport();
         
-        FBO::clear();
+        FBO::bind(drawFBO);
         
-        glState.clearColor.pop();
-        glState.scissorBox.pop();
-        glState.scissorTest.pop();
+        if (::gl.BlitFramebuffer)
+            FBO::bindRead(readFBO);
+        
+        pendingFills.clear();
     }
     
     static void ensureFormat(SDL_Surface *&surf, Uint32 format)
@@ -382,19 +1483,42 @@ struct BitmapPrivate
         if (surf->format->format == format)
             return;
         
-        SDL_Surface *surfConv = SDL_ConvertSurfaceFormat(surf, format, 0);
+        SDL_Surface *surfConv = 0;
+        
+        if (surf->w * surf->h >= CONVERT_PARALLEL_MIN)
+            surfConv = convertSurfaceParallel(surf, format);
+        
+        if (!surfConv)
+            surfConv = SDL_ConvertSurfaceFormat(surf, format, 0);
         SDL_FreeSurface(surf);
         surf = surfConv;
     }
     
-    void onModified(bool freeSurface = true)
+    void onModified(bool staleSurface = true)
     {
-        if (surface && freeSurface)
-        {
-            SDL_FreeSurface(surface);
-            surface = 0;
-        }
+        opaque = false;
+        releaseAtlas();
+        sourcePath.clear();
+        generation = shState->genTimeStamp();
+        
+        if (staleSurface)
+            markStale(0, gl.height);
+        
+        Scene::damageScreen();
+        self->modified();
+    }
+    
+    /* Only the rows covered by 'rect' changed */
+    void onModified(const IntRect &rect)
+    {
+        IntRect norm = normalizedRect(rect);
+        markStale(norm.y, norm.h);
+        opaque = false;
+        releaseAtlas();
+        sourcePath.clear();
+        generation = shState->genTimeStamp();
         
+        Scene::damageScreen();
         self->modified();
     }
 };
@@ -410,13 +1534,36 @@ struct BitmapOpenHandler : FileSystem::OpenHandler
     unsigned char *gif_data;
     size_t gif_data_size;
     
+    // Image cache
+    ImageCacheKey cacheKey;
+    bool haveCacheKey;
+    bool cacheHit;
     
     BitmapOpenHandler()
-    : surface(0), gif(0), gif_data(0), gif_data_size(0)
+    : surface(0), gif(0), gif_data(0), gif_data_size(0),
+    haveCacheKey(false), cacheHit(false)
     {}
     
+    bool tryPath(const char *fullPath)
+    {
+        if (!shState->config().imageCache)
+            return false;
+        
+        haveCacheKey = ImageCache::makeKey(fullPath, cacheKey);
+        
+        if (!haveCacheKey)
+            return false;
+        
+        surface = ImageCache::load(cacheKey);
+        cacheHit = (surface != 0);
+        
+        return cacheHit;
+    }
+    
     bool tryRead(SDL_RWops &ops, const char *ext)
     {
+        TRACE_ZONE("Image decode");
+        
         if (IMG_isGIF(&ops)) {
             // Use libnsgif to initialise the gif data
             gif = new gif_animation;
@@ -466,8 +1613,64 @@ struct BitmapOpenHandler : FileSystem::OpenHandler
     }
 };
 
-Bitmap::Bitmap(const char *filename)
+/* Looks for a pre-compressed copy of the image next to it, ie.
+ * 'Graphics/Pictures/foo.ktx2' for 'Graphics/Pictures/foo(.png)' */
+static bool loadCompressedImage(const char *filename, CompressedTex::Image &img)
+{
+    std::string path(filename);
+    
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+        path.erase(dot);
+    
+    path += ".ktx2";
+    
+    FileSystem &fs = shState->fileSystem();
+    
+    if (!fs.exists(path.c_str()))
+        return false;
+    
+    SDL_RWops ops;
+    fs.openReadRaw(ops, path.c_str());
+    
+    bool ok = CompressedTex::readKTX2(ops, img);
+    SDL_RWclose(&ops);
+    
+    if (!ok)
+    {
+        Debug() << "Ignoring unsupported KTX2 file" << path;
+        return false;
+    }
+    
+    if (!CompressedTex::supported(img.format))
+        return false;
+    
+    return img.width <= glState.caps.maxTexSize && img.height <= glState.caps.maxTexSize;
+}
+
+Bitmap::Bitmap(const char *filename, Storage storage)
 {
+    if (shState->config().textureCompression)
+    {
+        CompressedTex::Image img;
+        
+        if (loadCompressedImage(filename, img))
+        {
+            p = new BitmapPrivate(this);
+            p->gl.tex = CompressedTex::upload(img);
+            p->gl.width = img.width;
+            p->gl.height = img.height;
+            p->compressed = true;
+            
+            p->addTaintedArea(rect());
+            p->sourcePath = filename;
+            
+            return;
+        }
+    }
+    
     BitmapOpenHandler handler;
     shState->fileSystem().openRead(handler, filename);
     
@@ -530,61 +1733,224 @@ Bitmap::Bitmap(const char *filename)
         if (fcount > fcount_partial) {
             Debug() << "Non-fatal error reading" << filename << ": Only decoded" << fcount_partial << "out of" << fcount << "frames";
         }
-        for (int i = 0; i < fcount_partial; i++) {
-            if (i > 0) {
-                int status = gif_decode_frame(handler.gif, i);
-                if (status != GIF_OK && status != GIF_WORKING) {
-                    for (TEXFBO &frame : p->animation.frames)
-                        shState->texPool().release(frame);
-                    
-                    gif_finalise(handler.gif);
-                    delete handler.gif;
-                    delete handler.gif_data;
-                    
-                    throw Exception(Exception::MKXPError, "Failed to decode GIF frame %i out of %i (Status %i)",
-                                    i + 1, fcount_partial, status);
-                }
-            }
-            
-            TEXFBO texfbo;
-            try {
-                texfbo = shState->texPool().request(p->animation.width, p->animation.height);
-            }
-            catch (const Exception &e)
-            {
-                for (TEXFBO &frame : p->animation.frames)
-                    shState->texPool().release(frame);
-                
-                gif_finalise(handler.gif);
-                delete handler.gif;
-                delete handler.gif_data;
-                
-                throw e;
-            }
+        
+        /* Only the first frame is uploaded right away, the
+         * others are decoded as the animation reaches them */
+        p->animation.frames.resize(fcount_partial);
+        p->animation.gif = handler.gif;
+        p->animation.gifData = handler.gif_data;
+        
+        try {
+            p->animation.decodeFrame(0, 0);
+        }
+        catch (const Exception &e)
+        {
+            p->animation.closeGif();
             
-            TEX::bind(texfbo.tex);
-            TEX::uploadImage(p->animation.width, p->animation.height, handler.gif->frame_image, GL_RGBA);
-            p->animation.frames.push_back(texfbo);
+            throw e;
         }
         
+        p->addTaintedArea(rect());
+        return;
+    }
+    
+    SDL_Surface *imgSurf = handler.surface;
+    
+    BitmapPrivate::ensureFormat(imgSurf, SDL_PIXELFORMAT_ABGR8888);
+    
+    if (handler.haveCacheKey && !handler.cacheHit)
+        ImageCache::store(handler.cacheKey, imgSurf);
+    
+    initFromSurface(imgSurf, storage);
+    p->sourcePath = filename;
+}
+
+Bitmap::Bitmap(SDL_Surface *imgSurf, const char *filename, Storage storage)
+{
+    BitmapPrivate::ensureFormat(imgSurf, SDL_PIXELFORMAT_ABGR8888);
+    
+    initFromSurface(imgSurf, storage);
+    
+    if (filename)
+        p->sourcePath = filename;
+}
+
+SDL_Surface *Bitmap::decodeFile(const char *filename)
+{
+    BitmapOpenHandler handler;
+    shState->fileSystem().openRead(handler, filename);
+    
+    if (!handler.error.empty()) {
+        throw Exception(Exception::SDLError, "Error loading image '%s': %s", filename, handler.error.c_str());
+    }
+    else if (!handler.gif && !handler.surface) {
+        throw Exception(Exception::SDLError, "Error loading image '%s': %s",
+                        filename, SDL_GetError());
+    }
+    
+    if (handler.gif) {
+        /* Animations upload frames as they are decoded,
+         * so they can't be prepared off-thread */
         gif_finalise(handler.gif);
         delete handler.gif;
         delete handler.gif_data;
-        p->addTaintedArea(rect());
-        return;
+        
+        return 0;
     }
     
     SDL_Surface *imgSurf = handler.surface;
     
+    BitmapPrivate::ensureFormat(imgSurf, SDL_PIXELFORMAT_ABGR8888);
+    
+    if (handler.haveCacheKey && !handler.cacheHit)
+        ImageCache::store(handler.cacheKey, imgSurf);
+    
+    return imgSurf;
+}
+
+/* Whether all pixels of an ABGR8888 surface have full alpha.
+ * Transparent images usually give themselves away early on */
+static bool surfaceOpaque(SDL_Surface *surf)
+{
+    for (int y = 0; y < surf->h; ++y)
+    {
+        const uint32_t *row = (const uint32_t*) ((const uint8_t*) surf->pixels + y * surf->pitch);
+        
+        for (int x = 0; x < surf->w; ++x)
+            if ((row[x] & surf->format->Amask) != surf->format->Amask)
+                return false;
+    }
+    
+    return true;
+}
+
+enum ReducedFormat
+{
+    ReducedNone,
+    ReducedRGB565,
+    ReducedRGBA4444,
+    ReducedRed
+};
+
+static ReducedFormat reducedFormat(Bitmap::Storage storage, bool opaque)
+{
+    switch (storage)
+    {
+    case Bitmap::StorageFull :
+        return ReducedNone;
+    case Bitmap::StorageRedOnly :
+        return ReducedRed;
+    case Bitmap::StorageReduced :
+        return opaque ? ReducedRGB565 : ReducedRGBA4444;
+    case Bitmap::StorageAuto :
+        break;
+    }
+    
+    const int level = shState->config().textureReduction;
+    
+    if (level >= 1 && opaque)
+        return ReducedRGB565;
+    if (level >= 2)
+        return ReducedRGBA4444;
+    
+    return ReducedNone;
+}
+
+/* Packs an ABGR8888 surface into 'format' and uploads it to
+ * the bound texture. Returns the bytes per pixel stored */
+static int uploadReduced(SDL_Surface *surf, ReducedFormat format)
+{
+    const int texelBytes = (format == ReducedRed) ? 1 : 2;
+    std::vector<uint8_t> packed((size_t) surf->w * surf->h * texelBytes);
+    
+    for (int y = 0; y < surf->h; ++y)
+    {
+        const uint8_t *src = (const uint8_t*) surf->pixels + y * surf->pitch;
+        uint8_t *dst = &packed[(size_t) y * surf->w * texelBytes];
+        
+        for (int x = 0; x < surf->w; ++x, src += 4)
+        {
+            uint16_t value;
+            
+            switch (format)
+            {
+            case ReducedRed :
+                dst[x] = src[0];
+                continue;
+            case ReducedRGB565 :
+                value = (src[0] >> 3) << 11 | (src[1] >> 2) << 5 | (src[2] >> 3);
+                break;
+            default :
+                value = (src[0] >> 4) << 12 | (src[1] >> 4) << 8 | (src[2] >> 4) << 4 | (src[3] >> 4);
+                break;
+            }
+            
+            memcpy(dst + x * 2, &value, 2);
+        }
+    }
+    
+    GLenum internal, pixFormat, type;
+    
+    switch (format)
+    {
+    case ReducedRed :
+        internal = gl.tex_rg ? _GL_R8 : GL_LUMINANCE;
+        pixFormat = gl.tex_rg ? GL_RED : GL_LUMINANCE;
+        type = GL_UNSIGNED_BYTE;
+        break;
+    case ReducedRGB565 :
+        /* GLES only takes unsized formats here */
+        internal = gl.glsles ? GL_RGB : _GL_RGB5;
+        pixFormat = GL_RGB;
+        type = _GL_UNSIGNED_SHORT_5_6_5;
+        break;
+    default :
+        internal = gl.glsles ? GL_RGBA : _GL_RGBA4;
+        pixFormat = GL_RGBA;
+        type = _GL_UNSIGNED_SHORT_4_4_4_4;
+        break;
+    }
+    
+    TEX::setRepeat(false);
+    TEX::setSmooth(false);
+    
+    /* Rows aren't padded to 4 bytes */
+    gl.PixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    gl.TexImage2D(GL_TEXTURE_2D, 0, internal, surf->w, surf->h, 0, pixFormat, type, &packed[0]);
+    gl.PixelStorei(GL_UNPACK_ALIGNMENT, 4);
     
-    p->ensureFormat(imgSurf, SDL_PIXELFORMAT_ABGR8888);
+    ++glCounters.texUploads;
+    glCounters.texUploadBytes += packed.size();
+    
+    return texelBytes;
+}
+
+void Bitmap::initFromSurface(SDL_Surface *imgSurf, Storage storage)
+{
+    const bool mega = imgSurf->w > glState.caps.maxTexSize || imgSurf->h > glState.caps.maxTexSize;
+    const bool opaque = !mega && surfaceOpaque(imgSurf);
+    const ReducedFormat reduced = mega ? ReducedNone : reducedFormat(storage, opaque);
     
-    if (imgSurf->w > glState.caps.maxTexSize || imgSurf->h > glState.caps.maxTexSize)
+    if (mega)
     {
         /* Mega surface */
         p = new BitmapPrivate(this);
-        p->megaSurface = imgSurf;
-        SDL_SetSurfaceBlendMode(p->megaSurface, SDL_BLENDMODE_NONE);
+        p->setMegaSurface(imgSurf);
+    }
+    else if (reduced != ReducedNone)
+    {
+        /* Sample-only, like KTX2 textures */
+        p = new BitmapPrivate(this);
+        p->gl.tex = TEX::gen();
+        p->gl.width = imgSurf->w;
+        p->gl.height = imgSurf->h;
+        p->compressed = true;
+        p->opaque = opaque;
+        
+        TEX::bind(p->gl.tex);
+        p->texelBytes = uploadReduced(imgSurf, reduced);
+        
+        SDL_FreeSurface(imgSurf);
     }
     else
     {
@@ -603,16 +1969,36 @@ Bitmap::Bitmap(const char *filename)
         
         p = new BitmapPrivate(this);
         p->gl = tex;
+        p->opaque = opaque;
         
-        TEX::bind(p->gl.tex);
-        TEX::uploadImage(p->gl.width, p->gl.height, imgSurf->pixels, GL_RGBA);
+        /* The pooled texture already has storage of this size */
+        if (!p->deferUpload(imgSurf))
+        {
+            TEX::bind(p->gl.tex);
+            TEX::uploadImage(p->gl.width, p->gl.height, imgSurf->pixels, GL_RGBA);
+            
+            SDL_FreeSurface(imgSurf);
+        }
         
-        SDL_FreeSurface(imgSurf);
+        p->atlas.eligible = shState->config().textureAtlas;
     }
     
     p->addTaintedArea(rect());
 }
 
+Bitmap::Bitmap(SDL_Surface *imgSurf, const TEXFBO &tex, const char *filename)
+{
+    p = new BitmapPrivate(this);
+    p->gl = tex;
+    p->opaque = surfaceOpaque(imgSurf);
+    p->atlas.eligible = shState->config().textureAtlas;
+    p->sourcePath = filename;
+    
+    SDL_FreeSurface(imgSurf);
+    
+    p->addTaintedArea(rect());
+}
+
 Bitmap::Bitmap(int width, int height)
 {
     if (width <= 0 || height <= 0)
@@ -626,6 +2012,12 @@ Bitmap::Bitmap(int width, int height)
     clear();
 }
 
+Bitmap::Bitmap(const TEXFBO &tex)
+{
+    p = new BitmapPrivate(this);
+    p->gl = tex;
+}
+
 Bitmap::Bitmap(void *pixeldata, int width, int height)
 {
     SDL_Surface *surface = SDL_CreateRGBSurface(0, width, height, p->format->BitsPerPixel,
@@ -643,8 +2035,7 @@ Bitmap::Bitmap(void *pixeldata, int width, int height)
     if (surface->w > glState.caps.maxTexSize || surface->h > glState.caps.maxTexSize)
     {
         p = new BitmapPrivate(this);
-        p->megaSurface = surface;
-        SDL_SetSurfaceBlendMode(p->megaSurface, SDL_BLENDMODE_NONE);
+        p->setMegaSurface(surface);
     }
     else
     {
@@ -682,12 +2073,29 @@ Bitmap::Bitmap(const Bitmap &other, int frame)
     p = new BitmapPrivate(this);
     
     // TODO: Clean me up
-    if (!other.isAnimated() || frame >= -1) {
+    if (!other.isAnimated()) {
+        /* Copies are often made just to keep a reference, so
+         * the texture is shared until either side changes it */
+        BitmapPrivate *op = other.p;
+        op->finishUpload();
+        op->flushFills();
+        
+        if (!op->glShare)
+            op->glShare = new int(1);
+        
+        ++*op->glShare;
+        p->glShare = op->glShare;
+        p->gl = op->gl;
+        p->compressed = op->compressed;
+        p->texelBytes = op->texelBytes;
+        p->opaque = op->opaque;
+    }
+    else if (frame >= -1) {
         p->gl = shState->texPool().request(other.width(), other.height());
         
         GLMeta::blitBegin(p->gl);
         // Blit just the current frame of the other animated bitmap
-        if (!other.isAnimated() || frame == -1) {
+        if (frame == -1) {
             GLMeta::blitSource(other.getGLTypes());
         }
         else {
@@ -774,6 +2182,13 @@ bool Bitmap::isAnimated() const {
     return p->animation.enabled;
 }
 
+bool Bitmap::isOpaque() const
+{
+    guardDisposed();
+    
+    return p->opaque && !p->animation.enabled;
+}
+
 IntRect Bitmap::rect() const
 {
     guardDisposed();
@@ -812,96 +2227,39 @@ void Bitmap::stretchBlt(const IntRect &destRect,
     
     // Don't need this, right? This function is fine with megasurfaces it seems
     //GUARD_MEGA;
-    
-    if (source.isDisposed())
-        return;
-    
-    opacity = clamp(opacity, 0, 255);
-    
-    if (opacity == 0)
-        return;
-    
-    SDL_Surface *srcSurf = source.megaSurface();
-    
-    if (srcSurf && shState->config().subImageFix)
-    {
-        /* Blit from software surface, for broken GL drivers */
-        Vec2i gpTexSize;
-        shState->ensureTexSize(sourceRect.w, sourceRect.h, gpTexSize);
-        shState->bindTex();
-        
-        GLMeta::subRectImageUpload(srcSurf->w, sourceRect.x, sourceRect.y, 0, 0,
-                                   sourceRect.w, sourceRect.h, srcSurf, GL_RGBA);
-        GLMeta::subRectImageEnd();
-        
-        SimpleShader &shader = shState->shaders().simple;
-        shader.bind();
-        shader.setTranslation(Vec2i());
-        shader.setTexSize(gpTexSize);
-        
-        p->pushSetViewport(shader);
-        p->bindFBO();
-        
-        Quad &quad = shState->gpQuad();
-        quad.setTexRect(FloatRect(0, 0, sourceRect.w, sourceRect.h));
-        quad.setPosRect(destRect);
-        
-        p->blitQuad(quad);
-        p->popViewport();
-        
-        p->addTaintedArea(destRect);
-        p->onModified();
-        
+    
+    if (source.isDisposed())
         return;
-    }
-    else if (srcSurf)
+    
+    p->ensureWritable();
+    p->animation.decodeAll();
+    
+    /* Its texture is read while our FBO is bound */
+    source.p->flushFills();
+    
+    opacity = clamp(opacity, 0, 255);
+    
+    if (opacity == 0)
+        return;
+    
+    SDL_Surface *srcSurf = source.megaSurface();
+    
+    if (srcSurf)
     {
-        /* Blit from software surface */
-        /* Don't do transparent blits for now */
-        if (opacity < 255)
-            source.ensureNonMega();
-        
-        SDL_Rect srcRect = sourceRect;
-        SDL_Rect dstRect = destRect;
-        SDL_Rect btmRect = { 0, 0, width(), height() };
-        SDL_Rect bltRect;
-        
-        if (SDL_IntersectRect(&btmRect, &dstRect, &bltRect) != SDL_TRUE)
-            return;
+        p->bltFromMega(destRect, srcSurf, sourceRect, opacity);
         
-        int bpp;
-        Uint32 rMask, gMask, bMask, aMask;
-        SDL_PixelFormatEnumToMasks(SDL_PIXELFORMAT_ABGR8888,
-                                   &bpp, &rMask, &gMask, &bMask, &aMask);
-        SDL_Surface *blitTemp =
-        SDL_CreateRGBSurface(0, destRect.w, destRect.h, bpp, rMask, gMask, bMask, aMask);
-        
-        SDL_BlitScaled(srcSurf, &srcRect, blitTemp, 0);
-        
-        TEX::bind(getGLTypes().tex);
-        
-        if (bltRect.w == dstRect.w && bltRect.h == dstRect.h)
-        {
-            /* Dest rectangle lies within bounding box */
-            TEX::uploadSubImage(destRect.x, destRect.y,
-                                destRect.w, destRect.h,
-                                blitTemp->pixels, GL_RGBA);
-        }
-        else
-        {
-            /* Clipped blit */
-            GLMeta::subRectImageUpload(blitTemp->w, bltRect.x - dstRect.x, bltRect.y - dstRect.y,
-                                       bltRect.x, bltRect.y, bltRect.w, bltRect.h, blitTemp, GL_RGBA);
-            GLMeta::subRectImageEnd();
-        }
-        
-        SDL_FreeSurface(blitTemp);
+        p->addTaintedArea(destRect);
+        p->onModified(destRect);
         
-        p->onModified();
         return;
     }
     
-    if (opacity == 255 && !p->touchesTaintedArea(destRect))
+    /* An opaque source replaces what's under it, so
+     * there is nothing to blend with either way */
+    const bool replaces = opacity == 255 &&
+        (!p->touchesTaintedArea(destRect) || (source.isOpaque() && &source != this));
+    
+    if (replaces)
     {
         /* Fast blit */
         GLMeta::blitBegin(getGLTypes());
@@ -946,7 +2304,7 @@ void Bitmap::stretchBlt(const IntRect &destRect,
     }
     
     p->addTaintedArea(destRect);
-    p->onModified();
+    p->onModified(destRect);
 }
 
 void Bitmap::fillRect(int x, int y,
@@ -963,6 +2321,8 @@ void Bitmap::fillRect(const IntRect &rect, const Vec4 &color)
     GUARD_MEGA;
     GUARD_ANIMATED;
     
+    p->decompress();
+    
     p->fillRect(rect, color);
     
     if (color.w == 0)
@@ -972,7 +2332,11 @@ void Bitmap::fillRect(const IntRect &rect, const Vec4 &color)
     /* Fill op */
         p->addTaintedArea(rect);
     
-    p->onModified();
+    /* Keeps get_pixel from reading the rows back */
+    if (p->mirrorFill(rect, color))
+        p->onModified(false);
+    else
+        p->onModified(rect);
 }
 
 void Bitmap::gradientFillRect(int x, int y,
@@ -992,39 +2356,13 @@ void Bitmap::gradientFillRect(const IntRect &rect,
     GUARD_MEGA;
     GUARD_ANIMATED;
     
-    SimpleColorShader &shader = shState->shaders().simpleColor;
-    shader.bind();
-    shader.setTranslation(Vec2i());
-    
-    Quad &quad = shState->gpQuad();
-    
-    if (vertical)
-    {
-        quad.vert[0].color = color1;
-        quad.vert[1].color = color1;
-        quad.vert[2].color = color2;
-        quad.vert[3].color = color2;
-    }
-    else
-    {
-        quad.vert[0].color = color1;
-        quad.vert[3].color = color1;
-        quad.vert[1].color = color2;
-        quad.vert[2].color = color2;
-    }
-    
-    quad.setPosRect(rect);
-    
-    p->bindFBO();
-    p->pushSetViewport(shader);
-    
-    p->blitQuad(quad);
+    p->decompress();
     
-    p->popViewport();
+    p->recordFill(rect, color1, color2, vertical);
     
     p->addTaintedArea(rect);
     
-    p->onModified();
+    p->onModified(rect);
 }
 
 void Bitmap::clearRect(int x, int y, int width, int height)
@@ -1039,53 +2377,90 @@ void Bitmap::clearRect(const IntRect &rect)
     GUARD_MEGA;
     GUARD_ANIMATED;
     
+    p->decompress();
+    
     p->fillRect(rect, Vec4());
     
-    p->onModified();
+    if (p->mirrorFill(rect, Vec4()))
+        p->onModified(false);
+    else
+        p->onModified(rect);
 }
 
-void Bitmap::blur()
+void Bitmap::blur(int radius)
 {
     guardDisposed();
     
     GUARD_MEGA;
     GUARD_ANIMATED;
     
+    p->ensureWritable();
+    
     Quad &quad = shState->gpQuad();
     FloatRect rect(0, 0, width(), height());
     quad.setTexPosRect(rect, rect);
     
-    TEXFBO auxTex = shState->texPool().request(width(), height());
-    
-    BlurShader &shader = shState->shaders().blur;
-    BlurShader::HPass &pass1 = shader.pass1;
-    BlurShader::VPass &pass2 = shader.pass2;
+    TEXFBO auxTex = shState->texPool().request(width(), height(), TexPool::Intermediates);
     
     glState.blend.pushSet(false);
     glState.viewport.pushSet(IntRect(0, 0, width(), height()));
     
-    TEX::bind(p->gl.tex);
-    FBO::bind(auxTex.fbo);
-    
-    pass1.bind();
-    pass1.setTexSize(Vec2i(width(), height()));
-    pass1.applyViewportProj();
-    
-    quad.draw();
-    
-    TEX::bind(auxTex.tex);
-    p->bindFBO();
-    
-    pass2.bind();
-    pass2.setTexSize(Vec2i(width(), height()));
-    pass2.applyViewportProj();
-    
-    quad.draw();
+    if (radius <= 0) {
+        /* The classic 3x3 box blur */
+        BlurShader &shader = shState->shaders().blur;
+        BlurShader::HPass &pass1 = shader.pass1;
+        BlurShader::VPass &pass2 = shader.pass2;
+        
+        TEX::bind(p->gl.tex);
+        FBO::bind(auxTex.fbo);
+        
+        pass1.bind();
+        pass1.setTexSize(Vec2i(width(), height()));
+        pass1.applyViewportProj();
+        
+        quad.draw();
+        
+        TEX::bind(auxTex.tex);
+        p->bindFBO();
+        
+        pass2.bind();
+        pass2.setTexSize(Vec2i(width(), height()));
+        pass2.applyViewportProj();
+        
+        quad.draw();
+    } else {
+        radius = std::min<int>(radius, GaussianBlurShader::MaxRadius);
+        
+        GaussianBlurShader &shader = shState->shaders().gaussianBlur;
+        shader.bind();
+        shader.setTexSize(Vec2i(width(), height()));
+        shader.setRadius(radius);
+        shader.applyViewportProj();
+        
+        /* Linear filtering lets one fetch cover two texels */
+        TEX::bind(p->gl.tex);
+        TEX::setSmooth(true);
+        FBO::bind(auxTex.fbo);
+        
+        shader.setDirection(Vec2(1.0f / width(), 0));
+        quad.draw();
+        
+        TEX::setSmooth(false);
+        
+        TEX::bind(auxTex.tex);
+        TEX::setSmooth(true);
+        p->bindFBO();
+        
+        shader.setDirection(Vec2(0, 1.0f / height()));
+        quad.draw();
+        
+        TEX::setSmooth(false);
+    }
     
     glState.viewport.pop();
     glState.blend.pop();
     
-    shState->texPool().release(auxTex);
+    shState->texPool().release(auxTex, TexPool::Intermediates);
     
     p->onModified();
 }
@@ -1097,6 +2472,8 @@ void Bitmap::radialBlur(int angle, int divisions)
     GUARD_MEGA;
     GUARD_ANIMATED;
     
+    p->ensureUncompressed();
+    
     angle     = clamp<int>(angle, 0, 359);
     divisions = clamp<int>(divisions, 2, 100);
     
@@ -1104,83 +2481,39 @@ void Bitmap::radialBlur(int angle, int divisions)
     const int _height = height();
     
     float angleStep = (float) angle / (divisions-1);
-    float opacity   = 1.0f / divisions;
     float baseAngle = -((float) angle / 2);
     
-    ColorQuadArray qArray;
-    qArray.resize(5);
-    
-    std::vector<Vertex> &vert = qArray.vertices;
-    
-    int i = 0;
-    
-    /* Center */
-    FloatRect texRect(0, 0, _width, _height);
-    FloatRect posRect(0, 0, _width, _height);
-    
-    i += Quad::setTexPosRect(&vert[i*4], texRect, posRect);
-    
-    /* Upper */
-    posRect = FloatRect(0, 0, _width, -_height);
-    
-    i += Quad::setTexPosRect(&vert[i*4], texRect, posRect);
-    
-    /* Lower */
-    posRect = FloatRect(0, _height*2, _width, -_height);
-    
-    i += Quad::setTexPosRect(&vert[i*4], texRect, posRect);
-    
-    /* Left */
-    posRect = FloatRect(0, 0, -_width, _height);
-    
-    i += Quad::setTexPosRect(&vert[i*4], texRect, posRect);
-    
-    /* Right */
-    posRect = FloatRect(_width*2, 0, -_width, _height);
-    
-    i += Quad::setTexPosRect(&vert[i*4], texRect, posRect);
-    
-    for (int i = 0; i < 4*5; ++i)
-        vert[i].color = Vec4(1, 1, 1, opacity);
-    
-    qArray.commit();
+    /* All rotated copies are averaged in a single pass,
+     * mirroring the image beyond its edges */
+    Quad &quad = shState->gpQuad();
+    FloatRect rect(0, 0, _width, _height);
+    quad.setTexPosRect(rect, rect);
     
     TEXFBO newTex = shState->texPool().request(_width, _height);
     
     FBO::bind(newTex.fbo);
     
-    glState.clearColor.pushSet(Vec4());
-    FBO::clear();
-    
-    Transform trans;
-    trans.setOrigin(Vec2(_width / 2.0f, _height / 2.0f));
-    trans.setPosition(Vec2(_width / 2.0f, _height / 2.0f));
-    
-    glState.blendMode.pushSet(BlendAddition);
+    glState.blend.pushSet(false);
     
-    SimpleMatrixShader &shader = shState->shaders().simpleMatrix;
+    RadialBlurShader &shader = shState->shaders().radialBlur;
     shader.bind();
+    shader.setImageSize(Vec2i(_width, _height));
+    shader.setRotation(baseAngle, angleStep, divisions);
     
     p->bindTexture(shader);
     TEX::setSmooth(true);
     
     p->pushSetViewport(shader);
     
-    for (int i = 0; i < divisions; ++i)
-    {
-        trans.setRotation(baseAngle + i*angleStep);
-        shader.setMatrix(trans.getMatrix());
-        qArray.draw();
-    }
+    quad.draw();
     
     p->popViewport();
     
     TEX::setSmooth(false);
     
-    glState.blendMode.pop();
-    glState.clearColor.pop();
+    glState.blend.pop();
     
-    shState->texPool().release(p->gl);
+    p->releaseGL();
     p->gl = newTex;
     
     p->onModified();
@@ -1193,6 +2526,11 @@ void Bitmap::clear()
     GUARD_MEGA;
     GUARD_ANIMATED;
     
+    /* Would be cleared right away */
+    p->pendingFills.clear();
+    
+    p->ensureWritable();
+    
     p->bindFBO();
     
     glState.clearColor.pushSet(Vec4());
@@ -1203,7 +2541,19 @@ void Bitmap::clear()
     
     p->clearTaintedArea();
     
-    p->onModified();
+    /* The cached surface can simply be cleared along,
+     * anything still being read back is outdated */
+    if (p->surface)
+    {
+        memset(p->surface->pixels, 0, p->surface->pitch * p->surface->h);
+        p->stale.begin = p->stale.end = 0;
+        p->readback.pending = false;
+        p->onModified(false);
+    }
+    else
+    {
+        p->onModified();
+    }
 }
 
 static uint32_t &getPixelAt(SDL_Surface *surf, SDL_PixelFormat *form, int x, int y)
@@ -1221,22 +2571,19 @@ Color Bitmap::getPixel(int x, int y) const
     GUARD_MEGA;
     GUARD_ANIMATED;
     
+    p->ensureUncompressed();
+    
     if (x < 0 || y < 0 || x >= width() || y >= height())
         return Vec4();
     
     if (!p->surface)
     {
         p->allocSurface();
-        
-        FBO::bind(p->gl.fbo);
-        
-        glState.viewport.pushSet(IntRect(0, 0, width(), height()));
-        
-        gl.ReadPixels(0, 0, width(), height(), GL_RGBA, GL_UNSIGNED_BYTE, p->surface->pixels);
-        
-        glState.viewport.pop();
+        p->markStale(0, height());
     }
     
+    p->syncSurface();
+    
     uint32_t pixel = getPixelAt(p->surface, p->format, x, y);
     
     return Color((pixel >> p->format->Rshift) & 0xFF,
@@ -1245,6 +2592,25 @@ Color Bitmap::getPixel(int x, int y) const
                  (pixel >> p->format->Ashift) & 0xFF);
 }
 
+bool Bitmap::isSolidAt(int x, int y) const
+{
+    guardDisposed();
+    
+    if (x < 0 || y < 0 || x >= width() || y >= height())
+        return false;
+    
+    /* There are no masks of the individual frames */
+    if (p->animation.enabled)
+        return true;
+    
+    if (p->alphaMask.empty() || p->maskGeneration != p->generation)
+        p->buildAlphaMask();
+    
+    const int stride = (width() + 31) / 32;
+    
+    return (p->alphaMask[y * stride + x / 32] >> (x % 32)) & 1;
+}
+
 void Bitmap::setPixel(int x, int y, const Color &color)
 {
     guardDisposed();
@@ -1252,6 +2618,11 @@ void Bitmap::setPixel(int x, int y, const Color &color)
     GUARD_MEGA;
     GUARD_ANIMATED;
     
+    p->ensureWritable();
+    
+    if (x < 0 || y < 0 || x >= width() || y >= height())
+        return;
+    
     uint8_t pixel[] =
     {
         (uint8_t) clamp<double>(color.red,   0, 255),
@@ -1260,8 +2631,18 @@ void Bitmap::setPixel(int x, int y, const Color &color)
         (uint8_t) clamp<double>(color.alpha, 0, 255)
     };
     
-    TEX::bind(p->gl.tex);
-    TEX::uploadSubImage(x, y, 1, 1, &pixel, GL_RGBA);
+    /* Plotting scripts set thousands of pixels in a row; these
+     * are collected in the cached surface and uploaded together.
+     * Rows the surface doesn't hold yet are written directly */
+    const bool deferred = p->canDeferPixel(y);
+    
+    if (!deferred)
+    {
+        p->flushPixels();
+        
+        TEX::bind(p->gl.tex);
+        TEX::uploadSubImage(x, y, 1, 1, &pixel, GL_RGBA);
+    }
     
     p->addTaintedArea(IntRect(x, y, 1, 1));
     
@@ -1274,6 +2655,9 @@ void Bitmap::setPixel(int x, int y, const Color &color)
         surfPixel = SDL_MapRGBA(p->format, pixel[0], pixel[1], pixel[2], pixel[3]);
     }
     
+    if (deferred)
+        p->recordPixelWrite(y, y + 1);
+    
     p->onModified(false);
 }
 
@@ -1283,6 +2667,10 @@ bool Bitmap::getRaw(void *output, int output_size)
     
     guardDisposed();
     
+    p->ensureUncompressed();
+    
+    p->syncSurface();
+    
     if (!p->animation.enabled && (p->surface || p->megaSurface)) {
         void *src = (p->megaSurface) ? p->megaSurface->pixels : p->surface->pixels;
         memcpy(output, src, output_size);
@@ -1300,6 +2688,9 @@ void Bitmap::replaceRaw(void *pixel_data, int size)
     
     GUARD_MEGA;
     
+    p->ensureWritable();
+    p->animation.decodeAll();
+    
     int w = width();
     int h = height();
     int requiredsize = w*h*4;
@@ -1311,27 +2702,234 @@ void Bitmap::replaceRaw(void *pixel_data, int size)
     TEX::uploadImage(w, h, pixel_data, GL_RGBA);
     
     taintArea(IntRect(0,0,w,h));
+    
+    /* Cheaper than reading the same data back later */
+    if (p->surface)
+    {
+        memcpy(p->surface->pixels, pixel_data, requiredsize);
+        p->stale.begin = p->stale.end = 0;
+        p->readback.pending = false;
+        p->onModified(false);
+    }
+    else
+    {
+        p->onModified();
+    }
+}
+
+SDL_Surface *Bitmap::beginRawAccess()
+{
+    guardDisposed();
+    
+    GUARD_MEGA;
+    GUARD_ANIMATED;
+    
+    p->ensureWritable();
+    
+    if (!p->surface)
+    {
+        p->allocSurface();
+        
+        if (pixman_region_not_empty(&p->tainted))
+            p->markStale(0, height());
+    }
+    
+    p->syncSurface();
+    p->rawCommitted = false;
+    
+    /* The caller's reference */
+    p->surface->refcount++;
+    
+    return p->surface;
+}
+
+void Bitmap::commitRaw(int y, int h)
+{
+    guardDisposed();
+    
+    if (!p->surface)
+        return;
+    
+    const int begin = clamp(y, 0, height());
+    const int end = clamp(y + h, 0, height());
+    
+    p->rawCommitted = true;
+    
+    if (begin >= end)
+        return;
+    
+    p->recordPixelWrite(begin, end);
+    
+    taintArea(IntRect(0, begin, width(), end - begin));
+    p->onModified(false);
+}
+
+void Bitmap::endRawAccess(bool modified)
+{
+    if (isDisposed())
+        return;
+    
+    if (modified && !p->rawCommitted)
+        commitRaw(0, height());
+    
+    p->rawCommitted = false;
+}
+
+void Bitmap::notifyModified()
+{
+    taintArea(rect());
     p->onModified();
 }
 
 void Bitmap::saveToFile(const char *filename)
+{
+    SDL_Surface *surf = snapshot();
+    
+    std::string fn_normalized = shState->fileSystem().normalize(filename, 1, 1);
+    
+    try {
+        saveSurface(surf, fn_normalized.c_str());
+    } catch (const Exception &) {
+        SDL_FreeSurface(surf);
+        throw;
+    }
+    
+    SDL_FreeSurface(surf);
+}
+
+SDL_Surface *Bitmap::snapshot()
 {
     guardDisposed();
     
+    p->syncSurface();
+    
+    SDL_Surface *src = (p->surface) ? p->surface : p->megaSurface;
     SDL_Surface *surf;
     
-    if (p->surface || p->megaSurface) {
-        surf = (p->surface) ? p->surface : p->megaSurface;
+    if (src) {
+        surf = SDL_ConvertSurface(src, src->format, 0);
     }
     else {
         surf = SDL_CreateRGBSurface(0, width(), height(),p->format->BitsPerPixel, p->format->Rmask,p->format->Gmask,p->format->Bmask,p->format->Amask);
         
-        if (!surf)
-            throw Exception(Exception::SDLError, "Failed to prepare bitmap for saving: %s", SDL_GetError());
+        if (surf)
+            getRaw(surf->pixels, surf->w * surf->h * 4);
+    }
+    
+    if (!surf)
+        throw Exception(Exception::SDLError, "Failed to prepare bitmap for saving: %s", SDL_GetError());
+    
+    return surf;
+}
+
+/* Writes 'surf' in the QOI format, which encodes several
+ * times faster than PNG at a similar size for game art */
+static int saveQOI(SDL_Surface *surf, const char *filename)
+{
+    SDL_Surface *rgba = surf;
+    
+    if (surf->format->format != SDL_PIXELFORMAT_RGBA32) {
+        rgba = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGBA32, 0);
+        
+        if (!rgba)
+            return -1;
+    }
+    
+    const int w = rgba->w;
+    const int h = rgba->h;
+    
+    std::vector<uint8_t> out;
+    out.reserve(14 + (size_t) w * h + 8);
+    
+    const uint8_t header[14] = {
+        'q', 'o', 'i', 'f',
+        (uint8_t) (w >> 24), (uint8_t) (w >> 16), (uint8_t) (w >> 8), (uint8_t) w,
+        (uint8_t) (h >> 24), (uint8_t) (h >> 16), (uint8_t) (h >> 8), (uint8_t) h,
+        4, 0
+    };
+    out.insert(out.end(), header, header + sizeof(header));
+    
+    uint8_t index[64][4] = {};
+    uint8_t prev[4] = { 0, 0, 0, 255 };
+    int run = 0;
+    
+    for (int y = 0; y < h; ++y) {
+        const uint8_t *row = (const uint8_t*) rgba->pixels + y * rgba->pitch;
         
-        getRaw(surf->pixels, surf->w * surf->h * 4);
+        for (int x = 0; x < w; ++x) {
+            const uint8_t *px = row + x * 4;
+            const bool last = (y == h - 1 && x == w - 1);
+            
+            if (!memcmp(px, prev, 4)) {
+                if (++run == 62 || last) {
+                    out.push_back(0xC0 | (run - 1));
+                    run = 0;
+                }
+                
+                continue;
+            }
+            
+            if (run > 0) {
+                out.push_back(0xC0 | (run - 1));
+                run = 0;
+            }
+            
+            const int slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+            
+            if (!memcmp(index[slot], px, 4)) {
+                out.push_back(slot);
+            }
+            else {
+                memcpy(index[slot], px, 4);
+                
+                if (px[3] == prev[3]) {
+                    const int8_t vr = px[0] - prev[0];
+                    const int8_t vg = px[1] - prev[1];
+                    const int8_t vb = px[2] - prev[2];
+                    const int8_t vgr = vr - vg;
+                    const int8_t vgb = vb - vg;
+                    
+                    if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                        out.push_back(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                    }
+                    else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8) {
+                        out.push_back(0x80 | (vg + 32));
+                        out.push_back((vgr + 8) << 4 | (vgb + 8));
+                    }
+                    else {
+                        out.push_back(0xFE);
+                        out.insert(out.end(), px, px + 3);
+                    }
+                }
+                else {
+                    out.push_back(0xFF);
+                    out.insert(out.end(), px, px + 4);
+                }
+            }
+            
+            memcpy(prev, px, 4);
+        }
     }
     
+    static const uint8_t padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    out.insert(out.end(), padding, padding + sizeof(padding));
+    
+    if (rgba != surf)
+        SDL_FreeSurface(rgba);
+    
+    SDL_RWops *ops = SDL_RWFromFile(filename, "wb");
+    
+    if (!ops)
+        return -1;
+    
+    const size_t written = SDL_RWwrite(ops, out.data(), 1, out.size());
+    SDL_RWclose(ops);
+    
+    return (written == out.size()) ? 0 : -1;
+}
+
+void Bitmap::saveSurface(SDL_Surface *surf, const char *filename)
+{
     // Try and determine the intended image format from the filename extension
     const char *period = strrchr(filename, '.');
     int filetype = 0;
@@ -1348,25 +2946,27 @@ void Bitmap::saveToFile(const char *filename)
         else if (!ext.compare("jpg") || !ext.compare("jpeg")) {
             filetype = 2;
         }
+        else if (!ext.compare("qoi")) {
+            filetype = 3;
+        }
     }
     
-    std::string fn_normalized = shState->fileSystem().normalize(filename, 1, 1);
     int rc;
     switch (filetype) {
+        case 3:
+            rc = saveQOI(surf, filename);
+            break;
         case 2:
-            rc = IMG_SaveJPG(surf, fn_normalized.c_str(), 90);
+            rc = IMG_SaveJPG(surf, filename, 90);
             break;
         case 1:
-            rc = IMG_SavePNG(surf, fn_normalized.c_str());
+            rc = IMG_SavePNG(surf, filename);
             break;
         case 0: default:
-            rc = SDL_SaveBMP(surf, fn_normalized.c_str());
+            rc = SDL_SaveBMP(surf, filename);
             break;
     }
     
-    if (!p->surface && !p->megaSurface)
-        SDL_FreeSurface(surf);
-    
     if (rc) throw Exception(Exception::SDLError, "%s", SDL_GetError());
 }
 
@@ -1377,6 +2977,8 @@ void Bitmap::hueChange(int hue)
     GUARD_MEGA;
     GUARD_ANIMATED;
     
+    p->ensureUncompressed();
+    
     if ((hue % 360) == 0)
         return;
     
@@ -1403,10 +3005,13 @@ void Bitmap::hueChange(int hue)
     
     TEX::unbind();
     
-    shState->texPool().release(p->gl);
+    p->releaseGL();
     p->gl = newTex;
     
+    /* Only the colors change */
+    const bool opaque = p->opaque;
     p->onModified();
+    p->opaque = opaque;
 }
 
 void Bitmap::drawText(int x, int y,
@@ -1431,87 +3036,222 @@ static std::string fixupString(const char *str)
     return s;
 }
 
-static void applyShadow(SDL_Surface *&in, const SDL_PixelFormat &fm, const SDL_Color &c)
+/* Blends 'src' over the shadow pixel 'shd' (RGB taken as black) using
+ * the bitmap blit equation (see shader/bitmapBlit.frag). The result
+ * takes the font color 'c', as text pixels are only ever that color */
+static inline uint32_t shadowPixel(uint32_t src, uint32_t shd,
+                                   const SDL_PixelFormat &fm, const float *c)
+{
+    /* Input and shadow alpha values */
+    uint8_t srcA, shdA;
+    srcA = (src & fm.Amask) >> fm.Ashift;
+    shdA = (shd & fm.Amask) >> fm.Ashift;
+    
+    if (srcA == 255 || shdA == 0)
+        return src;
+    
+    float fSrcA = srcA / 255.0f;
+    float fShdA = shdA / 255.0f;
+    
+    /* Because opacity == 1, co1 == fSrcA */
+    float co2 = fShdA * (1.0f - fSrcA);
+    /* Result alpha */
+    float fa = fSrcA + co2;
+    /* Temp value to simplify arithmetic below */
+    float co3 = fSrcA / fa;
+    
+    /* Result colors */
+    uint32_t r, g, b, a;
+    
+    r = clamp<float>(c[0] * co3, 0, 1) * 255.0f;
+    g = clamp<float>(c[1] * co3, 0, 1) * 255.0f;
+    b = clamp<float>(c[2] * co3, 0, 1) * 255.0f;
+    a = clamp<float>(fa, 0, 1) * 255.0f;
+    
+    /* Text surfaces are always 8 bits per channel */
+    return (r << fm.Rshift) | (g << fm.Gshift) | (b << fm.Bshift) | (a << fm.Ashift);
+}
+
+/* 'shadowPixel()' over 'n' pixels, four at a time where possible.
+ * Computes the exact same values as the scalar version */
+static void shadowRow(uint32_t *out, const uint32_t *src, const uint32_t *shd,
+                      int n, const SDL_PixelFormat &fm, const float *c)
+{
+    int x = 0;
+    
+#if defined(SHADOW_SSE)
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+    const __m128i alphaMax = _mm_set1_epi32(255);
+    const __m128i zeroI = _mm_setzero_si128();
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128 fr = _mm_set1_ps(c[0]);
+    const __m128 fg = _mm_set1_ps(c[1]);
+    const __m128 fb = _mm_set1_ps(c[2]);
+    const __m128i rs = _mm_cvtsi32_si128(fm.Rshift);
+    const __m128i gs = _mm_cvtsi32_si128(fm.Gshift);
+    const __m128i bs = _mm_cvtsi32_si128(fm.Bshift);
+    const __m128i as = _mm_cvtsi32_si128(fm.Ashift);
+    
+    for (; x + 4 <= n; x += 4)
+    {
+        const __m128i sp = _mm_loadu_si128((const __m128i*) (src + x));
+        const __m128i dp = _mm_loadu_si128((const __m128i*) (shd + x));
+        
+        const __m128i srcA = _mm_and_si128(_mm_srl_epi32(sp, as), byteMask);
+        const __m128i shdA = _mm_and_si128(_mm_srl_epi32(dp, as), byteMask);
+        
+        const __m128 fSrcA = _mm_div_ps(_mm_cvtepi32_ps(srcA), scale);
+        const __m128 fShdA = _mm_div_ps(_mm_cvtepi32_ps(shdA), scale);
+        
+        const __m128 fa = _mm_add_ps(fSrcA, _mm_mul_ps(fShdA, _mm_sub_ps(one, fSrcA)));
+        /* Lanes with fa == 0 are replaced by 'src' below */
+        const __m128 co3 = _mm_div_ps(fSrcA, fa);
+        
+#define SHADOW_CHANNEL(v) \
+        _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(v, zero), one), scale))
+        
+        __m128i px = _mm_sll_epi32(SHADOW_CHANNEL(_mm_mul_ps(fr, co3)), rs);
+        px = _mm_or_si128(px, _mm_sll_epi32(SHADOW_CHANNEL(_mm_mul_ps(fg, co3)), gs));
+        px = _mm_or_si128(px, _mm_sll_epi32(SHADOW_CHANNEL(_mm_mul_ps(fb, co3)), bs));
+        px = _mm_or_si128(px, _mm_sll_epi32(SHADOW_CHANNEL(fa), as));
+        
+#undef SHADOW_CHANNEL
+        
+        const __m128i keep = _mm_or_si128(_mm_cmpeq_epi32(srcA, alphaMax),
+                                          _mm_cmpeq_epi32(shdA, zeroI));
+        
+        px = _mm_or_si128(_mm_and_si128(keep, sp), _mm_andnot_si128(keep, px));
+        _mm_storeu_si128((__m128i*) (out + x), px);
+    }
+#elif defined(SHADOW_NEON)
+    const uint32x4_t byteMask = vdupq_n_u32(0xFF);
+    const uint32x4_t alphaMax = vdupq_n_u32(255);
+    const uint32x4_t zeroI = vdupq_n_u32(0);
+    const float32x4_t zero = vdupq_n_f32(0);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t scale = vdupq_n_f32(255.0f);
+    const float32x4_t fr = vdupq_n_f32(c[0]);
+    const float32x4_t fg = vdupq_n_f32(c[1]);
+    const float32x4_t fb = vdupq_n_f32(c[2]);
+    const int32x4_t rs = vdupq_n_s32(fm.Rshift);
+    const int32x4_t gs = vdupq_n_s32(fm.Gshift);
+    const int32x4_t bs = vdupq_n_s32(fm.Bshift);
+    const int32x4_t as = vdupq_n_s32(fm.Ashift);
+    const int32x4_t asRight = vdupq_n_s32(-fm.Ashift);
+    
+    for (; x + 4 <= n; x += 4)
+    {
+        const uint32x4_t sp = vld1q_u32(src + x);
+        const uint32x4_t dp = vld1q_u32(shd + x);
+        
+        const uint32x4_t srcA = vandq_u32(vshlq_u32(sp, asRight), byteMask);
+        const uint32x4_t shdA = vandq_u32(vshlq_u32(dp, asRight), byteMask);
+        
+        const float32x4_t fSrcA = vdivq_f32(vcvtq_f32_u32(srcA), scale);
+        const float32x4_t fShdA = vdivq_f32(vcvtq_f32_u32(shdA), scale);
+        
+        /* Separate multiply and add, vmlaq would fuse them */
+        const float32x4_t fa = vaddq_f32(fSrcA, vmulq_f32(fShdA, vsubq_f32(one, fSrcA)));
+        const float32x4_t co3 = vdivq_f32(fSrcA, fa);
+        
+#define SHADOW_CHANNEL(v) \
+        vcvtq_u32_f32(vmulq_f32(vminq_f32(vmaxq_f32(v, zero), one), scale))
+        
+        uint32x4_t px = vshlq_u32(SHADOW_CHANNEL(vmulq_f32(fr, co3)), rs);
+        px = vorrq_u32(px, vshlq_u32(SHADOW_CHANNEL(vmulq_f32(fg, co3)), gs));
+        px = vorrq_u32(px, vshlq_u32(SHADOW_CHANNEL(vmulq_f32(fb, co3)), bs));
+        px = vorrq_u32(px, vshlq_u32(SHADOW_CHANNEL(fa), as));
+        
+#undef SHADOW_CHANNEL
+        
+        const uint32x4_t keep = vorrq_u32(vceqq_u32(srcA, alphaMax),
+                                          vceqq_u32(shdA, zeroI));
+        
+        vst1q_u32(out + x, vbslq_u32(keep, sp, px));
+    }
+#endif
+    
+    for (; x < n; ++x)
+        out[x] = shadowPixel(src[x], shd[x], fm, c);
+}
+
+/* Converts a freshly rendered text surface to ABGR8888. If 'scratchSlot'
+ * isn't negative, the result is only an intermediate step and goes
+ * into scratch memory instead of a new allocation */
+static void ensureTextFormat(SDL_Surface *&surf, int scratchSlot)
+{
+    if (surf->format->format == SDL_PIXELFORMAT_ABGR8888)
+        return;
+    
+    /* Paletted surfaces (solid text) need SDL to translate their colorkey */
+    if (scratchSlot < 0 || surf->format->BytesPerPixel != 4)
+    {
+        BitmapPrivate::ensureFormat(surf, SDL_PIXELFORMAT_ABGR8888);
+        return;
+    }
+    
+    SDL_Surface *conv = shState->fontState().scratchSurface(scratchSlot, surf->w, surf->h);
+    
+    SDL_ConvertPixels(surf->w, surf->h,
+                      surf->format->format, surf->pixels, surf->pitch,
+                      conv->format->format, conv->pixels, conv->pitch);
+    
+    SDL_FreeSurface(surf);
+    surf = conv;
+}
+
+static void applyShadow(SDL_Surface *&in, const SDL_PixelFormat &fm, const SDL_Color &c,
+                        int scratchSlot)
 {
-    SDL_Surface *out = SDL_CreateRGBSurface
-    (0, in->w+1, in->h+1, fm.BitsPerPixel, fm.Rmask, fm.Gmask, fm.Bmask, fm.Amask);
+    SDL_Surface *out;
+    
+    if (scratchSlot >= 0)
+        out = shState->fontState().scratchSurface(scratchSlot, in->w+1, in->h+1);
+    else
+        out = SDL_CreateRGBSurface
+        (0, in->w+1, in->h+1, fm.BitsPerPixel, fm.Rmask, fm.Gmask, fm.Bmask, fm.Amask);
     
-    float fr = c.r / 255.0f;
-    float fg = c.g / 255.0f;
-    float fb = c.b / 255.0f;
+    const float color[] = { c.r / 255.0f, c.g / 255.0f, c.b / 255.0f };
     
     /* We allocate an output surface one pixel wider and higher than the input,
      * (implicitly) blit a copy of the input with RGB values set to black into
      * it with x/y offset by 1, then blend the input surface over it at origin
-     * (0,0) using the bitmap blit equation (see shader/bitmapBlit.frag) */
+     * (0,0). Only the overlapping area needs actual blending */
+    
+    const int w = in->w;
+    const int h = in->h;
     
-    for (int y = 0; y < in->h+1; ++y)
-        for (int x = 0; x < in->w+1; ++x)
+    for (int y = 0; y < h+1; ++y)
+    {
+        uint32_t *outRow = (uint32_t*) ((uint8_t*) out->pixels + y*out->pitch);
+        
+        /* src: input row, shd: shadow row (offset by one) */
+        const uint32_t *src = (y < h) ? (uint32_t*) ((uint8_t*) in->pixels + y*in->pitch) : 0;
+        const uint32_t *shd = (y > 0) ? (uint32_t*) ((uint8_t*) in->pixels + (y-1)*in->pitch) : 0;
+        
+        if (!shd)
         {
-            /* src: input pixel, shd: shadow pixel */
-            uint32_t src = 0, shd = 0;
-            
-            /* Output pixel location */
-            uint32_t *outP = ((uint32_t*) ((uint8_t*) out->pixels + y*out->pitch)) + x;
-            
-            if (y < in->h && x < in->w)
-                src = ((uint32_t*) ((uint8_t*) in->pixels + y*in->pitch))[x];
-            
-            if (y > 0 && x > 0)
-                shd = ((uint32_t*) ((uint8_t*) in->pixels + (y-1)*in->pitch))[x-1];
-            
-            /* Set shadow pixel RGB values to 0 (black) */
-            shd &= fm.Amask;
-            
-            if (x == 0 || y == 0)
-            {
-                *outP = src;
-                continue;
-            }
-            
-            if (x == in->w || y == in->h)
-            {
-                *outP = shd;
-                continue;
-            }
-            
-            /* Input and shadow alpha values */
-            uint8_t srcA, shdA;
-            srcA = (src & fm.Amask) >> fm.Ashift;
-            shdA = (shd & fm.Amask) >> fm.Ashift;
-            
-            if (srcA == 255 || shdA == 0)
-            {
-                *outP = src;
-                continue;
-            }
-            
-            if (srcA == 0 && shdA == 0)
-            {
-                *outP = 0;
-                continue;
-            }
-            
-            float fSrcA = srcA / 255.0f;
-            float fShdA = shdA / 255.0f;
-            
-            /* Because opacity == 1, co1 == fSrcA */
-            float co2 = fShdA * (1.0f - fSrcA);
-            /* Result alpha */
-            float fa = fSrcA + co2;
-            /* Temp value to simplify arithmetic below */
-            float co3 = fSrcA / fa;
-            
-            /* Result colors */
-            uint8_t r, g, b, a;
+            memcpy(outRow, src, w * sizeof(uint32_t));
+            outRow[w] = 0;
+            continue;
+        }
+        
+        if (!src)
+        {
+            outRow[0] = 0;
             
-            r = clamp<float>(fr * co3, 0, 1) * 255.0f;
-            g = clamp<float>(fg * co3, 0, 1) * 255.0f;
-            b = clamp<float>(fb * co3, 0, 1) * 255.0f;
-            a = clamp<float>(fa, 0, 1) * 255.0f;
+            for (int x = 1; x < w+1; ++x)
+                outRow[x] = shd[x-1] & fm.Amask;
             
-            *outP = SDL_MapRGBA(&fm, r, g, b, a);
+            continue;
         }
+        
+        outRow[0] = src[0];
+        shadowRow(outRow + 1, src + 1, shd, w - 1, fm, color);
+        outRow[w] = shd[w-1] & fm.Amask;
+    }
     
     /* Store new surface in the input pointer */
     SDL_FreeSurface(in);
@@ -1525,6 +3265,11 @@ void Bitmap::drawText(const IntRect &rect, const char *str, int align)
     GUARD_MEGA;
     GUARD_ANIMATED;
     
+    p->ensureWritable();
+    
+    ProfileScope profile(Profiler::Text);
+    TRACE_ZONE("Bitmap::drawText");
+    
     std::string fixed = fixupString(str);
     str = fixed.c_str();
     
@@ -1543,43 +3288,67 @@ void Bitmap::drawText(const IntRect &rect, const char *str, int align)
     
     float txtAlpha = fontColor.norm.w;
     
-    SDL_Surface *txtSurf;
-    
-    if (p->font->isSolid())
-        txtSurf = TTF_RenderUTF8_Solid(font, str, c);
-    else
-        txtSurf = TTF_RenderUTF8_Blended(font, str, c);
+    SDL_Color co = outColor.toSDLColor();
+    co.a = 255;
     
-    p->ensureFormat(txtSurf, SDL_PIXELFORMAT_ABGR8888);
+    /* Message windows tend to redraw the same strings (or single
+     * characters) over and over, so reuse earlier rasterizations */
+    TextRenderKey key;
+    key.font = font;
+    key.style = TTF_GetFontStyle(font);
+    key.solid = p->font->isSolid();
+    key.shadow = p->font->getShadow();
+    key.outline = p->font->getOutline();
+    key.color = (c.r << 16) | (c.g << 8) | c.b;
+    key.outColor = key.outline ? ((co.r << 16) | (co.g << 8) | co.b) : 0;
+    key.text = str;
     
-    int rawTxtSurfH = txtSurf->h;
+    SharedFontState &fontState = shState->fontState();
     
-    if (p->font->getShadow())
-        applyShadow(txtSurf, *p->format, c);
+    int rawTxtSurfH;
+    SDL_Surface *txtSurf = fontState.findText(key, rawTxtSurfH);
+    bool ownedByCache = txtSurf != 0;
     
-    /* outline using TTF_Outline and blending it together with SDL_BlitSurface
-     * FIXME: outline is forced to have the same opacity as the font color */
-    if (p->font->getOutline())
+    if (!txtSurf)
     {
-        SDL_Color co = outColor.toSDLColor();
-        co.a = 255;
-        SDL_Surface *outline;
-        /* set the next font render to render the outline */
-        TTF_SetFontOutline(font, OUTLINE_SIZE);
         if (p->font->isSolid())
-            outline = TTF_RenderUTF8_Solid(font, str, co);
+            txtSurf = TTF_RenderUTF8_Solid(font, str, c);
         else
-            outline = TTF_RenderUTF8_Blended(font, str, co);
+            txtSurf = TTF_RenderUTF8_Blended(font, str, c);
         
-        p->ensureFormat(outline, SDL_PIXELFORMAT_ABGR8888);
-        SDL_Rect outRect = {OUTLINE_SIZE, OUTLINE_SIZE, txtSurf->w, txtSurf->h};
+        /* Steps followed by further ones go into scratch
+         * memory; only the final surface is allocated */
+        ensureTextFormat(txtSurf, (key.shadow || key.outline) ? 0 : -1);
         
-        SDL_SetSurfaceBlendMode(txtSurf, SDL_BLENDMODE_BLEND);
-        SDL_BlitSurface(txtSurf, NULL, outline, &outRect);
-        SDL_FreeSurface(txtSurf);
-        txtSurf = outline;
-        /* reset outline to 0 */
-        TTF_SetFontOutline(font, 0);
+        rawTxtSurfH = txtSurf->h;
+        
+        if (p->font->getShadow())
+            applyShadow(txtSurf, *p->format, c, key.outline ? 1 : -1);
+        
+        /* outline using TTF_Outline and blending it together with SDL_BlitSurface
+         * FIXME: outline is forced to have the same opacity as the font color */
+        if (p->font->getOutline())
+        {
+            SDL_Surface *outline;
+            /* set the next font render to render the outline */
+            TTF_SetFontOutline(font, OUTLINE_SIZE);
+            if (p->font->isSolid())
+                outline = TTF_RenderUTF8_Solid(font, str, co);
+            else
+                outline = TTF_RenderUTF8_Blended(font, str, co);
+        
+            ensureTextFormat(outline, -1);
+            SDL_Rect outRect = {OUTLINE_SIZE, OUTLINE_SIZE, txtSurf->w, txtSurf->h};
+        
+            SDL_SetSurfaceBlendMode(txtSurf, SDL_BLENDMODE_BLEND);
+            SDL_BlitSurface(txtSurf, NULL, outline, &outRect);
+            SDL_FreeSurface(txtSurf);
+            txtSurf = outline;
+            /* reset outline to 0 */
+            TTF_SetFontOutline(font, 0);
+        }
+        
+        ownedByCache = fontState.storeText(key, txtSurf, rawTxtSurfH);
     }
     
     int alignX = rect.x;
@@ -1678,17 +3447,27 @@ void Bitmap::drawText(const IntRect &rect, const char *str, int align)
         }
         else
         {
-            /* Squeezing involved: need to use intermediary TexFBO */
-            TEXFBO &gpTF = shState->gpTexFBO(txtSurf->w, txtSurf->h);
+            /* Squeezing involved: draw the text scaled straight
+             * into the bitmap, replacing what's underneath */
+            SimpleShader &shader = shState->shaders().simple;
+            shader.bind();
+            shader.setTranslation(Vec2i());
+            shader.setTexSize(gpTexSize);
             
-            TEX::bind(gpTF.tex);
+            shState->bindTex();
             TEX::uploadSubImage(0, 0, txtSurf->w, txtSurf->h, txtSurf->pixels, GL_RGBA);
+            TEX::setSmooth(true);
             
-            GLMeta::blitBegin(p->gl);
-            GLMeta::blitSource(gpTF);
-            GLMeta::blitRectangle(IntRect(0, 0, txtSurf->w, txtSurf->h),
-                                  posRect, true);
-            GLMeta::blitEnd();
+            Quad &quad = shState->gpQuad();
+            quad.setTexRect(FloatRect(0, 0, txtSurf->w, txtSurf->h));
+            quad.setPosRect(posRect);
+            
+            p->bindFBO();
+            p->pushSetViewport(shader);
+            
+            p->blitQuad(quad);
+            
+            p->popViewport();
         }
     }
     else
@@ -1730,54 +3509,42 @@ void Bitmap::drawText(const IntRect &rect, const char *str, int align)
         p->popViewport();
     }
     
-    SDL_FreeSurface(txtSurf);
+    if (!ownedByCache)
+        SDL_FreeSurface(txtSurf);
+    
     p->addTaintedArea(posRect);
     
-    p->onModified();
+    p->onModified(posRect);
 }
 
-/* http://www.lemoda.net/c/utf8-to-ucs2/index.html */
-static uint16_t utf8_to_ucs2(const char *_input,
-                             const char **end_ptr)
+int Bitmap::drawTextWrapped(const IntRect &rect, const char *str,
+                            int align, int lineHeight)
 {
-    const unsigned char *input =
-    reinterpret_cast<const unsigned char*>(_input);
-    *end_ptr = _input;
+    guardDisposed();
     
-    if (input[0] == 0)
-        return -1;
+    GUARD_MEGA;
+    GUARD_ANIMATED;
     
-    if (input[0] < 0x80)
-    {
-        *end_ptr = _input + 1;
-        
-        return input[0];
-    }
+    std::vector<std::string> lines;
+    p->font->layout(str, rect.w, lines);
     
-    if ((input[0] & 0xE0) == 0xE0)
-    {
-        if (input[1] == 0 || input[2] == 0)
-            return -1;
-        
-        *end_ptr = _input + 3;
-        
-        return (input[0] & 0x0F)<<12 |
-        (input[1] & 0x3F)<<6  |
-        (input[2] & 0x3F);
-    }
+    if (lineHeight <= 0)
+        lineHeight = TTF_FontHeight(p->font->getSdlFont());
+    
+    int drawn = 0;
     
-    if ((input[0] & 0xC0) == 0xC0)
+    for (size_t i = 0; i < lines.size(); ++i)
     {
-        if (input[1] == 0)
-            return -1;
+        const int y = rect.y + drawn * lineHeight;
         
-        *end_ptr = _input + 2;
+        if (y + lineHeight > rect.y + rect.h)
+            break;
         
-        return (input[0] & 0x1F)<<6  |
-        (input[1] & 0x3F);
+        drawText(IntRect(rect.x, y, rect.w, lineHeight), lines[i].c_str(), align);
+        ++drawn;
     }
     
-    return -1;
+    return drawn;
 }
 
 IntRect Bitmap::textSize(const char *str)
@@ -1792,7 +3559,16 @@ IntRect Bitmap::textSize(const char *str)
     std::string fixed = fixupString(str);
     str = fixed.c_str();
     
+    /* Window scripts measure the same words over and
+     * over for wrapping, so results are cached per font */
+    SharedFontState &fontState = shState->fontState();
+    const int style = TTF_GetFontStyle(font);
+    
     int w, h;
+    
+    if (fontState.findTextSize(font, style, fixed, w, h))
+        return IntRect(0, 0, w, h);
+    
     TTF_SizeUTF8(font, str, &w, &h);
     
     /* If str is one character long, *endPtr == 0 */
@@ -1804,6 +3580,8 @@ IntRect Bitmap::textSize(const char *str)
     if (p->font->getItalic() && *endPtr == '\0')
         TTF_GlyphMetrics(font, ucs2, 0, 0, 0, 0, &w);
     
+    fontState.storeTextSize(font, style, fixed, w, h);
+    
     return IntRect(0, 0, w, h);
 }
 
@@ -1821,11 +3599,34 @@ void Bitmap::setInitFont(Font *value)
 
 TEXFBO &Bitmap::getGLTypes() const
 {
+    p->ensureUncompressed();
+    
+    return p->getGLTypes();
+}
+
+const TEXFBO &Bitmap::getDrawTex() const
+{
+    p->markDrawn();
+    
     return p->getGLTypes();
 }
 
+std::string Bitmap::contentKey() const
+{
+    if (!p->sourcePath.empty())
+        return "file:" + p->sourcePath;
+    
+    char buf[32];
+    snprintf(buf, sizeof(buf), "gen:%u", p->generation);
+    
+    return buf;
+}
+
 SDL_Surface *Bitmap::surface() const
 {
+    p->ensureUncompressed();
+    p->syncSurface();
+    
     return p->surface;
 }
 
@@ -1834,6 +3635,59 @@ SDL_Surface *Bitmap::megaSurface() const
     return p->megaSurface;
 }
 
+bool Bitmap::getMegaWindow(const IntRect &region, const TEXFBO *&tex, Vec2i &offset)
+{
+    SDL_Surface *surf = p->megaSurface;
+    
+    if (!surf)
+        return false;
+    
+    IntRect &cur = p->megaWindow.region;
+    
+    const bool covered = cur.w > 0 &&
+        region.x >= cur.x && region.x + region.w <= cur.x + cur.w &&
+        region.y >= cur.y && region.y + region.h <= cur.y + cur.h;
+    
+    if (!covered)
+    {
+        const int maxSize = glState.caps.maxTexSize;
+        
+        IntRect next(region.x - MEGA_WINDOW_MARGIN, region.y - MEGA_WINDOW_MARGIN,
+                     region.w + MEGA_WINDOW_MARGIN * 2, region.h + MEGA_WINDOW_MARGIN * 2);
+        
+        next.w = std::min(next.w, std::min(maxSize, surf->w));
+        next.h = std::min(next.h, std::min(maxSize, surf->h));
+        next.x = clamp(next.x, 0, surf->w - next.w);
+        next.y = clamp(next.y, 0, surf->h - next.h);
+        
+        TEXFBO &win = p->megaWindow.tex;
+        
+        if (win.width < next.w || win.height < next.h)
+        {
+            const int w = std::max(win.width, next.w);
+            const int h = std::max(win.height, next.h);
+            
+            if (win.tex != TEX::ID(0))
+                shState->texPool().release(win);
+            
+            win = shState->texPool().request(w, h);
+        }
+        
+        TEX::bind(win.tex);
+        GLMeta::subRectImageUpload(surf->w, next.x, next.y, 0, 0,
+                                   next.w, next.h, surf, GL_RGBA);
+        GLMeta::subRectImageEnd();
+        
+        cur = next;
+    }
+    
+    tex = &p->megaWindow.tex;
+    offset = cur.pos();
+    p->markDrawn();
+    
+    return true;
+}
+
 void Bitmap::ensureNonMega() const
 {
     if (isDisposed())
@@ -1875,6 +3729,7 @@ void Bitmap::play()
     GUARD_UNANIMATED;
     if (p->animation.playing) return;
     p->animation.play();
+    p->requestPrepare();
 }
 
 bool Bitmap::isPlaying() const
@@ -1908,6 +3763,7 @@ void Bitmap::gotoAndPlay(int frame)
     p->animation.stop();
     p->animation.seek(frame);
     p->animation.play();
+    p->requestPrepare();
 }
 
 int Bitmap::numFrames() const
@@ -1932,6 +3788,9 @@ int Bitmap::addFrame(Bitmap &source, int position)
     
     GUARD_MEGA;
     
+    p->ensureWritable();
+    p->animation.decodeAll();
+    
     if (source.height() != height() || source.width() != width())
         throw Exception(Exception::MKXPError, "Animations with varying dimensions are not supported (%ix%i vs %ix%i)",
                         source.width(), source.height(), width(), height());
@@ -1952,16 +3811,14 @@ int Bitmap::addFrame(Bitmap &source, int position)
         
         p->animation.frames.push_back(p->gl);
         
-        if (p->surface)
-            SDL_FreeSurface(p->surface);
+        p->dropSurface();
         p->gl = TEXFBO();
     }
     
     if (source.surface()) {
         TEX::bind(newframe.tex);
         TEX::uploadImage(source.width(), source.height(), source.surface()->pixels, GL_RGBA);
-        SDL_FreeSurface(p->surface);
-        p->surface = 0;
+        p->dropSurface();
     }
     else {
         GLMeta::blitBegin(newframe);
@@ -1972,6 +3829,8 @@ int Bitmap::addFrame(Bitmap &source, int position)
     
     int ret;
     
+    Scene::damageScreen();
+    
     if (position < 0) {
         p->animation.frames.push_back(newframe);
         ret = (int)p->animation.frames.size();
@@ -1989,7 +3848,10 @@ void Bitmap::removeFrame(int position) {
     
     GUARD_UNANIMATED;
     
+    p->animation.decodeAll();
+    
     int pos = (position < 0) ? (int)p->animation.frames.size() - 1 : clamp(position, 0, (int)(p->animation.frames.size() - 1));
+    Scene::damageScreen();
     shState->texPool().release(p->animation.frames[pos]);
     p->animation.frames.erase(p->animation.frames.begin() + pos);
     
@@ -2017,6 +3879,8 @@ void Bitmap::nextFrame()
     GUARD_UNANIMATED;
     
     stop();
+    Scene::damageScreen();
+    
     if ((uint32_t)p->animation.lastFrame >= p->animation.frames.size() - 1)  {
         if (!p->animation.loop) return;
         p->animation.lastFrame = 0;
@@ -2033,6 +3897,8 @@ void Bitmap::previousFrame()
     GUARD_UNANIMATED;
     
     stop();
+    Scene::damageScreen();
+    
     if (p->animation.lastFrame <= 0) {
         if (!p->animation.loop) {
             p->animation.lastFrame = 0;
@@ -2054,11 +3920,17 @@ void Bitmap::setAnimationFPS(float FPS)
     bool restart = p->animation.playing;
     p->animation.stop();
     p->animation.fps = (FPS < 0) ? 0 : FPS;
-    if (restart) p->animation.play();
+    if (restart)
+    {
+        p->animation.play();
+        p->requestPrepare();
+    }
 }
 
 std::vector<TEXFBO> &Bitmap::getFrames() const
 {
+    p->animation.decodeAll();
+    
     return p->animation.frames;
 }
 
@@ -2094,6 +3966,172 @@ void Bitmap::bindTex(ShaderBase &shader)
     p->bindTexture(shader);
 }
 
+bool Bitmap::wantsMipmaps(float zoom) const
+{
+    if (zoom >= 1 || !gl.npot_mipmap)
+        return false;
+    
+    if (!p->mipmap && zoom > shState->config().mipmapZoom)
+        return false;
+    
+    /* Compressed textures can't have mipmaps generated */
+    return !p->animation.enabled && !p->compressed && !p->megaSurface;
+}
+
+bool Bitmap::bindTexZoomed(ShaderBase &shader, float zoom)
+{
+    p->bindTexture(shader);
+    
+    /* Pending fills can't be drawn in the middle of a draw */
+    if (!wantsMipmaps(zoom) || !p->pendingFills.empty())
+        return false;
+    
+    if (p->mipmaps.tex != p->gl.tex.gl || p->mipmaps.generation != p->generation)
+    {
+        gl.GenerateMipmap(GL_TEXTURE_2D);
+        
+        p->mipmaps.tex = p->gl.tex.gl;
+        p->mipmaps.generation = p->generation;
+    }
+    
+    TEX::setMipmapped();
+    
+    return true;
+}
+
+void Bitmap::setMipmap(bool value)
+{
+    guardDisposed();
+    
+    p->mipmap = value;
+}
+
+bool Bitmap::getMipmap() const
+{
+    guardDisposed();
+    
+    return p->mipmap;
+}
+
+void Bitmap::streamUploads()
+{
+    const size_t budget = (size_t) shState->config().textureUploadBudget * 1024;
+    size_t used = 0;
+    
+    while (!pendingUploads.isEmpty() && used < budget)
+        used += pendingUploads.begin()->data->uploadBand(budget - used, true);
+}
+
+void Bitmap::dropSurfaces()
+{
+    IntruListLink<BitmapPrivate> *iter = surfaceHolders.begin();
+    
+    while (iter != surfaceHolders.end())
+    {
+        BitmapPrivate *bp = iter->data;
+        iter = iter->next;
+        
+        /* Still handed out through 'beginRawAccess()' */
+        if (bp->surface->refcount > 1)
+            continue;
+        
+        bp->dropSurface();
+    }
+}
+
+bool Bitmap::trackingEnabled()
+{
+    return shState->config().bitmapTracker;
+}
+
+void Bitmap::setTrackOrigin(const std::string &origin)
+{
+    /* Not modified yet, so this is still the file loaded */
+    p->track.filename = p->sourcePath;
+    p->track.origin = origin;
+}
+
+static bool largerFirst(const Bitmap::TrackInfo &a, const Bitmap::TrackInfo &b)
+{
+    return a.bytes > b.bytes;
+}
+
+void Bitmap::trackReport(std::vector<TrackInfo> &out)
+{
+    out.clear();
+    
+    for (IntruListLink<BitmapPrivate> *iter = trackedBitmaps.begin();
+         iter != trackedBitmaps.end(); iter = iter->next)
+    {
+        BitmapPrivate *bp = iter->data;
+        TrackInfo info;
+        
+        info.width = bp->self->width();
+        info.height = bp->self->height();
+        info.bytes = bp->vramBytes();
+        info.shared = bp->glShare && *bp->glShare > 1;
+        info.filename = bp->track.filename;
+        info.origin = bp->track.origin;
+        info.lastDraw = bp->track.drawn ? (int) bp->track.lastDraw : -1;
+        
+        out.push_back(info);
+    }
+    
+    std::sort(out.begin(), out.end(), largerFirst);
+}
+
+void Bitmap::dumpTrackReport()
+{
+    if (!trackingEnabled())
+        return;
+    
+    std::vector<TrackInfo> report;
+    trackReport(report);
+    
+    size_t total = 0;
+    
+    for (size_t i = 0; i < report.size(); ++i)
+        total += report[i].bytes;
+    
+    Debug() << "Live bitmaps:" << report.size() << "using" << total / 1024 << "KiB";
+    
+    for (size_t i = 0; i < report.size(); ++i)
+    {
+        const TrackInfo &info = report[i];
+        
+        std::string line = std::to_string(info.width) + "x" + std::to_string(info.height)
+            + ", " + std::to_string(info.bytes / 1024) + " KiB, "
+            + (info.filename.empty() ? "(no file)" : info.filename)
+            + (info.lastDraw < 0 ? ", never drawn"
+                                 : ", last drawn on frame " + std::to_string(info.lastDraw));
+        
+        Debug() << line;
+        
+        if (!info.origin.empty())
+            Debug() << info.origin;
+    }
+}
+
+bool Bitmap::getAtlasTex(const TEXFBO *&page, Vec2i &offset)
+{
+    if (!p->atlas.eligible || p->animation.enabled)
+        return false;
+    
+    if (!p->atlas.active)
+    {
+        /* Can't touch GL state mid-draw, defer until next prepare */
+        p->atlas.wanted = true;
+        p->requestPrepare();
+        return false;
+    }
+    
+    page = &p->atlas.page;
+    offset = p->atlas.region.pos();
+    p->markDrawn();
+    
+    return true;
+}
+
 void Bitmap::taintArea(const IntRect &rect)
 {
     p->addTaintedArea(rect);
@@ -2123,16 +4161,24 @@ bool Bitmap::invalid() const {
 
 void Bitmap::releaseResources()
 {
-    if (p->megaSurface)
-        SDL_FreeSurface(p->megaSurface);
+    p->releaseAtlas();
+    
+    if (p->megaSurface) {
+        MappedSurface::free(p->megaSurface);
+        
+        if (p->megaWindow.tex.tex != TEX::ID(0))
+            shState->texPool().release(p->megaWindow.tex);
+    }
     else if (p->animation.enabled) {
         p->animation.enabled = false;
         p->animation.playing = false;
+        p->animation.closeGif();
         for (TEXFBO &tex : p->animation.frames)
-            shState->texPool().release(tex);
+            if (tex.tex != TEX::ID(0))
+                shState->texPool().release(tex);
     }
     else
-        shState->texPool().release(p->gl);
+        p->releaseGL();
     
     delete p;
 }
@@ -28,6 +28,9 @@
 
 #include "sigslot/signal.hpp"
 
+#include <string>
+#include <vector>
+
 class Font;
 class ShaderBase;
 struct TEXFBO;
@@ -38,9 +41,33 @@ struct BitmapPrivate;
 class Bitmap : public Disposable
 {
 public:
-	Bitmap(const char *filename);
+	/* How the texture of an image loaded from a file is stored.
+	 * Anything but full precision is sample-only, and expanded
+	 * to RGBA8 on the first operation writing to it */
+	enum Storage
+	{
+		/* As the 'textureReduction' setting says */
+		StorageAuto,
+		StorageFull,
+		/* RGB565 if opaque, RGBA4444 otherwise */
+		StorageReduced,
+		/* Only the red channel, eg. for transition maps */
+		StorageRedOnly
+	};
+
+	Bitmap(const char *filename, Storage storage = StorageAuto);
 	Bitmap(int width, int height);
     Bitmap(void *pixeldata, int width, int height);
+	/* Takes ownership of 'tex', which must be
+	 * a TexPool object of the Bitmaps category */
+	explicit Bitmap(const TEXFBO &tex);
+	/* Takes ownership of an image returned by 'decodeFile()',
+	 * which was decoded from 'filename' if given */
+	explicit Bitmap(SDL_Surface *imgSurf, const char *filename = 0,
+	                Storage storage = StorageAuto);
+	/* Same, with the pixels of 'imgSurf' already uploaded
+	 * into 'tex' (which it takes ownership of as well) */
+	Bitmap(SDL_Surface *imgSurf, const TEXFBO &tex, const char *filename);
 	/* Clone constructor */
     
     // frame is -2 for "any and all", -1 for "current", anything else for a specific frame
@@ -51,6 +78,9 @@ public:
 	int height() const;
 	bool isMega() const;
     bool isAnimated() const;
+    
+    /* Every pixel is known to be fully opaque (see 'Sprite::occludesScene()') */
+    bool isOpaque() const;
 
 	IntRect rect() const;
 
@@ -79,17 +109,45 @@ public:
 	               int width, int height);
 	void clearRect(const IntRect &rect);
 
-	void blur();
+	/* A radius of 0 applies the classic 3x3 box blur,
+	 * anything above a gaussian blur of that radius */
+	void blur(int radius = 0);
 	void radialBlur(int angle, int divisions);
 
 	void clear();
 
 	Color getPixel(int x, int y) const;
+
+	/* Whether the pixel isn't fully transparent, for hit tests.
+	 * Looked up in a bit mask made on first use after every
+	 * modification, so repeated tests never read back. Animated
+	 * bitmaps count as solid everywhere */
+	bool isSolidAt(int x, int y) const;
 	void setPixel(int x, int y, const Color &color);
     
     bool getRaw(void *output, int output_size);
     void replaceRaw(void *pixel_data, int size);
+    
+    /* Direct access to the pixels through the cached client
+     * surface (RGBA, 'width * 4' bytes per row). The caller
+     * holds a reference on the returned surface and drops it
+     * with SDL_FreeSurface(), so the memory stays valid even if
+     * the bitmap lets go of it. Writes reach the texture through
+     * 'commitRaw()' (a range of rows); 'endRawAccess()' commits
+     * everything if 'modified' is set and nothing was committed.
+     * Drawing to the bitmap in between may discard uncommitted
+     * writes */
+    SDL_Surface *beginRawAccess();
+    void commitRaw(int y, int h);
+    void endRawAccess(bool modified);
     void saveToFile(const char *filename);
+    
+    /* Copy of the current contents, owned by the caller */
+    SDL_Surface *snapshot();
+    
+    /* Encodes 'surf' to 'filename' (a normalized path), picking the
+     * format by extension. Doesn't touch GL, may run on any thread */
+    static void saveSurface(SDL_Surface *surf, const char *filename);
 
 	void hueChange(int hue);
 
@@ -107,6 +165,12 @@ public:
 	void drawText(const IntRect &rect,
 	              const char *str, int align = Left);
 
+	/* Draws 'str' broken into lines by Font::layout(), one
+	 * every 'lineHeight' pixels (the font height if 0), as far
+	 * as they fit into 'rect'. Returns the number drawn */
+	int drawTextWrapped(const IntRect &rect, const char *str,
+	                    int align = Left, int lineHeight = 0);
+
 	IntRect textSize(const char *str);
 
 	DECL_ATTR(Font, Font&)
@@ -117,8 +181,17 @@ public:
 
 	/* <internal> */
 	TEXFBO &getGLTypes() const;
+	/* For sampling only, doesn't expand compressed textures,
+	 * so the FBO may be null. Safe to call mid-draw */
+	const TEXFBO &getDrawTex() const;
     SDL_Surface *surface() const;
 	SDL_Surface *megaSurface() const;
+
+	/* For displaying a mega surface: a texture holding (at
+	 * least) 'region' of it, placed at 'offset'. Only the
+	 * area asked for last is kept, plus a margin around it.
+	 * Returns false if this isn't a mega surface */
+	bool getMegaWindow(const IntRect &region, const TEXFBO *&tex, Vec2i &offset);
 	void ensureNonMega() const;
     void ensureNonAnimated() const;
     void ensureAnimated() const;
@@ -152,6 +225,33 @@ public:
 	 * texture size uniform in shader */
 	void bindTex(ShaderBase &shader);
 
+	/* As above, for a draw scaled down to 'zoom'. If that
+	 * calls for mipmaps (see 'mipmap'), they are brought up
+	 * to date and trilinear filtering is set, which the
+	 * caller undoes with TEX::setSmooth(false) after the
+	 * draw; returns whether it did */
+	bool bindTexZoomed(ShaderBase &shader, float zoom);
+
+	/* Whether a draw at 'zoom' would use mipmaps */
+	bool wantsMipmaps(float zoom) const;
+
+	/* Sample from mipmaps whenever drawn below full size,
+	 * not only at the configured 'mipmapZoom' */
+	DECL_ATTR(Mipmap, bool)
+
+	/* Identifies the current contents. Bitmaps freshly loaded
+	 * from the same image file share the same key, while any
+	 * modification gives a bitmap a key never used before */
+	std::string contentKey() const;
+
+	/* Call after drawing into the FBO from getGLTypes()
+	 * directly, so cached surfaces and keys are dropped */
+	void notifyModified();
+
+	/* If a copy of this bitmap is available in a shared atlas
+	 * page, returns the page and the copy's offset within it */
+	bool getAtlasTex(const TEXFBO *&page, Vec2i &offset);
+
 	/* Adds 'rect' to tainted area */
 	void taintArea(const IntRect &rect);
 
@@ -161,7 +261,47 @@ public:
     
     bool invalid() const;
 
+	/* Decodes an image file without touching any GL state, so it
+	 * can be called from any thread. Returns null for animations,
+	 * which have to go through Bitmap(const char*) instead */
+	static SDL_Surface *decodeFile(const char *filename);
+
+	/* Moves large images loaded since the last call further
+	 * up to the GPU, within the per-frame upload budget */
+	static void streamUploads();
+
+	/* Frees the RAM copies kept for fast pixel access; they are
+	 * read back from the textures as needed */
+	static void dropSurfaces();
+
+	/* Bookkeeping of live bitmaps ('bitmapTracker'),
+	 * for hunting down leaks */
+	struct TrackInfo
+	{
+		int width, height;
+		/* Estimated texture memory */
+		size_t bytes;
+		/* Texture shared with copies, see Bitmap(const Bitmap&) */
+		bool shared;
+		/* Empty if not loaded from an image file */
+		std::string filename;
+		/* Script backtrace of the creation */
+		std::string origin;
+		/* Graphics::logicalFrame() of the last draw, -1 for never */
+		int lastDraw;
+	};
+
+	static bool trackingEnabled();
+	/* Called by the binding on creation */
+	void setTrackOrigin(const std::string &origin);
+	/* Largest first */
+	static void trackReport(std::vector<TrackInfo> &out);
+	/* Logs the live bitmaps, if the tracker is enabled */
+	static void dumpTrackReport();
+
 private:
+	void initFromSurface(SDL_Surface *imgSurf, Storage storage);
+
 	void releaseResources();
 	const char *klassName() const { return "bitmap"; }
 
@@ -0,0 +1,716 @@
+/*
+** bitmaploader.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bitmaploader.h"
+
+#include "bitmap.h"
+#include "config.h"
+#include "debugwriter.h"
+#include "exception.h"
+#include "gl-util.h"
+#include "glstate.h"
+#include "ioscheduler.h"
+#include "sdl-util.h"
+#include "sharedstate.h"
+#include "util.h"
+
+#include <SDL_cpuinfo.h>
+#include <SDL_mutex.h>
+#include <SDL_surface.h>
+#include <SDL_video.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+struct BitmapLoadJob
+{
+	enum Kind
+	{
+		Load,
+		Save
+	};
+
+	Kind kind;
+
+	std::string filename;
+
+	/* Null after a successful decode means the file
+	 * is an animation and must be loaded directly.
+	 * For saves, the pixels waiting to be encoded */
+	SDL_Surface *surface;
+
+	/* Saves whose pixels are still being read back */
+	bool readingBack;
+	PBO::ID pbo;
+	/* For loads, signaled once the upload context is done with 'tex' */
+	_GLsync fence;
+
+	/* Loads whose surface the upload context already put
+	 * into a texture. Owned by the job until it's finished */
+	TEX::ID tex;
+
+	bool failed;
+	Exception::Type errorType;
+	std::string errorMsg;
+
+	bool done;
+	bool discarded;
+
+	BitmapLoadJob(const char *filename, Kind kind = Load)
+	    : kind(kind),
+	      filename(filename),
+	      surface(0),
+	      readingBack(false),
+	      pbo(0),
+	      fence(0),
+	      tex(0),
+	      failed(false),
+	      errorType(Exception::MKXPError),
+	      done(false),
+	      discarded(false)
+	{}
+
+	~BitmapLoadJob()
+	{
+		if (surface)
+			SDL_FreeSurface(surface);
+
+		/* Never bound on the GL thread, so the
+		 * binding cache doesn't know about it */
+		if (tex != TEX::ID(0))
+			gl.DeleteTextures(1, &tex.gl);
+
+		if (kind == Load && fence)
+			gl.DeleteSync(fence);
+	}
+};
+
+struct BitmapLoaderPrivate
+{
+	std::vector<SDL_Thread*> workers;
+	std::deque<BitmapLoadJob*> queue;
+
+	/* Shares objects with the GL thread's context,
+	 * and is current on 'uploader' only */
+	SDL_Window *window;
+	SDL_GLContext uploadCtx;
+	SDL_Thread *uploader;
+	/* Decoded loads waiting for their upload */
+	std::deque<BitmapLoadJob*> uploads;
+
+	/* Only accessed on the GL thread */
+	std::vector<BitmapLoadJob*> readbacks;
+
+	SDL_mutex *mutex;
+	/* Signaled when jobs are queued, or on shutdown */
+	SDL_cond *jobCond;
+	/* Signaled whenever a job is done */
+	SDL_cond *doneCond;
+	/* Signaled when uploads are queued, or on shutdown */
+	SDL_cond *uploadCond;
+
+	bool quit;
+
+	BitmapLoaderPrivate(const Config &conf)
+	    : window(0),
+	      uploadCtx(0),
+	      uploader(0),
+	      quit(false)
+	{
+		mutex = SDL_CreateMutex();
+		jobCond = SDL_CreateCond();
+		doneCond = SDL_CreateCond();
+		uploadCond = SDL_CreateCond();
+
+		/* The fence is what tells the GL thread the
+		 * texture is complete, so there's no point
+		 * without one */
+		if (conf.sharedUploadContext && gl.FenceSync)
+			createUploadContext();
+	}
+
+	void createUploadContext()
+	{
+		window = SDL_GL_GetCurrentWindow();
+		SDL_GLContext mainCtx = SDL_GL_GetCurrentContext();
+
+		if (!window || !mainCtx)
+			return;
+
+		SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 1);
+		uploadCtx = SDL_GL_CreateContext(window);
+		SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 0);
+
+		/* Creating the context made it current */
+		SDL_GL_MakeCurrent(window, mainCtx);
+
+		if (!uploadCtx)
+			Debug() << "Failed to create shared upload context:" << SDL_GetError();
+	}
+
+	~BitmapLoaderPrivate()
+	{
+		/* The GL context may already be gone */
+		for (size_t i = 0; i < readbacks.size(); ++i)
+			delete readbacks[i];
+
+		SDL_LockMutex(mutex);
+
+		/* Pending loads are dropped, but queued saves
+		 * are still written out before the workers quit */
+		std::deque<BitmapLoadJob*> saves;
+
+		for (size_t i = 0; i < queue.size(); ++i)
+		{
+			if (queue[i]->kind == BitmapLoadJob::Save)
+				saves.push_back(queue[i]);
+			else
+				delete queue[i];
+		}
+
+		queue.swap(saves);
+
+		quit = true;
+		SDL_CondBroadcast(jobCond);
+		SDL_UnlockMutex(mutex);
+
+		for (size_t i = 0; i < workers.size(); ++i)
+			SDL_WaitThread(workers[i], 0);
+
+		SDL_LockMutex(mutex);
+		SDL_CondBroadcast(uploadCond);
+		SDL_UnlockMutex(mutex);
+
+		if (uploader)
+			SDL_WaitThread(uploader, 0);
+
+		for (size_t i = 0; i < queue.size(); ++i)
+			delete queue[i];
+
+		/* None of these have a texture yet */
+		for (size_t i = 0; i < uploads.size(); ++i)
+			delete uploads[i];
+
+		if (uploadCtx)
+			SDL_GL_DeleteContext(uploadCtx);
+
+		SDL_DestroyCond(uploadCond);
+		SDL_DestroyCond(doneCond);
+		SDL_DestroyCond(jobCond);
+		SDL_DestroyMutex(mutex);
+	}
+
+	/* Threads are only spawned once the first job is queued */
+	void ensureWorkers()
+	{
+		if (!workers.empty())
+			return;
+
+		int count = clamp(SDL_GetCPUCount() - 1, 1, 8);
+
+		for (int i = 0; i < count; ++i)
+		{
+			SDL_Thread *thread =
+				createSDLThread<BitmapLoaderPrivate, &BitmapLoaderPrivate::work>
+				(this, "bitmapload");
+
+			if (thread)
+				workers.push_back(thread);
+		}
+
+		if (uploadCtx && !workers.empty())
+			uploader = createSDLThread<BitmapLoaderPrivate, &BitmapLoaderPrivate::upload>
+				(this, "bitmapupload");
+	}
+
+	void work()
+	{
+		IOScheduler::setThreadPriority(IOScheduler::Visible);
+
+		SDL_LockMutex(mutex);
+
+		while (true)
+		{
+			while (!quit && queue.empty())
+				SDL_CondWait(jobCond, mutex);
+
+			if (queue.empty())
+				break;
+
+			BitmapLoadJob *job = queue.front();
+			queue.pop_front();
+
+			const bool skip = job->discarded && job->kind == BitmapLoadJob::Load;
+
+			SDL_UnlockMutex(mutex);
+
+			SDL_Surface *surface = 0;
+			bool failed = false;
+			Exception exc(Exception::MKXPError, "");
+
+			if (!skip)
+				run(job, surface, failed, exc);
+
+			SDL_LockMutex(mutex);
+
+			job->surface = surface;
+			job->failed = failed;
+			job->errorType = exc.type;
+			job->errorMsg = exc.msg;
+
+			if (wantsUpload(job))
+			{
+				uploads.push_back(job);
+				SDL_CondSignal(uploadCond);
+
+				continue;
+			}
+
+			complete(job);
+		}
+
+		SDL_UnlockMutex(mutex);
+	}
+
+	/* Called with the mutex held. Only plain full precision
+	 * textures are uploaded ahead; mega surfaces stay on the
+	 * CPU and reduced ones are packed on the GL thread */
+	bool wantsUpload(BitmapLoadJob *job) const
+	{
+		if (!uploader || job->kind != BitmapLoadJob::Load)
+			return false;
+
+		if (!job->surface || job->discarded)
+			return false;
+
+		const int maxSize = glState.caps.maxTexSize;
+
+		return job->surface->w <= maxSize && job->surface->h <= maxSize
+		    && shState->config().textureReduction == 0;
+	}
+
+	void upload()
+	{
+		SDL_GL_MakeCurrent(window, uploadCtx);
+
+		SDL_LockMutex(mutex);
+
+		while (true)
+		{
+			while (!quit && uploads.empty())
+				SDL_CondWait(uploadCond, mutex);
+
+			/* Loads still waiting are dropped */
+			if (quit)
+				break;
+
+			BitmapLoadJob *job = uploads.front();
+			uploads.pop_front();
+
+			const bool skip = job->discarded;
+
+			SDL_UnlockMutex(mutex);
+
+			if (!skip)
+				uploadSurface(job);
+
+			SDL_LockMutex(mutex);
+
+			complete(job);
+		}
+
+		SDL_UnlockMutex(mutex);
+
+		SDL_GL_MakeCurrent(window, 0);
+	}
+
+	/* Runs on the upload context. TEX:: helpers are avoided,
+	 * as they keep the GL thread's binding cache */
+	static void uploadSurface(BitmapLoadJob *job)
+	{
+		SDL_Surface *surf = job->surface;
+
+		gl.GenTextures(1, &job->tex.gl);
+		gl.BindTexture(GL_TEXTURE_2D, job->tex.gl);
+
+		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+		gl.TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surf->w, surf->h, 0,
+		              GL_RGBA, GL_UNSIGNED_BYTE, surf->pixels);
+
+		gl.BindTexture(GL_TEXTURE_2D, 0);
+
+		/* Flushed so the GL thread can't wait on a
+		 * fence that was never submitted */
+		job->fence = gl.FenceSync(_GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		gl.Flush();
+	}
+
+	/* Doesn't touch any shared state, so it's called without
+	 * the mutex held. Saves consume the job's surface */
+	static void run(BitmapLoadJob *job, SDL_Surface *&surface,
+	                bool &failed, Exception &exc)
+	{
+		try
+		{
+			if (job->kind == BitmapLoadJob::Save)
+				Bitmap::saveSurface(job->surface, job->filename.c_str());
+			else
+				surface = Bitmap::decodeFile(job->filename.c_str());
+		}
+		catch (const Exception &e)
+		{
+			failed = true;
+			exc = e;
+		}
+
+		if (job->kind == BitmapLoadJob::Save)
+		{
+			SDL_FreeSurface(job->surface);
+			job->surface = 0;
+		}
+	}
+
+	/* Called with the mutex held */
+	void complete(BitmapLoadJob *job)
+	{
+		job->done = true;
+
+		if (job->discarded)
+			delete job;
+		else
+			SDL_CondBroadcast(doneCond);
+	}
+
+	void enqueueSave(BitmapLoadJob *job)
+	{
+		SDL_LockMutex(mutex);
+
+		ensureWorkers();
+
+		if (!workers.empty())
+		{
+			queue.push_back(job);
+			SDL_CondSignal(jobCond);
+			SDL_UnlockMutex(mutex);
+
+			return;
+		}
+
+		SDL_UnlockMutex(mutex);
+
+		/* No threads available, encode right here */
+		SDL_Surface *surface = 0;
+		bool failed = false;
+		Exception exc(Exception::MKXPError, "");
+
+		run(job, surface, failed, exc);
+
+		SDL_LockMutex(mutex);
+
+		job->failed = failed;
+		job->errorType = exc.type;
+		job->errorMsg = exc.msg;
+
+		complete(job);
+
+		SDL_UnlockMutex(mutex);
+	}
+
+	/* Copies the read back pixels into the job's surface
+	 * and queues it for encoding. Without 'block', returns
+	 * false if the GPU isn't done writing them yet */
+	bool finishReadback(BitmapLoadJob *job, bool block)
+	{
+		if (job->fence)
+		{
+			if (!block && gl.ClientWaitSync(job->fence, 0, 0) == _GL_TIMEOUT_EXPIRED)
+				return false;
+
+			gl.DeleteSync(job->fence);
+			job->fence = 0;
+		}
+
+		SDL_Surface *surf = job->surface;
+		const GLsizeiptr size = surf->h * surf->pitch;
+
+		PBO::bind(job->pbo);
+		void *data = gl.MapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+
+		if (data)
+		{
+			memcpy(surf->pixels, data, size);
+			gl.UnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+
+		PBO::unbind();
+		PBO::del(job->pbo);
+
+		job->pbo = PBO::ID(0);
+		job->readingBack = false;
+
+		if (data)
+		{
+			enqueueSave(job);
+
+			return true;
+		}
+
+		SDL_FreeSurface(job->surface);
+		job->surface = 0;
+
+		SDL_LockMutex(mutex);
+
+		job->failed = true;
+		job->errorType = Exception::MKXPError;
+		job->errorMsg = "Failed to read back bitmap for saving";
+
+		complete(job);
+
+		SDL_UnlockMutex(mutex);
+
+		return true;
+	}
+};
+
+BitmapLoader::BitmapLoader(const Config &conf)
+{
+	p = new BitmapLoaderPrivate(conf);
+}
+
+BitmapLoader::~BitmapLoader()
+{
+	delete p;
+}
+
+BitmapLoadJob *BitmapLoader::request(const char *filename)
+{
+	BitmapLoadJob *job = new BitmapLoadJob(filename);
+
+	SDL_LockMutex(p->mutex);
+
+	p->ensureWorkers();
+
+	if (p->workers.empty())
+	{
+		/* No threads available, decoding will
+		 * happen synchronously at finish() */
+		job->done = true;
+	}
+	else
+	{
+		p->queue.push_back(job);
+		SDL_CondSignal(p->jobCond);
+	}
+
+	SDL_UnlockMutex(p->mutex);
+
+	return job;
+}
+
+bool BitmapLoader::isDone(BitmapLoadJob *job)
+{
+	SDL_LockMutex(p->mutex);
+	bool done = job->done;
+	SDL_UnlockMutex(p->mutex);
+
+	return done;
+}
+
+void BitmapLoader::wait(BitmapLoadJob *job)
+{
+	SDL_LockMutex(p->mutex);
+
+	while (!job->done)
+		SDL_CondWait(p->doneCond, p->mutex);
+
+	SDL_UnlockMutex(p->mutex);
+}
+
+Bitmap *BitmapLoader::finish(BitmapLoadJob *job)
+{
+	wait(job);
+
+	if (job->failed)
+	{
+		Exception exc(job->errorType, "%s", job->errorMsg.c_str());
+		delete job;
+
+		throw exc;
+	}
+
+	SDL_Surface *surface = job->surface;
+	job->surface = 0;
+
+	TEXFBO tex;
+
+	if (job->tex != TEX::ID(0))
+	{
+		/* Orders our use of the texture after the upload */
+		while (gl.ClientWaitSync(job->fence, _GL_SYNC_FLUSH_COMMANDS,
+		                         1000000) == _GL_TIMEOUT_EXPIRED);
+
+		gl.DeleteSync(job->fence);
+		job->fence = 0;
+
+		/* FBOs aren't shared between contexts */
+		tex.tex = job->tex;
+		tex.fbo = FBO::gen();
+		tex.width = surface->w;
+		tex.height = surface->h;
+		TEXFBO::linkFBO(tex);
+
+		TEX::countUpload(tex.width, tex.height);
+		job->tex = TEX::ID(0);
+	}
+
+	std::string filename = job->filename;
+	delete job;
+
+	/* Animations, or decoding never happened off-thread */
+	if (!surface)
+		return new Bitmap(filename.c_str());
+
+	if (tex.tex != TEX::ID(0))
+		return new Bitmap(surface, tex, filename.c_str());
+
+	return new Bitmap(surface, filename.c_str());
+}
+
+void BitmapLoader::discard(BitmapLoadJob *job)
+{
+	SDL_LockMutex(p->mutex);
+
+	if (job->done)
+	{
+		SDL_UnlockMutex(p->mutex);
+		delete job;
+
+		return;
+	}
+
+	/* The worker frees it once it's done */
+	job->discarded = true;
+
+	SDL_UnlockMutex(p->mutex);
+}
+
+BitmapLoadJob *BitmapLoader::requestSave(Bitmap &bitmap, const char *filename)
+{
+	/* Throws for disposed bitmaps */
+	const int width = bitmap.width();
+	const int height = bitmap.height();
+
+	BitmapLoadJob *job = new BitmapLoadJob(filename, BitmapLoadJob::Save);
+
+	/* Bitmaps with a client side copy are just copied
+	 * from that, and so are the ones that can't be read
+	 * back with a single glReadPixels */
+	if (!gl.async_readback || bitmap.surface() || bitmap.megaSurface() || bitmap.isAnimated())
+	{
+		try
+		{
+			job->surface = bitmap.snapshot();
+		}
+		catch (const Exception &)
+		{
+			delete job;
+			throw;
+		}
+
+		p->enqueueSave(job);
+
+		return job;
+	}
+
+	const TEXFBO &tex = bitmap.getGLTypes();
+
+	job->surface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32,
+	                                              SDL_PIXELFORMAT_ABGR8888);
+
+	if (!job->surface)
+	{
+		delete job;
+		throw Exception(Exception::SDLError, "Failed to prepare bitmap for saving: %s", SDL_GetError());
+	}
+
+	job->pbo = PBO::gen();
+	PBO::bind(job->pbo);
+	PBO::allocEmpty(job->surface->h * job->surface->pitch, GL_STREAM_READ);
+
+	FBO::bind(tex.fbo);
+	gl.ReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+	PBO::unbind();
+
+	if (gl.FenceSync)
+		job->fence = gl.FenceSync(_GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	job->readingBack = true;
+	p->readbacks.push_back(job);
+
+	return job;
+}
+
+void BitmapLoader::update()
+{
+	std::vector<BitmapLoadJob*> &readbacks = p->readbacks;
+
+	for (size_t i = 0; i < readbacks.size();)
+	{
+		if (p->finishReadback(readbacks[i], false))
+			readbacks.erase(readbacks.begin() + i);
+		else
+			++i;
+	}
+}
+
+void BitmapLoader::flush(BitmapLoadJob *job)
+{
+	if (!job->readingBack)
+		return;
+
+	std::vector<BitmapLoadJob*> &readbacks = p->readbacks;
+	readbacks.erase(std::find(readbacks.begin(), readbacks.end(), job));
+
+	p->finishReadback(job, true);
+}
+
+void BitmapLoader::finishSave(BitmapLoadJob *job)
+{
+	flush(job);
+	wait(job);
+
+	if (job->failed)
+	{
+		Exception exc(job->errorType, "%s", job->errorMsg.c_str());
+		delete job;
+
+		throw exc;
+	}
+
+	delete job;
+}
@@ -0,0 +1,80 @@
+/*
+** bitmaploader.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BITMAPLOADER_H
+#define BITMAPLOADER_H
+
+class Bitmap;
+struct BitmapLoadJob;
+struct Config;
+struct BitmapLoaderPrivate;
+
+/* Decodes image files on a small pool of worker threads.
+ * Only the final texture upload happens on the GL thread,
+ * when the job is finished, unless a shared upload context
+ * is enabled, in which case a thread of its own uploads the
+ * decoded images as well. The same threads also encode
+ * bitmaps being saved to disk */
+class BitmapLoader
+{
+public:
+	/* Must be constructed on the GL thread */
+	BitmapLoader(const Config &conf);
+	~BitmapLoader();
+
+	/* Queues 'filename' for decoding */
+	BitmapLoadJob *request(const char *filename);
+
+	bool isDone(BitmapLoadJob *job);
+
+	/* Blocks until 'job' is done decoding */
+	void wait(BitmapLoadJob *job);
+
+	/* Waits for 'job' to be decoded and creates the Bitmap from it.
+	 * Rethrows any error encountered while decoding. Must be called
+	 * on the GL thread. 'job' is freed in any case */
+	Bitmap *finish(BitmapLoadJob *job);
+
+	/* Drops a job whose result is no longer needed.
+	 * Save jobs still run to completion */
+	void discard(BitmapLoadJob *job);
+
+	/* Queues the contents of 'bitmap' to be written to 'filename'
+	 * (a normalized path). Where possible the pixels are read back
+	 * through a pixel pack buffer, so this returns without waiting
+	 * on the GPU. Must be called on the GL thread */
+	BitmapLoadJob *requestSave(Bitmap &bitmap, const char *filename);
+
+	/* Hands finished readbacks over to the workers.
+	 * Called once per frame on the GL thread */
+	void update();
+
+	/* Completes the readback of 'job' right away, so that
+	 * it can be waited on. Must be called on the GL thread */
+	void flush(BitmapLoadJob *job);
+
+	/* Waits for 'job' to be written and rethrows any error
+	 * encountered while encoding. 'job' is freed in any case */
+	void finishSave(BitmapLoadJob *job);
+
+private:
+	BitmapLoaderPrivate *p;
+};
+
+#endif // BITMAPLOADER_H
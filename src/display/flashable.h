@@ -24,6 +24,7 @@
 
 #include "etc.h"
 #include "etc-internal.h"
+#include "scene.h"
 
 class Flashable
 {
@@ -44,6 +45,7 @@ public:
 		flashing = true;
 		this->duration = duration;
 		counter = 0;
+		Scene::damageScreen();
 
 		if (!color)
 		{
@@ -60,6 +62,8 @@ public:
 		if (!flashing)
 			return;
 
+		Scene::damageScreen();
+
 		if (++counter > duration)
 		{
 			/* Flash finished. Cleanup */
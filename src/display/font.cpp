@@ -27,15 +27,23 @@
 #include "boost-hash.h"
 #include "util.h"
 #include "config.h"
+#include "gl-util.h"
 
 #include <string>
 #include <utility>
+#include <list>
+#include <algorithm>
 
 #ifdef MKXPZ_BUILD_XCODE
 #include "filesystem/filesystem.h"
 #endif
 
 #include <SDL_ttf.h>
+#include <SDL_surface.h>
+#include <SDL_rwops.h>
+
+#include <string.h>
+#include <math.h>
 
 #ifndef MKXPZ_BUILD_XCODE
 #ifndef MKXPZ_CJK_FONT
@@ -79,6 +87,79 @@ static SDL_RWops *openBundledFont()
 
 typedef std::pair<std::string, int> FontKey;
 
+/* Upper bound on the pixel memory held by the text cache */
+#define TEXT_CACHE_BYTES (4 * 1024 * 1024)
+
+bool TextRenderKey::operator<(const TextRenderKey &o) const
+{
+	if (font != o.font)
+		return font < o.font;
+
+	if (style != o.style)
+		return style < o.style;
+
+	if (solid != o.solid)
+		return solid < o.solid;
+
+	if (shadow != o.shadow)
+		return shadow < o.shadow;
+
+	if (outline != o.outline)
+		return outline < o.outline;
+
+	if (color != o.color)
+		return color < o.color;
+
+	if (outColor != o.outColor)
+		return outColor < o.outColor;
+
+	return text < o.text;
+}
+
+struct TextCacheEntry
+{
+	TextRenderKey key;
+	SDL_Surface *surf;
+	int rawHeight;
+	size_t bytes;
+};
+
+typedef std::list<TextCacheEntry> TextCacheList;
+
+/* Font handle, style, string */
+typedef std::pair<std::pair<TTF_Font*, int>, std::string> TextSizeKey;
+
+/* Entries are tiny, so only their count is bounded */
+#define TEXT_SIZE_CACHE_ENTRIES 8192
+
+struct TextSizeEntry
+{
+	TextSizeKey key;
+	int w, h;
+};
+
+typedef std::list<TextSizeEntry> TextSizeList;
+
+/* Font handle, style, character */
+typedef std::pair<std::pair<TTF_Font*, int>, uint16_t> GlyphKey;
+
+/* Number of scratch buffers that can be in use at once */
+#define TEXT_SCRATCH_SLOTS 2
+
+/* A scratch buffer is shrunk once this many requests
+ * in a row needed less than a quarter of it */
+#define TEXT_SCRATCH_SHRINK 256
+
+struct TextScratch
+{
+	std::vector<uint32_t> mem;
+	int smallCount;
+
+	TextScratch()
+	    : smallCount(0)
+	{}
+};
+
 struct FontSet
 {
 	/* 'Regular' style */
@@ -88,6 +169,20 @@ struct FontSet
 	std::string other;
 };
 
+/* What we need to know about a font file without opening it */
+struct FontFileInfo
+{
+	int64_t size;
+	int64_t mtime;
+	std::string family;
+	std::string style;
+};
+
+#define FONT_CACHE_MAGIC "mkxpFNT1"
+
+/* Font handle at 'SdfAtlas::BaseSize', style */
+typedef std::pair<TTF_Font*, int> SdfAtlasKey;
+
 struct SharedFontStatePrivate
 {
 	/* Maps: font family name, To: substituted family name,
@@ -97,19 +192,226 @@ struct SharedFontStatePrivate
 	/* Maps: font family name, To: set of physical
 	 * font filenames located in "Fonts/" */
 	BoostHash<std::string, FontSet> sets;
+	bool setsScanned;
+
+	/* Maps: font filename, To: its family and style names.
+	 * 'cachedInfo' holds what the last run found (read from
+	 * 'cacheFile'), 'fileInfo' what this one did */
+	BoostHash<std::string, FontFileInfo> cachedInfo;
+	BoostHash<std::string, FontFileInfo> fileInfo;
+	std::string cacheFile;
+	bool cacheDirty;
+
+	SharedFontState *self;
 
 	/* Pool of already opened fonts; once opened, they are reused
 	 * and never closed until the termination of the program */
 	BoostHash<FontKey, TTF_Font*> pool;
+
+	/* Contents of the font files opened so far, read once and
+	 * shared by every size opened from them. Large CJK fonts
+	 * would otherwise be read in full again for each new size */
+	BoostHash<std::string, std::vector<uint8_t>*> fileData;
     
     /* Internal default font family that is used anytime an
      * empty/invalid family is requested */
     std::string defaultFamily;
+
+	/* Most recently used entries first */
+	TextCacheList textLRU;
+	BoostHash<TextRenderKey, TextCacheList::iterator> textCache;
+	size_t textCacheBytes;
+
+	TextSizeList sizeLRU;
+	BoostHash<TextSizeKey, TextSizeList::iterator> sizeCache;
+	size_t sizeCacheCount;
+
+	/* Horizontal advances for text layout; bounded
+	 * by the characters the game actually uses */
+	BoostHash<GlyphKey, int> advances;
+
+	/* Sized to the largest recent text */
+	TextScratch scratch[TEXT_SCRATCH_SLOTS];
+
+	BoostHash<SdfAtlasKey, SdfAtlas*> sdfAtlases;
+
+	SharedFontStatePrivate(SharedFontState *self)
+	    : setsScanned(false),
+	      cacheDirty(false),
+	      self(self),
+	      textCacheBytes(0),
+	      sizeCacheCount(0)
+	{}
+
+	void addToSet(const FontFileInfo &info, const std::string &filename)
+	{
+		FontSet &set = sets[info.family];
+
+		if (info.style == "Regular")
+			set.regular = filename;
+		else
+			set.other = filename;
+	}
+
+	/* Font files are only looked at once a font is needed */
+	void ensureScanned()
+	{
+		if (setsScanned)
+			return;
+
+		setsScanned = true;
+
+		shState->fileSystem().initFontSets(*self);
+
+		/* Files removed since the last run */
+		if (fileInfo.size() != cachedInfo.size())
+			cacheDirty = true;
+
+		cachedInfo.clear();
+
+		if (cacheDirty)
+			saveCache();
+	}
+
+	static std::string readString(SDL_RWops *ops)
+	{
+		uint32_t len = SDL_ReadLE32(ops);
+
+		/* Names and paths are short; anything else is corrupt */
+		if (len > 1024)
+			return std::string();
+
+		std::string str(len, '\0');
+
+		if (len > 0 && SDL_RWread(ops, &str[0], len, 1) != 1)
+			str.clear();
+
+		return str;
+	}
+
+	static void writeString(SDL_RWops *ops, const std::string &str)
+	{
+		SDL_WriteLE32(ops, str.size());
+		SDL_RWwrite(ops, str.data(), 1, str.size());
+	}
+
+	void loadCache()
+	{
+		SDL_RWops *ops = SDL_RWFromFile(cacheFile.c_str(), "rb");
+
+		if (!ops)
+			return;
+
+		char magic[sizeof(FONT_CACHE_MAGIC) - 1];
+
+		if (SDL_RWread(ops, magic, sizeof(magic), 1) != 1 ||
+		    memcmp(magic, FONT_CACHE_MAGIC, sizeof(magic)))
+		{
+			SDL_RWclose(ops);
+			return;
+		}
+
+		uint32_t count = SDL_ReadLE32(ops);
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			std::string filename = readString(ops);
+
+			FontFileInfo info;
+			info.size = SDL_ReadLE64(ops);
+			info.mtime = SDL_ReadLE64(ops);
+			info.family = readString(ops);
+			info.style = readString(ops);
+
+			if (filename.empty() || info.family.empty())
+				break;
+
+			cachedInfo.insert(filename, info);
+		}
+
+		SDL_RWclose(ops);
+	}
+
+	void saveCache()
+	{
+		if (cacheFile.empty())
+			return;
+
+		SDL_RWops *ops = SDL_RWFromFile(cacheFile.c_str(), "wb");
+
+		if (!ops)
+			return;
+
+		SDL_RWwrite(ops, FONT_CACHE_MAGIC, sizeof(FONT_CACHE_MAGIC) - 1, 1);
+		SDL_WriteLE32(ops, fileInfo.size());
+
+		for (BoostHash<std::string, FontFileInfo>::const_iterator iter = fileInfo.cbegin();
+		     iter != fileInfo.cend(); ++iter)
+		{
+			writeString(ops, iter->first);
+			SDL_WriteLE64(ops, iter->second.size);
+			SDL_WriteLE64(ops, iter->second.mtime);
+			writeString(ops, iter->second.family);
+			writeString(ops, iter->second.style);
+		}
+
+		SDL_RWclose(ops);
+
+		cacheDirty = false;
+	}
+
+	void evictText()
+	{
+		const TextCacheEntry &entry = textLRU.back();
+
+		textCacheBytes -= entry.bytes;
+		textCache.remove(entry.key);
+		SDL_FreeSurface(entry.surf);
+
+		textLRU.pop_back();
+	}
+
+	const std::vector<uint8_t> &readFontFile(const std::string &path)
+	{
+		std::vector<uint8_t> *data = fileData.value(path, 0);
+
+		if (data)
+			return *data;
+
+		SDL_RWops ops;
+		shState->fileSystem().openReadRaw(ops, path.c_str());
+
+		const Sint64 size = SDL_RWsize(&ops);
+		data = new std::vector<uint8_t>(std::max<Sint64>(size, 0));
+
+		size_t read = 0;
+
+		if (!data->empty())
+			read = SDL_RWread(&ops, &(*data)[0], 1, data->size());
+
+		SDL_RWclose(&ops);
+
+		if (read != data->size() || data->empty())
+		{
+			delete data;
+			throw Exception(Exception::SDLError, "Failed to read font: %s", path.c_str());
+		}
+
+		fileData.insert(path, data);
+
+		return *data;
+	}
 };
 
 SharedFontState::SharedFontState(const Config &conf)
 {
-	p = new SharedFontStatePrivate;
+	p = new SharedFontStatePrivate(this);
+
+	if (!conf.customDataPath.empty())
+	{
+		p->cacheFile = conf.customDataPath + "/fontcache.bin";
+		p->loadCache();
+	}
 
 	/* Parse font substitutions */
 	for (size_t i = 0; i < conf.fontSubs.size(); ++i)
@@ -133,33 +435,70 @@ SharedFontState::~SharedFontState()
 	for (iter = p->pool.cbegin(); iter != p->pool.cend(); ++iter)
 		TTF_CloseFont(iter->second);
 
+	/* Fonts read from these until closed */
+	BoostHash<std::string, std::vector<uint8_t>*>::const_iterator dataIter;
+	for (dataIter = p->fileData.cbegin(); dataIter != p->fileData.cend(); ++dataIter)
+		delete dataIter->second;
+
+	while (!p->textLRU.empty())
+		p->evictText();
+
+	BoostHash<SdfAtlasKey, SdfAtlas*>::const_iterator sdfIter;
+	for (sdfIter = p->sdfAtlases.cbegin(); sdfIter != p->sdfAtlases.cend(); ++sdfIter)
+		delete sdfIter->second;
+
 	delete p;
 }
 
+bool SharedFontState::initFontSetCached(const std::string &filename,
+                                        int64_t size, int64_t mtime)
+{
+	/* No reliable modification time (eg. inside some archives) */
+	if (mtime < 0 || !p->cachedInfo.contains(filename))
+		return false;
+
+	const FontFileInfo info = p->cachedInfo.value(filename);
+
+	if (info.size != size || info.mtime != mtime)
+		return false;
+
+	p->fileInfo.insert(filename, info);
+	p->addToSet(info, filename);
+
+	return true;
+}
+
 void SharedFontState::initFontSetCB(SDL_RWops &ops,
-                                    const std::string &filename)
+                                    const std::string &filename,
+                                    int64_t size, int64_t mtime)
 {
 	TTF_Font *font = TTF_OpenFontRW(&ops, 0, 0);
 
 	if (!font)
 		return;
 
-	std::string family = TTF_FontFaceFamilyName(font);
-	std::string style = TTF_FontFaceStyleName(font);
+	FontFileInfo info;
+	info.size = size;
+	info.mtime = mtime;
+	info.family = TTF_FontFaceFamilyName(font);
+	info.style = TTF_FontFaceStyleName(font);
 
 	TTF_CloseFont(font);
 
-	FontSet &set = p->sets[family];
+	p->addToSet(info, filename);
 
-	if (style == "Regular")
-		set.regular = filename;
-	else
-		set.other = filename;
+	if (mtime >= 0)
+	{
+		p->fileInfo.insert(filename, info);
+		p->cacheDirty = true;
+	}
 }
 
 _TTF_Font *SharedFontState::getFont(std::string family,
                                     int size)
 {
+	p->ensureScanned();
+
 	if (family.empty())
 		family = p->defaultFamily;
 
@@ -195,11 +534,11 @@ _TTF_Font *SharedFontState::getFont(std::string family,
 	{
 		/* Use 'other' path as alternative in case
 		 * we have no 'regular' styled font asset */
-		const char *path = !req.regular.empty()
-		                 ? req.regular.c_str() : req.other.c_str();
+		const std::string &path = !req.regular.empty()
+		                        ? req.regular : req.other;
 
-		ops = SDL_AllocRW();
-		shState->fileSystem().openReadRaw(*ops, path, true);
+		const std::vector<uint8_t> &data = p->readFontFile(path);
+		ops = SDL_RWFromConstMem(&data[0], data.size());
 	}
 
 	// FIXME 0.9 is guesswork at this point
@@ -217,6 +556,8 @@ _TTF_Font *SharedFontState::getFont(std::string family,
 
 bool SharedFontState::fontPresent(std::string family) const
 {
+	p->ensureScanned();
+
 	/* Check for substitutions */
 	if (p->subs.contains(family))
 		family = p->subs[family];
@@ -237,6 +578,522 @@ void SharedFontState::setDefaultFontFamily(const std::string &family) {
     p->defaultFamily = family;
 }
 
+SDL_Surface *SharedFontState::findText(const TextRenderKey &key, int &rawHeight)
+{
+	TextCacheList::iterator iter = p->textCache.value(key, p->textLRU.end());
+
+	if (iter == p->textLRU.end())
+		return 0;
+
+	/* Move to front */
+	p->textLRU.splice(p->textLRU.begin(), p->textLRU, iter);
+
+	rawHeight = iter->rawHeight;
+
+	return iter->surf;
+}
+
+bool SharedFontState::storeText(const TextRenderKey &key, SDL_Surface *surf, int rawHeight)
+{
+	const size_t bytes = surf->h * surf->pitch;
+
+	/* Don't let one huge string flush the whole cache */
+	if (bytes > TEXT_CACHE_BYTES / 8)
+		return false;
+
+	if (p->textCache.contains(key))
+		return false;
+
+	while (!p->textLRU.empty() && p->textCacheBytes + bytes > TEXT_CACHE_BYTES)
+		p->evictText();
+
+	TextCacheEntry entry;
+	entry.key = key;
+	entry.surf = surf;
+	entry.rawHeight = rawHeight;
+	entry.bytes = bytes;
+
+	p->textLRU.push_front(entry);
+	p->textCache.insert(key, p->textLRU.begin());
+	p->textCacheBytes += bytes;
+
+	return true;
+}
+
+bool SharedFontState::findTextSize(_TTF_Font *font, int style, const std::string &text,
+                                   int &w, int &h)
+{
+	const TextSizeKey key(std::make_pair(font, style), text);
+	TextSizeList::iterator iter = p->sizeCache.value(key, p->sizeLRU.end());
+
+	if (iter == p->sizeLRU.end())
+		return false;
+
+	p->sizeLRU.splice(p->sizeLRU.begin(), p->sizeLRU, iter);
+
+	w = iter->w;
+	h = iter->h;
+
+	return true;
+}
+
+void SharedFontState::storeTextSize(_TTF_Font *font, int style, const std::string &text,
+                                    int w, int h)
+{
+	TextSizeEntry entry;
+	entry.key = TextSizeKey(std::make_pair(font, style), text);
+	entry.w = w;
+	entry.h = h;
+
+	if (p->sizeCache.contains(entry.key))
+		return;
+
+	if (p->sizeCacheCount == TEXT_SIZE_CACHE_ENTRIES)
+	{
+		p->sizeCache.remove(p->sizeLRU.back().key);
+		p->sizeLRU.pop_back();
+		--p->sizeCacheCount;
+	}
+
+	p->sizeLRU.push_front(entry);
+	p->sizeCache.insert(entry.key, p->sizeLRU.begin());
+	++p->sizeCacheCount;
+}
+
+int SharedFontState::glyphAdvance(_TTF_Font *font, int style, uint16_t ch)
+{
+	const GlyphKey key(std::make_pair(font, style), ch);
+	const int cached = p->advances.value(key, -1);
+
+	if (cached >= 0)
+		return cached;
+
+	/* Missing glyphs take no room */
+	int advance = 0;
+
+	if (TTF_GlyphMetrics(font, ch, 0, 0, 0, 0, &advance) < 0)
+		advance = 0;
+
+	p->advances.insert(key, advance);
+
+	return advance;
+}
+
+void SharedFontState::trimCaches()
+{
+	while (!p->textLRU.empty())
+		p->evictText();
+
+	p->sizeCache.clear();
+	p->sizeLRU.clear();
+	p->sizeCacheCount = 0;
+
+	p->advances.clear();
+
+	for (size_t i = 0; i < TEXT_SCRATCH_SLOTS; ++i)
+	{
+		std::vector<uint32_t>().swap(p->scratch[i].mem);
+		p->scratch[i].smallCount = 0;
+	}
+
+	/* Text elements refer to the atlases themselves,
+	 * so only their contents can go */
+	BoostHash<SdfAtlasKey, SdfAtlas*>::const_iterator iter;
+	for (iter = p->sdfAtlases.cbegin(); iter != p->sdfAtlases.cend(); ++iter)
+		iter->second->reset();
+}
+
+SdfAtlas &SharedFontState::sdfAtlas(const std::string &family, int style)
+{
+	const SdfAtlasKey key(getFont(family, SdfAtlas::BaseSize), style);
+	SdfAtlas *atlas = p->sdfAtlases.value(key, 0);
+
+	if (!atlas)
+	{
+		atlas = new SdfAtlas(key.first, style);
+		p->sdfAtlases.insert(key, atlas);
+	}
+
+	return *atlas;
+}
+
+SDL_Surface *SharedFontState::scratchSurface(int slot, int w, int h)
+{
+	TextScratch &scratch = p->scratch[slot];
+	const size_t need = std::max<size_t>((size_t) w * h, 1);
+
+	if (need > scratch.mem.size())
+	{
+		scratch.mem.resize(need);
+		scratch.smallCount = 0;
+	}
+	else if (need < scratch.mem.size() / 4)
+	{
+		if (++scratch.smallCount >= TEXT_SCRATCH_SHRINK)
+		{
+			std::vector<uint32_t>(need).swap(scratch.mem);
+			scratch.smallCount = 0;
+		}
+	}
+	else
+	{
+		scratch.smallCount = 0;
+	}
+
+	return SDL_CreateRGBSurfaceWithFormatFrom(&scratch.mem[0], w, h, 32, w * 4,
+	                                          SDL_PIXELFORMAT_ABGR8888);
+}
+
+/* Width of an SdfAtlas texture; its height grows in powers
+ * of two from the first up to the second value */
+#define SDF_ATLAS_WIDTH 1024
+#define SDF_ATLAS_MIN_HEIGHT 128
+#define SDF_ATLAS_MAX_HEIGHT 2048
+
+#define SDF_FAR 1e20f
+
+/* Squared distance transform of one row or column 'f' into 'd'
+ * (Felzenszwalb & Huttenlocher). 'v' and 'z' are scratch space
+ * for n and n+1 elements */
+static void sdfTransform1D(const float *f, float *d, int n, int *v, float *z)
+{
+	int k = 0;
+	v[0] = 0;
+	z[0] = -SDF_FAR;
+	z[1] = SDF_FAR;
+
+	for (int q = 1; q < n; ++q)
+	{
+		float s;
+
+		while (true)
+		{
+			const int r = v[k];
+			s = ((f[q] + q * q) - (f[r] + r * r)) / (2 * q - 2 * r);
+
+			if (s > z[k] || k == 0)
+				break;
+
+			--k;
+		}
+
+		++k;
+		v[k] = q;
+		z[k] = s;
+		z[k+1] = SDF_FAR;
+	}
+
+	k = 0;
+
+	for (int q = 0; q < n; ++q)
+	{
+		while (z[k+1] < q)
+			++k;
+
+		d[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
+	}
+}
+
+/* In place; cells of 'grid' are 0 on the shape, SDF_FAR elsewhere */
+static void sdfTransform2D(std::vector<float> &grid, int w, int h)
+{
+	const int n = std::max(w, h);
+	std::vector<float> f(n), d(n), z(n + 1);
+	std::vector<int> v(n);
+
+	for (int x = 0; x < w; ++x)
+	{
+		for (int y = 0; y < h; ++y)
+			f[y] = grid[y*w+x];
+
+		sdfTransform1D(&f[0], &d[0], h, &v[0], &z[0]);
+
+		for (int y = 0; y < h; ++y)
+			grid[y*w+x] = d[y];
+	}
+
+	for (int y = 0; y < h; ++y)
+	{
+		sdfTransform1D(&grid[y*w], &d[0], w, &v[0], &z[0]);
+		std::copy(d.begin(), d.begin() + w, grid.begin() + y*w);
+	}
+}
+
+struct SdfAtlasPrivate
+{
+	TTF_Font *font;
+	int style;
+
+	BoostHash<uint16_t, SdfGlyph> glyphs;
+
+	/* Copy of the texture, for growing it */
+	std::vector<uint8_t> pixels;
+	int height;
+
+	/* Glyphs are packed in rows of equal height */
+	int rowX, rowY;
+	int rowHeight;
+
+	unsigned int generation;
+
+	TEX::ID tex;
+
+	SdfAtlasPrivate(TTF_Font *font, int style)
+	    : font(font),
+	      style(style),
+	      height(0),
+	      rowX(0), rowY(0),
+	      rowHeight(0),
+	      generation(0)
+	{
+		tex = TEX::gen();
+		clear();
+	}
+
+	~SdfAtlasPrivate()
+	{
+		TEX::del(tex);
+	}
+
+	void clear()
+	{
+		glyphs.clear();
+		rowX = rowY = rowHeight = 0;
+		++generation;
+
+		height = SDF_ATLAS_MIN_HEIGHT;
+		pixels.assign(SDF_ATLAS_WIDTH * height, 0);
+
+		upload();
+	}
+
+	void upload()
+	{
+		TEX::bind(tex);
+		TEX::setRepeat(false);
+		TEX::setSmooth(true);
+
+		const GLenum format = gl.tex_rg ? GL_RED : GL_LUMINANCE;
+
+		gl.PixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		gl.TexImage2D(GL_TEXTURE_2D, 0, gl.tex_rg ? _GL_R8 : GL_LUMINANCE,
+		              SDF_ATLAS_WIDTH, height, 0, format, GL_UNSIGNED_BYTE, &pixels[0]);
+		gl.PixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+		TEX::countUpload(SDF_ATLAS_WIDTH, height / 4);
+	}
+
+	void uploadRect(const IntRect &rect)
+	{
+		TEX::bind(tex);
+
+		/* Whole rows, so the source data is contiguous */
+		gl.PixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		gl.TexSubImage2D(GL_TEXTURE_2D, 0, 0, rect.y, SDF_ATLAS_WIDTH, rect.h,
+		                 gl.tex_rg ? GL_RED : GL_LUMINANCE, GL_UNSIGNED_BYTE,
+		                 &pixels[rect.y * SDF_ATLAS_WIDTH]);
+		gl.PixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+		TEX::countUpload(SDF_ATLAS_WIDTH, rect.h / 4);
+	}
+
+	/* Finds room for a w by h cell, growing or emptying
+	 * the atlas if needed. Returns false if it can't fit */
+	bool allocate(int w, int h, Vec2i &pos)
+	{
+		if (w > SDF_ATLAS_WIDTH || h > SDF_ATLAS_MAX_HEIGHT)
+			return false;
+
+		if (rowX + w > SDF_ATLAS_WIDTH || h > rowHeight)
+		{
+			/* Start a new row, unless the current one is empty */
+			if (rowX > 0)
+				rowY += rowHeight;
+
+			rowX = 0;
+			rowHeight = h;
+		}
+
+		if (rowY + rowHeight > SDF_ATLAS_MAX_HEIGHT)
+		{
+			clear();
+			rowHeight = h;
+		}
+
+		if (rowY + rowHeight > height)
+		{
+			while (rowY + rowHeight > height)
+				height *= 2;
+
+			pixels.resize(SDF_ATLAS_WIDTH * height, 0);
+			upload();
+		}
+
+		pos = Vec2i(rowX, rowY);
+		rowX += w;
+
+		return true;
+	}
+
+	SdfGlyph rasterize(uint16_t ch)
+	{
+		const int Spread = SdfAtlas::Spread;
+		SdfGlyph glyph;
+
+		/* The font handle is shared with Bitmap#draw_text */
+		TTF_SetFontStyle(font, style);
+
+		if (TTF_GlyphMetrics(font, ch, 0, 0, 0, 0, &glyph.advance) < 0)
+			glyph.advance = 0;
+
+		SDL_Color white = { 255, 255, 255, 255 };
+		SDL_Surface *surf = TTF_RenderGlyph_Blended(font, ch, white);
+
+		if (!surf)
+			return glyph;
+
+		SDL_LockSurface(surf);
+
+		/* Bounds of the covered pixels */
+		const uint32_t aMask = surf->format->Amask;
+		const int aShift = surf->format->Ashift;
+		int minX = surf->w, minY = surf->h, maxX = -1, maxY = -1;
+
+		for (int y = 0; y < surf->h; ++y)
+		{
+			const uint32_t *row = (const uint32_t*) ((uint8_t*) surf->pixels + y * surf->pitch);
+
+			for (int x = 0; x < surf->w; ++x)
+			{
+				if (((row[x] & aMask) >> aShift) < 128)
+					continue;
+
+				minX = std::min(minX, x);
+				maxX = std::max(maxX, x);
+				minY = std::min(minY, y);
+				maxY = std::max(maxY, y);
+			}
+		}
+
+		if (maxX < 0)
+		{
+			SDL_UnlockSurface(surf);
+			SDL_FreeSurface(surf);
+
+			return glyph;
+		}
+
+		const int w = maxX - minX + 1 + Spread * 2;
+		const int h = maxY - minY + 1 + Spread * 2;
+
+		/* Distances to the nearest pixel inside,
+		 * and to the nearest one outside the glyph */
+		std::vector<float> toInside(w * h), toOutside(w * h);
+
+		for (int y = 0; y < h; ++y)
+			for (int x = 0; x < w; ++x)
+			{
+				const int sx = x - Spread + minX;
+				const int sy = y - Spread + minY;
+				bool inside = false;
+
+				if (sx >= 0 && sy >= 0 && sx < surf->w && sy < surf->h)
+				{
+					const uint32_t *row = (const uint32_t*) ((uint8_t*) surf->pixels + sy * surf->pitch);
+					inside = ((row[sx] & aMask) >> aShift) >= 128;
+				}
+
+				toInside[y*w+x] = inside ? 0 : SDF_FAR;
+				toOutside[y*w+x] = inside ? SDF_FAR : 0;
+			}
+
+		SDL_UnlockSurface(surf);
+		SDL_FreeSurface(surf);
+
+		sdfTransform2D(toInside, w, h);
+		sdfTransform2D(toOutside, w, h);
+
+		Vec2i pos;
+
+		if (!allocate(w, h, pos))
+			return glyph;
+
+		for (int y = 0; y < h; ++y)
+		{
+			uint8_t *dst = &pixels[(pos.y + y) * SDF_ATLAS_WIDTH + pos.x];
+
+			for (int x = 0; x < w; ++x)
+			{
+				/* Positive inside; 0.5 is the edge */
+				const float dist = sqrtf(toOutside[y*w+x]) - sqrtf(toInside[y*w+x]);
+				const float value = 0.5f + dist / (Spread * 2);
+
+				dst[x] = (uint8_t) clamp<int>((int) (value * 255 + 0.5f), 0, 255);
+			}
+		}
+
+		uploadRect(IntRect(pos.x, pos.y, w, h));
+
+		glyph.rect = IntRect(pos.x, pos.y, w, h);
+		glyph.offset = Vec2i(minX - Spread, minY - Spread);
+
+		return glyph;
+	}
+};
+
+SdfAtlas::SdfAtlas(_TTF_Font *font, int style)
+{
+	p = new SdfAtlasPrivate(font, style);
+}
+
+SdfAtlas::~SdfAtlas()
+{
+	delete p;
+}
+
+const SdfGlyph *SdfAtlas::glyph(uint16_t ch)
+{
+	if (p->glyphs.contains(ch))
+		return &p->glyphs[ch];
+
+	if (!TTF_GlyphIsProvided(p->font, ch))
+		return 0;
+
+	/* May empty the atlas to make room */
+	const SdfGlyph glyph = p->rasterize(ch);
+	p->glyphs.insert(ch, glyph);
+
+	return &p->glyphs[ch];
+}
+
+int SdfAtlas::lineHeight() const
+{
+	return TTF_FontHeight(p->font);
+}
+
+unsigned int SdfAtlas::generation() const
+{
+	return p->generation;
+}
+
+Vec2i SdfAtlas::texSize() const
+{
+	return Vec2i(SDF_ATLAS_WIDTH, p->height);
+}
+
+void SdfAtlas::bindTex()
+{
+	TEX::bind(p->tex);
+}
+
+void SdfAtlas::reset()
+{
+	if (p->glyphs.size() == 0 && p->height == SDF_ATLAS_MIN_HEIGHT)
+		return;
+
+	p->clear();
+}
+
 void pickExistingFontName(const std::vector<std::string> &names,
                           std::string &out,
                           const SharedFontState &sfs)
@@ -290,6 +1147,11 @@ struct FontPrivate
 	 * (when it is queried by a Bitmap), prior it is
 	 * set to null */
 	TTF_Font *sdlFont;
+
+	/* Same for the distance field atlas, which
+	 * depends on the style but not the size */
+	SdfAtlas *sdfAtlas;
+	int sdfStyle;
     
     bool isSolid;
 
@@ -304,6 +1166,8 @@ struct FontPrivate
 	      colorTmp(*defaultColor),
 	      outColorTmp(*defaultOutColor),
 	      sdlFont(0),
+	      sdfAtlas(0),
+	      sdfStyle(0),
           isSolid(false)
 	{}
 
@@ -319,6 +1183,8 @@ struct FontPrivate
 	      colorTmp(*other.color),
 	      outColorTmp(*other.outColor),
 	      sdlFont(other.sdlFont),
+	      sdfAtlas(other.sdfAtlas),
+	      sdfStyle(other.sdfStyle),
           isSolid(false)
 	{}
 
@@ -334,6 +1200,7 @@ struct FontPrivate
 		*outColor = *o.outColor;
 
 		sdlFont = 0;
+		sdfAtlas = 0;
         isSolid = o.isSolid;
 	}
 };
@@ -397,6 +1264,7 @@ void Font::setName(const std::vector<std::string> &names)
 	pickExistingFontName(names, p->name, shState->fontState());
     p->isSolid = strcmp(p->name.c_str(), "") && shState->config().fontIsSolid(p->name.c_str());
 	p->sdlFont = 0;
+	p->sdfAtlas = 0;
 }
 
 void Font::setSize(int value)
@@ -504,3 +1372,102 @@ _TTF_Font *Font::getSdlFont()
 
 	return p->sdlFont;
 }
+
+SdfAtlas &Font::getSdfAtlas()
+{
+	int style = TTF_STYLE_NORMAL;
+
+	if (p->bold)
+		style |= TTF_STYLE_BOLD;
+
+	if (p->italic)
+		style |= TTF_STYLE_ITALIC;
+
+	if (!p->sdfAtlas || p->sdfStyle != style)
+	{
+		p->sdfAtlas = &shState->fontState().sdfAtlas(p->name, style);
+		p->sdfStyle = style;
+	}
+
+	return *p->sdfAtlas;
+}
+
+void Font::layout(const char *str, int width,
+                  std::vector<std::string> &lines)
+{
+	TTF_Font *font = getSdlFont();
+	const int style = TTF_GetFontStyle(font);
+	SharedFontState &fontState = shState->fontState();
+
+	const char *lineStart = str;
+	const char *ptr = str;
+	int lineW = 0;
+
+	/* Just past the last space on the line,
+	 * and the line width up to there */
+	const char *spaceEnd = 0;
+	int spaceW = 0;
+
+	while (*ptr)
+	{
+		const char *next;
+		const uint16_t ch = utf8_to_ucs2(ptr, &next);
+
+		/* Stray byte, passed through as is */
+		if (next == ptr)
+		{
+			++ptr;
+			continue;
+		}
+
+		if (ch == '\n')
+		{
+			lines.push_back(std::string(lineStart, ptr));
+			lineStart = ptr = next;
+			lineW = 0;
+			spaceEnd = 0;
+			continue;
+		}
+
+		const int advance = (ch == '\r') ? 0 : fontState.glyphAdvance(font, style, ch);
+
+		if (lineW + advance > width && ptr > lineStart)
+		{
+			if (ch == ' ')
+			{
+				/* Break right here, the space goes away */
+				lines.push_back(std::string(lineStart, ptr));
+				lineStart = ptr = next;
+				lineW = 0;
+				spaceEnd = 0;
+				continue;
+			}
+
+			if (spaceEnd)
+			{
+				lines.push_back(std::string(lineStart, spaceEnd - 1));
+				lineStart = spaceEnd;
+				lineW -= spaceW;
+			}
+			else
+			{
+				lines.push_back(std::string(lineStart, ptr));
+				lineStart = ptr;
+				lineW = 0;
+			}
+
+			spaceEnd = 0;
+		}
+
+		lineW += advance;
+		ptr = next;
+
+		if (ch == ' ')
+		{
+			spaceEnd = ptr;
+			spaceW = lineW;
+		}
+	}
+
+	lines.push_back(std::string(lineStart, ptr));
+}
@@ -24,15 +24,91 @@
 
 #include "etc.h"
 #include "util.h"
+#include "bindingslots.h"
 
 #include <vector>
 #include <string>
+#include <stdint.h>
 
 struct SDL_RWops;
+struct SDL_Surface;
 struct _TTF_Font;
 struct Config;
 
 struct SharedFontStatePrivate;
+struct SdfAtlasPrivate;
+
+/* One glyph of an SdfAtlas, in pixels at 'SdfAtlas::BaseSize' */
+struct SdfGlyph
+{
+	/* Cell in the atlas texture, including the margin the
+	 * distance field spreads into. Empty for blank glyphs */
+	IntRect rect;
+
+	/* Top left corner of the cell, relative to the pen
+	 * position on the top edge of the line */
+	Vec2i offset;
+
+	int advance;
+};
+
+/* Signed distance fields of the glyphs of one font and style,
+ * rasterized once at 'BaseSize' into a single channel texture.
+ * Sampled with linear filtering and cut off at 0.5, the glyph
+ * edges stay sharp at any scale, so all sizes of a font (and any
+ * zoom or rotation on top) share one atlas. Glyphs are added on
+ * first use; must only be used on the GL thread */
+class SdfAtlas
+{
+public:
+	enum
+	{
+		/* Font size the glyphs are rasterized at */
+		BaseSize = 48,
+
+		/* Distance in pixels (at 'BaseSize') covered by the field
+		 * on either side of an edge; bounds the outline width */
+		Spread = 6
+	};
+
+	SdfAtlas(_TTF_Font *font, int style);
+	~SdfAtlas();
+
+	/* Returns 0 if the font has no glyph for 'ch' */
+	const SdfGlyph *glyph(uint16_t ch);
+
+	int lineHeight() const;
+
+	/* Changes whenever glyphs move or leave the atlas,
+	 * after which any 'glyph()' results are stale */
+	unsigned int generation() const;
+
+	Vec2i texSize() const;
+	void bindTex();
+
+	/* Drops all glyphs and shrinks the texture back */
+	void reset();
+
+private:
+	SdfAtlasPrivate *p;
+};
+
+/* Everything that affects the pixels produced
+ * by one Bitmap#draw_text string rasterization */
+struct TextRenderKey
+{
+	_TTF_Font *font;
+	int style;
+	bool solid;
+	bool shadow;
+	bool outline;
+	/* RGB only, alpha is applied when blitting */
+	uint32_t color;
+	uint32_t outColor;
+	std::string text;
+
+	bool operator<(const TextRenderKey &o) const;
+};
 
 class SharedFontState
 {
@@ -41,11 +117,19 @@ public:
 	~SharedFontState();
 
 	/* Called from FileSystem during font cache initialization
-	 * (when "Fonts/" is scanned for available assets).
-	 * 'ops' is an opened handle to a possible font file,
+	 * (when "Fonts/" is scanned for available assets), which
+	 * happens on the first font lookup. Returns true if the
+	 * file at 'filename' with the given size and modification
+	 * time is known from a previous run; otherwise the file is
+	 * opened and handed to 'initFontSetCB' */
+	bool initFontSetCached(const std::string &filename,
+	                       int64_t size, int64_t mtime);
+
+	/* 'ops' is an opened handle to a possible font file,
 	 * 'filename' is the corresponding path */
 	void initFontSetCB(SDL_RWops &ops,
-	                   const std::string &filename);
+	                   const std::string &filename,
+	                   int64_t size, int64_t mtime);
 
 	_TTF_Font *getFont(std::string family,
 	                   int size);
@@ -55,6 +139,38 @@ public:
 	static _TTF_Font *openBundled(int size);
     void setDefaultFontFamily(const std::string &family);
 
+	/* LRU cache of rasterized text. Returned surfaces are owned
+	 * by the cache and stay valid until the next 'storeText()'.
+	 * 'rawHeight' is the text height before shadow / outline */
+	SDL_Surface *findText(const TextRenderKey &key, int &rawHeight);
+
+	/* Takes ownership of 'surf' if it returns true */
+	bool storeText(const TextRenderKey &key, SDL_Surface *surf, int rawHeight);
+
+	/* LRU cache of Bitmap#text_size results. 'style' is the
+	 * TTF style the font was measured with */
+	bool findTextSize(_TTF_Font *font, int style, const std::string &text,
+	                  int &w, int &h);
+	void storeTextSize(_TTF_Font *font, int style, const std::string &text,
+	                   int w, int h);
+
+	/* Horizontal advance of one character, cached until
+	 * 'trimCaches()'. 'style' as for the text sizes */
+	int glyphAdvance(_TTF_Font *font, int style, uint16_t ch);
+
+	/* Surface (ABGR8888) over reusable memory, for intermediate
+	 * steps of text rendering. Freeing it only releases the header.
+	 * Surfaces of the same 'slot' share memory, so only one of
+	 * them may be in use at a time */
+	SDL_Surface *scratchSurface(int slot, int w, int h);
+
+	/* The distance field atlas for 'family' in TTF 'style',
+	 * shared by all sizes. Lives as long as the font state */
+	SdfAtlas &sdfAtlas(const std::string &family, int style);
+
+	/* Empties the text caches and scratch memory */
+	void trimCaches();
+
 private:
 	SharedFontStatePrivate *p;
 };
@@ -113,8 +229,19 @@ public:
 
 	static void initDefaults(const SharedFontState &sfs);
 
+	/* Breaks 'str' into lines no wider than 'width', after
+	 * the last space that fits or, failing that (CJK text,
+	 * overlong words), after the last character that does.
+	 * Line feeds always break. Widths are summed glyph
+	 * advances, so kerning is not taken into account */
+	void layout(const char *str, int width,
+	            std::vector<std::string> &lines);
+
 	/* internal */
 	_TTF_Font *getSdlFont();
+	SdfAtlas &getSdfAtlas();
+
+	BindingSlots bindingSlots;
 
 private:
 	FontPrivate *p;
@@ -0,0 +1,180 @@
+/*
+** compressedtex.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "compressedtex.h"
+
+#include "util.h"
+
+#include <SDL_endian.h>
+
+#include <string.h>
+
+namespace CompressedTex
+{
+
+struct FormatInfo
+{
+	/* VkFormat as stored in KTX2 files */
+	uint32_t vkFormat;
+	GLenum glFormat;
+	int blockW, blockH;
+	int blockBytes;
+};
+
+/* sRGB variants are sampled as UNORM, as we blend in gamma
+ * space anyway and want the stored values untouched */
+static const FormatInfo formats[] =
+{
+	{ 131, _GL_COMPRESSED_RGB_S3TC_DXT1, 4, 4, 8 },
+	{ 132, _GL_COMPRESSED_RGB_S3TC_DXT1, 4, 4, 8 },
+	{ 133, _GL_COMPRESSED_RGBA_S3TC_DXT1, 4, 4, 8 },
+	{ 134, _GL_COMPRESSED_RGBA_S3TC_DXT1, 4, 4, 8 },
+	{ 137, _GL_COMPRESSED_RGBA_S3TC_DXT5, 4, 4, 16 },
+	{ 138, _GL_COMPRESSED_RGBA_S3TC_DXT5, 4, 4, 16 },
+	{ 145, _GL_COMPRESSED_RGBA_BPTC_UNORM, 4, 4, 16 },
+	{ 146, _GL_COMPRESSED_RGBA_BPTC_UNORM, 4, 4, 16 },
+	{ 147, _GL_COMPRESSED_RGB8_ETC2, 4, 4, 8 },
+	{ 148, _GL_COMPRESSED_RGB8_ETC2, 4, 4, 8 },
+	{ 149, _GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2, 4, 4, 8 },
+	{ 150, _GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2, 4, 4, 8 },
+	{ 151, _GL_COMPRESSED_RGBA8_ETC2_EAC, 4, 4, 16 },
+	{ 152, _GL_COMPRESSED_RGBA8_ETC2_EAC, 4, 4, 16 },
+	{ 157, _GL_COMPRESSED_RGBA_ASTC_4x4, 4, 4, 16 },
+	{ 158, _GL_COMPRESSED_RGBA_ASTC_4x4, 4, 4, 16 },
+	{ 161, _GL_COMPRESSED_RGBA_ASTC_5x5, 5, 5, 16 },
+	{ 162, _GL_COMPRESSED_RGBA_ASTC_5x5, 5, 5, 16 },
+	{ 165, _GL_COMPRESSED_RGBA_ASTC_6x6, 6, 6, 16 },
+	{ 166, _GL_COMPRESSED_RGBA_ASTC_6x6, 6, 6, 16 },
+	{ 171, _GL_COMPRESSED_RGBA_ASTC_8x8, 8, 8, 16 },
+	{ 172, _GL_COMPRESSED_RGBA_ASTC_8x8, 8, 8, 16 }
+};
+
+static const FormatInfo *findFormat(uint32_t vkFormat)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(formats); ++i)
+		if (formats[i].vkFormat == vkFormat)
+			return &formats[i];
+
+	return 0;
+}
+
+static const uint8_t ktx2Identifier[12] =
+{
+	0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'
+};
+
+bool readKTX2(SDL_RWops &ops, Image &img)
+{
+	uint8_t ident[sizeof(ktx2Identifier)];
+
+	if (SDL_RWread(&ops, ident, sizeof(ident), 1) != 1 ||
+	    memcmp(ident, ktx2Identifier, sizeof(ident)))
+		return false;
+
+	uint32_t vkFormat = SDL_ReadLE32(&ops);
+	/* typeSize */ SDL_ReadLE32(&ops);
+	uint32_t width = SDL_ReadLE32(&ops);
+	uint32_t height = SDL_ReadLE32(&ops);
+	uint32_t depth = SDL_ReadLE32(&ops);
+	uint32_t layers = SDL_ReadLE32(&ops);
+	uint32_t faces = SDL_ReadLE32(&ops);
+	/* levelCount */ SDL_ReadLE32(&ops);
+	uint32_t supercompression = SDL_ReadLE32(&ops);
+
+	/* DFD, key/value and supercompression global data,
+	 * none of which we need */
+	for (int i = 0; i < 4; ++i)
+		SDL_ReadLE32(&ops);
+	for (int i = 0; i < 2; ++i)
+		SDL_ReadLE64(&ops);
+
+	/* The first entry of the level index is the base level */
+	uint64_t offset = SDL_ReadLE64(&ops);
+	uint64_t length = SDL_ReadLE64(&ops);
+
+	const FormatInfo *info = findFormat(vkFormat);
+
+	if (!info || supercompression != 0 || depth != 0 || layers != 0 || faces != 1)
+		return false;
+
+	if (width == 0 || height == 0)
+		return false;
+
+	const uint64_t blocksX = (width + info->blockW - 1) / info->blockW;
+	const uint64_t blocksY = (height + info->blockH - 1) / info->blockH;
+
+	if (length != blocksX * blocksY * info->blockBytes)
+		return false;
+
+	img.format = info->glFormat;
+	img.width = width;
+	img.height = height;
+	img.data.resize(length);
+
+	if (SDL_RWseek(&ops, offset, RW_SEEK_SET) < 0)
+		return false;
+
+	return SDL_RWread(&ops, &img.data[0], length, 1) == 1;
+}
+
+bool supported(GLenum format)
+{
+	switch (format)
+	{
+	case _GL_COMPRESSED_RGB_S3TC_DXT1 :
+	case _GL_COMPRESSED_RGBA_S3TC_DXT1 :
+	case _GL_COMPRESSED_RGBA_S3TC_DXT5 :
+		return gl.tex_s3tc;
+
+	case _GL_COMPRESSED_RGBA_BPTC_UNORM :
+		return gl.tex_bptc;
+
+	case _GL_COMPRESSED_RGB8_ETC2 :
+	case _GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2 :
+	case _GL_COMPRESSED_RGBA8_ETC2_EAC :
+		return gl.tex_etc2;
+
+	case _GL_COMPRESSED_RGBA_ASTC_4x4 :
+	case _GL_COMPRESSED_RGBA_ASTC_5x5 :
+	case _GL_COMPRESSED_RGBA_ASTC_6x6 :
+	case _GL_COMPRESSED_RGBA_ASTC_8x8 :
+		return gl.tex_astc;
+	}
+
+	return false;
+}
+
+TEX::ID upload(const Image &img)
+{
+	TEX::ID tex = TEX::gen();
+
+	TEX::bind(tex);
+	TEX::setRepeat(false);
+	TEX::setSmooth(false);
+
+	gl.CompressedTexImage2D(GL_TEXTURE_2D, 0, img.format, img.width, img.height,
+	                        0, img.data.size(), &img.data[0]);
+
+	++glCounters.texUploads;
+	glCounters.texUploadBytes += img.data.size();
+
+	return tex;
+}
+
+}
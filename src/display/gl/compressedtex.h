@@ -0,0 +1,56 @@
+/*
+** compressedtex.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMPRESSEDTEX_H
+#define COMPRESSEDTEX_H
+
+#include "gl-util.h"
+
+#include <SDL_rwops.h>
+
+#include <stdint.h>
+#include <vector>
+
+/* Textures in a GPU compressed format (BC1/3/7, ETC2, ASTC),
+ * read from pre-compressed KTX2 files. They can be sampled
+ * like any other texture, but never rendered into */
+namespace CompressedTex
+{
+
+struct Image
+{
+	GLenum format;
+	int width, height;
+	std::vector<uint8_t> data;
+};
+
+/* Reads the first level of a KTX2 file. Returns false if the
+ * file is malformed, supercompressed, not a plain 2D texture
+ * or in a format we don't know */
+bool readKTX2(SDL_RWops &ops, Image &img);
+
+/* Whether the driver can sample textures in 'format' */
+bool supported(GLenum format);
+
+/* Uploads 'img' into a new texture, left bound */
+TEX::ID upload(const Image &img);
+
+}
+
+#endif // COMPRESSEDTEX_H
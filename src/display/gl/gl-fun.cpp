@@ -20,6 +20,7 @@
  */
 
 #include "gl-fun.h"
+#include "gpu-profile.h"
 
 #include "boost-hash.h"
 #include "exception.h"
@@ -74,7 +75,7 @@ gl.name = (type) SDL_GL_GetProcAddress("gl" #name EXT_SUFFIX);
 #define EXC(msg) \
 Exception(Exception::MKXPError, "%s", msg)
 
-void initGLFunctions()
+void initGLFunctions(GPUProfile &profile)
 {
 #define EXT_SUFFIX ""
     GL_20_FUN;
@@ -120,12 +121,18 @@ void initGLFunctions()
         GL_ES_FUN;
     }
     
-    BoostSet<std::string> ext;
+    /* A profile of the same driver already knows them */
+    profile.matchDriver();
     
-    if (glMajor >= 3)
-        parseExtensionsCore(gl.GetIntegerv, ext);
-    else
-        parseExtensionsCompat(gl.GetString, ext);
+    BoostSet<std::string> &ext = profile.extensions;
+    
+    if (!profile.cached)
+    {
+        if (glMajor >= 3)
+            parseExtensionsCore(gl.GetIntegerv, ext);
+        else
+            parseExtensionsCompat(gl.GetString, ext);
+    }
     
 #define HAVE_EXT(_ext) ext.contains("GL_" #_ext)
     
@@ -177,6 +184,85 @@ void initGLFunctions()
         GL_VAO_FUN;
     }
     
+    /* Buffer mapping entrypoints */
+    if (glMajor >= 3 || HAVE_EXT(ARB_map_buffer_range))
+    {
+#undef EXT_SUFFIX
+#define EXT_SUFFIX ""
+        GL_MAP_BUFFER_FUN;
+    }
+    else if (gles && HAVE_EXT(EXT_map_buffer_range))
+    {
+#undef EXT_SUFFIX
+#define EXT_SUFFIX "EXT"
+        GL_MAP_BUFFER_FUN;
+    }
+    
+    /* Buffer storage entrypoints */
+    if (!gles && HAVE_EXT(ARB_buffer_storage))
+    {
+#undef EXT_SUFFIX
+#define EXT_SUFFIX ""
+        GL_BUFFER_STORAGE_FUN;
+    }
+    else if (gles && HAVE_EXT(EXT_buffer_storage))
+    {
+#undef EXT_SUFFIX
+#define EXT_SUFFIX "EXT"
+        GL_BUFFER_STORAGE_FUN;
+    }
+    
+    /* Sync object entrypoints */
+    if (HAVE_EXT(ARB_sync) || (gles && glMajor >= 3))
+    {
+#undef EXT_SUFFIX
+#define EXT_SUFFIX ""
+        GL_SYNC_FUN;
+    }
+    
+    /* Program binary entrypoints */
+    if (glMajor >= 4 || HAVE_EXT(ARB_get_program_binary) || (gles && glMajor >= 3))
+    {
+#undef EXT_SUFFIX
+#define EXT_SUFFIX ""
+        GL_PROGRAM_BINARY_FUN;
+        GL_PROGRAM_PARAMETER_FUN;
+    }
+    else if (gles && HAVE_EXT(OES_get_program_binary))
+    {
+#undef EXT_SUFFIX
+#define EXT_SUFFIX "OES"
+        GL_PROGRAM_BINARY_FUN;
+    }
+    
+    /* Parallel shader compile entrypoints */
+    if (HAVE_EXT(KHR_parallel_shader_compile))
+    {
+#undef EXT_SUFFIX
+#define EXT_SUFFIX "KHR"
+        GL_PARALLEL_COMPILE_FUN;
+    }
+    else if (HAVE_EXT(ARB_parallel_shader_compile))
+    {
+#undef EXT_SUFFIX
+#define EXT_SUFFIX "ARB"
+        GL_PARALLEL_COMPILE_FUN;
+    }
+    
+    /* Timer query entrypoints */
+    if (!gles && HAVE_EXT(ARB_timer_query))
+    {
+#undef EXT_SUFFIX
+#define EXT_SUFFIX ""
+        GL_TIMER_QUERY_FUN;
+    }
+    else if (gles && HAVE_EXT(EXT_disjoint_timer_query))
+    {
+#undef EXT_SUFFIX
+#define EXT_SUFFIX "EXT"
+        GL_TIMER_QUERY_FUN;
+    }
+    
     /* Debug callback entrypoints */
     if (HAVE_EXT(KHR_debug))
     {
@@ -204,4 +290,56 @@ void initGLFunctions()
     
     if (!gles || glMajor >= 3 || HAVE_EXT(OES_texture_npot))
         gl.npot_repeat = true;
+    
+    if (gl.GenerateMipmap && gl.npot_repeat)
+        gl.npot_mipmap = true;
+    
+    if (!gles || glMajor >= 3 || HAVE_EXT(OES_element_index_uint))
+        gl.element_index_uint = true;
+    
+    /* GLES2 has no pixel pack buffers, even with mapping support */
+    if (gl.MapBufferRange && gl.UnmapBuffer && (!gles || glMajor >= 3))
+        gl.async_readback = true;
+    
+    if (gles ? glMajor >= 3 : (glMajor >= 3 || HAVE_EXT(ARB_pixel_buffer_object)))
+        gl.unpack_buffer = true;
+    
+    if (gl.GenQueries && gl.BeginQuery && gl.GetQueryObjectui64v)
+        gl.timer_query = true;
+    
+    if (gl.BufferStorage && gl.MapBufferRange && gl.FenceSync && gl.ClientWaitSync)
+        gl.persistent_map = true;
+    
+    if (HAVE_EXT(EXT_texture_compression_s3tc))
+        gl.tex_s3tc = true;
+    
+    if (HAVE_EXT(ARB_texture_compression_bptc) || HAVE_EXT(EXT_texture_compression_bptc))
+        gl.tex_bptc = true;
+    
+    if ((gles && glMajor >= 3) || HAVE_EXT(ARB_ES3_compatibility))
+        gl.tex_etc2 = true;
+    
+    if (HAVE_EXT(KHR_texture_compression_astc_ldr))
+        gl.tex_astc = true;
+    
+    /* GLES keeps GL_LUMINANCE around in every version */
+    if (!gles && (glMajor >= 3 || HAVE_EXT(ARB_texture_rg)))
+        gl.tex_rg = true;
+    
+    /* Drivers may support the entrypoints without any format */
+    if (gl.GetProgramBinary && gl.ProgramBinary)
+    {
+        GLint formats = 0;
+        gl.GetIntegerv(_GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        
+        if (formats > 0)
+            gl.program_binary = true;
+    }
+    
+    /* Let the driver pick the thread count */
+    if (gl.MaxShaderCompilerThreads)
+    {
+        gl.MaxShaderCompilerThreads(0xFFFFFFFF);
+        gl.parallel_compile = true;
+    }
 }
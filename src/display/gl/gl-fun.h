@@ -22,6 +22,8 @@
 #ifndef GLFUN_H
 #define GLFUN_H
 
+#include <stdint.h>
+
 #ifdef GLES2_HEADER
 #include <SDL_opengles2.h>
 #define APIENTRYP GL_APIENTRYP
@@ -33,6 +35,7 @@
 typedef GLenum (APIENTRYP _PFNGLGETERRORPROC) (void);
 typedef void (APIENTRYP _PFNGLCLEARCOLORPROC) (GLclampf red, GLclampf green, GLclampf blue, GLclampf alpha);
 typedef void (APIENTRYP _PFNGLCLEARPROC) (GLbitfield mask);
+typedef void (APIENTRYP _PFNGLFLUSHPROC) (void);
 typedef const GLubyte * (APIENTRYP _PFNGLGETSTRINGPROC) (GLenum name);
 typedef void (APIENTRYP _PFNGLGETINTEGERVPROC) (GLenum pname, GLint *params);
 typedef void (APIENTRYP _PFNGLPIXELSTOREIPROC) (GLenum pname, GLint param);
@@ -45,6 +48,9 @@ typedef void (APIENTRYP _PFNGLBLENDFUNCPROC) (GLenum sfactor, GLenum dfactor);
 typedef void (APIENTRYP _PFNGLBLENDFUNCSEPARATEPROC) (GLenum sfactorRGB, GLenum dfactorRGB, GLenum sfactorAlpha, GLenum dfactorAlpha);
 typedef void (APIENTRYP _PFNGLBLENDEQUATIONPROC) (GLenum mode);
 typedef void (APIENTRYP _PFNGLDRAWELEMENTSPROC) (GLenum mode, GLsizei count, GLenum type, const GLvoid *indices);
+typedef void (APIENTRYP _PFNGLDEPTHFUNCPROC) (GLenum func);
+typedef void (APIENTRYP _PFNGLDEPTHMASKPROC) (GLboolean flag);
+typedef void (APIENTRYP _PFNGLDEPTHRANGEPROC) (double near, double far);
 
 /* Texture */
 typedef void (APIENTRYP _PFNGLGENTEXTURESPROC) (GLsizei n, GLuint *textures);
@@ -54,6 +60,7 @@ typedef void (APIENTRYP _PFNGLTEXIMAGE2DPROC) (GLenum target, GLint level, GLint
 typedef void (APIENTRYP _PFNGLTEXSUBIMAGE2DPROC) (GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const GLvoid *pixels);
 typedef void (APIENTRYP _PFNGLTEXPARAMETERIPROC) (GLenum target, GLenum pname, GLint param);
 typedef void (APIENTRYP _PFNGLACTIVETEXTUREPROC) (GLenum texture);
+typedef void (APIENTRYP _PFNGLCOMPRESSEDTEXIMAGE2DPROC) (GLenum target, GLint level, GLenum internalformat, GLsizei width, GLsizei height, GLint border, GLsizei imageSize, const GLvoid *data);
 
 /* Debugging */
 typedef void (APIENTRY * _GLDEBUGPROC) (GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void *userParam);
@@ -66,6 +73,23 @@ typedef void (APIENTRYP _PFNGLDELETEBUFFERSPROC) (GLsizei n, const GLuint* buffe
 typedef void (APIENTRYP _PFNGLBINDBUFFERPROC) (GLenum target, GLuint buffer);
 typedef void (APIENTRYP _PFNGLBUFFERDATAPROC) (GLenum target, GLsizeiptr size, const GLvoid* data, GLenum usage);
 typedef void (APIENTRYP _PFNGLBUFFERSUBDATAPROC) (GLenum target, GLintptr offset, GLsizeiptr size, const GLvoid* data);
+typedef void* (APIENTRYP _PFNGLMAPBUFFERRANGEPROC) (GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+typedef GLboolean (APIENTRYP _PFNGLUNMAPBUFFERPROC) (GLenum target);
+typedef void (APIENTRYP _PFNGLBUFFERSTORAGEPROC) (GLenum target, GLsizeiptr size, const GLvoid* data, GLbitfield flags);
+
+/* Sync objects */
+typedef struct __GLsync *_GLsync;
+typedef _GLsync (APIENTRYP _PFNGLFENCESYNCPROC) (GLenum condition, GLbitfield flags);
+typedef GLenum (APIENTRYP _PFNGLCLIENTWAITSYNCPROC) (_GLsync sync, GLbitfield flags, uint64_t timeout);
+typedef void (APIENTRYP _PFNGLDELETESYNCPROC) (_GLsync sync);
+
+/* Timer query */
+typedef void (APIENTRYP _PFNGLGENQUERIESPROC) (GLsizei n, GLuint *ids);
+typedef void (APIENTRYP _PFNGLDELETEQUERIESPROC) (GLsizei n, const GLuint *ids);
+typedef void (APIENTRYP _PFNGLBEGINQUERYPROC) (GLenum target, GLuint id);
+typedef void (APIENTRYP _PFNGLENDQUERYPROC) (GLenum target);
+typedef void (APIENTRYP _PFNGLGETQUERYOBJECTIVPROC) (GLuint id, GLenum pname, GLint *params);
+typedef void (APIENTRYP _PFNGLGETQUERYOBJECTUI64VPROC) (GLuint id, GLenum pname, uint64_t *params);
 
 /* Shader */
 typedef GLuint (APIENTRYP _PFNGLCREATESHADERPROC) (GLenum type);
@@ -84,6 +108,14 @@ typedef void (APIENTRYP _PFNGLLINKPROGRAMPROC) (GLuint program);
 typedef void (APIENTRYP _PFNGLGETPROGRAMIVPROC) (GLuint program, GLenum pname, GLint* param);
 typedef void (APIENTRYP _PFNGLGETPROGRAMINFOLOGPROC) (GLuint program, GLsizei bufSize, GLsizei* length, GLchar* infoLog);
 
+/* Program binary */
+typedef void (APIENTRYP _PFNGLGETPROGRAMBINARYPROC) (GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary);
+typedef void (APIENTRYP _PFNGLPROGRAMBINARYPROC) (GLuint program, GLenum binaryFormat, const void *binary, GLsizei length);
+typedef void (APIENTRYP _PFNGLPROGRAMPARAMETERIPROC) (GLuint program, GLenum pname, GLint value);
+
+/* Parallel shader compile */
+typedef void (APIENTRYP _PFNGLMAXSHADERCOMPILERTHREADSPROC) (GLuint count);
+
 /* Uniform */
 typedef GLint (APIENTRYP _PFNGLGETUNIFORMLOCATIONPROC) (GLuint program, const GLchar* name);
 typedef void (APIENTRYP _PFNGLUNIFORM1FPROC) (GLint location, GLfloat v0);
@@ -104,6 +136,12 @@ typedef void (APIENTRYP _PFNGLGENFRAMEBUFFERSPROC) (GLsizei n, GLuint* framebuff
 typedef void (APIENTRYP _PFNGLDELETEFRAMEBUFFERSPROC) (GLsizei n, const GLuint* framebuffers);
 typedef void (APIENTRYP _PFNGLBINDFRAMEBUFFERPROC) (GLenum target, GLuint framebuffer);
 typedef void (APIENTRYP _PFNGLFRAMEBUFFERTEXTURE2DPROC) (GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
+typedef void (APIENTRYP _PFNGLGENRENDERBUFFERSPROC) (GLsizei n, GLuint* renderbuffers);
+typedef void (APIENTRYP _PFNGLDELETERENDERBUFFERSPROC) (GLsizei n, const GLuint* renderbuffers);
+typedef void (APIENTRYP _PFNGLBINDRENDERBUFFERPROC) (GLenum target, GLuint renderbuffer);
+typedef void (APIENTRYP _PFNGLRENDERBUFFERSTORAGEPROC) (GLenum target, GLenum internalformat, GLsizei width, GLsizei height);
+typedef void (APIENTRYP _PFNGLFRAMEBUFFERRENDERBUFFERPROC) (GLenum target, GLenum attachment, GLenum renderbuffertarget, GLuint renderbuffer);
+typedef void (APIENTRYP _PFNGLGENERATEMIPMAPPROC) (GLenum target);
 typedef void (APIENTRYP _PFNGLBLITFRAMEBUFFERPROC) (GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1, GLint dstX0, GLint dstY0, GLint dstX1, GLint dstY1, GLbitfield mask, GLenum filter);
 
 /* Vertex array object */
@@ -113,6 +151,7 @@ typedef void (APIENTRYP _PFNGLBINDVERTEXARRAYPROC) (GLuint array);
 
 /* GLES only */
 typedef void (APIENTRYP _PFNGLRELEASESHADERCOMPILERPROC) (void);
+typedef void (APIENTRYP _PFNGLDEPTHRANGEFPROC) (GLclampf near, GLclampf far);
 
 #ifdef GLES2_HEADER
 #define GL_NUM_EXTENSIONS 0x821D
@@ -121,13 +160,60 @@ typedef void (APIENTRYP _PFNGLRELEASESHADERCOMPILERPROC) (void);
 #define GL_UNPACK_ROW_LENGTH 0x0CF2
 #define GL_UNPACK_SKIP_PIXELS 0x0CF4
 #define GL_UNPACK_SKIP_ROWS 0x0CF3
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#define GL_STREAM_READ 0x88E1
+#define GL_MAP_READ_BIT 0x0001
+#define GL_TIME_ELAPSED 0x88BF
+#define GL_QUERY_RESULT 0x8866
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
 #endif
 
+/* EXT_disjoint_timer_query */
+#define _GL_GPU_DISJOINT 0x8FBB
+
+/* ARB_get_program_binary, OES_get_program_binary */
+#define _GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define _GL_PROGRAM_BINARY_LENGTH 0x8741
+#define _GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+
+/* KHR_parallel_shader_compile, ARB_parallel_shader_compile */
+#define _GL_COMPLETION_STATUS 0x91B1
+
+/* Compressed texture formats */
+#define _GL_COMPRESSED_RGB_S3TC_DXT1 0x83F0
+#define _GL_COMPRESSED_RGBA_S3TC_DXT1 0x83F1
+#define _GL_COMPRESSED_RGBA_S3TC_DXT5 0x83F3
+#define _GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#define _GL_COMPRESSED_RGB8_ETC2 0x9274
+#define _GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2 0x9276
+#define _GL_COMPRESSED_RGBA8_ETC2_EAC 0x9278
+#define _GL_COMPRESSED_RGBA_ASTC_4x4 0x93B0
+#define _GL_COMPRESSED_RGBA_ASTC_5x5 0x93B2
+#define _GL_COMPRESSED_RGBA_ASTC_6x6 0x93B4
+#define _GL_COMPRESSED_RGBA_ASTC_8x8 0x93B7
+
+/* Reduced precision texture formats */
+#define _GL_RGB5 0x8050
+#define _GL_RGBA4 0x8056
+#define _GL_R8 0x8229
+#define _GL_UNSIGNED_SHORT_4_4_4_4 0x8033
+#define _GL_UNSIGNED_SHORT_5_6_5 0x8363
+
+/* ARB_buffer_storage, ARB_sync */
+#define _GL_MAP_WRITE 0x0002
+#define _GL_MAP_PERSISTENT 0x0040
+#define _GL_MAP_COHERENT 0x0080
+#define _GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define _GL_SYNC_FLUSH_COMMANDS 0x0001
+#define _GL_TIMEOUT_EXPIRED 0x911B
+
 #define GL_20_FUN \
 	/* Etc */ \
 	GL_FUN(GetError, _PFNGLGETERRORPROC) \
 	GL_FUN(ClearColor, _PFNGLCLEARCOLORPROC) \
 	GL_FUN(Clear, _PFNGLCLEARPROC) \
+	GL_FUN(Flush, _PFNGLFLUSHPROC) \
 	GL_FUN(GetString, _PFNGLGETSTRINGPROC) \
 	GL_FUN(GetIntegerv, _PFNGLGETINTEGERVPROC) \
 	GL_FUN(PixelStorei, _PFNGLPIXELSTOREIPROC) \
@@ -140,6 +226,10 @@ typedef void (APIENTRYP _PFNGLRELEASESHADERCOMPILERPROC) (void);
 	GL_FUN(BlendFuncSeparate, _PFNGLBLENDFUNCSEPARATEPROC) \
 	GL_FUN(BlendEquation, _PFNGLBLENDEQUATIONPROC) \
 	GL_FUN(DrawElements, _PFNGLDRAWELEMENTSPROC) \
+	GL_FUN(DepthFunc, _PFNGLDEPTHFUNCPROC) \
+	GL_FUN(DepthMask, _PFNGLDEPTHMASKPROC) \
+	/* Desktop only, see DepthRangef */ \
+	GL_FUN(DepthRange, _PFNGLDEPTHRANGEPROC) \
 	/* Texture */ \
 	GL_FUN(GenTextures, _PFNGLGENTEXTURESPROC) \
 	GL_FUN(DeleteTextures, _PFNGLDELETETEXTURESPROC) \
@@ -148,6 +238,7 @@ typedef void (APIENTRYP _PFNGLRELEASESHADERCOMPILERPROC) (void);
 	GL_FUN(TexSubImage2D, _PFNGLTEXSUBIMAGE2DPROC) \
 	GL_FUN(TexParameteri, _PFNGLTEXPARAMETERIPROC) \
 	GL_FUN(ActiveTexture, _PFNGLACTIVETEXTUREPROC) \
+	GL_FUN(CompressedTexImage2D, _PFNGLCOMPRESSEDTEXIMAGE2DPROC) \
 	/* Buffer object */ \
 	GL_FUN(GenBuffers, _PFNGLGENBUFFERSPROC) \
 	GL_FUN(DeleteBuffers, _PFNGLDELETEBUFFERSPROC) \
@@ -184,14 +275,21 @@ typedef void (APIENTRYP _PFNGLRELEASESHADERCOMPILERPROC) (void);
 	GL_FUN(VertexAttribPointer, _PFNGLVERTEXATTRIBPOINTERPROC)
 
 #define GL_ES_FUN \
-	GL_FUN(ReleaseShaderCompiler, _PFNGLRELEASESHADERCOMPILERPROC)
+	GL_FUN(ReleaseShaderCompiler, _PFNGLRELEASESHADERCOMPILERPROC) \
+	GL_FUN(DepthRangef, _PFNGLDEPTHRANGEFPROC)
 
 #define GL_FBO_FUN \
 	/* Framebuffer object */ \
 	GL_FUN(GenFramebuffers, _PFNGLGENFRAMEBUFFERSPROC) \
 	GL_FUN(DeleteFramebuffers, _PFNGLDELETEFRAMEBUFFERSPROC) \
 	GL_FUN(BindFramebuffer, _PFNGLBINDFRAMEBUFFERPROC) \
-	GL_FUN(FramebufferTexture2D, _PFNGLFRAMEBUFFERTEXTURE2DPROC)
+	GL_FUN(FramebufferTexture2D, _PFNGLFRAMEBUFFERTEXTURE2DPROC) \
+	GL_FUN(GenRenderbuffers, _PFNGLGENRENDERBUFFERSPROC) \
+	GL_FUN(DeleteRenderbuffers, _PFNGLDELETERENDERBUFFERSPROC) \
+	GL_FUN(BindRenderbuffer, _PFNGLBINDRENDERBUFFERPROC) \
+	GL_FUN(RenderbufferStorage, _PFNGLRENDERBUFFERSTORAGEPROC) \
+	GL_FUN(FramebufferRenderbuffer, _PFNGLFRAMEBUFFERRENDERBUFFERPROC) \
+	GL_FUN(GenerateMipmap, _PFNGLGENERATEMIPMAPPROC)
 
 #define GL_FBO_BLIT_FUN \
 	GL_FUN(BlitFramebuffer, _PFNGLBLITFRAMEBUFFERPROC)
@@ -202,6 +300,41 @@ typedef void (APIENTRYP _PFNGLRELEASESHADERCOMPILERPROC) (void);
 	GL_FUN(DeleteVertexArrays, _PFNGLDELETEVERTEXARRAYSPROC) \
 	GL_FUN(BindVertexArray, _PFNGLBINDVERTEXARRAYPROC)
 
+#define GL_MAP_BUFFER_FUN \
+	/* Buffer mapping (pixel pack readback) */ \
+	GL_FUN(MapBufferRange, _PFNGLMAPBUFFERRANGEPROC) \
+	GL_FUN(UnmapBuffer, _PFNGLUNMAPBUFFERPROC)
+
+#define GL_BUFFER_STORAGE_FUN \
+	/* Immutable buffer storage (persistent mapping) */ \
+	GL_FUN(BufferStorage, _PFNGLBUFFERSTORAGEPROC)
+
+#define GL_SYNC_FUN \
+	/* Sync objects */ \
+	GL_FUN(FenceSync, _PFNGLFENCESYNCPROC) \
+	GL_FUN(ClientWaitSync, _PFNGLCLIENTWAITSYNCPROC) \
+	GL_FUN(DeleteSync, _PFNGLDELETESYNCPROC)
+
+#define GL_PROGRAM_BINARY_FUN \
+	/* Program binaries (shader cache) */ \
+	GL_FUN(GetProgramBinary, _PFNGLGETPROGRAMBINARYPROC) \
+	GL_FUN(ProgramBinary, _PFNGLPROGRAMBINARYPROC)
+
+#define GL_PROGRAM_PARAMETER_FUN \
+	GL_FUN(ProgramParameteri, _PFNGLPROGRAMPARAMETERIPROC)
+
+#define GL_PARALLEL_COMPILE_FUN \
+	GL_FUN(MaxShaderCompilerThreads, _PFNGLMAXSHADERCOMPILERTHREADSPROC)
+
+#define GL_TIMER_QUERY_FUN \
+	/* Timer query (GPU profiling) */ \
+	GL_FUN(GenQueries, _PFNGLGENQUERIESPROC) \
+	GL_FUN(DeleteQueries, _PFNGLDELETEQUERIESPROC) \
+	GL_FUN(BeginQuery, _PFNGLBEGINQUERYPROC) \
+	GL_FUN(EndQuery, _PFNGLENDQUERYPROC) \
+	GL_FUN(GetQueryObjectiv, _PFNGLGETQUERYOBJECTIVPROC) \
+	GL_FUN(GetQueryObjectui64v, _PFNGLGETQUERYOBJECTUI64VPROC)
+
 #define GL_DEBUG_KHR_FUN \
 	GL_FUN(DebugMessageCallback, _PFNGLDEBUGMESSAGECALLBACKPROC)
 
@@ -218,17 +351,52 @@ struct GLFunctions
 	GL_FBO_FUN
 	GL_FBO_BLIT_FUN
 	GL_VAO_FUN
+	GL_MAP_BUFFER_FUN
+	GL_BUFFER_STORAGE_FUN
+	GL_SYNC_FUN
+	GL_PROGRAM_BINARY_FUN
+	GL_PROGRAM_PARAMETER_FUN
+	GL_PARALLEL_COMPILE_FUN
+	GL_TIMER_QUERY_FUN
 	GL_DEBUG_KHR_FUN
 	GL_GREMEMDY_FUN
 
 	bool glsles;
 	bool unpack_subimage;
 	bool npot_repeat;
+	/* Mipmaps can be generated for textures of any size */
+	bool npot_mipmap;
+	/* Pixel pack buffers can be mapped for reading */
+	bool async_readback;
+	/* Textures can be uploaded from pixel unpack buffers */
+	bool unpack_buffer;
+	/* GL_TIME_ELAPSED queries are available */
+	bool timer_query;
+	/* GL_UNSIGNED_INT indices can be drawn */
+	bool element_index_uint;
+	/* Buffers can be persistently mapped, and
+	 * fences guard the mapped ranges */
+	bool persistent_map;
+	/* Linked programs can be stored and reloaded */
+	bool program_binary;
+	/* Compiles and links run on driver threads, and
+	 * can be polled for with _GL_COMPLETION_STATUS */
+	bool parallel_compile;
+	/* Compressed texture formats that can be sampled */
+	bool tex_s3tc;
+	bool tex_bptc;
+	bool tex_etc2;
+	bool tex_astc;
+	/* Single channel textures are GL_R8 (desktop GL 3,
+	 * ARB_texture_rg) rather than GL_LUMINANCE */
+	bool tex_rg;
 
 #undef GL_FUN
 };
 
+struct GPUProfile;
+
 extern GLFunctions gl;
-void initGLFunctions();
+void initGLFunctions(GPUProfile &profile);
 
 #endif // GLFUN_H
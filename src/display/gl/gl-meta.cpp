@@ -26,6 +26,9 @@
 #include "quad.h"
 #include "config.h"
 
+#include <assert.h>
+#include <stdlib.h>
+
 namespace GLMeta
 {
 
@@ -68,16 +71,19 @@ void subRectImageEnd()
 
 #define HAVE_NATIVE_VAO gl.GenVertexArrays
 
-static void vaoBindRes(VAO &vao)
+/* Native VAOs are left bound after use, and without them the
+ * attribute setup of the last drawn VAO is kept enabled, so
+ * consecutive draws from the same VAO don't repeat any binds.
+ * Arrays in 'enabled' are already on and only get new pointers */
+static void vaoSetupAttribs(VAO &vao, uint32_t enabled = 0)
 {
-	VBO::bind(vao.vbo);
-	IBO::bind(vao.ibo);
-
 	for (size_t i = 0; i < vao.attrCount; ++i)
 	{
 		const VertexAttribute &va = vao.attr[i];
 
-		gl.EnableVertexAttribArray(va.index);
+		if (!(enabled & (1u << va.index)))
+			gl.EnableVertexAttribArray(va.index);
+
 		gl.VertexAttribPointer(va.index, va.size, va.type, GL_FALSE, vao.vertSize, va.offset);
 	}
 }
@@ -88,9 +94,15 @@ void vaoInit(VAO &vao, bool keepBound)
 	{
 		gl.GenVertexArrays(1, &vao.nativeVAO);
 		gl.BindVertexArray(vao.nativeVAO);
-		vaoBindRes(vao);
-		if (!keepBound)
-			gl.BindVertexArray(0);
+		glBindings.vao = vao.nativeVAO;
+
+		/* Bypass the helpers, as the element binding recorded
+		 * there belongs to the default VAO */
+		gl.BindBuffer(GL_ARRAY_BUFFER, vao.vbo.gl);
+		gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, vao.ibo.gl);
+		glBindings.arrayBuffer = vao.vbo.gl;
+
+		vaoSetupAttribs(vao);
 	}
 	else
 	{
@@ -105,62 +117,101 @@ void vaoInit(VAO &vao, bool keepBound)
 void vaoFini(VAO &vao)
 {
 	if (HAVE_NATIVE_VAO)
+	{
 		gl.DeleteVertexArrays(1, &vao.nativeVAO);
+
+		if (glBindings.vao == vao.nativeVAO)
+			glBindings.vao = 0;
+	}
+	else if (glBindings.attrLayout == vao.attr && glBindings.attrVBO == vao.vbo.gl)
+	{
+		glBindings.attrLayout = 0;
+	}
 }
 
 void vaoBind(VAO &vao)
 {
 	if (HAVE_NATIVE_VAO)
+	{
+		if (glBindings.vao == vao.nativeVAO)
+		{
+			++glBindings.elided;
+			return;
+		}
+
 		gl.BindVertexArray(vao.nativeVAO);
-	else
-		vaoBindRes(vao);
-}
+		glBindings.vao = vao.nativeVAO;
+		++glBindings.issued;
 
-void vaoUnbind(VAO &vao)
-{
-	if (HAVE_NATIVE_VAO)
-	{
-		gl.BindVertexArray(0);
+		return;
 	}
-	else
-	{
-		for (size_t i = 0; i < vao.attrCount; ++i)
-			gl.DisableVertexAttribArray(vao.attr[i].index);
 
-		VBO::unbind();
-		IBO::unbind();
+	VBO::bind(vao.vbo);
+	IBO::bind(vao.ibo);
+
+	if (glBindings.attrLayout == vao.attr && glBindings.attrVBO == vao.vbo.gl)
+	{
+		++glBindings.elided;
+		return;
 	}
+
+	uint32_t mask = 0;
+
+	for (size_t i = 0; i < vao.attrCount; ++i)
+		mask |= 1u << vao.attr[i].index;
+
+	/* Disable what the previous layout used and this one doesn't */
+	const uint32_t stale = glBindings.attrMask & ~mask;
+
+	for (unsigned i = 0; i < 32; ++i)
+		if (stale & (1u << i))
+			gl.DisableVertexAttribArray(i);
+
+	/* Switching between buffers of the same vertex format
+	 * (the common case) leaves the enabled set as it is */
+	vaoSetupAttribs(vao, glBindings.attrMask & mask);
+
+	glBindings.attrLayout = vao.attr;
+	glBindings.attrVBO = vao.vbo.gl;
+	glBindings.attrMask = mask;
+	++glBindings.issued;
+}
+
+void vaoUnbind(VAO &)
+{
+	/* Binds are deferred until another VAO, or the
+	 * default VAO's element buffer, is needed */
 }
 
 #define HAVE_NATIVE_BLIT gl.BlitFramebuffer
 
+/* Shader emulated blits in progress, remembered
+ * for the passes of a Lanczos3 upscale */
+static struct
+{
+	FBO::ID target;
+	TEX::ID source;
+	Vec2i sourceSize;
+} blitState;
+
 static void _blitBegin(FBO::ID fbo, const Vec2i &size)
 {
 	if (HAVE_NATIVE_BLIT)
 	{
-		gl.BindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo.gl);
+		FBO::bindDraw(fbo);
 	}
 	else
 	{
 		FBO::bind(fbo);
 		glState.viewport.pushSet(IntRect(0, 0, size.x, size.y));
 
-		if (shState->config().lanczos3Scaling)
-		{
-			Lanczos3Shader &shader = shState->shaders().lanczos3;
-			shader.bind();
-			shader.applyViewportProj();
-			shader.setTranslation(Vec2i());
-			shader.setTexSize(Vec2i(size.x, size.y));
-		}
-		else
-		{
-			SimpleShader &shader = shState->shaders().simple;
-			shader.bind();
-			shader.applyViewportProj();
-			shader.setTranslation(Vec2i());
-			shader.setTexSize(Vec2i(size.x, size.y));
-		}
+		SimpleShader &shader = shState->shaders().simple;
+		shader.bind();
+		shader.applyViewportProj();
+		shader.setTranslation(Vec2i());
+		shader.setTexSize(Vec2i(size.x, size.y));
+
+		blitState.target = fbo;
 	}
 }
 
@@ -178,26 +229,72 @@ void blitSource(TEXFBO &source)
 {
 	if (HAVE_NATIVE_BLIT)
 	{
-		gl.BindFramebuffer(GL_READ_FRAMEBUFFER, source.fbo.gl);
+		FBO::bindRead(source.fbo);
 	}
 	else
 	{
-		if (shState->config().lanczos3Scaling)
-		{
-			Lanczos3Shader &shader = shState->shaders().lanczos3;
-			shader.bind();
-			shader.setTexSize(Vec2i(source.width, source.height));
-		}
-		else
-		{
-			SimpleShader &shader = shState->shaders().simple;
-			shader.bind();
-			shader.setTexSize(Vec2i(source.width, source.height));
-		}
+		SimpleShader &shader = shState->shaders().simple;
+		shader.bind();
+		shader.setTexSize(Vec2i(source.width, source.height));
 		TEX::bind(source.tex);
+
+		blitState.source = source.tex;
+		blitState.sourceSize = Vec2i(source.width, source.height);
 	}
 }
 
+/* Upscales 'src' into 'dst' (which may be flipped) of the current
+ * blit target in two 1D passes, horizontally into the general
+ * purpose buffer first. Copies at the same size don't come here,
+ * so the kernel only ever runs where it makes a difference */
+static void blitLanczos3(const IntRect &src, const IntRect &dst)
+{
+	const int midW = abs(dst.w);
+	TEXFBO &mid = shState->gpTexFBO(midW, src.h);
+
+	assert(mid.tex != blitState.source);
+
+	Lanczos3Shader &shader = shState->shaders().lanczos3;
+	Quad &quad = shState->gpQuad();
+
+	glState.blend.pushSet(false);
+
+	FBO::bind(mid.fbo);
+	glState.viewport.pushSet(IntRect(0, 0, mid.width, mid.height));
+
+	shader.bind();
+	shader.applyViewportProj();
+	shader.setTranslation(Vec2i());
+	shader.setTexSize(blitState.sourceSize);
+	shader.setVertical(false);
+	TEX::bind(blitState.source);
+
+	quad.setTexPosRect(src, IntRect(0, 0, midW, src.h));
+	quad.draw();
+
+	glState.viewport.pop();
+	FBO::bind(blitState.target);
+
+	shader.applyViewportProj();
+	shader.setTexSize(Vec2i(mid.width, mid.height));
+	shader.setVertical(true);
+	TEX::bind(mid.tex);
+
+	/* Only the vertical pass flips horizontally, the
+	 * intermediate buffer holds the source the right
+	 * way around */
+	quad.setTexPosRect(IntRect(0, 0, midW, src.h), dst);
+	quad.draw();
+
+	glState.blend.pop();
+
+	/* Further blits expect the plain shader and source */
+	SimpleShader &simple = shState->shaders().simple;
+	simple.bind();
+	simple.setTexSize(blitState.sourceSize);
+	TEX::bind(blitState.source);
+}
+
 void blitRectangle(const IntRect &src, const Vec2i &dstPos)
 {
 	blitRectangle(src, IntRect(dstPos.x, dstPos.y, src.w, src.h), false);
@@ -210,9 +307,17 @@ void blitRectangle(const IntRect &src, const IntRect &dst, bool smooth)
 		gl.BlitFramebuffer(src.x, src.y, src.x+src.w, src.y+src.h,
 		                   dst.x, dst.y, dst.x+dst.w, dst.y+dst.h,
 		                   GL_COLOR_BUFFER_BIT, smooth ? GL_LINEAR : GL_NEAREST);
+		++glCounters.draws;
 	}
 	else
 	{
+		if (shState->config().lanczos3Scaling
+		    && (abs(dst.w) != src.w || abs(dst.h) != src.h))
+		{
+			blitLanczos3(src, dst);
+			return;
+		}
+
 		if (smooth)
 			TEX::setSmooth(true);
 
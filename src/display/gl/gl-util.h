@@ -25,6 +25,58 @@
 #include "gl-fun.h"
 #include "etc-internal.h"
 
+#include <stdint.h>
+
+/* Objects last bound through the helpers below, so redundant
+ * binds can be skipped. A value of ~0 means unknown. This is
+ * only accurate as long as nothing binds behind their back */
+struct GLBindings
+{
+	enum { TexUnitCount = 8 };
+
+	unsigned texUnit;
+	GLuint tex[TexUnitCount];
+
+	GLuint arrayBuffer;
+	/* Element binding of the default VAO */
+	GLuint elementBuffer;
+	GLuint pixelPackBuffer;
+	GLuint pixelUnpackBuffer;
+
+	GLuint vao;
+
+	/* Framebuffers bound for drawing and reading; the
+	 * same one unless split up by a native blit */
+	GLuint drawFBO;
+	GLuint readFBO;
+
+	/* Attribute setup last applied without native VAOs */
+	const void *attrLayout;
+	GLuint attrVBO;
+	uint32_t attrMask;
+
+	/* Binds and state changes issued / skipped
+	 * since the counters were last reset */
+	uint32_t issued;
+	uint32_t elided;
+};
+
+extern GLBindings glBindings;
+
+/* Work handed to GL since the counters were last reset,
+ * so the savings of batching and caching can be measured */
+struct GLCounters
+{
+	uint32_t draws;
+	uint32_t fboBinds;
+	uint32_t texUploads;
+	uint64_t texUploadBytes;
+	uint32_t bufferUploads;
+	uint64_t bufferUploadBytes;
+};
+
+extern GLCounters glCounters;
+
 /* Struct wrapping GLuint for some light type safety */
 #define DEF_GL_ID \
 struct ID \
@@ -64,11 +116,43 @@ namespace TEX
 	static inline void del(ID id)
 	{
 		gl.DeleteTextures(1, &id.gl);
+
+		/* Deleted textures revert to 0 on every unit */
+		for (size_t i = 0; i < GLBindings::TexUnitCount; ++i)
+			if (glBindings.tex[i] == id.gl)
+				glBindings.tex[i] = 0;
+	}
+
+	static inline void setUnit(unsigned index)
+	{
+		if (glBindings.texUnit == index)
+		{
+			++glBindings.elided;
+			return;
+		}
+
+		gl.ActiveTexture(GL_TEXTURE0 + index);
+		glBindings.texUnit = index;
+		++glBindings.issued;
 	}
 
 	static inline void bind(ID id)
 	{
+		const unsigned unit = glBindings.texUnit;
+
+		if (unit < GLBindings::TexUnitCount)
+		{
+			if (glBindings.tex[unit] == id.gl)
+			{
+				++glBindings.elided;
+				return;
+			}
+
+			glBindings.tex[unit] = id.gl;
+		}
+
 		gl.BindTexture(GL_TEXTURE_2D, id.gl);
+		++glBindings.issued;
 	}
 
 	static inline void unbind()
@@ -76,14 +160,24 @@ namespace TEX
 		bind(ID(0));
 	}
 
+	static inline void countUpload(GLsizei width, GLsizei height)
+	{
+		++glCounters.texUploads;
+		glCounters.texUploadBytes += (uint64_t) width * height * 4;
+	}
+
 	static inline void uploadImage(GLsizei width, GLsizei height, const void *data, GLenum format)
 	{
 		gl.TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+
+		if (data)
+			countUpload(width, height);
 	}
 
 	static inline void uploadSubImage(GLint x, GLint y, GLsizei width, GLsizei height, const void *data, GLenum format)
 	{
 		gl.TexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, format, GL_UNSIGNED_BYTE, data);
+		countUpload(width, height);
 	}
 
 	static inline void allocEmpty(GLsizei width, GLsizei height)
@@ -102,6 +196,14 @@ namespace TEX
 		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mode ? GL_LINEAR : GL_NEAREST);
 		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, mode ? GL_LINEAR : GL_NEAREST);
 	}
+
+	/* Trilinear filtering; the texture must have a full set of
+	 * mipmaps. Undone through 'setSmooth(false)' */
+	static inline void setMipmapped()
+	{
+		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	}
 }
 
 /* Framebuffer Object */
@@ -120,11 +222,52 @@ namespace FBO
 	static inline void del(ID id)
 	{
 		gl.DeleteFramebuffers(1, &id.gl);
+
+		/* Deleting a bound framebuffer binds 0 in its place */
+		if (glBindings.drawFBO == id.gl)
+			glBindings.drawFBO = 0;
+		if (glBindings.readFBO == id.gl)
+			glBindings.readFBO = 0;
 	}
 
 	static inline void bind(ID id)
 	{
+		if (glBindings.drawFBO == id.gl && glBindings.readFBO == id.gl)
+		{
+			++glBindings.elided;
+			return;
+		}
+
 		gl.BindFramebuffer(GL_FRAMEBUFFER, id.gl);
+		glBindings.drawFBO = glBindings.readFBO = id.gl;
+		++glCounters.fboBinds;
+	}
+
+	/* Only for native blits (needs BlitFramebuffer) */
+	static inline void bindDraw(ID id)
+	{
+		if (glBindings.drawFBO == id.gl)
+		{
+			++glBindings.elided;
+			return;
+		}
+
+		gl.BindFramebuffer(GL_DRAW_FRAMEBUFFER, id.gl);
+		glBindings.drawFBO = id.gl;
+		++glCounters.fboBinds;
+	}
+
+	static inline void bindRead(ID id)
+	{
+		if (glBindings.readFBO == id.gl)
+		{
+			++glBindings.elided;
+			return;
+		}
+
+		gl.BindFramebuffer(GL_READ_FRAMEBUFFER, id.gl);
+		glBindings.readFBO = id.gl;
+		++glCounters.fboBinds;
 	}
 
 	static inline void unbind()
@@ -159,11 +302,33 @@ struct GenericBO
 	static inline void del(ID id)
 	{
 		gl.DeleteBuffers(1, &id.gl);
+
+		if (bound() == id.gl)
+			bound() = ~0u;
+
+		if (glBindings.attrVBO == id.gl)
+			glBindings.attrLayout = 0;
 	}
 
 	static inline void bind(ID id)
 	{
+		/* The element binding is part of VAO state,
+		 * so only ever change the default VAO's one */
+		if (target == GL_ELEMENT_ARRAY_BUFFER && glBindings.vao != 0)
+		{
+			gl.BindVertexArray(0);
+			glBindings.vao = 0;
+		}
+
+		if (bound() == id.gl)
+		{
+			++glBindings.elided;
+			return;
+		}
+
 		gl.BindBuffer(target, id.gl);
+		bound() = id.gl;
+		++glBindings.issued;
 	}
 
 	static inline void unbind()
@@ -174,17 +339,42 @@ struct GenericBO
 	static inline void uploadData(GLsizeiptr size, const GLvoid *data, GLenum usage = GL_STATIC_DRAW)
 	{
 		gl.BufferData(target, size, data, usage);
+
+		if (data)
+			countUpload(size);
 	}
 
 	static inline void uploadSubData(GLintptr offset, GLsizeiptr size, const GLvoid *data)
 	{
 		gl.BufferSubData(target, offset, size, data);
+		countUpload(size);
+	}
+
+	static inline void countUpload(GLsizeiptr size)
+	{
+		++glCounters.bufferUploads;
+		glCounters.bufferUploadBytes += size;
 	}
 
 	static inline void allocEmpty(GLsizeiptr size, GLenum usage = GL_STATIC_DRAW)
 	{
 		uploadData(size, 0, usage);
 	}
+
+	static inline GLuint &bound()
+	{
+		switch (target)
+		{
+		case GL_ELEMENT_ARRAY_BUFFER :
+			return glBindings.elementBuffer;
+		case GL_PIXEL_PACK_BUFFER :
+			return glBindings.pixelPackBuffer;
+		case GL_PIXEL_UNPACK_BUFFER :
+			return glBindings.pixelUnpackBuffer;
+		default :
+			return glBindings.arrayBuffer;
+		}
+	}
 };
 
 /* Vertex Buffer Object */
@@ -193,6 +383,12 @@ typedef struct GenericBO<GL_ARRAY_BUFFER> VBO;
 /* Index Buffer Object */
 typedef struct GenericBO<GL_ELEMENT_ARRAY_BUFFER> IBO;
 
+/* Pixel Pack Buffer Object */
+typedef struct GenericBO<GL_PIXEL_PACK_BUFFER> PBO;
+
+/* Pixel Unpack Buffer Object */
+typedef struct GenericBO<GL_PIXEL_UNPACK_BUFFER> UPBO;
+
 #undef DEF_GL_ID
 
 /* Convenience struct wrapping a framebuffer
@@ -25,18 +25,22 @@
 #include "gl-util.h"
 
 #include <vector>
-#include <limits>
 #include <assert.h>
 #include <stdint.h>
 
-typedef uint16_t index_t;
-#define INDEX_T_MAX std::numeric_limits<index_t>::max()
-#define _GL_INDEX_TYPE GL_UNSIGNED_SHORT
+/* Indices are 32 bit wide wherever the context supports it, so a
+ * single draw isn't limited to the 16384 quads 16 bit ones address */
+#define _GL_INDEX_TYPE (gl.element_index_uint ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT)
+#define _GL_INDEX_SIZE (gl.element_index_uint ? sizeof(uint32_t) : sizeof(uint16_t))
+
+/* Most quads addressable with 16 bit indices */
+#define INDEX_16_MAX_QUADS (0x10000 / 4)
 
 struct GlobalIBO
 {
 	IBO::ID ibo;
-	std::vector<index_t> buffer;
+	std::vector<uint32_t> buffer;
+	std::vector<uint16_t> buffer16;
 
 	GlobalIBO()
 	{
@@ -50,25 +54,42 @@ struct GlobalIBO
 
 	void ensureSize(size_t quadCount)
 	{
-		assert(quadCount*6 < INDEX_T_MAX);
+		if (!gl.element_index_uint)
+			assert(quadCount <= INDEX_16_MAX_QUADS);
 
-		if (buffer.size() >= quadCount*6)
+		if (buffer.size() + buffer16.size() >= quadCount*6)
 			return;
 
-		size_t startInd = buffer.size() / 6;
-		buffer.reserve(quadCount*6);
+		IBO::bind(ibo);
+
+		if (gl.element_index_uint)
+		{
+			fill(buffer, quadCount);
+			IBO::uploadData(buffer.size() * sizeof(uint32_t), dataPtr(buffer));
+		}
+		else
+		{
+			fill(buffer16, quadCount);
+			IBO::uploadData(buffer16.size() * sizeof(uint16_t), dataPtr(buffer16));
+		}
+
+		IBO::unbind();
+	}
+
+private:
+	template<typename T>
+	static void fill(std::vector<T> &buf, size_t quadCount)
+	{
+		size_t startInd = buf.size() / 6;
+		buf.reserve(quadCount*6);
 
 		for (size_t i = startInd; i < quadCount; ++i)
 		{
-			static const index_t indTemp[] = { 0, 1, 2, 2, 3, 0 };
+			static const T indTemp[] = { 0, 1, 2, 2, 3, 0 };
 
 			for (size_t j = 0; j < 6; ++j)
-				buffer.push_back(i * 4 + indTemp[j]);
+				buf.push_back(i * 4 + indTemp[j]);
 		}
-
-		IBO::bind(ibo);
-		IBO::uploadData(buffer.size() * sizeof(index_t), dataPtr(buffer));
-		IBO::unbind();
 	}
 };
 
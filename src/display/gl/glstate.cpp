@@ -24,9 +24,13 @@
 #include "etc.h"
 #include "gl-fun.h"
 #include "shader.h"
+#include "gpu-profile.h"
 
 #include <SDL_rect.h>
 
+GLBindings glBindings;
+GLCounters glCounters;
+
 static void applyBool(GLenum state, bool mode) {
   mode ? gl.Enable(state) : gl.Disable(state);
 }
@@ -58,6 +62,12 @@ void GLScissorTest::apply(const bool &value) {
 
 void GLBlendMode::apply(const BlendType &value) {
   switch (value) {
+  case BlendPremultiplied:
+    gl.BlendEquation(GL_FUNC_ADD);
+    gl.BlendFuncSeparate(GL_ONE, GL_ONE_MINUS_SRC_ALPHA, GL_ONE,
+                         GL_ONE_MINUS_SRC_ALPHA);
+    break;
+
   case BlendKeepDestAlpha:
     gl.BlendEquation(GL_FUNC_ADD);
     gl.BlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
@@ -83,24 +93,44 @@ void GLBlendMode::apply(const BlendType &value) {
 
 void GLBlend::apply(const bool &value) { applyBool(GL_BLEND, value); }
 
+void GLDepthTest::apply(const bool &value) { applyBool(GL_DEPTH_TEST, value); }
+
+void GLDepthRange::apply(const Vec2 &value) {
+  /* GLES only has the float variant */
+  if (gl.glsles)
+    gl.DepthRangef(value.x, value.y);
+  else
+    gl.DepthRange(value.x, value.y);
+}
+
 void GLViewport::apply(const IntRect &value) {
   gl.Viewport(value.x, value.y, value.w, value.h);
 }
 
 void GLProgram::apply(const unsigned int &value) { gl.UseProgram(value); }
 
-GLState::Caps::Caps() { gl.GetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize); }
+GLState::Caps::Caps() {
+  /* The profile already asked for it */
+  if (gpuProfile.maxTexSize > 0)
+    maxTexSize = gpuProfile.maxTexSize;
+  else
+    gl.GetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize);
+}
 
 GLState::GLState(const Config &conf) {
-  gl.Disable(GL_DEPTH_TEST);
-
   clearColor.init(Vec4(0, 0, 0, 1));
   blendMode.init(BlendNormal);
   blend.init(true);
+  depthTest.init(false);
+  depthRange.init(Vec2(0, 1));
   scissorTest.init(false);
   scissorBox.init(IntRect(0, 0, conf.defScreenW, conf.defScreenH));
   program.init(0);
 
+  /* Depth is only written by the opaque tilemap pass,
+   * which turns this on for the duration */
+  gl.DepthMask(GL_FALSE);
+
   if (conf.maxTextureSize > 0)
     caps.maxTexSize = conf.maxTextureSize;
 }
@@ -23,6 +23,7 @@
 #define GLSTATE_H
 
 #include "etc.h"
+#include "gl-util.h"
 
 #include <stack>
 #include <assert.h>
@@ -49,8 +50,12 @@ struct GLProperty
 	void set(const T &value)
 	{
 		if (value == current)
+		{
+			++glBindings.elided;
 			return;
+		}
 
+		++glBindings.issued;
 		init(value);
 	}
 
@@ -102,6 +107,19 @@ class GLBlend : public GLProperty<bool>
 	void apply(const bool &value);
 };
 
+/* Only ever enabled while a tilemap draws its
+ * zlayers through the depth buffer */
+class GLDepthTest : public GLProperty<bool>
+{
+	void apply(const bool &value);
+};
+
+/* Window depth range (near, far) */
+class GLDepthRange : public GLProperty<Vec2>
+{
+	void apply(const Vec2 &value);
+};
+
 class GLViewport : public GLProperty<IntRect>
 {
 	void apply(const IntRect &value);
@@ -121,6 +139,8 @@ public:
 	GLScissorTest scissorTest;
 	GLBlendMode blendMode;
 	GLBlend blend;
+	GLDepthTest depthTest;
+	GLDepthRange depthRange;
 	GLViewport viewport;
 	GLProgram program;
 
@@ -0,0 +1,642 @@
+/*
+** gpu-profile.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "gpu-profile.h"
+#include "gl-fun.h"
+#include "config.h"
+#include "util.h"
+#include "debugwriter.h"
+
+#include <SDL_rwops.h>
+#include <SDL_timer.h>
+
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+#define GPU_PROFILE_MAGIC "mkxpGPU1"
+
+/* In megapixels per second. Below the first, frames are skipped
+ * and the screen isn't filtered; above the second, it is scaled
+ * with lanczos3 */
+#define FILL_RATE_WEAK 500
+#define FILL_RATE_STRONG 4000
+
+/* How much slower a fast path may measure and still be kept,
+ * so noise alone doesn't turn it off */
+#define FAST_PATH_SLACK 1.1
+
+enum
+{
+	FlagFastVAO       = 1 << 0,
+	FlagFastIndexUint = 1 << 1
+};
+
+GPUProfile gpuProfile;
+
+GPUProfile::GPUProfile()
+{
+	reset();
+	driverHash = 0;
+}
+
+void GPUProfile::reset()
+{
+	extensions.clear();
+	maxTexSize = 0;
+	fillRate = 0;
+	fastVAO = true;
+	fastIndexUint = true;
+	cached = false;
+}
+
+void GPUProfile::load(const Config &conf)
+{
+	if (!conf.gpuProfile || conf.customDataPath.empty())
+		return;
+
+	file = conf.customDataPath + "/gpuprofile.bin";
+
+	SDL_RWops *ops = SDL_RWFromFile(file.c_str(), "rb");
+
+	if (!ops)
+		return;
+
+	char magic[sizeof(GPU_PROFILE_MAGIC) - 1];
+
+	if (SDL_RWread(ops, magic, sizeof(magic), 1) != 1 ||
+	    memcmp(magic, GPU_PROFILE_MAGIC, sizeof(magic)))
+	{
+		SDL_RWclose(ops);
+		return;
+	}
+
+	driverHash = SDL_ReadLE64(ops);
+	maxTexSize = SDL_ReadLE32(ops);
+	fillRate = SDL_ReadLE32(ops);
+
+	uint32_t flags = SDL_ReadLE32(ops);
+	fastVAO = flags & FlagFastVAO;
+	fastIndexUint = flags & FlagFastIndexUint;
+
+	uint32_t extCount = SDL_ReadLE32(ops);
+	std::string ext;
+
+	for (uint32_t i = 0; i < extCount; ++i)
+	{
+		ext.resize(SDL_ReadLE16(ops));
+
+		/* Truncated, measure again */
+		if (ext.empty() || SDL_RWread(ops, &ext[0], ext.size(), 1) != 1)
+		{
+			SDL_RWclose(ops);
+			reset();
+
+			return;
+		}
+
+		extensions.insert(ext);
+	}
+
+	SDL_RWclose(ops);
+
+	cached = (maxTexSize > 0 && extCount > 0);
+
+	if (!cached)
+		reset();
+}
+
+void GPUProfile::matchDriver()
+{
+	static const GLenum driverStrings[] =
+	{
+		GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION
+	};
+
+	/* FNV-1a */
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < ARRAY_SIZE(driverStrings); ++i)
+	{
+		const char *str = (const char*) gl.GetString(driverStrings[i]);
+
+		for (; str && *str; ++str)
+		{
+			hash ^= (uint8_t) *str;
+			hash *= 1099511628211ULL;
+		}
+
+		hash ^= 0xFF;
+		hash *= 1099511628211ULL;
+	}
+
+	if (cached && hash != driverHash)
+	{
+		Debug() << "GPU profile: driver changed, measuring again";
+		reset();
+	}
+
+	driverHash = hash;
+}
+
+/* A throwaway program, buffers and render target for the benchmarks.
+ * GLState doesn't exist yet, so everything goes straight to GL and
+ * is put back the way the context started out */
+struct Benchmark
+{
+	enum
+	{
+		TargetSize = 1024,
+		SourceSize = 256,
+
+		/* Quads of one draw in the index benchmark,
+		 * addressable with 16 bit indices */
+		BatchQuads = 4096
+	};
+
+	struct Vertex
+	{
+		float x, y, u, v;
+	};
+
+	GLuint program;
+	GLuint tex;
+	GLuint targetTex;
+	GLuint fbo;
+
+	/* [0..1]: one quad each, [2]: BatchQuads quads */
+	GLuint vbo[3];
+	/* [0]: one quad, [1]: BatchQuads quads 16 bit, [2]: 32 bit */
+	GLuint ibo[3];
+
+	GLint viewport[4];
+
+	bool ok;
+
+	Benchmark()
+	    : ok(false)
+	{
+		gl.GetIntegerv(GL_VIEWPORT, viewport);
+
+		program = linkProgram();
+
+		if (!program)
+			return;
+
+		std::vector<uint8_t> pixels(SourceSize * SourceSize * 4);
+
+		for (size_t i = 0; i < pixels.size(); ++i)
+			pixels[i] = i * 7;
+
+		gl.GenTextures(1, &tex);
+		gl.BindTexture(GL_TEXTURE_2D, tex);
+		setupTex();
+		gl.TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SourceSize, SourceSize, 0,
+		              GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+
+		gl.GenTextures(1, &targetTex);
+		gl.BindTexture(GL_TEXTURE_2D, targetTex);
+		setupTex();
+		gl.TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, TargetSize, TargetSize, 0,
+		              GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+		gl.GenFramebuffers(1, &fbo);
+		gl.BindFramebuffer(GL_FRAMEBUFFER, fbo);
+		gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+		                        GL_TEXTURE_2D, targetTex, 0);
+
+		gl.BindTexture(GL_TEXTURE_2D, tex);
+		gl.Viewport(0, 0, TargetSize, TargetSize);
+		gl.UseProgram(program);
+
+		gl.GenBuffers(3, vbo);
+		gl.GenBuffers(3, ibo);
+
+		/* Full target quads */
+		std::vector<Vertex> vert;
+		std::vector<uint16_t> idx16;
+		std::vector<uint32_t> idx32;
+
+		pushQuad(vert, idx16, idx32, -1, -1, 2);
+
+		for (size_t i = 0; i < 2; ++i)
+			uploadBuffer(GL_ARRAY_BUFFER, vbo[i], vert);
+
+		uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo[0], idx16);
+
+		/* Pixel sized ones, so the batch is vertex bound */
+		vert.clear();
+		idx16.clear();
+		idx32.clear();
+
+		const float pixel = 2.0f / TargetSize;
+
+		for (int i = 0; i < BatchQuads; ++i)
+			pushQuad(vert, idx16, idx32,
+			         -1 + (i % 64) * pixel * 2,
+			         -1 + (i / 64) * pixel * 2, pixel);
+
+		uploadBuffer(GL_ARRAY_BUFFER, vbo[2], vert);
+		uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo[1], idx16);
+		uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo[2], idx32);
+
+		gl.EnableVertexAttribArray(0);
+		gl.EnableVertexAttribArray(1);
+
+		ok = true;
+	}
+
+	~Benchmark()
+	{
+		gl.DisableVertexAttribArray(0);
+		gl.DisableVertexAttribArray(1);
+		gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+		gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
+		gl.BindTexture(GL_TEXTURE_2D, 0);
+		gl.UseProgram(0);
+		gl.Disable(GL_BLEND);
+		gl.Viewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+		if (!program)
+			return;
+
+		gl.DeleteBuffers(3, ibo);
+		gl.DeleteBuffers(3, vbo);
+		gl.DeleteFramebuffers(1, &fbo);
+		gl.DeleteTextures(1, &targetTex);
+		gl.DeleteTextures(1, &tex);
+		gl.DeleteProgram(program);
+	}
+
+	static GLuint compileShader(GLenum type, const char *source)
+	{
+		GLuint shader = gl.CreateShader(type);
+		gl.ShaderSource(shader, 1, &source, 0);
+		gl.CompileShader(shader);
+
+		GLint success;
+		gl.GetShaderiv(shader, GL_COMPILE_STATUS, &success);
+
+		if (success)
+			return shader;
+
+		gl.DeleteShader(shader);
+
+		return 0;
+	}
+
+	/* GLSL 1.00 / 1.10, valid for both GLES and desktop GL */
+	static GLuint linkProgram()
+	{
+		static const char vertSrc[] =
+			"attribute vec2 position;\n"
+			"attribute vec2 texCoord;\n"
+			"varying vec2 v_texCoord;\n"
+			"void main() {\n"
+			"	gl_Position = vec4(position, 0.0, 1.0);\n"
+			"	v_texCoord = texCoord;\n"
+			"}\n";
+
+		static const char fragSrc[] =
+			"#ifdef GL_ES\n"
+			"precision mediump float;\n"
+			"#endif\n"
+			"uniform sampler2D texture;\n"
+			"varying vec2 v_texCoord;\n"
+			"void main() {\n"
+			"	gl_FragColor = texture2D(texture, v_texCoord);\n"
+			"}\n";
+
+		GLuint vert = compileShader(GL_VERTEX_SHADER, vertSrc);
+		GLuint frag = compileShader(GL_FRAGMENT_SHADER, fragSrc);
+
+		GLuint program = 0;
+
+		if (vert && frag)
+		{
+			program = gl.CreateProgram();
+			gl.AttachShader(program, vert);
+			gl.AttachShader(program, frag);
+			gl.BindAttribLocation(program, 0, "position");
+			gl.BindAttribLocation(program, 1, "texCoord");
+			gl.LinkProgram(program);
+
+			GLint success;
+			gl.GetProgramiv(program, GL_LINK_STATUS, &success);
+
+			if (!success)
+			{
+				gl.DeleteProgram(program);
+				program = 0;
+			}
+		}
+
+		if (vert)
+			gl.DeleteShader(vert);
+
+		if (frag)
+			gl.DeleteShader(frag);
+
+		return program;
+	}
+
+	static void setupTex()
+	{
+		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		gl.TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	static void pushQuad(std::vector<Vertex> &vert,
+	                     std::vector<uint16_t> &idx16, std::vector<uint32_t> &idx32,
+	                     float x, float y, float size)
+	{
+		static const uint8_t order[] = { 0, 1, 2, 2, 3, 0 };
+
+		const uint32_t base = vert.size();
+
+		const Vertex quad[] =
+		{
+			{ x,        y,        0, 0 },
+			{ x + size, y,        1, 0 },
+			{ x + size, y + size, 1, 1 },
+			{ x,        y + size, 0, 1 }
+		};
+
+		vert.insert(vert.end(), quad, quad + 4);
+
+		for (size_t i = 0; i < ARRAY_SIZE(order); ++i)
+		{
+			idx16.push_back(base + order[i]);
+			idx32.push_back(base + order[i]);
+		}
+	}
+
+	template<typename T>
+	static void uploadBuffer(GLenum target, GLuint buffer, const std::vector<T> &data)
+	{
+		gl.BindBuffer(target, buffer);
+		gl.BufferData(target, data.size() * sizeof(T), &data[0], GL_STATIC_DRAW);
+	}
+
+	static void setupAttribs()
+	{
+		gl.VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+		                       (const GLvoid*) offsetof(Vertex, x));
+		gl.VertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+		                       (const GLvoid*) offsetof(Vertex, u));
+	}
+
+	/* Reading back a pixel waits for everything queued */
+	static void sync()
+	{
+		uint8_t pixel[4];
+		gl.ReadPixels(0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixel);
+	}
+
+	static uint64_t now()
+	{
+		return SDL_GetPerformanceCounter();
+	}
+
+	static double seconds(uint64_t since)
+	{
+		return (double) (now() - since) / SDL_GetPerformanceFrequency();
+	}
+
+	/* Megapixels per second of blended full target quads */
+	int fillRate()
+	{
+		const int passes = 32;
+
+		gl.BindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+		gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo[0]);
+		setupAttribs();
+
+		gl.Enable(GL_BLEND);
+		gl.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+		/* Warm up */
+		gl.DrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+		sync();
+
+		uint64_t start = now();
+
+		for (int i = 0; i < passes; ++i)
+			gl.DrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+
+		sync();
+
+		const double time = seconds(start);
+
+		gl.Disable(GL_BLEND);
+
+		if (time <= 0)
+			return 0;
+
+		return (int) ((double) TargetSize * TargetSize * passes / time / 1e6);
+	}
+
+	/* Seconds for 'draws' single quad draws, alternating between
+	 * two vertex buffers, switched with native VAOs or not */
+	double switchTime(bool native, int draws)
+	{
+		GLuint vao[2] = { 0, 0 };
+
+		if (native)
+		{
+			gl.GenVertexArrays(2, vao);
+
+			for (size_t i = 0; i < 2; ++i)
+			{
+				gl.BindVertexArray(vao[i]);
+				gl.BindBuffer(GL_ARRAY_BUFFER, vbo[i]);
+				gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo[0]);
+				gl.EnableVertexAttribArray(0);
+				gl.EnableVertexAttribArray(1);
+				setupAttribs();
+			}
+		}
+
+		/* Draw them to a single pixel */
+		gl.Viewport(0, 0, 1, 1);
+		gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo[0]);
+		sync();
+
+		uint64_t start = now();
+
+		for (int i = 0; i < draws; ++i)
+		{
+			if (native)
+			{
+				gl.BindVertexArray(vao[i & 1]);
+			}
+			else
+			{
+				gl.BindBuffer(GL_ARRAY_BUFFER, vbo[i & 1]);
+				setupAttribs();
+			}
+
+			gl.DrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+		}
+
+		sync();
+
+		const double time = seconds(start);
+
+		gl.Viewport(0, 0, TargetSize, TargetSize);
+
+		if (native)
+		{
+			gl.BindVertexArray(0);
+			gl.DeleteVertexArrays(2, vao);
+		}
+
+		return time;
+	}
+
+	/* Seconds for 'draws' batches of pixel sized quads */
+	double batchTime(bool indexUint, int draws)
+	{
+		gl.BindBuffer(GL_ARRAY_BUFFER, vbo[2]);
+		gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo[indexUint ? 2 : 1]);
+		setupAttribs();
+		sync();
+
+		const GLenum type = indexUint ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+
+		uint64_t start = now();
+
+		for (int i = 0; i < draws; ++i)
+			gl.DrawElements(GL_TRIANGLES, BatchQuads * 6, type, 0);
+
+		sync();
+
+		return seconds(start);
+	}
+};
+
+void GPUProfile::measure()
+{
+	/* Turned off, or nothing left to measure */
+	if (file.empty() || cached)
+		return;
+
+	gl.GetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize);
+
+	{
+		Benchmark bench;
+
+		if (!bench.ok)
+		{
+			Debug() << "GPU profile: benchmark program failed to link";
+			return;
+		}
+
+		fillRate = bench.fillRate();
+
+		/* First rounds warm up the driver */
+		if (gl.GenVertexArrays)
+		{
+			bench.switchTime(true, 100);
+			bench.switchTime(false, 100);
+
+			const double native = bench.switchTime(true, 2000);
+			const double emulated = bench.switchTime(false, 2000);
+
+			fastVAO = native <= emulated * FAST_PATH_SLACK;
+		}
+
+		if (gl.element_index_uint)
+		{
+			bench.batchTime(false, 4);
+			bench.batchTime(true, 4);
+
+			const double index16 = bench.batchTime(false, 32);
+			const double index32 = bench.batchTime(true, 32);
+
+			fastIndexUint = index32 <= index16 * FAST_PATH_SLACK;
+		}
+	}
+
+	Debug() << "GPU profile: fill rate" << fillRate << "Mpx/s, native VAOs"
+	        << (fastVAO ? "on" : "off") << "/ 32 bit indices" << (fastIndexUint ? "on" : "off");
+
+	save();
+}
+
+void GPUProfile::save() const
+{
+	SDL_RWops *ops = SDL_RWFromFile(file.c_str(), "wb");
+
+	if (!ops)
+		return;
+
+	uint32_t flags = 0;
+
+	if (fastVAO)
+		flags |= FlagFastVAO;
+
+	if (fastIndexUint)
+		flags |= FlagFastIndexUint;
+
+	SDL_RWwrite(ops, GPU_PROFILE_MAGIC, sizeof(GPU_PROFILE_MAGIC) - 1, 1);
+	SDL_WriteLE64(ops, driverHash);
+	SDL_WriteLE32(ops, maxTexSize);
+	SDL_WriteLE32(ops, fillRate);
+	SDL_WriteLE32(ops, flags);
+	SDL_WriteLE32(ops, extensions.size());
+
+	for (BoostSet<std::string>::const_iterator iter = extensions.cbegin();
+	     iter != extensions.cend(); ++iter)
+	{
+		SDL_WriteLE16(ops, iter->size());
+		SDL_RWwrite(ops, iter->c_str(), 1, iter->size());
+	}
+
+	SDL_RWclose(ops);
+}
+
+void GPUProfile::apply(Config &conf) const
+{
+	/* Turned off, or the benchmarks couldn't run */
+	if (file.empty() || fillRate == 0)
+		return;
+
+	if (!fastVAO)
+	{
+		gl.GenVertexArrays = 0;
+		gl.DeleteVertexArrays = 0;
+		gl.BindVertexArray = 0;
+	}
+
+	if (!fastIndexUint)
+		gl.element_index_uint = false;
+
+	if (conf.profileDefaults.frameSkip)
+		conf.frameSkip = fillRate < FILL_RATE_WEAK;
+
+	if (conf.profileDefaults.smoothScaling)
+		conf.smoothScaling = fillRate >= FILL_RATE_WEAK;
+
+	if (conf.profileDefaults.lanczos3Scaling)
+		conf.lanczos3Scaling = fillRate >= FILL_RATE_STRONG;
+}
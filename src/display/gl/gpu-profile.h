@@ -0,0 +1,82 @@
+/*
+** gpu-profile.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GPUPROFILE_H
+#define GPUPROFILE_H
+
+#include "boost-hash.h"
+
+#include <stdint.h>
+#include <string>
+
+struct Config;
+
+/* What was probed and measured about the GL driver, kept in the
+ * user data directory so later launches with the same driver
+ * skip the extension scan and the benchmarks. Loaded before
+ * initGLFunctions, which fills in the extensions on a miss */
+struct GPUProfile
+{
+	/* Hash of the driver strings, set by initGLFunctions */
+	uint64_t driverHash;
+
+	/* Filled in by initGLFunctions unless 'cached' */
+	BoostSet<std::string> extensions;
+	int maxTexSize;
+
+	/* Blended, textured fill rate in megapixels per second */
+	int fillRate;
+
+	/* Native VAOs switch faster than setting up the attributes
+	 * anew for every draw (or there are none to turn off) */
+	bool fastVAO;
+	/* 32 bit indices draw about as fast as 16 bit ones */
+	bool fastIndexUint;
+
+	/* The fields above came from a profile of this driver */
+	bool cached;
+
+	GPUProfile();
+
+	/* Reads the stored profile; does nothing if the
+	 * profile is turned off in 'conf' */
+	void load(const Config &conf);
+
+	/* Hashes the driver strings, and drops a stored
+	 * profile made with a different driver */
+	void matchDriver();
+
+	/* Runs the benchmarks if the profile isn't cached, and
+	 * stores the results. Needs initGLFunctions to be done */
+	void measure();
+
+	/* Turns off fast paths that measured slower, and picks
+	 * the quality options the user left open */
+	void apply(Config &conf) const;
+
+private:
+	void reset();
+	void save() const;
+
+	std::string file;
+};
+
+extern GPUProfile gpuProfile;
+
+#endif // GPUPROFILE_H
@@ -27,14 +27,14 @@
 #include "gl-meta.h"
 #include "sharedstate.h"
 #include "global-ibo.h"
+#include "quadstream.h"
 #include "shader.h"
 
+/* Vertices are streamed through the shared
+ * QuadStream on every draw */
 struct Quad
 {
 	Vertex vert[4];
-	VBO::ID vbo;
-	GLMeta::VAO vao;
-	bool vboDirty;
 
 	template<typename V>
 	static void setPosRect(V *vert, const FloatRect &r)
@@ -73,70 +73,34 @@ struct Quad
 	}
 
 	Quad()
-	    : vbo(VBO::gen()),
-	      vboDirty(true)
 	{
-		GLMeta::vaoFillInVertexData<Vertex>(vao);
-		vao.vbo = vbo;
-		vao.ibo = shState->globalIBO().ibo;
-
-		GLMeta::vaoInit(vao, true);
-		VBO::allocEmpty(sizeof(Vertex[4]), GL_DYNAMIC_DRAW);
-		GLMeta::vaoUnbind(vao);
-
 		setColor(Vec4(1, 1, 1, 1));
 	}
 
-	~Quad()
-	{
-		GLMeta::vaoFini(vao);
-		VBO::del(vbo);
-	}
-
-	void updateBuffer()
-	{
-		VBO::bind(vbo);
-		VBO::uploadSubData(0, sizeof(Vertex[4]), vert);
-		VBO::unbind();
-	}
-
 	void setPosRect(const FloatRect &r)
 	{
 		setPosRect(vert, r);
-		vboDirty = true;
 	}
 
 	void setTexRect(const FloatRect &r)
 	{
 		setTexRect(vert, r);
-		vboDirty = true;
 	}
 
 	void setTexPosRect(const FloatRect &tex, const FloatRect &pos)
 	{
 		setTexPosRect(vert, tex, pos);
-		vboDirty = true;
 	}
 
 	void setColor(const Vec4 &c)
 	{
 		for (int i = 0; i < 4; ++i)
 			vert[i].color = c;
-
-		vboDirty = true;
 	}
 
 	void draw()
 	{
-		if (vboDirty)
-		{
-			updateBuffer();
-			vboDirty = false;
-		}
-
-		GLMeta::vaoBind(vao);
-		gl.DrawElements(GL_TRIANGLES, 6, _GL_INDEX_TYPE, 0);
-		GLMeta::vaoUnbind(vao);
+		shState->quadStream().draw(vert);
 	}
 };
 
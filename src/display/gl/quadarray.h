@@ -32,21 +32,39 @@
 #include <vector>
 #include <stdint.h>
 
+/* Spare GL objects for QuadArrays of one vertex type. Those of
+ * destroyed arrays are handed to the next array created instead
+ * of being deleted right away, as sprites and planes come and go
+ * in bulk (eg. during battle animations). What exceeds the
+ * spare count is deleted in one go at the end of the frame */
 template<class VertexType>
-struct QuadArray
+struct QuadArrayPool
 {
-	std::vector<VertexType> vertices;
-
-	VBO::ID vbo;
-	GLMeta::VAO vao;
+	struct Entry
+	{
+		VBO::ID vbo;
+		GLMeta::VAO vao;
+	};
 
-	size_t quadCount;
-	GLsizeiptr vboSize;
+	static std::vector<Entry> &spares()
+	{
+		static std::vector<Entry> list;
+		return list;
+	}
 
-	QuadArray()
-	    : quadCount(0),
-	      vboSize(-1)
+	static void acquire(VBO::ID &vbo, GLMeta::VAO &vao)
 	{
+		std::vector<Entry> &list = spares();
+
+		if (!list.empty())
+		{
+			vbo = list.back().vbo;
+			vao = list.back().vao;
+			list.pop_back();
+
+			return;
+		}
+
 		vbo = VBO::gen();
 
 		GLMeta::vaoFillInVertexData<VertexType>(vao);
@@ -56,10 +74,49 @@ struct QuadArray
 		GLMeta::vaoInit(vao);
 	}
 
+	static void release(VBO::ID vbo, const GLMeta::VAO &vao)
+	{
+		Entry entry = { vbo, vao };
+		spares().push_back(entry);
+	}
+
+	static void trim(size_t keep)
+	{
+		std::vector<Entry> &list = spares();
+
+		while (list.size() > keep)
+		{
+			GLMeta::vaoFini(list.back().vao);
+			VBO::del(list.back().vbo);
+			list.pop_back();
+		}
+	}
+};
+
+template<class VertexType>
+struct QuadArray
+{
+	std::vector<VertexType> vertices;
+
+	/* Only taken from the pool on first commit,
+	 * as many arrays (eg. of sprite waves) never are */
+	VBO::ID vbo;
+	GLMeta::VAO vao;
+	bool hasGL;
+
+	size_t quadCount;
+	GLsizeiptr vboSize;
+
+	QuadArray()
+	    : hasGL(false),
+	      quadCount(0),
+	      vboSize(-1)
+	{}
+
 	~QuadArray()
 	{
-		GLMeta::vaoFini(vao);
-		VBO::del(vbo);
+		if (hasGL)
+			QuadArrayPool<VertexType>::release(vbo, vao);
 	}
 
 	void resize(size_t size)
@@ -78,6 +135,12 @@ struct QuadArray
 	 * and previous to the first 'draw()' call. */
 	void commit()
 	{
+		if (!hasGL)
+		{
+			QuadArrayPool<VertexType>::acquire(vbo, vao);
+			hasGL = true;
+		}
+
 		VBO::bind(vbo);
 
 		GLsizeiptr size = vertices.size() * sizeof(VertexType);
@@ -93,7 +156,10 @@ struct QuadArray
 		}
 		else
 		{
-			/* New data fits in allocated size */
+			/* New data fits in allocated size. Orphan the old
+			 * storage first, so this doesn't wait on draws
+			 * still reading from it */
+			VBO::allocEmpty(vboSize, GL_DYNAMIC_DRAW);
 			VBO::uploadSubData(0, size, dataPtr(vertices));
 		}
 
@@ -102,10 +168,15 @@ struct QuadArray
 
 	void draw(size_t offset, size_t count)
 	{
+		/* Nothing committed yet */
+		if (!hasGL)
+			return;
+
 		GLMeta::vaoBind(vao);
 
-		const char *_offset = (const char*) 0 + offset * 6 * sizeof(index_t);
+		const char *_offset = (const char*) 0 + offset * 6 * _GL_INDEX_SIZE;
 		gl.DrawElements(GL_TRIANGLES, count * 6, _GL_INDEX_TYPE, _offset);
+		++glCounters.draws;
 
 		GLMeta::vaoUnbind(vao);
 	}
@@ -124,4 +195,14 @@ struct QuadArray
 typedef QuadArray<Vertex> ColorQuadArray;
 typedef QuadArray<SVertex> SimpleQuadArray;
 
+/* Number of spare GL objects kept per vertex type */
+#define QUADARRAY_SPARES 64
+
+/* Called once per frame */
+inline void quadArrayTrimPools()
+{
+	QuadArrayPool<Vertex>::trim(QUADARRAY_SPARES);
+	QuadArrayPool<SVertex>::trim(QUADARRAY_SPARES);
+}
+
 #endif // QUADARRAY_H
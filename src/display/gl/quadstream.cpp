@@ -0,0 +1,199 @@
+/*
+** quadstream.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "quadstream.h"
+
+#include "gl-fun.h"
+#include "gl-util.h"
+#include "gl-meta.h"
+#include "global-ibo.h"
+#include "vertex.h"
+
+#include <string.h>
+#include <assert.h>
+
+/* 512 KiB of vertex data */
+#define STREAM_QUADS 4096
+
+/* Fencing granularity of the persistently mapped ring */
+#define STREAM_SECTIONS 4
+#define SECTION_QUADS (STREAM_QUADS / STREAM_SECTIONS)
+
+/* Nanoseconds per fence wait, before checking again */
+#define FENCE_WAIT_NS 1000000
+
+struct QuadStreamPrivate
+{
+	VBO::ID vbo;
+	GLMeta::VAO vao;
+
+	/* Null unless persistently mapped */
+	Vertex *mapping;
+
+	/* Next free quad slot */
+	size_t head;
+
+	size_t section;
+	_GLsync fences[STREAM_SECTIONS];
+
+	static GLsizeiptr byteSize(size_t quads)
+	{
+		return quads * sizeof(Vertex[4]);
+	}
+
+	bool initPersistent()
+	{
+		const GLbitfield flags = _GL_MAP_WRITE | _GL_MAP_PERSISTENT | _GL_MAP_COHERENT;
+
+		gl.BufferStorage(GL_ARRAY_BUFFER, byteSize(STREAM_QUADS), 0, flags);
+		mapping = static_cast<Vertex*>
+			(gl.MapBufferRange(GL_ARRAY_BUFFER, 0, byteSize(STREAM_QUADS), flags));
+
+		return mapping != 0;
+	}
+
+	static void waitFence(_GLsync fence)
+	{
+		while (true)
+		{
+			GLenum result = gl.ClientWaitSync(fence, _GL_SYNC_FLUSH_COMMANDS, FENCE_WAIT_NS);
+
+			if (result != _GL_TIMEOUT_EXPIRED)
+				break;
+		}
+
+		gl.DeleteSync(fence);
+	}
+
+	/* Moves on to the next section, once the GPU is
+	 * done reading what was last written there */
+	void nextSection()
+	{
+		fences[section] = gl.FenceSync(_GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		section = (section + 1) % STREAM_SECTIONS;
+
+		if (fences[section])
+		{
+			waitFence(fences[section]);
+			fences[section] = 0;
+		}
+
+		head = section * SECTION_QUADS;
+	}
+
+	/* Returns the first of 'count' consecutive free slots */
+	size_t reserve(size_t count)
+	{
+		if (mapping)
+		{
+			if (head + count > (section + 1) * SECTION_QUADS)
+				nextSection();
+		}
+		else if (head + count > STREAM_QUADS)
+		{
+			/* Orphan the storage the GPU may still be reading */
+			VBO::bind(vbo);
+			VBO::allocEmpty(byteSize(STREAM_QUADS), GL_STREAM_DRAW);
+			head = 0;
+		}
+
+		const size_t start = head;
+		head += count;
+
+		return start;
+	}
+};
+
+QuadStream::QuadStream(GlobalIBO &ibo)
+{
+	p = new QuadStreamPrivate;
+	p->mapping = 0;
+	p->head = 0;
+	p->section = 0;
+
+	for (size_t i = 0; i < STREAM_SECTIONS; ++i)
+		p->fences[i] = 0;
+
+	ibo.ensureSize(STREAM_QUADS);
+
+	p->vbo = VBO::gen();
+	VBO::bind(p->vbo);
+
+	if (gl.persistent_map && !p->initPersistent())
+	{
+		/* The immutable storage can't be respecified */
+		VBO::del(p->vbo);
+		p->vbo = VBO::gen();
+		VBO::bind(p->vbo);
+	}
+
+	if (!p->mapping)
+		VBO::allocEmpty(p->byteSize(STREAM_QUADS), GL_STREAM_DRAW);
+
+	GLMeta::vaoFillInVertexData<Vertex>(p->vao);
+	p->vao.vbo = p->vbo;
+	p->vao.ibo = ibo.ibo;
+
+	GLMeta::vaoInit(p->vao);
+}
+
+QuadStream::~QuadStream()
+{
+	for (size_t i = 0; i < STREAM_SECTIONS; ++i)
+		if (p->fences[i])
+			gl.DeleteSync(p->fences[i]);
+
+	if (p->mapping)
+	{
+		VBO::bind(p->vbo);
+		gl.UnmapBuffer(GL_ARRAY_BUFFER);
+	}
+
+	GLMeta::vaoFini(p->vao);
+	VBO::del(p->vbo);
+
+	delete p;
+}
+
+void QuadStream::draw(const Vertex *vert, size_t count)
+{
+	assert(count <= SECTION_QUADS);
+
+	const size_t start = p->reserve(count);
+
+	if (p->mapping)
+	{
+		memcpy(&p->mapping[start*4], vert, p->byteSize(count));
+		VBO::countUpload(p->byteSize(count));
+	}
+	else
+	{
+		VBO::bind(p->vbo);
+		VBO::uploadSubData(p->byteSize(start), p->byteSize(count), vert);
+	}
+
+	GLMeta::vaoBind(p->vao);
+
+	/* Quad n of the index buffer addresses vertices 4n to 4n+3 */
+	const char *offset = (const char*) 0 + start * 6 * _GL_INDEX_SIZE;
+	gl.DrawElements(GL_TRIANGLES, count * 6, _GL_INDEX_TYPE, offset);
+	++glCounters.draws;
+
+	GLMeta::vaoUnbind(p->vao);
+}
@@ -0,0 +1,50 @@
+/*
+** quadstream.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QUADSTREAM_H
+#define QUADSTREAM_H
+
+#include <stddef.h>
+
+struct GlobalIBO;
+struct Vertex;
+struct QuadStreamPrivate;
+
+/* Ring of vertex storage shared by all 'Quad' draws. Every draw
+ * writes its vertices behind the previous ones, so no quad needs
+ * a buffer of its own. Where buffer storage and sync objects are
+ * available the ring stays persistently mapped, and its sections
+ * are fenced before being written again; elsewhere the buffer is
+ * orphaned whenever writing wraps around */
+class QuadStream
+{
+public:
+	/* 'ibo' is grown to cover the whole ring */
+	QuadStream(GlobalIBO &ibo);
+	~QuadStream();
+
+	/* Streams 'count' quads (4 vertices each) and draws
+	 * them with the currently bound shader */
+	void draw(const Vertex *vert, size_t count = 1);
+
+private:
+	QuadStreamPrivate *p;
+};
+
+#endif // QUADSTREAM_H
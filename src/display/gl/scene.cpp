@@ -21,12 +21,35 @@
 
 #include "scene.h"
 #include "sharedstate.h"
+#include "config.h"
+#include "quadarray.h"
+#include "shader.h"
+#include "glstate.h"
+#include "gl-util.h"
+#include "trace.h"
+
+#include <vector>
+#include <algorithm>
+
+/* Upper bound on quads merged into a single draw call,
+ * keeps the quad index buffer in range */
+#define BATCH_MAX_QUADS (gl.element_index_uint ? 0x10000 : INDEX_16_MAX_QUADS)
+
+struct SceneBatch
+{
+	ColorQuadArray qArray;
+	std::vector<BatchQuad> quads;
+};
 
 Scene::Scene()
+    : sortPending(false),
+      batch(0)
 {}
 
 Scene::~Scene()
 {
+	delete batch;
+
 	/* Ensure elements don't unlink from a destructed Scene */
 	IntruListLink<SceneElement> *iter;
 
@@ -36,26 +59,41 @@ Scene::~Scene()
 	}
 }
 
-void Scene::insert(SceneElement &element)
+unsigned int Scene::screenDamageStamp = 0;
+bool Scene::depthBuffered = false;
+
+void Scene::damageScreen()
 {
-	IntruListLink<SceneElement> *iter;
+	++screenDamageStamp;
 
-	for (iter = elements.begin(); iter != elements.end(); iter = iter->next)
-	{
-		SceneElement *e = iter->data;
+	if (!shState || !shState->screen())
+		return;
 
-		if (element < *e)
-		{
-			elements.insertBefore(element.link, *iter);
-			return;
-		}
-	}
+	shState->screen()->damage();
+}
 
+void Scene::insert(SceneElement &element)
+{
+	damage();
+
+	/* Put in place by the next sortElements() pass */
 	elements.append(element.link);
+	element.sortPending = true;
+	sortPending = true;
 }
 
 void Scene::insertAfter(SceneElement &element, SceneElement &after)
 {
+	/* The list is only known to be in order
+	 * after all pending moves are sorted in */
+	if (sortPending)
+	{
+		insert(element);
+		return;
+	}
+
+	damage();
+
 	IntruListLink<SceneElement> *iter;
 
 	for (iter = &after.link; iter != elements.end(); iter = iter->next)
@@ -74,12 +112,68 @@ void Scene::insertAfter(SceneElement &element, SceneElement &after)
 
 void Scene::reinsert(SceneElement &element)
 {
-	elements.remove(element.link);
-	insert(element);
+	damage();
+
+	element.sortPending = true;
+	sortPending = true;
+}
+
+void Scene::sortElements()
+{
+	if (!sortPending)
+		return;
+
+	sortPending = false;
+
+	/* Only touched from the render thread */
+	static std::vector<SceneElement*> moved;
+	moved.clear();
+
+	IntruListLink<SceneElement> *iter = elements.begin();
+
+	/* Take out all elements whose order changed; the
+	 * remaining ones are still sorted among each other */
+	while (iter != elements.end())
+	{
+		IntruListLink<SceneElement> *next = iter->next;
+		SceneElement *e = iter->data;
+
+		if (e->sortPending)
+		{
+			elements.remove(e->link);
+			e->sortPending = false;
+			moved.push_back(e);
+		}
+
+		iter = next;
+	}
+
+	/* Creation stamps make the order total, so
+	 * an unstable sort yields the same result */
+	std::sort(moved.begin(), moved.end(),
+	          [](const SceneElement *a, const SceneElement *b) { return *a < *b; });
+
+	/* Merge both back into one list */
+	iter = elements.begin();
+
+	for (size_t i = 0; i < moved.size(); ++i)
+	{
+		SceneElement *e = moved[i];
+
+		while (iter != elements.end() && !(*e < *iter->data))
+			iter = iter->next;
+
+		if (iter == elements.end())
+			elements.append(e->link);
+		else
+			elements.insertBefore(e->link, *iter);
+	}
 }
 
 void Scene::notifyGeometryChange()
 {
+	damage();
+
 	IntruListLink<SceneElement> *iter;
 
 	for (iter = elements.begin(); iter != elements.end(); iter = iter->next)
@@ -88,17 +182,171 @@ void Scene::notifyGeometryChange()
 	}
 }
 
+static void drawElement(SceneElement *e)
+{
+	TRACE_ZONE("SceneElement::draw");
+	e->draw();
+}
+
 void Scene::composite()
 {
+	TRACE_ZONE("Scene::composite");
+
+	sortElements();
+
+	const bool batching = shState->config().spriteBatching;
+
+	/* Nothing below an opaque full-scene element can be seen */
+	IntruListLink<SceneElement> *iter = topOccluder();
+
+	if (!iter)
+		iter = elements.begin();
+
+	while (iter != elements.end())
+	{
+		SceneElement *e = iter->data;
+
+		if (!e->visible || e->culled)
+		{
+			iter = iter->next;
+			continue;
+		}
+
+		if (batching)
+		{
+			iter = drawBatch(iter);
+		}
+		else
+		{
+			drawElement(e);
+			iter = iter->next;
+		}
+	}
+}
+
+IntruListLink<SceneElement> *Scene::topOccluder()
+{
+	for (IntruListLink<SceneElement> *iter = elements.end()->prev;
+	     iter != elements.end(); iter = iter->prev)
+	{
+		SceneElement *e = iter->data;
+
+		if (e->visible && !e->culled && e->occludesScene())
+			return iter;
+	}
+
+	return 0;
+}
+
+IntruListLink<SceneElement> *Scene::drawBatch(IntruListLink<SceneElement> *first)
+{
+	if (!batch)
+		batch = new SceneBatch;
+
+	std::vector<BatchQuad> &quads = batch->quads;
+	quads.clear();
+
+	SceneElement *single = first->data;
+
+	if (!single->getBatchQuads(quads) || quads.size() > BATCH_MAX_QUADS)
+	{
+		drawElement(single);
+		return first->next;
+	}
+
+	/* Nothing to draw */
+	if (quads.empty())
+		return first->next;
+
+	size_t elementCount = 1;
 	IntruListLink<SceneElement> *iter;
 
-	for (iter = elements.begin(); iter != elements.end(); iter = iter->next)
+	for (iter = first->next; iter != elements.end(); iter = iter->next)
 	{
 		SceneElement *e = iter->data;
 
-		if (e->visible)
-			e->draw();
+		/* Invisible elements don't break the run */
+		if (!e->visible || e->culled)
+			continue;
+
+		const size_t prevCount = quads.size();
+
+		/* Elements that don't fit are left for the next run */
+		if (!e->getBatchQuads(quads) || quads.size() > BATCH_MAX_QUADS)
+		{
+			quads.resize(prevCount);
+			break;
+		}
+
+		if (quads.size() > prevCount)
+			++elementCount;
+	}
+
+	/* Not worth going through the batch path */
+	if (elementCount == 1)
+	{
+		drawElement(single);
+		return first->next;
+	}
+
+	ColorQuadArray &qArray = batch->qArray;
+	qArray.resize(quads.size());
+
+	for (size_t i = 0; i < quads.size(); ++i)
+	{
+		const BatchQuad &q = quads[i];
+		Vertex *vert = &qArray.vertices[i*4];
+
+		for (size_t j = 0; j < 4; ++j)
+		{
+			vert[j].pos = q.pos[j];
+			vert[j].texPos = q.texPos[j];
+			vert[j].color = Vec4(1, 1, 1, q.opacity);
+		}
+	}
+
+	qArray.commit();
+
+	SimpleAlphaShader &shader = shState->shaders().simpleAlpha;
+	shader.bind();
+	shader.applyViewportProj();
+	shader.setTranslation(Vec2i());
+
+	/* One draw call per stretch of quads sharing
+	 * texture, filtering, blend mode and opacity */
+	size_t next;
+
+	for (size_t i = 0; i < quads.size(); i = next)
+	{
+		const BatchQuad &q = quads[i];
+
+		for (next = i + 1; next < quads.size(); ++next)
+		{
+			const BatchQuad &n = quads[next];
+
+			if (n.tex->tex != q.tex->tex || n.blendType != q.blendType ||
+			    n.smooth != q.smooth || n.opaque != q.opaque)
+				break;
+		}
+
+		shader.setTexSize(Vec2i(q.tex->width, q.tex->height));
+
+		TEX::bind(q.tex->tex);
+
+		if (q.smooth)
+			TEX::setSmooth(true);
+
+		glState.blendMode.pushSet(q.blendType);
+		glState.blend.pushSet(!q.opaque);
+		qArray.draw(i, next - i);
+		glState.blend.pop();
+		glState.blendMode.pop();
+
+		if (q.smooth)
+			TEX::setSmooth(false);
 	}
+
+	return iter;
 }
 
 
@@ -107,6 +355,8 @@ SceneElement::SceneElement(Scene &scene, int z, int spriteY)
       creationStamp(shState->genTimeStamp()),
       z(z),
       visible(true),
+      culled(false),
+      sortPending(false),
       scene(&scene),
       spriteY(spriteY)
 {
@@ -118,6 +368,19 @@ SceneElement::~SceneElement()
 	unlink();
 }
 
+bool SceneElement::getBatchQuads(std::vector<BatchQuad> &quads)
+{
+	BatchQuad quad;
+
+	if (!getBatchQuad(quad))
+		return false;
+
+	if (quad.tex)
+		quads.push_back(quad);
+
+	return true;
+}
+
 void SceneElement::setScene(Scene &scene)
 {
 	unlink();
@@ -158,7 +421,13 @@ void SceneElement::setVisible(bool value)
 {
 	aboutToAccess();
 
+	if (visible == value)
+		return;
+
 	visible = value;
+
+	if (scene)
+		scene->damage();
 }
 
 bool SceneElement::operator<(const SceneElement &o) const
@@ -197,6 +466,17 @@ void SceneElement::setSpriteY(int value)
 
 void SceneElement::unlink()
 {
-	if (scene)
-		scene->elements.remove(link);
+	if (!scene)
+		return;
+
+	scene->elements.remove(link);
+	scene->damage();
+
+	sortPending = false;
+}
+
+void SceneElement::damage()
+{
+	if (visible && scene)
+		scene->damage();
 }
@@ -27,12 +27,39 @@
 #include "etc.h"
 #include "etc-internal.h"
 
+#include <vector>
+
 class SceneElement;
 class Viewport;
 class WindowVX;
 class Window;
 struct ScanRow;
 struct TilemapPrivate;
+struct TEXFBO;
+struct SceneBatch;
+
+/* Describes an element which can be drawn as a single, plain
+ * textured quad (no tone, color, wave etc.), allowing runs of
+ * such elements to be merged into one draw call */
+struct BatchQuad
+{
+	/* Texture the quad samples from. If null, the
+	 * element wouldn't draw anything at all */
+	const TEXFBO *tex;
+	BlendType blendType;
+	float opacity;
+
+	/* Sample with linear filtering */
+	bool smooth;
+
+	/* Covers whatever is below it completely, so
+	 * it can be drawn with blending turned off */
+	bool opaque;
+
+	/* Scene space positions, texture space coordinates */
+	Vec2 pos[4];
+	Vec2 texPos[4];
+};
 
 class Scene
 {
@@ -55,27 +82,66 @@ public:
 	virtual ~Scene();
 
 	virtual void composite();
+	/* 'source' is the viewport the effects belong to */
 	virtual void requestViewportRender(const Vec4& /* color */,
 	                                   const Vec4& /* flash */,
-	                                   const Vec4& /* tone */) {}
+	                                   const Vec4& /* tone */,
+	                                   const SceneElement* /* source */) {}
 
 	const Geometry &getGeometry() const { return geometry; }
 
+	/* Marks the contents of this scene as changed since the
+	 * last composition. Only the screen scene keeps track */
+	virtual void damage() {}
+
+	/* Damages the screen scene, if there is one yet. Used for
+	 * changes that can't be traced to a scene (eg. a modified
+	 * Bitmap), so everything drawn is outdated */
+	static void damageScreen();
+
+	/* Bumped on each damageScreen() call */
+	static unsigned int screenDamageStamp;
+
+	/* Set while the screen scene is composited into
+	 * buffers with a depth attachment (see 'tilemapDepth') */
+	static bool depthBuffered;
+
 protected:
+	/* Inserting and reinserting only flag the element; the list
+	 * is brought back into draw order in bulk on composition */
 	void insert(SceneElement &element);
 	void insertAfter(SceneElement &element, SceneElement &after);
 	void reinsert(SceneElement &element);
 
+	/* Sorts all flagged elements and merges them back in,
+	 * O(n + k log k) for k elements changed since last time */
+	void sortElements();
+
 	/* Notify all elements that geometry has changed */
 	void notifyGeometryChange();
 
+	/* The topmost element hiding everything below it (see
+	 * 'SceneElement::occludesScene()'), or null */
+	IntruListLink<SceneElement> *topOccluder();
+
 	IntruList<SceneElement> elements;
 	Geometry geometry;
 
+	/* Some element is out of place */
+	bool sortPending;
+
 	friend class SceneElement;
 	friend class Window;
 	friend class WindowVX;
 	friend struct ZLayer;
+
+private:
+	/* Draws the longest run of batchable elements starting
+	 * at 'first', and returns the first link not consumed */
+	IntruListLink<SceneElement> *drawBatch(IntruListLink<SceneElement> *first);
+
+	/* Lazily allocated on first batched draw */
+	SceneBatch *batch;
 };
 
 class SceneElement
@@ -91,6 +157,21 @@ public:
 
 	virtual void aboutToAccess() const = 0;
 
+	/* To be called whenever something changes that affects
+	 * what this element draws; damages the scene it is part
+	 * of. No-op while invisible */
+	void damage();
+
+	/* Called on the screen's elements before each composition,
+	 * outside of the draw cycle, so they can render into buffers
+	 * of their own */
+	virtual void prerender() {}
+
+	/* Whether the screen pixel at (x, y) shows something this
+	 * element drew. Only sprites tell, which 'Viewport::pick()'
+	 * relies on */
+	virtual bool hitTest(int /* x */, int /* y */) { return false; }
+
 protected:
 	/* A bit about OpenGL state:
 	 *
@@ -107,14 +188,34 @@ protected:
 	 * cleanup (and therefore you should expect dirty state).
 	 * Do NOT touch the FBO::Draw binding. If you have to do work
 	 * immediately before drawing that touches this (such as flushing
-	 * Bitmaps), use the 'prepareDraw' signal in SharedState that
-	 * will fire immediately before each frame draw.
+	 * Bitmaps), derive from Preparable and request a 'prepare()',
+	 * which will run immediately before the next frame draw.
 	 */
 	virtual void draw() = 0;
 
 	// FIXME: This should be a signal
 	virtual void onGeometryChange(const Scene::Geometry &) {}
 
+	/* If this element can currently be drawn as a plain textured
+	 * quad, fill out 'quad' and return true. Scene will then try
+	 * to merge it with neighbouring batchable elements instead of
+	 * calling 'draw()'; each stretch of quads sharing texture,
+	 * filtering and blend mode becomes one draw call */
+	virtual bool getBatchQuad(BatchQuad &) { return false; }
+
+	/* Same for elements drawn as several plain quads (eg. the
+	 * pieces of a window frame), which may sample different
+	 * textures. Appends them in draw order and returns true,
+	 * or returns false if 'draw()' is needed. Appending nothing
+	 * means there is nothing to draw. Defaults to a single
+	 * 'getBatchQuad()' */
+	virtual bool getBatchQuads(std::vector<BatchQuad> &quads);
+
+	/* Whether this element currently covers all of its scene
+	 * with fully opaque pixels. Nothing below it in display
+	 * order is drawn then */
+	virtual bool occludesScene() { return false; }
+
 	/* Compares two elements in terms of their display priority;
 	 * elements with lower priority are drawn earlier */
 	bool operator<(const SceneElement &o) const;
@@ -126,6 +227,15 @@ protected:
 	const unsigned int creationStamp;
 	int z;
 	bool visible;
+
+	/* Set by the element itself while it is known to draw
+	 * nothing (eg. entirely off screen). Skipped like an
+	 * invisible element, without being called into */
+	bool culled;
+
+	/* Needs to be moved by the next sortElements() */
+	bool sortPending;
+
 	Scene *scene;
 
 	friend class Scene;
@@ -146,6 +256,16 @@ private:
 	int spriteY;
 };
 
+/* Same as DEF_ATTR_SIMPLE, but damages the element on write */
+#define DEF_ATTR_SIMPLE_DAMAGE(klass, name, type, location) \
+	DEF_ATTR_RD_SIMPLE(klass, name, type, location) \
+	void klass :: set##name(type value) \
+	{ \
+		guardDisposed(); \
+		location = value; \
+		damage(); \
+	}
+
 #define ABOUT_TO_ACCESS_NOOP \
 	void aboutToAccess() const {}
 
@@ -23,9 +23,16 @@
 #include "sharedstate.h"
 #include "glstate.h"
 #include "exception.h"
+#include "config.h"
+#include "util.h"
+#include "debugwriter.h"
+
+#include <SDL_rwops.h>
 
 #include <assert.h>
 #include <string.h>
+#include <math.h>
+#include <math.h>
 #include <iostream>
 
 #ifndef MKXPZ_BUILD_XCODE
@@ -42,9 +49,14 @@
 #include "simpleColor.frag.xxd"
 #include "simpleAlpha.frag.xxd"
 #include "simpleAlphaUni.frag.xxd"
+#include "particle.frag.xxd"
 #include "tilemap.frag.xxd"
+#include "tilemapGround.frag.xxd"
 #include "flashMap.frag.xxd"
 #include "lanczos3.frag.xxd"
+#include "sharpScale.frag.xxd"
+#include "screenEffects.frag.xxd"
+#include "sdfText.frag.xxd"
 #include "minimal.vert.xxd"
 #include "simple.vert.xxd"
 #include "simpleColor.vert.xxd"
@@ -54,26 +66,34 @@
 #include "simpleMatrix.vert.xxd"
 #include "blurH.vert.xxd"
 #include "blurV.vert.xxd"
+#include "gaussianBlur.frag.xxd"
+#include "radialBlur.frag.xxd"
 #include "tilemapvx.vert.xxd"
+#include "windowBg.frag.xxd"
+#include "windowBg.vert.xxd"
+#include "windowBase.frag.xxd"
+#include "yuv.frag.xxd"
 #endif
 
 #ifdef MKXPZ_BUILD_XCODE
 #include "filesystem/filesystem.h"
-#define INIT_SHADER(vert, frag, name) \
+#define INIT_SHADER_DEFS(vert, frag, name, defines) \
 { \
     std::string v = mkxp_fs::contentsOfAssetAsString("Shaders/" #vert, "vert"); \
     std::string f = mkxp_fs::contentsOfAssetAsString("Shaders/" #frag, "frag"); \
-    Shader::init((const unsigned char*)v.c_str(), v.length(), (const unsigned char*)f.c_str(), f.length(), #vert, #frag, #name); \
+    Shader::init((const unsigned char*)v.c_str(), v.length(), (const unsigned char*)f.c_str(), f.length(), #vert, #frag, #name, defines); \
 }
 #else
-#define INIT_SHADER(vert, frag, name) \
+#define INIT_SHADER_DEFS(vert, frag, name, defines) \
 { \
 	Shader::init(___shader_##vert##_vert, ___shader_##vert##_vert_len, ___shader_##frag##_frag, ___shader_##frag##_frag_len, \
-	#vert, #frag, #name); \
+	#vert, #frag, #name, defines); \
 }
 #endif
 
-#define GET_U(name) u_##name = gl.GetUniformLocation(program, #name)
+#define INIT_SHADER(vert, frag, name) INIT_SHADER_DEFS(vert, frag, name, 0)
+
+#define GET_U(name) lookupUniform(u_##name, #name)
 
 #ifdef MKXPZ_BUILD_XCODE
     std::string Shader::shaderCommon = "";
@@ -111,8 +131,13 @@ Shader::Shader()
 	fragShader = gl.CreateShader(GL_FRAGMENT_SHADER);
 
 	program = gl.CreateProgram();
+
+	deferred.pending = false;
+	deferred.cacheKey = 0;
 }
 
+bool Shader::deferLinks = false;
+
 Shader::~Shader()
 {
 	gl.UseProgram(0);
@@ -126,9 +151,17 @@ void Shader::bind()
 	glState.program.set(program);
 }
 
+void Shader::lookupUniform(GLint &location, const char *name)
+{
+	if (deferred.pending)
+		deferred.uniforms.push_back(std::make_pair(&location, name));
+	else
+		location = gl.GetUniformLocation(program, name);
+}
+
 void Shader::unbind()
 {
-	gl.ActiveTexture(GL_TEXTURE0);
+	TEX::setUnit(0);
 	glState.program.set(0);
 }
 
@@ -138,14 +171,26 @@ std::string &Shader::commonHeader() {
 }
 #endif
 
+static void commonSource(const GLchar *&src, GLint &size)
+{
+#ifndef MKXPZ_BUILD_XCODE
+	src = (const GLchar*) ___shader_common_h;
+	size = ___shader_common_h_len;
+#else
+    src = (const GLchar*) Shader::commonHeader().c_str();
+    size = Shader::commonHeader().length();
+#endif
+}
+
 static void setupShaderSource(GLuint shader, GLenum type,
-                              const unsigned char *body, int bodySize)
+                              const unsigned char *body, int bodySize,
+                              const char *defines)
 {
 	static const char glesDefine[] = "#define GLSLES\n";
 	static const char fragDefine[] = "#define FRAGMENT_SHADER\n";
 
-	const GLchar *shaderSrc[4];
-	GLint shaderSrcSize[4];
+	const GLchar *shaderSrc[5];
+	GLint shaderSrcSize[5];
 	size_t i = 0;
 
 	if (gl.glsles)
@@ -162,13 +207,14 @@ static void setupShaderSource(GLuint shader, GLenum type,
 		++i;
 	}
 
-#ifndef MKXPZ_BUILD_XCODE
-	shaderSrc[i] = (const GLchar*) ___shader_common_h;
-	shaderSrcSize[i] = ___shader_common_h_len;
-#else
-    shaderSrc[i] = (const GLchar*) Shader::commonHeader().c_str();
-    shaderSrcSize[i] = Shader::commonHeader().length();
-#endif
+	if (defines)
+	{
+		shaderSrc[i] = defines;
+		shaderSrcSize[i] = strlen(defines);
+		++i;
+	}
+
+	commonSource(shaderSrc[i], shaderSrcSize[i]);
 	++i;
 
 	shaderSrc[i] = (const GLchar*) body;
@@ -181,12 +227,43 @@ static void setupShaderSource(GLuint shader, GLenum type,
 void Shader::init(const unsigned char *vert, int vertSize,
                   const unsigned char *frag, int fragSize,
                   const char *vertName, const char *fragName,
-                  const char *programName)
+                  const char *programName, const char *defines)
 {
 	GLint success;
 
+	ProgramCache *cache = ProgramCache::current;
+	uint64_t cacheKey = 0;
+
+	if (cache)
+	{
+		cacheKey = cache->keyFor(vert, vertSize, frag, fragSize, defines);
+
+		if (cache->restore(cacheKey, program))
+			return;
+	}
+
+	/* Nothing is checked here if deferred, so that all compiles
+	 * and links can be queued before any is waited for */
+	if (deferLinks && gl.parallel_compile)
+	{
+		setupShaderSource(vertShader, GL_VERTEX_SHADER, vert, vertSize, defines);
+		gl.CompileShader(vertShader);
+		setupShaderSource(fragShader, GL_FRAGMENT_SHADER, frag, fragSize, defines);
+		gl.CompileShader(fragShader);
+
+		link(cache != 0);
+
+		deferred.pending = true;
+		deferred.cacheKey = cacheKey;
+		deferred.vertName = vertName;
+		deferred.fragName = fragName;
+		deferred.programName = programName;
+
+		return;
+	}
+
 	/* Compile vertex shader */
-	setupShaderSource(vertShader, GL_VERTEX_SHADER, vert, vertSize);
+	setupShaderSource(vertShader, GL_VERTEX_SHADER, vert, vertSize, defines);
 	gl.CompileShader(vertShader);
 
 	gl.GetShaderiv(vertShader, GL_COMPILE_STATUS, &success);
@@ -200,7 +277,7 @@ void Shader::init(const unsigned char *vert, int vertSize,
 	}
 
 	/* Compile fragment shader */
-	setupShaderSource(fragShader, GL_FRAGMENT_SHADER, frag, fragSize);
+	setupShaderSource(fragShader, GL_FRAGMENT_SHADER, frag, fragSize, defines);
 	gl.CompileShader(fragShader);
 
 	gl.GetShaderiv(fragShader, GL_COMPILE_STATUS, &success);
@@ -214,6 +291,24 @@ void Shader::init(const unsigned char *vert, int vertSize,
 	}
 
 	/* Link shader program */
+	link(cache != 0);
+
+	gl.GetProgramiv(program, GL_LINK_STATUS, &success);
+
+	if (!success)
+	{
+		printProgramLog(program);
+		throw Exception(Exception::MKXPError,
+	                    "GLSL: An error occured while linking program '%s' (vertex '%s', fragment '%s')",
+	                    programName, vertName, fragName);
+	}
+
+	if (cache)
+		cache->store(cacheKey, program);
+}
+
+void Shader::link(bool retrievable)
+{
 	gl.AttachShader(program, vertShader);
 	gl.AttachShader(program, fragShader);
 
@@ -221,17 +316,70 @@ void Shader::init(const unsigned char *vert, int vertSize,
 	gl.BindAttribLocation(program, TexCoord, "texCoord");
 	gl.BindAttribLocation(program, Color, "color");
 
+	if (retrievable && gl.ProgramParameteri)
+		gl.ProgramParameteri(program, _GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
 	gl.LinkProgram(program);
+}
+
+bool Shader::linkDone()
+{
+	if (!deferred.pending)
+		return true;
+
+	GLint done = GL_FALSE;
+	gl.GetProgramiv(program, _GL_COMPLETION_STATUS, &done);
+
+	return done != GL_FALSE;
+}
+
+void Shader::finishLink()
+{
+	if (!deferred.pending)
+		return;
 
+	deferred.pending = false;
+
+	GLint success;
 	gl.GetProgramiv(program, GL_LINK_STATUS, &success);
 
 	if (!success)
 	{
+		/* Find out which stage it was */
+		gl.GetShaderiv(vertShader, GL_COMPILE_STATUS, &success);
+
+		if (!success)
+		{
+			printShaderLog(vertShader);
+			throw Exception(Exception::MKXPError,
+			                "GLSL: An error occured while compiling vertex shader '%s' in program '%s'",
+			                deferred.vertName.c_str(), deferred.programName.c_str());
+		}
+
+		gl.GetShaderiv(fragShader, GL_COMPILE_STATUS, &success);
+
+		if (!success)
+		{
+			printShaderLog(fragShader);
+			throw Exception(Exception::MKXPError,
+			                "GLSL: An error occured while compiling fragment shader '%s' in program '%s'",
+			                deferred.fragName.c_str(), deferred.programName.c_str());
+		}
+
 		printProgramLog(program);
 		throw Exception(Exception::MKXPError,
-	                    "GLSL: An error occured while linking program '%s' (vertex '%s', fragment '%s')",
-	                    programName, vertName, fragName);
+		                "GLSL: An error occured while linking program '%s' (vertex '%s', fragment '%s')",
+		                deferred.programName.c_str(), deferred.vertName.c_str(), deferred.fragName.c_str());
 	}
+
+	if (ProgramCache::current && deferred.cacheKey)
+		ProgramCache::current->store(deferred.cacheKey, program);
+
+	for (size_t i = 0; i < deferred.uniforms.size(); ++i)
+		*deferred.uniforms[i].first =
+			gl.GetUniformLocation(program, deferred.uniforms[i].second);
+
+	deferred.uniforms.clear();
 }
 
 void Shader::initFromFile(const char *_vertFile, const char *_fragFile,
@@ -258,12 +406,10 @@ void Shader::setVec4Uniform(GLint location, const Vec4 &vec)
 
 void Shader::setTexUniform(GLint location, unsigned unitIndex, TEX::ID texture)
 {
-	GLenum texUnit = GL_TEXTURE0 + unitIndex;
-
-	gl.ActiveTexture(texUnit);
-	gl.BindTexture(GL_TEXTURE_2D, texture.gl);
+	TEX::setUnit(unitIndex);
+	TEX::bind(texture);
 	gl.Uniform1i(location, unitIndex);
-	gl.ActiveTexture(GL_TEXTURE0);
+	TEX::setUnit(0);
 }
 
 void ShaderBase::GLProjMat::apply(const Vec2i &value)
@@ -289,7 +435,7 @@ void ShaderBase::init()
 	GET_U(texSizeInv);
 	GET_U(translation);
 
-	projMat.u_mat = gl.GetUniformLocation(program, "projMat");
+	lookupUniform(projMat.u_mat, "projMat");
 }
 
 void ShaderBase::applyViewportProj()
@@ -355,6 +501,29 @@ SimpleAlphaShader::SimpleAlphaShader()
 }
 
 
+SimpleAlphaUniShader::SimpleAlphaUniShader()
+{
+	INIT_SHADER(simple, simpleAlphaUni, SimpleAlphaUniShader);
+
+	ShaderBase::init();
+
+	GET_U(alpha);
+}
+
+void SimpleAlphaUniShader::setAlpha(float value)
+{
+	gl.Uniform1f(u_alpha, value);
+}
+
+
+ParticleShader::ParticleShader()
+{
+	INIT_SHADER(simpleColor, particle, ParticleShader);
+
+	ShaderBase::init();
+}
+
+
 SimpleSpriteShader::SimpleSpriteShader()
 {
 	INIT_SHADER(sprite, simple, SimpleSpriteShader);
@@ -457,9 +626,24 @@ void SimpleTransShader::setProg(float value)
 }
 
 
-SpriteShader::SpriteShader()
+SpriteShader::SpriteShader(unsigned features)
 {
-	INIT_SHADER(sprite, sprite, SpriteShader);
+	std::string defines;
+
+	if (features & Tone)
+		defines += "#define SPRITE_TONE\n";
+	if (features & Color)
+		defines += "#define SPRITE_COLOR\n";
+	if (features & Bush)
+		defines += "#define SPRITE_BUSH\n";
+	if (features & Pattern)
+		defines += "#define SPRITE_PATTERN\n";
+	if (features & Invert)
+		defines += "#define SPRITE_INVERT\n";
+	if (features & Hue)
+		defines += "#define SPRITE_HUE\n";
+
+	INIT_SHADER_DEFS(sprite, sprite, SpriteShader, defines.c_str());
 
 	ShaderBase::init();
 
@@ -478,6 +662,10 @@ SpriteShader::SpriteShader()
     GET_U(patternScroll);
     GET_U(patternZoom);
     GET_U(invert);
+    GET_U(hueAdjust);
+    GET_U(waveAmp);
+    GET_U(wavePhase);
+    GET_U(waveFreq);
 }
 
 void SpriteShader::setSpriteMat(const float value[16])
@@ -551,6 +739,18 @@ void SpriteShader::setInvert(bool value)
     gl.Uniform1i(u_invert, value);
 }
 
+void SpriteShader::setHueAdjust(float value)
+{
+    gl.Uniform1f(u_hueAdjust, value);
+}
+
+void SpriteShader::setWave(float amp, float phase, float length)
+{
+    gl.Uniform1f(u_waveAmp, amp);
+    gl.Uniform1f(u_wavePhase, phase);
+    gl.Uniform1f(u_waveFreq, length != 0 ? (float) (M_PI * 2) / length : 0);
+}
+
 
 PlaneShader::PlaneShader()
 {
@@ -562,6 +762,7 @@ PlaneShader::PlaneShader()
 	GET_U(color);
 	GET_U(flash);
 	GET_U(opacity);
+	GET_U(wrap);
 }
 
 void PlaneShader::setTone(const Vec4 &tone)
@@ -584,6 +785,77 @@ void PlaneShader::setOpacity(float value)
 	gl.Uniform1f(u_opacity, value);
 }
 
+void PlaneShader::setWrap(bool value)
+{
+	gl.Uniform1i(u_wrap, value);
+}
+
+
+WindowBgShader::WindowBgShader()
+{
+	INIT_SHADER(windowBg, windowBg, WindowBgShader);
+
+	ShaderBase::init();
+
+	GET_U(tone);
+	GET_U(opacity);
+	GET_U(tileSrc);
+	GET_U(skinSize);
+	GET_U(bgOrigin);
+}
+
+void WindowBgShader::setTone(const Vec4 &value)
+{
+	setVec4Uniform(u_tone, value);
+}
+
+void WindowBgShader::setOpacity(float value)
+{
+	gl.Uniform1f(u_opacity, value);
+}
+
+void WindowBgShader::setTileSrc(const IntRect &value)
+{
+	setVec4Uniform(u_tileSrc, Vec4(value.x, value.y, value.w, value.h));
+}
+
+void WindowBgShader::setSkinSize(const Vec2i &value)
+{
+	gl.Uniform2f(u_skinSize, value.x, value.y);
+}
+
+void WindowBgShader::setBgOrigin(const Vec2i &value)
+{
+	gl.Uniform2f(u_bgOrigin, value.x, value.y);
+}
+
+
+WindowBaseShader::WindowBaseShader()
+{
+	INIT_SHADER(simpleColor, windowBase, WindowBaseShader);
+
+	ShaderBase::init();
+
+	GET_U(tone);
+	GET_U(backOpacity);
+	GET_U(layerStep);
+}
+
+void WindowBaseShader::setTone(const Vec4 &value)
+{
+	setVec4Uniform(u_tone, value);
+}
+
+void WindowBaseShader::setBackOpacity(float value)
+{
+	gl.Uniform1f(u_backOpacity, value);
+}
+
+void WindowBaseShader::setLayerStep(const Vec2 &value)
+{
+	setVec2Uniform(u_layerStep, value);
+}
+
 
 GrayShader::GrayShader()
 {
@@ -604,6 +876,18 @@ TilemapShader::TilemapShader()
 {
 	INIT_SHADER(tilemap, tilemap, TilemapShader);
 
+	initUniforms();
+}
+
+TilemapShader::TilemapShader(const char *defines)
+{
+	INIT_SHADER_DEFS(tilemap, tilemap, TilemapShader, defines);
+
+	initUniforms();
+}
+
+void TilemapShader::initUniforms()
+{
 	ShaderBase::init();
 
 	GET_U(tone);
@@ -640,10 +924,96 @@ void TilemapShader::setATFrames(int values[7])
 }
 
 
+TilemapDepthShader::TilemapDepthShader()
+    : TilemapShader("#define TILEMAP_DEPTH\n")
+{
+	GET_U(depthStep);
+	GET_U(alphaPass);
+}
+
+void TilemapDepthShader::setDepthStep(float value)
+{
+	gl.Uniform1f(u_depthStep, value);
+}
+
+void TilemapDepthShader::setAlphaPass(AlphaPass value)
+{
+	gl.Uniform1i(u_alphaPass, value);
+}
+
+
+TilemapGroundShader::TilemapGroundShader()
+{
+	INIT_SHADER(simple, tilemapGround, TilemapGroundShader);
+
+	ShaderBase::init();
+
+	GET_U(mapData);
+	GET_U(tileLookup);
+	GET_U(atlasSizeInv);
+	GET_U(mapSize);
+	GET_U(mapTexSizeInv);
+	GET_U(lookupSize);
+	GET_U(layers);
+
+	GET_U(tone);
+	GET_U(color);
+	GET_U(opacity);
+
+	GET_U(aniIndex);
+	GET_U(atFrames);
+}
+
+void TilemapGroundShader::setAtlasSize(const Vec2i &value)
+{
+	gl.Uniform2f(u_atlasSizeInv, 1.f / value.x, 1.f / value.y);
+}
+
+void TilemapGroundShader::setMapData(TEX::ID value, const Vec2i &texSize,
+                                     const Vec2i &mapSize, int layers)
+{
+	setTexUniform(u_mapData, 1, value);
+	gl.Uniform2f(u_mapTexSizeInv, 1.f / texSize.x, 1.f / texSize.y);
+	gl.Uniform2f(u_mapSize, mapSize.x, mapSize.y);
+	gl.Uniform1f(u_layers, layers);
+}
+
+void TilemapGroundShader::setTileLookup(TEX::ID value, const Vec2i &size)
+{
+	setTexUniform(u_tileLookup, 2, value);
+	gl.Uniform2f(u_lookupSize, size.x, size.y);
+}
+
+void TilemapGroundShader::setTone(const Vec4 &tone)
+{
+	setVec4Uniform(u_tone, tone);
+}
+
+void TilemapGroundShader::setColor(const Vec4 &color)
+{
+	setVec4Uniform(u_color, color);
+}
+
+void TilemapGroundShader::setOpacity(float value)
+{
+	gl.Uniform1f(u_opacity, value);
+}
+
+void TilemapGroundShader::setAniIndex(int value)
+{
+	gl.Uniform1i(u_aniIndex, value);
+}
+
+void TilemapGroundShader::setATFrames(int values[7])
+{
+	gl.Uniform1iv(u_atFrames, 7, values);
+}
+
+
 
 FlashMapShader::FlashMapShader()
 {
-	INIT_SHADER(simpleColor, flashMap, FlashMapShader);
+	INIT_SHADER(simple, flashMap, FlashMapShader);
 
 	ShaderBase::init();
 
@@ -671,6 +1041,27 @@ void HueShader::setHueAdjust(float value)
 }
 
 
+YUVShader::YUVShader()
+{
+	INIT_SHADER(simple, yuv, YUVShader);
+
+	ShaderBase::init();
+
+	GET_U(texU);
+	GET_U(texV);
+}
+
+void YUVShader::setTexU(TEX::ID tex)
+{
+	setTexUniform(u_texU, 1, tex);
+}
+
+void YUVShader::setTexV(TEX::ID tex)
+{
+	setTexUniform(u_texV, 2, tex);
+}
+
+
 SimpleMatrixShader::SimpleMatrixShader()
 {
 	INIT_SHADER(simpleMatrix, simpleAlpha, SimpleMatrixShader);
@@ -701,6 +1092,67 @@ BlurShader::VPass::VPass()
 }
 
 
+GaussianBlurShader::GaussianBlurShader()
+{
+	INIT_SHADER(simple, gaussianBlur, GaussianBlurShader);
+
+	ShaderBase::init();
+
+	GET_U(direction);
+	GET_U(sigma);
+	GET_U(taps);
+	GET_U(norm);
+}
+
+void GaussianBlurShader::setDirection(const Vec2 &value)
+{
+	gl.Uniform2f(u_direction, value.x, value.y);
+}
+
+void GaussianBlurShader::setRadius(int radius)
+{
+	const float sigma = radius / 2.0f;
+	const int taps = (radius + 1) / 2;
+
+	/* Must match the weights summed up by the shader */
+	float total = 1;
+
+	for (int k = 1; k <= taps * 2; ++k)
+		total += 2 * expf(-(k * k) / (2 * sigma * sigma));
+
+	gl.Uniform1f(u_sigma, sigma);
+	gl.Uniform1i(u_taps, taps);
+	gl.Uniform1f(u_norm, 1 / total);
+}
+
+
+RadialBlurShader::RadialBlurShader()
+{
+	INIT_SHADER(simple, radialBlur, RadialBlurShader);
+
+	ShaderBase::init();
+
+	GET_U(imageSize);
+	GET_U(rotStart);
+	GET_U(rotStep);
+	GET_U(divisions);
+}
+
+void RadialBlurShader::setImageSize(const Vec2i &value)
+{
+	gl.Uniform2f(u_imageSize, value.x, value.y);
+}
+
+void RadialBlurShader::setRotation(float baseAngle, float angleStep, int divisions)
+{
+	const float toRad = 3.14159265f / 180;
+
+	gl.Uniform2f(u_rotStart, cosf(baseAngle * toRad), sinf(baseAngle * toRad));
+	gl.Uniform2f(u_rotStep, cosf(angleStep * toRad), sinf(angleStep * toRad));
+	gl.Uniform1i(u_divisions, divisions);
+}
+
+
 TilemapVXShader::TilemapVXShader()
 {
 	INIT_SHADER(tilemapvx, simple, TilemapVXShader);
@@ -756,6 +1208,7 @@ Lanczos3Shader::Lanczos3Shader()
 
 	GET_U(texOffsetX);
 	GET_U(sourceSize);
+	GET_U(direction);
 }
 
 void Lanczos3Shader::setTexSize(const Vec2i &value)
@@ -763,3 +1216,398 @@ void Lanczos3Shader::setTexSize(const Vec2i &value)
 	ShaderBase::setTexSize(value);
 	gl.Uniform2f(u_sourceSize, (float)value.x, (float)value.y);
 }
+
+void Lanczos3Shader::setVertical(bool value)
+{
+	gl.Uniform2f(u_direction, value ? 0.f : 1.f, value ? 1.f : 0.f);
+}
+
+SharpScaleShader::SharpScaleShader()
+{
+	INIT_SHADER(simple, sharpScale, SharpScaleShader);
+
+	ShaderBase::init();
+
+	GET_U(sourceSize);
+	GET_U(scale);
+}
+
+void SharpScaleShader::setTexSize(const Vec2i &value)
+{
+	ShaderBase::setTexSize(value);
+	gl.Uniform2f(u_sourceSize, (float)value.x, (float)value.y);
+}
+
+void SharpScaleShader::setScale(const Vec2i &value)
+{
+	gl.Uniform2f(u_scale, (float)value.x, (float)value.y);
+}
+
+
+ScreenEffectsShader::ScreenEffectsShader()
+{
+	INIT_SHADER(simple, screenEffects, ScreenEffectsShader);
+
+	ShaderBase::init();
+
+	GET_U(tone);
+	GET_U(color);
+	GET_U(flash);
+	GET_U(brightness);
+}
+
+void ScreenEffectsShader::setTone(const Vec4 &value)
+{
+	setVec4Uniform(u_tone, value);
+}
+
+void ScreenEffectsShader::setColor(const Vec4 &value)
+{
+	setVec4Uniform(u_color, value);
+}
+
+void ScreenEffectsShader::setFlash(const Vec4 &value)
+{
+	setVec4Uniform(u_flash, value);
+}
+
+void ScreenEffectsShader::setBrightness(float value)
+{
+	gl.Uniform1f(u_brightness, value);
+}
+
+
+SdfTextShader::SdfTextShader()
+{
+	INIT_SHADER(simpleMatrix, sdfText, SdfTextShader);
+
+	ShaderBase::init();
+
+	GET_U(matrix);
+	GET_U(color);
+	GET_U(outColor);
+	GET_U(opacity);
+	GET_U(smoothing);
+	GET_U(outlineEdge);
+}
+
+void SdfTextShader::setMatrix(const float value[16])
+{
+	gl.UniformMatrix4fv(u_matrix, 1, GL_FALSE, value);
+}
+
+void SdfTextShader::setColor(const Vec4 &value)
+{
+	setVec4Uniform(u_color, value);
+}
+
+void SdfTextShader::setOutColor(const Vec4 &value)
+{
+	setVec4Uniform(u_outColor, value);
+}
+
+void SdfTextShader::setOpacity(float value)
+{
+	gl.Uniform1f(u_opacity, value);
+}
+
+void SdfTextShader::setSmoothing(float value)
+{
+	gl.Uniform1f(u_smoothing, value);
+}
+
+void SdfTextShader::setOutlineEdge(float value)
+{
+	gl.Uniform1f(u_outlineEdge, value);
+}
+
+#define PROGRAM_CACHE_MAGIC "mkxpPGB2"
+
+ProgramCache *ProgramCache::current = 0;
+
+static uint64_t fnvFeed(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t*) data;
+
+	for (size_t i = 0; i < len; ++i)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+
+	/* Separator, so "ab"+"c" differs from "a"+"bc" */
+	h ^= 0xFF;
+	h *= 1099511628211ULL;
+
+	return h;
+}
+
+ProgramCache::ProgramCache(const Config &conf)
+    : driverHash(14695981039346656037ULL),
+      dirty(false)
+{
+	if (!conf.shaderCache || conf.customDataPath.empty() || !gl.program_binary)
+		return;
+
+	/* Binaries are only valid for the driver that produced them */
+	static const GLenum driverStrings[] =
+	{
+		GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(driverStrings); ++i)
+	{
+		const char *str = (const char*) gl.GetString(driverStrings[i]);
+
+		if (str)
+			driverHash = fnvFeed(driverHash, str, strlen(str));
+	}
+
+	file = conf.customDataPath + "/shadercache.bin";
+	current = this;
+
+	SDL_RWops *ops = SDL_RWFromFile(file.c_str(), "rb");
+
+	if (!ops)
+		return;
+
+	char magic[sizeof(PROGRAM_CACHE_MAGIC) - 1];
+
+	if (SDL_RWread(ops, magic, sizeof(magic), 1) != 1 ||
+	    memcmp(magic, PROGRAM_CACHE_MAGIC, sizeof(magic)) ||
+	    SDL_ReadLE64(ops) != driverHash)
+	{
+		SDL_RWclose(ops);
+		return;
+	}
+
+	uint32_t count = SDL_ReadLE32(ops);
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint64_t key = SDL_ReadLE64(ops);
+
+		Entry entry;
+		entry.format = SDL_ReadLE32(ops);
+		uint32_t size = SDL_ReadLE32(ops);
+
+		entry.data.resize(size);
+
+		if (size == 0 || SDL_RWread(ops, &entry.data[0], size, 1) != 1)
+			break;
+
+		entries.insert(key, entry);
+	}
+
+	SDL_RWclose(ops);
+}
+
+ProgramCache::~ProgramCache()
+{
+	save();
+
+	if (current == this)
+		current = 0;
+}
+
+uint64_t ProgramCache::keyFor(const unsigned char *vert, int vertSize,
+                              const unsigned char *frag, int fragSize,
+                              const char *defines) const
+{
+	const GLchar *common;
+	GLint commonSize;
+	commonSource(common, commonSize);
+
+	uint64_t h = driverHash;
+
+	h = fnvFeed(h, &gl.glsles, sizeof(gl.glsles));
+	h = fnvFeed(h, common, commonSize);
+	h = fnvFeed(h, vert, vertSize);
+	h = fnvFeed(h, frag, fragSize);
+
+	if (defines)
+		h = fnvFeed(h, defines, strlen(defines));
+
+	return h;
+}
+
+bool ProgramCache::restore(uint64_t key, GLuint program)
+{
+	if (!entries.contains(key))
+		return false;
+
+	Entry entry = entries.value(key);
+
+	gl.ProgramBinary(program, entry.format, entry.data.data(), entry.data.size());
+
+	GLint success;
+	gl.GetProgramiv(program, GL_LINK_STATUS, &success);
+
+	/* The driver rejected it (eg. after an update that kept the
+	 * version string), compile from source and store again */
+	return success;
+}
+
+void ProgramCache::store(uint64_t key, GLuint program)
+{
+	GLint size = 0;
+	gl.GetProgramiv(program, _GL_PROGRAM_BINARY_LENGTH, &size);
+
+	if (size <= 0)
+		return;
+
+	Entry entry;
+	entry.data.resize(size);
+
+	GLsizei length = 0;
+	gl.GetProgramBinary(program, size, &length, &entry.format, &entry.data[0]);
+
+	if (length <= 0)
+		return;
+
+	entry.data.resize(length);
+
+	entries.insert(key, entry);
+	dirty = true;
+}
+
+void ProgramCache::save()
+{
+	if (file.empty() || !dirty)
+		return;
+
+	SDL_RWops *ops = SDL_RWFromFile(file.c_str(), "wb");
+
+	if (!ops)
+		return;
+
+	SDL_RWwrite(ops, PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC) - 1, 1);
+	SDL_WriteLE64(ops, driverHash);
+	SDL_WriteLE32(ops, entries.size());
+
+	for (BoostHash<uint64_t, Entry>::const_iterator iter = entries.cbegin();
+	     iter != entries.cend(); ++iter)
+	{
+		SDL_WriteLE64(ops, iter->first);
+		SDL_WriteLE32(ops, iter->second.format);
+		SDL_WriteLE32(ops, iter->second.data.size());
+		SDL_RWwrite(ops, iter->second.data.data(), 1, iter->second.data.size());
+	}
+
+	SDL_RWclose(ops);
+
+	dirty = false;
+}
+
+#define SHADER_SET_ENTRIES \
+	ENTRY(flatColor) ENTRY(simple) ENTRY(simpleColor) ENTRY(simpleAlpha) \
+	ENTRY(simpleAlphaUni) ENTRY(particle) ENTRY(simpleSprite) ENTRY(alphaSprite) ENTRY(sprite) \
+	ENTRY(plane) ENTRY(windowBg) ENTRY(windowBase) ENTRY(gray) ENTRY(tilemap) ENTRY(tilemapDepth) \
+	ENTRY(tilemapGround) ENTRY(flashMap) ENTRY(trans) ENTRY(simpleTrans) \
+	ENTRY(hue) ENTRY(yuv) ENTRY(blt) ENTRY(simpleMatrix) ENTRY(blur) \
+	ENTRY(gaussianBlur) ENTRY(radialBlur) ENTRY(tilemapVX) ENTRY(lanczos3) \
+	ENTRY(sharpScale) ENTRY(screenEffects) ENTRY(sdfText)
+
+ShaderSet::ShaderSet(const Config &conf)
+    : programCache(conf)
+{
+	for (size_t i = 0; i < SpriteShader::VariantCount; ++i)
+		spriteVariants[i] = 0;
+
+	/* Everything known to be needed is queued before
+	 * the first link result is asked for */
+	Shader::deferLinks = gl.parallel_compile;
+
+	/* Used by nearly every frame */
+	simple.submit();
+	sprite.submit();
+	tilemap.submit();
+
+	if (conf.tilemapDepth)
+		tilemapDepth.submit();
+
+	/* Taken from the back, so the list is walked in order */
+	for (size_t i = conf.shaderPrewarm.size(); i-- > 0;)
+	{
+		LazyShaderBase *shader = find(conf.shaderPrewarm[i]);
+
+		if (shader)
+			prewarm.push_back(shader);
+		else
+			Debug() << "Unknown shader in shaderPrewarm:" << conf.shaderPrewarm[i];
+	}
+
+	if (Shader::deferLinks)
+		for (size_t i = prewarm.size(); i-- > 0;)
+			prewarm[i]->submit();
+
+	Shader::deferLinks = false;
+
+	simple.build();
+	sprite.build();
+	tilemap.build();
+
+	if (conf.tilemapDepth)
+		tilemapDepth.build();
+
+	/* Get the startup programs on disk right away */
+	programCache.save();
+}
+
+ShaderSet::~ShaderSet()
+{
+	for (size_t i = 0; i < SpriteShader::VariantCount; ++i)
+		delete spriteVariants[i];
+}
+
+SpriteShader &ShaderSet::spriteVariant(unsigned features)
+{
+	if (features == SpriteShader::AllFeatures)
+		return sprite;
+
+	SpriteShader *&shader = spriteVariants[features];
+
+	if (!shader)
+		shader = new SpriteShader(features);
+
+	return *shader;
+}
+
+void ShaderSet::prewarmStep()
+{
+	while (!prewarm.empty())
+	{
+		LazyShaderBase *shader = prewarm.back();
+
+		/* Submitted at startup; finishing it only blocks
+		 * if the driver isn't done linking yet */
+		if (shader->isSubmitted() && !shader->isBuilt())
+		{
+			if (!shader->linkDone())
+				return;
+
+			prewarm.pop_back();
+			shader->build();
+
+			continue;
+		}
+
+		prewarm.pop_back();
+
+		if (shader->isBuilt())
+			continue;
+
+		shader->build();
+
+		return;
+	}
+}
+
+LazyShaderBase *ShaderSet::find(const std::string &name)
+{
+#define ENTRY(n) if (name == #n) return &n;
+	SHADER_SET_ENTRIES
+#undef ENTRY
+
+	return 0;
+}
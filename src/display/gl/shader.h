@@ -25,6 +25,13 @@
 #include "etc-internal.h"
 #include "gl-util.h"
 #include "glstate.h"
+#include "boost-hash.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+struct Config;
 
 class Shader
 {
@@ -41,25 +48,52 @@ public:
     
     static std::string &commonHeader();
 
+	/* Checks the outcome of a deferred link, waiting for it if
+	 * needed, and looks up the uniforms; does nothing otherwise */
+	void finishLink();
+
+	/* Doesn't block; true once finishLink() won't have to wait */
+	bool linkDone();
+
+	bool linkPending() const { return deferred.pending; }
+
+	/* While set, new shaders only submit their compile and link,
+	 * to be finished later (needs parallel_compile). Compiles
+	 * can then run on the driver's threads side by side */
+	static bool deferLinks;
+
 protected:
 	Shader();
 	~Shader();
 
+    /* 'defines' is prepended to both stages, if given */
     void init(const unsigned char *vert, int vertSize,
               const unsigned char *frag, int fragSize,
 	          const char *vertName, const char *fragName,
-	          const char *programName);
+	          const char *programName, const char *defines = 0);
 	void initFromFile(const char *vertFile, const char *fragFile,
 	                  const char *programName);
+	void link(bool retrievable);
 
 	static void setVec4Uniform(GLint location, const Vec4 &vec);
     static void setVec2Uniform(GLint location, const Vec2 &vec);
 	static void setTexUniform(GLint location, unsigned unitIndex, TEX::ID texture);
 
+	/* Postponed until finishLink() while a link is deferred */
+	void lookupUniform(GLint &location, const char *name);
+
 	GLuint vertShader, fragShader;
 	GLuint program;
     
 private:
+	struct
+	{
+		bool pending;
+		uint64_t cacheKey;
+		std::string vertName, fragName, programName;
+		std::vector<std::pair<GLint*, const char*> > uniforms;
+	} deferred;
+
 #ifdef MKXPZ_BUILD_XCODE
     static std::string shaderCommon;
 #endif
@@ -129,6 +163,25 @@ public:
 	SimpleAlphaShader();
 };
 
+/* Like SimpleAlphaShader, with the alpha taken from a
+ * uniform instead of the vertices */
+class SimpleAlphaUniShader : public ShaderBase
+{
+public:
+	SimpleAlphaUniShader();
+
+	void setAlpha(float value);
+
+private:
+	GLint u_alpha;
+};
+
+class ParticleShader : public ShaderBase
+{
+public:
+	ParticleShader();
+};
+
 class SimpleSpriteShader : public ShaderBase
 {
 public:
@@ -183,7 +236,22 @@ private:
 class SpriteShader : public ShaderBase
 {
 public:
-	SpriteShader();
+	/* Effects compiled into a variant. Setters of
+	 * effects left out have no effect */
+	enum Features
+	{
+		Tone    = 1 << 0,
+		Color   = 1 << 1, /* Also flash */
+		Bush    = 1 << 2,
+		Pattern = 1 << 3,
+		Invert  = 1 << 4,
+		Hue     = 1 << 5,
+
+		AllFeatures  = (1 << 6) - 1,
+		VariantCount = AllFeatures + 1
+	};
+
+	SpriteShader(unsigned features = AllFeatures);
 
 	void setSpriteMat(const float value[16]);
 	void setTone(const Vec4 &value);
@@ -199,10 +267,14 @@ public:
     void setPatternScroll(const Vec2 &scroll);
     void setPatternZoom(const Vec2 &zoom);
     void setInvert(bool value);
+    void setHueAdjust(float value);
+    /* 'amp' of 0 disables the wave */
+    void setWave(float amp, float phase, float length);
 
 private:
 	GLint u_spriteMat, u_tone, u_opacity, u_color, u_bushDepth, u_bushOpacity, u_pattern, u_renderPattern,
-    u_patternBlendType, u_patternSizeInv, u_patternTile, u_patternOpacity, u_patternScroll, u_patternZoom, u_invert;
+    u_patternBlendType, u_patternSizeInv, u_patternTile, u_patternOpacity, u_patternScroll, u_patternZoom, u_invert,
+    u_hueAdjust, u_waveAmp, u_wavePhase, u_waveFreq;
 };
 
 class PlaneShader : public ShaderBase
@@ -214,9 +286,42 @@ public:
 	void setColor(const Vec4 &value);
 	void setFlash(const Vec4 &value);
 	void setOpacity(float value);
+	void setWrap(bool value);
 
 private:
-	GLint u_tone, u_color, u_flash, u_opacity;
+	GLint u_tone, u_color, u_flash, u_opacity, u_wrap;
+};
+
+/* Draws the stretched and tiled background layers
+ * of a VX windowskin in one pass */
+class WindowBgShader : public ShaderBase
+{
+public:
+	WindowBgShader();
+
+	void setTone(const Vec4 &value);
+	void setOpacity(float value);
+	void setTileSrc(const IntRect &value);
+	void setSkinSize(const Vec2i &value);
+	void setBgOrigin(const Vec2i &value);
+
+private:
+	GLint u_tone, u_opacity, u_tileSrc, u_skinSize, u_bgOrigin;
+};
+
+/* Draws a WindowVX base texture, see windowBase.frag */
+class WindowBaseShader : public ShaderBase
+{
+public:
+	WindowBaseShader();
+
+	void setTone(const Vec4 &value);
+	void setBackOpacity(float value);
+	/* In normalized texture coordinates */
+	void setLayerStep(const Vec2 &value);
+
+private:
+	GLint u_tone, u_backOpacity, u_layerStep;
 };
 
 class GrayShader : public ShaderBase
@@ -243,7 +348,60 @@ public:
 
 	void setATFrames(int values[7]);
 
+protected:
+	TilemapShader(const char *defines);
+
+private:
+	void initUniforms();
+
+	GLint u_aniIndex, u_tone, u_color, u_opacity, u_atFrames;
+};
+
+/* Writes each zlayer at its own depth, with the zlayer index
+ * taken from the vertex positions (see 'tilemapDepth') */
+class TilemapDepthShader : public TilemapShader
+{
+public:
+	enum AlphaPass
+	{
+		AllTexels,
+		OpaqueTexels,
+		TranslucentTexels
+	};
+
+	TilemapDepthShader();
+
+	void setDepthStep(float value);
+	void setAlphaPass(AlphaPass value);
+
+private:
+	GLint u_depthStep, u_alphaPass;
+};
+
+/* Draws the ground layer of a Tilemap as one quad,
+ * looking up tiles from the map data per fragment */
+class TilemapGroundShader : public ShaderBase
+{
+public:
+	TilemapGroundShader();
+
+	void setAtlasSize(const Vec2i &value);
+	/* Bound to texture units 1 and 2 */
+	void setMapData(TEX::ID value, const Vec2i &texSize,
+	                const Vec2i &mapSize, int layers);
+	void setTileLookup(TEX::ID value, const Vec2i &size);
+
+	void setAniIndex(int value);
+
+	void setTone(const Vec4 &value);
+	void setColor(const Vec4 &value);
+	void setOpacity(float value);
+
+	void setATFrames(int values[7]);
+
 private:
+	GLint u_mapData, u_tileLookup, u_atlasSizeInv, u_mapSize,
+	      u_mapTexSizeInv, u_lookupSize, u_layers;
 	GLint u_aniIndex, u_tone, u_color, u_opacity, u_atFrames;
 };
 
@@ -269,6 +427,19 @@ private:
 	GLint u_hueAdjust;
 };
 
+class YUVShader : public ShaderBase
+{
+public:
+	YUVShader();
+
+	/* The Y plane is bound as the regular texture */
+	void setTexU(TEX::ID tex);
+	void setTexV(TEX::ID tex);
+
+private:
+	GLint u_texU, u_texV;
+};
+
 class SimpleMatrixShader : public ShaderBase
 {
 public:
@@ -299,6 +470,39 @@ struct BlurShader
 	VPass pass2;
 };
 
+/* Separable gaussian blur of arbitrary radius, drawn
+ * once per direction */
+class GaussianBlurShader : public ShaderBase
+{
+public:
+	/* Radii above this are clamped */
+	enum { MaxRadius = 32 };
+
+	GaussianBlurShader();
+
+	/* One texel along the blur direction,
+	 * in texture coordinates */
+	void setDirection(const Vec2 &value);
+	void setRadius(int radius);
+
+private:
+	GLint u_direction, u_sigma, u_taps, u_norm;
+};
+
+/* Single pass radial blur */
+class RadialBlurShader : public ShaderBase
+{
+public:
+	RadialBlurShader();
+
+	void setImageSize(const Vec2i &value);
+	/* Angles in degrees */
+	void setRotation(float baseAngle, float angleStep, int divisions);
+
+private:
+	GLint u_imageSize, u_rotStart, u_rotStep, u_divisions;
+};
+
 class TilemapVXShader : public ShaderBase
 {
 public:
@@ -326,39 +530,246 @@ private:
 	GLint u_source, u_destination, u_subRect, u_opacity;
 };
 
+/* One direction of the separable Lanczos3 upscale */
 class Lanczos3Shader : public SimpleShader
 {
 public:
 	Lanczos3Shader();
 
 	void setTexSize(const Vec2i &value);
+	void setVertical(bool value);
 
 protected:
-	GLint u_sourceSize;
+	GLint u_sourceSize, u_direction;
+};
+
+/* Integer upscale followed by linear last-mile scaling */
+class SharpScaleShader : public ShaderBase
+{
+public:
+	SharpScaleShader();
+
+	void setTexSize(const Vec2i &value);
+	/* The integer upscaling factor */
+	void setScale(const Vec2i &value);
+
+private:
+	GLint u_sourceSize, u_scale;
 };
 
-/* Global object containing all available shaders */
+/* Whole-screen viewport effects and brightness, applied
+ * while presenting the screen (see ScreenScene) */
+class ScreenEffectsShader : public ShaderBase
+{
+public:
+	ScreenEffectsShader();
+
+	void setTone(const Vec4 &value);
+	void setColor(const Vec4 &value);
+	void setFlash(const Vec4 &value);
+	void setBrightness(float value);
+
+private:
+	GLint u_tone, u_color, u_flash, u_brightness;
+};
+
+/* Text from a distance field glyph atlas, placed
+ * by a sprite style matrix (see TextSprite) */
+class SdfTextShader : public ShaderBase
+{
+public:
+	SdfTextShader();
+
+	void setMatrix(const float value[16]);
+	void setColor(const Vec4 &value);
+	void setOutColor(const Vec4 &value);
+	void setOpacity(float value);
+	void setSmoothing(float value);
+	void setOutlineEdge(float value);
+
+private:
+	GLint u_matrix, u_color, u_outColor, u_opacity,
+	      u_smoothing, u_outlineEdge;
+};
+
+/* Linked program binaries, kept in the user data directory so
+ * later launches can skip compiling the shaders. Entries are keyed
+ * by a hash of the program's sources; the whole cache is dropped
+ * once the driver strings change */
+class ProgramCache
+{
+public:
+	ProgramCache(const Config &conf);
+	~ProgramCache();
+
+	uint64_t keyFor(const unsigned char *vert, int vertSize,
+	                const unsigned char *frag, int fragSize,
+	                const char *defines) const;
+
+	/* Loads the binary stored under 'key' into 'program',
+	 * returns false if there is none or it doesn't link */
+	bool restore(uint64_t key, GLuint program);
+
+	/* Stores the binary of the freshly linked 'program' */
+	void store(uint64_t key, GLuint program);
+
+	/* Writes out the cache if programs were added */
+	void save();
+
+	/* The cache of the shader set, or null */
+	static ProgramCache *current;
+
+private:
+	struct Entry
+	{
+		GLenum format;
+		std::string data;
+	};
+
+	std::string file;
+	uint64_t driverHash;
+
+	BoostHash<uint64_t, Entry> entries;
+
+	bool dirty;
+};
+
+/* Compiles its shader the first time it is retrieved */
+class LazyShaderBase
+{
+public:
+	virtual ~LazyShaderBase() {}
+
+	virtual void build() = 0;
+	virtual bool isBuilt() const = 0;
+
+	/* Creates the shader without waiting for its link
+	 * if Shader::deferLinks is set; build() finishes it */
+	virtual void submit() = 0;
+	virtual bool isSubmitted() const = 0;
+	virtual bool linkDone() = 0;
+};
+
+template<class S>
+class LazyShader : public LazyShaderBase
+{
+public:
+	LazyShader()
+	    : shader(0)
+	{}
+
+	~LazyShader()
+	{
+		delete shader;
+	}
+
+	S &get()
+	{
+		submit();
+		shader->finishLink();
+
+		return *shader;
+	}
+
+	operator S&()
+	{
+		return get();
+	}
+
+	void build()
+	{
+		get();
+	}
+
+	bool isBuilt() const
+	{
+		return shader && !shader->linkPending();
+	}
+
+	void submit()
+	{
+		if (!shader)
+			shader = new S;
+	}
+
+	bool isSubmitted() const
+	{
+		return shader != 0;
+	}
+
+	bool linkDone()
+	{
+		return !shader || shader->linkDone();
+	}
+
+private:
+	LazyShader(const LazyShader &);
+	LazyShader &operator=(const LazyShader &);
+
+	S *shader;
+};
+
+/* Global object containing all available shaders. Only the ones
+ * needed for nearly every frame are compiled up front, the rest
+ * when first used or, if listed in the config, one per frame
+ * during the first updates. With parallel_compile, the listed
+ * ones are submitted at startup along with the others and picked
+ * up as the driver finishes them */
 struct ShaderSet
 {
-	FlatColorShader flatColor;
-	SimpleShader simple;
-	SimpleColorShader simpleColor;
-	SimpleAlphaShader simpleAlpha;
-	SimpleSpriteShader simpleSprite;
-	AlphaSpriteShader alphaSprite;
-	SpriteShader sprite;
-	PlaneShader plane;
-	GrayShader gray;
-	TilemapShader tilemap;
-	FlashMapShader flashMap;
-	TransShader trans;
-	SimpleTransShader simpleTrans;
-	HueShader hue;
-	BltShader blt;
-	SimpleMatrixShader simpleMatrix;
-	BlurShader blur;
-	TilemapVXShader tilemapVX;
-	Lanczos3Shader lanczos3;
+	ShaderSet(const Config &conf);
+	~ShaderSet();
+
+	/* Compiles the next shader waiting to be pre-warmed, or
+	 * finishes those submitted whose link is done */
+	void prewarmStep();
+
+	/* Constructed first and destroyed last, so the shaders below
+	 * can use it; programs built after startup are saved then */
+	ProgramCache programCache;
+
+	LazyShader<FlatColorShader> flatColor;
+	LazyShader<SimpleShader> simple;
+	LazyShader<SimpleColorShader> simpleColor;
+	LazyShader<SimpleAlphaShader> simpleAlpha;
+	LazyShader<SimpleAlphaUniShader> simpleAlphaUni;
+	LazyShader<ParticleShader> particle;
+	LazyShader<SimpleSpriteShader> simpleSprite;
+	LazyShader<AlphaSpriteShader> alphaSprite;
+	LazyShader<SpriteShader> sprite;
+	LazyShader<PlaneShader> plane;
+	LazyShader<WindowBgShader> windowBg;
+	LazyShader<WindowBaseShader> windowBase;
+	LazyShader<GrayShader> gray;
+	LazyShader<TilemapShader> tilemap;
+	LazyShader<TilemapDepthShader> tilemapDepth;
+	LazyShader<TilemapGroundShader> tilemapGround;
+	LazyShader<FlashMapShader> flashMap;
+	LazyShader<TransShader> trans;
+	LazyShader<SimpleTransShader> simpleTrans;
+	LazyShader<HueShader> hue;
+	LazyShader<YUVShader> yuv;
+	LazyShader<BltShader> blt;
+	LazyShader<SimpleMatrixShader> simpleMatrix;
+	LazyShader<BlurShader> blur;
+	LazyShader<GaussianBlurShader> gaussianBlur;
+	LazyShader<RadialBlurShader> radialBlur;
+	LazyShader<TilemapVXShader> tilemapVX;
+	LazyShader<Lanczos3Shader> lanczos3;
+	LazyShader<SharpScaleShader> sharpScale;
+	LazyShader<ScreenEffectsShader> screenEffects;
+	LazyShader<SdfTextShader> sdfText;
+
+	/* The sprite shader with only the effects in 'features'
+	 * (see SpriteShader::Features), built on first use */
+	SpriteShader &spriteVariant(unsigned features);
+
+private:
+	LazyShaderBase *find(const std::string &name);
+
+	SpriteShader *spriteVariants[SpriteShader::VariantCount];
+
+	std::vector<LazyShaderBase*> prewarm;
 };
 
 #endif // SHADER_H
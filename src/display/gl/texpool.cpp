@@ -28,6 +28,7 @@
 
 #include <list>
 #include <utility>
+#include <vector>
 #include <assert.h>
 #include <string.h>
 
@@ -51,7 +52,89 @@ struct CacheNode
 
 typedef std::list<CacheNode> CNodeList;
 
-struct TexPoolPrivate
+/* Atlas pages are filled using simple shelf packing. Freed
+ * regions aren't reused individually; instead a page is reset
+ * as a whole once its last region is released */
+#define ATLAS_PAGE_SIZE 1024
+#define ATLAS_MAX_ITEM 256
+/* Empty border kept around each region */
+#define ATLAS_PADDING 1
+
+struct AtlasShelf
+{
+	int y, height;
+	/* Next free x coordinate */
+	int x;
+};
+
+struct AtlasPage
+{
+	TEXFBO tex;
+	std::vector<AtlasShelf> shelves;
+	/* Bottom of the last shelf */
+	int shelfEnd;
+	int liveCount;
+
+	bool alloc(int w, int h, IntRect &out)
+	{
+		const int pw = w + ATLAS_PADDING*2;
+		const int ph = h + ATLAS_PADDING*2;
+
+		/* Pick the tightest fitting shelf */
+		AtlasShelf *best = 0;
+
+		for (size_t i = 0; i < shelves.size(); ++i)
+		{
+			AtlasShelf &s = shelves[i];
+
+			if (s.height < ph || s.x + pw > tex.width)
+				continue;
+
+			if (!best || s.height < best->height)
+				best = &s;
+		}
+
+		if (!best)
+		{
+			if (shelfEnd + ph > tex.height)
+				return false;
+
+			AtlasShelf s = { shelfEnd, ph, 0 };
+			shelves.push_back(s);
+			shelfEnd += ph;
+
+			best = &shelves.back();
+		}
+
+		out = IntRect(best->x + ATLAS_PADDING, best->y + ATLAS_PADDING, w, h);
+		best->x += pw;
+		++liveCount;
+
+		return true;
+	}
+
+	/* Keeps padding transparent */
+	void clear()
+	{
+		FBO::bind(tex.fbo);
+		glState.clearColor.pushSet(Vec4());
+		FBO::clear();
+		glState.clearColor.pop();
+	}
+
+	void free()
+	{
+		if (--liveCount > 0)
+			return;
+
+		shelves.clear();
+		shelfEnd = 0;
+		clear();
+	}
+};
+
+/* Cached objects of one category */
+struct TexCache
 {
 	/* Contains all cached TexFBOs, grouped by size */
 	BoostHash<Size, CNodeList> poolHash;
@@ -59,24 +142,119 @@ struct TexPoolPrivate
 	/* Contains all cached TexFBOs, sorted by release time */
 	std::list<TEXFBO> priorityQueue;
 
-	/* Maximal allowed cache memory */
-	const uint32_t maxMemSize;
-
-	/* Current amound of memory consumed by the cache */
-	uint32_t memSize;
-
 	/* Current amount of TexFBOs cached */
 	uint16_t objCount;
 
+	/* 'cachedBytes' is the current amount of memory consumed
+	 * by the cache, 'budget' the maximal allowed amount */
+	TexPool::Stats stats;
+
+	TexCache()
+	    : objCount(0)
+	{
+		memset(&stats, 0, sizeof(stats));
+	}
+
+	bool take(Size size, TEXFBO &out)
+	{
+		CNodeList &bucket = poolHash[size];
+
+		if (bucket.empty())
+			return false;
+
+		CacheNode cnode = bucket.back();
+		bucket.pop_back();
+
+		priorityQueue.erase(cnode.prioIter);
+
+		stats.cachedBytes -= byteCount(size);
+		--objCount;
+
+		out = cnode.obj;
+
+		return true;
+	}
+
+	/* Deletes the least recently released object */
+	void evictOne()
+	{
+		CacheNode last;
+		last.obj = priorityQueue.back();
+		Size removedSize(last.obj.width, last.obj.height);
+
+		CNodeList &bucket = poolHash[removedSize];
+
+		std::list<CacheNode>::iterator toRemove =
+		        std::find(bucket.begin(), bucket.end(), last);
+		assert(toRemove != bucket.end());
+		bucket.erase(toRemove);
+
+		priorityQueue.pop_back();
+
+		TEXFBO::fini(last.obj);
+
+		stats.cachedBytes -= byteCount(removedSize);
+		--objCount;
+		++stats.evictions;
+
+//		Debug() << "TexPool: <!-> (" << last.obj.width << last.obj.height << ")";
+	}
+
+	void retain(TEXFBO &obj)
+	{
+		Size size(obj.width, obj.height);
+
+		priorityQueue.push_front(obj);
+		CacheNode cnode;
+		cnode.obj = obj;
+		cnode.prioIter = priorityQueue.begin();
+		CNodeList &bucket = poolHash[size];
+		bucket.push_back(cnode);
+
+		stats.cachedBytes += byteCount(size);
+		++objCount;
+	}
+
+	void clear()
+	{
+		std::list<TEXFBO>::iterator iter;
+
+		for (iter = priorityQueue.begin();
+		     iter != priorityQueue.end();
+		     ++iter)
+		{
+			TEXFBO obj = *iter;
+			TEXFBO::fini(obj);
+			--objCount;
+		}
+
+		assert(objCount == 0);
+	}
+};
+
+struct TexPoolPrivate
+{
+	TexCache caches[TexPool::CategoryCount];
+
 	/* Has this pool been disabled? */
 	bool disabled;
 
+	std::vector<AtlasPage> atlasPages;
+
 	TexPoolPrivate(uint32_t maxMemSize)
-	    : maxMemSize(maxMemSize),
-	      memSize(0),
-	      objCount(0),
-	      disabled(false)
-	{}
+	    : disabled(false)
+	{
+		caches[TexPool::Bitmaps].stats.budget = maxMemSize;
+		caches[TexPool::Intermediates].stats.budget = maxMemSize / 2;
+		/* Unlimited */
+		caches[TexPool::Atlases].stats.budget = 0;
+	}
+
+	static void subLive(TexPool::Stats &stats, uint32_t bytes)
+	{
+		/* Objects not created by the pool may be released into it */
+		stats.liveBytes -= std::min(stats.liveBytes, bytes);
+	}
 };
 
 TexPool::TexPool(uint32_t maxMemSize)
@@ -86,44 +264,37 @@ TexPool::TexPool(uint32_t maxMemSize)
 
 TexPool::~TexPool()
 {
-	std::list<TEXFBO>::iterator iter;
-
-	for (iter = p->priorityQueue.begin();
-	     iter != p->priorityQueue.end();
-	     ++iter)
-	{
-		TEXFBO obj = *iter;
-		TEXFBO::fini(obj);
-		--p->objCount;
-	}
+	for (int i = 0; i < CategoryCount; ++i)
+		p->caches[i].clear();
 
-	assert(p->objCount == 0);
+	for (size_t i = 0; i < p->atlasPages.size(); ++i)
+		TEXFBO::fini(p->atlasPages[i].tex);
 
 	delete p;
 }
 
-TEXFBO TexPool::request(int width, int height)
+TEXFBO TexPool::request(int width, int height, Category cat)
 {
-	CacheNode cnode;
+	TEXFBO obj;
 	Size size(width, height);
+	Stats &stats = p->caches[cat].stats;
 
-	/* See if we can statisfy request from cache */
-	CNodeList &bucket = p->poolHash[size];
-
-	if (!bucket.empty())
+	/* See if we can statisfy request from cache,
+	 * preferring objects of the same category */
+	for (int i = 0; i < CategoryCount; ++i)
 	{
-		/* Found one! */
-		cnode = bucket.back();
-		bucket.pop_back();
+		TexCache &cache = p->caches[(cat + i) % CategoryCount];
 
-		p->priorityQueue.erase(cnode.prioIter);
+		if (!cache.take(size, obj))
+			continue;
 
-		p->memSize -= byteCount(size);
-		--p->objCount;
+		/* Found one! */
+		++stats.hits;
+		stats.liveBytes += byteCount(size);
 
 //		Debug() << "TexPool: <?+> (" << width << height << ")";
 
-		return cnode.obj;
+		return obj;
 	}
 
 	int maxSize = glState.caps.maxTexSize;
@@ -133,16 +304,19 @@ TEXFBO TexPool::request(int width, int height)
 		                width, height);
 
 	/* Nope, create it instead */
-	TEXFBO::init(cnode.obj);
-	TEXFBO::allocEmpty(cnode.obj, width, height);
-	TEXFBO::linkFBO(cnode.obj);
+	TEXFBO::init(obj);
+	TEXFBO::allocEmpty(obj, width, height);
+	TEXFBO::linkFBO(obj);
+
+	++stats.misses;
+	stats.liveBytes += byteCount(size);
 
 //	Debug() << "TexPool: <?-> (" << width << height << ")";
 
-	return cnode.obj;
+	return obj;
 }
 
-void TexPool::release(TEXFBO &obj)
+void TexPool::release(TEXFBO &obj, Category cat)
 {
 	if (obj.tex == TEX::ID(0) || obj.fbo == FBO::ID(0))
 	{
@@ -150,6 +324,11 @@ void TexPool::release(TEXFBO &obj)
 		return;
 	}
 
+	Size size(obj.width, obj.height);
+	TexCache &cache = p->caches[cat];
+
+	p->subLive(cache.stats, byteCount(size));
+
 	if (p->disabled)
 	{
 		/* If we're disabled, delete without caching */
@@ -158,54 +337,46 @@ void TexPool::release(TEXFBO &obj)
 		return;
 	}
 
-	Size size(obj.width, obj.height);
-
-	uint32_t newMemSize = p->memSize + byteCount(size);
-
 	/* If caching this object would spill over the allowed memory budget,
 	 * delete least used objects until we're good again */
-	while (newMemSize > p->maxMemSize)
+	while (cache.stats.cachedBytes + byteCount(size) > cache.stats.budget)
 	{
-		if (p->objCount == 0)
+		if (cache.objCount == 0)
 			break;
 
-//		Debug() << "TexPool: <!~> Size:" << p->memSize;
-
-		/* Retrieve object with lowest priority for deletion */
-		CacheNode last;
-		last.obj = p->priorityQueue.back();
-		Size removedSize(last.obj.width, last.obj.height);
+//		Debug() << "TexPool: <!~> Size:" << cache.stats.cachedBytes;
 
-		CNodeList &bucket = p->poolHash[removedSize];
-
-		std::list<CacheNode>::iterator toRemove =
-		        std::find(bucket.begin(), bucket.end(), last);
-		assert(toRemove != bucket.end());
-		bucket.erase(toRemove);
-
-		p->priorityQueue.pop_back();
+		cache.evictOne();
+	}
 
-		TEXFBO::fini(last.obj);
+	/* Retain object */
+	cache.retain(obj);
 
-		newMemSize -= byteCount(removedSize);
-		--p->objCount;
+//	Debug() << "TexPool: <!+> (" << obj.width << obj.height << ") Current size:" << cache.stats.cachedBytes;
+}
 
-//		Debug() << "TexPool: <!-> (" << last.obj.width << last.obj.height << ")";
-	}
+void TexPool::setBudget(Category cat, uint32_t bytes)
+{
+	TexCache &cache = p->caches[cat];
+	cache.stats.budget = bytes;
 
-	p->memSize = newMemSize;
+	if (cat == Atlases)
+		return;
 
-	/* Retain object */
-	p->priorityQueue.push_front(obj);
-	CacheNode cnode;
-	cnode.obj = obj;
-	cnode.prioIter = p->priorityQueue.begin();
-	CNodeList &bucket = p->poolHash[size];
-	bucket.push_back(cnode);
+	while (cache.stats.cachedBytes > bytes && cache.objCount > 0)
+		cache.evictOne();
+}
 
-	++p->objCount;
+void TexPool::trim()
+{
+	for (int i = 0; i < CategoryCount; ++i)
+		while (p->caches[i].objCount > 0)
+			p->caches[i].evictOne();
+}
 
-//	Debug() << "TexPool: <!+> (" << obj.width << obj.height << ") Current size:" << p->memSize;
+TexPool::Stats TexPool::stats(Category cat) const
+{
+	return p->caches[cat].stats;
 }
 
 void TexPool::disable()
@@ -213,4 +384,70 @@ void TexPool::disable()
 	p->disabled = true;
 }
 
+bool TexPool::requestAtlas(int width, int height,
+                           TEXFBO &page, IntRect &region)
+{
+	if (p->disabled)
+		return false;
+
+	if (width <= 0 || height <= 0 ||
+	    width > ATLAS_MAX_ITEM || height > ATLAS_MAX_ITEM)
+		return false;
+
+	Stats &stats = p->caches[Atlases].stats;
+
+	for (size_t i = 0; i < p->atlasPages.size(); ++i)
+	{
+		AtlasPage &ap = p->atlasPages[i];
+
+		if (ap.alloc(width, height, region))
+		{
+			page = ap.tex;
+			++stats.hits;
 
+			return true;
+		}
+	}
+
+	int pageSize = std::min<int>(ATLAS_PAGE_SIZE, glState.caps.maxTexSize);
+	Size pageDims(pageSize, pageSize);
+
+	++stats.misses;
+
+	/* Out of budget, the image gets a texture of its own */
+	if (stats.budget > 0 && stats.liveBytes + byteCount(pageDims) > stats.budget)
+		return false;
+
+	AtlasPage ap;
+	ap.shelfEnd = 0;
+	ap.liveCount = 0;
+
+	TEXFBO::init(ap.tex);
+	TEXFBO::allocEmpty(ap.tex, pageSize, pageSize);
+	TEXFBO::linkFBO(ap.tex);
+	ap.clear();
+
+	p->atlasPages.push_back(ap);
+	stats.liveBytes += byteCount(pageDims);
+
+	if (!p->atlasPages.back().alloc(width, height, region))
+		return false;
+
+	page = ap.tex;
+
+	return true;
+}
+
+void TexPool::releaseAtlas(const TEXFBO &page, const IntRect &)
+{
+	for (size_t i = 0; i < p->atlasPages.size(); ++i)
+	{
+		AtlasPage &ap = p->atlasPages[i];
+
+		if (ap.tex == page)
+		{
+			ap.free();
+			return;
+		}
+	}
+}
@@ -23,17 +23,59 @@
 #define TEXPOOL_H
 
 #include "gl-util.h"
+#include "etc-internal.h"
 
 struct TexPoolPrivate;
 
 class TexPool
 {
 public:
+	/* Released objects are cached and evicted separately per
+	 * category, each within its own memory budget */
+	enum Category
+	{
+		Bitmaps = 0,
+		/* Scratch and backing textures of windows etc. */
+		Intermediates,
+		/* Shared atlas pages, which are never evicted;
+		 * their budget caps how many get created */
+		Atlases,
+
+		CategoryCount
+	};
+
+	struct Stats
+	{
+		/* Requests served from / missing the cache */
+		uint32_t hits;
+		uint32_t misses;
+		uint32_t evictions;
+
+		/* Bytes held by cached objects */
+		uint32_t cachedBytes;
+		/* Bytes of objects handed out and not yet released */
+		uint32_t liveBytes;
+		uint32_t budget;
+	};
+
 	TexPool(uint32_t maxMemSize = 20000000 /* 20 MB */);
 	~TexPool();
 
-	TEXFBO request(int width, int height);
-	void release(TEXFBO &obj);
+	TEXFBO request(int width, int height, Category cat = Bitmaps);
+	void release(TEXFBO &obj, Category cat = Bitmaps);
+
+	/* Shared atlas pages for small images. On success, 'page'
+	 * receives the page texture and 'region' the allocated
+	 * area within it. Pages are never handed out by 'request()' */
+	bool requestAtlas(int width, int height,
+	                  TEXFBO &page, IntRect &region);
+	void releaseAtlas(const TEXFBO &page, const IntRect &region);
+
+	void setBudget(Category cat, uint32_t bytes);
+
+	/* Frees all cached objects (atlas pages stay) */
+	void trim();
+	Stats stats(Category cat) const;
 
 	void disable();
 
@@ -26,14 +26,15 @@
 #include "table.h"
 #include "etc-internal.h"
 #include "gl-util.h"
-#include "gl-meta.h"
 #include "sharedstate.h"
 #include "glstate.h"
+#include "shader.h"
+#include "quad.h"
+#include "quadstream.h"
 #include "texpool.h"
 #include "util.h"
 
 #include <assert.h>
-#include <vector>
 
 /* Regular (A) autotile patterns */
 extern const StaticRect autotileVXRectsA[];
@@ -177,15 +178,31 @@ static const Blit blitsE[] =
 	Blit(0, 0, bmSizes[BM_E], blitsD[0].dst.x, blitsD[0].dst.y+blitsD[0].src.h)
 };
 
-static elementsN(blitsA1);
-static elementsN(blitsA2);
-static elementsN(blitsA3);
-static elementsN(blitsA4);
-static elementsN(blitsA5);
-static elementsN(blitsB);
-static elementsN(blitsC);
-static elementsN(blitsD);
-static elementsN(blitsE);
+/* Every copy that makes up the atlas, tagged with the
+ * bitmap it reads from, in the order they are drawn */
+struct LayoutPart
+{
+	int bitmap;
+	const Blit *blits;
+	size_t count;
+};
+
+#define LAYOUT_PART(part) { BM_##part, blits##part, ARRAY_SIZE(blits##part) }
+
+static const LayoutPart layout[] =
+{
+	LAYOUT_PART(A1),
+	LAYOUT_PART(A2),
+	LAYOUT_PART(A3),
+	LAYOUT_PART(A4),
+	LAYOUT_PART(A5),
+	LAYOUT_PART(B),
+	LAYOUT_PART(C),
+	LAYOUT_PART(D),
+	LAYOUT_PART(E)
+};
+
+#undef LAYOUT_PART
 
 /* 'Waterfall' autotiles atlas origin */
 static const Vec2i AEPartsDst[] =
@@ -200,120 +217,112 @@ static const Vec2i AEPartsDst[] =
 
 static const Vec2i shadowArea(freeArea.x+2, freeArea.y);
 
-static SDL_Surface*
-createShadowSet()
-{
-	int bpp;
-	Uint32 rm, gm, bm, am;
+/* One tile per corner combination, with a half
+ * opacity black square in each set corner */
+#define SHADOW_QUADS (16*4/2)
 
-	SDL_PixelFormatEnumToMasks(SDL_PIXELFORMAT_ABGR8888, &bpp, &rm, &gm, &bm, &am);
-	SDL_Surface *surf = SDL_CreateRGBSurface(0, 1*32, 16*32, bpp, rm, gm, bm, am);
-
-	std::vector<SDL_Rect> rects;
-	SDL_Rect rect = { 0, 0, 16, 16 };
+static size_t
+buildShadowSet(Vertex *vert)
+{
+	const Vec4 color(0, 0, 0, 128 / 255.0f);
+	size_t n = 0;
 
 	for (int val = 0; val < 16; ++val)
 	{
-		int origY = val*32;
+		const int origX = shadowArea.x*32;
+		const int origY = shadowArea.y*32 + val*32;
 
-		/* Top left */
-		if (val & (1 << 0))
+		for (int corner = 0; corner < 4; ++corner)
 		{
-			rect.x = 0;
-			rect.y = origY;
-			rects.push_back(rect);
-		}
-
-		/* Top Right */
-		if (val & (1 << 1))
-		{
-			rect.x = 16;
-			rect.y = origY;
-			rects.push_back(rect);
-		}
+			if (!(val & (1 << corner)))
+				continue;
 
-		/* Bottom left */
-		if (val & (1 << 2))
-		{
-			rect.x = 0;
-			rect.y = origY+16;
-			rects.push_back(rect);
-		}
+			/* Top left, top right, bottom left, bottom right */
+			FloatRect rect(origX + (corner & 1) * 16,
+			               origY + (corner >> 1) * 16, 16, 16);
 
-		/* Bottom right */
-		if (val & (1 << 3))
-		{
-			rect.x = 16;
-			rect.y = origY+16;
-			rects.push_back(rect);
+			Quad::setPosRect(&vert[n*4], rect);
+			Quad::setColor(&vert[n*4], color);
+			++n;
 		}
 	}
 
-	/* Fill rects with half opacity black */
-	uint32_t color = (0x80808080 & am);
-	SDL_FillRects(surf, dataPtr(rects), rects.size(), color);
-
-	return surf;
+	return n;
 }
 
-static void doBlit(Bitmap *bm, const IntRect &src, const Vec2i &dst)
-{
-	/* Translate tile to pixel units */
-	IntRect _src(src.x*32, src.y*32, src.w*32, src.h*32);
-	Vec2i _dst(dst.x*32, dst.y*32);
-	IntRect bmr(0, 0, bm->width(), bm->height());
-
-	if (!SDL_IntersectRect(&_src, &bmr, &_src))
-		return;
-
-	GLMeta::blitRectangle(_src, _dst);
-}
+/* Largest number of quads drawn with one call */
+#define MAX_PART_QUADS SHADOW_QUADS
 
 void build(TEXFBO &tf, Bitmap *bitmaps[BM_COUNT])
 {
 	assert(tf.width == ATLASVX_W && tf.height == ATLASVX_H);
 
-	GLMeta::blitBegin(tf);
+	/* The whole atlas is assembled in one pass into its own
+	 * FBO: one draw for the shadow set and one per bitmap,
+	 * instead of a framebuffer blit per rectangle */
+	FBO::bind(tf.fbo);
+	glState.viewport.pushSet(IntRect(0, 0, tf.width, tf.height));
+	glState.blend.pushSet(false);
 
 	glState.clearColor.pushSet(Vec4());
 	FBO::clear();
 	glState.clearColor.pop();
 
+	QuadStream &stream = shState->quadStream();
+	Vertex vert[MAX_PART_QUADS*4];
+
 	if (rgssVer >= 3)
 	{
-		SDL_Surface *shadow = createShadowSet();
-		TEX::bind(tf.tex);
-		TEX::uploadSubImage(shadowArea.x*32, shadowArea.y*32,
-							shadow->w, shadow->h, shadow->pixels, GL_RGBA);
-		SDL_FreeSurface(shadow);
-	}
+		SimpleColorShader &shader = shState->shaders().simpleColor;
+		shader.bind();
+		shader.applyViewportProj();
+		shader.setTranslation(Vec2i());
 
-	Bitmap *bm;
-#define EXEC_BLITS(part) \
-	if (!nullOrDisposed(bm = bitmaps[BM_##part])) \
-	{ \
-		GLMeta::blitSource(bm->getGLTypes()); \
-		for (size_t i = 0; i < blits##part##N; ++i) \
-		{\
-			const IntRect &src = blits##part[i].src; \
-			const Vec2i &dst = blits##part[i].dst; \
-			doBlit(bm, src, dst); \
-		} \
+		stream.draw(vert, buildShadowSet(vert));
 	}
 
-	EXEC_BLITS(A1);
-	EXEC_BLITS(A2);
-	EXEC_BLITS(A3);
-	EXEC_BLITS(A4);
-	EXEC_BLITS(A5);
-	EXEC_BLITS(B);
-	EXEC_BLITS(C);
-	EXEC_BLITS(D);
-	EXEC_BLITS(E);
+	SimpleShader &shader = shState->shaders().simple;
+	shader.bind();
+	shader.applyViewportProj();
+	shader.setTranslation(Vec2i());
+
+	for (size_t i = 0; i < ARRAY_SIZE(layout); ++i)
+	{
+		const LayoutPart &part = layout[i];
+		Bitmap *bm = bitmaps[part.bitmap];
+
+		if (nullOrDisposed(bm))
+			continue;
+
+		const IntRect bmr(0, 0, bm->width(), bm->height());
+		size_t n = 0;
 
-#undef EXEC_BLITS
+		for (size_t j = 0; j < part.count; ++j)
+		{
+			/* Translate tile to pixel units */
+			const IntRect &src = part.blits[j].src;
+			const Vec2i &dst = part.blits[j].dst;
+			IntRect _src(src.x*32, src.y*32, src.w*32, src.h*32);
+
+			if (!SDL_IntersectRect(&_src, &bmr, &_src))
+				continue;
+
+			n += Quad::setTexPosRect(&vert[n*4], _src,
+			                         IntRect(dst.x*32, dst.y*32, _src.w, _src.h));
+		}
+
+		if (n == 0)
+			continue;
+
+		const TEXFBO &tex = bm->getDrawTex();
+		TEX::bind(tex.tex);
+		shader.setTexSize(Vec2i(tex.width, tex.height));
+
+		stream.draw(vert, n);
+	}
 
-	GLMeta::blitEnd();
+	glState.blend.pop();
+	glState.viewport.pop();
 }
 
 #define OVER_PLAYER_FLAG (1 << 4)
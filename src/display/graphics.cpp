@@ -25,17 +25,23 @@
 #include "audio.h"
 #include "binding.h"
 #include "bitmap.h"
+#include "bitmaploader.h"
 #include "config.h"
 #include "debugwriter.h"
 #include "disposable.h"
 #include "etc-internal.h"
 #include "eventthread.h"
+#include "exception.h"
 #include "filesystem.h"
+#include "frame-arena.h"
 #include "gl-fun.h"
 #include "gl-util.h"
 #include "glstate.h"
 #include "intrulist.h"
+#include "profiler.h"
+#include "trace.h"
 #include "quad.h"
+#include "quadarray.h"
 #include "scene.h"
 #include "shader.h"
 #include "sharedstate.h"
@@ -52,8 +58,9 @@
 #include <SDL_mutex.h>
 #include <SDL_thread.h>
 
-#ifdef MKXPZ_STEAM
-#include "steamshim_child.h"
+#ifdef __WIN32__
+#define NOMINMAX
+#include <windows.h>
 #endif
 
 #include <algorithm>
@@ -63,6 +70,8 @@
 #include <time.h>
 #include <cmath>
 #include <climits>
+#include <list>
+#include <string>
 
 
 #define DEF_SCREEN_W (rgssVer == 1 ? 640 : 544)
@@ -71,16 +80,64 @@
 #define DEF_FRAMERATE (rgssVer == 1 ? 40 : 60)
 
 #define DEF_MAX_VIDEO_FRAMES 30
+
+/* Decoded transition maps kept around */
+#define TRANS_CACHE_MAX 4
+
+/* Update calls kept for Graphics.frame_history */
+#define FRAME_HISTORY_SIZE 600
 #define VIDEO_DELAY 10
 #define MOVIE_AUDIO_BUFFER_SIZE 2048
+#define MOVIE_AUDIO_QUEUE_SIZE 256
 #define AUDIO_BUFFER_LEN_MS 2000
 
-typedef struct AudioQueue
+/* Decoded audio packets, handed from the RGSS thread (the only
+ * producer) to the movie audio thread (the only consumer) */
+struct AudioQueue
 {
-    const THEORAPLAY_AudioPacket *audio;
+    const THEORAPLAY_AudioPacket *packets[MOVIE_AUDIO_QUEUE_SIZE];
+    SDL_atomic_t head;
+    SDL_atomic_t tail;
+    
+    /* Frames of the front packet already played,
+     * only touched by the consumer */
     int offset;
-    struct AudioQueue *next;
-} AudioQueue;
+    
+    void clear()
+    {
+        SDL_AtomicSet(&head, 0);
+        SDL_AtomicSet(&tail, 0);
+        offset = 0;
+    }
+    
+    bool full()
+    {
+        return SDL_AtomicGet(&tail) - SDL_AtomicGet(&head) == MOVIE_AUDIO_QUEUE_SIZE;
+    }
+    
+    void push(const THEORAPLAY_AudioPacket *packet)
+    {
+        int t = SDL_AtomicGet(&tail);
+        packets[t % MOVIE_AUDIO_QUEUE_SIZE] = packet;
+        SDL_AtomicSet(&tail, t + 1);
+    }
+    
+    const THEORAPLAY_AudioPacket *front()
+    {
+        int h = SDL_AtomicGet(&head);
+        
+        if (h == SDL_AtomicGet(&tail))
+            return 0;
+        
+        return packets[h % MOVIE_AUDIO_QUEUE_SIZE];
+    }
+    
+    void pop()
+    {
+        offset = 0;
+        SDL_AtomicAdd(&head, 1);
+    }
+};
 
 
 static long readMovie(THEORAPLAY_Io *io, void *buf, long buflen)
@@ -107,19 +164,26 @@ struct Movie
     bool hasAudio;
     bool skippable;
     Bitmap *videoBitmap;
+    /* Y, U and V planes of the current frame,
+     * converted into 'videoBitmap' on the GPU */
+    TEX::ID planes[3];
     SDL_RWops srcOps;
     SDL_Thread *audioThread;
     AtomicFlag audioThreadTermReq;
-    volatile AudioQueue *audioQueueHead;
-    volatile AudioQueue *audioQueueTail;
+    AudioQueue audioQueue;
     ALuint audioSource;
     ALuint alBuffers[STREAM_BUFS];
-    ALshort audioBuffer[MOVIE_AUDIO_BUFFER_SIZE];
-    SDL_mutex *audioMutex;
+    /* Samples are passed on to OpenAL as floats, just as
+     * the decoder outputs them, so no conversion is needed */
+    float audioBuffer[MOVIE_AUDIO_BUFFER_SIZE];
     
     Movie(bool skippable_)
     : decoder(0), audio(0), video(0), skippable(skippable_), videoBitmap(0), audioThread(0)
     {
+        for (int i = 0; i < 3; ++i)
+            planes[i] = TEX::ID(0);
+        
+        audioQueue.clear();
     }
     bool preparePlayback()
     {
@@ -135,7 +199,7 @@ struct Movie
         io->read = readMovie;
         io->close = closeMovie;
         io->userdata = &srcOps;
-        decoder = THEORAPLAY_startDecode(io, DEF_MAX_VIDEO_FRAMES, THEORAPLAY_VIDFMT_RGBA);
+        decoder = THEORAPLAY_startDecode(io, DEF_MAX_VIDEO_FRAMES, THEORAPLAY_VIDFMT_IYUV);
         if (!decoder) {
             SDL_RWclose(&srcOps);
             return false;
@@ -179,43 +243,84 @@ struct Movie
             }
         }
         videoBitmap = new Bitmap(video->width, video->height);
-        audioQueueHead = NULL;
-        audioQueueTail = NULL;
-        
+        initPlanes(video->width, video->height);
         return true;
     }
     
-    void queueAudioPacket(const THEORAPLAY_AudioPacket *audio) {
-        AudioQueue *item = NULL;
-        
-        if (!audio) {
-            return;
+    void initPlanes(int w, int h)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            const int pw = (i == 0) ? w : w / 2;
+            const int ph = (i == 0) ? h : h / 2;
+            
+            planes[i] = TEX::gen();
+            TEX::bind(planes[i]);
+            TEX::setRepeat(false);
+            /* Chroma is stretched to twice its size */
+            TEX::setSmooth(i != 0);
+            gl.TexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, pw, ph, 0,
+                          GL_LUMINANCE, GL_UNSIGNED_BYTE, 0);
         }
+    }
+    
+    /* Uploads the planes of an IYUV frame and converts
+     * them to RGB straight into the video bitmap */
+    void drawFrame(const THEORAPLAY_VideoFrame *frame)
+    {
+        const int w = frame->width;
+        const int h = frame->height;
+        const unsigned char *data[3];
         
-        item = (AudioQueue *) malloc(sizeof (AudioQueue));
-        if (!item) {
-            THEORAPLAY_freeAudio(audio);
-            return;  // oh well.
-        }
+        data[0] = frame->pixels;
+        data[1] = data[0] + w * h;
+        data[2] = data[1] + (w / 2) * (h / 2);
         
-        item->audio = audio;
-        item->offset = 0;
-        item->next = NULL;
+        gl.PixelStorei(GL_UNPACK_ALIGNMENT, 1);
         
-        SDL_LockMutex(audioMutex);
-        if (audioQueueTail) {
-            audioQueueTail->next = item;
-        } else {
-            audioQueueHead = item;
+        for (int i = 0; i < 3; ++i)
+        {
+            TEX::bind(planes[i]);
+            gl.TexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+                             (i == 0) ? w : w / 2, (i == 0) ? h : h / 2,
+                             GL_LUMINANCE, GL_UNSIGNED_BYTE, data[i]);
+            
+            ++glCounters.texUploads;
+            glCounters.texUploadBytes += (i == 0) ? w * h : (w / 2) * (h / 2);
         }
-        audioQueueTail = item;
-        SDL_UnlockMutex(audioMutex);
+        
+        gl.PixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        
+        const IntRect rect(0, 0, w, h);
+        
+        FBO::bind(videoBitmap->getGLTypes().fbo);
+        glState.viewport.pushSet(rect);
+        glState.blend.pushSet(false);
+        
+        YUVShader &shader = shState->shaders().yuv;
+        shader.bind();
+        shader.applyViewportProj();
+        shader.setTranslation(Vec2i());
+        shader.setTexU(planes[1]);
+        shader.setTexV(planes[2]);
+        shader.setTexSize(Vec2i(w, h));
+        TEX::bind(planes[0]);
+        
+        Quad &quad = shState->gpQuad();
+        quad.setTexPosRect(rect, rect);
+        quad.setColor(Vec4(1, 1, 1, 1));
+        quad.draw();
+        
+        glState.blend.pop();
+        glState.viewport.pop();
+        
+        videoBitmap->notifyModified();
     }
     
     void bufferMovieAudio(THEORAPLAY_Decoder *decoder, const Uint32 now) {
         const THEORAPLAY_AudioPacket *audio;
-        while ((audio = THEORAPLAY_getAudio(decoder)) != NULL) {
-            queueAudioPacket(audio);
+        while (!audioQueue.full() && (audio = THEORAPLAY_getAudio(decoder)) != NULL) {
+            audioQueue.push(audio);
             if (audio->playms >= now + AUDIO_BUFFER_LEN_MS) {  // don't let this get too far ahead.
                 break;
             }
@@ -224,69 +329,55 @@ struct Movie
 
     void streamMovieAudio(){
         ALint state = 0;
-        ALint procBufs = STREAM_BUFS;	    
-        volatile AudioQueue *audioPacketAndOffset;
-        int channels;
-        int sampleRate;
-        float *sourceSamples;
-        ALuint samplesToProcess;
-        ALshort *sampleBuffer;
-        ALuint remainingSamples;
+        ALint procBufs = STREAM_BUFS;
+        int channels = 1;
+        int sampleRate = 0;
 
         while(true) {
-            while(procBufs--) {
+            while(procBufs > 0) {
                 // Quit if audio thread terminate request has been made
                 if (audioThreadTermReq) return;
 
-                remainingSamples = MOVIE_AUDIO_BUFFER_SIZE;
-                sampleBuffer = audioBuffer;
-                SDL_LockMutex(audioMutex);
-
-                while(audioQueueHead && (remainingSamples > 0)) {
-                    audioPacketAndOffset = audioQueueHead;
-                    channels = audioPacketAndOffset->audio->channels;
-                    sampleRate = audioPacketAndOffset->audio->freq;
-                    sourceSamples = audioPacketAndOffset->audio->samples + (audioPacketAndOffset->offset * channels);
-                    samplesToProcess = (audioPacketAndOffset->audio->frames - audioPacketAndOffset->offset) * channels;
-
-                    if (samplesToProcess > remainingSamples) samplesToProcess = remainingSamples;
-
-                    for (ALuint i = 0; i < samplesToProcess; i++) {
-                        const float val = (*(sourceSamples++));
-                        if (val < -1.0f) {
-                            *(sampleBuffer++) = SHRT_MIN;
-                        } else if (val > 1.0f) {
-                            *(sampleBuffer++) = SHRT_MAX;
-                        } else {
-                            *(sampleBuffer++) = (ALshort) (val * SHRT_MAX);
-                        }
-                    }
+                ALuint filled = 0;
+                const THEORAPLAY_AudioPacket *packet;
+
+                while((filled < MOVIE_AUDIO_BUFFER_SIZE) && (packet = audioQueue.front())) {
+                    channels = packet->channels;
+                    sampleRate = packet->freq;
+
+                    ALuint samples = (packet->frames - audioQueue.offset) * channels;
+                    if (samples > MOVIE_AUDIO_BUFFER_SIZE - filled) samples = MOVIE_AUDIO_BUFFER_SIZE - filled;
+
+                    memcpy(audioBuffer + filled, packet->samples + audioQueue.offset * channels, samples * sizeof(float));
 
                     // Necessary to remember position between repeated iterations
-                    audioPacketAndOffset->offset += (samplesToProcess / channels);
-                    remainingSamples -= samplesToProcess;
+                    audioQueue.offset += samples / channels;
+                    filled += samples;
 
                     // The current audio packet has been completed
-                    if ((audioPacketAndOffset->offset) >= audioPacketAndOffset->audio->frames) {
-                        audioQueueHead = audioPacketAndOffset->next;
-                        THEORAPLAY_freeAudio(audioPacketAndOffset->audio);
-                        free((void *) audioPacketAndOffset);
+                    if (audioQueue.offset >= packet->frames) {
+                        audioQueue.pop();
+                        THEORAPLAY_freeAudio(packet);
                     }
                 }
 
-                if(!audioQueueHead) audioQueueTail = NULL;
-
-                SDL_UnlockMutex(audioMutex);
+                // Nothing decoded yet, don't queue an empty buffer
+                if (filled == 0) {
+                    SDL_Delay(AUDIO_SLEEP);
+                    continue;
+                }
 
-                alBufferData(alBuffers[procBufs], channels == 1 ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16, audioBuffer,
-                    (MOVIE_AUDIO_BUFFER_SIZE - remainingSamples) * sizeof(ALshort), sampleRate);
-                alSourceQueueBuffers(audioSource, 1, &alBuffers[procBufs]);     
+                --procBufs;
+                alBufferData(alBuffers[procBufs], channels == 1 ? AL_FORMAT_MONO_FLOAT32 : AL_FORMAT_STEREO_FLOAT32,
+                    audioBuffer, filled * sizeof(float), sampleRate);
+                alSourceQueueBuffers(audioSource, 1, &alBuffers[procBufs]);
                 alGetSourcei(audioSource, AL_SOURCE_STATE, &state);
                 if(state != AL_PLAYING) alSourcePlay(audioSource);
             }
 
             // Periodically check the buffers until one is available
             while(true) {
+                if (audioThreadTermReq) return;
                 alGetSourcei(audioSource, AL_BUFFERS_PROCESSED, &procBufs);
                 if(procBufs > 0) break;
                 SDL_Delay(AUDIO_SLEEP);
@@ -302,8 +393,7 @@ struct Movie
         alSourcef(audioSource, AL_GAIN, volume);
 
         audioThreadTermReq.clear();
-        audioMutex = SDL_CreateMutex();
-        queueAudioPacket(audio);
+        audioQueue.push(audio);
         audio = NULL;
         bufferMovieAudio(decoder, 0);
         audioThread = createSDLThread <Movie, &Movie::streamMovieAudio>(this, "movieaudio");
@@ -332,12 +422,12 @@ struct Movie
                 video = THEORAPLAY_getVideo(decoder);
             }
             
-            if (hasAudio) {
+            if (hasAudio && !openedAudio) {
                 if (!audio) {
                     audio = THEORAPLAY_getAudio(decoder);
                 }
                 
-                if (audio && !openedAudio) {
+                if (audio) {
                     if(!startAudio(volume)){
                         Debug() << "Error opening movie audio!";
                         break;
@@ -355,7 +445,7 @@ struct Movie
                     const THEORAPLAY_VideoFrame *last = video;
                     while ((video = THEORAPLAY_getVideo(decoder)) != NULL)
                     {
-                        THEORAPLAY_freeVideo(last);
+                        THEORAPLAY_recycleVideo(decoder, last);
                         last = video;
                         if ((now - video->playms) < frameMs)
                             break;
@@ -372,14 +462,19 @@ struct Movie
                 }
 
                 // Got a video frame, now draw it
-                videoBitmap->replaceRaw(video->pixels, video->width * video->height * 4);
+                drawFrame(video);
+                THEORAPLAY_recycleVideo(decoder, video);
                 shState->graphics().update(false);
-                THEORAPLAY_freeVideo(video);
                 video = NULL;
 
             } else {
-                // Next video frame not yet ready, let the CPU breathe
-                SDL_Delay(VIDEO_DELAY);
+                // Next video frame not yet due, let the CPU breathe.
+                // Wake up right when it is rather than up to a whole
+                // delay late, which shows as judder at higher frame rates
+                Uint32 delay = VIDEO_DELAY;
+                if (video && video->playms - now < delay)
+                    delay = video->playms - now;
+                SDL_Delay(delay);
             }
             
             if (openedAudio) {
@@ -390,29 +485,26 @@ struct Movie
     
     ~Movie()
     {
-        if (hasAudio) {
-            if (audioQueueTail) {
-                THEORAPLAY_freeAudio(audioQueueTail->audio);
-            }
-            audioQueueTail = NULL;
-            
-            if (audioQueueHead) {
-                THEORAPLAY_freeAudio(audioQueueHead->audio);
-            }
-            audioQueueHead = NULL;
-        }
-        SDL_DestroyMutex(audioMutex);
         audioThreadTermReq.set();
         if(audioThread) {
             SDL_WaitThread(audioThread, 0);
             audioThread = 0;
         }
+        if (hasAudio) {
+            while (const THEORAPLAY_AudioPacket *packet = audioQueue.front()) {
+                audioQueue.pop();
+                THEORAPLAY_freeAudio(packet);
+            }
+        }
         alSourceStop(audioSource);
         alDeleteSources(1, &audioSource);
         alDeleteBuffers(STREAM_BUFS, alBuffers);
         if (video) THEORAPLAY_freeVideo(video);
         if (audio) THEORAPLAY_freeAudio(audio);
         if (decoder) THEORAPLAY_stopDecode(decoder);
+        for (int i = 0; i < 3; ++i)
+            if (planes[i] != TEX::ID(0))
+                TEX::del(planes[i]);
         delete videoBitmap;
     }
 };
@@ -437,22 +529,40 @@ struct PingPong {
     uint8_t srcInd, dstInd;
     int screenW, screenH;
     
-    PingPong(int screenW, int screenH)
-    : srcInd(0), dstInd(1), screenW(screenW), screenH(screenH) {
+    /* Shared by both buffers, only with 'tilemapDepth' */
+    GLuint depthRB;
+    /* The FBOs 'depthRB' is attached to; buffers may be
+     * traded for others through 'takeFrontBuffer()' */
+    FBO::ID depthLinked[2];
+    
+    PingPong(int screenW, int screenH, bool depth)
+    : srcInd(0), dstInd(1), screenW(screenW), screenH(screenH), depthRB(0) {
         for (int i = 0; i < 2; ++i) {
             TEXFBO::init(rt[i]);
             TEXFBO::allocEmpty(rt[i], screenW, screenH);
             TEXFBO::linkFBO(rt[i]);
             gl.ClearColor(0, 0, 0, 1);
             FBO::clear();
+            
+            depthLinked[i] = FBO::ID(0);
+        }
+        
+        if (depth) {
+            gl.GenRenderbuffers(1, &depthRB);
+            allocDepth();
         }
     }
     
     ~PingPong() {
         for (int i = 0; i < 2; ++i)
             TEXFBO::fini(rt[i]);
+        
+        if (depthRB)
+            gl.DeleteRenderbuffers(1, &depthRB);
     }
     
+    bool hasDepth() const { return depthRB != 0; }
+    
     TEXFBO &backBuffer() { return rt[srcInd]; }
     
     TEXFBO &frontBuffer() { return rt[dstInd]; }
@@ -464,6 +574,9 @@ struct PingPong {
         
         for (int i = 0; i < 2; ++i)
             TEXFBO::allocEmpty(rt[i], width, height);
+        
+        if (depthRB)
+            allocDepth();
     }
     
     void startRender() { bind(); }
@@ -486,79 +599,155 @@ struct PingPong {
     }
     
 private:
-    void bind() { FBO::bind(rt[dstInd].fbo); }
+    void bind() {
+        TEXFBO &target = rt[dstInd];
+        FBO::bind(target.fbo);
+        
+        if (depthRB && depthLinked[dstInd] != target.fbo) {
+            gl.FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                       GL_RENDERBUFFER, depthRB);
+            depthLinked[dstInd] = target.fbo;
+        }
+    }
+    
+    void allocDepth() {
+        gl.BindRenderbuffer(GL_RENDERBUFFER, depthRB);
+        gl.RenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16,
+                               screenW, screenH);
+        gl.BindRenderbuffer(GL_RENDERBUFFER, 0);
+    }
 };
 
 class ScreenScene : public Scene {
 public:
-    ScreenScene(int width, int height) : pp(width, height) {
+    ScreenScene(int width, int height, bool depth)
+    : pp(width, height, depth), brightness(1), lastElement(0),
+      deferring(false), effectsPending(false), damaged(true) {
         updateReso(width, height);
+    }
+    
+    /* With 'deferEffects', the brightness and the effects of a
+     * viewport covering the whole screen on top of everything
+     * else are left for the presenting pass to apply (see
+     * 'presentEffects()'), instead of drawn over the screen */
+    void composite(bool deferEffects = false) {
+        ProfileScope profile(Profiler::Composite);
+        
+        shState->prepareDraw();
+        
+        render(deferEffects);
+    }
+    
+    /* Like 'composite()', but leaves the last frame in the
+     * PP frontbuffer as is if nothing was damaged since */
+    void compositeIfDamaged(bool deferEffects = false) {
+        ProfileScope profile(Profiler::Composite);
+        
+        /* Flushing bitmaps and tilemaps might damage us */
+        shState->prepareDraw();
+        
+        if (!damaged) {
+            if (!deferEffects)
+                resolveEffects();
+            
+            return;
+        }
         
-        brightEffect = false;
-        brightnessQuad.setColor(Vec4());
+        render(deferEffects);
     }
     
-    void composite() {
+    bool hasPendingEffects() const { return effectsPending; }
+    
+    /* Draws deferred effects into the PP frontbuffer */
+    void resolveEffects() {
+        if (!effectsPending)
+            return;
+        
         const int w = geometry.rect.w;
         const int h = geometry.rect.h;
         
-        shState->prepareDraw();
+        pp.swapRender();
+        glState.viewport.pushSet(IntRect(0, 0, w, h));
         
-        pp.startRender();
+        ScreenEffectsShader &shader = bindEffectsShader();
+        shader.setTexSize(Vec2i(w, h));
+        TEX::bind(pp.backBuffer().tex);
         
-        glState.viewport.set(IntRect(0, 0, w, h));
+        glState.blend.pushSet(false);
+        screenQuad.draw();
+        glState.blend.pop();
         
-        FBO::clear();
+        glState.viewport.pop();
         
-        Scene::composite();
+        effectsPending = false;
+    }
+    
+    /* Binds the shader that applies deferred effects, set up
+     * for them. The caller binds the PP frontbuffer as source */
+    ScreenEffectsShader &bindEffectsShader() {
+        ScreenEffectsShader &shader = shState->shaders().screenEffects;
+        shader.bind();
+        shader.applyViewportProj();
+        shader.setTranslation(Vec2i());
+        shader.setTone(pending.tone);
+        shader.setColor(pending.color);
+        shader.setFlash(pending.flash);
+        shader.setBrightness(pending.brightness);
         
-        if (brightEffect) {
-            SimpleColorShader &shader = shState->shaders().simpleColor;
-            shader.bind();
-            shader.applyViewportProj();
-            shader.setTranslation(Vec2i());
-            
-            brightnessQuad.draw();
-        }
+        return shader;
+    }
+    
+    void damage() { damaged = true; }
+    
+    /* Whether the PP frontbuffer still shows the scene as it
+     * is now. Only reliable with damage tracking enabled */
+    bool frontBufferCurrent() {
+        /* Flushing bitmaps and tilemaps might damage us */
+        shState->prepareDraw();
+        
+        return !damaged;
+    }
+    
+    /* Trades the PP frontbuffer for 'buffer' (of the same size)
+     * without copying; the screen is redrawn in full next time */
+    void takeFrontBuffer(TEXFBO &buffer) {
+        resolveEffects();
+        
+        std::swap(buffer, pp.frontBuffer());
+        damaged = true;
     }
     
-    void requestViewportRender(const Vec4 &c, const Vec4 &f, const Vec4 &t) {
+    void requestViewportRender(const Vec4 &c, const Vec4 &f, const Vec4 &t,
+                               const SceneElement *source) {
         const IntRect &viewpRect = glState.scissorBox.get();
         const IntRect &screenRect = geometry.rect;
         
+        /* Nothing is drawn over the last element, so its effects
+         * can just as well be applied on the way to the window */
+        if (deferring && source == lastElement && viewpRect.encloses(screenRect)) {
+            pending.tone = t;
+            pending.color = c;
+            pending.flash = f;
+            effectsPending = true;
+            
+            return;
+        }
+        
         const bool toneRGBEffect = t.xyzNotNull();
         const bool toneGrayEffect = t.w != 0;
         const bool colorEffect = c.w > 0;
         const bool flashEffect = f.w > 0;
         
         if (toneGrayEffect) {
-            pp.swapRender();
-            
-            if (!viewpRect.encloses(screenRect)) {
-                /* Scissor test _does_ affect FBO blit operations,
-                 * and since we're inside the draw cycle, it will
-                 * be turned on, so turn it off temporarily */
-                glState.scissorTest.pushSet(false);
-                
-                GLMeta::blitBegin(pp.frontBuffer());
-                GLMeta::blitSource(pp.backBuffer());
-                GLMeta::blitRectangle(geometry.rect, Vec2i());
-                GLMeta::blitEnd();
-                
-                glState.scissorTest.pop();
-            }
-            
-            GrayShader &shader = shState->shaders().gray;
-            shader.bind();
-            shader.setGray(t.w);
-            shader.applyViewportProj();
-            shader.setTexSize(screenRect.size());
+            const IntRect r = clipToScreen(viewpRect);
             
-            TEX::bind(pp.backBuffer().tex);
+            /* Swapping buffers would lose what a tilemap
+             * depth tested away (see 'tilemapDepth') */
+            const bool wholeScreen = viewpRect.encloses(screenRect) &&
+                                     !glState.depthTest.get();
             
-            glState.blend.pushSet(false);
-            screenQuad.draw();
-            glState.blend.pop();
+            if (r.w > 0 && r.h > 0)
+                renderGray(r, t.w, wholeScreen);
         }
         
         if (!toneRGBEffect && !colorEffect && !flashEffect)
@@ -624,9 +813,8 @@ public:
     }
     
     void setBrightness(float norm) {
-        brightnessQuad.setColor(Vec4(0, 0, 0, 1.0f - norm));
-        
-        brightEffect = norm < 1.0f;
+        brightness = norm;
+        damaged = true;
     }
     
     void updateReso(int width, int height) {
@@ -634,7 +822,6 @@ public:
         geometry.rect.h = height;
         
         screenQuad.setTexPosRect(geometry.rect, geometry.rect);
-        brightnessQuad.setTexPosRect(geometry.rect, geometry.rect);
         
         notifyGeometryChange();
     }
@@ -642,21 +829,148 @@ public:
     void setResolution(int width, int height) {
         pp.resize(width, height);
         updateReso(width, height);
+        
+        /* Reallocating left the buffers undefined */
+        damaged = true;
     }
     
     PingPong &getPP() { return pp; }
     
 private:
+    void render(bool deferEffects) {
+        const int w = geometry.rect.w;
+        const int h = geometry.rect.h;
+        
+        damaged = false;
+        lastElement = 0;
+        
+        for (IntruListLink<SceneElement> *iter = elements.begin();
+             iter != elements.end(); iter = iter->next)
+            iter->data->prerender();
+        
+        /* Visibility is only final after prerendering */
+        for (IntruListLink<SceneElement> *iter = elements.begin();
+             iter != elements.end(); iter = iter->next)
+            if (iter->data->visible && !iter->data->culled)
+                lastElement = iter->data;
+        
+        pp.startRender();
+        
+        glState.viewport.set(IntRect(0, 0, w, h));
+        
+        FBO::clear();
+        
+        pending = PendingEffects();
+        pending.brightness = brightness;
+        effectsPending = brightness < 1.0f;
+        
+        deferring = deferEffects;
+        
+        Scene::depthBuffered = pp.hasDepth();
+        Scene::composite();
+        Scene::depthBuffered = false;
+        
+        deferring = false;
+        
+        if (!deferEffects)
+            resolveEffects();
+    }
+    
+    IntRect clipToScreen(const IntRect &rect) const {
+        const IntRect &screen = geometry.rect;
+        
+        const int x1 = std::max(rect.x, screen.x);
+        const int y1 = std::max(rect.y, screen.y);
+        const int x2 = std::min(rect.x + rect.w, screen.x + screen.w);
+        const int y2 = std::min(rect.y + rect.h, screen.y + screen.h);
+        
+        return IntRect(x1, y1, x2 - x1, y2 - y1);
+    }
+    
+    void renderGray(const IntRect &r, float gray, bool wholeScreen) {
+        GrayShader &shader = shState->shaders().gray;
+        
+        if (wholeScreen) {
+            /* Covers everything, so just render the whole
+             * screen through the other buffer */
+            pp.swapRender();
+            
+            shader.bind();
+            shader.setTexSize(r.size());
+            TEX::bind(pp.backBuffer().tex);
+            
+            grayQuad.setTexPosRect(r, r);
+        } else {
+            /* Only copy out the region we're about to overwrite
+             * instead of swapping and restoring the whole screen */
+            TEXFBO &tmp = shState->gpTexFBO(r.w, r.h);
+            
+            /* Scissor test _does_ affect FBO blit operations,
+             * and since we're inside the draw cycle, it will
+             * be turned on, so turn it off temporarily */
+            glState.scissorTest.pushSet(false);
+            
+            GLMeta::blitBegin(tmp);
+            GLMeta::blitSource(pp.frontBuffer());
+            GLMeta::blitRectangle(r, Vec2i());
+            GLMeta::blitEnd();
+            
+            glState.scissorTest.pop();
+            
+            pp.startRender();
+            
+            shader.bind();
+            shader.setTexSize(Vec2i(tmp.width, tmp.height));
+            TEX::bind(tmp.tex);
+            
+            grayQuad.setTexPosRect(IntRect(0, 0, r.w, r.h), r);
+        }
+        
+        shader.setGray(gray);
+        shader.applyViewportProj();
+        
+        glState.blend.pushSet(false);
+        grayQuad.draw();
+        glState.blend.pop();
+    }
+    
     PingPong pp;
     Quad screenQuad;
     
-    Quad brightnessQuad;
-    bool brightEffect;
+    /* Gray tone pass over (part of) the screen */
+    Quad grayQuad;
+    
+    float brightness;
+    
+    /* Effects not yet drawn into the PP frontbuffer */
+    struct PendingEffects {
+        Vec4 tone;
+        Vec4 color;
+        Vec4 flash;
+        float brightness;
+        
+        PendingEffects() : brightness(1) {}
+    } pending;
+    
+    /* Topmost element drawn in the current composition */
+    const SceneElement *lastElement;
+    bool deferring;
+    bool effectsPending;
+    
+    /* Whether the PP frontbuffer is outdated */
+    bool damaged;
 };
 
 /* Nanoseconds per second */
 #define NS_PER_S 1000000000
 
+/* Number of frame intervals frame time statistics are taken over */
+#define FRAME_STATS_N 120
+
+#if defined(__WIN32__) && !defined(CREATE_WAITABLE_TIMER_HIGH_RESOLUTION)
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
 struct FPSLimiter {
     uint64_t lastTickCount;
     
@@ -674,6 +988,10 @@ struct FPSLimiter {
     
     bool disabled;
     
+    /* Ticks per frame while running in the background,
+     * applied even when disabled. 0 if not throttled */
+    int64_t throttleTpf;
+    
     /* Data for frame timing adjustment */
     struct {
         /* Last tick count */
@@ -685,25 +1003,102 @@ struct FPSLimiter {
         bool resetFlag;
     } adj;
     
+    /* The OS sleep is asked to wake up this many ticks early,
+     * the rest of the wait is spun out. Adapts to how much
+     * the sleeps have been observed to overshoot */
+    int64_t spinMargin;
+    
+    /* Intervals between the last frames */
+    struct {
+        int64_t samples[FRAME_STATS_N];
+        size_t count;
+        size_t next;
+        uint64_t last;
+    } stats;
+    
+#ifdef __WIN32__
+    HANDLE timer;
+#endif
+    
     FPSLimiter(uint16_t desiredFPS)
     : lastTickCount(SDL_GetPerformanceCounter()),
     tickFreq(SDL_GetPerformanceFrequency()), tickFreqMS(tickFreq / 1000),
-    tickFreqNS((double)tickFreq / NS_PER_S), disabled(false) {
+    tickFreqNS((double)tickFreq / NS_PER_S), disabled(false), throttleTpf(0) {
         setDesiredFPS(desiredFPS);
         
         adj.last = SDL_GetPerformanceCounter();
         adj.idealDiff = 0;
         adj.resetFlag = false;
+        
+        spinMargin = tickFreqMS;
+        
+        stats.count = 0;
+        stats.next = 0;
+        stats.last = 0;
+        
+#ifdef __WIN32__
+        /* High resolution timers need Windows 10 1803 or later */
+        timer = CreateWaitableTimerExW(0, 0, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                       TIMER_ALL_ACCESS);
+        
+        if (!timer)
+            timer = CreateWaitableTimerW(0, TRUE, 0);
+#endif
+    }
+    
+    ~FPSLimiter() {
+#ifdef __WIN32__
+        if (timer)
+            CloseHandle(timer);
+#endif
     }
     
     void setDesiredFPS(uint16_t value) { tpf = tickFreq / value; }
     
+    /* Caps the frame rate at 'value' on top of the regular
+     * limit, 0 lifts the cap again */
+    void setThrottle(uint16_t value) {
+        int64_t newTpf = value ? tickFreq / value : 0;
+        
+        if (newTpf == throttleTpf)
+            return;
+        
+        throttleTpf = newTpf;
+        lastTickCount = SDL_GetPerformanceCounter();
+        resetFrameAdjust();
+    }
+    
+    /* Ticks per frame currently aimed for */
+    int64_t frameTicks() const {
+        if (disabled || throttleTpf > tpf)
+            return throttleTpf;
+        
+        return tpf;
+    }
+    
+    /* Waits until 'index' of 'count' evenly spaced points
+     * into the current frame, for interpolated frames */
+    void delaySubframe(int index, int count) {
+        if (disabled && !throttleTpf)
+            return;
+        
+        const int64_t target = frameTicks() * index / count - adj.idealDiff;
+        const int64_t toDelay = target - (int64_t) (SDL_GetPerformanceCounter() - lastTickCount);
+        
+        if (toDelay > 0)
+            delayTicks(toDelay);
+    }
+    
     void delay() {
-        if (disabled)
+        if (disabled && !throttleTpf) {
+            recordFrame(SDL_GetPerformanceCounter());
             return;
+        }
+        
+        const int64_t frameTpf = frameTicks();
         
         int64_t tickDelta = SDL_GetPerformanceCounter() - lastTickCount;
-        int64_t toDelay = tpf - tickDelta;
+        int64_t toDelay = frameTpf - tickDelta;
         
         /* Compensate for the last delta
          * to the ideal timestep */
@@ -718,9 +1113,11 @@ struct FPSLimiter {
         int64_t diff = now - adj.last;
         adj.last = now;
         
+        recordFrame(now);
+        
         /* Recalculate our temporal position
          * relative to the ideal timestep */
-        adj.idealDiff = diff - tpf + adj.idealDiff;
+        adj.idealDiff = diff - frameTpf + adj.idealDiff;
         
         if (adj.resetFlag) {
             adj.idealDiff = 0;
@@ -738,12 +1135,109 @@ struct FPSLimiter {
         if (disabled)
             return false;
         
-        return adj.idealDiff > tpf;
+        return adj.idealDiff > frameTicks();
+    }
+    
+    /* Ticks left until the next frame is due, as
+     * delay() would wait for them right now */
+    int64_t ticksLeft() const {
+        if (disabled)
+            return 0;
+        
+        int64_t tickDelta = SDL_GetPerformanceCounter() - lastTickCount;
+        
+        return tpf - tickDelta - adj.idealDiff;
+    }
+    
+    /* Variance of the recent frame intervals, in ms^2 */
+    double frameTimeVariance() const {
+        if (stats.count < 2)
+            return 0;
+        
+        double mean = 0;
+        
+        for (size_t i = 0; i < stats.count; ++i)
+            mean += stats.samples[i];
+        
+        mean /= stats.count;
+        
+        double sum = 0;
+        
+        for (size_t i = 0; i < stats.count; ++i) {
+            double d = stats.samples[i] - mean;
+            sum += d * d;
+        }
+        
+        const double ticksPerMS = (double) tickFreq / 1000;
+        
+        return sum / (stats.count - 1) / (ticksPerMS * ticksPerMS);
     }
     
 private:
+    void recordFrame(uint64_t now) {
+        if (stats.last != 0) {
+            stats.samples[stats.next] = now - stats.last;
+            stats.next = (stats.next + 1) % FRAME_STATS_N;
+            
+            if (stats.count < FRAME_STATS_N)
+                ++stats.count;
+        }
+        
+        stats.last = now;
+    }
+    
+    /* Sleeps through most of 'ticks', then spins until the
+     * exact deadline, as OS sleeps tend to overshoot by up
+     * to a millisecond or two */
     void delayTicks(uint64_t ticks) {
-#if defined(HAVE_NANOSLEEP)
+        const uint64_t start = SDL_GetPerformanceCounter();
+        const uint64_t deadline = start + ticks;
+        
+        if ((int64_t) ticks > spinMargin) {
+            const int64_t toSleep = ticks - spinMargin;
+            
+            sleepTicks(toSleep);
+            
+            int64_t slept = SDL_GetPerformanceCounter() - start;
+            calibrate(slept - toSleep);
+        }
+        
+        while (SDL_GetPerformanceCounter() < deadline)
+            ;
+    }
+    
+    /* Grows the spin margin right away when a sleep overshot
+     * it, and lets it decay slowly otherwise */
+    void calibrate(int64_t overshoot) {
+        const int64_t minMargin = tickFreqMS / 4;
+        const int64_t maxMargin = tickFreqMS * 4;
+        
+        /* Some headroom over the observed overshoot */
+        int64_t target = std::max<int64_t>(overshoot, 0) + tickFreqMS / 10;
+        
+        if (target > spinMargin)
+            spinMargin = target;
+        else
+            spinMargin -= (spinMargin - target) / 32;
+        
+        spinMargin = clamp(spinMargin, minMargin, maxMargin);
+    }
+    
+    void sleepTicks(uint64_t ticks) {
+#if defined(__WIN32__)
+        if (timer) {
+            /* Negative due times are relative, in 100ns units */
+            LARGE_INTEGER due;
+            due.QuadPart = -(LONGLONG) (ticks / tickFreqNS / 100);
+            
+            if (SetWaitableTimer(timer, &due, 0, 0, 0, FALSE)) {
+                WaitForSingleObject(timer, INFINITE);
+                return;
+            }
+        }
+        
+        SDL_Delay(ticks / tickFreqMS);
+#elif defined(HAVE_NANOSLEEP)
         struct timespec req;
         uint64_t nsec = ticks / tickFreqNS;
         req.tv_sec = nsec / NS_PER_S;
@@ -809,6 +1303,60 @@ struct GraphicsPrivate {
     TEXFBO frozenScene;
     Quad screenQuad;
     
+    /* A transition advanced by Graphics::update
+     * (see Graphics::beginTransition) */
+    struct {
+        bool active;
+        Bitmap *map;
+        int vague;
+        int frame;
+        int duration;
+    } trans;
+    
+    /* Internal resolution of transition frames relative
+     * to 'scRes' (see 'dynamicResolution') */
+    float transScale;
+    
+    /* Recently used transition maps, most recent first */
+    std::list<std::pair<std::string, Bitmap*> > transCache;
+    
+    /* A composed frame waits in the window backbuffer
+     * for its swap (see 'deferPresent') */
+    bool presentPending;
+    
+    /* How far the frame being drawn is between the previous
+     * and the current logical frame, and the number of update()
+     * calls so far (see 'frameInterpolation') */
+    float interpAlpha;
+    unsigned int logicFrame;
+    
+    /* GL counters of the last update() call */
+    Graphics::RenderStats renderStats;
+    Graphics::ScriptStats scriptStats;
+    
+    /* See 'frameSkip' */
+    struct {
+        /* Moving average of the ticks spent drawing a frame,
+         * or its GPU time if longer. Frame limit waits and
+         * swaps are left out */
+        int64_t drawTicks;
+        int run;
+        Graphics::FrameSkipStats stats;
+    } skip;
+    
+    /* Ring buffer, see 'Graphics::frameHistory()' */
+    std::vector<Graphics::FrameRecord> frameRecords;
+    size_t frameRecordHead;
+    size_t frameRecordCount;
+    
+    /* Time between updates (in performance counter ticks)
+     * while an input recording plays back (see 'inputReplay') */
+    struct {
+        bool active;
+        uint64_t last;
+        std::vector<uint64_t> samples;
+    } replay;
+    
     float backingScaleFactor;
     
     Vec2i integerScaleFactor;
@@ -823,6 +1371,9 @@ struct GraphicsPrivate {
     SDL_mutex *glResourceLock;
     bool multithreadedMode;
     
+    /* Thread the GL context was last made current on */
+    SDL_threadID glThread;
+    
     /* Global list of all live Disposables
      * (disposed on reset) */
     IntruList<Disposable> dispList;
@@ -830,16 +1381,18 @@ struct GraphicsPrivate {
     GraphicsPrivate(RGSSThreadData *rtData)
     : scRes(DEF_SCREEN_W, DEF_SCREEN_H), scSize(scRes),
     winSize(rtData->config.defScreenW, rtData->config.defScreenH),
-    screen(scRes.x, scRes.y), threadData(rtData),
+    screen(scRes.x, scRes.y, rtData->config.tilemapDepth), threadData(rtData),
     glCtx(SDL_GL_GetCurrentContext()), multithreadedMode(true),
     frameRate(DEF_FRAMERATE), frameCount(0), brightness(255),
     fpsLimiter(frameRate), useFrameSkip(rtData->config.frameSkip), frozen(false),
-    last_update(0), last_avg_update(0), backingScaleFactor(1), integerScaleFactor(0, 0),
+    transScale(1), presentPending(false), interpAlpha(1), logicFrame(0), renderStats(), scriptStats(), frameRecordHead(0), frameRecordCount(0), last_update(0), last_avg_update(0), backingScaleFactor(1), integerScaleFactor(0, 0),
     integerScaleActive(rtData->config.integerScaling.active),
     integerLastMileScaling(rtData->config.integerScaling.lastMileScaling) {
         avgFPSData = std::vector<double>();
+        frameRecords.resize(FRAME_HISTORY_SIZE);
         avgFPSLock = SDL_CreateMutex();
         glResourceLock = SDL_CreateMutex();
+        glThread = SDL_ThreadID();
         
         if (integerScaleActive) {
             integerScaleFactor = Vec2i(0, 0);
@@ -857,7 +1410,17 @@ struct GraphicsPrivate {
         screenQuad.setTexPosRect(screenRect, screenRect);
         
         fpsLimiter.resetFrameAdjust();
-    }
+        
+        trans.active = false;
+        trans.map = 0;
+        
+        skip.drawTicks = 0;
+        skip.run = 0;
+        skip.stats = Graphics::FrameSkipStats();
+        
+        replay.active = !rtData->config.inputReplay.empty();
+        replay.last = 0;
+    }
     
     ~GraphicsPrivate() {
         TEXFBO::fini(frozenScene);
@@ -933,9 +1496,19 @@ struct GraphicsPrivate {
         return true;
     }
     
+    /* The buffer is only allocated once a frame actually
+     * needs it, the single pass sharp scaling doesn't */
     void rebuildIntegerScaleBuffer()
     {
         TEXFBO::fini(integerScaleBuffer);
+        TEXFBO::clear(integerScaleBuffer);
+    }
+    
+    void ensureIntegerScaleBuffer()
+    {
+        if (integerScaleBuffer.tex != TEX::ID(0))
+            return;
+        
         TEXFBO::init(integerScaleBuffer);
         TEXFBO::allocEmpty(integerScaleBuffer, scRes.x * integerScaleFactor.x,
                            scRes.y * integerScaleFactor.y);
@@ -990,14 +1563,49 @@ struct GraphicsPrivate {
     }
     
     void swapGLBuffer() {
+        presentGLBuffer();
+        ++frameCount;
+    }
+    
+    /* Submits the frame in the window backbuffer, but puts off
+     * the (possibly blocking) swap until the next redraw, so the
+     * GPU can work through it while scripts run */
+    void queueGLBuffer() {
+        gl.Flush();
+        presentPending = true;
+        ++frameCount;
+    }
+    
+    /* Must be called before anything else is
+     * drawn to the window backbuffer */
+    void flushPendingPresent() {
+        if (!presentPending)
+            return;
+        
+        presentPending = false;
+        presentGLBuffer();
+    }
+    
+    void presentGLBuffer() {
         fpsLimiter.delay();
-        SDL_GL_SwapWindow(threadData->window);
         
-        ++frameCount;
+        if (threadData->config.headless) {
+            gl.Flush();
+        } else {
+            ProfileScope profile(Profiler::Swap);
+            SDL_GL_SwapWindow(threadData->window);
+        }
         
         threadData->ethread->notifyFrame();
     }
     
+    void finishFrame() {
+        if (threadData->config.deferPresent)
+            queueGLBuffer();
+        else
+            swapGLBuffer();
+    }
+    
     void compositeToBuffer(TEXFBO &buffer) {
         screen.composite();
         
@@ -1024,8 +1632,123 @@ struct GraphicsPrivate {
                               !forceNearestNeighbor && threadData->config.smoothScaling);
     }
     
-    void redrawScreen() {
-        screen.composite();
+    /* Lanczos3 still goes through the integer scale buffer */
+    bool sharpScaleApplicable() const
+    {
+        return integerScaleStepApplicable() && integerLastMileScaling
+            && !threadData->config.lanczos3Scaling;
+    }
+    
+    /* Integer upscaling, last-mile scaling and the flip
+     * done in a single draw straight to the window */
+    void drawSharpScaled() {
+        TEXFBO &source = screen.getPP().frontBuffer();
+        
+        FBO::unbind();
+        glState.viewport.pushSet(IntRect(0, 0, winSize.x, winSize.y));
+        FBO::clear();
+        
+        SharpScaleShader &shader = shState->shaders().sharpScale;
+        shader.bind();
+        shader.applyViewportProj();
+        shader.setTranslation(Vec2i());
+        shader.setTexSize(Vec2i(source.width, source.height));
+        shader.setScale(integerScaleFactor);
+        
+        TEX::bind(source.tex);
+        
+        /* Without smoothing, the shader reduces to nearest neighbor */
+        if (threadData->config.smoothScaling)
+            TEX::setSmooth(true);
+        
+        glState.blend.pushSet(false);
+        
+        Quad &quad = shState->gpQuad();
+        quad.setTexPosRect(IntRect(0, 0, scRes.x, scRes.y),
+                           IntRect(scOffset.x, scSize.y + scOffset.y, scSize.x, -scSize.y));
+        quad.draw();
+        
+        glState.blend.pop();
+        
+        if (threadData->config.smoothScaling)
+            TEX::setSmooth(false);
+        
+        glState.viewport.pop();
+    }
+    
+    /* Deferred screen effects, scaling and the flip done
+     * in a single draw straight to the window */
+    void drawEffectsScaled() {
+        TEXFBO &source = screen.getPP().frontBuffer();
+        
+        FBO::unbind();
+        glState.viewport.pushSet(IntRect(0, 0, winSize.x, winSize.y));
+        FBO::clear();
+        
+        ScreenEffectsShader &shader = screen.bindEffectsShader();
+        shader.setTexSize(Vec2i(source.width, source.height));
+        
+        TEX::bind(source.tex);
+        
+        if (threadData->config.smoothScaling)
+            TEX::setSmooth(true);
+        
+        glState.blend.pushSet(false);
+        
+        Quad &quad = shState->gpQuad();
+        quad.setTexPosRect(IntRect(0, 0, scRes.x, scRes.y),
+                           IntRect(scOffset.x, scSize.y + scOffset.y, scSize.x, -scSize.y));
+        quad.draw();
+        
+        glState.blend.pop();
+        
+        if (threadData->config.smoothScaling)
+            TEX::setSmooth(false);
+        
+        glState.viewport.pop();
+    }
+    
+    void collectRenderStats() {
+        renderStats.draws = glCounters.draws;
+        renderStats.stateChanges = glBindings.issued;
+        renderStats.stateChangesElided = glBindings.elided;
+        renderStats.fboBinds = glCounters.fboBinds;
+        renderStats.texUploads = glCounters.texUploads;
+        renderStats.texUploadBytes = glCounters.texUploadBytes;
+        renderStats.bufferUploads = glCounters.bufferUploads;
+        renderStats.bufferUploadBytes = glCounters.bufferUploadBytes;
+        
+        glCounters = GLCounters();
+        glBindings.issued = glBindings.elided = 0;
+    }
+    
+    /* Ends GPU timing of the frame and draws the profiler
+     * graph on top of the window contents */
+    void finishProfiledFrame() {
+        Profiler &profiler = shState->profiler();
+        profiler.endGPU();
+        
+        if (!profiler.isEnabled())
+            return;
+        
+        FBO::unbind();
+        profiler.drawOverlay(winSize);
+    }
+    
+    /* Draws the composited screen to the window backbuffer */
+    void blitScreenToWindow() {
+        if (screen.hasPendingEffects())
+        {
+            /* Plain scaling can take the effects along, the
+             * other paths need them in the screen buffer */
+            if (!integerScaleStepApplicable() && !threadData->config.lanczos3Scaling)
+            {
+                drawEffectsScaled();
+                return;
+            }
+            
+            screen.resolveEffects();
+        }
         
         // maybe unspaghetti this later
         if (integerScaleStepApplicable() && !integerLastMileScaling)
@@ -1037,13 +1760,18 @@ struct GraphicsPrivate {
             metaBlitBufferFlippedScaled(scRes, true);
             GLMeta::blitEnd();
             
-            swapGLBuffer();
+            return;
+        }
+        
+        if (sharpScaleApplicable())
+        {
+            drawSharpScaled();
             return;
         }
         
         if (integerScaleStepApplicable())
         {
-            assert(integerScaleBuffer.tex != TEX::ID(0));
+            ensureIntegerScaleBuffer();
             GLMeta::blitBegin(integerScaleBuffer);
             GLMeta::blitSource(screen.getPP().frontBuffer());
             
@@ -1055,12 +1783,12 @@ struct GraphicsPrivate {
         }
         
         GLMeta::blitBeginScreen(winSize);
-        //GLMeta::blitSource(screen.getPP().frontBuffer());
         
         Vec2i sourceSize;
         
         if (integerScaleActive)
         {
+            ensureIntegerScaleBuffer();
             GLMeta::blitSource(integerScaleBuffer);
             sourceSize = Vec2i(integerScaleBuffer.width, integerScaleBuffer.height);
         }
@@ -1074,8 +1802,103 @@ struct GraphicsPrivate {
         metaBlitBufferFlippedScaled(sourceSize);
         
         GLMeta::blitEnd();
+    }
+    
+    /* Number of frames to present per logical frame,
+     * more than 1 if frame interpolation applies */
+    int interpolationSubframes() const {
+        const Config &conf = threadData->config;
         
-        swapGLBuffer();
+        if (!conf.frameInterpolation || conf.headless || replay.active)
+            return 1;
+        
+        if (fpsLimiter.disabled || fpsLimiter.throttleTpf || frameRate <= 0)
+            return 1;
+        
+        const int count = (threadData->refreshRate + frameRate / 2) / frameRate;
+        
+        return clamp(count, 1, 8);
+    }
+    
+    /* Presents the frames in between the previous logical
+     * frame and this one, then this one as usual */
+    void redrawInterpolated(int subframes) {
+        /* Anything held back by deferPresent goes first */
+        flushPendingPresent();
+        
+        for (int i = 1; i < subframes; ++i) {
+            interpAlpha = (float) i / subframes;
+            
+            screen.composite(true);
+            blitScreenToWindow();
+            
+            fpsLimiter.delaySubframe(i, subframes);
+            SDL_GL_SwapWindow(threadData->window);
+            threadData->ethread->notifyFrame();
+        }
+        
+        interpAlpha = 1;
+        
+        /* The screen buffer holds an interpolated frame now */
+        redrawScreen(true);
+    }
+    
+    /* Whether the time left in this frame is predicted to be
+     * too short to draw and present it. Script time is in the
+     * elapsed part of the frame already */
+    bool frameSkipPredicted() const {
+        if (fpsLimiter.disabled || fpsLimiter.throttleTpf)
+            return false;
+        
+        if (skip.run >= std::max(threadData->config.frameSkipMax, 1))
+            return false;
+        
+        return fpsLimiter.ticksLeft() < skip.drawTicks;
+    }
+    
+    /* 'start' is when drawing of the frame began */
+    void recordDrawTime(uint64_t start) {
+        int64_t ticks = SDL_GetPerformanceCounter() - start;
+        
+        /* The GPU may well finish after the CPU is done
+         * submitting; its time shows up in the next swap */
+        const int32_t gpuUsecs = shState->profiler().lastGPUUsecs();
+        
+        if (gpuUsecs > 0)
+            ticks = std::max<int64_t>(ticks, gpuUsecs * (int64_t) fpsLimiter.tickFreq / 1000000);
+        
+        skip.drawTicks += (ticks - skip.drawTicks) / 8;
+    }
+    
+    void redrawScreen(bool forceComposite = false) {
+        uint64_t drawStart = SDL_GetPerformanceCounter();
+        shState->profiler().beginGPU();
+        
+        if (threadData->config.damageTracking && !forceComposite)
+            screen.compositeIfDamaged(true);
+        else
+            screen.composite(true);
+        
+        /* The held back frame waits for its time in here,
+         * which is not part of drawing this one */
+        const uint64_t flushStart = SDL_GetPerformanceCounter();
+        flushPendingPresent();
+        drawStart += SDL_GetPerformanceCounter() - flushStart;
+        
+        /* Nothing to show without a display, the frame
+         * stays in the screen buffer for screenshots */
+        if (threadData->config.headless) {
+            screen.resolveEffects();
+            recordDrawTime(drawStart);
+            finishFrame();
+            return;
+        }
+        
+        blitScreenToWindow();
+        
+        finishProfiledFrame();
+        recordDrawTime(drawStart);
+        finishFrame();
         
         SDL_LockMutex(avgFPSLock);
         if (avgFPSData.size() > 40)
@@ -1087,6 +1910,160 @@ struct GraphicsPrivate {
         SDL_UnlockMutex(avgFPSLock);
     }
     
+    Bitmap *transMap(const char *filename) {
+        if (!*filename)
+            return 0;
+        
+        std::list<std::pair<std::string, Bitmap*> >::iterator iter;
+        
+        for (iter = transCache.begin(); iter != transCache.end(); ++iter) {
+            if (iter->first != filename)
+                continue;
+            
+            transCache.splice(transCache.begin(), transCache, iter);
+            
+            return iter->second;
+        }
+        
+        /* Only the red channel is ever sampled */
+        Bitmap *map = new Bitmap(filename, Bitmap::StorageRedOnly);
+        
+        if (transCache.size() >= TRANS_CACHE_MAX) {
+            delete transCache.back().second;
+            transCache.pop_back();
+        }
+        
+        transCache.push_front(std::make_pair(std::string(filename), map));
+        
+        return map;
+    }
+    
+    void clearTransCache() {
+        std::list<std::pair<std::string, Bitmap*> >::iterator iter;
+        
+        for (iter = transCache.begin(); iter != transCache.end(); ++iter)
+            delete iter->second;
+        
+        transCache.clear();
+    }
+    
+    /* Size of the region of the transition buffer drawn to */
+    Vec2i transSize() const {
+        return Vec2i(std::max<int>(scRes.x * transScale, 1),
+                     std::max<int>(scRes.y * transScale, 1));
+    }
+    
+    /* Picks the internal resolution of the next transition
+     * frame from the GPU time of a recent one */
+    void updateTransScale() {
+        const int budget = threadData->config.dynamicResolution;
+        const int32_t usecs = shState->profiler().lastGPUUsecs();
+        
+        if (budget <= 0 || usecs <= 0)
+            return;
+        
+        /* The blend is fill bound, so its cost goes with the
+         * pixel count. Aim for a tenth below the budget */
+        const float fullCost = usecs / (transScale * transScale);
+        const float scale = sqrtf(budget * 900.0f / fullCost);
+        
+        /* Whole eighths, so jitter doesn't change it every frame */
+        transScale = clamp(floorf(scale * 8) / 8, 0.5f, 1.0f);
+    }
+    
+    /* Blends the frozen scene over the one in 'currentScene',
+     * drawing the result into 'transBuffer' */
+    void drawTransFrame(Bitmap *map, int vague, float prog,
+                        TEXFBO &currentScene, TEXFBO &transBuffer) {
+        shState->profiler().beginGPU();
+        
+        /* If no transition bitmap is provided,
+         * we can use a simplified shader */
+        if (map) {
+            TransShader &shader = shState->shaders().trans;
+            shader.bind();
+            shader.applyViewportProj();
+            shader.setFrozenScene(frozenScene.tex);
+            shader.setCurrentScene(currentScene.tex);
+            shader.setTransMap(map->getDrawTex().tex);
+            shader.setVague(vague / 256.0f);
+            shader.setTexSize(scRes);
+            shader.setProg(prog);
+        } else {
+            SimpleTransShader &shader = shState->shaders().simpleTrans;
+            shader.bind();
+            shader.applyViewportProj();
+            shader.setFrozenScene(frozenScene.tex);
+            shader.setCurrentScene(currentScene.tex);
+            shader.setTexSize(scRes);
+            shader.setProg(prog);
+        }
+        
+        /* Draw the composed frame to a buffer first
+         * (we need this because we're skipping PingPong) */
+        glState.blend.pushSet(false);
+        
+        FBO::bind(transBuffer.fbo);
+        FBO::clear();
+        
+        /* The projection was set up for the full resolution
+         * above, so a smaller viewport shrinks the quad into
+         * its corner (upscaled again in presentTransFrame) */
+        const Vec2i size = transSize();
+        glState.viewport.pushSet(IntRect(0, 0, size.x, size.y));
+        screenQuad.draw();
+        glState.viewport.pop();
+        
+        glState.blend.pop();
+    }
+    
+    /* Blits the result of drawTransFrame flipped
+     * and scaled to the screen */
+    void presentTransFrame(TEXFBO &transBuffer) {
+        FBO::unbind();
+        FBO::clear();
+        
+        GLMeta::blitBeginScreen(Vec2i(winSize));
+        GLMeta::blitSource(transBuffer);
+        metaBlitBufferFlippedScaled(transSize());
+        GLMeta::blitEnd();
+        
+        shState->profiler().endGPU();
+        updateTransScale();
+        
+        swapGLBuffer();
+    }
+    
+    /* One frame of a non blocking transition, blending
+     * over the scene as it currently looks */
+    void stepTransition() {
+        screen.composite();
+        
+        TEXFBO &currentScene = screen.getPP().frontBuffer();
+        TEXFBO &transBuffer = screen.getPP().backBuffer();
+        
+        const float prog = trans.frame * (1.0f / trans.duration);
+        
+        drawTransFrame(trans.map, trans.vague, prog, currentScene, transBuffer);
+        checkResize();
+        presentTransFrame(transBuffer);
+        
+        if (++trans.frame >= trans.duration)
+            endTransition();
+    }
+    
+    void endTransition() {
+        if (!trans.active)
+            return;
+        
+        trans.active = false;
+        trans.map = 0;
+        frozen = false;
+        
+        /* The last frame showed the transition, not the scene */
+        screen.damage();
+    }
+    
     void checkSyncLock() {
         if (!threadData->syncPoint.mainSyncLocked())
             return;
@@ -1116,7 +2093,22 @@ struct GraphicsPrivate {
         if (!(force || multithreadedMode)) return;
         
         SDL_LockMutex(glResourceLock);
-        SDL_GL_MakeCurrent(threadData->window, threadData->glContext);
+        
+        /* Most calls come from the thread that had it last */
+        if (SDL_ThreadID() != glThread) {
+            SDL_GL_MakeCurrent(threadData->window, threadData->glContext);
+            glThread = SDL_ThreadID();
+        }
+    }
+    
+    /* For calls that only touch state a frame reads (attributes
+     * of sprites etc.), not GL itself. Ruby threads are already
+     * serialized by the GVL, so this only keeps them from
+     * changing things while a frame is drawn without it */
+    void setStateLock() {
+        if (!multithreadedMode) return;
+        
+        SDL_LockMutex(glResourceLock);
     }
     
     void releaseLock(bool force = false) {
@@ -1136,6 +2128,10 @@ Graphics::Graphics(RGSSThreadData *data) {
     } else if (data->config.fixedFramerate < 0) {
         p->fpsLimiter.disabled = true;
     }
+    
+    /* Benchmark runs go as fast as they can */
+    if (p->replay.active)
+        p->fpsLimiter.disabled = true;
 }
 
 Graphics::~Graphics() { delete p; }
@@ -1148,9 +2144,58 @@ double Graphics::lastUpdate() {
     return p->last_update;
 }
 
+/* Accounts one Graphics::update call as a profiler frame,
+ * taking over the GL counters on the way out */
+struct ProfileUpdate {
+    GraphicsPrivate *p;
+    
+    ProfileUpdate(GraphicsPrivate *p) : p(p) { shState->profiler().beginUpdate(); }
+    
+    ~ProfileUpdate() {
+        p->collectRenderStats();
+        shState->profiler().endUpdate();
+        TRACE_FRAME();
+        
+        /* Only counts if handed in again before the next call */
+        p->scriptStats = Graphics::ScriptStats();
+    }
+};
+
 void Graphics::update(bool checkForShutdown) {
+    ProfileUpdate profile(p);
+    TRACE_ZONE("Graphics::update");
+    
     p->threadData->rqWindowAdjust.wait();
-    p->last_update = shState->runTime();
+    
+    const double now = shState->runTime();
+    
+    Graphics::FrameRecord &record = p->frameRecords[p->frameRecordHead];
+    record.frame = p->logicFrame;
+    record.frameTime = (p->last_update > 0) ? (now - p->last_update) * 1000 : 0;
+    record.script = p->scriptStats;
+    
+    p->frameRecordHead = (p->frameRecordHead + 1) % FRAME_HISTORY_SIZE;
+    p->frameRecordCount = std::min<size_t>(p->frameRecordCount + 1, FRAME_HISTORY_SIZE);
+    
+    p->last_update = now;
+    ++p->logicFrame;
+    
+    /* Nothing from the previous frame's preparation is still in use */
+    shState->frameArena().reset();
+    quadArrayTrimPools();
+    
+    if (p->replay.active) {
+        uint64_t now = SDL_GetPerformanceCounter();
+        
+        if (p->replay.last != 0)
+            p->replay.samples.push_back(now - p->replay.last);
+        
+        p->replay.last = now;
+    }
+    
+    if (p->threadData->config.backgroundFramerate > 0)
+        p->fpsLimiter.setThrottle(p->threadData->windowInBackground
+                                  ? clamp(p->threadData->config.backgroundFramerate, 1, 120) : 0);
     
     // update Input.repeat timing, rounding the framerate to the nearest 2
     {
@@ -1166,51 +2211,88 @@ void Graphics::update(bool checkForShutdown) {
     
     p->checkSyncLock();
     
+    /* Move finished screenshot / to_file readbacks on to encoding */
+    shState->bitmapLoader().update();
     
-#ifdef MKXPZ_STEAM
-    if (STEAMSHIM_alive())
-        STEAMSHIM_pump();
-#endif
+    /* Also while frozen, so images loaded behind
+     * a transition are on the GPU when it ends */
+    Bitmap::streamUploads();
+    
+    shState->checkMemoryPressure();
     
-    if (p->frozen)
+    if (p->trans.active) {
+        p->flushPendingPresent();
+        p->stepTransition();
         return;
+    }
     
-    if (p->fpsLimiter.frameSkipRequired()) {
-        if (p->useFrameSkip) {
-            /* Skip frame */
-            p->fpsLimiter.delay();
-            ++p->frameCount;
-            p->threadData->ethread->notifyFrame();
-            
-            return;
-        } else {
-            /* Just reset frame adjust counter */
-            p->fpsLimiter.resetFrameAdjust();
-        }
+    if (p->frozen) {
+        p->flushPendingPresent();
+        return;
+    }
+    
+    if (p->useFrameSkip && p->frameSkipPredicted()) {
+        /* Skip frame, but still wait for its time
+         * so the game logic keeps its pace */
+        p->flushPendingPresent();
+        p->fpsLimiter.delay();
+        ++p->frameCount;
+        p->threadData->ethread->notifyFrame();
+        
+        Graphics::FrameSkipStats &stats = p->skip.stats;
+        ++stats.skipped;
+        stats.longestRun = std::max<uint32_t>(stats.longestRun, ++p->skip.run);
+        
+        return;
     }
     
+    /* Not skipping, so if a frame or more behind,
+     * just reset frame adjust counter */
+    if (p->fpsLimiter.frameSkipRequired())
+        p->fpsLimiter.resetFrameAdjust();
+    
+    p->skip.run = 0;
+    ++p->skip.stats.drawn;
+    
     p->checkResize();
-    p->redrawScreen();
+    
+    const int subframes = p->interpolationSubframes();
+    
+    if (subframes > 1)
+        p->redrawInterpolated(subframes);
+    else
+        p->redrawScreen();
+    
+    shState->shaders().prewarmStep();
 }
 
 void Graphics::freeze() {
+    p->endTransition();
     p->frozen = true;
     
     p->checkShutDownReset();
     p->checkResize();
     
-    /* Capture scene into frozen buffer */
-    p->compositeToBuffer(p->frozenScene);
+    /* Capture scene into frozen buffer. If the last frame we drew
+     * is still current, take it over instead of drawing it again */
+    if (p->threadData->config.damageTracking && p->screen.frontBufferCurrent())
+        p->screen.takeFrontBuffer(p->frozenScene);
+    else
+        p->compositeToBuffer(p->frozenScene);
 }
 
 void Graphics::transition(int duration, const char *filename, int vague) {
     p->checkSyncLock();
+    p->endTransition();
     
     if (!p->frozen)
         return;
     
+    p->flushPendingPresent();
+    
     vague = clamp(vague, 1, 256);
-    Bitmap *transMap = *filename ? new Bitmap(filename) : 0;
+    Bitmap *transMap = p->transMap(filename);
+    p->transScale = 1;
     
     setBrightness(255);
     
@@ -1224,45 +2306,15 @@ void Graphics::transition(int duration, const char *filename, int vague) {
     TEXFBO &currentScene = p->screen.getPP().frontBuffer();
     TEXFBO &transBuffer = p->screen.getPP().backBuffer();
     
-    /* If no transition bitmap is provided,
-     * we can use a simplified shader */
-    TransShader &transShader = shState->shaders().trans;
-    SimpleTransShader &simpleShader = shState->shaders().simpleTrans;
-    
-    if (transMap) {
-        TransShader &shader = transShader;
-        shader.bind();
-        shader.applyViewportProj();
-        shader.setFrozenScene(p->frozenScene.tex);
-        shader.setCurrentScene(currentScene.tex);
-        shader.setTransMap(transMap->getGLTypes().tex);
-        shader.setVague(vague / 256.0f);
-        shader.setTexSize(p->scRes);
-    } else {
-        SimpleTransShader &shader = simpleShader;
-        shader.bind();
-        shader.applyViewportProj();
-        shader.setFrozenScene(p->frozenScene.tex);
-        shader.setCurrentScene(currentScene.tex);
-        shader.setTexSize(p->scRes);
-    }
-    
-    glState.blend.pushSet(false);
-    
     for (int i = 0; i < duration; ++i) {
-        /* We need to clean up transMap properly before
-         * a possible longjmp, so we manually test for
-         * shutdown/reset here */
+        /* Manually test for shutdown/reset here, so we
+         * don't leave a half finished transition behind */
         if (p->threadData->rqTerm) {
-            glState.blend.pop();
-            delete transMap;
             p->shutdown();
             return;
         }
         
         if (p->threadData->rqReset) {
-            glState.blend.pop();
-            delete transMap;
             scriptBinding->reset();
             return;
         }
@@ -1271,39 +2323,38 @@ void Graphics::transition(int duration, const char *filename, int vague) {
         
         const float prog = i * (1.0f / duration);
         
-        if (transMap) {
-            transShader.bind();
-            transShader.setProg(prog);
-        } else {
-            simpleShader.bind();
-            simpleShader.setProg(prog);
-        }
-        
-        /* Draw the composed frame to a buffer first
-         * (we need this because we're skipping PingPong) */
-        FBO::bind(transBuffer.fbo);
-        FBO::clear();
-        p->screenQuad.draw();
-        
+        p->drawTransFrame(transMap, vague, prog, currentScene, transBuffer);
         p->checkResize();
-        
-        /* Then blit it flipped and scaled to the screen */
-        FBO::unbind();
-        FBO::clear();
-        
-        GLMeta::blitBeginScreen(Vec2i(p->winSize));
-        GLMeta::blitSource(transBuffer);
-        p->metaBlitBufferFlippedScaled();
-        GLMeta::blitEnd();
-        
-        p->swapGLBuffer();
+        p->presentTransFrame(transBuffer);
     }
     
-    glState.blend.pop();
+    p->frozen = false;
+}
+
+void Graphics::beginTransition(int duration, const char *filename, int vague) {
+    p->checkSyncLock();
+    p->endTransition();
+    
+    if (!p->frozen)
+        return;
+    
+    if (duration <= 0) {
+        p->frozen = false;
+        return;
+    }
     
-    delete transMap;
+    p->trans.map = p->transMap(filename);
+    p->trans.vague = clamp(vague, 1, 256);
+    p->trans.frame = 0;
+    p->trans.duration = duration;
+    p->trans.active = true;
+    p->transScale = 1;
     
-    p->frozen = false;
+    setBrightness(255);
+}
+
+bool Graphics::isTransitioning() const {
+    return p->trans.active;
 }
 
 void Graphics::frameReset() {p->fpsLimiter.resetFrameAdjust();}
@@ -1331,6 +2382,18 @@ double Graphics::averageFrameRate() {
     return p->averageFPS();
 }
 
+double Graphics::frameTimeVariance() {
+    return p->fpsLimiter.frameTimeVariance();
+}
+
+double Graphics::frameTimeLeft() {
+    return (double) p->fpsLimiter.ticksLeft() / p->fpsLimiter.tickFreqMS;
+}
+
+void Graphics::presentPending() {
+    p->flushPendingPresent();
+}
+
 void Graphics::wait(int duration) {
     for (int i = 0; i < duration; ++i) {
         p->checkShutDownReset();
@@ -1348,6 +2411,8 @@ void Graphics::fadeout(int duration) {
         setBrightness(diff + (curr / duration) * i);
         
         if (p->frozen) {
+            p->flushPendingPresent();
+            
             GLMeta::blitBeginScreen(p->scSize);
             GLMeta::blitSource(p->frozenScene);
             
@@ -1373,6 +2438,8 @@ void Graphics::fadein(int duration) {
         setBrightness(curr + (diff / duration) * i);
         
         if (p->frozen) {
+            p->flushPendingPresent();
+            
             GLMeta::blitBeginScreen(p->scSize);
             GLMeta::blitSource(p->frozenScene);
             
@@ -1388,10 +2455,22 @@ void Graphics::fadein(int duration) {
     }
 }
 
-Bitmap *Graphics::snapToBitmap() {
-    Bitmap *bitmap = new Bitmap(width(), height());
+Bitmap *Graphics::snapToBitmap(bool adopt) {
+    Bitmap *bitmap;
     
-    p->compositeToBuffer(bitmap->getGLTypes());
+    if (adopt) {
+        p->screen.composite();
+        
+        /* Trade a pooled texture for the one holding the scene */
+        TEXFBO tex = shState->texPool().request(width(), height());
+        p->screen.takeFrontBuffer(tex);
+        
+        bitmap = new Bitmap(tex);
+    } else {
+        bitmap = new Bitmap(width(), height());
+        
+        p->compositeToBuffer(bitmap->getGLTypes());
+    }
     
     /* Taint entire bitmap */
     bitmap->taintArea(IntRect(0, 0, width(), height()));
@@ -1489,6 +2568,57 @@ void Graphics::playMovie(const char *filename, int volume_, bool skippable) {
     delete movie;
 }
 
+static double replayPercentile(const std::vector<uint64_t> &sorted, double q) {
+    if (sorted.empty())
+        return 0;
+    
+    size_t i = std::min(sorted.size() - 1, (size_t) (q * sorted.size()));
+    
+    return sorted[i] * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+void Graphics::finishReplay(unsigned int frames) {
+    std::vector<uint64_t> sorted = p->replay.samples;
+    std::sort(sorted.begin(), sorted.end());
+    
+    /* FNV-1a over the last composed frame, to tell
+     * whether two runs ended up drawing the same */
+    Bitmap *snap = snapToBitmap();
+    std::vector<uint8_t> pixels(width() * height() * 4);
+    snap->getRaw(pixels.data(), pixels.size());
+    snap->dispose();
+    delete snap;
+    
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        hash ^= pixels[i];
+        hash *= 0x100000001b3ULL;
+    }
+    
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "frames: %u\n"
+             "frame time (ms): p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n"
+             "checksum: %016llx\n",
+             frames,
+             replayPercentile(sorted, 0.50), replayPercentile(sorted, 0.90),
+             replayPercentile(sorted, 0.99), replayPercentile(sorted, 1.0),
+             (unsigned long long) hash);
+    
+    const std::string &path = p->threadData->config.replayReport;
+    SDL_RWops *ops = path.empty() ? 0 : SDL_RWFromFile(path.c_str(), "wb");
+    
+    if (ops) {
+        SDL_RWwrite(ops, buf, 1, strlen(buf));
+        SDL_RWclose(ops);
+    } else {
+        Debug() << "Replay finished\n" << buf;
+    }
+    
+    p->threadData->ethread->requestTerminate();
+}
+
 void Graphics::screenshot(const char *filename) {
     p->threadData->rqWindowAdjust.wait();
     Bitmap *ss = snapToBitmap();
@@ -1497,6 +2627,29 @@ void Graphics::screenshot(const char *filename) {
     delete ss;
 }
 
+BitmapLoadJob *Graphics::screenshotAsync(const char *filename) {
+    p->threadData->rqWindowAdjust.wait();
+    std::string path = shState->fileSystem().normalize(filename, 1, 1);
+    
+    Bitmap *ss = snapToBitmap();
+    BitmapLoadJob *job = 0;
+    
+    /* The readback is queued before the bitmap goes away,
+     * so deleting it right after is fine */
+    try {
+        job = shState->bitmapLoader().requestSave(*ss, path.c_str());
+    } catch (const Exception &) {
+        ss->dispose();
+        delete ss;
+        throw;
+    }
+    
+    ss->dispose();
+    delete ss;
+    
+    return job;
+}
+
 DEF_ATTR_RD_SIMPLE(Graphics, Brightness, int, p->brightness)
 
 void Graphics::setBrightness(int value) {
@@ -1510,6 +2663,8 @@ void Graphics::setBrightness(int value) {
 }
 
 void Graphics::reset() {
+    p->clearTransCache();
+    
     /* Dispose all live Disposables */
     IntruListLink<Disposable> *iter;
     
@@ -1522,8 +2677,12 @@ void Graphics::reset() {
     
     /* Reset attributes (frame count not included) */
     p->fpsLimiter.resetFrameAdjust();
+    p->trans.active = false;
+    p->trans.map = 0;
     p->frozen = false;
     p->screen.getPP().clearBuffers();
+    p->screen.damage();
+    p->screen.damage();
     
     setFrameRate(DEF_FRAMERATE);
     setBrightness(255);
@@ -1642,12 +2801,46 @@ void Graphics::setFrameskip(bool value) { p->useFrameSkip = value; }
 
 Scene *Graphics::getScreen() const { return &p->screen; }
 
+float Graphics::interpolationAlpha() const { return p->interpAlpha; }
+
+unsigned int Graphics::logicalFrame() const { return p->logicFrame; }
+
+const Graphics::RenderStats &Graphics::renderStats() const { return p->renderStats; }
+
+void Graphics::setScriptStats(const ScriptStats &stats) { p->scriptStats = stats; }
+
+const Graphics::ScriptStats &Graphics::scriptStats() const { return p->scriptStats; }
+
+void Graphics::frameHistory(std::vector<FrameRecord> &out, size_t count) const {
+    count = std::min(count, p->frameRecordCount);
+    out.resize(count);
+    
+    for (size_t i = 0; i < count; ++i)
+        out[i] = p->frameRecords[(p->frameRecordHead + FRAME_HISTORY_SIZE - count + i) % FRAME_HISTORY_SIZE];
+}
+
+Graphics::FrameSkipStats Graphics::frameSkipStats() const {
+    FrameSkipStats stats = p->skip.stats;
+    stats.drawEstimate = (double) p->skip.drawTicks / p->fpsLimiter.tickFreqMS;
+    
+    return stats;
+}
+
 void Graphics::repaintWait(const AtomicFlag &exitCond, bool checkReset) {
     if (exitCond)
         return;
     
-    /* Repaint the screen with the last good frame we drew */
-    TEXFBO &lastFrame = p->screen.getPP().frontBuffer();
+    p->flushPendingPresent();
+    
+    /* Repaint the screen with the last good frame we drew
+     * (while frozen, the PP frontbuffer may have been traded
+     * away, see 'freeze()') */
+    const bool onlyFrozen = p->frozen && !p->trans.active;
+    
+    if (!onlyFrozen)
+        p->screen.resolveEffects();
+    
+    TEXFBO &lastFrame = onlyFrozen ? p->frozenScene : p->screen.getPP().frontBuffer();
     GLMeta::blitBeginScreen(p->winSize);
     GLMeta::blitSource(lastFrame);
     
@@ -1659,7 +2852,8 @@ void Graphics::repaintWait(const AtomicFlag &exitCond, bool checkReset) {
         
         FBO::clear();
         p->metaBlitBufferFlippedScaled();
-        SDL_GL_SwapWindow(p->threadData->window);
+        if (!p->threadData->config.headless)
+            SDL_GL_SwapWindow(p->threadData->window);
         p->fpsLimiter.delay();
         
         p->threadData->ethread->notifyFrame();
@@ -1676,6 +2870,14 @@ void Graphics::unlock(bool force) {
     p->releaseLock(force);
 }
 
+void Graphics::lockState() {
+    p->setStateLock();
+}
+
+void Graphics::unlockState() {
+    p->releaseLock();
+}
+
 void Graphics::addDisposable(Disposable *d) { p->dispList.append(d->link); }
 
 void Graphics::remDisposable(Disposable *d) { p->dispList.remove(d->link); }
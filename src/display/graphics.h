@@ -24,6 +24,9 @@
 
 #include "util.h"
 
+#include <stdint.h>
+#include <vector>
+
 class Scene;
 class Bitmap;
 class Disposable;
@@ -32,6 +35,7 @@ struct GraphicsPrivate;
 struct AtomicFlag;
 struct THEORAPLAY_VideoFrame;
 struct Movie;
+struct BitmapLoadJob;
 
 class Graphics
 {
@@ -44,6 +48,13 @@ public:
 	void transition(int duration = 8,
 	                const char *filename = "",
 	                int vague = 40);
+	/* Like transition(), but returns right away. The transition
+	 * then advances one frame per update() call, drawn over the
+	 * scene as it looks at that time */
+	void beginTransition(int duration = 8,
+	                     const char *filename = "",
+	                     int vague = 40);
+	bool isTransitioning() const;
 	void frameReset();
 
 	DECL_ATTR( FrameRate,  int )
@@ -54,7 +65,9 @@ public:
 	void fadeout(int duration);
 	void fadein(int duration);
 
-	Bitmap *snapToBitmap();
+	/* With 'adopt', the bitmap takes over the screen buffer
+	 * the scene was just drawn into instead of copying it */
+	Bitmap *snapToBitmap(bool adopt = false);
 
 	int width() const;
 	int height() const;
@@ -66,6 +79,9 @@ public:
 	bool updateMovieInput(Movie *movie);
 	void playMovie(const char *filename, int volume, bool skippable);
 	void screenshot(const char *filename);
+	/* Returns as soon as the frame is queued for saving,
+	 * see BitmapLoader::requestSave() */
+	BitmapLoadJob *screenshotAsync(const char *filename);
 
 	void reset();
     void center();
@@ -81,9 +97,85 @@ public:
     DECL_ATTR( LastMileScaling, bool )
     DECL_ATTR( Threadsafe, bool )
     double averageFrameRate();
+    /* Variance (in ms^2) of the time between recent frames */
+    double frameTimeVariance();
+    /* Time (in ms) left until the next frame is due, 0 or
+     * less when late or without a frame rate limit */
+    double frameTimeLeft();
+    
+    /* Shows the frame held back by deferPresent now,
+     * waiting for the frame rate limit first */
+    void presentPending();
+    
+    /* Reports the frame times and a checksum of the final
+     * frame of an input replay, then asks the game to quit */
+    void finishReplay(unsigned int frames);
+
+	/* GL work issued during the last update() call, including
+	 * anything drawn since the one before (eg. transitions) */
+	struct RenderStats
+	{
+		uint32_t draws;
+		/* Binds and state changes made / skipped by the caches */
+		uint32_t stateChanges;
+		uint32_t stateChangesElided;
+		uint32_t fboBinds;
+		uint32_t texUploads;
+		uint64_t texUploadBytes;
+		uint32_t bufferUploads;
+		uint64_t bufferUploadBytes;
+	};
+
+	const RenderStats &renderStats() const;
+
+	/* Ruby GC activity since the previous update() call,
+	 * handed in by the binding right before each call */
+	struct ScriptStats
+	{
+		uint32_t minorGCs;
+		uint32_t majorGCs;
+		uint64_t allocatedObjects;
+		/* Heap pages gained, negative if freed */
+		int32_t heapPages;
+	};
+
+	void setScriptStats(const ScriptStats &stats);
+	const ScriptStats &scriptStats() const;
+
+	/* One update() call, see 'frameHistory()' */
+	struct FrameRecord
+	{
+		unsigned int frame;
+		/* Since the previous update() call, in ms */
+		double frameTime;
+		ScriptStats script;
+	};
+
+	/* The last 'count' (at most a few hundred)
+	 * update() calls, oldest first */
+	void frameHistory(std::vector<FrameRecord> &out, size_t count) const;
+
+	/* Skipping by 'frameSkip' so far */
+	struct FrameSkipStats
+	{
+		uint64_t skipped;
+		uint64_t drawn;
+		/* Most frames skipped in a row */
+		uint32_t longestRun;
+		/* Predicted time to draw and present a frame, in ms */
+		double drawEstimate;
+	};
+
+	FrameSkipStats frameSkipStats() const;
 
 	/* <internal> */
 	Scene *getScreen() const;
+	/* How far the frame being drawn lies between the previous
+	 * and the current logical frame, in (0, 1]. Always 1 unless
+	 * frame interpolation is running */
+	float interpolationAlpha() const;
+	/* Number of update() calls so far, never reset */
+	unsigned int logicalFrame() const;
 	/* Repaint screen with static image until exitCond
 	 * is set. Observes reset flag on top of shutdown
 	 * if "checkReset" */
@@ -92,6 +184,10 @@ public:
     
     void lock(bool force = false);
     void unlock(bool force = false);
+    
+    /* Same lock, without the GL context; see GFX_STATE_LOCK */
+    void lockState();
+    void unlockState();
 
 private:
 	Graphics(RGSSThreadData *data);
@@ -109,4 +205,10 @@ private:
 #define GFX_LOCK shState->graphics().lock()
 #define GFX_UNLOCK shState->graphics().unlock()
 
+/* For operations that don't touch GL, only state read while
+ * a frame is drawn (eg. sprite attributes), so they don't
+ * have to make the GL context current on the calling thread */
+#define GFX_STATE_LOCK shState->graphics().lockState()
+#define GFX_STATE_UNLOCK shState->graphics().unlockState()
+
 #endif // GRAPHICS_H
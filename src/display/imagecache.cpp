@@ -0,0 +1,215 @@
+/*
+** imagecache.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "imagecache.h"
+
+#include "sharedstate.h"
+#include "config.h"
+#include "filesystem.h"
+#include "debugwriter.h"
+
+#include <SDL_rwops.h>
+#include <SDL_surface.h>
+
+#include <physfs.h>
+
+#include <stdio.h>
+#include <string.h>
+
+/* Entry layout (little endian):
+ *   char[8]  magic
+ *   uint32   width, height
+ *   int64    mtime
+ *   uint32   key length, followed by the key itself
+ *   uint8[]  width * height * 4 bytes of ABGR8888 pixels */
+static const char entryMagic[8] = { 'M', 'K', 'X', 'P', 'I', 'M', 'G', '1' };
+
+/* Guards against reading absurd sizes from corrupted entries */
+static const uint32_t maxDimension = 1 << 15;
+
+static std::string keyString(const ImageCacheKey &key)
+{
+	return key.archive + '\n' + key.path;
+}
+
+static std::string cacheDir()
+{
+	return shState->config().customDataPath + "/ImageCache";
+}
+
+static std::string entryPath(const ImageCacheKey &key)
+{
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const std::string str = keyString(key);
+
+	for (size_t i = 0; i < str.size(); ++i)
+	{
+		hash ^= (uint8_t) str[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long) hash);
+
+	return cacheDir() + "/" + name;
+}
+
+bool ImageCache::makeKey(const char *fullPath, ImageCacheKey &key)
+{
+	PHYSFS_Stat stat;
+
+	if (!PHYSFS_stat(fullPath, &stat))
+		return false;
+
+	const char *archive = PHYSFS_getRealDir(fullPath);
+
+	key.path = fullPath;
+	key.archive = archive ? archive : "";
+	key.mtime = stat.modtime;
+
+	return true;
+}
+
+SDL_Surface *ImageCache::load(const ImageCacheKey &key)
+{
+	SDL_RWops *ops = SDL_RWFromFile(entryPath(key).c_str(), "rb");
+
+	if (!ops)
+		return 0;
+
+	SDL_Surface *surf = 0;
+	char magic[sizeof(entryMagic)];
+
+	if (SDL_RWread(ops, magic, sizeof(magic), 1) != 1 ||
+	    memcmp(magic, entryMagic, sizeof(magic)))
+	{
+		SDL_RWclose(ops);
+		return 0;
+	}
+
+	uint32_t width = SDL_ReadLE32(ops);
+	uint32_t height = SDL_ReadLE32(ops);
+	int64_t mtime = (int64_t) SDL_ReadLE64(ops);
+	uint32_t keySize = SDL_ReadLE32(ops);
+
+	const std::string expKey = keyString(key);
+
+	if (mtime != key.mtime || keySize != expKey.size() ||
+	    width == 0 || height == 0 ||
+	    width > maxDimension || height > maxDimension)
+	{
+		SDL_RWclose(ops);
+		return 0;
+	}
+
+	std::string entryKey(keySize, '\0');
+
+	if (keySize > 0 && SDL_RWread(ops, &entryKey[0], keySize, 1) != 1)
+	{
+		SDL_RWclose(ops);
+		return 0;
+	}
+
+	if (entryKey != expKey)
+	{
+		SDL_RWclose(ops);
+		return 0;
+	}
+
+	surf = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ABGR8888);
+
+	if (!surf)
+	{
+		SDL_RWclose(ops);
+		return 0;
+	}
+
+	const size_t rowSize = width * 4;
+	bool ok = true;
+
+	if ((size_t) surf->pitch == rowSize)
+	{
+		ok = SDL_RWread(ops, surf->pixels, rowSize * height, 1) == 1;
+	}
+	else
+	{
+		for (uint32_t y = 0; y < height && ok; ++y)
+		{
+			uint8_t *row = (uint8_t*) surf->pixels + y * surf->pitch;
+			ok = SDL_RWread(ops, row, rowSize, 1) == 1;
+		}
+	}
+
+	SDL_RWclose(ops);
+
+	if (!ok)
+	{
+		SDL_FreeSurface(surf);
+		return 0;
+	}
+
+	return surf;
+}
+
+void ImageCache::store(const ImageCacheKey &key, SDL_Surface *surf)
+{
+	if (surf->format->format != SDL_PIXELFORMAT_ABGR8888)
+		return;
+
+	static bool haveDir = false;
+
+	if (!haveDir)
+	{
+		haveDir = mkxp_fs::createDirectories(cacheDir().c_str());
+
+		if (!haveDir)
+			return;
+	}
+
+	const std::string path = entryPath(key);
+	SDL_RWops *ops = SDL_RWFromFile(path.c_str(), "wb");
+
+	if (!ops)
+		return;
+
+	const std::string keyStr = keyString(key);
+	const size_t rowSize = surf->w * 4;
+
+	bool ok = SDL_RWwrite(ops, entryMagic, sizeof(entryMagic), 1) == 1;
+	ok = ok && SDL_WriteLE32(ops, surf->w);
+	ok = ok && SDL_WriteLE32(ops, surf->h);
+	ok = ok && SDL_WriteLE64(ops, (uint64_t) key.mtime);
+	ok = ok && SDL_WriteLE32(ops, keyStr.size());
+	ok = ok && SDL_RWwrite(ops, keyStr.c_str(), keyStr.size(), 1) == 1;
+
+	for (int y = 0; y < surf->h && ok; ++y)
+	{
+		const uint8_t *row = (const uint8_t*) surf->pixels + y * surf->pitch;
+		ok = SDL_RWwrite(ops, row, rowSize, 1) == 1;
+	}
+
+	SDL_RWclose(ops);
+
+	if (!ok)
+	{
+		Debug() << "Failed to write image cache entry for" << key.path;
+		remove(path.c_str());
+	}
+}
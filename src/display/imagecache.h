@@ -0,0 +1,55 @@
+/*
+** imagecache.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <stdint.h>
+#include <string>
+
+struct SDL_Surface;
+
+/* Identifies one particular version of an image file
+ * inside the mounted game file system */
+struct ImageCacheKey
+{
+	/* Full PhysFS path of the file */
+	std::string path;
+	/* Archive or directory the file was found in */
+	std::string archive;
+	int64_t mtime;
+};
+
+/* Persistent on-disk cache of decoded images. Entries hold the
+ * raw ABGR8888 pixels, so loading one skips the image decoder
+ * entirely. Stale entries are simply overwritten on next store */
+namespace ImageCache
+{
+	/* Returns false if the file cannot be stat'ed */
+	bool makeKey(const char *fullPath, ImageCacheKey &key);
+
+	/* Returns a new ABGR8888 surface, or null if
+	 * there is no valid entry for 'key' */
+	SDL_Surface *load(const ImageCacheKey &key);
+
+	/* 'surf' must be in ABGR8888 format */
+	void store(const ImageCacheKey &key, SDL_Surface *surf);
+}
+
+#endif // IMAGECACHE_H
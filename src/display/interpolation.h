@@ -0,0 +1,75 @@
+/*
+** interpolation.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INTERPOLATION_H
+#define INTERPOLATION_H
+
+#include "etc-internal.h"
+#include "graphics.h"
+#include "sharedstate.h"
+
+#include <math.h>
+
+/* Moves of more than this many pixels in one
+ * logical frame are taken as jumps and not blended */
+#define INTERP_MAX_STEP 64
+
+/* Tracks where an element was drawn in the previous logical
+ * frame, so frames presented in between two Graphics.update
+ * calls can show it part of the way (see 'frameInterpolation') */
+struct FrameInterpolator
+{
+	Vec2 prev;
+	Vec2 cur;
+	unsigned int frame;
+
+	FrameInterpolator()
+	    : frame(0)
+	{}
+
+	/* 'value' is the current logical position. Must be
+	 * called on every draw to keep track of the frames */
+	Vec2 get(const Vec2 &value)
+	{
+		Graphics &graphics = shState->graphics();
+		const unsigned int now = graphics.logicalFrame();
+
+		if (frame != now)
+		{
+			/* Not drawn last frame, nothing to blend from */
+			prev = (frame + 1 == now) ? cur : value;
+			cur = value;
+			frame = now;
+		}
+
+		const float alpha = graphics.interpolationAlpha();
+
+		if (alpha >= 1)
+			return value;
+
+		const Vec2 delta(value.x - prev.x, value.y - prev.y);
+
+		if (fabsf(delta.x) > INTERP_MAX_STEP || fabsf(delta.y) > INTERP_MAX_STEP)
+			return value;
+
+		return Vec2(prev.x + delta.x * alpha, prev.y + delta.y * alpha);
+	}
+};
+
+#endif // INTERPOLATION_H
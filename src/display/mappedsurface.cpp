@@ -0,0 +1,220 @@
+/*
+** mappedsurface.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "mappedsurface.h"
+
+#include "debugwriter.h"
+
+#include <SDL_surface.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef __WIN32__
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+/* Stored in the surface's 'userdata' */
+struct Mapping
+{
+	void *base;
+	size_t size;
+
+#ifdef __WIN32__
+	HANDLE handle;
+#endif
+};
+
+static void *mapPixels(Mapping &m)
+{
+#ifdef __WIN32__
+	/* Backed by the page file, which written out
+	 * pages are discarded to just like a real file */
+	const uint64_t size = m.size;
+	m.handle = CreateFileMappingW(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE,
+	                              (DWORD) (size >> 32), (DWORD) size, 0);
+
+	if (!m.handle)
+		return 0;
+
+	void *base = MapViewOfFile(m.handle, FILE_MAP_ALL_ACCESS, 0, 0, m.size);
+
+	if (!base)
+		CloseHandle(m.handle);
+
+	return base;
+#else
+	/* The file is unlinked right away, the mapping keeps it alive */
+	FILE *f = tmpfile();
+
+	if (!f)
+		return 0;
+
+	void *base = 0;
+
+	if (ftruncate(fileno(f), m.size) == 0)
+	{
+		base = mmap(0, m.size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(f), 0);
+
+		if (base == MAP_FAILED)
+			base = 0;
+	}
+
+	fclose(f);
+
+	return base;
+#endif
+}
+
+static void unmapPixels(Mapping &m)
+{
+#ifdef __WIN32__
+	UnmapViewOfFile(m.base);
+	CloseHandle(m.handle);
+#else
+	munmap(m.base, m.size);
+#endif
+}
+
+/* Page aligned byte range covering rows [y, y+h) */
+static bool rowRange(SDL_Surface *surf, int y, int h, char *&start, size_t &len)
+{
+	Mapping *m = static_cast<Mapping*>(surf->userdata);
+
+	if (!m || h <= 0)
+		return false;
+
+#ifdef __WIN32__
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	const size_t pageSize = info.dwPageSize;
+#else
+	const size_t pageSize = sysconf(_SC_PAGESIZE);
+#endif
+
+	char *base = static_cast<char*>(m->base);
+	size_t begin = (size_t) y * surf->pitch;
+	size_t end = std::min((size_t) (y + h) * surf->pitch, m->size);
+
+	begin -= begin % pageSize;
+
+	if (begin >= end)
+		return false;
+
+	start = base + begin;
+	len = end - begin;
+
+	return true;
+}
+
+SDL_Surface *MappedSurface::create(SDL_Surface *surf)
+{
+	Mapping *m = new Mapping;
+	m->size = (size_t) surf->pitch * surf->h;
+	m->base = mapPixels(*m);
+
+	if (!m->base)
+	{
+		Debug() << "Failed to map surface pixels, keeping them in RAM";
+		delete m;
+
+		return 0;
+	}
+
+	SDL_Surface *mapped =
+		SDL_CreateRGBSurfaceWithFormatFrom(m->base, surf->w, surf->h,
+		                                   surf->format->BitsPerPixel, surf->pitch,
+		                                   surf->format->format);
+
+	if (!mapped)
+	{
+		unmapPixels(*m);
+		delete m;
+
+		return 0;
+	}
+
+	mapped->userdata = m;
+	memcpy(m->base, surf->pixels, m->size);
+
+	/* Everything was just written, none of it is needed yet */
+	dontNeed(mapped, 0, mapped->h);
+
+	return mapped;
+}
+
+bool MappedSurface::isMapped(SDL_Surface *surf)
+{
+	return surf->userdata != 0;
+}
+
+void MappedSurface::free(SDL_Surface *surf)
+{
+	Mapping *m = static_cast<Mapping*>(surf->userdata);
+
+	SDL_FreeSurface(surf);
+
+	if (!m)
+		return;
+
+	unmapPixels(*m);
+	delete m;
+}
+
+void MappedSurface::willNeed(SDL_Surface *surf, int y, int h)
+{
+	char *start;
+	size_t len;
+
+	if (!rowRange(surf, y, h, start, len))
+		return;
+
+#ifdef __WIN32__
+	/* PrefetchVirtualMemory is not available everywhere,
+	 * the rows are simply faulted in on access */
+	(void) start;
+	(void) len;
+#else
+	madvise(start, len, MADV_WILLNEED);
+#endif
+}
+
+void MappedSurface::dontNeed(SDL_Surface *surf, int y, int h)
+{
+	char *start;
+	size_t len;
+
+	if (!rowRange(surf, y, h, start, len))
+		return;
+
+#ifdef __WIN32__
+	/* Unlocking pages that aren't locked
+	 * removes them from the working set */
+	VirtualUnlock(start, len);
+#else
+	/* Contents stay in the backing file */
+	madvise(start, len, MADV_DONTNEED);
+#endif
+}
@@ -0,0 +1,46 @@
+/*
+** mappedsurface.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAPPEDSURFACE_H
+#define MAPPEDSURFACE_H
+
+struct SDL_Surface;
+
+/* Surfaces whose pixels live in a temporary file mapped into
+ * memory. The OS pages rows in when they are read, and can drop
+ * them again under memory pressure without touching swap */
+namespace MappedSurface
+{
+	/* Returns a mapped copy of 'surf', or null if mapping
+	 * is not possible. 'surf' itself is left untouched */
+	SDL_Surface *create(SDL_Surface *surf);
+
+	bool isMapped(SDL_Surface *surf);
+
+	/* Also works on regular surfaces */
+	void free(SDL_Surface *surf);
+
+	/* Hint that rows [y, y+h) are about to be read */
+	void willNeed(SDL_Surface *surf, int y, int h);
+
+	/* Drops rows [y, y+h) from the resident set */
+	void dontNeed(SDL_Surface *surf, int y, int h);
+}
+
+#endif // MAPPEDSURFACE_H
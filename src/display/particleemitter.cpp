@@ -0,0 +1,463 @@
+/*
+** particleemitter.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "particleemitter.h"
+
+#include "sharedstate.h"
+#include "bitmap.h"
+#include "etc.h"
+#include "util.h"
+
+#include "gl-util.h"
+#include "quad.h"
+#include "quadarray.h"
+#include "etc-internal.h"
+#include "shader.h"
+#include "glstate.h"
+#include "preparable.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+/* Hard cap on 'max_particles', keeps the vertex
+ * buffer within a sane size */
+#define PARTICLES_LIMIT 65536
+
+struct ParticleEmitterPrivate : public Preparable
+{
+	Bitmap *bitmap;
+
+	float x, y;
+	float rate;
+	int life, lifeVar;
+	float speed, speedVar;
+	float direction, spread;
+	float gravityX, gravityY;
+	float zoomStart, zoomEnd;
+
+	Color *startColor;
+	Color *endColor;
+
+	BlendType blendType;
+	int maxParticles;
+
+	/* Particle state, one entry per live particle.
+	 * Kept as separate arrays so the update loops
+	 * run over tightly packed floats */
+	std::vector<float> px, py;
+	std::vector<float> vx, vy;
+	std::vector<int32_t> age, ttl;
+
+	/* Fractional particles carried over between updates */
+	float spawnAcc;
+
+	uint32_t rng;
+
+	Vec2i sceneOffset;
+
+	bool quadsDirty;
+
+	ColorQuadArray qArray;
+
+	EtcTemps tmp;
+
+	ParticleEmitterPrivate()
+	    : bitmap(0),
+	      x(0), y(0),
+	      rate(0),
+	      life(60), lifeVar(0),
+	      speed(1), speedVar(0),
+	      direction(90), spread(0),
+	      gravityX(0), gravityY(0),
+	      zoomStart(1), zoomEnd(1),
+	      startColor(&tmp.color),
+	      endColor(&tmp.color),
+	      blendType(BlendNormal),
+	      maxParticles(1024),
+	      spawnAcc(0),
+	      rng(0x9E3779B9u ^ (uint32_t) (uintptr_t) this),
+	      quadsDirty(false)
+	{}
+
+	void invalidateQuads()
+	{
+		quadsDirty = true;
+		requestPrepare();
+	}
+
+	size_t count() const
+	{
+		return px.size();
+	}
+
+	/* xorshift32, uniform in [0, 1) */
+	float random()
+	{
+		rng ^= rng << 13;
+		rng ^= rng >> 17;
+		rng ^= rng << 5;
+
+		return (rng >> 8) * (1.0f / 16777216.0f);
+	}
+
+	/* Uniform in [-1, 1) */
+	float randomSigned()
+	{
+		return random() * 2.0f - 1.0f;
+	}
+
+	void spawn(int n)
+	{
+		n = std::min<int>(n, maxParticles - (int) count());
+
+		if (n <= 0)
+			return;
+
+		const float degToRad = M_PI / 180.0f;
+
+		for (int i = 0; i < n; ++i)
+		{
+			float angle = (direction + spread * randomSigned() * 0.5f) * degToRad;
+			float v = speed + speedVar * randomSigned();
+			int t = life + (int) (lifeVar * randomSigned());
+
+			px.push_back(x);
+			py.push_back(y);
+
+			/* Screen Y grows downwards */
+			vx.push_back( cosf(angle) * v);
+			vy.push_back(-sinf(angle) * v);
+
+			age.push_back(0);
+			ttl.push_back(std::max(t, 1));
+		}
+
+		invalidateQuads();
+	}
+
+	void step()
+	{
+		const size_t n = count();
+
+		float *_px = dataPtr(px), *_py = dataPtr(py);
+		float *_vx = dataPtr(vx), *_vy = dataPtr(vy);
+		int32_t *_age = dataPtr(age);
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			_vx[i] += gravityX;
+			_vy[i] += gravityY;
+			_px[i] += _vx[i];
+			_py[i] += _vy[i];
+			_age[i] += 1;
+		}
+
+		/* Drop expired particles, filling their
+		 * place with the last one */
+		for (size_t i = 0; i < px.size();)
+		{
+			if (age[i] < ttl[i])
+			{
+				++i;
+				continue;
+			}
+
+			px[i] = px.back(); px.pop_back();
+			py[i] = py.back(); py.pop_back();
+			vx[i] = vx.back(); vx.pop_back();
+			vy[i] = vy.back(); vy.pop_back();
+			age[i] = age.back(); age.pop_back();
+			ttl[i] = ttl.back(); ttl.pop_back();
+		}
+
+		if (n > 0)
+			invalidateQuads();
+	}
+
+	void clear()
+	{
+		px.clear();
+		py.clear();
+		vx.clear();
+		vy.clear();
+		age.clear();
+		ttl.clear();
+
+		invalidateQuads();
+	}
+
+	void truncate(size_t n)
+	{
+		if (count() <= n)
+			return;
+
+		px.resize(n);
+		py.resize(n);
+		vx.resize(n);
+		vy.resize(n);
+		age.resize(n);
+		ttl.resize(n);
+
+		invalidateQuads();
+	}
+
+	void updateQuads()
+	{
+		const size_t n = count();
+
+		qArray.resize(n);
+
+		if (n == 0 || nullOrDisposed(bitmap))
+		{
+			qArray.clear();
+			return;
+		}
+
+		const FloatRect tex = bitmap->rect();
+		const float hw = tex.w * 0.5f;
+		const float hh = tex.h * 0.5f;
+
+		const Vec4 &c0 = startColor->norm;
+		const Vec4 &c1 = endColor->norm;
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			const float t = (float) age[i] / ttl[i];
+			const float zoom = zoomStart + (zoomEnd - zoomStart) * t;
+
+			const Vec4 color(c0.x + (c1.x - c0.x) * t,
+			                 c0.y + (c1.y - c0.y) * t,
+			                 c0.z + (c1.z - c0.z) * t,
+			                 c0.w + (c1.w - c0.w) * t);
+
+			Vertex *vert = &qArray.vertices[i*4];
+			FloatRect pos(px[i] - hw * zoom, py[i] - hh * zoom,
+			              tex.w * zoom, tex.h * zoom);
+
+			Quad::setTexPosRect(vert, tex, pos);
+			Quad::setColor(vert, color);
+		}
+
+		qArray.commit();
+	}
+
+	bool prepare()
+	{
+		if (quadsDirty)
+		{
+			updateQuads();
+			quadsDirty = false;
+		}
+
+		return false;
+	}
+};
+
+ParticleEmitter::ParticleEmitter(Viewport *viewport)
+    : ViewportElement(viewport)
+{
+	p = new ParticleEmitterPrivate();
+
+	onGeometryChange(scene->getGeometry());
+}
+
+ParticleEmitter::~ParticleEmitter()
+{
+	dispose();
+}
+
+DEF_ATTR_RD_SIMPLE(ParticleEmitter, Bitmap,       Bitmap*, p->bitmap)
+DEF_ATTR_RD_SIMPLE(ParticleEmitter, ZoomStart,    float,   p->zoomStart)
+DEF_ATTR_RD_SIMPLE(ParticleEmitter, ZoomEnd,      float,   p->zoomEnd)
+DEF_ATTR_RD_SIMPLE(ParticleEmitter, BlendType,    int,     p->blendType)
+DEF_ATTR_RD_SIMPLE(ParticleEmitter, MaxParticles, int,     p->maxParticles)
+
+DEF_ATTR_SIMPLE(ParticleEmitter, X,          float,  p->x)
+DEF_ATTR_SIMPLE(ParticleEmitter, Y,          float,  p->y)
+DEF_ATTR_SIMPLE(ParticleEmitter, Rate,       float,  p->rate)
+DEF_ATTR_SIMPLE(ParticleEmitter, Life,       int,    p->life)
+DEF_ATTR_SIMPLE(ParticleEmitter, LifeVar,    int,    p->lifeVar)
+DEF_ATTR_SIMPLE(ParticleEmitter, Speed,      float,  p->speed)
+DEF_ATTR_SIMPLE(ParticleEmitter, SpeedVar,   float,  p->speedVar)
+DEF_ATTR_SIMPLE(ParticleEmitter, Direction,  float,  p->direction)
+DEF_ATTR_SIMPLE(ParticleEmitter, Spread,     float,  p->spread)
+DEF_ATTR_SIMPLE(ParticleEmitter, GravityX,   float,  p->gravityX)
+DEF_ATTR_SIMPLE(ParticleEmitter, GravityY,   float,  p->gravityY)
+
+DEF_ATTR_SIMPLE(ParticleEmitter, StartColor, Color&, *p->startColor)
+DEF_ATTR_SIMPLE(ParticleEmitter, EndColor,   Color&, *p->endColor)
+
+int ParticleEmitter::getCount() const
+{
+	guardDisposed();
+
+	return p->count();
+}
+
+void ParticleEmitter::update()
+{
+	guardDisposed();
+
+	bool had = p->count() > 0;
+
+	p->step();
+
+	p->spawnAcc += p->rate;
+
+	if (p->spawnAcc >= 1)
+	{
+		int n = (int) p->spawnAcc;
+		p->spawnAcc -= n;
+		p->spawn(n);
+	}
+
+	if (had || p->count() > 0)
+		damage();
+}
+
+void ParticleEmitter::emit(int count)
+{
+	guardDisposed();
+
+	p->spawn(count);
+
+	damage();
+}
+
+void ParticleEmitter::clear()
+{
+	guardDisposed();
+
+	if (p->count() == 0)
+		return;
+
+	p->clear();
+
+	damage();
+}
+
+void ParticleEmitter::setBitmap(Bitmap *value)
+{
+	guardDisposed();
+
+	if (p->bitmap == value)
+		return;
+
+	damage();
+
+	p->bitmap = value;
+	p->invalidateQuads();
+
+	if (!value)
+		return;
+
+	value->ensureNonMega();
+}
+
+void ParticleEmitter::setZoomStart(float value)
+{
+	guardDisposed();
+
+	if (p->zoomStart == value)
+		return;
+
+	p->zoomStart = value;
+	p->invalidateQuads();
+}
+
+void ParticleEmitter::setZoomEnd(float value)
+{
+	guardDisposed();
+
+	if (p->zoomEnd == value)
+		return;
+
+	p->zoomEnd = value;
+	p->invalidateQuads();
+}
+
+void ParticleEmitter::setBlendType(int value)
+{
+	guardDisposed();
+	damage();
+
+	switch (value)
+	{
+	default :
+	case BlendNormal :
+		p->blendType = BlendNormal;
+		return;
+	case BlendAddition :
+		p->blendType = BlendAddition;
+		return;
+	case BlendSubstraction :
+		p->blendType = BlendSubstraction;
+		return;
+	}
+}
+
+void ParticleEmitter::setMaxParticles(int value)
+{
+	guardDisposed();
+
+	p->maxParticles = clamp(value, 0, PARTICLES_LIMIT);
+	p->truncate(p->maxParticles);
+}
+
+void ParticleEmitter::initDynAttribs()
+{
+	p->startColor = new Color(255, 255, 255, 255);
+	p->endColor = new Color(255, 255, 255, 0);
+}
+
+void ParticleEmitter::draw()
+{
+	if (p->qArray.count() == 0)
+		return;
+
+	if (nullOrDisposed(p->bitmap))
+		return;
+
+	ParticleShader &shader = shState->shaders().particle;
+
+	shader.bind();
+	shader.applyViewportProj();
+	shader.setTranslation(p->sceneOffset);
+
+	glState.blendMode.pushSet(p->blendType);
+
+	p->bitmap->bindTex(shader);
+
+	p->qArray.draw();
+
+	glState.blendMode.pop();
+}
+
+void ParticleEmitter::onGeometryChange(const Scene::Geometry &geo)
+{
+	p->sceneOffset = geo.offset();
+}
+
+void ParticleEmitter::releaseResources()
+{
+	unlink();
+
+	delete p;
+}
@@ -0,0 +1,87 @@
+/*
+** particleemitter.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PARTICLEEMITTER_H
+#define PARTICLEEMITTER_H
+
+#include "disposable.h"
+#include "viewport.h"
+
+class Bitmap;
+struct Color;
+
+struct ParticleEmitterPrivate;
+
+/* Spawns, moves and fades particles natively, drawing
+ * all of them with a single draw call. Every particle
+ * is a copy of 'bitmap' centered on its position.
+ * Angles are in degrees, counter clockwise with 0 pointing
+ * right; speeds and gravity are in pixels per frame */
+class ParticleEmitter : public ViewportElement, public Disposable
+{
+public:
+	ParticleEmitter(Viewport *viewport = 0);
+	~ParticleEmitter();
+
+	/* Advances all particles by one frame and
+	 * spawns 'rate' new ones (fractions accumulate) */
+	void update();
+
+	/* Spawns 'count' particles right away */
+	void emit(int count);
+
+	/* Removes all particles */
+	void clear();
+
+	int getCount() const;
+
+	DECL_ATTR( Bitmap,       Bitmap* )
+	DECL_ATTR( X,            float   )
+	DECL_ATTR( Y,            float   )
+	DECL_ATTR( Rate,         float   )
+	DECL_ATTR( Life,         int     )
+	DECL_ATTR( LifeVar,      int     )
+	DECL_ATTR( Speed,        float   )
+	DECL_ATTR( SpeedVar,     float   )
+	DECL_ATTR( Direction,    float   )
+	DECL_ATTR( Spread,       float   )
+	DECL_ATTR( GravityX,     float   )
+	DECL_ATTR( GravityY,     float   )
+	DECL_ATTR( ZoomStart,    float   )
+	DECL_ATTR( ZoomEnd,      float   )
+	DECL_ATTR( StartColor,   Color&  )
+	DECL_ATTR( EndColor,     Color&  )
+	DECL_ATTR( BlendType,    int     )
+	DECL_ATTR( MaxParticles, int     )
+
+	void initDynAttribs();
+
+private:
+	ParticleEmitterPrivate *p;
+
+	void draw();
+	void onGeometryChange(const Scene::Geometry &);
+
+	void releaseResources();
+	const char *klassName() const { return "particle emitter"; }
+
+	ABOUT_TO_ACCESS_DISP
+};
+
+#endif // PARTICLEEMITTER_H
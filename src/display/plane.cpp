@@ -33,17 +33,15 @@
 #include "etc-internal.h"
 #include "shader.h"
 #include "glstate.h"
+#include "preparable.h"
 
-#include "sigslot/signal.hpp"
+#include <math.h>
+#include <algorithm>
 
-static float fwrap(float value, float range)
+struct PlanePrivate : public Preparable
 {
-	float res = fmod(value, range);
-	return res < 0 ? res + range : res;
-}
+	DECL_POOLED_NEW(PlanePrivate)
 
-struct PlanePrivate
-{
 	Bitmap *bitmap;
 
 	NormValue opacity;
@@ -62,8 +60,6 @@ struct PlanePrivate
 
 	EtcTemps tmp;
 
-	sigslot::connection prepareCon;
-
 	PlanePrivate()
 	    : bitmap(0),
 	      opacity(255),
@@ -74,75 +70,40 @@ struct PlanePrivate
 	      zoomX(1), zoomY(1),
 	      quadSourceDirty(false)
 	{
-		prepareCon = shState->prepareDraw.connect
-		        (&PlanePrivate::prepare, this);
-
 		qArray.resize(1);
 	}
 
-	~PlanePrivate()
+	void invalidateQuadSource()
 	{
-		prepareCon.disconnect();
+		quadSourceDirty = true;
+		requestPrepare();
 	}
 
+	/* The whole plane is a single quad, with texture coordinates
+	 * running past the bitmap's edges. These are either wrapped
+	 * by GL_REPEAT or, where that isn't available for NPOT
+	 * textures, in the shader */
 	void updateQuadSource()
 	{
-		if (gl.npot_repeat)
-		{
-			FloatRect srcRect;
-			srcRect.x = (sceneGeo.orig.x + ox) / zoomX;
-			srcRect.y = (sceneGeo.orig.y + oy) / zoomY;
-			srcRect.w = sceneGeo.rect.w / zoomX;
-			srcRect.h = sceneGeo.rect.h / zoomY;
-
-			Quad::setTexRect(&qArray.vertices[0], srcRect);
-			qArray.commit();
-
-			return;
-		}
-
-		if (nullOrDisposed(bitmap))
-			return;
-
-		/* Scaled (zoomed) bitmap dimensions */
-		float sw = bitmap->width()  * zoomX;
-		float sh = bitmap->height() * zoomY;
-
-		/* Plane offset wrapped by scaled bitmap dims */
-		float wox = fwrap(ox, sw);
-		float woy = fwrap(oy, sh);
-
-		/* Viewport dimensions */
-		int vpw = sceneGeo.rect.w;
-		int vph = sceneGeo.rect.h;
-
-		/* Amount the scaled bitmap is tiled (repeated) */
-		size_t tilesX = ceil((vpw - sw + wox) / sw) + 1;
-		size_t tilesY = ceil((vph - sh + woy) / sh) + 1;
-
-		FloatRect tex = bitmap->rect();
-
-		qArray.resize(tilesX * tilesY);
-
-		for (size_t y = 0; y < tilesY; ++y)
-			for (size_t x = 0; x < tilesX; ++x)
-			{
-				SVertex *vert = &qArray.vertices[(y*tilesX + x) * 4];
-				FloatRect pos(x*sw - wox, y*sh - woy, sw, sh);
-
-				Quad::setTexPosRect(vert, tex, pos);
-			}
+		FloatRect srcRect;
+		srcRect.x = (sceneGeo.orig.x + ox) / zoomX;
+		srcRect.y = (sceneGeo.orig.y + oy) / zoomY;
+		srcRect.w = sceneGeo.rect.w / zoomX;
+		srcRect.h = sceneGeo.rect.h / zoomY;
 
+		Quad::setTexRect(&qArray.vertices[0], srcRect);
 		qArray.commit();
 	}
 
-	void prepare()
+	bool prepare()
 	{
 		if (quadSourceDirty)
 		{
 			updateQuadSource();
 			quadSourceDirty = false;
 		}
+
+		return false;
 	}
 };
 
@@ -161,9 +122,9 @@ DEF_ATTR_RD_SIMPLE(Plane, ZoomX,     float,   p->zoomX)
 DEF_ATTR_RD_SIMPLE(Plane, ZoomY,     float,   p->zoomY)
 DEF_ATTR_RD_SIMPLE(Plane, BlendType, int,     p->blendType)
 
-DEF_ATTR_SIMPLE(Plane, Opacity,   int,     p->opacity)
-DEF_ATTR_SIMPLE(Plane, Color,     Color&, *p->color)
-DEF_ATTR_SIMPLE(Plane, Tone,      Tone&,  *p->tone)
+DEF_ATTR_SIMPLE_DAMAGE(Plane, Opacity,   int,     p->opacity)
+DEF_ATTR_SIMPLE_DAMAGE(Plane, Color,     Color&, *p->color)
+DEF_ATTR_SIMPLE_DAMAGE(Plane, Tone,      Tone&,  *p->tone)
 
 Plane::~Plane()
 {
@@ -173,6 +134,7 @@ Plane::~Plane()
 void Plane::setBitmap(Bitmap *value)
 {
 	guardDisposed();
+	damage();
 
 	p->bitmap = value;
 
@@ -189,8 +151,10 @@ void Plane::setOX(int value)
 	if (p->ox == value)
 	        return;
 
+	damage();
+
 	p->ox = value;
-	p->quadSourceDirty = true;
+	p->invalidateQuadSource();
 }
 
 void Plane::setOY(int value)
@@ -200,8 +164,10 @@ void Plane::setOY(int value)
 	if (p->oy == value)
 	        return;
 
+	damage();
+
 	p->oy = value;
-	p->quadSourceDirty = true;
+	p->invalidateQuadSource();
 }
 
 void Plane::setZoomX(float value)
@@ -211,8 +177,10 @@ void Plane::setZoomX(float value)
 	if (p->zoomX == value)
 	        return;
 
+	damage();
+
 	p->zoomX = value;
-	p->quadSourceDirty = true;
+	p->invalidateQuadSource();
 }
 
 void Plane::setZoomY(float value)
@@ -222,13 +190,16 @@ void Plane::setZoomY(float value)
 	if (p->zoomY == value)
 	        return;
 
+	damage();
+
 	p->zoomY = value;
-	p->quadSourceDirty = true;
+	p->invalidateQuadSource();
 }
 
 void Plane::setBlendType(int value)
 {
 	guardDisposed();
+	damage();
 
 	switch (value)
 	{
@@ -260,8 +231,10 @@ void Plane::draw()
 		return;
 
 	ShaderBase *base;
+	bool noBlend = false;
 
-	if (p->color->hasEffect() || p->tone->hasEffect() || p->opacity != 255)
+	if (p->color->hasEffect() || p->tone->hasEffect() || p->opacity != 255 ||
+	    !gl.npot_repeat)
 	{
 		PlaneShader &shader = shState->shaders().plane;
 
@@ -271,6 +244,7 @@ void Plane::draw()
 		shader.setColor(p->color->norm);
 		shader.setFlash(Vec4());
 		shader.setOpacity(p->opacity.norm);
+		shader.setWrap(!gl.npot_repeat);
 
 		base = &shader;
 	}
@@ -283,11 +257,16 @@ void Plane::draw()
 		shader.setTranslation(Vec2i());
 
 		base = &shader;
+
+		/* Nothing behind an opaque tiling shows through */
+		noBlend = p->blendType == BlendNormal && p->bitmap->isOpaque();
 	}
 
 	glState.blendMode.pushSet(p->blendType);
+	glState.blend.pushSet(!noBlend);
 
-	p->bitmap->bindTex(*base);
+	const float zoom = std::max(fabsf(p->zoomX), fabsf(p->zoomY));
+	const bool mipmapped = p->bitmap->bindTexZoomed(*base, zoom);
 
 	if (gl.npot_repeat)
 		TEX::setRepeat(true);
@@ -297,16 +276,19 @@ void Plane::draw()
 	if (gl.npot_repeat)
 		TEX::setRepeat(false);
 
+	if (mipmapped)
+		TEX::setSmooth(false);
+
+	glState.blend.pop();
 	glState.blendMode.pop();
 }
 
 void Plane::onGeometryChange(const Scene::Geometry &geo)
 {
-	if (gl.npot_repeat)
-		Quad::setPosRect(&p->qArray.vertices[0], FloatRect(geo.rect));
+	Quad::setPosRect(&p->qArray.vertices[0], FloatRect(geo.rect));
 
 	p->sceneGeo = geo;
-	p->quadSourceDirty = true;
+	p->invalidateQuadSource();
 }
 
 void Plane::releaseResources()
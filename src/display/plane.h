@@ -24,6 +24,7 @@
 
 #include "disposable.h"
 #include "viewport.h"
+#include "object-pool.h"
 
 class Bitmap;
 struct Color;
@@ -37,6 +38,8 @@ public:
 	Plane(Viewport *viewport = 0);
 	~Plane();
 
+	DECL_POOLED_NEW(Plane)
+
 	DECL_ATTR( Bitmap,    Bitmap* )
 	DECL_ATTR( OX,        int     )
 	DECL_ATTR( OY,        int     )
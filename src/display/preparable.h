@@ -0,0 +1,52 @@
+/*
+** preparable.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PREPARABLE_H
+#define PREPARABLE_H
+
+#include "intrulist.h"
+#include "sharedstate.h"
+
+/* Something with work to do right before the next frame is
+ * drawn (flushing queued GL work, rebuilding vertices, advancing
+ * animations). Rather than being visited on every frame, it
+ * enrolls itself with 'requestPrepare()' whenever it has work
+ * pending; see 'SharedState::prepareDraw()' */
+struct Preparable
+{
+	IntruListLink<Preparable> prepareLink;
+
+	Preparable()
+	    : prepareLink(this)
+	{}
+
+	/* The link takes itself out of the list on destruction */
+	virtual ~Preparable() {}
+
+	/* Returns true to stay enrolled for the next frame */
+	virtual bool prepare() = 0;
+
+	void requestPrepare()
+	{
+		if (!prepareLink.next)
+			shState->enrollPrepare(*this);
+	}
+};
+
+#endif // PREPARABLE_H
@@ -0,0 +1,579 @@
+/*
+** profiler.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "profiler.h"
+
+#include "graphics.h"
+#include "gl-fun.h"
+#include "glstate.h"
+#include "shader.h"
+#include "quad.h"
+#include "quadarray.h"
+#include "etc-internal.h"
+#include "util.h"
+
+#include <SDL_atomic.h>
+#include <SDL_mutex.h>
+#include <SDL_rwops.h>
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+/* Roughly ten seconds at 60 FPS */
+#define HISTORY_SIZE 600
+
+/* Results are read back a few frames late to avoid stalls */
+#define GPU_QUERY_COUNT 4
+
+/* Overlay layout, in window pixels */
+#define GRAPH_FRAMES 240
+#define GRAPH_BAR_W 2
+#define GRAPH_H 128
+#define GRAPH_MARGIN 8
+#define AUDIO_GRAPH_H 24
+#define RENDER_GRAPH_H 24
+/* Time span covered by the full graph height */
+#define GRAPH_SPAN_US 33333
+/* Draw calls / uploaded bytes covered by the render graph height */
+#define RENDER_SPAN_DRAWS 500
+#define RENDER_SPAN_BYTES (4 * 1024 * 1024)
+
+static const char *sectionNames[] =
+{
+	"Script",
+	"Composite",
+	"TilemapPrepare",
+	"Text",
+	"Audio",
+	"Swap"
+};
+
+/* Stacking order of the main thread bars */
+static const Profiler::Section stackOrder[] =
+{
+	Profiler::Script,
+	Profiler::Text,
+	Profiler::Composite,
+	Profiler::TilemapPrepare,
+	Profiler::Swap
+};
+
+static const Vec4 sectionColors[] =
+{
+	Vec4(0.25f, 0.45f, 1.00f, 0.9f), /* Script */
+	Vec4(0.20f, 0.85f, 0.30f, 0.9f), /* Composite */
+	Vec4(0.10f, 0.85f, 0.85f, 0.9f), /* TilemapPrepare */
+	Vec4(1.00f, 0.85f, 0.15f, 0.9f), /* Text */
+	Vec4(0.90f, 0.30f, 0.90f, 0.9f), /* Audio */
+	Vec4(1.00f, 0.45f, 0.15f, 0.9f)  /* Swap */
+};
+
+struct ProfilerFrame
+{
+	/* Microseconds since profiler creation */
+	uint64_t start;
+	uint32_t usecs[Profiler::SectionCount];
+	/* Of the most recently completed GPU query, -1 if unknown */
+	int32_t gpuUsecs;
+	/* GL binds and state changes issued / elided by the caches */
+	uint32_t glIssued;
+	uint32_t glElided;
+	uint32_t draws;
+	uint32_t fboBinds;
+	/* Texture and buffer uploads combined */
+	uint64_t uploadBytes;
+	/* Ruby GC runs during the script section */
+	uint32_t minorGCs;
+	uint32_t majorGCs;
+	uint64_t allocatedObjects;
+};
+
+struct ProfilerPrivate
+{
+	SDL_atomic_t acc[Profiler::SectionCount];
+
+	uint64_t freq;
+	uint64_t origin;
+	/* Counter value at the end of the last update, 0 before the first */
+	uint64_t lastEnd;
+
+	SDL_mutex *historyLock;
+	std::vector<ProfilerFrame> history;
+	size_t historyHead;
+	size_t historyCount;
+
+	struct
+	{
+		bool inited;
+		GLuint ids[GPU_QUERY_COUNT];
+		bool pending[GPU_QUERY_COUNT];
+		size_t head;
+		bool active;
+		int32_t lastUsecs;
+	} gpu;
+
+	ColorQuadArray *overlay;
+
+	ProfilerPrivate()
+	    : freq(SDL_GetPerformanceFrequency()),
+	      origin(SDL_GetPerformanceCounter()),
+	      lastEnd(0),
+	      historyHead(0),
+	      historyCount(0),
+	      overlay(0)
+	{
+		for (int i = 0; i < Profiler::SectionCount; ++i)
+			SDL_AtomicSet(&acc[i], 0);
+
+		historyLock = SDL_CreateMutex();
+		history.resize(HISTORY_SIZE);
+
+		gpu.inited = false;
+		gpu.head = 0;
+		gpu.active = false;
+		gpu.lastUsecs = -1;
+
+		for (size_t i = 0; i < GPU_QUERY_COUNT; ++i)
+			gpu.pending[i] = false;
+	}
+
+	~ProfilerPrivate()
+	{
+		if (gpu.inited)
+			gl.DeleteQueries(GPU_QUERY_COUNT, gpu.ids);
+
+		delete overlay;
+
+		SDL_DestroyMutex(historyLock);
+	}
+
+	uint64_t toUsecs(uint64_t ticks) const
+	{
+		return (ticks * 1000000) / freq;
+	}
+
+	void collectGPU()
+	{
+		if (gl.glsles)
+		{
+			/* The results of all in-flight queries are
+			 * meaningless after a disjoint event */
+			GLint disjoint = 0;
+			gl.GetIntegerv(_GL_GPU_DISJOINT, &disjoint);
+
+			if (disjoint)
+			{
+				for (size_t i = 0; i < GPU_QUERY_COUNT; ++i)
+					gpu.pending[i] = false;
+
+				return;
+			}
+		}
+
+		/* Oldest first, so the latest result wins */
+		for (size_t i = 0; i < GPU_QUERY_COUNT; ++i)
+		{
+			const size_t slot = (gpu.head + i) % GPU_QUERY_COUNT;
+
+			if (!gpu.pending[slot])
+				continue;
+
+			GLint available = 0;
+			gl.GetQueryObjectiv(gpu.ids[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+
+			if (!available)
+				continue;
+
+			uint64_t nsecs = 0;
+			gl.GetQueryObjectui64v(gpu.ids[slot], GL_QUERY_RESULT, &nsecs);
+
+			gpu.lastUsecs = (int32_t) (nsecs / 1000);
+			gpu.pending[slot] = false;
+		}
+	}
+
+	/* Excludes nested sections from their parents, so
+	 * the stacked bars add up to the frame's CPU time */
+	static uint32_t exclusive(const ProfilerFrame &frame, Profiler::Section s)
+	{
+		uint32_t time = frame.usecs[s];
+		uint32_t nested = 0;
+
+		if (s == Profiler::Script)
+			nested = frame.usecs[Profiler::Text];
+		else if (s == Profiler::Composite)
+			nested = frame.usecs[Profiler::TilemapPrepare];
+
+		return time > nested ? time - nested : 0;
+	}
+
+	static float barHeight(uint32_t usecs, int fullHeight)
+	{
+		return ((float) usecs / GRAPH_SPAN_US) * fullHeight;
+	}
+
+	void appendQuad(std::vector<Vertex> &verts, const FloatRect &rect, const Vec4 &color)
+	{
+		const size_t i = verts.size();
+		verts.resize(i + 4);
+
+		Quad::setPosRect(&verts[i], rect);
+		Quad::setColor(&verts[i], color);
+	}
+
+	void buildOverlay(std::vector<Vertex> &verts)
+	{
+		const size_t frames = std::min<size_t>(historyCount, GRAPH_FRAMES);
+
+		const float graphW = GRAPH_FRAMES * GRAPH_BAR_W;
+		const float audioY = GRAPH_MARGIN;
+		const float mainY = audioY + AUDIO_GRAPH_H + GRAPH_MARGIN / 2;
+		const float renderY = mainY + GRAPH_H + GRAPH_MARGIN / 2;
+
+		/* Backgrounds */
+		appendQuad(verts, FloatRect(GRAPH_MARGIN, mainY, graphW, GRAPH_H),
+		           Vec4(0, 0, 0, 0.5f));
+		appendQuad(verts, FloatRect(GRAPH_MARGIN, audioY, graphW, AUDIO_GRAPH_H),
+		           Vec4(0, 0, 0, 0.5f));
+		appendQuad(verts, FloatRect(GRAPH_MARGIN, renderY, graphW, RENDER_GRAPH_H),
+		           Vec4(0, 0, 0, 0.5f));
+
+		for (size_t i = 0; i < frames; ++i)
+		{
+			const size_t idx = (historyHead + HISTORY_SIZE - frames + i) % HISTORY_SIZE;
+			const ProfilerFrame &frame = history[idx];
+
+			const float x = GRAPH_MARGIN + i * GRAPH_BAR_W;
+			float y = mainY;
+
+			for (size_t j = 0; j < ARRAY_SIZE(stackOrder); ++j)
+			{
+				const Profiler::Section s = stackOrder[j];
+				float h = barHeight(exclusive(frame, s), GRAPH_H);
+
+				if (y + h > mainY + GRAPH_H)
+					h = mainY + GRAPH_H - y;
+
+				if (h <= 0)
+					continue;
+
+				appendQuad(verts, FloatRect(x, y, GRAPH_BAR_W, h), sectionColors[s]);
+				y += h;
+			}
+
+			/* Frames with GC runs are marked at the graph's far end */
+			if (frame.majorGCs > 0 || frame.minorGCs > 0)
+				appendQuad(verts, FloatRect(x, mainY + GRAPH_H - 3, GRAPH_BAR_W, 3),
+				           frame.majorGCs > 0 ? Vec4(1.00f, 0.20f, 0.60f, 1)
+				                          : Vec4(1.00f, 1.00f, 1.00f, 0.6f));
+
+			if (frame.gpuUsecs >= 0)
+			{
+				const float h = std::min<float>(barHeight(frame.gpuUsecs, GRAPH_H), GRAPH_H);
+				appendQuad(verts, FloatRect(x, mainY + h, GRAPH_BAR_W, 1),
+				           Vec4(1, 1, 1, 1));
+			}
+
+			const float audioH = std::min<float>(barHeight(frame.usecs[Profiler::Audio], AUDIO_GRAPH_H),
+			                                     AUDIO_GRAPH_H);
+
+			if (audioH > 0)
+				appendQuad(verts, FloatRect(x, audioY, GRAPH_BAR_W, audioH),
+				           sectionColors[Profiler::Audio]);
+
+			/* Draw calls as bars, upload volume as a marker */
+			const float drawsH = std::min<float>(((float) frame.draws / RENDER_SPAN_DRAWS) * RENDER_GRAPH_H,
+			                                     RENDER_GRAPH_H);
+
+			if (drawsH > 0)
+				appendQuad(verts, FloatRect(x, renderY, GRAPH_BAR_W, drawsH),
+				           Vec4(0.60f, 0.60f, 0.65f, 0.9f));
+
+			if (frame.uploadBytes > 0)
+			{
+				const float uploadH = std::min<float>(((float) frame.uploadBytes / RENDER_SPAN_BYTES) * RENDER_GRAPH_H,
+				                                      RENDER_GRAPH_H - 1);
+				appendQuad(verts, FloatRect(x, renderY + uploadH, GRAPH_BAR_W, 1),
+				           Vec4(1.00f, 0.30f, 0.30f, 1));
+			}
+		}
+
+		/* 60 FPS frame budget */
+		appendQuad(verts, FloatRect(GRAPH_MARGIN, mainY + barHeight(16667, GRAPH_H), graphW, 1),
+		           Vec4(1, 0.2f, 0.2f, 0.8f));
+	}
+};
+
+Profiler::Profiler(bool enabled, bool gpuTiming)
+    : enabled(enabled),
+      gpuTiming(enabled || gpuTiming)
+{
+	p = new ProfilerPrivate;
+}
+
+Profiler::~Profiler()
+{
+	delete p;
+}
+
+void Profiler::addTime(Section section, uint64_t ticks)
+{
+	if (!enabled)
+		return;
+
+	SDL_AtomicAdd(&p->acc[section], (int) p->toUsecs(ticks));
+}
+
+void Profiler::beginUpdate()
+{
+	if (!enabled)
+		return;
+
+	if (p->lastEnd)
+		addTime(Script, SDL_GetPerformanceCounter() - p->lastEnd);
+}
+
+void Profiler::endUpdate()
+{
+	if (!enabled)
+		return;
+
+	const uint64_t now = SDL_GetPerformanceCounter();
+
+	ProfilerFrame frame;
+	frame.start = p->toUsecs((p->lastEnd ? p->lastEnd : now) - p->origin);
+	frame.gpuUsecs = p->gpu.lastUsecs;
+	const Graphics::RenderStats &stats = shState->graphics().renderStats();
+
+	frame.glIssued = stats.stateChanges;
+	frame.glElided = stats.stateChangesElided;
+	frame.draws = stats.draws;
+	frame.fboBinds = stats.fboBinds;
+	frame.uploadBytes = stats.texUploadBytes + stats.bufferUploadBytes;
+
+	const Graphics::ScriptStats &script = shState->graphics().scriptStats();
+
+	frame.minorGCs = script.minorGCs;
+	frame.majorGCs = script.majorGCs;
+	frame.allocatedObjects = script.allocatedObjects;
+
+	for (int i = 0; i < SectionCount; ++i)
+		frame.usecs[i] = (uint32_t) SDL_AtomicSet(&p->acc[i], 0);
+
+	SDL_LockMutex(p->historyLock);
+
+	p->history[p->historyHead] = frame;
+	p->historyHead = (p->historyHead + 1) % HISTORY_SIZE;
+	p->historyCount = std::min<size_t>(p->historyCount + 1, HISTORY_SIZE);
+
+	SDL_UnlockMutex(p->historyLock);
+
+	p->lastEnd = now;
+}
+
+void Profiler::beginGPU()
+{
+	if (!gpuTiming || !gl.timer_query)
+		return;
+
+	if (!p->gpu.inited)
+	{
+		gl.GenQueries(GPU_QUERY_COUNT, p->gpu.ids);
+		p->gpu.inited = true;
+	}
+
+	/* Don't reuse a query whose result is still in flight */
+	if (p->gpu.pending[p->gpu.head])
+		return;
+
+	gl.BeginQuery(GL_TIME_ELAPSED, p->gpu.ids[p->gpu.head]);
+	p->gpu.active = true;
+}
+
+void Profiler::endGPU()
+{
+	if (!p->gpu.active)
+	{
+		if (gpuTiming && p->gpu.inited)
+			p->collectGPU();
+
+		return;
+	}
+
+	gl.EndQuery(GL_TIME_ELAPSED);
+
+	p->gpu.pending[p->gpu.head] = true;
+	p->gpu.head = (p->gpu.head + 1) % GPU_QUERY_COUNT;
+	p->gpu.active = false;
+
+	p->collectGPU();
+}
+
+int32_t Profiler::lastGPUUsecs() const
+{
+	return p->gpu.lastUsecs;
+}
+
+void Profiler::drawOverlay(const Vec2i &winSize)
+{
+	if (!enabled)
+		return;
+
+	if (!p->overlay)
+		p->overlay = new ColorQuadArray;
+
+	ColorQuadArray &qArray = *p->overlay;
+	qArray.clear();
+
+	SDL_LockMutex(p->historyLock);
+	p->buildOverlay(qArray.vertices);
+	SDL_UnlockMutex(p->historyLock);
+
+	qArray.quadCount = qArray.vertices.size() / 4;
+	qArray.commit();
+
+	glState.viewport.pushSet(IntRect(0, 0, winSize.x, winSize.y));
+	glState.blend.pushSet(true);
+	glState.blendMode.pushSet(BlendNormal);
+
+	SimpleColorShader &shader = shState->shaders().simpleColor;
+	shader.bind();
+	shader.applyViewportProj();
+	shader.setTranslation(Vec2i());
+
+	qArray.draw();
+
+	glState.blendMode.pop();
+	glState.blend.pop();
+	glState.viewport.pop();
+}
+
+static void appendEvent(std::string &out, bool &first, const char *name,
+                        int tid, uint64_t ts, uint64_t dur)
+{
+	char buf[192];
+	snprintf(buf, sizeof(buf),
+	         "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+	         "\"ts\":%llu,\"dur\":%llu}",
+	         first ? "" : ",", name, tid,
+	         (unsigned long long) ts, (unsigned long long) dur);
+
+	out += buf;
+	first = false;
+}
+
+static void appendCounters(std::string &out, bool &first, uint64_t ts,
+                           const ProfilerFrame &frame)
+{
+	char buf[512];
+	snprintf(buf, sizeof(buf),
+	         "%s\n{\"name\":\"GL binds\",\"ph\":\"C\",\"pid\":1,"
+	         "\"ts\":%llu,\"args\":{\"issued\":%u,\"elided\":%u}},"
+	         "\n{\"name\":\"GL work\",\"ph\":\"C\",\"pid\":1,"
+	         "\"ts\":%llu,\"args\":{\"draws\":%u,\"fbo_binds\":%u,\"upload_bytes\":%llu}},"
+	         "\n{\"name\":\"Ruby GC\",\"ph\":\"C\",\"pid\":1,"
+	         "\"ts\":%llu,\"args\":{\"minor\":%u,\"major\":%u,\"allocated\":%llu}}",
+	         first ? "" : ",", (unsigned long long) ts, frame.glIssued, frame.glElided,
+	         (unsigned long long) ts, frame.draws, frame.fboBinds,
+	         (unsigned long long) frame.uploadBytes,
+	         (unsigned long long) ts, frame.minorGCs, frame.majorGCs,
+	         (unsigned long long) frame.allocatedObjects);
+
+	out += buf;
+	first = false;
+}
+
+static void appendThreadName(std::string &out, bool &first, int tid, const char *name)
+{
+	char buf[128];
+	snprintf(buf, sizeof(buf),
+	         "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+	         "\"args\":{\"name\":\"%s\"}}",
+	         first ? "" : ",", tid, name);
+
+	out += buf;
+	first = false;
+}
+
+bool Profiler::dumpTrace(const char *filename)
+{
+	/* Sections are stored as per-frame totals, so events are laid
+	 * out sequentially from the frame start on the main track, and
+	 * nested / off-thread sections start with their parent */
+	enum { MainTid = 1, NestedTid, AudioTid, GPUTid };
+
+	std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+
+	appendThreadName(out, first, MainTid, "Main");
+	appendThreadName(out, first, NestedTid, "Main (nested)");
+	appendThreadName(out, first, AudioTid, "Audio streams");
+	appendThreadName(out, first, GPUTid, "GPU");
+
+	SDL_LockMutex(p->historyLock);
+
+	for (size_t i = 0; i < p->historyCount; ++i)
+	{
+		const size_t idx = (p->historyHead + HISTORY_SIZE - p->historyCount + i) % HISTORY_SIZE;
+		const ProfilerFrame &frame = p->history[idx];
+
+		const uint64_t scriptEnd = frame.start + frame.usecs[Script];
+		const uint64_t compositeEnd = scriptEnd + frame.usecs[Composite];
+
+		appendEvent(out, first, sectionNames[Script], MainTid,
+		            frame.start, frame.usecs[Script]);
+		appendEvent(out, first, sectionNames[Composite], MainTid,
+		            scriptEnd, frame.usecs[Composite]);
+		appendEvent(out, first, sectionNames[Swap], MainTid,
+		            compositeEnd, frame.usecs[Swap]);
+
+		if (frame.usecs[Text])
+			appendEvent(out, first, sectionNames[Text], NestedTid,
+			            frame.start, frame.usecs[Text]);
+
+		if (frame.usecs[TilemapPrepare])
+			appendEvent(out, first, sectionNames[TilemapPrepare], NestedTid,
+			            scriptEnd, frame.usecs[TilemapPrepare]);
+
+		if (frame.usecs[Audio])
+			appendEvent(out, first, sectionNames[Audio], AudioTid,
+			            frame.start, frame.usecs[Audio]);
+
+		if (frame.gpuUsecs >= 0)
+			appendEvent(out, first, "GPU", GPUTid,
+			            scriptEnd, frame.gpuUsecs);
+
+		appendCounters(out, first, frame.start, frame);
+	}
+
+	SDL_UnlockMutex(p->historyLock);
+
+	out += "\n]}\n";
+
+	SDL_RWops *ops = SDL_RWFromFile(filename, "wb");
+
+	if (!ops)
+		return false;
+
+	bool ok = SDL_RWwrite(ops, out.c_str(), out.size(), 1) == 1;
+	SDL_RWclose(ops);
+
+	return ok;
+}
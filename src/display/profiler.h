@@ -0,0 +1,116 @@
+/*
+** profiler.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "sharedstate.h"
+
+#include <SDL_timer.h>
+#include <stdint.h>
+
+struct ProfilerPrivate;
+struct Vec2i;
+
+/* Collects per-frame timings of the main engine subsystems.
+ * A history of the most recent frames is kept, which can be
+ * drawn as a graph over the screen or saved as a trace file.
+ * When disabled, all entry points return right away */
+class Profiler
+{
+public:
+	enum Section
+	{
+		/* Time spent in script code between Graphics.update calls */
+		Script = 0,
+		/* Screen composition, including 'prepareDraw' handlers */
+		Composite,
+		TilemapPrepare,
+		Text,
+		/* Buffer refills on the audio thread */
+		Audio,
+		Swap,
+
+		SectionCount
+	};
+
+	/* With 'gpuTiming', GPU frame times are measured even
+	 * if the profiler is otherwise disabled */
+	Profiler(bool enabled, bool gpuTiming = false);
+	~Profiler();
+
+	bool isEnabled() const
+	{
+		return enabled;
+	}
+
+	/* Thread safe. 'ticks' are in SDL performance counter units */
+	void addTime(Section section, uint64_t ticks);
+
+	/* Bracket one Graphics::update call */
+	void beginUpdate();
+	void endUpdate();
+
+	/* Bracket the GL work of one frame for GPU timing.
+	 * Must be called on the GL thread */
+	void beginGPU();
+	void endGPU();
+
+	/* GPU time of the most recent frame whose result came
+	 * back, in microseconds. -1 if none has yet */
+	int32_t lastGPUUsecs() const;
+
+	/* Draws the timing graph into the currently bound
+	 * framebuffer, which is 'winSize' large */
+	void drawOverlay(const Vec2i &winSize);
+
+	/* Writes the frame history in Chrome trace event format
+	 * (chrome://tracing). Returns false on write failure */
+	bool dumpTrace(const char *filename);
+
+private:
+	bool enabled;
+	bool gpuTiming;
+	ProfilerPrivate *p;
+};
+
+/* Adds the lifetime of this object to 'section' */
+class ProfileScope
+{
+public:
+	ProfileScope(Profiler::Section section)
+	    : section(section),
+	      start(0)
+	{
+		if (shState->profiler().isEnabled())
+			start = SDL_GetPerformanceCounter();
+	}
+
+	~ProfileScope()
+	{
+		if (start)
+			shState->profiler().addTime(section, SDL_GetPerformanceCounter() - start);
+	}
+
+private:
+	Profiler::Section section;
+	uint64_t start;
+};
+
+#endif // PROFILER_H
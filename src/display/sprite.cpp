@@ -33,25 +33,33 @@
 #include "shader.h"
 #include "glstate.h"
 #include "quadarray.h"
+#include "interpolation.h"
+#include "preparable.h"
 
 #include <math.h>
+#include <algorithm>
 #ifndef M_PI
 # define M_PI 3.14159265358979323846
 #endif
 
 #include <SDL_rect.h>
 
-#include "sigslot/signal.hpp"
-
-struct SpritePrivate
+struct SpritePrivate : public Preparable
 {
+    DECL_POOLED_NEW(SpritePrivate)
+    
     Bitmap *bitmap;
     
     Quad quad;
     Transform trans;
     
+    /* Screen position blended between logical frames,
+     * written to a copy of the transform matrix */
+    FrameInterpolator interp;
+    float interpMatrix[16];
+    
     Rect *srcRect;
-    sigslot::connection srcRectCon;
+    GenerationWatch srcRectWatch;
     
     bool mirrored;
     int bushDepth;
@@ -69,13 +77,30 @@ struct SpritePrivate
     
     bool invert;
     
+    /* Applied while drawing, in degrees (0 ~ 359) */
+    int hue;
+    
     IntRect sceneRect;
     Vec2i sceneOrig;
     
+    /* Screen area the sprite is clipped to */
+    IntRect clipRect;
+    
+    /* Where the window texture of a mega surface bitmap sits
+     * in it, and the window's height (see 'fetchMegaWindow()') */
+    Vec2i megaOffset;
+    int megaTexH;
+    
     /* Would this sprite be visible on
      * the screen if drawn? */
     bool isVisible;
     
+    /* Not visible only for lying outside the scene */
+    bool offScreen;
+    
+    /* The source rectangle, unrotated, spans the whole scene */
+    bool coversScene;
+    
     Color *color;
     Tone *tone;
     
@@ -88,14 +113,18 @@ struct SpritePrivate
         
         /* Wave effect is active (amp != 0) */
         bool active;
-        /* qArray needs updating */
+        /* Strip mesh in qArray needs rebuilding; the phase
+         * is applied in sprite.vert and doesn't affect it */
         bool dirty;
+        /* Mesh was built as strips to be displaced
+         * (as opposed to the amp < 0 special cases) */
+        bool strips;
         SimpleQuadArray qArray;
     } wave;
     
     EtcTemps tmp;
     
-    sigslot::connection prepareCon;
+    Sprite *self;
     
     SpritePrivate()
     : bitmap(0),
@@ -110,18 +139,17 @@ struct SpritePrivate
     patternTile(true),
     patternOpacity(255),
     invert(false),
+    hue(0),
+    megaTexH(0),
     isVisible(false),
+    offScreen(false),
+    coversScene(false),
     color(&tmp.color),
     tone(&tmp.tone)
     
     {
         sceneRect.x = sceneRect.y = 0;
         
-        updateSrcRectCon();
-        
-        prepareCon = shState->prepareDraw.connect
-        (&SpritePrivate::prepare, this);
-        
         patternScroll = Vec2(0,0);
         patternZoom = Vec2(1, 1);
         
@@ -130,12 +158,15 @@ struct SpritePrivate
         wave.speed = 360;
         wave.phase = 0.0f;
         wave.dirty = false;
+        wave.strips = false;
+        
+        requestPrepare();
     }
     
-    ~SpritePrivate()
+    void invalidateWave()
     {
-        srcRectCon.disconnect();
-        prepareCon.disconnect();
+        wave.dirty = true;
+        requestPrepare();
     }
     
     void recomputeBushDepth()
@@ -143,12 +174,18 @@ struct SpritePrivate
         if (nullOrDisposed(bitmap))
             return;
         
+        /* Mega surfaces are drawn from a window texture */
+        const int texH = bitmap->isMega() ? megaTexH : bitmap->height();
+        
+        if (texH == 0)
+            return;
+        
         /* Calculate effective (normalized) bush depth */
         float texBushDepth = (bushDepth / trans.getScale().y) -
-        (srcRect->y + srcRect->height) +
-        bitmap->height();
+        (srcRect->y - megaOffset.y + srcRect->height) +
+        texH;
         
-        efBushDepth = 1.0f - texBushDepth / bitmap->height();
+        efBushDepth = 1.0f - texBushDepth / texH;
     }
     
     void onSrcRectChange()
@@ -164,26 +201,38 @@ struct SpritePrivate
         rect.w = clamp<int>(rect.w, 0, bmSize.x-rect.x);
         rect.h = clamp<int>(rect.h, 0, bmSize.y-rect.y);
         
-        quad.setTexRect(mirrored ? rect.hFlipped() : rect);
-        
         quad.setPosRect(FloatRect(0, 0, rect.w, rect.h));
+        
+        rect.x -= megaOffset.x;
+        rect.y -= megaOffset.y;
+        
+        quad.setTexRect(mirrored ? rect.hFlipped() : rect);
         recomputeBushDepth();
         
-        wave.dirty = true;
+        invalidateWave();
     }
     
-    void updateSrcRectCon()
+    /* Picks up src_rect writes made since the last call */
+    void syncSrcRect()
     {
-        /* Cut old connection */
-        srcRectCon.disconnect();
-        /* Create new one */
-        srcRectCon = srcRect->valueChanged.connect
-        (&SpritePrivate::onSrcRectChange, this);
+        if (!srcRectWatch.poll(srcRect->generation))
+            return;
+        
+        onSrcRectChange();
+        
+        /* Too late to wait for prepare() when drawing */
+        if (wave.dirty)
+        {
+            updateWave();
+            wave.dirty = false;
+        }
     }
     
     void updateVisibility()
     {
         isVisible = false;
+        offScreen = false;
+        coversScene = false;
         
         if (nullOrDisposed(bitmap))
             return;
@@ -202,36 +251,118 @@ struct SpritePrivate
             return;
         }
         
-        /* Compare sprite bounding box against the scene */
+        /* Compare the bounding box of the transformed source
+         * rectangle against the scene, zoomed / rotated or not */
+        const float w = clamp<int>(srcRect->width, 0, bitmap->width() - srcRect->x);
+        const float h = clamp<int>(srcRect->height, 0, bitmap->height() - srcRect->y);
+        const float *m = trans.getMatrix();
+        
+        const float xs[] = { 0, w * m[0], h * m[4], w * m[0] + h * m[4] };
+        const float ys[] = { 0, w * m[1], h * m[5], w * m[1] + h * m[5] };
         
-        /* If sprite is zoomed/rotated, just opt out for now
-         * for simplicity's sake */
+        /* The matrix places the sprite relative to the screen */
+        const float left   = m[12] - clipRect.x + *std::min_element(xs, xs + 4);
+        const float right  = m[12] - clipRect.x + *std::max_element(xs, xs + 4);
+        const float top    = m[13] - clipRect.y + *std::min_element(ys, ys + 4);
+        const float bottom = m[13] - clipRect.y + *std::max_element(ys, ys + 4);
+        
+        IntRect self;
+        self.x = (int) floorf(left);
+        self.y = (int) floorf(top);
+        self.w = (int) ceilf(right) - self.x;
+        self.h = (int) ceilf(bottom) - self.y;
+        
+        isVisible = SDL_HasIntersection(&self, &sceneRect);
+        offScreen = !isVisible;
+        
+        coversScene = isVisible && m[1] == 0 && m[4] == 0
+                   && srcRect->x >= 0 && srcRect->y >= 0
+                   && left <= 0 && top <= 0
+                   && right >= sceneRect.w && bottom >= sceneRect.h;
+    }
+    
+    /* The larger of the two zoom factors; mipmaps are
+     * only worth it once the sprite shrinks both ways */
+    float drawZoom()
+    {
         const Vec2 &scale = trans.getScale();
-        if (scale.x != 1 || scale.y != 1 || trans.getRotation() != 0)
+        
+        return std::max(fabsf(scale.x), fabsf(scale.y));
+    }
+    
+    /* Every pixel the plain (effect free) draw writes
+     * is fully opaque, so blending would change nothing */
+    bool drawsOpaque()
+    {
+        return opacity == 255 && blendType == BlendNormal
+            && bitmap->isOpaque();
+    }
+    
+    void updateCulling()
+    {
+        /* Skipped by the scene without being asked */
+        self->culled = !isVisible;
+    }
+    
+    /* Bitmaps too large for a texture (mega surfaces) are drawn
+     * from a window texture holding the part of them in view */
+    const TEXFBO *fetchMegaWindow()
+    {
+        IntRect region = srcRect->toIntRect();
+        region.w = clamp<int>(region.w, 0, bitmap->width() - region.x);
+        region.h = clamp<int>(region.h, 0, bitmap->height() - region.y);
+        
+        /* Cut down to what's on screen where that's easy
+         * to tell; rotated and waving sprites take it all */
+        const Vec2 &scale = trans.getScale();
+        
+        if (!wave.active && trans.getRotation() == 0 && scale.x > 0 && scale.y > 0)
         {
-            isVisible = true;
-            return;
+            const Vec2i pos = trans.getPositionI() - sceneOrig;
+            const Vec2i orig = trans.getOriginI();
+            
+            int x0 = floorf(-pos.x / scale.x) + orig.x;
+            int x1 = ceilf((sceneRect.w - pos.x) / scale.x) + orig.x;
+            const int y0 = clamp<int>(floorf(-pos.y / scale.y) + orig.y, 0, region.h);
+            const int y1 = clamp<int>(ceilf((sceneRect.h - pos.y) / scale.y) + orig.y, 0, region.h);
+            
+            x0 = clamp(x0, 0, region.w);
+            x1 = clamp(x1, 0, region.w);
+            
+            if (mirrored)
+            {
+                const int tmp = x0;
+                x0 = region.w - x1;
+                x1 = region.w - tmp;
+            }
+            
+            region = IntRect(region.x + x0, region.y + y0, x1 - x0, y1 - y0);
         }
         
-        IntRect self;
-        self.setPos(trans.getPositionI() - (trans.getOriginI() + sceneOrig));
-        self.w = bitmap->width();
-        self.h = bitmap->height();
+        const TEXFBO *tex;
+        Vec2i offset;
+        bitmap->getMegaWindow(region, tex, offset);
         
-        isVisible = SDL_HasIntersection(&self, &sceneRect);
+        if (offset != megaOffset || tex->height != megaTexH)
+        {
+            megaOffset = offset;
+            megaTexH = tex->height;
+            onSrcRectChange();
+        }
+        
+        return tex;
     }
     
-    void emitWaveChunk(SVertex *&vert, float phase, int width,
+    /* The strip's vertical position is taken from its tex
+     * coords in sprite.vert; its pos only carries the strip's
+     * top edge (on screen), from which the offset is computed */
+    void emitWaveChunk(SVertex *&vert, int width,
                        float zoomY, int chunkY, int chunkLength)
     {
-        float wavePos = phase + (chunkY / (float) wave.length) * (float) (M_PI * 2);
-        float chunkX = sin(wavePos) * wave.amp;
-        
         FloatRect tex(0, chunkY / zoomY, width, chunkLength / zoomY);
-        FloatRect pos = tex;
-        pos.x = chunkX;
         
-        Quad::setTexPosRect(vert, mirrored ? tex.hFlipped() : tex, pos);
+        Quad::setTexPosRect(vert, mirrored ? tex.hFlipped() : tex,
+                            FloatRect(0, chunkY, width, 0));
         vert += 4;
     }
     
@@ -247,6 +378,7 @@ struct SpritePrivate
         }
         
         wave.active = true;
+        wave.strips = false;
         
         int width = srcRect->width;
         int height = srcRect->height;
@@ -291,22 +423,41 @@ struct SpritePrivate
         wave.qArray.resize(!!firstLength + chunks + !!lastLength);
         SVertex *vert = &wave.qArray.vertices[0];
         
-        float phase = (wave.phase * (float) M_PI) / 180.0f;
-        
         if (firstLength > 0)
-            emitWaveChunk(vert, phase, width, zoomY, 0, firstLength);
+            emitWaveChunk(vert, width, zoomY, 0, firstLength);
         
         for (int i = 0; i < chunks; ++i)
-            emitWaveChunk(vert, phase, width, zoomY, firstLength + i * 8, 8);
+            emitWaveChunk(vert, width, zoomY, firstLength + i * 8, 8);
         
         if (lastLength > 0)
-            emitWaveChunk(vert, phase, width, zoomY, firstLength + chunks * 8, lastLength);
+            emitWaveChunk(vert, width, zoomY, firstLength + chunks * 8, lastLength);
         
         wave.qArray.commit();
+        wave.strips = true;
     }
     
-    void prepare()
+    /* The transform matrix to draw with, see FrameInterpolator */
+    const float *drawMatrix()
     {
+        const float *m = trans.getMatrix();
+        const Vec2 pos = interp.get(Vec2(m[12], m[13]));
+        
+        if (pos.x == m[12] && pos.y == m[13])
+            return m;
+        
+        memcpy(interpMatrix, m, sizeof(interpMatrix));
+        interpMatrix[12] = pos.x;
+        interpMatrix[13] = pos.y;
+        
+        return interpMatrix;
+    }
+    
+    /* Enrolled by changes to the wave or to anything
+     * the visibility check depends on */
+    bool prepare()
+    {
+        syncSrcRect();
+        
         if (wave.dirty)
         {
             updateWave();
@@ -314,6 +465,11 @@ struct SpritePrivate
         }
         
         updateVisibility();
+        updateCulling();
+        
+        /* Culled sprites aren't drawn, which is where src_rect
+         * writes are picked up otherwise; poll it from here */
+        return offScreen;
     }
 };
 
@@ -321,6 +477,7 @@ Sprite::Sprite(Viewport *viewport)
 : ViewportElement(viewport)
 {
     p = new SpritePrivate;
+    p->self = this;
     onGeometryChange(scene->getGeometry());
 }
 
@@ -348,19 +505,30 @@ DEF_ATTR_RD_SIMPLE(Sprite, WaveAmp,    int,     p->wave.amp)
 DEF_ATTR_RD_SIMPLE(Sprite, WaveLength, int,     p->wave.length)
 DEF_ATTR_RD_SIMPLE(Sprite, WaveSpeed,  int,     p->wave.speed)
 DEF_ATTR_RD_SIMPLE(Sprite, WavePhase,  float,   p->wave.phase)
+DEF_ATTR_RD_SIMPLE(Sprite, Hue,        int,     p->hue)
+
+DEF_ATTR_SIMPLE_DAMAGE(Sprite, BushOpacity, int,     p->bushOpacity)
+DEF_ATTR_SIMPLE_DAMAGE(Sprite, SrcRect,     Rect&,  *p->srcRect)
+DEF_ATTR_SIMPLE_DAMAGE(Sprite, Color,       Color&, *p->color)
+DEF_ATTR_SIMPLE_DAMAGE(Sprite, Tone,        Tone&,  *p->tone)
+DEF_ATTR_SIMPLE_DAMAGE(Sprite, PatternTile, bool, p->patternTile)
+DEF_ATTR_SIMPLE_DAMAGE(Sprite, PatternOpacity, int, p->patternOpacity)
+DEF_ATTR_SIMPLE_DAMAGE(Sprite, PatternScrollX, int, p->patternScroll.x)
+DEF_ATTR_SIMPLE_DAMAGE(Sprite, PatternScrollY, int, p->patternScroll.y)
+DEF_ATTR_SIMPLE_DAMAGE(Sprite, PatternZoomX, float, p->patternZoom.x)
+DEF_ATTR_SIMPLE_DAMAGE(Sprite, PatternZoomY, float, p->patternZoom.y)
+DEF_ATTR_SIMPLE_DAMAGE(Sprite, Invert,      bool,    p->invert)
 
-DEF_ATTR_SIMPLE(Sprite, BushOpacity, int,     p->bushOpacity)
-DEF_ATTR_SIMPLE(Sprite, Opacity,     int,     p->opacity)
-DEF_ATTR_SIMPLE(Sprite, SrcRect,     Rect&,  *p->srcRect)
-DEF_ATTR_SIMPLE(Sprite, Color,       Color&, *p->color)
-DEF_ATTR_SIMPLE(Sprite, Tone,        Tone&,  *p->tone)
-DEF_ATTR_SIMPLE(Sprite, PatternTile, bool, p->patternTile)
-DEF_ATTR_SIMPLE(Sprite, PatternOpacity, int, p->patternOpacity)
-DEF_ATTR_SIMPLE(Sprite, PatternScrollX, int, p->patternScroll.x)
-DEF_ATTR_SIMPLE(Sprite, PatternScrollY, int, p->patternScroll.y)
-DEF_ATTR_SIMPLE(Sprite, PatternZoomX, float, p->patternZoom.x)
-DEF_ATTR_SIMPLE(Sprite, PatternZoomY, float, p->patternZoom.y)
-DEF_ATTR_SIMPLE(Sprite, Invert,      bool,    p->invert)
+DEF_ATTR_RD_SIMPLE(Sprite, Opacity, int, p->opacity)
+
+void Sprite::setOpacity(int value)
+{
+    guardDisposed();
+    
+    p->opacity = value;
+    p->requestPrepare();
+    damage();
+}
 
 void Sprite::setBitmap(Bitmap *bitmap)
 {
@@ -369,18 +537,22 @@ void Sprite::setBitmap(Bitmap *bitmap)
     if (p->bitmap == bitmap)
         return;
     
+    damage();
+    
     p->bitmap = bitmap;
+    p->requestPrepare();
     
     if (nullOrDisposed(bitmap))
         return;
     
-    bitmap->ensureNonMega();
+    p->megaOffset = Vec2i();
+    p->megaTexH = 0;
     
     *p->srcRect = bitmap->rect();
     p->onSrcRectChange();
     p->quad.setPosRect(p->srcRect->toFloatRect());
     
-    p->wave.dirty = true;
+    p->invalidateWave();
 }
 
 void Sprite::setX(int value)
@@ -390,7 +562,10 @@ void Sprite::setX(int value)
     if (p->trans.getPosition().x == value)
         return;
     
+    damage();
+    
     p->trans.setPosition(Vec2(value, getY()));
+    p->requestPrepare();
 }
 
 void Sprite::setY(int value)
@@ -400,11 +575,14 @@ void Sprite::setY(int value)
     if (p->trans.getPosition().y == value)
         return;
     
+    damage();
+    
     p->trans.setPosition(Vec2(getX(), value));
+    p->requestPrepare();
     
     if (rgssVer >= 2)
     {
-        p->wave.dirty = true;
+        p->invalidateWave();
         setSpriteY(value);
     }
 }
@@ -416,7 +594,10 @@ void Sprite::setOX(int value)
     if (p->trans.getOrigin().x == value)
         return;
     
+    damage();
+    
     p->trans.setOrigin(Vec2(value, getOY()));
+    p->requestPrepare();
 }
 
 void Sprite::setOY(int value)
@@ -426,7 +607,10 @@ void Sprite::setOY(int value)
     if (p->trans.getOrigin().y == value)
         return;
     
+    damage();
+    
     p->trans.setOrigin(Vec2(getOX(), value));
+    p->requestPrepare();
 }
 
 void Sprite::setZoomX(float value)
@@ -436,7 +620,10 @@ void Sprite::setZoomX(float value)
     if (p->trans.getScale().x == value)
         return;
     
+    damage();
+    
     p->trans.setScale(Vec2(value, getZoomY()));
+    p->requestPrepare();
 }
 
 void Sprite::setZoomY(float value)
@@ -446,11 +633,14 @@ void Sprite::setZoomY(float value)
     if (p->trans.getScale().y == value)
         return;
     
+    damage();
+    
     p->trans.setScale(Vec2(getZoomX(), value));
+    p->requestPrepare();
     p->recomputeBushDepth();
     
     if (rgssVer >= 2)
-        p->wave.dirty = true;
+        p->invalidateWave();
 }
 
 void Sprite::setAngle(float value)
@@ -460,7 +650,10 @@ void Sprite::setAngle(float value)
     if (p->trans.getRotation() == value)
         return;
     
+    damage();
+    
     p->trans.setRotation(value);
+    p->requestPrepare();
 }
 
 void Sprite::setMirror(bool mirrored)
@@ -470,6 +663,8 @@ void Sprite::setMirror(bool mirrored)
     if (p->mirrored == mirrored)
         return;
     
+    damage();
+    
     p->mirrored = mirrored;
     p->onSrcRectChange();
 }
@@ -481,13 +676,30 @@ void Sprite::setBushDepth(int value)
     if (p->bushDepth == value)
         return;
     
+    damage();
+    
     p->bushDepth = value;
     p->recomputeBushDepth();
 }
 
+void Sprite::setHue(int value)
+{
+    guardDisposed();
+    
+    value = wrapRange(value, 0, 359);
+    
+    if (p->hue == value)
+        return;
+    
+    damage();
+    
+    p->hue = value;
+}
+
 void Sprite::setBlendType(int type)
 {
     guardDisposed();
+    damage();
     
     switch (type)
     {
@@ -511,6 +723,8 @@ void Sprite::setPattern(Bitmap *value)
     if (p->pattern == value)
         return;
     
+    damage();
+    
     p->pattern = value;
     
     if (!nullOrDisposed(value))
@@ -520,6 +734,7 @@ void Sprite::setPattern(Bitmap *value)
 void Sprite::setPatternBlendType(int type)
 {
     guardDisposed();
+    damage();
     
     switch (type)
     {
@@ -536,20 +751,24 @@ void Sprite::setPatternBlendType(int type)
     }
 }
 
-#define DEF_WAVE_SETTER(Name, name, type) \
+/* Only amp and length change the strip mesh,
+ * the rest is fed to the shader on draw */
+#define DEF_WAVE_SETTER(Name, name, type, rebuild) \
 void Sprite::setWave##Name(type value) \
 { \
 guardDisposed(); \
 if (p->wave.name == value) \
 return; \
+damage(); \
 p->wave.name = value; \
-p->wave.dirty = true; \
+if (rebuild) \
+p->invalidateWave(); \
 }
 
-DEF_WAVE_SETTER(Amp,    amp,    int)
-DEF_WAVE_SETTER(Length, length, int)
-DEF_WAVE_SETTER(Speed,  speed,  int)
-DEF_WAVE_SETTER(Phase,  phase,  float)
+DEF_WAVE_SETTER(Amp,    amp,    int,   true)
+DEF_WAVE_SETTER(Length, length, int,   true)
+DEF_WAVE_SETTER(Speed,  speed,  int,   false)
+DEF_WAVE_SETTER(Phase,  phase,  float, false)
 
 #undef DEF_WAVE_SETTER
 
@@ -559,7 +778,7 @@ void Sprite::initDynAttribs()
     p->color = new Color;
     p->tone = new Tone;
     
-    p->updateSrcRectCon();
+    p->srcRectWatch.reset();
 }
 
 /* Flashable */
@@ -569,43 +788,73 @@ void Sprite::update()
     
     Flashable::update();
     
+    /* A moving wave needs redrawing every frame */
+    if (p->wave.amp != 0 && p->wave.speed / 180 != 0)
+        damage();
+    
     p->wave.phase += p->wave.speed / 180;
-    p->wave.dirty = true;
 }
 
 /* SceneElement */
 void Sprite::draw()
 {
-    if (!p->isVisible)
+    /* The bitmap may have been disposed
+     * since visibility was last checked */
+    if (!p->isVisible || nullOrDisposed(p->bitmap))
         return;
     
     if (emptyFlashFlag)
         return;
     
+    p->syncSrcRect();
+    
     ShaderBase *base;
     
-    bool renderEffect = p->color->hasEffect() ||
+    bool renderEffect = p->wave.active        ||
+    p->color->hasEffect() ||
     p->tone->hasEffect()  ||
     flashing              ||
     p->bushDepth != 0     ||
     p->invert             ||
+    p->hue != 0           ||
     (p->pattern && !p->pattern->isDisposed());
     
     if (renderEffect)
     {
-        SpriteShader &shader = shState->shaders().sprite;
+        /* Only compile in the effects this draw needs */
+        unsigned features = 0;
+        
+        if (p->tone->hasEffect())
+            features |= SpriteShader::Tone;
+        if (p->color->hasEffect() || flashing)
+            features |= SpriteShader::Color;
+        if (p->bushDepth != 0)
+            features |= SpriteShader::Bush;
+        if (p->pattern && !p->pattern->isDisposed() && p->patternOpacity > 0)
+            features |= SpriteShader::Pattern;
+        if (p->invert)
+            features |= SpriteShader::Invert;
+        if (p->hue != 0)
+            features |= SpriteShader::Hue;
+        
+        SpriteShader &shader = shState->shaders().spriteVariant(features);
         
         shader.bind();
         shader.applyViewportProj();
-        shader.setSpriteMat(p->trans.getMatrix());
-        
-        shader.setTone(p->tone->norm);
+        shader.setSpriteMat(p->drawMatrix());
         shader.setOpacity(p->opacity.norm);
-        shader.setBushDepth(p->efBushDepth);
-        shader.setBushOpacity(p->bushOpacity.norm);
         
-        if (p->pattern && p->patternOpacity > 0) {
-            shader.setPattern(p->pattern->getGLTypes().tex, Vec2(p->pattern->width(), p->pattern->height()));
+        if (features & SpriteShader::Tone)
+            shader.setTone(p->tone->norm);
+        
+        if (features & SpriteShader::Bush)
+        {
+            shader.setBushDepth(p->efBushDepth);
+            shader.setBushOpacity(p->bushOpacity.norm);
+        }
+        
+        if (features & SpriteShader::Pattern) {
+            shader.setPattern(p->pattern->getDrawTex().tex, Vec2(p->pattern->width(), p->pattern->height()));
             shader.setPatternBlendType(p->patternBlendType);
             shader.setPatternTile(p->patternTile);
             shader.setPatternZoom(p->patternZoom);
@@ -617,14 +866,27 @@ void Sprite::draw()
             shader.setShouldRenderPattern(false);
         }
         
-        shader.setInvert(p->invert);
+        if (features & SpriteShader::Invert)
+            shader.setInvert(p->invert);
         
-        /* When both flashing and effective color are set,
-         * the one with higher alpha will be blended */
-        const Vec4 *blend = (flashing && flashColor.w > p->color->norm.w) ?
-        &flashColor : &p->color->norm;
+        if (features & SpriteShader::Hue)
+            shader.setHueAdjust(p->hue / 360.0f);
         
-        shader.setColor(*blend);
+        if (p->wave.strips && p->wave.active)
+            shader.setWave(p->wave.amp, (p->wave.phase * (float) M_PI) / 180.0f,
+                           p->wave.length);
+        else
+            shader.setWave(0, 0, 0);
+        
+        if (features & SpriteShader::Color)
+        {
+            /* When both flashing and effective color are set,
+             * the one with higher alpha will be blended */
+            const Vec4 *blend = (flashing && flashColor.w > p->color->norm.w) ?
+            &flashColor : &p->color->norm;
+            
+            shader.setColor(*blend);
+        }
         
         base = &shader;
     }
@@ -633,7 +895,7 @@ void Sprite::draw()
         AlphaSpriteShader &shader = shState->shaders().alphaSprite;
         shader.bind();
         
-        shader.setSpriteMat(p->trans.getMatrix());
+        shader.setSpriteMat(p->drawMatrix());
         shader.setAlpha(p->opacity.norm);
         shader.applyViewportProj();
         base = &shader;
@@ -643,23 +905,159 @@ void Sprite::draw()
         SimpleSpriteShader &shader = shState->shaders().simpleSprite;
         shader.bind();
         
-        shader.setSpriteMat(p->trans.getMatrix());
+        shader.setSpriteMat(p->drawMatrix());
         shader.applyViewportProj();
         base = &shader;
     }
     
+    /* Effects are left to blending; only the plain
+     * shader paths can know they write opaque pixels */
+    const bool noBlend = !renderEffect && p->drawsOpaque();
+    
     glState.blendMode.pushSet(p->blendType);
+    glState.blend.pushSet(!noBlend);
     
-    p->bitmap->bindTex(*base);
+    bool mipmapped = false;
+    
+    if (p->bitmap->isMega())
+    {
+        const TEXFBO *tex = p->fetchMegaWindow();
+        TEX::bind(tex->tex);
+        base->setTexSize(Vec2i(tex->width, tex->height));
+    }
+    else
+    {
+        mipmapped = p->bitmap->bindTexZoomed(*base, p->drawZoom());
+    }
     
     if (p->wave.active)
         p->wave.qArray.draw();
     else
         p->quad.draw();
     
+    if (mipmapped)
+        TEX::setSmooth(false);
+    
+    glState.blend.pop();
     glState.blendMode.pop();
 }
 
+bool Sprite::getBatchQuad(BatchQuad &quad)
+{
+    if (!p->isVisible || emptyFlashFlag || nullOrDisposed(p->bitmap))
+    {
+        quad.tex = 0;
+        return true;
+    }
+    
+    p->syncSrcRect();
+    
+    /* Anything beyond a plain (optionally translucent)
+     * textured quad needs the full shader path */
+    if (p->wave.active               ||
+        flashing                     ||
+        p->bushDepth != 0            ||
+        p->invert                    ||
+        p->hue != 0                  ||
+        p->bitmap->isMega()          ||
+        p->bitmap->wantsMipmaps(p->drawZoom()) ||
+        p->color->hasEffect()        ||
+        p->tone->hasEffect()         ||
+        (p->pattern && !p->pattern->isDisposed()))
+        return false;
+    
+    const float *m = p->drawMatrix();
+    
+    for (size_t i = 0; i < 4; ++i)
+    {
+        const Vec2 &pos = p->quad.vert[i].pos;
+        
+        quad.pos[i] = Vec2(m[0]*pos.x + m[4]*pos.y + m[12],
+                           m[1]*pos.x + m[5]*pos.y + m[13]);
+        quad.texPos[i] = p->quad.vert[i].texPos;
+    }
+    
+    const TEXFBO *page;
+    Vec2i offset;
+    
+    if (p->bitmap->getAtlasTex(page, offset))
+    {
+        for (size_t i = 0; i < 4; ++i)
+            quad.texPos[i] = Vec2(quad.texPos[i].x + offset.x,
+                                  quad.texPos[i].y + offset.y);
+        
+        quad.tex = page;
+    }
+    else
+    {
+        quad.tex = &p->bitmap->getDrawTex();
+    }
+    
+    quad.blendType = p->blendType;
+    quad.opacity = p->opacity.norm;
+    quad.smooth = false;
+    quad.opaque = p->drawsOpaque();
+    
+    return true;
+}
+
+bool Sprite::occludesScene()
+{
+    if (!p->isVisible || !p->coversScene || emptyFlashFlag)
+        return false;
+    
+    /* Color, tone, flash and hue only change colors; anything
+     * that can let the scene behind shine through is out */
+    if (!(p->opacity == 255)         ||
+        p->blendType != BlendNormal  ||
+        p->wave.active               ||
+        (p->bushDepth != 0 && !(p->bushOpacity == 255)) ||
+        (p->pattern && !p->pattern->isDisposed()))
+        return false;
+    
+    return !nullOrDisposed(p->bitmap) && p->bitmap->isOpaque();
+}
+
+bool Sprite::hitTest(int x, int y)
+{
+    if (isDisposed() || !visible || !p->opacity)
+        return false;
+    
+    if (nullOrDisposed(p->bitmap))
+        return false;
+    
+    if (!p->clipRect.encloses(IntRect(x, y, 1, 1)))
+        return false;
+    
+    /* Map the pixel center back through the sprite transform */
+    const float *m = p->trans.getMatrix();
+    const float det = m[0] * m[5] - m[4] * m[1];
+    
+    if (det == 0)
+        return false;
+    
+    const float dx = x + 0.5f - m[12];
+    const float dy = y + 0.5f - m[13];
+    const float u = ( m[5] * dx - m[4] * dy) / det;
+    const float v = (-m[1] * dx + m[0] * dy) / det;
+    
+    /* Clamped the same way as in 'onSrcRectChange()' */
+    IntRect rect = p->srcRect->toIntRect();
+    rect.w = clamp<int>(rect.w, 0, p->bitmap->width() - rect.x);
+    rect.h = clamp<int>(rect.h, 0, p->bitmap->height() - rect.y);
+    
+    if (u < 0 || v < 0 || u >= rect.w || v >= rect.h)
+        return false;
+    
+    int bx = (int) u;
+    const int by = (int) v;
+    
+    if (p->mirrored)
+        bx = rect.w - 1 - bx;
+    
+    return p->bitmap->isSolidAt(rect.x + bx, rect.y + by);
+}
+
 void Sprite::onGeometryChange(const Scene::Geometry &geo)
 {
     /* Offset at which the sprite will be drawn
@@ -668,6 +1066,8 @@ void Sprite::onGeometryChange(const Scene::Geometry &geo)
     
     p->sceneRect.setSize(geo.rect.size());
     p->sceneOrig = geo.orig;
+    p->clipRect = geo.rect;
+    p->requestPrepare();
 }
 
 void Sprite::releaseResources()
@@ -27,6 +27,7 @@
 #include "disposable.h"
 #include "viewport.h"
 #include "util.h"
+#include "object-pool.h"
 
 class Bitmap;
 struct Color;
@@ -41,6 +42,8 @@ public:
 	Sprite(Viewport *viewport = 0);
 	~Sprite();
 
+	DECL_POOLED_NEW(Sprite)
+
 	int getWidth()  const;
 	int getHeight() const;
 
@@ -71,6 +74,8 @@ public:
     DECL_ATTR( PatternZoomX, float  )
     DECL_ATTR( PatternZoomY, float  )
     DECL_ATTR( Invert,      bool    )
+    /* Like Bitmap#hue_change, but applied while drawing */
+    DECL_ATTR( Hue,         int     )
 	DECL_ATTR( WaveAmp,     int     )
 	DECL_ATTR( WaveLength,  int     )
 	DECL_ATTR( WaveSpeed,   int     )
@@ -78,15 +83,25 @@ public:
 
 	void initDynAttribs();
 
+	/* Pixel exact: the screen pixel (x, y) is covered by a non
+	 * transparent pixel of the bitmap, following position, zoom,
+	 * angle, mirror, src_rect and viewport clipping. Wave and
+	 * bush effects are not taken into account */
+	bool hitTest(int x, int y);
+
 private:
 	SpritePrivate *p;
 
 	void draw();
 	void onGeometryChange(const Scene::Geometry &);
+	bool getBatchQuad(BatchQuad &quad);
+	bool occludesScene();
 
 	void releaseResources();
 	const char *klassName() const { return "sprite"; }
 
+	friend struct SpritePrivate;
+
 	ABOUT_TO_ACCESS_DISP
 };
 
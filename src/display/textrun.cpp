@@ -0,0 +1,116 @@
+/*
+** textrun.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "textrun.h"
+
+#include "bitmap.h"
+#include "font.h"
+#include "sharedstate.h"
+#include "util.h"
+
+#include <SDL_ttf.h>
+
+#include <algorithm>
+#include <string>
+
+/* Room for the outline and shadow around the glyphs */
+#define TEXT_RUN_PADDING 2
+
+/* Line breaks are drawn as spaces, as by Bitmap#draw_text */
+static std::string singleLine(const char *str)
+{
+	std::string s(str);
+	std::replace(s.begin(), s.end(), '\r', ' ');
+	std::replace(s.begin(), s.end(), '\n', ' ');
+
+	return s;
+}
+
+Vec2i TextRun::bitmapSize(const char *str, Font &font)
+{
+	TTF_Font *sdlFont = font.getSdlFont();
+	const std::string line = singleLine(str);
+
+	int w = 0, h = 0;
+	TTF_SizeUTF8(sdlFont, line.c_str(), &w, &h);
+
+	h = std::max(h, TTF_FontHeight(sdlFont));
+
+	return Vec2i(std::max(w, 1) + TEXT_RUN_PADDING,
+	             std::max(h, 1) + TEXT_RUN_PADDING);
+}
+
+TextRun::TextRun(const char *str, Font &font, Bitmap *bitmap)
+    : bitmap(bitmap)
+{
+	TTF_Font *sdlFont = font.getSdlFont();
+	const int style = TTF_GetFontStyle(sdlFont);
+	SharedFontState &fontState = shState->fontState();
+	const std::string line = singleLine(str);
+
+	int x = 0;
+
+	for (const char *ptr = line.c_str(); *ptr;)
+	{
+		const char *next;
+		const uint16_t ch = utf8_to_ucs2(ptr, &next);
+
+		/* Stray byte, not a character of its own */
+		if (next == ptr)
+		{
+			++ptr;
+			continue;
+		}
+
+		offsets.push_back(x);
+		x += fontState.glyphAdvance(sdlFont, style, ch);
+		ptr = next;
+	}
+
+	offsets.push_back(x);
+
+	bitmap->setFont(font);
+	bitmap->drawText(IntRect(0, 0, bitmap->width(), bitmap->height()), line.c_str());
+}
+
+int TextRun::length() const
+{
+	return offsets.size() - 1;
+}
+
+int TextRun::revealWidth(int count) const
+{
+	if (count >= length())
+		return bitmap->width();
+
+	if (count <= 0)
+		return 0;
+
+	return offsets[count];
+}
+
+void TextRun::draw(Bitmap &dest, int x, int y, int count, int opacity) const
+{
+	const int w = revealWidth(count);
+
+	if (w == 0)
+		return;
+
+	dest.blt(x, y, *bitmap, IntRect(0, 0, w, bitmap->height()), opacity);
+}
@@ -0,0 +1,64 @@
+/*
+** textrun.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TEXTRUN_H
+#define TEXTRUN_H
+
+#include "etc-internal.h"
+
+#include <vector>
+
+class Bitmap;
+class Font;
+
+/* A string rasterized once, to be revealed a character at a time
+ * (typewriter style message display) without drawing the string
+ * again for every step. Revealing is a blit of the leading part,
+ * or a Sprite showing the bitmap with a growing 'src_rect' */
+class TextRun
+{
+public:
+	/* Size the bitmap for 'str' drawn with 'font' has to be */
+	static Vec2i bitmapSize(const char *str, Font &font);
+
+	/* Draws 'str' into 'bitmap' (sized by 'bitmapSize()',
+	 * and kept alive by the caller) with a copy of 'font' */
+	TextRun(const char *str, Font &font, Bitmap *bitmap);
+
+	/* Characters in the string */
+	int length() const;
+
+	/* Width of the bitmap covering the first 'count'
+	 * characters; with all of them, the whole bitmap */
+	int revealWidth(int count) const;
+
+	/* Blits the first 'count' characters to (x, y) of 'dest' */
+	void draw(Bitmap &dest, int x, int y, int count,
+	          int opacity = 255) const;
+
+	Bitmap *getBitmap() const { return bitmap; }
+
+private:
+	Bitmap *bitmap;
+
+	/* Left edge of every character, and the text width last */
+	std::vector<int> offsets;
+};
+
+#endif // TEXTRUN_H
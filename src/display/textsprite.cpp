@@ -0,0 +1,410 @@
+/*
+** textsprite.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "textsprite.h"
+
+#include "sharedstate.h"
+#include "font.h"
+#include "etc.h"
+#include "util.h"
+
+#include "quad.h"
+#include "quadarray.h"
+#include "transform.h"
+#include "etc-internal.h"
+#include "shader.h"
+#include "glstate.h"
+
+#include <math.h>
+#include <vector>
+
+struct TextSpritePrivate
+{
+	std::string text;
+
+	Font fontTmp;
+	Font *font;
+
+	int opacity;
+	BlendType blendType;
+
+	Transform trans;
+
+	/* What the quads were last built from */
+	SdfAtlas *atlas;
+	unsigned int atlasGeneration;
+	int fontSize;
+	bool textDirty;
+
+	/* Extent of the text at zoom 1 */
+	Vec2i size;
+
+	/* In the text's own coordinates, at zoom 1 */
+	SimpleQuadArray qArray;
+
+	TextSpritePrivate()
+	    : font(&fontTmp),
+	      opacity(255),
+	      blendType(BlendNormal),
+	      atlas(0),
+	      atlasGeneration(0),
+	      fontSize(0),
+	      textDirty(true)
+	{}
+
+	/* Rebuilds the quads if the text, the font or
+	 * the atlas have changed since they were built */
+	void ensureQuads()
+	{
+		SdfAtlas &current = font->getSdfAtlas();
+
+		if (!textDirty && &current == atlas && current.generation() == atlasGeneration
+		    && font->getSize() == fontSize)
+			return;
+
+		atlas = &current;
+		fontSize = font->getSize();
+		textDirty = false;
+
+		/* Adding glyphs may empty a full atlas, taking
+		 * the ones placed before with it; start over once */
+		for (int i = 0; i < 2; ++i)
+		{
+			atlasGeneration = atlas->generation();
+			buildQuads();
+
+			if (atlas->generation() == atlasGeneration)
+				break;
+		}
+	}
+
+	void buildQuads()
+	{
+		const float scale = (float) fontSize / SdfAtlas::BaseSize;
+		const float lineH = atlas->lineHeight() * scale;
+
+		std::vector<FloatRect> tex, pos;
+
+		float penX = 0, penY = 0;
+		float width = 0;
+
+		for (const char *ptr = text.c_str(); *ptr;)
+		{
+			const char *next;
+			const uint16_t ch = utf8_to_ucs2(ptr, &next);
+
+			/* Stray byte, not a character of its own */
+			if (next == ptr)
+			{
+				++ptr;
+				continue;
+			}
+
+			ptr = next;
+
+			if (ch == '\n')
+			{
+				penX = 0;
+				penY += lineH;
+				continue;
+			}
+
+			if (ch == '\r')
+				continue;
+
+			const SdfGlyph *glyph = atlas->glyph(ch);
+
+			if (!glyph)
+				continue;
+
+			if (glyph->rect.w > 0)
+			{
+				tex.push_back(FloatRect(glyph->rect.x, glyph->rect.y,
+				                        glyph->rect.w, glyph->rect.h));
+				pos.push_back(FloatRect(penX + glyph->offset.x * scale,
+				                        penY + glyph->offset.y * scale,
+				                        glyph->rect.w * scale, glyph->rect.h * scale));
+			}
+
+			penX += glyph->advance * scale;
+			width = std::max(width, penX);
+		}
+
+		size = Vec2i((int) ceilf(width), text.empty() ? 0 : (int) ceilf(penY + lineH));
+
+		qArray.resize(tex.size());
+
+		for (size_t i = 0; i < tex.size(); ++i)
+			Quad::setTexPosRect(&qArray.vertices[i*4], tex[i], pos[i]);
+
+		qArray.commit();
+	}
+};
+
+TextSprite::TextSprite(Viewport *viewport)
+    : ViewportElement(viewport)
+{
+	p = new TextSpritePrivate();
+
+	onGeometryChange(scene->getGeometry());
+}
+
+TextSprite::~TextSprite()
+{
+	dispose();
+}
+
+DEF_ATTR_RD_SIMPLE(TextSprite, Font,      Font&, *p->font)
+DEF_ATTR_RD_SIMPLE(TextSprite, X,         int,   p->trans.getPosition().x)
+DEF_ATTR_RD_SIMPLE(TextSprite, Y,         int,   p->trans.getPosition().y)
+DEF_ATTR_RD_SIMPLE(TextSprite, OX,        int,   p->trans.getOrigin().x)
+DEF_ATTR_RD_SIMPLE(TextSprite, OY,        int,   p->trans.getOrigin().y)
+DEF_ATTR_RD_SIMPLE(TextSprite, ZoomX,     float, p->trans.getScale().x)
+DEF_ATTR_RD_SIMPLE(TextSprite, ZoomY,     float, p->trans.getScale().y)
+DEF_ATTR_RD_SIMPLE(TextSprite, Angle,     float, p->trans.getRotation())
+DEF_ATTR_RD_SIMPLE(TextSprite, Opacity,   int,   p->opacity)
+DEF_ATTR_RD_SIMPLE(TextSprite, BlendType, int,   p->blendType)
+
+const std::string &TextSprite::getText() const
+{
+	guardDisposed();
+
+	return p->text;
+}
+
+void TextSprite::setText(const std::string &value)
+{
+	guardDisposed();
+
+	if (p->text == value)
+		return;
+
+	p->text = value;
+	p->textDirty = true;
+
+	damage();
+}
+
+int TextSprite::getWidth()
+{
+	guardDisposed();
+
+	p->ensureQuads();
+
+	return p->size.x;
+}
+
+int TextSprite::getHeight()
+{
+	guardDisposed();
+
+	p->ensureQuads();
+
+	return p->size.y;
+}
+
+void TextSprite::setFont(Font &value)
+{
+	guardDisposed();
+
+	*p->font = value;
+	p->textDirty = true;
+
+	damage();
+}
+
+void TextSprite::setInitFont(Font *value)
+{
+	p->font = value;
+	p->textDirty = true;
+}
+
+void TextSprite::setX(int value)
+{
+	guardDisposed();
+
+	if (p->trans.getPosition().x == value)
+		return;
+
+	p->trans.setPosition(Vec2(value, getY()));
+	damage();
+}
+
+void TextSprite::setY(int value)
+{
+	guardDisposed();
+
+	if (p->trans.getPosition().y == value)
+		return;
+
+	p->trans.setPosition(Vec2(getX(), value));
+	damage();
+}
+
+void TextSprite::setOX(int value)
+{
+	guardDisposed();
+
+	if (p->trans.getOrigin().x == value)
+		return;
+
+	p->trans.setOrigin(Vec2(value, getOY()));
+	damage();
+}
+
+void TextSprite::setOY(int value)
+{
+	guardDisposed();
+
+	if (p->trans.getOrigin().y == value)
+		return;
+
+	p->trans.setOrigin(Vec2(getOX(), value));
+	damage();
+}
+
+void TextSprite::setZoomX(float value)
+{
+	guardDisposed();
+
+	if (p->trans.getScale().x == value)
+		return;
+
+	p->trans.setScale(Vec2(value, getZoomY()));
+	damage();
+}
+
+void TextSprite::setZoomY(float value)
+{
+	guardDisposed();
+
+	if (p->trans.getScale().y == value)
+		return;
+
+	p->trans.setScale(Vec2(getZoomX(), value));
+	damage();
+}
+
+void TextSprite::setAngle(float value)
+{
+	guardDisposed();
+
+	if (p->trans.getRotation() == value)
+		return;
+
+	p->trans.setRotation(value);
+	damage();
+}
+
+void TextSprite::setOpacity(int value)
+{
+	guardDisposed();
+
+	value = clamp(value, 0, 255);
+
+	if (p->opacity == value)
+		return;
+
+	p->opacity = value;
+	damage();
+}
+
+void TextSprite::setBlendType(int value)
+{
+	guardDisposed();
+	damage();
+
+	switch (value)
+	{
+	default :
+	case BlendNormal :
+		p->blendType = BlendNormal;
+		return;
+	case BlendAddition :
+		p->blendType = BlendAddition;
+		return;
+	case BlendSubstraction :
+		p->blendType = BlendSubstraction;
+		return;
+	}
+}
+
+void TextSprite::draw()
+{
+	if (p->opacity == 0)
+		return;
+
+	p->ensureQuads();
+
+	if (p->qArray.count() == 0)
+		return;
+
+	Font &font = *p->font;
+
+	/* One screen pixel in field units (see SdfAtlas), for
+	 * antialiasing; the field spans 2 * Spread pixels */
+	const Vec2 &zoom = p->trans.getScale();
+	const float screenScale = (float) p->fontSize / SdfAtlas::BaseSize
+	                        * (fabsf(zoom.x) + fabsf(zoom.y)) * 0.5f;
+	const float pixel = 1.0f / (std::max(screenScale, 0.01f) * SdfAtlas::Spread * 2);
+
+	SdfTextShader &shader = shState->shaders().sdfText;
+
+	shader.bind();
+	shader.applyViewportProj();
+	shader.setMatrix(p->trans.getMatrix());
+	shader.setTexSize(p->atlas->texSize());
+	shader.setColor(font.getColor().norm);
+	shader.setOpacity(p->opacity / 255.0f);
+	shader.setSmoothing(clamp(pixel * 0.5f, 0.01f, 0.25f));
+
+	if (font.getOutline())
+	{
+		/* One pixel at the font's size, like Bitmap#draw_text */
+		const float width = (float) SdfAtlas::BaseSize / p->fontSize / (SdfAtlas::Spread * 2);
+
+		shader.setOutColor(font.getOutColor().norm);
+		shader.setOutlineEdge(std::max(0.5f - width, 0.05f));
+	}
+	else
+	{
+		shader.setOutColor(font.getColor().norm);
+		shader.setOutlineEdge(0.5f);
+	}
+
+	p->atlas->bindTex();
+
+	glState.blendMode.pushSet(p->blendType);
+
+	p->qArray.draw();
+
+	glState.blendMode.pop();
+}
+
+void TextSprite::onGeometryChange(const Scene::Geometry &geo)
+{
+	p->trans.setGlobalOffset(geo.offset());
+}
+
+void TextSprite::releaseResources()
+{
+	unlink();
+
+	delete p;
+}
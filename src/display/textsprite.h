@@ -0,0 +1,77 @@
+/*
+** textsprite.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TEXTSPRITE_H
+#define TEXTSPRITE_H
+
+#include "disposable.h"
+#include "viewport.h"
+
+#include <string>
+
+class Font;
+
+struct TextSpritePrivate;
+
+/* A string drawn straight from its font's distance field atlas
+ * (see SdfAtlas), positioned like a sprite. The glyphs stay sharp
+ * under any zoom or rotation, without the text being rasterized
+ * anew for each size. Line feeds start new lines. The font's
+ * color, outline and out_color apply; shadows are not drawn.
+ * Changes to the font's attributes show with the next redraw */
+class TextSprite : public ViewportElement, public Disposable
+{
+public:
+	TextSprite(Viewport *viewport = 0);
+	~TextSprite();
+
+	const std::string &getText() const;
+	void setText(const std::string &value);
+
+	/* Size of the text at zoom 1, before rotation */
+	int getWidth();
+	int getHeight();
+
+	DECL_ATTR( Font,      Font&   )
+	DECL_ATTR( X,         int     )
+	DECL_ATTR( Y,         int     )
+	DECL_ATTR( OX,        int     )
+	DECL_ATTR( OY,        int     )
+	DECL_ATTR( ZoomX,     float   )
+	DECL_ATTR( ZoomY,     float   )
+	DECL_ATTR( Angle,     float   )
+	DECL_ATTR( Opacity,   int     )
+	DECL_ATTR( BlendType, int     )
+
+	/* The font object the bindings hand out; owned by them */
+	void setInitFont(Font *value);
+
+private:
+	TextSpritePrivate *p;
+
+	void draw();
+	void onGeometryChange(const Scene::Geometry &);
+
+	void releaseResources();
+	const char *klassName() const { return "text sprite"; }
+
+	ABOUT_TO_ACCESS_DISP
+};
+
+#endif // TEXTSPRITE_H
@@ -32,8 +32,10 @@
 #include "vertex.h"
 #include "quad.h"
 #include "etc-internal.h"
+#include "scene.h"
 
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <vector>
 
@@ -110,24 +112,25 @@ atSelectSubPos(FloatRect &pos, int i)
 	}
 }
 
+/* Flash colors of the cells in view, kept as one texel per cell
+ * and drawn as a single quad over the visible map area */
 struct FlashMap
 {
 	FlashMap()
 		: dirty(false),
 	      data(0),
-	      allocQuads(0)
+	      flashCount(0)
 	{
-		vao.vbo = VBO::gen();
-		vao.ibo = shState->globalIBO().ibo;
-		GLMeta::vaoFillInVertexData<CVertex>(vao);
+		tex = TEX::gen();
 
-		GLMeta::vaoInit(vao);
+		TEX::bind(tex);
+		TEX::setRepeat(false);
+		TEX::setSmooth(false);
 	}
 
 	~FlashMap()
 	{
-		GLMeta::vaoFini(vao);
-		VBO::del(vao.vbo);
+		TEX::del(tex);
 		dataCon.disconnect();
 	}
 
@@ -153,6 +156,12 @@ struct FlashMap
         dataCon = data->modified.connect(&FlashMap::setDirty, this);
 	}
 
+	/* False if no cell would be flashing */
+	bool hasFlash() const
+	{
+		return dirty || flashCount > 0;
+	}
+
 	void setViewport(const IntRect &value)
 	{
 		viewp = value;
@@ -164,18 +173,15 @@ struct FlashMap
 		if (!dirty)
 			return;
 
-		rebuildBuffer();
+		rebuildTexture();
 		dirty = false;
 	}
 
 	void draw(float alpha, const Vec2i &trans)
 	{
-		const size_t count = quadCount();
-
-		if (count == 0)
+		if (flashCount == 0)
 			return;
 
-		GLMeta::vaoBind(vao);
 		glState.blendMode.pushSet(BlendAddition);
 
 		FlashMapShader &shader = shState->shaders().flashMap;
@@ -183,85 +189,78 @@ struct FlashMap
 		shader.applyViewportProj();
 		shader.setAlpha(alpha);
 		shader.setTranslation(trans);
+		shader.setTexSize(texSize);
 
-		gl.DrawElements(GL_TRIANGLES, count * 6, _GL_INDEX_TYPE, 0);
+		TEX::bind(tex);
+		quad.draw();
 
 		glState.blendMode.pop();
-
-		GLMeta::vaoUnbind(vao);
 	}
 
 private:
 	void setDirty()
 	{
 		dirty = true;
+		Scene::damageScreen();
 	}
 
-	size_t quadCount() const
-	{
-		return vertices.size() / 4;
-	}
-
-	bool sampleFlashColor(Vec4 &out, int x, int y) const
+	/* Cell color as a texel, 0 if the cell doesn't flash */
+	uint32_t sampleFlashColor(int x, int y) const
 	{
 		int16_t packed = tableGetWrapped(*data, x, y);
 
 		if (packed == 0)
-			return false;
-
-		const float max = 0xF;
+			return 0;
 
-		float b = ((packed & 0x000F) >> 0) / max;
-		float g = ((packed & 0x00F0) >> 4) / max;
-		float r = ((packed & 0x0F00) >> 8) / max;
+		/* 4 bits per channel, scaled to 8 */
+		const uint32_t b = ((packed & 0x000F) >> 0) * 0x11;
+		const uint32_t g = ((packed & 0x00F0) >> 4) * 0x11;
+		const uint32_t r = ((packed & 0x0F00) >> 8) * 0x11;
 
-		out = Vec4(r, g, b, 1);
+		/* Byte order matches GL_RGBA */
+		const uint8_t texel[4] = { (uint8_t) r, (uint8_t) g, (uint8_t) b, 0xFF };
+		uint32_t value;
+		memcpy(&value, texel, sizeof(value));
 
-		return true;
+		return value;
 	}
 
-	void rebuildBuffer()
+	void rebuildTexture()
 	{
-		vertices.clear();
+		flashCount = 0;
 
-		if (!data)
+		if (!data || viewp.w <= 0 || viewp.h <= 0)
 			return;
 
-		for (int x = 0; x < viewp.w; ++x)
-			for (int y = 0; y < viewp.h; ++y)
-			{
-				Vec4 color;
+		texels.resize(viewp.w * viewp.h);
 
-				if (!sampleFlashColor(color, x+viewp.x, y+viewp.y))
-					continue;
-
-				FloatRect posRect(x*32, y*32, 32, 32);
-
-				CVertex v[4];
-				Quad::setPosRect(v, posRect);
-				Quad::setColor(v, color);
+		for (int y = 0; y < viewp.h; ++y)
+			for (int x = 0; x < viewp.w; ++x)
+			{
+				const uint32_t texel = sampleFlashColor(x+viewp.x, y+viewp.y);
+				texels[y*viewp.w + x] = texel;
 
-				for (size_t i = 0; i < 4; ++i)
-					vertices.push_back(v[i]);
+				if (texel)
+					++flashCount;
 			}
 
-		if (vertices.size() == 0)
+		if (flashCount == 0)
 			return;
 
-		VBO::bind(vao.vbo);
+		TEX::bind(tex);
 
-		if (quadCount() > allocQuads)
+		if (texSize != viewp.size())
 		{
-			allocQuads = quadCount();
-			VBO::allocEmpty(sizeof(CVertex) * vertices.size());
-		}
-
-		VBO::uploadSubData(0, sizeof(CVertex) * vertices.size(), dataPtr(vertices));
+			texSize = viewp.size();
+			TEX::uploadImage(texSize.x, texSize.y, dataPtr(texels), GL_RGBA);
 
-		VBO::unbind();
-
-		/* Ensure global IBO size */
-		shState->ensureQuadIBO(quadCount());
+			quad.setTexPosRect(FloatRect(0, 0, texSize.x, texSize.y),
+			                   FloatRect(0, 0, texSize.x*32, texSize.y*32));
+		}
+		else
+		{
+			TEX::uploadSubImage(0, 0, texSize.x, texSize.y, dataPtr(texels), GL_RGBA);
+		}
 	}
 
 	bool dirty;
@@ -271,9 +270,13 @@ private:
 
 	IntRect viewp;
 
-	GLMeta::VAO vao;
-	size_t allocQuads;
-	std::vector<CVertex> vertices;
+	/* One texel per cell of 'viewp' */
+	TEX::ID tex;
+	Vec2i texSize;
+	std::vector<uint32_t> texels;
+	size_t flashCount;
+
+	Quad quad;
 };
 
 #endif // TILEMAPCOMMON_H
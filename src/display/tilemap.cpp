@@ -38,14 +38,26 @@
 #include "vertex.h"
 #include "tileatlas.h"
 #include "tilemap-common.h"
+#include "interpolation.h"
+#include "mappedsurface.h"
+#include "profiler.h"
+#include "trace.h"
+#include "preparable.h"
+#include "frame-arena.h"
+#include "sdl-util.h"
+#include "util.h"
 
 #include "sigslot/signal.hpp"
 
 #include <string.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <algorithm>
+#include <string>
 #include <vector>
 
+#include <SDL_cpuinfo.h>
+#include <SDL_mutex.h>
 #include <SDL_surface.h>
 
 extern const StaticRect autotileRects[];
@@ -71,6 +83,29 @@ static const int viewpH = 16;
 
 static const size_t zlayersMax = viewpH + 5;
 
+/* Tile rows generated for the map viewport */
+static const int viewpRows = viewpH + 1;
+
+/* Highest valid tile priority */
+static const int prioMax = 5;
+
+/* Map layers the ground shader composites */
+static const int gpuLayersMax = 4;
+
+/* Width of the tile lookup texture, in entries */
+static const int gpuLookupW = 256;
+
+/* Changed cells uploaded one by one, any
+ * more and the whole map is uploaded */
+static const size_t gpuCellsMax = 64;
+
+/* Rows of a streamed mega surface tileset
+ * paged in and uploaded at once */
+static const int tsChunkH = 32 * 32;
+
+/* Dirty rows from which on they're built in parallel */
+static const size_t parallelRowsMin = 6;
+
 /* Vocabulary:
  *
  * Atlas: A texture containing both the tileset and all
@@ -231,7 +266,54 @@ struct ZLayer : public ViewportElement
 	ABOUT_TO_ACCESS_NOOP
 };
 
-struct TilemapPrivate
+struct TilemapPrivate;
+
+/* Helper threads building tilemap rows alongside the RGSS
+ * thread. Scrolling only rebuilds a row or two, this is for
+ * when most of them are rebuilt at once (new map data, jumps).
+ * Each row is only written by the thread that took it */
+struct RowBuildPool
+{
+	std::vector<SDL_Thread*> workers;
+
+	SDL_mutex *mutex;
+	/* Signaled when rows are handed out, or on shutdown */
+	SDL_cond *jobCond;
+	/* Signaled when the last row of a batch is done */
+	SDL_cond *doneCond;
+
+	TilemapPrivate *p;
+	const int *rows;
+	size_t rowCount;
+	size_t nextRow;
+	size_t rowsDone;
+
+	bool quit;
+
+	RowBuildPool();
+	~RowBuildPool();
+
+	static RowBuildPool &instance()
+	{
+		static RowBuildPool pool;
+		return pool;
+	}
+
+	/* False on single core machines */
+	bool available();
+
+	/* Builds 'rows' of 'p', returning once all are done */
+	void build(TilemapPrivate *p, const int *rows, size_t count);
+
+	void work();
+
+private:
+	/* Builds rows until none are left to take.
+	 * Called and returns with 'mutex' locked */
+	void buildRows();
+};
+
+struct TilemapPrivate : public Preparable
 {
 	Viewport *viewport;
 
@@ -245,11 +327,17 @@ struct TilemapPrivate
 	Vec2i origin;
 
 	Vec2i dispPos;
+	/* Map scrolling blended between logical frames */
+	FrameInterpolator interp;
 
 	/* Tile atlas */
 	struct {
 		TEXFBO gl;
 
+		/* Describes the bitmaps 'gl' was built from,
+		 * see SharedState::requestAtlasTex() */
+		std::string contentKey;
+
 		Vec2i size;
 
 		/* Effective tileset height,
@@ -266,18 +354,50 @@ struct TilemapPrivate
 		/* Whether each autotile is 3x4 or not */
 		bool smallATs[autotileCount] = {false};
 
+		/* 'tiles.animated' at the time of the last build;
+		 * decides how static autotiles were laid out */
+		bool builtAnimated = false;
+
 		/* The number of frames for each autotile */
 		int nATFrames[autotileCount] = {1};
+
+		/* Pieces of a mega surface tileset, and the upload
+		 * state of each. When streaming, only pieces holding
+		 * tiles referenced by the map data are uploaded */
+		TileAtlas::BlitVec tsChunks;
+		std::vector<uint8_t> tsChunkState;
+		bool tsChunksWanted;
+		/* Affected by: mapData(.changed) */
+		bool tsScanMap;
 	} atlas;
 
+	enum TilesetChunkState
+	{
+		ChunkMissing,
+		ChunkWanted,
+		ChunkUploaded
+	};
+
 	/* Map viewport position */
 	Vec2i viewpPos;
 
-	/* Ground layer vertices */
-	SVVector groundVert;
-
-	/* ZLayer vertices */
-	SVVector zlayerVert[zlayersMax];
+	/* The vertices of each viewport row are kept separately,
+	 * so that tile changes and vertical scrolling only have
+	 * to regenerate the rows affected. The ground and zlayer
+	 * buffers are assembled from these on upload */
+	struct RowChunk
+	{
+		SVVector ground;
+		/* Tiles of priority 1 to 5, which end up
+		 * in zlayer (row index + priority) */
+		SVVector prio[prioMax];
+		bool dirty;
+
+		/* Quad offsets from the last buffer assembly; ground
+		 * is absolute, prio relative to the zlayer's base */
+		size_t groundBase;
+		size_t prioBase[prioMax];
+	} rows[viewpRows];
 
 	/* Base quad indices of each zlayer
 	 * in the shared buffer */
@@ -294,6 +414,51 @@ struct TilemapPrivate
 		uint32_t aniIdx;
 	} tiles;
 
+	/* Ground layer resolved per fragment by TilemapGroundShader,
+	 * instead of being built from quads */
+	struct
+	{
+		/* Requested via config */
+		bool enabled;
+		/* Enabled, and the map data fits into a texture */
+		bool active;
+
+		/* Ground tile index of every map cell,
+		 * z layers stacked vertically */
+		TEX::ID mapTex;
+		Vec2i mapTexSize;
+		Vec2i mapSize;
+		int layers;
+
+		/* Atlas origin of each tile quarter,
+		 * indexed by tile index * 4 + quarter */
+		TEX::ID lookupTex;
+		Vec2i lookupSize;
+		/* Tile indices covered by the lookup */
+		int tileCount;
+
+		/* Affected by: buffersDirty */
+		bool mapDirty;
+		/* Affected by: buildAtlas */
+		bool lookupDirty;
+		/* Affected by: mapData(.cellModified) */
+		std::vector<Vec2i> dirtyCells;
+
+		std::vector<uint8_t> texels;
+		Quad quad;
+	} gpu;
+
+	/* Zlayers drawn through the depth buffer of the screen */
+	struct
+	{
+		/* Requested via config. Zlayer vertices then
+		 * carry their zlayer index (see 'tagLayer()') */
+		bool enabled;
+		/* Set from the first zlayer drawn this way
+		 * in a frame until the last one */
+		bool span;
+	} depth;
+
 	FlashMap flashMap;
 	uint8_t flashAlphaIdx;
 
@@ -309,10 +474,18 @@ struct TilemapPrivate
 
 	/* Affected by: autotiles, tileset */
 	bool atlasSizeDirty;
-	/* Affected by: autotiles(.changed), tileset(.changed), allocateAtlas */
+	/* Affected by: allocateAtlas */
 	bool atlasDirty;
+	/* Affected by: autotiles[i](.changed), bit i per slot */
+	uint8_t atlasDirtyATs;
 	/* Affected by: mapData(.changed), priorities(.changed) */
 	bool buffersDirty;
+	/* Affected by: mapData(.cellModified) */
+	bool rowsDirty;
+	/* Rows were reordered, positions in the VBO changed */
+	bool rowLayoutDirty;
+	/* Set between a mapData cell change and its 'modified' signal */
+	bool mapCellPending;
 	/* Affected by: ox, oy */
 	bool mapViewportDirty;
 	/* Affected by: oy */
@@ -325,14 +498,12 @@ struct TilemapPrivate
 	sigslot::connection tilesetCon;
 	sigslot::connection autotilesCon[autotileCount];
 	sigslot::connection mapDataCon;
+	sigslot::connection mapDataCellCon;
 	sigslot::connection prioritiesCon;
 
 	/* Dispose watches */
 	sigslot::connection autotilesDispCon[autotileCount];
 
-	/* Draw prepare call */
-	sigslot::connection prepareCon;
-
 	NormValue opacity;
 	BlendType blendType;
 	Color *color;
@@ -349,7 +520,11 @@ struct TilemapPrivate
 	      flashAlphaIdx(0),
 	      atlasSizeDirty(false),
 	      atlasDirty(false),
+	      atlasDirtyATs(0),
 	      buffersDirty(false),
+	      rowsDirty(false),
+	      rowLayoutDirty(false),
+	      mapCellPending(false),
 	      mapViewportDirty(false),
 	      zOrderDirty(false),
 	      tilemapReady(false),
@@ -360,9 +535,12 @@ struct TilemapPrivate
 	      tone(&tmp.tone)
 	{
 		memset(autotiles, 0, sizeof(autotiles));
+		memset(zlayerBases, 0, sizeof(zlayerBases));
 
 		atlas.animatedATs.reserve(autotileCount);
 		atlas.efTilesetH = 0;
+		atlas.tsChunksWanted = false;
+		atlas.tsScanMap = false;
 
 		tiles.animated = false;
 		tiles.aniIdx = 0;
@@ -376,13 +554,28 @@ struct TilemapPrivate
 
 		GLMeta::vaoInit(tiles.vao);
 
+		gpu.enabled = shState->config().gpuTilemap;
+		gpu.active = false;
+		gpu.layers = 0;
+		gpu.tileCount = 0;
+		gpu.mapDirty = true;
+		gpu.lookupDirty = true;
+
+		if (gpu.enabled)
+		{
+			gpu.mapTex = genGPUTex();
+			gpu.lookupTex = genGPUTex();
+		}
+
+		depth.enabled = shState->config().tilemapDepth;
+		depth.span = false;
+
 		elem.ground = new GroundLayer(this, viewport);
 
 		for (size_t i = 0; i < zlayersMax; ++i)
 			elem.zlayers[i] = new ZLayer(this, viewport);
 
-		prepareCon = shState->prepareDraw.connect
-		        (&TilemapPrivate::prepare, this);
+		requestPrepare();
 
 		updateFlashMapViewport();
 	}
@@ -394,12 +587,18 @@ struct TilemapPrivate
 		for (size_t i = 0; i < zlayersMax; ++i)
 			delete elem.zlayers[i];
 
-		shState->releaseAtlasTex(atlas.gl);
+		shState->releaseAtlasTex(atlas.gl, atlas.contentKey);
 
 		/* Destroy tile buffers */
 		GLMeta::vaoFini(tiles.vao);
 		VBO::del(tiles.vbo);
 
+		if (gpu.enabled)
+		{
+			TEX::del(gpu.mapTex);
+			TEX::del(gpu.lookupTex);
+		}
+
 		/* Disconnect signal handlers */
 		tilesetCon.disconnect();
 		for (int i = 0; i < autotileCount; ++i)
@@ -408,9 +607,8 @@ struct TilemapPrivate
 			autotilesDispCon[i].disconnect();
 		}
 		mapDataCon.disconnect();
+		mapDataCellCon.disconnect();
 		prioritiesCon.disconnect();
-
-		prepareCon.disconnect();
 	}
 
 	void updateFlashMapViewport()
@@ -479,19 +677,76 @@ struct TilemapPrivate
 		mapViewportDirty = true;
 	}
 
+	/* Only the scene we are part of needs redrawing; leaves the
+	 * caches of other viewports intact, eg. on every autotile
+	 * animation step */
+	void damage()
+	{
+		if (visible && elem.ground->scene)
+			elem.ground->scene->damage();
+	}
+
 	void invalidateAtlasSize()
 	{
 		atlasSizeDirty = true;
+		damage();
 	}
 
-	void invalidateAtlasContents()
+	void invalidateAutotile(int i)
 	{
-		atlasDirty = true;
+		atlasDirtyATs |= (1 << i);
+		damage();
 	}
 
 	void invalidateBuffers()
 	{
 		buffersDirty = true;
+		gpu.mapDirty = true;
+		atlas.tsScanMap = true;
+		damage();
+	}
+
+	void onMapDataModified()
+	{
+		/* Already handled by onMapCellModified() */
+		if (mapCellPending)
+		{
+			mapCellPending = false;
+			return;
+		}
+
+		invalidateBuffers();
+	}
+
+	void onMapCellModified(int x, int y)
+	{
+		mapCellPending = true;
+		damage();
+
+		if (tilesetStreamed())
+			for (int z = 0; z < mapData->zSize(); ++z)
+				wantTile(mapData->at(x, y, z));
+
+		if (gpu.active && !gpu.mapDirty)
+		{
+			if (gpu.dirtyCells.size() < gpuCellsMax)
+				gpu.dirtyCells.push_back(Vec2i(x, y));
+			else
+				gpu.mapDirty = true;
+		}
+
+		if (buffersDirty)
+			return;
+
+		const int vx = x - viewpPos.x;
+		const int vy = y - viewpPos.y;
+
+		/* Outside of the generated area */
+		if (vx < 0 || vx > viewpW || vy < 0 || vy >= viewpRows)
+			return;
+
+		rows[vy].dirty = true;
+		rowsDirty = true;
 	}
 
 	/* Checks for the minimum amount of data needed to display */
@@ -512,18 +767,144 @@ struct TilemapPrivate
 		updateAtlasInfo();
 
 		/* Aquire atlas tex */
-		shState->releaseAtlasTex(atlas.gl);
-		shState->requestAtlasTex(atlas.size.x, atlas.size.y, atlas.gl);
+		shState->releaseAtlasTex(atlas.gl, atlas.contentKey);
+		shState->requestAtlasTex(atlas.size.x, atlas.size.y, atlas.gl, &atlas.contentKey);
 
 		atlasDirty = true;
 	}
 
+	/* Identifies the atlas built from the current bitmaps.
+	 * Empty if the atlas must not be reused */
+	std::string atlasKey()
+	{
+		/* Only the pieces used by the map are uploaded */
+		if (tilesetStreamed())
+			return std::string();
+
+		std::string key = tileset->contentKey();
+
+		for (int i = 0; i < autotileCount; ++i)
+		{
+			key += '\n';
+			key += nullOrDisposed(autotiles[i]) ? "-" : autotiles[i]->contentKey();
+		}
+
+		return key;
+	}
+
+	/* Blits autotile 'atInd' into its slot of the atlas.
+	 * Must be inside a GLMeta::blitBegin() on the atlas */
+	void blitAutotile(uint8_t atInd)
+	{
+		Bitmap *autotile = autotiles[atInd];
+		autotile->ensureNonAnimated();
+
+		int atW = autotile->width();
+		int atH = autotile->height();
+		int blitW = std::min(atW, atAreaW);
+		int blitH = std::min(atH, autotileH);
+
+		GLMeta::blitSource(autotile->getGLTypes());
+
+		if (atW <= autotileW && tiles.animated && !atlas.smallATs[atInd])
+		{
+			/* Static autotile */
+			for (int j = 0; j < atFrames; ++j)
+				GLMeta::blitRectangle(IntRect(0, 0, blitW, blitH),
+				                      Vec2i(autotileW*j, atInd*autotileH));
+		}
+		else
+		{
+			/* Animated autotile */
+			if (atlas.smallATs[atInd])
+			{
+				int frames = atW/32;
+				for (int j = 0; j < atFrames*autotileH/32; ++j)
+				{
+					GLMeta::blitRectangle(IntRect(32*(j % frames), 0, 32, 32),
+					                      Vec2i(autotileW*(j % atFrames), atInd*autotileH + 32*(j / atFrames)));
+				}
+			}
+			else
+				GLMeta::blitRectangle(IntRect(0, 0, blitW, blitH),
+				                      Vec2i(0, atInd*autotileH));
+		}
+	}
+
+	/* Regenerates only the autotile slots flagged in 'atlasDirtyATs',
+	 * leaving the tileset and all other slots in place */
+	void updateAtlasAutotiles()
+	{
+		updateAutotileInfo();
+
+		/* Static autotiles are laid out differently
+		 * depending on whether any autotile is animated */
+		if (tiles.animated != atlas.builtAnimated)
+		{
+			buildAtlas();
+			return;
+		}
+
+		/* Frame counts and sizes of the autotiles
+		 * are baked into the tile buffers */
+		buffersDirty = true;
+		gpu.lookupDirty = true;
+		gpu.mapDirty = true;
+
+		const std::string key = atlasKey();
+
+		if (!key.empty() && key == atlas.contentKey)
+			return;
+
+		/* Clear the affected slots */
+		FBO::bind(atlas.gl.fbo);
+		glState.clearColor.pushSet(Vec4());
+		glState.scissorTest.pushSet(true);
+
+		for (int i = 0; i < autotileCount; ++i)
+		{
+			if (!(atlasDirtyATs & (1 << i)))
+				continue;
+
+			glState.scissorBox.pushSet(IntRect(0, i*autotileH, atAreaW, autotileH));
+			FBO::clear();
+			glState.scissorBox.pop();
+		}
+
+		glState.scissorTest.pop();
+		glState.clearColor.pop();
+
+		GLMeta::blitBegin(atlas.gl);
+
+		for (size_t i = 0; i < atlas.usableATs.size(); ++i)
+			if (atlasDirtyATs & (1 << atlas.usableATs[i]))
+				blitAutotile(atlas.usableATs[i]);
+
+		GLMeta::blitEnd();
+
+		atlas.contentKey = key;
+	}
+
 	/* Assembles atlas from tileset and autotile bitmaps */
 	void buildAtlas()
 	{
+		/* Tile texture coordinates depend on the atlas layout */
+		buffersDirty = true;
+		gpu.lookupDirty = true;
+		gpu.mapDirty = true;
+
         updateAutotileInfo();
         tileset->ensureNonAnimated();
 
+		const std::string key = atlasKey();
+
+		/* Left over from a tilemap using the same bitmaps,
+		 * eg. the previous map before a transfer */
+		if (!key.empty() && key == atlas.contentKey)
+			return;
+
+		atlas.contentKey.clear();
+
 		TileAtlas::BlitVec blits = TileAtlas::calcBlits(atlas.efTilesetH, atlas.size);
 
 		/* Clear atlas */
@@ -540,119 +921,189 @@ struct TilemapPrivate
 
 		/* Blit autotiles */
 		for (size_t i = 0; i < atlas.usableATs.size(); ++i)
+			blitAutotile(atlas.usableATs[i]);
+
+		GLMeta::blitEnd();
+
+		atlas.builtAnimated = tiles.animated;
+
+		/* Blit tileset */
+		if (tileset->megaSurface())
 		{
-			const uint8_t atInd = atlas.usableATs[i];
-			Bitmap *autotile = autotiles[atInd];
-            autotile->ensureNonAnimated();
+			/* Mega surface tileset */
+			initTilesetChunks(blits);
 
-			int atW = autotile->width();
-			int atH = autotile->height();
-			int blitW = std::min(atW, atAreaW);
-			int blitH = std::min(atH, autotileH);
+			if (tilesetStreamed())
+				wantMapTiles();
 
-			GLMeta::blitSource(autotile->getGLTypes());
+			uploadTilesetChunks();
+		}
+		else
+		{
+			/* Regular tileset */
+			GLMeta::blitBegin(atlas.gl);
+			GLMeta::blitSource(tileset->getGLTypes());
 
-			if (atW <= autotileW && tiles.animated && !atlas.smallATs[atInd])
-			{
-				/* Static autotile */
-				for (int j = 0; j < atFrames; ++j)
-					GLMeta::blitRectangle(IntRect(0, 0, blitW, blitH),
-					                      Vec2i(autotileW*j, atInd*autotileH));
-			}
-			else
+			for (size_t i = 0; i < blits.size(); ++i)
 			{
-				/* Animated autotile */
-				if (atlas.smallATs[atInd])
-				{
-					int frames = atW/32;
-					for (int j = 0; j < atFrames*autotileH/32; ++j)
-					{
-						GLMeta::blitRectangle(IntRect(32*(j % frames), 0, 32, 32),
-						                      Vec2i(autotileW*(j % atFrames), atInd*autotileH + 32*(j / atFrames)));
-					}
-				}
-				else
-					GLMeta::blitRectangle(IntRect(0, 0, blitW, blitH),
-					                      Vec2i(0, atInd*autotileH));
+				const TileAtlas::Blit &blitOp = blits[i];
+
+				GLMeta::blitRectangle(IntRect(blitOp.src.x, blitOp.src.y, tsLaneW, blitOp.h),
+				                      blitOp.dst);
 			}
+
+			GLMeta::blitEnd();
 		}
 
-		GLMeta::blitEnd();
+		atlas.contentKey = key;
+	}
 
-		/* Blit tileset */
-		if (tileset->megaSurface())
+	bool tilesetStreamed()
+	{
+		return shState->config().streamMegaSurfaces &&
+		       !nullOrDisposed(tileset) && tileset->megaSurface();
+	}
+
+	/* Splits the tileset blits into pieces of at most 'tsChunkH' rows */
+	void initTilesetChunks(const TileAtlas::BlitVec &blits)
+	{
+		atlas.tsChunks.clear();
+
+		for (size_t i = 0; i < blits.size(); ++i)
 		{
-			/* Mega surface tileset */
-			SDL_Surface *tsSurf = tileset->megaSurface();
+			const TileAtlas::Blit &blitOp = blits[i];
+
+			for (int y = 0; y < blitOp.h; y += tsChunkH)
+				atlas.tsChunks.push_back(TileAtlas::Blit(blitOp.src.x, blitOp.src.y + y,
+				                                         blitOp.dst.x, blitOp.dst.y + y,
+				                                         std::min(tsChunkH, blitOp.h - y)));
+		}
+
+		const uint8_t state = tilesetStreamed() ? ChunkMissing : ChunkWanted;
+		atlas.tsChunkState.assign(atlas.tsChunks.size(), state);
+		atlas.tsChunksWanted = true;
+		atlas.tsScanMap = false;
+	}
+
+	/* Marks the piece holding 'tileInd' for upload */
+	void wantTile(int tileInd)
+	{
+		if (tileInd < 48*8)
+			return;
+
+		const int srcY = ((tileInd - 48*8) / 8) * 32;
+
+		for (size_t i = 0; i < atlas.tsChunks.size(); ++i)
+		{
+			const TileAtlas::Blit &chunk = atlas.tsChunks[i];
 
-			if (shState->config().subImageFix)
+			if (srcY < chunk.src.y || srcY >= chunk.src.y + chunk.h)
+				continue;
+
+			if (atlas.tsChunkState[i] == ChunkMissing)
 			{
-				/* Implementation for broken GL drivers */
-				FBO::bind(atlas.gl.fbo);
-				glState.blend.pushSet(false);
-				glState.viewport.pushSet(IntRect(0, 0, atlas.size.x, atlas.size.y));
+				atlas.tsChunkState[i] = ChunkWanted;
+				atlas.tsChunksWanted = true;
+			}
 
-				SimpleShader &shader = shState->shaders().simple;
-				shader.bind();
-				shader.applyViewportProj();
-				shader.setTranslation(Vec2i());
+			return;
+		}
+	}
 
-				Quad &quad = shState->gpQuad();
+	void wantMapTiles()
+	{
+		for (int z = 0; z < mapData->zSize(); ++z)
+			for (int y = 0; y < mapData->ySize(); ++y)
+				for (int x = 0; x < mapData->xSize(); ++x)
+					wantTile(mapData->at(x, y, z));
 
-				for (size_t i = 0; i < blits.size(); ++i)
-				{
-					const TileAtlas::Blit &blitOp = blits[i];
+		atlas.tsScanMap = false;
+	}
 
-					Vec2i texSize;
-					shState->ensureTexSize(tsLaneW, blitOp.h, texSize);
-					shState->bindTex();
-					GLMeta::subRectImageUpload(tsSurf->w, blitOp.src.x, blitOp.src.y,
-					                           0, 0, tsLaneW, blitOp.h, tsSurf, GL_RGBA);
+	/* Uploads all wanted mega surface tileset pieces. Mapped
+	 * rows are only paged in for the duration of their upload */
+	void uploadTilesetChunks()
+	{
+		SDL_Surface *tsSurf = tileset->megaSurface();
+		const bool mapped = MappedSurface::isMapped(tsSurf);
 
-					shader.setTexSize(texSize);
-					quad.setTexRect(FloatRect(0, 0, tsLaneW, blitOp.h));
-					quad.setPosRect(FloatRect(blitOp.dst.x, blitOp.dst.y, tsLaneW, blitOp.h));
+		const TileAtlas::BlitVec &chunks = atlas.tsChunks;
+		std::vector<uint8_t> &state = atlas.tsChunkState;
 
-					quad.draw();
-				}
+		if (shState->config().subImageFix)
+		{
+			/* Implementation for broken GL drivers */
+			FBO::bind(atlas.gl.fbo);
+			glState.blend.pushSet(false);
+			glState.viewport.pushSet(IntRect(0, 0, atlas.size.x, atlas.size.y));
 
-				GLMeta::subRectImageEnd();
-				glState.viewport.pop();
-				glState.blend.pop();
-			}
-			else
+			SimpleShader &shader = shState->shaders().simple;
+			shader.bind();
+			shader.applyViewportProj();
+			shader.setTranslation(Vec2i());
+
+			Quad &quad = shState->gpQuad();
+
+			for (size_t i = 0; i < chunks.size(); ++i)
 			{
-				/* Clean implementation */
-				TEX::bind(atlas.gl.tex);
+				if (state[i] != ChunkWanted)
+					continue;
 
-				for (size_t i = 0; i < blits.size(); ++i)
-				{
-					const TileAtlas::Blit &blitOp = blits[i];
+				const TileAtlas::Blit &blitOp = chunks[i];
 
-					GLMeta::subRectImageUpload(tsSurf->w, blitOp.src.x, blitOp.src.y,
-					                           blitOp.dst.x, blitOp.dst.y, tsLaneW, blitOp.h, tsSurf, GL_RGBA);
-				}
+				if (mapped)
+					MappedSurface::willNeed(tsSurf, blitOp.src.y, blitOp.h);
+
+				Vec2i texSize;
+				shState->ensureTexSize(tsLaneW, blitOp.h, texSize);
+				shState->bindTex();
+				GLMeta::subRectImageUpload(tsSurf->w, blitOp.src.x, blitOp.src.y,
+				                           0, 0, tsLaneW, blitOp.h, tsSurf, GL_RGBA);
+
+				shader.setTexSize(texSize);
+				quad.setTexRect(FloatRect(0, 0, tsLaneW, blitOp.h));
+				quad.setPosRect(FloatRect(blitOp.dst.x, blitOp.dst.y, tsLaneW, blitOp.h));
 
-				GLMeta::subRectImageEnd();
+				quad.draw();
+
+				if (mapped)
+					MappedSurface::dontNeed(tsSurf, blitOp.src.y, blitOp.h);
+
+				state[i] = ChunkUploaded;
 			}
 
+			GLMeta::subRectImageEnd();
+			glState.viewport.pop();
+			glState.blend.pop();
 		}
 		else
 		{
-			/* Regular tileset */
-			GLMeta::blitBegin(atlas.gl);
-			GLMeta::blitSource(tileset->getGLTypes());
+			/* Clean implementation */
+			TEX::bind(atlas.gl.tex);
 
-			for (size_t i = 0; i < blits.size(); ++i)
+			for (size_t i = 0; i < chunks.size(); ++i)
 			{
-				const TileAtlas::Blit &blitOp = blits[i];
+				if (state[i] != ChunkWanted)
+					continue;
 
-				GLMeta::blitRectangle(IntRect(blitOp.src.x, blitOp.src.y, tsLaneW, blitOp.h),
-				                      blitOp.dst);
+				const TileAtlas::Blit &blitOp = chunks[i];
+
+				if (mapped)
+					MappedSurface::willNeed(tsSurf, blitOp.src.y, blitOp.h);
+
+				GLMeta::subRectImageUpload(tsSurf->w, blitOp.src.x, blitOp.src.y,
+				                           blitOp.dst.x, blitOp.dst.y, tsLaneW, blitOp.h, tsSurf, GL_RGBA);
+
+				if (mapped)
+					MappedSurface::dontNeed(tsSurf, blitOp.src.y, blitOp.h);
+
+				state[i] = ChunkUploaded;
 			}
 
-			GLMeta::blitEnd();
+			GLMeta::subRectImageEnd();
 		}
+
+		atlas.tsChunksWanted = false;
 	}
 
 	int samplePriority(int tileInd)
@@ -714,7 +1165,7 @@ struct TilemapPrivate
 		}
 	}
 
-	void handleTile(int x, int y, int z)
+	void handleTile(int x, int y, int z, RowChunk &row)
 	{
 		int tileInd =
 			tableGetWrapped(*mapData, x + viewpPos.x, y + viewpPos.y, z);
@@ -730,149 +1181,538 @@ struct TilemapPrivate
 			return;
 
 		SVVector *targetArray;
+		int layerInd = 0;
 
 		/* Prio 0 tiles are all part of the same ground layer */
 		if (prio == 0)
 		{
-			targetArray = &groundVert;
+			/* Drawn from the map texture instead */
+			if (gpu.active)
+				return;
+
+			targetArray = &row.ground;
 		}
 		else
 		{
-			int layerInd = y + prio;
+			layerInd = y + prio;
 			if ((size_t)layerInd >= zlayersMax)
 				return;
-			targetArray = &zlayerVert[layerInd];
+			targetArray = &row.prio[prio-1];
 		}
 
+		const size_t first = targetArray->size();
+
 		/* Check for autotile */
 		if (tileInd < 48*8)
 		{
 			handleAutotile(x, y, tileInd, targetArray);
-			return;
 		}
+		else
+		{
+			int tsInd = tileInd - 48*8;
+			int tileX = tsInd % 8;
+			int tileY = tsInd / 8;
+
+			Vec2i texPos = TileAtlas::tileToAtlasCoor(tileX, tileY, atlas.efTilesetH, atlas.size.y);
+			FloatRect texRect((float) texPos.x+0.5f, (float) texPos.y+0.5f, 31, 31);
+			FloatRect posRect(x*32, y*32, 32, 32);
 
-		int tsInd = tileInd - 48*8;
-		int tileX = tsInd % 8;
-		int tileY = tsInd / 8;
+			SVertex v[4];
+			Quad::setTexPosRect(v, texRect, posRect);
 
-		Vec2i texPos = TileAtlas::tileToAtlasCoor(tileX, tileY, atlas.efTilesetH, atlas.size.y);
-		FloatRect texRect((float) texPos.x+0.5f, (float) texPos.y+0.5f, 31, 31);
-		FloatRect posRect(x*32, y*32, 32, 32);
+			for (size_t i = 0; i < 4; ++i)
+				targetArray->push_back(v[i]);
+		}
 
-		SVertex v[4];
-		Quad::setTexPosRect(v, texRect, posRect);
+		if (prio > 0 && depth.enabled)
+			tagLayer(*targetArray, first, layerInd);
+	}
 
-		for (size_t i = 0; i < 4; ++i)
-			targetArray->push_back(v[i]);
+	/* Adds the zlayer index to the vertices from 'first' on, in
+	 * 64ths of a pixel; the depth shader splits it off again */
+	static void tagLayer(SVVector &array, size_t first, int layerInd)
+	{
+		for (size_t i = first; i < array.size(); ++i)
+			array[i].pos.y += layerInd / 64.0f;
 	}
 
-	void clearQuadArrays()
+	static TEX::ID genGPUTex()
 	{
-		groundVert.clear();
+		TEX::ID tex = TEX::gen();
 
-		for (size_t i = 0; i < zlayersMax; ++i)
-			zlayerVert[i].clear();
+		TEX::bind(tex);
+		TEX::setRepeat(false);
+		TEX::setSmooth(false);
+
+		return tex;
 	}
 
-	void buildQuadArray()
+	/* Switches between quad and shader based
+	 * ground layer depending on the map size */
+	void updateGPUActive()
 	{
-		clearQuadArrays();
-
-		int ox = viewpPos.x;
-		int oy = viewpPos.y;
-		int mapW = mapData->xSize();
-		int mapH = mapData->ySize();
+		if (!gpu.enabled)
+			return;
 
-		int minX = 0;
-		int minY = 0;
-		if (ox < 0)
-			minX = -ox;
-		if (oy < 0)
-			minY = -oy;
+		const int maxSize = glState.caps.maxTexSize;
+		const int w = mapData->xSize();
+		const int h = mapData->ySize();
+		const int d = mapData->zSize();
 
-		// There could be off-by-one issues in these couple sections.
-		int maxX = viewpW;
-		int maxY = viewpH;
-		if (ox + maxX >= mapW)
-			maxX = mapW - ox - 1;
-		if (oy + maxY >= mapH)
-			maxY = mapH - oy - 1;
+		const bool active = w > 0 && h > 0 && d > 0 && d <= gpuLayersMax &&
+		                    w <= maxSize && h * d <= maxSize;
 
-		if ((minX > maxX) || (minY > maxY))
+		if (active == gpu.active)
 			return;
-		for (int x = minX; x <= maxX; ++x)
-			for (int y = minY; y <= maxY; ++y)
-				for (int z = 0; z < mapData->zSize(); ++z)
-					handleTile(x, y, z);
+
+		gpu.active = active;
+		invalidateBuffers();
 	}
 
-	static size_t quadDataSize(size_t quadCount)
+	/* Tile index as seen by the ground shader,
+	 * 0 for cells not on the ground layer */
+	int gpuTileAt(int x, int y, int z)
 	{
-		return quadCount * sizeof(SVertex) * 4;
+		int tileInd = mapData->at(x, y, z);
+
+		if (tileInd < 48 || tileInd >= gpu.tileCount)
+			return 0;
+
+		if (samplePriority(tileInd) != 0)
+			return 0;
+
+		return tileInd;
 	}
 
-	size_t zlayerSize(size_t index)
+	static void writeTexel16(uint8_t *texel, int value1, int value2)
 	{
-		return zlayerBases[index+1] - zlayerBases[index];
+		texel[0] = value1 & 0xFF;
+		texel[1] = value1 >> 8;
+		texel[2] = value2 & 0xFF;
+		texel[3] = value2 >> 8;
 	}
 
-	void uploadBuffers()
+	/* Top left of one 16x16 tile quarter in the atlas */
+	Vec2i quarterOrigin(int tileInd, int quarter)
+	{
+		const Vec2i offset((quarter % 2) * 16, (quarter / 2) * 16);
+
+		if (tileInd >= 48*8)
+		{
+			int tsInd = tileInd - 48*8;
+			Vec2i texPos = TileAtlas::tileToAtlasCoor(tsInd % 8, tsInd / 8,
+			                                          atlas.efTilesetH, atlas.size.y);
+
+			return texPos + offset;
+		}
+
+		int atInd = tileInd / 48 - 1;
+
+		if (atlas.smallATs[atInd])
+			return Vec2i(0, atInd * autotileH) + offset;
+
+		const StaticRect &pieceRect = autotileRects[(tileInd % 48)*4 + quarter];
+
+		return Vec2i(pieceRect.x, pieceRect.y + atInd * autotileH);
+	}
+
+	void uploadLookupTex()
+	{
+		gpu.tileCount = 48*8 + 8 * (atlas.efTilesetH / 32);
+
+		const int entries = gpu.tileCount * 4;
+		gpu.lookupSize = Vec2i(gpuLookupW, (entries + gpuLookupW - 1) / gpuLookupW);
+
+		gpu.texels.assign(gpu.lookupSize.x * gpu.lookupSize.y * 4, 0);
+
+		for (int i = 48; i < gpu.tileCount; ++i)
+		{
+			for (int j = 0; j < 4; ++j)
+			{
+				Vec2i origin = quarterOrigin(i, j);
+				writeTexel16(&gpu.texels[(i*4 + j) * 4], origin.x / 16, origin.y / 16);
+			}
+		}
+
+		TEX::bind(gpu.lookupTex);
+		TEX::uploadImage(gpu.lookupSize.x, gpu.lookupSize.y, dataPtr(gpu.texels), GL_RGBA);
+	}
+
+	void uploadMapTex()
+	{
+		const int w = mapData->xSize();
+		const int h = mapData->ySize();
+		const int d = mapData->zSize();
+
+		gpu.mapSize = Vec2i(w, h);
+		gpu.mapTexSize = Vec2i(w, h * d);
+		gpu.layers = d;
+
+		gpu.texels.resize(w * h * d * 4);
+
+		for (int z = 0; z < d; ++z)
+			for (int y = 0; y < h; ++y)
+				for (int x = 0; x < w; ++x)
+					writeTexel16(&gpu.texels[((z*h + y)*w + x) * 4], gpuTileAt(x, y, z), 0);
+
+		TEX::bind(gpu.mapTex);
+		TEX::uploadImage(gpu.mapTexSize.x, gpu.mapTexSize.y, dataPtr(gpu.texels), GL_RGBA);
+	}
+
+	void uploadMapCells()
+	{
+		TEX::bind(gpu.mapTex);
+
+		for (size_t i = 0; i < gpu.dirtyCells.size(); ++i)
+		{
+			const Vec2i &cell = gpu.dirtyCells[i];
+
+			if (cell.x >= gpu.mapSize.x || cell.y >= gpu.mapSize.y)
+				continue;
+
+			for (int z = 0; z < gpu.layers; ++z)
+			{
+				uint8_t texel[4];
+				writeTexel16(texel, gpuTileAt(cell.x, cell.y, z), 0);
+
+				TEX::uploadSubImage(cell.x, z * gpu.mapSize.y + cell.y, 1, 1, texel, GL_RGBA);
+			}
+		}
+	}
+
+	void prepareGPU()
+	{
+		if (gpu.lookupDirty)
+		{
+			uploadLookupTex();
+			gpu.lookupDirty = false;
+		}
+
+		if (gpu.mapDirty)
+			uploadMapTex();
+		else if (!gpu.dirtyCells.empty())
+			uploadMapCells();
+
+		gpu.mapDirty = false;
+		gpu.dirtyCells.clear();
+	}
+
+	void drawGPUGround()
+	{
+		TilemapGroundShader &shader = shState->shaders().tilemapGround;
+		shader.bind();
+		shader.applyViewportProj();
+		shader.setTexSize(Vec2i(1, 1));
+		shader.setTranslation(drawPos());
+		shader.setAtlasSize(atlas.size);
+		shader.setMapData(gpu.mapTex, gpu.mapTexSize, gpu.mapSize, gpu.layers);
+		shader.setTileLookup(gpu.lookupTex, gpu.lookupSize);
+		shader.setTone(tone->norm);
+		shader.setColor(color->norm);
+		shader.setOpacity(opacity.norm);
+		shader.setAniIndex(tiles.aniIdx / atFrameDur);
+		shader.setATFrames(atlas.nATFrames);
+
+		TEX::bind(atlas.gl.tex);
+
+		/* Same area the quad based ground layer covers */
+		const float w = (viewpW+1) * 32;
+		const float h = (viewpH+1) * 32;
+
+		gpu.quad.setTexPosRect(FloatRect(viewpPos.x * 32, viewpPos.y * 32, w, h),
+		                       FloatRect(0, 0, w, h));
+		gpu.quad.draw();
+	}
+
+	/* Returns false if no part of the map is in view */
+	bool getVisibleTiles(int &minX, int &minY, int &maxX, int &maxY)
+	{
+		int ox = viewpPos.x;
+		int oy = viewpPos.y;
+		int mapW = mapData->xSize();
+		int mapH = mapData->ySize();
+
+		minX = 0;
+		minY = 0;
+		if (ox < 0)
+			minX = -ox;
+		if (oy < 0)
+			minY = -oy;
+
+		// There could be off-by-one issues in these couple sections.
+		maxX = viewpW;
+		maxY = viewpH;
+		if (ox + maxX >= mapW)
+			maxX = mapW - ox - 1;
+		if (oy + maxY >= mapH)
+			maxY = mapH - oy - 1;
+
+		return (minX <= maxX) && (minY <= maxY);
+	}
+
+	void buildRow(int y)
+	{
+		RowChunk &row = rows[y];
+
+		row.ground.clear();
+		for (int i = 0; i < prioMax; ++i)
+			row.prio[i].clear();
+
+		row.dirty = false;
+
+		int minX, minY, maxX, maxY;
+
+		if (!getVisibleTiles(minX, minY, maxX, maxY))
+			return;
+
+		if (y < minY || y > maxY)
+			return;
+
+		for (int x = minX; x <= maxX; ++x)
+			for (int z = 0; z < mapData->zSize(); ++z)
+				handleTile(x, y, z, row);
+	}
+
+	/* Regenerates all dirty rows. Returns true if any of
+	 * them changed in size, which means the VBO layout
+	 * has to be rebuilt */
+	bool buildDirtyRows()
+	{
+		int dirtyRows[viewpRows];
+		size_t oldSizes[viewpRows][prioMax+1];
+		size_t dirtyCount = 0;
+
+		for (int y = 0; y < viewpRows; ++y)
+		{
+			const RowChunk &row = rows[y];
+
+			if (!row.dirty)
+				continue;
+
+			oldSizes[y][0] = row.ground.size();
+			for (int i = 0; i < prioMax; ++i)
+				oldSizes[y][i+1] = row.prio[i].size();
+
+			dirtyRows[dirtyCount++] = y;
+		}
+
+		RowBuildPool &pool = RowBuildPool::instance();
+
+		if (dirtyCount >= parallelRowsMin && pool.available())
+		{
+			pool.build(this, dirtyRows, dirtyCount);
+		}
+		else
+		{
+			for (size_t i = 0; i < dirtyCount; ++i)
+				buildRow(dirtyRows[i]);
+		}
+
+		bool sizeChanged = false;
+
+		for (size_t j = 0; j < dirtyCount; ++j)
+		{
+			const int y = dirtyRows[j];
+			const RowChunk &row = rows[y];
+
+			if (oldSizes[y][0] != row.ground.size())
+				sizeChanged = true;
+
+			for (int i = 0; i < prioMax; ++i)
+				if (oldSizes[y][i+1] != row.prio[i].size())
+					sizeChanged = true;
+		}
+
+		return sizeChanged;
+	}
+
+	/* Uploads the rows built since the last
+	 * full upload, whose sizes have not changed */
+	void uploadRows(const bool *rebuilt)
 	{
-		/* Calculate total quad count */
-		size_t groundQuadCount = groundVert.size() / 4;
-		size_t quadCount = groundQuadCount;
+		VBO::bind(tiles.vbo);
+
+		for (int y = 0; y < viewpRows; ++y)
+		{
+			if (!rebuilt[y])
+				continue;
+
+			const RowChunk &row = rows[y];
+
+			if (!row.ground.empty())
+				VBO::uploadSubData(quadDataSize(row.groundBase),
+				                   quadDataSize(row.ground.size() / 4), dataPtr(row.ground));
+
+			for (int i = 0; i < prioMax; ++i)
+			{
+				if (row.prio[i].empty())
+					continue;
+
+				const size_t base = zlayerBases[y+i+1] + row.prioBase[i];
+
+				VBO::uploadSubData(quadDataSize(base),
+				                   quadDataSize(row.prio[i].size() / 4), dataPtr(row.prio[i]));
+			}
+		}
+
+		VBO::unbind();
+	}
+
+	/* Moves the generated rows by 'dy' tiles, so only
+	 * the rows scrolling into view have to be built */
+	void shiftRows(int dy)
+	{
+		if (dy > 0)
+			std::rotate(rows, rows + dy, rows + viewpRows);
+		else
+			std::rotate(rows, rows + viewpRows + dy, rows + viewpRows);
+
+		for (int y = 0; y < viewpRows; ++y)
+		{
+			RowChunk &row = rows[y];
+			const bool newRow = (dy > 0) ? (y >= viewpRows - dy) : (y < -dy);
+
+			if (newRow)
+			{
+				row.dirty = true;
+				continue;
+			}
+
+			const float offset = -32.0f * dy;
+
+			/* The zlayers of the row move along with it */
+			const float prioOffset = depth.enabled ? offset - dy / 64.0f : offset;
+
+			for (size_t i = 0; i < row.ground.size(); ++i)
+				row.ground[i].pos.y += offset;
+
+			for (int j = 0; j < prioMax; ++j)
+				for (size_t i = 0; i < row.prio[j].size(); ++i)
+					row.prio[j][i].pos.y += prioOffset;
+		}
+
+		rowsDirty = true;
+		rowLayoutDirty = true;
+	}
+
+	static size_t quadDataSize(size_t quadCount)
+	{
+		return quadCount * sizeof(SVertex) * 4;
+	}
+
+	size_t zlayerSize(size_t index)
+	{
+		return zlayerBases[index+1] - zlayerBases[index];
+	}
+
+	/* Lays out the rows as the ground layer followed by
+	 * each zlayer, computing the row offsets */
+	size_t layoutRows()
+	{
+		size_t quadCount = 0;
+
+		for (int y = 0; y < viewpRows; ++y)
+		{
+			rows[y].groundBase = quadCount;
+			quadCount += rows[y].ground.size() / 4;
+		}
 
 		for (size_t i = 0; i < zlayersMax; ++i)
 		{
 			zlayerBases[i] = quadCount;
-			quadCount += zlayerVert[i].size() / 4;
+
+			for (int prio = 1; prio <= prioMax; ++prio)
+			{
+				const int y = i - prio;
+
+				if (y < 0 || y >= viewpRows)
+					continue;
+
+				rows[y].prioBase[prio-1] = quadCount - zlayerBases[i];
+				quadCount += rows[y].prio[prio-1].size() / 4;
+			}
 		}
 
 		zlayerBases[zlayersMax] = quadCount;
 
-		VBO::bind(tiles.vbo);
-		VBO::allocEmpty(quadDataSize(quadCount));
+		return quadCount;
+	}
 
-		VBO::uploadSubData(0, quadDataSize(groundQuadCount), dataPtr(groundVert));
+	static void copyVerts(SVertex *dst, size_t quadOffset, const SVVector &src)
+	{
+		if (!src.empty())
+			memcpy(dst + quadOffset * 4, &src[0], src.size() * sizeof(SVertex));
+	}
 
-		for (size_t i = 0; i < zlayersMax; ++i)
+	/* Assembles all rows in frame scratch memory
+	 * and uploads them in one go */
+	void uploadBuffers()
+	{
+		const size_t quadCount = layoutRows();
+
+		SVertex *vert = shState->frameArena().alloc<SVertex>(quadCount * 4);
+
+		for (int y = 0; y < viewpRows; ++y)
 		{
-			if (zlayerVert[i].empty())
-				continue;
+			const RowChunk &row = rows[y];
+
+			copyVerts(vert, row.groundBase, row.ground);
 
-			VBO::uploadSubData(quadDataSize(zlayerBases[i]),
-			                   quadDataSize(zlayerSize(i)), dataPtr(zlayerVert[i]));
+			for (int i = 0; i < prioMax; ++i)
+				if (y+i+1 < (int) zlayersMax)
+					copyVerts(vert, zlayerBases[y+i+1] + row.prioBase[i], row.prio[i]);
 		}
 
+		VBO::bind(tiles.vbo);
+		VBO::allocEmpty(quadDataSize(quadCount));
+
+		if (quadCount > 0)
+			VBO::uploadSubData(0, quadDataSize(quadCount), vert);
+
 		VBO::unbind();
 
 		/* Ensure global IBO size */
 		shState->ensureQuadIBO(quadCount);
 	}
 
-	void bindShader(ShaderBase *&shaderVar)
+	/* 'tagged' is set for zlayer vertices, which only
+	 * the depth shader can draw once tagged */
+	void bindShader(ShaderBase *&shaderVar, bool tagged = false)
 	{
-		if (tiles.animated || color->hasEffect() || tone->hasEffect() || opacity != 255)
+		if (tagged)
+		{
+			TilemapDepthShader &depthShader = shState->shaders().tilemapDepth;
+			setupShader(depthShader);
+			depthShader.setDepthStep(2.0f / (2 * zlayersMax + 1));
+			depthShader.setAlphaPass(TilemapDepthShader::AllTexels);
+			shaderVar = &depthShader;
+		}
+		else if (tiles.animated || color->hasEffect() || tone->hasEffect() || opacity != 255)
 		{
 			TilemapShader &tilemapShader = shState->shaders().tilemap;
-			tilemapShader.bind();
-			tilemapShader.applyViewportProj();
-			tilemapShader.setTone(tone->norm);
-			tilemapShader.setColor(color->norm);
-			tilemapShader.setOpacity(opacity.norm);
-			tilemapShader.setAniIndex(tiles.aniIdx / atFrameDur);
-			tilemapShader.setATFrames(atlas.nATFrames);
+			setupShader(tilemapShader);
 			shaderVar = &tilemapShader;
 		}
 		else
 		{
-			shaderVar = &shState->shaders().simple;
+			shaderVar = &shState->shaders().simple.get();
 			shaderVar->bind();
 		}
 
 		shaderVar->applyViewportProj();
 	}
 
+	void setupShader(TilemapShader &shader)
+	{
+		shader.bind();
+		shader.applyViewportProj();
+		shader.setTone(tone->norm);
+		shader.setColor(color->norm);
+		shader.setOpacity(opacity.norm);
+		shader.setAniIndex(tiles.aniIdx / atFrameDur);
+		shader.setATFrames(atlas.nATFrames);
+	}
+
 	void bindAtlas(ShaderBase &shader)
 	{
 		TEX::bind(atlas.gl.tex);
@@ -905,7 +1745,7 @@ struct TilemapPrivate
 		std::vector<int> zlayerInd;
 
 		for (size_t i = 0; i < zlayersMax; ++i)
-			if (zlayerVert[i].size() > 0)
+			if (zlayerSize(i) > 0)
 				zlayerInd.push_back(i);
 
 		updateActiveElements(zlayerInd);
@@ -981,6 +1821,100 @@ struct TilemapPrivate
 		}
 	}
 
+	/* With 'depth.enabled', zlayer i is drawn at window depth
+	 * 1 - (2i+1) / (2*zlayersMax+1). The elements between zlayer
+	 * i and the next one sit just below that, so they are depth
+	 * tested behind the opaque texels of all higher zlayers,
+	 * like they'd be drawn before them normally */
+	static float elementDepth(size_t index)
+	{
+		return 1.0f - (2.0f * index + 2.0f) / (2.0f * zlayersMax + 1.0f);
+	}
+
+	bool canDrawDepth()
+	{
+		/* A tilemap drawn inside another one's span
+		 * can't touch the depth buffer */
+		if (!Scene::depthBuffered || glState.depthTest.get())
+			return false;
+
+		/* Blending with the elements in between
+		 * depends on them being drawn first */
+		return opacity == 255 && blendType == BlendNormal;
+	}
+
+	/* Draws the opaque texels of all zlayers at their depths,
+	 * then the translucent ones depth tested against those */
+	void drawDepthTiles()
+	{
+		const GLsizei count = (zlayerBases[zlayersMax] - zlayerBases[0]) * 6;
+		const GLintptr offset = zlayerBases[0] * _GL_INDEX_SIZE * 6;
+
+		ShaderBase *shader;
+
+		bindShader(shader, true);
+		bindAtlas(*shader);
+
+		TilemapDepthShader &depthShader = shState->shaders().tilemapDepth;
+
+		glState.blendMode.pushSet(blendType);
+		glState.depthTest.set(true);
+
+		GLMeta::vaoBind(tiles.vao);
+
+		shader->setTranslation(drawPos());
+
+		gl.DepthMask(GL_TRUE);
+		gl.Clear(GL_DEPTH_BUFFER_BIT);
+
+		depthShader.setAlphaPass(TilemapDepthShader::OpaqueTexels);
+		gl.DrawElements(GL_TRIANGLES, count, _GL_INDEX_TYPE, (GLvoid*) offset);
+
+		gl.DepthMask(GL_FALSE);
+
+		depthShader.setAlphaPass(TilemapDepthShader::TranslucentTexels);
+		gl.DrawElements(GL_TRIANGLES, count, _GL_INDEX_TYPE, (GLvoid*) offset);
+
+		glCounters.draws += 2;
+
+		GLMeta::vaoUnbind(tiles.vao);
+
+		glState.blendMode.pop();
+	}
+
+	/* Called for each zlayer in place of its own draw. The first
+	 * one draws the tiles of all of them, and every one sets the
+	 * depth the elements up to the next one are drawn at. Returns
+	 * false if the zlayers have to be drawn one by one instead */
+	bool drawDepthLayer(const ZLayer &layer)
+	{
+		const bool first = (&layer == elem.zlayers[0]);
+		const bool last = (&layer == elem.zlayers[elem.activeLayers-1]);
+
+		if (first)
+			depth.span = canDrawDepth();
+
+		if (!depth.span)
+			return false;
+
+		if (first)
+			drawDepthTiles();
+
+		if (last)
+		{
+			glState.depthRange.set(Vec2(0, 1));
+			glState.depthTest.set(false);
+			depth.span = false;
+		}
+		else
+		{
+			const float d = elementDepth(layer.index);
+			glState.depthRange.set(Vec2(d, d));
+		}
+
+		return true;
+	}
+
 	void updateMapViewport()
 	{
 		const Vec2i combOrigin = origin + elem.sceneGeo.orig;
@@ -988,23 +1922,55 @@ struct TilemapPrivate
 
 		if (mvpPos != viewpPos)
 		{
+			const int dy = mvpPos.y - viewpPos.y;
+
+			if (!buffersDirty && mvpPos.x == viewpPos.x && abs(dy) < viewpRows)
+				shiftRows(dy);
+			else
+				buffersDirty = true;
+
 			viewpPos = mvpPos;
-			buffersDirty = true;
 			updateFlashMapViewport();
 		}
 
 		dispPos = elem.sceneGeo.rect.pos() - wrap(combOrigin, 32);
 	}
 
-	void prepare()
+	/* 'dispPos' with the scroll position interpolated, as far
+	 * as the buffers built for the current one still cover it */
+	Vec2i drawPos()
 	{
+		const Vec2i combOrigin = origin + elem.sceneGeo.orig;
+		const Vec2 pos = interp.get(Vec2(combOrigin.x, combOrigin.y));
+		const Vec2i wrapped = wrap(combOrigin, 32);
+		const Vec2i slack((viewpW+1) * 32 - elem.sceneGeo.rect.w,
+		                  viewpRows * 32 - elem.sceneGeo.rect.h);
+
+		Vec2i off(wrapped.x + (int) floorf(pos.x) - combOrigin.x,
+		          wrapped.y + (int) floorf(pos.y) - combOrigin.y);
+
+		if (off.x < 0 || off.x > slack.x)
+			off.x = wrapped.x;
+		if (off.y < 0 || off.y > slack.y)
+			off.y = wrapped.y;
+
+		return elem.sceneGeo.rect.pos() - off;
+	}
+
+	/* Stays enrolled, as the resources have to be
+	 * verified each frame (they may be disposed) */
+	bool prepare()
+	{
+		ProfileScope profile(Profiler::TilemapPrepare);
+		TRACE_ZONE("Tilemap prepare");
+
 		if (!verifyResources())
 		{
 			if (tilemapReady)
 				hideElements();
 			tilemapReady = false;
 
-			return;
+			return true;
 		}
 
 		if (atlasSizeDirty)
@@ -1017,22 +1983,63 @@ struct TilemapPrivate
 		{
 			buildAtlas();
 			atlasDirty = false;
+			atlasDirtyATs = 0;
+		}
+		else if (atlasDirtyATs)
+		{
+			updateAtlasAutotiles();
+			atlasDirtyATs = 0;
+		}
+
+		if (tilesetStreamed())
+		{
+			if (atlas.tsScanMap)
+				wantMapTiles();
+
+			if (atlas.tsChunksWanted)
+				uploadTilesetChunks();
 		}
 
+		updateGPUActive();
+
 		if (mapViewportDirty)
 		{
 			updateMapViewport();
 			mapViewportDirty = false;
 		}
 
-		if (buffersDirty)
+		if (buffersDirty || rowsDirty)
 		{
-			buildQuadArray();
-			uploadBuffers();
-			updateSceneElements();
+			bool rebuilt[viewpRows];
+
+			for (int y = 0; y < viewpRows; ++y)
+			{
+				if (buffersDirty)
+					rows[y].dirty = true;
+
+				rebuilt[y] = rows[y].dirty;
+			}
+
+			const bool sizeChanged = buildDirtyRows();
+
+			if (buffersDirty || rowLayoutDirty || sizeChanged)
+			{
+				uploadBuffers();
+				updateSceneElements();
+			}
+			else
+			{
+				uploadRows(rebuilt);
+			}
+
 			buffersDirty = false;
+			rowsDirty = false;
+			rowLayoutDirty = false;
 		}
 
+		if (gpu.active)
+			prepareGPU();
+
 		flashMap.prepare();
 
 		if (zOrderDirty)
@@ -1044,9 +2051,120 @@ struct TilemapPrivate
 		prepareZLayerBatches();
 
 		tilemapReady = true;
+
+		return true;
 	}
 };
 
+RowBuildPool::RowBuildPool()
+    : p(0),
+      rows(0),
+      rowCount(0),
+      nextRow(0),
+      rowsDone(0),
+      quit(false)
+{
+	mutex = SDL_CreateMutex();
+	jobCond = SDL_CreateCond();
+	doneCond = SDL_CreateCond();
+}
+
+RowBuildPool::~RowBuildPool()
+{
+	SDL_LockMutex(mutex);
+	quit = true;
+	SDL_CondBroadcast(jobCond);
+	SDL_UnlockMutex(mutex);
+
+	for (size_t i = 0; i < workers.size(); ++i)
+		SDL_WaitThread(workers[i], 0);
+
+	SDL_DestroyCond(doneCond);
+	SDL_DestroyCond(jobCond);
+	SDL_DestroyMutex(mutex);
+}
+
+bool RowBuildPool::available()
+{
+	if (SDL_GetCPUCount() < 2)
+		return false;
+
+	/* Threads are only spawned for the first batch */
+	if (workers.empty())
+	{
+		const int count = clamp(SDL_GetCPUCount() - 1, 1, 3);
+
+		for (int i = 0; i < count; ++i)
+		{
+			SDL_Thread *thread =
+				createSDLThread<RowBuildPool, &RowBuildPool::work>(this, "tilemaprows");
+
+			if (thread)
+				workers.push_back(thread);
+		}
+	}
+
+	return !workers.empty();
+}
+
+void RowBuildPool::build(TilemapPrivate *p, const int *rows, size_t count)
+{
+	SDL_LockMutex(mutex);
+
+	this->p = p;
+	this->rows = rows;
+	rowCount = count;
+	nextRow = 0;
+	rowsDone = 0;
+
+	SDL_CondBroadcast(jobCond);
+
+	/* The calling thread takes rows as well */
+	buildRows();
+
+	while (rowsDone < rowCount)
+		SDL_CondWait(doneCond, mutex);
+
+	this->p = 0;
+	this->rows = 0;
+
+	SDL_UnlockMutex(mutex);
+}
+
+void RowBuildPool::work()
+{
+	SDL_LockMutex(mutex);
+
+	while (true)
+	{
+		while (!quit && nextRow >= rowCount)
+			SDL_CondWait(jobCond, mutex);
+
+		if (quit)
+			break;
+
+		buildRows();
+	}
+
+	SDL_UnlockMutex(mutex);
+}
+
+void RowBuildPool::buildRows()
+{
+	while (nextRow < rowCount)
+	{
+		const int y = rows[nextRow++];
+		TilemapPrivate *target = p;
+
+		SDL_UnlockMutex(mutex);
+		target->buildRow(y);
+		SDL_LockMutex(mutex);
+
+		if (++rowsDone == rowCount)
+			SDL_CondSignal(doneCond);
+	}
+}
+
 GroundLayer::GroundLayer(TilemapPrivate *p, Viewport *viewport)
     : ViewportElement(viewport, 0),
       vboCount(0),
@@ -1062,10 +2180,23 @@ void GroundLayer::updateVboCount()
 
 void GroundLayer::draw()
 {
-	if (p->groundVert.size() == 0)
+	if (!p->opacity)
 		return;
 
-	if (!p->opacity)
+	if (p->gpu.active)
+	{
+		glState.blendMode.pushSet(p->blendType);
+
+		p->drawGPUGround();
+		p->flashMap.draw(flashAlpha[p->flashAlphaIdx] / 255.f, p->drawPos());
+
+		glState.blendMode.pop();
+
+		return;
+	}
+
+	/* Ground quads come first in the buffer */
+	if (p->zlayerBases[0] == 0)
 		return;
 
 	ShaderBase *shader;
@@ -1077,12 +2208,12 @@ void GroundLayer::draw()
 
 	GLMeta::vaoBind(p->tiles.vao);
 
-	shader->setTranslation(p->dispPos);
+	shader->setTranslation(p->drawPos());
 	drawInt();
 
 	GLMeta::vaoUnbind(p->tiles.vao);
 
-	p->flashMap.draw(flashAlpha[p->flashAlphaIdx] / 255.f, p->dispPos);
+	p->flashMap.draw(flashAlpha[p->flashAlphaIdx] / 255.f, p->drawPos());
 
 	glState.blendMode.pop();
 }
@@ -1090,6 +2221,7 @@ void GroundLayer::draw()
 void GroundLayer::drawInt()
 {
 	gl.DrawElements(GL_TRIANGLES, vboCount, _GL_INDEX_TYPE, (GLvoid*) 0);
+	++glCounters.draws;
 }
 
 void GroundLayer::onGeometryChange(const Scene::Geometry &geo)
@@ -1113,25 +2245,28 @@ void ZLayer::setIndex(int value)
 	z = calculateZ(p, index);
 	scene->reinsert(*this);
 
-	vboOffset = p->zlayerBases[index] * sizeof(index_t) * 6;
+	vboOffset = p->zlayerBases[index] * _GL_INDEX_SIZE * 6;
 	vboCount = p->zlayerSize(index) * 6;
 }
 
 void ZLayer::draw()
 {
+	if (p->depth.enabled && p->drawDepthLayer(*this))
+		return;
+
 	if (batchedFlag)
 		return;
 
 	ShaderBase *shader;
 
-	p->bindShader(shader);
+	p->bindShader(shader, p->depth.enabled);
 	p->bindAtlas(*shader);
 
 	glState.blendMode.pushSet(p->blendType);
 
 	GLMeta::vaoBind(p->tiles.vao);
 
-	shader->setTranslation(p->dispPos);
+	shader->setTranslation(p->drawPos());
 	drawInt();
 
 	GLMeta::vaoUnbind(p->tiles.vao);
@@ -1142,6 +2277,7 @@ void ZLayer::draw()
 void ZLayer::drawInt()
 {
 	gl.DrawElements(GL_TRIANGLES, vboBatchCount, _GL_INDEX_TYPE, (GLvoid*) vboOffset);
+	++glCounters.draws;
 }
 
 int ZLayer::calculateZ(TilemapPrivate *p, int index)
@@ -1177,15 +2313,18 @@ void Tilemap::Autotiles::set(int i, Bitmap *bitmap)
 
 	p->autotiles[i] = bitmap;
 
-	p->invalidateAtlasContents();
+	p->invalidateAutotile(i);
+
+	/* Only this slot of the atlas needs regenerating */
+	TilemapPrivate *tp = p;
 
 	p->autotilesCon[i].disconnect();
 	p->autotilesCon[i] = bitmap->modified.connect
-	        (&TilemapPrivate::invalidateAtlasContents, p);
+	        ([tp, i]() { tp->invalidateAutotile(i); });
 
 	p->autotilesDispCon[i].disconnect();
 	p->autotilesDispCon[i] = bitmap->wasDisposed.connect
-	        (&TilemapPrivate::invalidateAtlasContents, p);
+	        ([tp, i]() { tp->invalidateAutotile(i); });
 
 	p->updateAutotileInfo();
 }
@@ -1223,11 +2362,17 @@ void Tilemap::update()
 	if (++p->flashAlphaIdx >= flashAlphaN)
 		p->flashAlphaIdx = 0;
 
+	if (p->flashMap.hasFlash())
+		p->damage();
+
 	/* Animate autotiles */
 	if (!p->tiles.animated)
 		return;
 
-	++p->tiles.aniIdx;
+	const uint32_t prevFrame = p->tiles.aniIdx / atFrameDur;
+
+	if (++p->tiles.aniIdx / atFrameDur != prevFrame)
+		p->damage();
 }
 
 Tilemap::Autotiles &Tilemap::getAutotiles()
@@ -1247,7 +2392,7 @@ DEF_ATTR_RD_SIMPLE(Tilemap, OX, int, p->origin.x)
 DEF_ATTR_RD_SIMPLE(Tilemap, OY, int, p->origin.y)
 
 DEF_ATTR_RD_SIMPLE(Tilemap, BlendType, int, p->blendType)
-DEF_ATTR_SIMPLE(Tilemap, Opacity,   int,     p->opacity)
+DEF_ATTR_RD_SIMPLE(Tilemap, Opacity, int, p->opacity)
 DEF_ATTR_SIMPLE(Tilemap, Color,     Color&, *p->color)
 DEF_ATTR_SIMPLE(Tilemap, Tone,      Tone&,  *p->tone)
 
@@ -1258,6 +2403,8 @@ void Tilemap::setTileset(Bitmap *value)
 	if (p->tileset == value)
 		return;
 
+	p->damage();
+
 	p->tileset = value;
 
 	if (!value)
@@ -1278,6 +2425,8 @@ void Tilemap::setMapData(Table *value)
 	if (p->mapData == value)
 		return;
 
+	p->damage();
+
 	p->mapData = value;
 
 	if (!value)
@@ -1286,12 +2435,16 @@ void Tilemap::setMapData(Table *value)
 	p->invalidateBuffers();
 	p->mapDataCon.disconnect();
 	p->mapDataCon = value->modified.connect
-	        (&TilemapPrivate::invalidateBuffers, p);
+	        (&TilemapPrivate::onMapDataModified, p);
+	p->mapDataCellCon.disconnect();
+	p->mapDataCellCon = value->cellModified.connect
+	        (&TilemapPrivate::onMapCellModified, p);
 }
 
 void Tilemap::setFlashData(Table *value)
 {
 	guardDisposed();
+	p->damage();
 
 	p->flashMap.setData(value);
 }
@@ -1303,6 +2456,8 @@ void Tilemap::setPriorities(Table *value)
 	if (p->priorities == value)
 		return;
 
+	p->damage();
+
 	p->priorities = value;
 
 	if (!value)
@@ -1321,6 +2476,8 @@ void Tilemap::setVisible(bool value)
 	if (p->visible == value)
 		return;
 
+	p->damage();
+
 	p->visible = value;
 
 	if (!p->tilemapReady)
@@ -1338,6 +2495,8 @@ void Tilemap::setOX(int value)
 	if (p->origin.x == value)
 		return;
 
+	p->damage();
+
 	p->origin.x = value;
 	p->mapViewportDirty = true;
 }
@@ -1349,14 +2508,29 @@ void Tilemap::setOY(int value)
 	if (p->origin.y == value)
 		return;
 
+	p->damage();
+
 	p->origin.y = value;
 	p->zOrderDirty = true;
 	p->mapViewportDirty = true;
 }
 
+void Tilemap::setOpacity(int value)
+{
+	guardDisposed();
+
+	if (p->opacity == value)
+		return;
+
+	p->damage();
+
+	p->opacity = value;
+}
+
 void Tilemap::setBlendType(int value)
 {
 	guardDisposed();
+	p->damage();
 
 	switch (value)
 	{
@@ -34,7 +34,11 @@
 #include "quadarray.h"
 #include "shader.h"
 #include "tilemap-common.h"
+#include "profiler.h"
+#include "trace.h"
+#include "preparable.h"
 
+#include <string>
 #include <vector>
 #include "sigslot/signal.hpp"
 
@@ -51,7 +55,7 @@ static const uint8_t flashAlpha[] =
 
 static elementsN(flashAlpha);
 
-struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
+struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader, Preparable
 {
 	Bitmap *bitmaps[BM_COUNT];
 
@@ -69,6 +73,8 @@ struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
 	std::vector<SVertex> aboveVert;
 
 	TEXFBO atlas;
+	/* See SharedState::requestAtlasTex() */
+	std::string atlasKey;
 	VBO::ID vbo;
 	GLMeta::VAO vao;
 
@@ -90,7 +96,6 @@ struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
 	sigslot::connection mapDataCon;
 	sigslot::connection flagsCon;
 
-	sigslot::connection prepareCon;
 	sigslot::connection bmChangedCons[BM_COUNT];
 	sigslot::connection bmDisposedCons[BM_COUNT];
 
@@ -130,7 +135,7 @@ struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
 	{
 		memset(bitmaps, 0, sizeof(bitmaps));
 
-		shState->requestAtlasTex(ATLASVX_W, ATLASVX_H, atlas);
+		shState->requestAtlasTex(ATLASVX_W, ATLASVX_H, atlas, &atlasKey);
 
 		vbo = VBO::gen();
 
@@ -141,8 +146,7 @@ struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
 
 		onGeometryChange(scene->getGeometry());
 
-		prepareCon = shState->prepareDraw.connect
-			(&TilemapVXPrivate::prepare, this);
+		requestPrepare();
 	}
 
 	virtual ~TilemapVXPrivate()
@@ -150,9 +154,7 @@ struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
 		GLMeta::vaoFini(vao);
 		VBO::del(vbo);
 
-		shState->releaseAtlasTex(atlas);
-
-		prepareCon.disconnect();
+		shState->releaseAtlasTex(atlas, atlasKey);
 
 		mapDataCon.disconnect();
 		flagsCon.disconnect();
@@ -167,16 +169,36 @@ struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
 	void invalidateAtlas()
 	{
 		atlasDirty = true;
+		damage();
 	}
 
 	void invalidateBuffers()
 	{
 		buffersDirty = true;
+		damage();
 	}
 
 	void rebuildAtlas()
 	{
+		std::string key;
+
+		for (size_t i = 0; i < BM_COUNT; ++i)
+		{
+			key += '\n';
+			key += nullOrDisposed(bitmaps[i]) ? "-" : bitmaps[i]->contentKey();
+		}
+
+		/* Left over from a tilemap using the same bitmaps */
+		if (key == atlasKey)
+			return;
+
+		/* Built earlier for another tileset combination */
+		if (shState->swapAtlasTex(atlas, atlasKey, key))
+			return;
+
+		atlasKey.clear();
 		TileAtlasVX::build(atlas, bitmaps);
+		atlasKey = key;
 	}
 
 	void updateMapViewport()
@@ -242,10 +264,14 @@ struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
 		shState->ensureQuadIBO(totalQuads);
 	}
 
-	void prepare()
+	/* Stays enrolled, like Tilemap */
+	bool prepare()
 	{
+		ProfileScope profile(Profiler::TilemapPrepare);
+		TRACE_ZONE("Tilemap prepare");
+
 		if (!mapData)
-			return;
+			return true;
 
 		if (atlasDirty)
 		{
@@ -266,6 +292,8 @@ struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
 		}
 
 		flashMap.prepare();
+
+		return true;
 	}
 
 	SVertex *allocVert(std::vector<SVertex> &vec, size_t count)
@@ -302,7 +330,7 @@ struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
 		else
 		{
 			/* Static tileset */
-			shader = &shState->shaders().simple;
+			shader = &shState->shaders().simple.get();
 			shader->bind();
 		}
 
@@ -314,6 +342,7 @@ struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
 		GLMeta::vaoBind(vao);
 
 		gl.DrawElements(GL_TRIANGLES, groundQuads*6, _GL_INDEX_TYPE, 0);
+		++glCounters.draws;
 
 		GLMeta::vaoUnbind(vao);
 	}
@@ -333,7 +362,8 @@ struct TilemapVXPrivate : public ViewportElement, TileAtlasVX::Reader
 		GLMeta::vaoBind(vao);
 
 		gl.DrawElements(GL_TRIANGLES, aboveQuads*6, _GL_INDEX_TYPE,
-		                (GLvoid*) (groundQuads*6*sizeof(index_t)));
+		                (GLvoid*) (groundQuads*6*_GL_INDEX_SIZE));
+		++glCounters.draws;
 
 		GLMeta::vaoUnbind(vao);
 	}
@@ -379,7 +409,7 @@ void TilemapVX::BitmapArray::set(int i, Bitmap *bitmap)
 		return;
 
 	p->bitmaps[i] = bitmap;
-	p->atlasDirty = true;
+	p->invalidateAtlas();
 
 	p->bmChangedCons[i].disconnect();
 	p->bmChangedCons[i] = bitmap->modified.connect
@@ -428,11 +458,19 @@ void TilemapVX::update()
 	uint8_t aniIdxA = aniIndicesA[p->frameIdx / 30];
 	uint8_t aniIdxC = aniIndicesC[p->frameIdx / 30];
 
-	p->aniOffset = Vec2(aniIdxA * 2 * 32, aniIdxC * 32);
+	const Vec2 aniOffset(aniIdxA * 2 * 32, aniIdxC * 32);
+
+	if (aniOffset.x != p->aniOffset.x || aniOffset.y != p->aniOffset.y)
+		p->damage();
+
+	p->aniOffset = aniOffset;
 
 	/* Animate flash */
 	if (++p->flashAlphaIdx >= flashAlphaN)
 		p->flashAlphaIdx = 0;
+
+	if (p->flashMap.hasFlash())
+		p->damage();
 }
 
 TilemapVX::BitmapArray &TilemapVX::getBitmapArray()
@@ -477,6 +515,8 @@ void TilemapVX::setMapData(Table *value)
 	if (p->mapData == value)
 		return;
 
+	p->damage();
+
 	p->mapData = value;
 	p->buffersDirty = true;
 
@@ -488,6 +528,7 @@ void TilemapVX::setMapData(Table *value)
 void TilemapVX::setFlashData(Table *value)
 {
 	guardDisposed();
+	p->damage();
 
 	p->flashMap.setData(value);
 }
@@ -499,6 +540,8 @@ void TilemapVX::setFlags(Table *value)
 	if (p->flags == value)
 		return;
 
+	p->damage();
+
 	p->flags = value;
 	p->buffersDirty = true;
 
@@ -522,6 +565,8 @@ void TilemapVX::setOX(int value)
 	if (p->origin.x == value)
 		return;
 
+	p->damage();
+
 	p->origin.x = value;
 	p->mapViewportDirty = true;
 }
@@ -533,6 +578,8 @@ void TilemapVX::setOY(int value)
 	if (p->origin.y == value)
 		return;
 
+	p->damage();
+
 	p->origin.y = value;
 	p->mapViewportDirty = true;
 }
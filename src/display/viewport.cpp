@@ -27,18 +27,22 @@
 #include "quad.h"
 #include "glstate.h"
 #include "graphics.h"
+#include "gl-util.h"
+#include "shader.h"
+#include "sprite.h"
+#include "preparable.h"
 
 #include <SDL_rect.h>
 
-#include "sigslot/signal.hpp"
-
-struct ViewportPrivate
+struct ViewportPrivate : public Preparable
 {
+	DECL_POOLED_NEW(ViewportPrivate)
+
 	/* Needed for geometry changes */
 	Viewport *self;
 
 	Rect *rect;
-	sigslot::connection rectCon;
+	GenerationWatch rectWatch;
 
 	Color *color;
 	Tone *tone;
@@ -46,6 +50,17 @@ struct ViewportPrivate
 	IntRect screenRect;
 	int isOnScreen;
 
+	/* Retained rendering of the children (see 'Cache'),
+	 * as large as the screen */
+	struct
+	{
+		bool enabled;
+		bool dirty;
+		unsigned int stamp;
+		TEXFBO tex;
+		Quad quad;
+	} cache;
+
 	EtcTemps tmp;
 
 	ViewportPrivate(int x, int y, int width, int height, Viewport *self)
@@ -56,12 +71,88 @@ struct ViewportPrivate
 	      isOnScreen(false)
 	{
 		rect->set(x, y, width, height);
-		updateRectCon();
+		rectWatch.poll(rect->generation);
+		requestPrepare();
+
+		cache.enabled = false;
+		cache.dirty = true;
+		cache.stamp = 0;
+		TEXFBO::clear(cache.tex);
 	}
 
 	~ViewportPrivate()
 	{
-		rectCon.disconnect();
+		releaseCache();
+	}
+
+	void releaseCache()
+	{
+		if (cache.tex.tex != TEX::ID(0))
+			TEXFBO::fini(cache.tex);
+
+		TEXFBO::clear(cache.tex);
+	}
+
+	bool cacheValid() const
+	{
+		return !cache.dirty && cache.stamp == Scene::screenDamageStamp;
+	}
+
+	void renderCache()
+	{
+		const IntRect &screen = self->scene->getGeometry().rect;
+
+		if (cache.tex.width != screen.w || cache.tex.height != screen.h)
+		{
+			releaseCache();
+
+			TEXFBO::init(cache.tex);
+			TEXFBO::allocEmpty(cache.tex, screen.w, screen.h);
+			TEXFBO::linkFBO(cache.tex);
+
+			cache.dirty = true;
+		}
+
+		if (cacheValid())
+			return;
+
+		FBO::bind(cache.tex.fbo);
+		glState.viewport.pushSet(IntRect(0, 0, screen.w, screen.h));
+		glState.clearColor.pushSet(Vec4());
+		FBO::clear();
+
+		glState.scissorTest.pushSet(true);
+		glState.scissorBox.pushSet(rect->toIntRect());
+
+		self->Scene::composite();
+
+		glState.scissorBox.pop();
+		glState.scissorTest.pop();
+		glState.clearColor.pop();
+		glState.viewport.pop();
+
+		const FloatRect r = rect->toFloatRect();
+		cache.quad.setTexPosRect(r, r);
+
+		cache.dirty = false;
+		cache.stamp = Scene::screenDamageStamp;
+	}
+
+	/* Children were drawn onto a transparent buffer with
+	 * normal blending, which leaves them premultiplied */
+	void drawCache()
+	{
+		SimpleShader &shader = shState->shaders().simple;
+		shader.bind();
+		shader.applyViewportProj();
+		shader.setTranslation(Vec2i());
+		shader.setTexSize(Vec2i(cache.tex.width, cache.tex.height));
+
+		TEX::bind(cache.tex.tex);
+
+		glState.blendMode.pushSet(BlendPremultiplied);
+		cache.quad.draw();
+		glState.blendMode.pop();
 	}
 
 	void onRectChange()
@@ -71,11 +162,20 @@ struct ViewportPrivate
 		recomputeOnScreen();
 	}
 
-	void updateRectCon()
+	/* Picks up rect writes made since the last call */
+	void syncRect()
 	{
-		rectCon.disconnect();
-		rectCon = rect->valueChanged.connect
-		        (&ViewportPrivate::onRectChange, this);
+		if (rectWatch.poll(rect->generation))
+			onRectChange();
+	}
+
+	/* Stays enrolled; runs ahead of the children's prepare(),
+	 * which the geometry change enrolls for the same pass */
+	bool prepare()
+	{
+		syncRect();
+
+		return true;
 	}
 
 	void recomputeOnScreen()
@@ -147,9 +247,27 @@ void Viewport::update()
 DEF_ATTR_RD_SIMPLE(Viewport, OX,   int,   geometry.orig.x)
 DEF_ATTR_RD_SIMPLE(Viewport, OY,   int,   geometry.orig.y)
 
-DEF_ATTR_SIMPLE(Viewport, Rect,  Rect&,  *p->rect)
-DEF_ATTR_SIMPLE(Viewport, Color, Color&, *p->color)
-DEF_ATTR_SIMPLE(Viewport, Tone,  Tone&,  *p->tone)
+DEF_ATTR_SIMPLE_DAMAGE(Viewport, Rect,  Rect&,  *p->rect)
+DEF_ATTR_SIMPLE_DAMAGE(Viewport, Color, Color&, *p->color)
+DEF_ATTR_SIMPLE_DAMAGE(Viewport, Tone,  Tone&,  *p->tone)
+
+DEF_ATTR_RD_SIMPLE(Viewport, Cache, bool, p->cache.enabled)
+
+void Viewport::setCache(bool value)
+{
+	guardDisposed();
+
+	if (p->cache.enabled == value)
+		return;
+
+	p->cache.enabled = value;
+	p->cache.dirty = true;
+
+	if (!value)
+		p->releaseCache();
+
+	damage();
+}
 
 void Viewport::setOX(int value)
 {
@@ -173,13 +291,36 @@ void Viewport::setOY(int value)
 	notifyGeometryChange();
 }
 
+Sprite *Viewport::pick(int x, int y)
+{
+	guardDisposed();
+
+	if (!visible)
+		return 0;
+
+	p->syncRect();
+	sortElements();
+
+	for (IntruListLink<SceneElement> *iter = elements.end()->prev;
+	     iter != elements.end(); iter = iter->prev)
+	{
+		if (iter->data->culled)
+			continue;
+
+		if (iter->data->hitTest(x, y))
+			return static_cast<Sprite*>(iter->data);
+	}
+
+	return 0;
+}
+
 void Viewport::initDynAttribs()
 {
 	p->rect = new Rect(*p->rect);
 	p->color = new Color;
 	p->tone = new Tone;
 
-	p->updateRectCon();
+	p->rectWatch.reset();
 }
 
 /* Scene */
@@ -197,24 +338,61 @@ void Viewport::composite()
 	glState.scissorTest.pushSet(true);
 	glState.scissorBox.pushSet(p->rect->toIntRect());
 
-	Scene::composite();
+	if (p->cache.enabled && p->cacheValid())
+		p->drawCache();
+	else
+		Scene::composite();
 
 	/* If any effects are visible, request parent Scene to
 	 * render them. */
 	if (renderEffect)
 		scene->requestViewportRender
-		        (p->color->norm, flashColor, p->tone->norm);
+		        (p->color->norm, flashColor, p->tone->norm, this);
 
 	glState.scissorBox.pop();
 	glState.scissorTest.pop();
 }
 
+bool Viewport::occludesScene()
+{
+	if (emptyFlashFlag || elements.getSize() == 0)
+		return false;
+
+	/* Must span the whole parent scene; color, tone
+	 * and flash don't make anything translucent */
+	const IntRect &parent = p->screenRect;
+
+	if (!p->rect->toIntRect().encloses(IntRect(0, 0, parent.w, parent.h)))
+		return false;
+
+	return topOccluder() != 0;
+}
+
+void Viewport::damage()
+{
+	p->cache.dirty = true;
+
+	/* Our contents are only visible if we are */
+	SceneElement::damage();
+}
+
 /* SceneElement */
 void Viewport::draw()
 {
 	composite();
 }
 
+void Viewport::prerender()
+{
+	if (!p->cache.enabled || !visible || !p->isOnScreen || emptyFlashFlag)
+		return;
+
+	if (elements.getSize() == 0)
+		return;
+
+	p->renderCache();
+}
+
 void Viewport::onGeometryChange(const Geometry &geo)
 {
 	p->screenRect = geo.rect;
@@ -26,6 +26,9 @@
 #include "flashable.h"
 #include "disposable.h"
 #include "util.h"
+#include "object-pool.h"
+
+class Sprite;
 
 struct ViewportPrivate;
 
@@ -37,6 +40,8 @@ public:
 	Viewport();
 	~Viewport();
 
+	DECL_POOLED_NEW(Viewport)
+
 	void update();
 
 	DECL_ATTR( Rect,  Rect&  )
@@ -45,15 +50,27 @@ public:
 	DECL_ATTR( Color, Color& )
 	DECL_ATTR( Tone,  Tone&  )
 
+	/* Non-standard extension. Keeps the rendered children in a
+	 * buffer of their own, which is only redrawn after they
+	 * changed (or something global like a Bitmap did) */
+	DECL_ATTR( Cache, bool   )
+
 	void initDynAttribs();
 
+	/* Topmost sprite hit at screen pixel (x, y), if any
+	 * (see 'Sprite::hitTest()') */
+	Sprite *pick(int x, int y);
+
 private:
 	void initViewport(int x, int y, int width, int height);
 	void geometryChanged();
 
 	void composite();
+	void damage();
 	void draw();
+	void prerender();
 	void onGeometryChange(const Geometry &);
+	bool occludesScene();
 	bool isEffectiveViewport(Rect *&, Color *&, Tone *&) const;
 
 	void releaseResources();
@@ -33,8 +33,9 @@
 #include "quadarray.h"
 #include "texpool.h"
 #include "glstate.h"
+#include "preparable.h"
 
-#include "sigslot/signal.hpp"
+#include <algorithm>
 
 template<typename T>
 struct Sides
@@ -118,6 +119,8 @@ static const uint8_t pauseAniAlpha[] =
 
 static elementsN(pauseAniAlpha);
 
+static elementsN(pauseAniSrc);
+
 /* Points to an array of quads which it doesn't own.
  * Useful for setting alpha of quads stored inside
  * bigger arrays */
@@ -137,6 +140,60 @@ struct QuadChunk
 	}
 };
 
+/* Appends the axis aligned quad at 'vert', moved by 'offset'
+ * and cut down to 'clip' in place of the scissor box, to the
+ * quads of a scene batch */
+static void appendBatchQuad(std::vector<BatchQuad> &quads, const Vertex *vert,
+                            const Vec2i &offset, const IntRect &clip,
+                            const TEXFBO &tex, float opacity, bool smooth)
+{
+	/* Top left and bottom right corner (see Quad::setPosRect) */
+	const Vec2 &p0 = vert[0].pos;
+	const Vec2 &p1 = vert[2].pos;
+	const Vec2 &t0 = vert[0].texPos;
+	const Vec2 &t1 = vert[2].texPos;
+
+	const float x0 = p0.x + offset.x;
+	const float y0 = p0.y + offset.y;
+	const float x1 = p1.x + offset.x;
+	const float y1 = p1.y + offset.y;
+
+	const float cx0 = std::max<float>(x0, clip.x);
+	const float cy0 = std::max<float>(y0, clip.y);
+	const float cx1 = std::min<float>(x1, clip.x + clip.w);
+	const float cy1 = std::min<float>(y1, clip.y + clip.h);
+
+	if (cx0 >= cx1 || cy0 >= cy1)
+		return;
+
+	/* Texture coordinates follow the cut linearly */
+	const float sx = (t1.x - t0.x) / (x1 - x0);
+	const float sy = (t1.y - t0.y) / (y1 - y0);
+
+	const FloatRect pos(cx0, cy0, cx1 - cx0, cy1 - cy0);
+	const FloatRect texPos(t0.x + (cx0 - x0) * sx, t0.y + (cy0 - y0) * sy,
+	                       (cx1 - cx0) * sx, (cy1 - cy0) * sy);
+
+	BatchQuad quad;
+	quad.tex = &tex;
+	quad.blendType = BlendNormal;
+	quad.opacity = opacity;
+	quad.smooth = smooth;
+	quad.opaque = false;
+
+	quad.pos[0] = pos.topLeft();
+	quad.pos[1] = pos.topRight();
+	quad.pos[2] = pos.bottomRight();
+	quad.pos[3] = pos.bottomLeft();
+
+	quad.texPos[0] = texPos.topLeft();
+	quad.texPos[1] = texPos.topRight();
+	quad.texPos[2] = texPos.bottomRight();
+	quad.texPos[3] = texPos.bottomLeft();
+
+	quads.push_back(quad);
+}
+
 /* Vocabulary:
  *
  * Base: 'Base' layer of window; includes background and borders.
@@ -164,9 +221,13 @@ struct QuadChunk
  * BaseTex: If the window has an opacity <255, we have to prerender
  *   the base to a texture and draw that. Otherwise, we can draw the
  *   quad array directly to the screen.
+ *
+ * Both layers can also hand their quads to the scene batch, so the
+ * bases (and controls) of a stack of windows with the same skin
+ * are drawn together. Clipping is then done on the quads.
  */
 
-struct WindowPrivate
+struct WindowPrivate : public Preparable
 {
 	Bitmap *windowskin;
 
@@ -177,7 +238,7 @@ struct WindowPrivate
 	bool active;
 	bool pause;
 
-	sigslot::connection cursorRectCon;
+	GenerationWatch cursorRectWatch;
 
 	Vec2i sceneOffset;
 
@@ -220,6 +281,11 @@ struct WindowPrivate
 			p->drawControls();
 		}
 
+		bool getBatchQuads(std::vector<BatchQuad> &quads)
+		{
+			return p->getControlsBatchQuads(quads);
+		}
+
 		void release()
 		{
 			unlink();
@@ -230,24 +296,35 @@ struct WindowPrivate
 
 	WindowControls controlsElement;
 
+	/* Holds the cursor frame, then the scroll arrows, then all
+	 * pause animation frames. The animations only pick which
+	 * quads to draw and with what alpha (a shader uniform), so
+	 * they don't touch the array. The cursor is built at the
+	 * origin and moved into place by translation, so moving it
+	 * doesn't either; only resizing it does */
 	ColorQuadArray controlsQuadArray;
-	int controlsQuadCount;
+	int cursorQuadCount;
+	int arrowQuadCount;
+	int pauseQuadOffset;
 
-	Quad contentsQuad;
+	/* Cursor size the array was built for */
+	Vec2i cursorBuiltSize;
 
-	QuadChunk pauseAniVert;
-	QuadChunk cursorVert;
+	Quad contentsQuad;
 
 	uint8_t cursorAniAlphaIdx;
 	uint8_t pauseAniAlphaIdx;
 	uint8_t pauseAniQuadIdx;
 
+	/* Animation state as of the last update */
+	float cursorAlpha;
+	float pauseAlpha;
+	int pauseFrame;
+
 	bool controlsVertDirty;
 
 	EtcTemps tmp;
 
-	sigslot::connection prepareCon;
-
 	WindowPrivate(Viewport *viewport = 0)
 	    : windowskin(0),
 	      contents(0),
@@ -262,39 +339,35 @@ struct WindowPrivate
 	      opacityDirty(true),
 	      baseTexDirty(true),
 	      controlsElement(this, viewport),
+	      cursorQuadCount(0),
+	      arrowQuadCount(0),
+	      pauseQuadOffset(0),
 	      cursorAniAlphaIdx(0),
 	      pauseAniAlphaIdx(0),
 	      pauseAniQuadIdx(0),
+	      cursorAlpha(1),
+	      pauseAlpha(0),
+	      pauseFrame(0),
 	      controlsVertDirty(true)
 	{
-		refreshCursorRectCon();
+		controlsQuadArray.resize(9 + 4 + pauseAniSrcN);
 
-		controlsQuadArray.resize(14);
-		cursorVert.count = 9;
-		pauseAniVert.count = 1;
-
-		prepareCon = shState->prepareDraw.connect
-		        (&WindowPrivate::prepare, this);
+		requestPrepare();
 	}
 
 	~WindowPrivate()
 	{
-		shState->texPool().release(baseTex);
-		cursorRectCon.disconnect();
-		prepareCon.disconnect();
+		shState->texPool().release(baseTex, TexPool::Intermediates);
 	}
 
-	void markControlVertDirty()
+	/* Scripts commonly set the cursor rect every frame; only
+	 * a new size needs the quads rebuilt */
+	void onCursorRectChange()
 	{
-		controlsVertDirty = true;
+		if (Vec2i(cursorRect->width, cursorRect->height) != cursorBuiltSize)
+			controlsVertDirty = true;
 	}
 
-	void refreshCursorRectCon()
-	{
-		cursorRectCon.disconnect();
-		cursorRectCon = cursorRect->valueChanged.connect
-		        (&WindowPrivate::markControlVertDirty, this);
-	}
 
 	void buildBaseVert()
 	{
@@ -407,8 +480,8 @@ struct WindowPrivate
 		if (!resizeNeeded)
 			return;
 
-		shState->texPool().release(baseTex);
-		baseTex = shState->texPool().request(newW, newH);
+		shState->texPool().release(baseTex, TexPool::Intermediates);
+		baseTex = shState->texPool().request(newW, newH, TexPool::Intermediates);
 
 		baseTexDirty = true;
 	}
@@ -460,17 +533,18 @@ struct WindowPrivate
 		int i = 0;
 		Vertex *vert = controlsQuadArray.vertices.data();
 
-		/* Cursor */
+		cursorBuiltSize = Vec2i(cursorRect->width, cursorRect->height);
+
+		/* Cursor, relative to its own position */
 		if (!cursorRect->isEmpty())
 		{
-			/* Effective cursor rect has 16 xy offset to window */
-			IntRect effectRect(cursorRect->x+16, cursorRect->y+16,
-			                   cursorRect->width, cursorRect->height);
-			cursorVert.vert = &vert[i*4];
-			TileQuads::buildFrameSource(cursorSrc, cursorVert.vert);
-			i += TileQuads::buildFrame(effectRect, cursorVert.vert);
+			IntRect frameRect(0, 0, cursorRect->width, cursorRect->height);
+			TileQuads::buildFrameSource(cursorSrc, &vert[i*4]);
+			i += TileQuads::buildFrame(frameRect, &vert[i*4]);
 		}
 
+		cursorQuadCount = i;
+
 		/* Scroll arrow position: Top Bottom X, Left Right Y */
 		const Vec2i scroll = (size - Vec2i(16)) / 2;
 
@@ -496,22 +570,27 @@ struct WindowPrivate
 				i += Quad::setTexPosRect(&vert[i*4], scrollArrowSrc.b, scrollArrows.b);
 		}
 
-		/* Pause animation */
-		if (pause)
-		{
-			pauseAniVert.vert = &vert[i*4];
-			i += Quad::setTexPosRect(&vert[i*4], pauseAniSrc[pauseAniQuad[pauseAniQuadIdx]],
+		arrowQuadCount = i - cursorQuadCount;
+
+		/* Pause animation, one quad per frame */
+		pauseQuadOffset = i;
+
+		for (size_t j = 0; j < pauseAniSrcN; ++j)
+			i += Quad::setTexPosRect(&vert[i*4], pauseAniSrc[j],
 			                         FloatRect((size.x - 16) / 2, size.y - 16, 16, 16));
-		}
 
 		controlsQuadArray.commit();
-		controlsQuadCount = i;
 	}
 
-	void prepare()
+	/* Stays enrolled; the base texture follows the
+	 * windowskin, which can change under us */
+	bool prepare()
 	{
+		if (cursorRectWatch.poll(cursorRect->generation))
+			onCursorRectChange();
+
 		if (size.x <= 0 || size.y <= 0)
-			return;
+			return true;
 
 		bool updateBaseQuadArray = false;
 
@@ -546,6 +625,8 @@ struct WindowPrivate
 				baseTexDirty = false;
 			}
 		}
+
+		return true;
 	}
 
 	void drawBase()
@@ -579,6 +660,46 @@ struct WindowPrivate
 		}
 	}
 
+	bool getBaseBatchQuads(std::vector<BatchQuad> &quads)
+	{
+		if (nullOrDisposed(windowskin))
+			return true;
+
+		if (size == Vec2i(0, 0))
+			return true;
+
+		const Vec2i efPos = position + sceneOffset;
+		const IntRect windowRect(efPos, size);
+
+		if (useBaseTex)
+		{
+			appendBatchQuad(quads, baseTexQuad.vert, efPos, windowRect,
+			                baseTex, opacity.norm, false);
+
+			return true;
+		}
+
+		const TEXFBO &skin = windowskin->getDrawTex();
+		const Vertex *vert = baseQuadArray.vertices.data();
+
+		/* The background's back opacity is in its vertex colors */
+		for (size_t i = 0; i < baseQuadArray.count(); ++i)
+			appendBatchQuad(quads, &vert[i*4], efPos, windowRect,
+			                skin, vert[i*4].color.w, true);
+
+		return true;
+	}
+
+	void ensureControlsVert()
+	{
+		if (!controlsVertDirty)
+			return;
+
+		buildControlsVert();
+		updateControls();
+		controlsVertDirty = false;
+	}
+
 	void drawControls()
 	{
 		if (nullOrDisposed(windowskin) && nullOrDisposed(contents))
@@ -587,12 +708,7 @@ struct WindowPrivate
 		if (size == Vec2i(0, 0))
 			return;
 
-		if (controlsVertDirty)
-		{
-			buildControlsVert();
-			updateControls();
-			controlsVertDirty = false;
-		}
+		ensureControlsVert();
 
 		/* Effective on screen coordinates */
 		const Vec2i efPos = position + sceneOffset;
@@ -604,19 +720,37 @@ struct WindowPrivate
 		glState.scissorBox.push();
 		glState.scissorBox.setIntersect(windowRect);
 
-		SimpleAlphaShader &shader = shState->shaders().simpleAlpha;
+		SimpleAlphaUniShader &shader = shState->shaders().simpleAlphaUni;
 		shader.bind();
 		shader.applyViewportProj();
 
 		if (!nullOrDisposed(windowskin))
 		{
-			shader.setTranslation(efPos);
-
 			/* Draw arrows / cursors */
 			windowskin->bindTex(shader);
 			TEX::setSmooth(true);
 
-			controlsQuadArray.draw(0, controlsQuadCount);
+			if (cursorQuadCount > 0)
+			{
+				/* Effective cursor rect has 16 xy offset to window */
+				shader.setTranslation(efPos + Vec2i(cursorRect->x + 16, cursorRect->y + 16));
+				shader.setAlpha(cursorAlpha);
+				controlsQuadArray.draw(0, cursorQuadCount);
+			}
+
+			shader.setTranslation(efPos);
+
+			if (arrowQuadCount > 0)
+			{
+				shader.setAlpha(1);
+				controlsQuadArray.draw(cursorQuadCount, arrowQuadCount);
+			}
+
+			if (pause)
+			{
+				shader.setAlpha(pauseAlpha);
+				controlsQuadArray.draw(pauseQuadOffset + pauseFrame, 1);
+			}
 
 			TEX::setSmooth(false);
 		}
@@ -629,6 +763,7 @@ struct WindowPrivate
 			shader.setTranslation(efPos + (Vec2i(16) - contentsOffset));
 
 			contents->bindTex(shader);
+			shader.setAlpha(contentsOpacity.norm);
 			contentsQuad.draw();
 		}
 
@@ -636,32 +771,69 @@ struct WindowPrivate
 		glState.scissorTest.pop();
 	}
 
-	void updateControls()
+	/* Same order as 'drawControls()' */
+	bool getControlsBatchQuads(std::vector<BatchQuad> &quads)
 	{
-		bool updateArray = false;
+		if (nullOrDisposed(windowskin) && nullOrDisposed(contents))
+			return true;
+
+		if (size == Vec2i(0, 0))
+			return true;
+
+		ensureControlsVert();
+
+		const Vec2i efPos = position + sceneOffset;
+
+		const IntRect windowRect(efPos, size);
+		const IntRect contentsRect(efPos + Vec2i(16), size - Vec2i(32));
 
-		if (active && cursorVert.vert)
+		if (!nullOrDisposed(windowskin))
 		{
-			float alpha = cursorAniAlpha[cursorAniAlphaIdx] / 255.0f;
+			const TEXFBO &skin = windowskin->getDrawTex();
+			const Vertex *vert = controlsQuadArray.vertices.data();
+
+			const Vec2i cursorPos = efPos + Vec2i(cursorRect->x + 16, cursorRect->y + 16);
 
-			cursorVert.setAlpha(alpha);
+			for (int i = 0; i < cursorQuadCount; ++i)
+				appendBatchQuad(quads, &vert[i*4], cursorPos, windowRect,
+				                skin, cursorAlpha, true);
 
-			updateArray = true;
+			for (int i = cursorQuadCount; i < cursorQuadCount + arrowQuadCount; ++i)
+				appendBatchQuad(quads, &vert[i*4], efPos, windowRect,
+				                skin, 1, true);
+
+			if (pause)
+				appendBatchQuad(quads, &vert[(pauseQuadOffset + pauseFrame)*4], efPos,
+				                windowRect, skin, pauseAlpha, true);
 		}
 
-		if (pause && pauseAniVert.vert)
-		{
-			float alpha = pauseAniAlpha[pauseAniAlphaIdx] / 255.0f;
-			FloatRect frameRect = pauseAniSrc[pauseAniQuad[pauseAniQuadIdx]];
+		if (!nullOrDisposed(contents))
+			appendBatchQuad(quads, contentsQuad.vert, efPos + (Vec2i(16) - contentsOffset),
+			                contentsRect, contents->getDrawTex(),
+			                contentsOpacity.norm, false);
+
+		return true;
+	}
 
-			pauseAniVert.setAlpha(alpha);
-			Quad::setTexRect(pauseAniVert.vert, frameRect);
+	/* Returns true if any animated control was touched */
+	bool updateControls()
+	{
+		bool touched = false;
 
-			updateArray = true;
+		if (active && !cursorRect->isEmpty())
+		{
+			cursorAlpha = cursorAniAlpha[cursorAniAlphaIdx] / 255.0f;
+			touched = true;
 		}
 
-		if (updateArray)
-			controlsQuadArray.commit();
+		if (pause)
+		{
+			pauseAlpha = pauseAniAlpha[pauseAniAlphaIdx] / 255.0f;
+			pauseFrame = pauseAniQuad[pauseAniQuadIdx];
+			touched = true;
+		}
+
+		return touched;
 	}
 
 	void stepAnimations()
@@ -693,13 +865,15 @@ void Window::update()
 {
 	guardDisposed();
 
-	p->updateControls();
+	if (p->updateControls())
+		damage();
+
 	p->stepAnimations();
 }
 
-DEF_ATTR_SIMPLE(Window, X,          int,     p->position.x)
-DEF_ATTR_SIMPLE(Window, Y,          int,     p->position.y)
-DEF_ATTR_SIMPLE(Window, CursorRect, Rect&,  *p->cursorRect)
+DEF_ATTR_SIMPLE_DAMAGE(Window, X,          int,     p->position.x)
+DEF_ATTR_SIMPLE_DAMAGE(Window, Y,          int,     p->position.y)
+DEF_ATTR_SIMPLE_DAMAGE(Window, CursorRect, Rect&,  *p->cursorRect)
 
 DEF_ATTR_RD_SIMPLE(Window, Windowskin,      Bitmap*, p->windowskin)
 DEF_ATTR_RD_SIMPLE(Window, Contents,        Bitmap*, p->contents)
@@ -717,6 +891,7 @@ DEF_ATTR_RD_SIMPLE(Window, ContentsOpacity, int,     p->contentsOpacity)
 void Window::setWindowskin(Bitmap *value)
 {
 	guardDisposed();
+	damage();
 
 	p->windowskin = value;
 
@@ -733,6 +908,8 @@ void Window::setContents(Bitmap *value)
 	if (p->contents == value)
 		return;
 
+	damage();
+
 	p->contents = value;
 	p->controlsVertDirty = true;
 
@@ -750,6 +927,8 @@ void Window::setStretch(bool value)
 	if (value == p->bgStretch)
 		return;
 
+	damage();
+
 	p->bgStretch = value;
 	p->baseVertDirty = true;
 }
@@ -761,6 +940,8 @@ void Window::setActive(bool value)
 	if (p->active == value)
 		return;
 
+	damage();
+
 	p->active = value;
 	p->cursorAniAlphaIdx = 0;
 }
@@ -772,10 +953,12 @@ void Window::setPause(bool value)
 	if (p->pause == value)
 		return;
 
+	damage();
+
 	p->pause = value;
 	p->pauseAniAlphaIdx = 0;
 	p->pauseAniQuadIdx = 0;
-	p->controlsVertDirty = true;
+	p->updateControls();
 }
 
 void Window::setWidth(int value)
@@ -785,8 +968,11 @@ void Window::setWidth(int value)
 	if (p->size.x == value)
 		return;
 
+	damage();
+
 	p->size.x = value;
 	p->baseVertDirty = true;
+	p->controlsVertDirty = true;
 }
 
 void Window::setHeight(int value)
@@ -796,8 +982,11 @@ void Window::setHeight(int value)
 	if (p->size.y == value)
 		return;
 
+	damage();
+
 	p->size.y = value;
 	p->baseVertDirty = true;
+	p->controlsVertDirty = true;
 }
 
 void Window::setOX(int value)
@@ -807,6 +996,8 @@ void Window::setOX(int value)
 	if (p->contentsOffset.x == value)
 		return;
 
+	damage();
+
 	p->contentsOffset.x = value;
 	p->controlsVertDirty = true;
 }
@@ -818,6 +1009,8 @@ void Window::setOY(int value)
 	if (p->contentsOffset.y == value)
 		return;
 
+	damage();
+
 	p->contentsOffset.y = value;
 	p->controlsVertDirty = true;
 }
@@ -829,8 +1022,13 @@ void Window::setOpacity(int value)
 	if (p->opacity == value)
 		return;
 
+	damage();
+
 	p->opacity = value;
-	p->opacityDirty = true;
+
+	/* Only applied when drawing the base texture,
+	 * its contents stay valid */
+	p->baseTexQuad.setColor(Vec4(1, 1, 1, p->opacity.norm));
 }
 
 void Window::setBackOpacity(int value)
@@ -840,6 +1038,8 @@ void Window::setBackOpacity(int value)
 	if (p->backOpacity == value)
 		return;
 
+	damage();
+
 	p->backOpacity = value;
 	p->opacityDirty = true;
 }
@@ -851,6 +1051,8 @@ void Window::setContentsOpacity(int value)
 	if (p->contentsOpacity == value)
 		return;
 
+	damage();
+
 	p->contentsOpacity = value;
 	p->contentsQuad.setColor(Vec4(1, 1, 1, p->contentsOpacity.norm));
 }
@@ -859,7 +1061,7 @@ void Window::initDynAttribs()
 {
 	p->cursorRect = new Rect;
 
-	p->refreshCursorRectCon();
+	p->cursorRectWatch.reset();
 }
 
 void Window::draw()
@@ -867,6 +1069,11 @@ void Window::draw()
 	p->drawBase();
 }
 
+bool Window::getBatchQuads(std::vector<BatchQuad> &quads)
+{
+	return p->getBaseBatchQuads(quads);
+}
+
 void Window::onGeometryChange(const Scene::Geometry &geo)
 {
 	p->sceneOffset = geo.offset();
@@ -31,10 +31,10 @@
 #include "tilequad.h"
 #include "glstate.h"
 #include "shader.h"
+#include "preparable.h"
 
 #include <limits>
 #include <algorithm>
-#include "sigslot/signal.hpp"
 
 #define DEF_Z         (rgssVer >= 3 ? 100 :   0)
 #define DEF_PADDING   (rgssVer >= 3 ?  12 :  16)
@@ -148,7 +148,7 @@ static const uint8_t pauseQuad[] =
 
 static elementsN(pauseQuad);
 
-struct WindowVXPrivate
+struct WindowVXPrivate : public Preparable
 {
 	Bitmap *windowskin;
 
@@ -179,9 +179,7 @@ struct WindowVXPrivate
 	NormValue openness;
 	Tone *tone;
 
-	sigslot::connection cursorRectCon;
-	sigslot::connection toneCon;
-	sigslot::connection prepareCon;
+	GenerationWatch cursorRectWatch;
 
 	EtcTemps tmp;
 
@@ -263,21 +261,14 @@ struct WindowVXPrivate
 			ctrlVertDirty = true;
 		}
 
-		prepareCon = shState->prepareDraw.connect
-			(&WindowVXPrivate::prepare, this);
+		requestPrepare();
 
-		refreshCursorRectCon();
-		refreshToneCon();
 		updateBaseQuad();
 	}
 
 	~WindowVXPrivate()
 	{
-		shState->texPool().release(base.tex);
-
-		cursorRectCon.disconnect();
-		toneCon.disconnect();
-		prepareCon.disconnect();
+		shState->texPool().release(base.tex, TexPool::Intermediates);
 	}
 
 	void invalidateCursorVert()
@@ -290,23 +281,30 @@ struct WindowVXPrivate
 		base.texDirty = true;
 	}
 
-	void refreshCursorRectCon()
+	/* Picks up cursor_rect writes made since the last call */
+	void syncWatched()
 	{
-		cursorRectCon.disconnect();
-		cursorRectCon = cursorRect->valueChanged.connect
-		        (&WindowVXPrivate::invalidateCursorVert, this);
+		if (cursorRectWatch.poll(cursorRect->generation))
+			invalidateCursorVert();
 	}
 
-	void refreshToneCon()
+	/* The base texture holds the stretched layer, the tiled layer
+	 * and the frame side by side, along the window's shorter side.
+	 * The one pixel gaps keep filtering from bleeding across */
+	Vec2i baseLayerStep() const
 	{
-		toneCon.disconnect();
-		toneCon = tone->valueChanged.connect
-			(&WindowVXPrivate::invalidateBaseTex, this);
+		if (geo.w <= geo.h)
+			return Vec2i(geo.w + 1, 0);
+
+		return Vec2i(0, geo.h + 1);
 	}
 
 	void updateBaseTexSize()
 	{
-		if (base.tex.width >= geo.w && base.tex.height >= geo.h)
+		const Vec2i step = baseLayerStep();
+		const Vec2i size(geo.w + step.x*2, geo.h + step.y*2);
+
+		if (base.tex.width >= size.x && base.tex.height >= size.y)
 			return;
 
 		if (base.tex.tex != TEX::ID(0))
@@ -315,13 +313,13 @@ struct WindowVXPrivate
 			TEX::setSmooth(false); // XXX make pool set this up at alloc time
 		}
 
-		shState->texPool().release(base.tex);
+		shState->texPool().release(base.tex, TexPool::Intermediates);
 		TEXFBO::clear(base.tex);
 
 		if (geo.w == 0 || geo.h == 0)
 			return;
 
-		base.tex = shState->texPool().request(geo.w, geo.h);
+		base.tex = shState->texPool().request(size.x, size.y, TexPool::Intermediates);
 		TEX::bind(base.tex.tex);
 		TEX::setSmooth(true);
 	}
@@ -423,62 +421,93 @@ struct WindowVXPrivate
 		glState.viewport.pushSet(IntRect(0, 0, base.tex.width, base.tex.height));
 		glState.blend.pushSet(false);
 
-		ShaderBase *shader;
-
-		if (backOpacity < 255 || tone->hasEffect())
-		{
-			PlaneShader &planeShader = shState->shaders().plane;
-			planeShader.bind();
-
-			planeShader.setColor(Vec4());
-			planeShader.setFlash(Vec4());
-			planeShader.setTone(tone->norm);
-			planeShader.setOpacity(backOpacity.norm);
-
-			shader = &planeShader;
-		}
-		else
-		{
-			shader = &shState->shaders().simple;
-			shader->bind();
-		}
+		/* Layers are stored untoned at full opacity, windowBase composes
+		 * them at draw time, so tone and back_opacity changes don't
+		 * land here */
+		SimpleShader &shader = shState->shaders().simple;
+		shader.bind();
+		shader.applyViewportProj();
 
-		windowskin->bindTex(*shader);
+		windowskin->bindTex(shader);
 		TEX::setSmooth(true);
 
-		shader->setTranslation(Vec2i());
-		shader->applyViewportProj();
+		const Vec2i step = baseLayerStep();
 
 		/* Draw stretched layer */
+		shader.setTranslation(Vec2i());
 		base.vert.draw(0, 1);
 
-		glState.blend.set(true);
-		glState.blendMode.pushSet(BlendKeepDestAlpha);
-
 		/* Draw tiled layer */
+		shader.setTranslation(step);
 		base.vert.draw(1, base.bgTileQuads);
 
-		glState.blendMode.set(BlendNormal);
-
-		/* If we used plane shader before, switch to simple */
-		if (shader != &shState->shaders().simple)
-		{
-			shader = &shState->shaders().simple;
-			shader->bind();
-			shader->setTranslation(Vec2i());
-			shader->applyViewportProj();
-			windowskin->bindTex(*shader);
-		}
-
+		/* Draw frame */
+		shader.setTranslation(step * 2);
 		base.vert.draw(1+base.bgTileQuads, base.borderQuads);
 
 		TEX::setSmooth(false);
 
-		glState.blendMode.pop();
 		glState.blend.pop();
 		glState.viewport.pop();
 	}
 
+	/* Without translucency or the open/close squash, the base is
+	 * drawn straight from the windowskin, so resizing the window
+	 * only rebuilds vertices */
+	bool baseDirect() const
+	{
+		return opacity == 255 && openness == 255 && geo.w > 0 && geo.h > 0;
+	}
+
+	void drawBaseDirect(const Vec2i &trans)
+	{
+		WindowBgShader &bgShader = shState->shaders().windowBg;
+		bgShader.bind();
+		bgShader.applyViewportProj();
+		bgShader.setTranslation(trans);
+		bgShader.setTone(tone->norm);
+		bgShader.setOpacity(backOpacity.norm);
+		bgShader.setTileSrc(bgTileSrc);
+		bgShader.setSkinSize(Vec2i(windowskin->width(), windowskin->height()));
+		bgShader.setBgOrigin(Vec2i(2, 2));
+
+		windowskin->bindTex(bgShader);
+		TEX::setSmooth(true);
+
+		/* The shader tiles the second layer itself, so only
+		 * the stretched quad is needed */
+		base.vert.draw(0, 1);
+
+		SimpleAlphaShader &shader = shState->shaders().simpleAlpha;
+		shader.bind();
+		shader.applyViewportProj();
+		shader.setTranslation(trans);
+		windowskin->bindTex(shader);
+
+		base.vert.draw(1+base.bgTileQuads, base.borderQuads);
+
+		TEX::setSmooth(false);
+	}
+
+	void drawBaseTex(const Vec2i &trans)
+	{
+		const Vec2i texSize(base.tex.width, base.tex.height);
+		const Vec2i step = baseLayerStep();
+
+		WindowBaseShader &baseShader = shState->shaders().windowBase;
+		baseShader.bind();
+		baseShader.applyViewportProj();
+		baseShader.setTranslation(trans);
+		baseShader.setTexSize(texSize);
+		baseShader.setTone(tone->norm);
+		baseShader.setBackOpacity(backOpacity.norm);
+		baseShader.setLayerStep(Vec2((float) step.x / texSize.x,
+		                             (float) step.y / texSize.y));
+
+		TEX::bind(base.tex.tex);
+		base.quad.draw();
+	}
+
 	void updateBaseQuad()
 	{
 		const FloatRect tex(0, 0, geo.w, geo.h);
@@ -667,8 +696,11 @@ struct WindowVXPrivate
 		}
 	}
 
-	void prepare()
+	/* Stays enrolled, like Window */
+	bool prepare()
 	{
+		syncWatched();
+
 		if (base.vertDirty)
 		{
 			rebuildBaseVert();
@@ -676,6 +708,18 @@ struct WindowVXPrivate
 			base.texDirty = true;
 		}
 
+		/* The base texture is only brought up to date
+		 * once it is needed again */
+		if (!baseDirect())
+			prepareBaseTex();
+
+		prepareControls();
+
+		return true;
+	}
+
+	void prepareBaseTex()
+	{
 		if (base.texSizeDirty)
 		{
 			updateBaseTexSize();
@@ -688,7 +732,10 @@ struct WindowVXPrivate
 			redrawBaseTex();
 			base.texDirty = false;
 		}
+	}
 
+	void prepareControls()
+	{
 		if (clipRectDirty)
 		{
 			updateClipRect();
@@ -724,7 +771,9 @@ struct WindowVXPrivate
 
 	void draw()
 	{
-		if (base.tex.tex == TEX::ID(0))
+		const bool direct = baseDirect();
+
+		if (!direct && base.tex.tex == TEX::ID(0))
 			return;
 
 		bool windowskinValid = !nullOrDisposed(windowskin);
@@ -738,11 +787,19 @@ struct WindowVXPrivate
 
 		if (windowskinValid)
 		{
-			shader.setTranslation(trans);
-			shader.setTexSize(Vec2i(base.tex.width, base.tex.height));
+			if (direct)
+			{
+				drawBaseDirect(trans);
+			}
+			else
+			{
+				drawBaseTex(trans);
 
-			TEX::bind(base.tex.tex);
-			base.quad.draw();
+				shader.bind();
+				shader.applyViewportProj();
+			}
+
+			shader.setTranslation(trans);
 
 			if (openness < 255)
 				return;
@@ -837,6 +894,10 @@ void WindowVX::update()
 {
 	guardDisposed();
 
+	/* Blinking cursor or pause arrow */
+	if ((p->active && p->cursorVert.count() > 0) || (p->pause && p->pauseVert))
+		damage();
+
 	p->stepAnimations();
 
 	p->updatePauseQuad();
@@ -846,6 +907,7 @@ void WindowVX::update()
 void WindowVX::move(int x, int y, int width, int height)
 {
 	guardDisposed();
+	damage();
 
 	p->width = width;
 	p->height = height;
@@ -878,10 +940,10 @@ bool WindowVX::isClosed() const
 	return p->openness == 0;
 }
 
-DEF_ATTR_SIMPLE(WindowVX, X,          int,     p->geo.x)
-DEF_ATTR_SIMPLE(WindowVX, Y,          int,     p->geo.y)
-DEF_ATTR_SIMPLE(WindowVX, CursorRect, Rect&,  *p->cursorRect)
-DEF_ATTR_SIMPLE(WindowVX, Tone,       Tone&,  *p->tone)
+DEF_ATTR_SIMPLE_DAMAGE(WindowVX, X,          int,     p->geo.x)
+DEF_ATTR_SIMPLE_DAMAGE(WindowVX, Y,          int,     p->geo.y)
+DEF_ATTR_SIMPLE_DAMAGE(WindowVX, CursorRect, Rect&,  *p->cursorRect)
+DEF_ATTR_SIMPLE_DAMAGE(WindowVX, Tone,       Tone&,  *p->tone)
 
 DEF_ATTR_RD_SIMPLE(WindowVX, Windowskin,      Bitmap*, p->windowskin)
 DEF_ATTR_RD_SIMPLE(WindowVX, Contents,        Bitmap*, p->contents)
@@ -906,6 +968,8 @@ void WindowVX::setWindowskin(Bitmap *value)
 	if (p->windowskin == value)
 		return;
 
+	damage();
+
 	p->windowskin = value;
 	p->base.texDirty = true;
 }
@@ -917,6 +981,8 @@ void WindowVX::setContents(Bitmap *value)
 	if (p->contents == value)
 		return;
 
+	damage();
+
 	p->contents = value;
 
 	if (nullOrDisposed(value))
@@ -934,6 +1000,8 @@ void WindowVX::setActive(bool value)
 	if (p->active == value)
 		return;
 
+	damage();
+
 	p->active = value;
 	p->cursorAlphaIdx = cursorAlphaResetIdx;
 	p->updateCursorAlpha();
@@ -946,6 +1014,8 @@ void WindowVX::setArrowsVisible(bool value)
 	if (p->arrowsVisible == value)
 		return;
 
+	damage();
+
 	p->arrowsVisible = value;
 	p->ctrlVertDirty = true;
 }
@@ -957,6 +1027,8 @@ void WindowVX::setPause(bool value)
 	if (p->pause == value)
 		return;
 
+	damage();
+
 	p->pause = value;
 	p->pauseAlphaIdx = 0;
 	p->pauseQuadIdx = 0;
@@ -970,6 +1042,8 @@ void WindowVX::setWidth(int value)
 	if (p->width == value)
 		return;
 
+	damage();
+
 	p->width = value;
 	p->geo.w = std::max(0, value);
 	p->base.vertDirty = true;
@@ -986,6 +1060,8 @@ void WindowVX::setHeight(int value)
 	if (p->height == value)
 		return;
 
+	damage();
+
 	p->height = value;
 	p->geo.h = std::max(0, value);
 	p->base.vertDirty = true;
@@ -1002,6 +1078,8 @@ void WindowVX::setOX(int value)
 	if (p->contentsOff.x == value)
 		return;
 
+	damage();
+
 	p->contentsOff.x = value;
 	p->ctrlVertDirty = true;
 }
@@ -1013,6 +1091,8 @@ void WindowVX::setOY(int value)
 	if (p->contentsOff.y == value)
 		return;
 
+	damage();
+
 	p->contentsOff.y = value;
 	p->ctrlVertDirty = true;
 }
@@ -1024,6 +1104,8 @@ void WindowVX::setPadding(int value)
 	if (p->padding == value)
 		return;
 
+	damage();
+
 	p->padding = value;
 	p->paddingBottom = value;
 	p->clipRectDirty = true;
@@ -1036,6 +1118,8 @@ void WindowVX::setPaddingBottom(int value)
 	if (p->paddingBottom == value)
 		return;
 
+	damage();
+
 	p->paddingBottom = value;
 	p->clipRectDirty = true;
 }
@@ -1047,6 +1131,8 @@ void WindowVX::setOpacity(int value)
 	if (p->opacity == value)
 		return;
 
+	damage();
+
 	p->opacity = value;
 	p->base.quad.setColor(Vec4(1, 1, 1, p->opacity.norm));
 }
@@ -1058,8 +1144,9 @@ void WindowVX::setBackOpacity(int value)
 	if (p->backOpacity == value)
 		return;
 
+	damage();
+
 	p->backOpacity = value;
-	p->base.texDirty = true;
 }
 
 void WindowVX::setContentsOpacity(int value)
@@ -1069,6 +1156,8 @@ void WindowVX::setContentsOpacity(int value)
 	if (p->contentsOpacity == value)
 		return;
 
+	damage();
+
 	p->contentsOpacity = value;
 	p->contentsQuad.setColor(Vec4(1, 1, 1, p->contentsOpacity.norm));
 }
@@ -1080,6 +1169,8 @@ void WindowVX::setOpenness(int value)
 	if (p->openness == value)
 		return;
 
+	damage();
+
 	p->openness = value;
 	p->updateBaseQuad();
 }
@@ -1087,13 +1178,10 @@ void WindowVX::setOpenness(int value)
 void WindowVX::initDynAttribs()
 {
 	p->cursorRect = new Rect;
-	p->refreshCursorRectCon();
+	p->cursorRectWatch.reset();
 
 	if (rgssVer >= 3)
-	{
 		p->tone = new Tone;
-		p->refreshToneCon();
-	}
 }
 
 void WindowVX::draw()
@@ -21,11 +21,108 @@
 
 #include "etc.h"
 
+#include "scene.h"
 #include "serial-util.h"
 #include "exception.h"
 
 #include <SDL_types.h>
 #include <SDL_pixels.h>
+#include <SDL_atomic.h>
+
+#include <new>
+
+/* Objects kept for reuse, per type */
+#define POOL_MAX 4096
+
+/* Scripts create and drop these by the thousands (eg. one Color
+ * per get_pixel call), so freed objects are kept on a freelist
+ * instead of going back to the heap every time */
+template<class T>
+struct EtcPool
+{
+	struct Node
+	{
+		Node *next;
+	};
+
+	static Node *head;
+	static size_t count;
+	static SDL_SpinLock lock;
+
+	static void *alloc(size_t size)
+	{
+		/* Can't reuse a slot for anything bigger */
+		if (size != sizeof(T))
+			return ::operator new(size);
+
+		SDL_AtomicLock(&lock);
+
+		Node *node = head;
+
+		if (node)
+		{
+			head = node->next;
+			--count;
+		}
+
+		SDL_AtomicUnlock(&lock);
+
+		if (node)
+			return node;
+
+		return ::operator new(size);
+	}
+
+	static void release(void *p, size_t size)
+	{
+		if (!p)
+			return;
+
+		if (size != sizeof(T))
+		{
+			::operator delete(p);
+			return;
+		}
+
+		SDL_AtomicLock(&lock);
+
+		if (count < POOL_MAX)
+		{
+			Node *node = static_cast<Node*>(p);
+			node->next = head;
+			head = node;
+			++count;
+			p = 0;
+		}
+
+		SDL_AtomicUnlock(&lock);
+
+		::operator delete(p);
+	}
+};
+
+template<class T>
+typename EtcPool<T>::Node *EtcPool<T>::head = 0;
+
+template<class T>
+size_t EtcPool<T>::count = 0;
+
+template<class T>
+SDL_SpinLock EtcPool<T>::lock = 0;
+
+#define DEF_POOLED(Klass) \
+	void *Klass::operator new(size_t size) \
+	{ \
+		return EtcPool<Klass>::alloc(size); \
+	} \
+	void Klass::operator delete(void *p, size_t size) \
+	{ \
+		EtcPool<Klass>::release(p, size); \
+	}
+
+DEF_POOLED(Color)
+DEF_POOLED(Tone)
+DEF_POOLED(Rect)
 
 Color::Color(double red, double green, double blue, double alpha)
 	: red(red), green(green), blue(blue), alpha(alpha)
@@ -60,6 +157,8 @@ const Color &Color::operator=(const Color &o)
 	alpha = o.alpha;
 	norm  = o.norm;
 
+	Scene::damageScreen();
+
 	return o;
 }
 
@@ -71,30 +170,35 @@ void Color::set(double red, double green, double blue, double alpha)
 	this->alpha = alpha;
 
 	updateInternal();
+	Scene::damageScreen();
 }
 
 void Color::setRed(double value)
 {
 	red = value;
 	norm.x = clamp<double>(value, 0, 255) / 255;
+	Scene::damageScreen();
 }
 
 void Color::setGreen(double value)
 {
 	green = value;
 	norm.y = clamp<double>(value, 0, 255) / 255;
+	Scene::damageScreen();
 }
 
 void Color::setBlue(double value)
 {
 	blue = value;
 	norm.z = clamp<double>(value, 0, 255) / 255;
+	Scene::damageScreen();
 }
 
 void Color::setAlpha(double value)
 {
 	alpha = value;
 	norm.w = clamp<double>(value, 0, 255) / 255;
+	Scene::damageScreen();
 }
 
 /* Serializable */
@@ -156,14 +260,14 @@ SDL_Color Color::toSDLColor() const
 
 
 Tone::Tone(double red, double green, double blue, double gray)
-	: red(red), green(green), blue(blue), gray(gray)
+	: red(red), green(green), blue(blue), gray(gray), generation(0)
 {
 	updateInternal();
 }
 
 Tone::Tone(const Tone &o)
     : red(o.red), green(o.green), blue(o.blue), gray(o.gray),
-      norm(o.norm)
+      norm(o.norm), generation(0)
 {}
 
 bool Tone::operator==(const Tone &o) const
@@ -182,7 +286,8 @@ void Tone::set(double red, double green, double blue, double gray)
 	this->gray  = gray;
 
 	updateInternal();
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 }
 
 const Tone& Tone::operator=(const Tone &o)
@@ -193,7 +298,8 @@ const Tone& Tone::operator=(const Tone &o)
 	gray  = o.gray;
 	norm  = o.norm;
 
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 
 	return o;
 }
@@ -203,7 +309,8 @@ void Tone::setRed(double value)
 	red = value;
 	norm.x = (float) clamp<double>(value, -255, 255) / 255;
 
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 }
 
 void Tone::setGreen(double value)
@@ -211,7 +318,8 @@ void Tone::setGreen(double value)
 	green = value;
 	norm.y = (float) clamp<double>(value, -255, 255) / 255;
 
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 }
 
 void Tone::setBlue(double value)
@@ -219,7 +327,8 @@ void Tone::setBlue(double value)
 	blue = value;
 	norm.z = (float) clamp<double>(value, -255, 255) / 255;
 
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 }
 
 void Tone::setGray(double value)
@@ -227,7 +336,8 @@ void Tone::setGray(double value)
 	gray = value;
 	norm.w = (float) clamp<double>(value, 0, 255) / 255;
 
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 }
 
 /* Serializable */
@@ -270,16 +380,16 @@ void Tone::updateInternal()
 
 
 Rect::Rect(int x, int y, int width, int height)
-    : x(x), y(y), width(width), height(height)
+    : x(x), y(y), width(width), height(height), generation(0)
 {}
 
 Rect::Rect(const Rect &o)
     : x(o.x), y(o.y),
-      width(o.width), height(o.height)
+      width(o.width), height(o.height), generation(0)
 {}
 
 Rect::Rect(const IntRect &r)
-    : x(r.x), y(r.y), width(r.w), height(r.h)
+    : x(r.x), y(r.y), width(r.w), height(r.h), generation(0)
 {}
 
 bool Rect::operator==(const Rect &o) const
@@ -296,6 +406,8 @@ void Rect::operator=(const IntRect &rect)
 	y = rect.y;
 	width = rect.w;
 	height = rect.h;
+	generation++;
+	Scene::damageScreen();
 }
 
 void Rect::set(int x, int y, int w, int h)
@@ -312,7 +424,8 @@ void Rect::set(int x, int y, int w, int h)
 	this->y = y;
 	width = w;
 	height = h;
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 }
 
 const Rect &Rect::operator=(const Rect &o)
@@ -322,7 +435,8 @@ const Rect &Rect::operator=(const Rect &o)
 	width  = o.width;
 	height = o.height;
 
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 
 	return o;
 }
@@ -333,7 +447,8 @@ void Rect::empty()
 		return;
 
 	x = y = width = height = 0;
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 }
 
 bool Rect::isEmpty() const
@@ -347,7 +462,8 @@ void Rect::setX(int value)
 		return;
 
 	x = value;
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 }
 
 void Rect::setY(int value)
@@ -356,7 +472,8 @@ void Rect::setY(int value)
 		return;
 
 	y = value;
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 }
 
 void Rect::setWidth(int value)
@@ -365,7 +482,8 @@ void Rect::setWidth(int value)
 		return;
 
 	width = value;
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 }
 
 void Rect::setHeight(int value)
@@ -374,7 +492,8 @@ void Rect::setHeight(int value)
 		return;
 
 	height = value;
-	valueChanged();
+	generation++;
+	Scene::damageScreen();
 }
 
 int Rect::serialSize() const
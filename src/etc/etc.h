@@ -22,15 +22,16 @@
 #ifndef ETC_H
 #define ETC_H
 
-#include "sigslot/signal.hpp"
-
 #include "serializable.h"
 #include "etc-internal.h"
 
+#include <stddef.h>
+
 struct SDL_Color;
 
 enum BlendType
 {
+	BlendPremultiplied = -2,
 	BlendKeepDestAlpha = -1,
 
 	BlendNormal = 0,
@@ -50,6 +51,10 @@ struct Color : public Serializable
 
 	virtual ~Color() {}
 
+	/* Allocated from a pool, see etc.cpp */
+	static void *operator new(size_t size);
+	static void operator delete(void *p, size_t size);
+
 	const Color &operator=(const Color &o);
 	void set(double red, double green, double blue, double alpha);
 
@@ -94,7 +99,7 @@ struct Color : public Serializable
 struct Tone : public Serializable
 {
 	Tone()
-	    : red(0), green(0), blue(0), gray(0)
+	    : red(0), green(0), blue(0), gray(0), generation(0)
 	{}
 
 	Tone(double red, double green, double blue, double gray = 0);
@@ -102,6 +107,10 @@ struct Tone : public Serializable
 
 	virtual ~Tone() {}
 
+	/* Allocated from a pool, see etc.cpp */
+	static void *operator new(size_t size);
+	static void operator delete(void *p, size_t size);
+
 	bool operator==(const Tone &o) const;
 
 	void set(double red, double green, double blue, double gray);
@@ -143,17 +152,22 @@ struct Tone : public Serializable
 	/* Normalized (-1.0 ~ 1.0) */
 	Vec4 norm;
 
-    sigslot::signal<> valueChanged;
+	/* See 'GenerationWatch' */
+	unsigned int generation;
 };
 
 struct Rect : public Serializable
 {
 	Rect()
-	    : x(0), y(0), width(0), height(0)
+	    : x(0), y(0), width(0), height(0), generation(0)
 	{}
 
 	virtual ~Rect() {}
 
+	/* Allocated from a pool, see etc.cpp */
+	static void *operator new(size_t size);
+	static void operator delete(void *p, size_t size);
+
 	Rect(int x, int y, int width, int height);
 	Rect(const Rect &o);
 	Rect(const IntRect &r);
@@ -197,7 +211,39 @@ struct Rect : public Serializable
 	int width;
 	int height;
 
-	sigslot::signal<> valueChanged;
+	/* See 'GenerationWatch' */
+	unsigned int generation;
+};
+
+/* Tone and Rect bump their 'generation' on every write. Drawables
+ * deriving state from one (eg. a sprite's quad from its src_rect)
+ * keep one of these and poll it where that state is used, instead
+ * of being called back on each write; scripts animating a rect
+ * field by field every frame then only cost the increments */
+struct GenerationWatch
+{
+	GenerationWatch()
+	    : seen(~0u)
+	{}
+
+	/* Returns true once after each change */
+	bool poll(unsigned int generation)
+	{
+		if (seen == generation)
+			return false;
+
+		seen = generation;
+		return true;
+	}
+
+	/* For when the watched object is replaced */
+	void reset()
+	{
+		seen = ~0u;
+	}
+
+private:
+	unsigned int seen;
 };
 
 /* For internal use.
@@ -0,0 +1,294 @@
+/*
+** pathfinder.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pathfinder.h"
+
+#include "table.h"
+
+#include <stdlib.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+/* Distance fields kept around, enough for a handful
+ * of targets (eg. the player and some events) */
+#define FIELDS_MAX 8
+
+static const int dirs[] = { 2, 4, 6, 8 };
+
+static inline int dirX(int dir)
+{
+	return (dir == 6) - (dir == 4);
+}
+
+static inline int dirY(int dir)
+{
+	return (dir == 2) - (dir == 8);
+}
+
+static inline int dirBit(int dir)
+{
+	return 1 << (dir / 2 - 1);
+}
+
+Pathfinder::Pathfinder(Table *grid)
+    : grid(grid),
+      mask(0xFFFF),
+      w(0), h(0),
+      searchId(0)
+{
+	gridCon = grid->modified.connect(&Pathfinder::invalidate, this);
+}
+
+Pathfinder::~Pathfinder()
+{
+	gridCon.disconnect();
+}
+
+void Pathfinder::setMask(int value)
+{
+	if (mask == value)
+		return;
+
+	mask = value;
+	invalidate();
+}
+
+void Pathfinder::invalidate()
+{
+	fields.clear();
+}
+
+void Pathfinder::updateSize()
+{
+	int nw = grid->xSize();
+	int nh = grid->ySize();
+
+	/* Without a layer there are no cells */
+	if (grid->zSize() < 1)
+		nw = nh = 0;
+
+	if (nw == w && nh == h)
+		return;
+
+	w = nw;
+	h = nh;
+
+	invalidate();
+
+	stamp.assign(w * h, 0);
+	cost.resize(w * h);
+	from.resize(w * h);
+	searchId = 0;
+}
+
+bool Pathfinder::canMove(int x, int y, int dir) const
+{
+	int nx = x + dirX(dir);
+	int ny = y + dirY(dir);
+
+	if (nx < 0 || nx >= w || ny < 0 || ny >= h)
+		return false;
+
+	uint16_t src = grid->at(x, y) & mask;
+	uint16_t dst = grid->at(nx, ny) & mask;
+
+	if (src & dirBit(dir))
+		return false;
+
+	return !(dst & (0xFFF0 | dirBit(10 - dir)));
+}
+
+bool Pathfinder::findPath(int sx, int sy, int tx, int ty,
+                          std::vector<uint8_t> &path, int maxNodes)
+{
+	updateSize();
+	path.clear();
+
+	if (sx < 0 || sx >= w || sy < 0 || sy >= h
+	||  tx < 0 || tx >= w || ty < 0 || ty >= h)
+		return false;
+
+	if (sx == tx && sy == ty)
+		return true;
+
+	if (++searchId == 0)
+	{
+		std::fill(stamp.begin(), stamp.end(), 0);
+		searchId = 1;
+	}
+
+	/* (estimated total cost, cell), cheapest first */
+	typedef std::pair<int, int> Node;
+	std::priority_queue<Node, std::vector<Node>, std::greater<Node> > open;
+
+	const int start = sy * w + sx;
+	const int target = ty * w + tx;
+
+	stamp[start] = searchId;
+	cost[start] = 0;
+	open.push(Node(abs(tx - sx) + abs(ty - sy), start));
+
+	int expanded = 0;
+
+	while (!open.empty())
+	{
+		Node node = open.top();
+		open.pop();
+
+		const int cell = node.second;
+		const int x = cell % w;
+		const int y = cell / w;
+
+		/* Stale entry, the cell was reached cheaper since */
+		if (node.first != cost[cell] + abs(tx - x) + abs(ty - y))
+			continue;
+
+		if (cell == target)
+			break;
+
+		if (maxNodes > 0 && ++expanded > maxNodes)
+			return false;
+
+		for (int i = 0; i < 4; ++i)
+		{
+			const int dir = dirs[i];
+
+			if (!canMove(x, y, dir))
+				continue;
+
+			const int nx = x + dirX(dir);
+			const int ny = y + dirY(dir);
+			const int next = ny * w + nx;
+			const int nextCost = cost[cell] + 1;
+
+			if (stamp[next] == searchId && cost[next] <= nextCost)
+				continue;
+
+			stamp[next] = searchId;
+			cost[next] = nextCost;
+			from[next] = dir;
+			open.push(Node(nextCost + abs(tx - nx) + abs(ty - ny), next));
+		}
+	}
+
+	if (stamp[target] != searchId)
+		return false;
+
+	for (int cell = target; cell != start;)
+	{
+		const int dir = from[cell];
+		path.push_back(dir);
+		cell -= dirY(dir) * w + dirX(dir);
+	}
+
+	std::reverse(path.begin(), path.end());
+
+	return true;
+}
+
+const std::vector<int32_t> &Pathfinder::distanceField(int tx, int ty)
+{
+	updateSize();
+
+	const bool inside = (tx >= 0 && tx < w && ty >= 0 && ty < h);
+	const int target = inside ? ty * w + tx : -1;
+
+	for (std::list<Field>::iterator iter = fields.begin(); iter != fields.end(); ++iter)
+	{
+		if (iter->target != target)
+			continue;
+
+		fields.splice(fields.begin(), fields, iter);
+
+		return fields.front().dist;
+	}
+
+	if (fields.size() >= FIELDS_MAX)
+		fields.pop_back();
+
+	fields.push_front(Field());
+	Field &field = fields.front();
+
+	field.target = target;
+	field.dist.assign(w * h, -1);
+
+	if (!inside)
+		return field.dist;
+
+	/* Breadth first from the target, following
+	 * the moves that lead back towards it */
+	std::vector<int> queue;
+	queue.reserve(w * h);
+	queue.push_back(target);
+	field.dist[target] = 0;
+
+	for (size_t i = 0; i < queue.size(); ++i)
+	{
+		const int cell = queue[i];
+		const int x = cell % w;
+		const int y = cell / w;
+
+		for (int j = 0; j < 4; ++j)
+		{
+			const int dir = dirs[j];
+			const int px = x + dirX(dir);
+			const int py = y + dirY(dir);
+
+			if (px < 0 || px >= w || py < 0 || py >= h)
+				continue;
+
+			const int prev = py * w + px;
+
+			if (field.dist[prev] >= 0 || !canMove(px, py, 10 - dir))
+				continue;
+
+			field.dist[prev] = field.dist[cell] + 1;
+			queue.push_back(prev);
+		}
+	}
+
+	return field.dist;
+}
+
+int Pathfinder::nextStep(int sx, int sy, int tx, int ty)
+{
+	const std::vector<int32_t> &dist = distanceField(tx, ty);
+
+	if (sx < 0 || sx >= w || sy < 0 || sy >= h)
+		return 0;
+
+	const int here = dist[sy * w + sx];
+
+	if (here <= 0)
+		return 0;
+
+	for (int i = 0; i < 4; ++i)
+	{
+		const int dir = dirs[i];
+
+		if (!canMove(sx, sy, dir))
+			continue;
+
+		if (dist[(sy + dirY(dir)) * w + sx + dirX(dir)] == here - 1)
+			return dir;
+	}
+
+	return 0;
+}
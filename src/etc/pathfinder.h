@@ -0,0 +1,97 @@
+/*
+** pathfinder.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PATHFINDER_H
+#define PATHFINDER_H
+
+#include "sigslot/signal.hpp"
+
+#include <stdint.h>
+#include <list>
+#include <vector>
+
+class Table;
+
+/* Four way path search over the first layer of a Table.
+ * Every cell holds a bitmask, masked with 'mask' before use:
+ * bits 0x01, 0x02, 0x04 and 0x08 block leaving or entering
+ * the cell downwards, left, right and up (as in RMXP passages),
+ * any higher bit blocks the cell completely.
+ * Directions are given in RMXP numpad notation (2, 4, 6, 8) */
+class Pathfinder
+{
+public:
+	Pathfinder(Table *grid);
+	~Pathfinder();
+
+	int getMask() const { return mask; }
+	void setMask(int value);
+
+	/* A* search. Writes the directions leading from (sx, sy)
+	 * to (tx, ty) into 'path' and returns true if there is
+	 * a path. 'maxNodes' caps the expanded cells, 0 means
+	 * no limit */
+	bool findPath(int sx, int sy, int tx, int ty,
+	              std::vector<uint8_t> &path, int maxNodes = 0);
+
+	/* Steps needed from every cell to reach (tx, ty), or -1
+	 * if it can't be reached. Recently used fields are kept
+	 * until the grid is modified */
+	const std::vector<int32_t> &distanceField(int tx, int ty);
+
+	/* First direction of a shortest path from (sx, sy) to
+	 * (tx, ty), looked up in the distance field of the target.
+	 * 0 if there is none or (sx, sy) is the target */
+	int nextStep(int sx, int sy, int tx, int ty);
+
+	/* Drops all cached distance fields */
+	void invalidate();
+
+	/* <internal */
+	int width() const { return w; }
+	int height() const { return h; }
+
+private:
+	bool canMove(int x, int y, int dir) const;
+	void updateSize();
+
+	Table *grid;
+	int mask;
+	int w, h;
+
+	struct Field
+	{
+		int target;
+		std::vector<int32_t> dist;
+	};
+
+	/* Most recently used first */
+	std::list<Field> fields;
+
+	/* A* scratch, reused between searches. Cells with
+	 * a stamp other than 'searchId' count as unvisited */
+	std::vector<uint32_t> stamp;
+	std::vector<int32_t> cost;
+	std::vector<uint8_t> from;
+	uint32_t searchId;
+
+	sigslot::connection gridCon;
+};
+
+#endif // PATHFINDER_H
@@ -53,8 +53,14 @@ void Table::set(int16_t value, int x, int y, int z)
 		return;
 	}
 
-	data[xs*ys*z + xs*y + x] = value;
+	int16_t &cell = data[xs*ys*z + xs*y + x];
 
+	if (cell == value)
+		return;
+
+	cell = value;
+
+	cellModified(x, y);
 	modified();
 }
 
@@ -89,6 +95,73 @@ void Table::resize(int x)
 	resize(x, ys, zs);
 }
 
+void Table::fill(int16_t value)
+{
+	std::fill(data.begin(), data.end(), value);
+
+	modified();
+}
+
+void Table::fill(int16_t value, int x, int y, int width, int height, int z)
+{
+	int x2 = std::min(x + width, xs);
+	int y2 = std::min(y + height, ys);
+	x = std::max(x, 0);
+	y = std::max(y, 0);
+
+	int z1 = (z < 0) ? 0 : z;
+	int z2 = (z < 0) ? zs : std::min(z + 1, zs);
+
+	if (x >= x2 || y >= y2 || z1 >= z2)
+		return;
+
+	for (int k = z1; k < z2; ++k)
+		for (int j = y; j < y2; ++j)
+			std::fill_n(&at(x, j, k), x2 - x, value);
+
+	modified();
+}
+
+void Table::copyRect(int dx, int dy, const Table &src,
+                     int sx, int sy, int width, int height)
+{
+	/* Clip against the source, then the destination */
+	if (sx < 0) { dx -= sx; width += sx; sx = 0; }
+	if (sy < 0) { dy -= sy; height += sy; sy = 0; }
+	if (dx < 0) { sx -= dx; width += dx; dx = 0; }
+	if (dy < 0) { sy -= dy; height += dy; dy = 0; }
+
+	width = std::min(width, std::min(src.xs - sx, xs - dx));
+	height = std::min(height, std::min(src.ys - sy, ys - dy));
+	int depth = std::min(zs, src.zs);
+
+	if (width <= 0 || height <= 0 || depth <= 0)
+		return;
+
+	/* Walk rows bottom up when copying downwards within
+	 * the same table, so no source row is overwritten
+	 * before it was read. memmove covers overlap inside rows */
+	bool backwards = (&src == this && dy > sy);
+
+	for (int k = 0; k < depth; ++k)
+		for (int n = 0; n < height; ++n)
+		{
+			int j = backwards ? height - 1 - n : n;
+
+			memmove(&at(dx, dy + j, k), &src.at(sx, sy + j, k),
+			        sizeof(int16_t) * width);
+		}
+
+	modified();
+}
+
+void Table::assignRaw(const void *src)
+{
+	memcpy(dataPtr(data), src, rawSize());
+
+	modified();
+}
+
 /* Serializable */
 int Table::serialSize() const
 {
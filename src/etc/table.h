@@ -47,6 +47,27 @@ public:
 	void resize(int x, int y);
 	void resize(int x);
 
+	/* Bulk operations. Rectangles are clipped to the table,
+	 * and only 'modified' is emitted, once per call */
+
+	/* Sets every cell to 'value' */
+	void fill(int16_t value);
+	/* Sets the cells inside the rectangle to 'value', on
+	 * layer 'z' only or on all of them if 'z' is negative */
+	void fill(int16_t value, int x, int y, int width, int height, int z = -1);
+
+	/* Copies a rectangle of 'src' (which may be this table)
+	 * to (dx, dy), on all layers that both tables have */
+	void copyRect(int dx, int dy, const Table &src,
+	              int sx, int sy, int width, int height);
+
+	/* Cells in native int16 layout, x varying fastest */
+	const int16_t *raw() const { return data.data(); }
+	size_t rawSize() const { return data.size() * sizeof(int16_t); }
+
+	/* Replaces all cells with 'rawSize()' bytes from 'src' */
+	void assignRaw(const void *src);
+
 	int serialSize() const;
 	void serialize(char *buffer) const;
 	static Table *deserialize(const char *data, int len);
@@ -64,6 +85,10 @@ public:
 
     sigslot::signal<> modified;
 
+	/* Emitted by set() with the changed cell's x and y,
+	 * right before 'modified' */
+	sigslot::signal<int, int> cellModified;
+
 private:
 	int xs, ys, zs;
 	std::vector<int16_t> data;
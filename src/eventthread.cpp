@@ -47,6 +47,7 @@
 
 #include "al-util.h"
 #include "debugwriter.h"
+#include "trace.h"
 
 #ifndef __APPLE__
 #include "util/string-util.h"
@@ -83,10 +84,6 @@ initALCFunctions(ALCdevice *alcDev)
 
 #define HAVE_ALC_DEVICE_PAUSE alc.DevicePause
 
-uint8_t EventThread::keyStates[];
-EventThread::ControllerState EventThread::controllerState;
-EventThread::MouseState EventThread::mouseState;
-EventThread::TouchState EventThread::touchState;
 SDL_atomic_t EventThread::verticalScrollDistance;
 
 /* User event codes */
@@ -112,6 +109,9 @@ enum
 
 static uint32_t usrIdStart;
 
+/* Button events kept when the scripts don't fetch them */
+#define BUTTON_EVENTS_MAX 256
+
 bool EventThread::allocUserEvents()
 {
     usrIdStart = SDL_RegisterEvents(EVENT_COUNT);
@@ -128,15 +128,23 @@ fullscreen(false),
 showCursor(true)
 {
     textInputLock = SDL_CreateMutex();
+    buttonEventsLock = SDL_CreateMutex();
+    
+    memset(&input, 0, sizeof(input));
+    memset(published, 0, sizeof(published));
+    SDL_AtomicSet(&inputSeq, 0);
 }
 
 EventThread::~EventThread()
 {
     SDL_DestroyMutex(textInputLock);
+    SDL_DestroyMutex(buttonEventsLock);
 }
 
 void EventThread::process(RGSSThreadData &rtData)
 {
+    TRACE_THREAD("Event");
+    
     SDL_Event event;
     SDL_Window *win = rtData.window;
     UnidirMessage<Vec2i> &windowSizeMsg = rtData.windowSizeMsg;
@@ -163,6 +171,7 @@ void EventThread::process(RGSSThreadData &rtData)
     
     /* SDL doesn't send an initial FOCUS_GAINED event */
     bool windowFocused = true;
+    bool windowMinimized = false;
     
     bool terminate = false;
     
@@ -207,6 +216,11 @@ void EventThread::process(RGSSThreadData &rtData)
     
     while (true)
     {
+        /* Hand out the state once the current batch
+         * is through, right before going to sleep */
+        if (!SDL_PollEvent(0))
+            publishInputState();
+        
         if (!SDL_WaitEvent(&event))
         {
             Debug() << "EventThread: Event error";
@@ -265,14 +279,14 @@ void EventThread::process(RGSSThreadData &rtData)
                         
                     case SDL_WINDOWEVENT_ENTER :
                         cursorInWindow = true;
-                        mouseState.inWindow = true;
+                        input.mouseState.inWindow = true;
                         updateCursorState(cursorInWindow && windowFocused && !sMenu, gameScreen);
                         
                         break;
                         
                     case SDL_WINDOWEVENT_LEAVE :
                         cursorInWindow = false;
-                        mouseState.inWindow = false;
+                        input.mouseState.inWindow = false;
                         updateCursorState(cursorInWindow && windowFocused && !sMenu, gameScreen);
                         
                         break;
@@ -293,8 +307,25 @@ void EventThread::process(RGSSThreadData &rtData)
                         updateCursorState(cursorInWindow && windowFocused && !sMenu, gameScreen);
                         resetInputStates();
                         
+                        break;
+                        
+                    case SDL_WINDOWEVENT_MINIMIZED :
+                        windowMinimized = true;
+                        
+                        break;
+                        
+                    case SDL_WINDOWEVENT_RESTORED :
+                    case SDL_WINDOWEVENT_MAXIMIZED :
+                        windowMinimized = false;
+                        
                         break;
                 }
+                
+                if (windowFocused && !windowMinimized)
+                    rtData.windowInBackground.clear();
+                else
+                    rtData.windowInBackground.set();
+                
                 break;
                 
             case SDL_TEXTINPUT :
@@ -386,7 +417,14 @@ void EventThread::process(RGSSThreadData &rtData)
                     break;
                 }
                 
-                keyStates[event.key.keysym.scancode] = true;
+                if (!event.key.repeat)
+                {
+                    input.keyTimes[event.key.keysym.scancode] = event.key.timestamp;
+                    queueButtonEvent(ButtonEvent::Key, event.key.keysym.scancode,
+                                     true, event.key.timestamp);
+                }
+                
+                input.keyStates[event.key.keysym.scancode] = true;
                 break;
                 
             case SDL_KEYUP :
@@ -400,19 +438,26 @@ void EventThread::process(RGSSThreadData &rtData)
                     break;
                 }
                 
-                keyStates[event.key.keysym.scancode] = false;
+                queueButtonEvent(ButtonEvent::Key, event.key.keysym.scancode,
+                                 false, event.key.timestamp);
+                input.keyStates[event.key.keysym.scancode] = false;
                 break;
                 
             case SDL_CONTROLLERBUTTONDOWN:
-                controllerState.buttons[event.cbutton.button] = true;
+                input.controllerState.buttonTimes[event.cbutton.button] = event.cbutton.timestamp;
+                queueButtonEvent(ButtonEvent::ControllerButton, event.cbutton.button,
+                                 true, event.cbutton.timestamp);
+                input.controllerState.buttons[event.cbutton.button] = true;
                 break;
                 
             case SDL_CONTROLLERBUTTONUP:
-                controllerState.buttons[event.cbutton.button] = false;
+                queueButtonEvent(ButtonEvent::ControllerButton, event.cbutton.button,
+                                 false, event.cbutton.timestamp);
+                input.controllerState.buttons[event.cbutton.button] = false;
                 break;
                 
             case SDL_CONTROLLERAXISMOTION:
-                controllerState.axes[event.caxis.axis] = event.caxis.value;
+                input.controllerState.axes[event.caxis.axis] = event.caxis.value;
                 break;
                 
             case SDL_CONTROLLERDEVICEADDED:
@@ -428,16 +473,21 @@ void EventThread::process(RGSSThreadData &rtData)
                 break;
                 
             case SDL_MOUSEBUTTONDOWN :
-                mouseState.buttons[event.button.button] = true;
+                input.mouseState.buttonTimes[event.button.button] = event.button.timestamp;
+                queueButtonEvent(ButtonEvent::MouseButton, event.button.button,
+                                 true, event.button.timestamp);
+                input.mouseState.buttons[event.button.button] = true;
                 break;
                 
             case SDL_MOUSEBUTTONUP :
-                mouseState.buttons[event.button.button] = false;
+                queueButtonEvent(ButtonEvent::MouseButton, event.button.button,
+                                 false, event.button.timestamp);
+                input.mouseState.buttons[event.button.button] = false;
                 break;
                 
             case SDL_MOUSEMOTION :
-                mouseState.x = event.motion.x;
-                mouseState.y = event.motion.y;
+                input.mouseState.x = event.motion.x;
+                input.mouseState.y = event.motion.y;
                 updateCursorState(cursorInWindow, gameScreen);
                 break;
                 
@@ -447,17 +497,17 @@ void EventThread::process(RGSSThreadData &rtData)
                 
             case SDL_FINGERDOWN :
                 i = event.tfinger.fingerId;
-                touchState.fingers[i].down = true;
+                input.touchState.fingers[i].down = true;
                 
             case SDL_FINGERMOTION :
                 i = event.tfinger.fingerId;
-                touchState.fingers[i].x = event.tfinger.x * winW;
-                touchState.fingers[i].y = event.tfinger.y * winH;
+                input.touchState.fingers[i].x = event.tfinger.x * winW;
+                input.touchState.fingers[i].y = event.tfinger.y * winH;
                 break;
                 
             case SDL_FINGERUP :
                 i = event.tfinger.fingerId;
-                memset(&touchState.fingers[i], 0, sizeof(touchState.fingers[0]));
+                memset(&input.touchState.fingers[i], 0, sizeof(input.touchState.fingers[0]));
                 break;
                 
             default :
@@ -635,6 +685,7 @@ int EventThread::eventFilter(void *data, SDL_Event *event)
             
         case SDL_APP_LOWMEMORY :
             Debug() << "SDL_APP_LOWMEMORY";
+            rtData.rqTrimCaches.set();
             return 0;
             
             //	case SDL_RENDER_TARGETS_RESET :
@@ -660,10 +711,33 @@ void EventThread::cleanup()
 
 void EventThread::resetInputStates()
 {
-    memset(&keyStates, 0, sizeof(keyStates));
-    memset(&controllerState, 0, sizeof(controllerState));
-    memset(&mouseState.buttons, 0, sizeof(mouseState.buttons));
-    memset(&touchState, 0, sizeof(touchState));
+    memset(&input.keyStates, 0, sizeof(input.keyStates));
+    memset(&input.controllerState, 0, sizeof(input.controllerState));
+    memset(&input.mouseState.buttons, 0, sizeof(input.mouseState.buttons));
+    memset(&input.touchState, 0, sizeof(input.touchState));
+}
+
+void EventThread::publishInputState()
+{
+    const int seq = SDL_AtomicGet(&inputSeq);
+    
+    SDL_AtomicSet(&inputSeq, seq + 1);
+    published[(seq / 2 + 1) & 1] = input;
+    SDL_AtomicSet(&inputSeq, seq + 2);
+}
+
+void EventThread::readInputState(InputState &out) const
+{
+    while (true)
+    {
+        const int seq = SDL_AtomicGet(&inputSeq);
+        out = published[(seq / 2) & 1];
+        
+        /* The copy we read is only written again once the
+         * publish after the next one has started */
+        if (SDL_AtomicGet(&inputSeq) - (seq & ~1) < 3)
+            return;
+    }
 }
 
 void EventThread::setFullscreen(SDL_Window *win, bool mode)
@@ -676,7 +750,7 @@ void EventThread::setFullscreen(SDL_Window *win, bool mode)
 void EventThread::updateCursorState(bool inWindow,
                                     const SDL_Rect &screen)
 {
-    SDL_Point pos = { mouseState.x, mouseState.y };
+    SDL_Point pos = { input.mouseState.x, input.mouseState.y };
     bool inScreen = inWindow && SDL_PointInRect(&pos, &screen);
     
     if (inScreen)
@@ -840,6 +914,34 @@ void EventThread::lockText(bool lock)
     lock ? SDL_LockMutex(textInputLock) : SDL_UnlockMutex(textInputLock);
 }
 
+void EventThread::queueButtonEvent(ButtonEvent::Source source, int code,
+                                   bool down, uint32_t ticks)
+{
+    ButtonEvent ev;
+    ev.source = source;
+    ev.code = code;
+    ev.down = down;
+    ev.ticks = ticks;
+    
+    SDL_LockMutex(buttonEventsLock);
+    
+    if (buttonEvents.size() >= BUTTON_EVENTS_MAX)
+        buttonEvents.erase(buttonEvents.begin());
+    
+    buttonEvents.push_back(ev);
+    
+    SDL_UnlockMutex(buttonEventsLock);
+}
+
+void EventThread::takeButtonEvents(std::vector<ButtonEvent> &out)
+{
+    out.clear();
+    
+    SDL_LockMutex(buttonEventsLock);
+    out.swap(buttonEvents);
+    SDL_UnlockMutex(buttonEventsLock);
+}
+
 void SyncPoint::haltThreads()
 {
     if (mainSync.locked)
@@ -29,6 +29,7 @@
 #include <SDL_gamecontroller.h>
 
 #include <string>
+#include <vector>
 
 #include <stdint.h>
 
@@ -51,6 +52,8 @@ public:
     struct ControllerState {
         int axes[SDL_CONTROLLER_AXIS_MAX];
         bool buttons[SDL_CONTROLLER_BUTTON_MAX];
+        /* SDL timestamps (in ms) of the last presses */
+        uint32_t buttonTimes[SDL_CONTROLLER_BUTTON_MAX];
     };
 
 	struct MouseState
@@ -58,6 +61,24 @@ public:
 		int x, y;
 		bool inWindow;
 		bool buttons[32];
+		uint32_t buttonTimes[32];
+	};
+
+	/* Press or release of a key, controller or mouse
+	 * button, with the SDL timestamp (in ms) of the event */
+	struct ButtonEvent
+	{
+		enum Source
+		{
+			Key,
+			ControllerButton,
+			MouseButton
+		};
+
+		Source source;
+		int code;
+		bool down;
+		uint32_t ticks;
 	};
 
 	struct FingerState
@@ -71,15 +92,30 @@ public:
 		FingerState fingers[MAX_FINGERS];
 	};
 
-	static uint8_t keyStates[SDL_NUM_SCANCODES];
-    static ControllerState controllerState;
-	static MouseState mouseState;
-	static TouchState touchState;
+	/* Everything the RGSS thread reads about the input devices */
+	struct InputState
+	{
+		uint8_t keyStates[SDL_NUM_SCANCODES];
+		/* SDL timestamps (in ms) of the last key presses */
+		uint32_t keyTimes[SDL_NUM_SCANCODES];
+		ControllerState controllerState;
+		MouseState mouseState;
+		TouchState touchState;
+	};
+
     static SDL_atomic_t verticalScrollDistance;
     
     std::string textInputBuffer;
     void lockText(bool lock);
     
+	/* Called from RGSS thread. Copies the state as of the last
+	 * batch of handled events, without locking or blocking */
+	void readInputState(InputState &out) const;
+
+	/* Called from RGSS thread, moves the button events
+	 * queued since the last call into 'out' */
+	void takeButtonEvents(std::vector<ButtonEvent> &out);
+    
 
 	static bool allocUserEvents();
 
@@ -121,6 +157,9 @@ private:
 	static int eventFilter(void *, SDL_Event*);
 
 	void resetInputStates();
+	void publishInputState();
+	void queueButtonEvent(ButtonEvent::Source source, int code,
+	                      bool down, uint32_t ticks);
 	void setFullscreen(SDL_Window *, bool mode);
 	void updateCursorState(bool inWindow,
 	                       const SDL_Rect &screen);
@@ -133,6 +172,18 @@ private:
 	AtomicFlag msgBoxDone;
     
     SDL_mutex *textInputLock;
+    
+	/* Only touched by the event thread */
+	InputState input;
+
+	/* Copies handed to the RGSS thread. 'inputSeq' is twice the
+	 * number of published copies, plus one while the next one is
+	 * written, which always goes into the copy not read from */
+	InputState published[2];
+	mutable SDL_atomic_t inputSeq;
+
+	std::vector<ButtonEvent> buttonEvents;
+	SDL_mutex *buttonEventsLock;
 
 	struct
 	{
@@ -246,6 +297,13 @@ struct RGSSThreadData
     // Set when window is being adjusted (resize, reposition)
     AtomicFlag rqWindowAdjust;
 
+	/* Set while the window is minimized or unfocused */
+	AtomicFlag windowInBackground;
+
+	/* Set when the OS reports low memory, so the RGSS
+	 * thread purges its caches on the next frame */
+	AtomicFlag rqTrimCaches;
+
 	EventThread *ethread;
 	UnidirMessage<Vec2i> windowSizeMsg;
     UnidirMessage<Vec2i> drawableSizeMsg;
@@ -20,21 +20,31 @@
 */
 
 #include "filesystem.h"
+#include "ioscheduler.h"
 
 #include "util/boost-hash.h"
 #include "util/debugwriter.h"
 #include "util/exception.h"
 #include "util/util.h"
+#include "util/sdl-util.h"
+#include "util/trace.h"
 #include "display/font.h"
 #include "crypto/rgssad.h"
+#include "crypto/mkxpa.h"
 
 #include "eventthread.h"
 #include "sharedstate.h"
 
 #include <physfs.h>
 
+#include <SDL_mutex.h>
+#include <SDL_thread.h>
+
 #include <algorithm>
-#include <stack>
+#include <deque>
+#include <list>
+#include <memory>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -46,6 +56,22 @@
 
 #ifdef __WIN32__
 #include <direct.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef MKXPZ_EXP_FS
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+#include "ghc/filesystem.hpp"
+namespace fs = ghc::filesystem;
 #endif
 
 struct SDLRWIoContext {
@@ -175,6 +201,7 @@ static size_t SDL_RWopsRead(SDL_RWops *ops, void *buffer, size_t size,
   if (!f)
     return 0;
 
+  IOScheduler::Scope io(size * maxnum);
   PHYSFS_sint64 result = PHYSFS_readBytes(f, buffer, size * maxnum);
 
   return (result != -1) ? (result / size) : 0;
@@ -212,6 +239,199 @@ static int SDL_RWopsCloseFree(SDL_RWops *ops) {
   return result;
 }
 
+/* Loose files can instead be read straight out of a read-only
+ * mapping, sparing decoders a syscall and a copy per read. The
+ * mapping is kept in the memory fields of the ops, so they can
+ * be copied around just like PhysFS ones */
+static const Uint32 SDL_RWOPS_MAPPED = SDL_RWOPS_UNKNOWN + 11;
+
+static Sint64 mappedSize(SDL_RWops *ops) {
+  return ops->hidden.mem.stop - ops->hidden.mem.base;
+}
+
+static Sint64 mappedSeek(SDL_RWops *ops, int64_t offset, int whence) {
+  Uint8 *base;
+
+  switch (whence) {
+  default:
+  case RW_SEEK_SET:
+    base = ops->hidden.mem.base;
+    break;
+  case RW_SEEK_CUR:
+    base = ops->hidden.mem.here;
+    break;
+  case RW_SEEK_END:
+    base = ops->hidden.mem.stop;
+    break;
+  }
+
+  const int64_t pos = (base - ops->hidden.mem.base) + offset;
+
+  if (pos < 0 || pos > mappedSize(ops))
+    return -1;
+
+  ops->hidden.mem.here = ops->hidden.mem.base + pos;
+
+  return pos;
+}
+
+static size_t mappedRead(SDL_RWops *ops, void *buffer, size_t size,
+                         size_t maxnum) {
+  if (size == 0)
+    return 0;
+
+  const size_t avail = ops->hidden.mem.stop - ops->hidden.mem.here;
+  const size_t num = std::min(maxnum, avail / size);
+
+  /* The disk is only read when the pages are touched */
+  IOScheduler::Scope io(num * size);
+  memcpy(buffer, ops->hidden.mem.here, num * size);
+  ops->hidden.mem.here += num * size;
+
+  return num;
+}
+
+static size_t mappedWrite(SDL_RWops *, const void *, size_t, size_t) {
+  return 0;
+}
+
+static int mappedClose(SDL_RWops *ops) {
+  Uint8 *base = ops->hidden.mem.base;
+
+  if (!base)
+    return -1;
+
+#ifdef __WIN32__
+  UnmapViewOfFile(base);
+#else
+  munmap(base, mappedSize(ops));
+#endif
+
+  ops->hidden.mem.base = ops->hidden.mem.here = ops->hidden.mem.stop = 0;
+
+  return 0;
+}
+
+static int mappedCloseFree(SDL_RWops *ops) {
+  int result = mappedClose(ops);
+
+  SDL_FreeRW(ops);
+
+  return result;
+}
+
+/* Returns 0 for anything that can't be mapped,
+ * including empty files */
+static void *mapFile(const fs::path &path, size_t &size) {
+#ifdef __WIN32__
+  HANDLE file = CreateFileW(path.wstring().c_str(), GENERIC_READ,
+                            FILE_SHARE_READ, 0, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, 0);
+
+  if (file == INVALID_HANDLE_VALUE)
+    return 0;
+
+  LARGE_INTEGER fileSize;
+
+  if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0 ||
+      (uint64_t) fileSize.QuadPart > SIZE_MAX) {
+    CloseHandle(file);
+    return 0;
+  }
+
+  /* The view keeps both handles alive */
+  HANDLE mapping = CreateFileMappingW(file, 0, PAGE_READONLY, 0, 0, 0);
+  CloseHandle(file);
+
+  if (!mapping)
+    return 0;
+
+  void *base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+
+  size = fileSize.QuadPart;
+
+  return base;
+#else
+  int fd = open(path.string().c_str(), O_RDONLY);
+
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+      (uint64_t) st.st_size > SIZE_MAX) {
+    close(fd);
+    return 0;
+  }
+
+  void *base = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (base == MAP_FAILED)
+    return 0;
+
+#ifdef MADV_SEQUENTIAL
+  /* Decoders mostly read front to back */
+  madvise(base, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+  size = st.st_size;
+
+  return base;
+#endif
+}
+
+/* Sets up 'ops' to read the PhysFS file 'path' from a mapping
+ * if it lives in a mounted directory. Returns false for files
+ * inside archives, which have to go through PhysFS */
+static bool initMappedOps(const char *path, SDL_RWops &ops, bool freeOnClose) {
+  const char *realDir = PHYSFS_getRealDir(path);
+
+  if (!realDir)
+    return false;
+
+  std::error_code ec;
+  fs::path dir(realDir);
+
+  if (!fs::is_directory(dir, ec))
+    return false;
+
+  /* 'path' is relative to the mount point, not the directory */
+  std::string rel(path);
+  const char *mountPoint = PHYSFS_getMountPoint(realDir);
+
+  if (mountPoint) {
+    while (*mountPoint == '/')
+      ++mountPoint;
+
+    const size_t len = strlen(mountPoint);
+
+    if (rel.compare(0, len, mountPoint) == 0)
+      rel.erase(0, len);
+  }
+
+  size_t size;
+  Uint8 *base = static_cast<Uint8 *>(mapFile(dir / fs::path(rel), size));
+
+  if (!base)
+    return false;
+
+  ops.size = mappedSize;
+  ops.seek = mappedSeek;
+  ops.read = mappedRead;
+  ops.write = mappedWrite;
+  ops.close = freeOnClose ? mappedCloseFree : mappedClose;
+
+  ops.type = SDL_RWOPS_MAPPED;
+  ops.hidden.mem.base = base;
+  ops.hidden.mem.here = base;
+  ops.hidden.mem.stop = base + size;
+
+  return true;
+}
+
 /* Copies the first srcN characters from src into dst,
  * or the full string if srcN == -1. Never writes more
  * than dstMax, and guarantees dst to be null terminated.
@@ -265,6 +485,244 @@ static void strTolower(std::string &str) {
     str[i] = tolower(str[i]);
 }
 
+/* Decompressed contents of small files inside ZIP and 7z archives
+ * (eg. mods), so that reopening them doesn't inflate them again.
+ * Kept in LRU order within a byte budget. Open ops hold on to the
+ * data themselves, so eviction never pulls it from under a reader */
+struct EntryCache {
+  typedef std::shared_ptr<const std::string> Data;
+  typedef std::list<std::pair<std::string, Data>> List;
+
+  List entries;
+  BoostHash<std::string, List::iterator> index;
+  size_t size;
+  size_t budget;
+
+  /* Files are opened from loader threads too */
+  SDL_mutex *mutex;
+
+  EntryCache(size_t budget) : size(0), budget(budget) {
+    mutex = SDL_CreateMutex();
+  }
+
+  ~EntryCache() { SDL_DestroyMutex(mutex); }
+
+  /* Larger files are streamed from the archive as usual */
+  size_t maxEntry() const {
+    return std::min<size_t>(budget / 8, 1024 * 1024);
+  }
+
+  /* Archives whose entries are (usually) compressed */
+  static bool wanted(const char *realDir) {
+    const char *ext = findExt(realDir);
+
+    if (!ext)
+      return false;
+
+    std::string lower(ext);
+    strTolower(lower);
+
+    return lower == "zip" || lower == "7z";
+  }
+
+  Data find(const std::string &key) {
+    Data data;
+
+    SDL_LockMutex(mutex);
+
+    if (index.contains(key)) {
+      List::iterator iter = index[key];
+      entries.splice(entries.begin(), entries, iter);
+      data = iter->second;
+    }
+
+    SDL_UnlockMutex(mutex);
+
+    return data;
+  }
+
+  void insert(const std::string &key, const Data &data) {
+    SDL_LockMutex(mutex);
+
+    /* Another thread may have read it in the meantime */
+    if (!index.contains(key)) {
+      entries.push_front(std::make_pair(key, data));
+      index.insert(key, entries.begin());
+      size += data->size();
+
+      while (size > budget) {
+        size -= entries.back().second->size();
+        index.remove(entries.back().first);
+        entries.pop_back();
+      }
+    }
+
+    SDL_UnlockMutex(mutex);
+  }
+
+  void clear() {
+    SDL_LockMutex(mutex);
+
+    entries.clear();
+    index.clear();
+    size = 0;
+
+    SDL_UnlockMutex(mutex);
+  }
+};
+
+static const Uint32 SDL_RWOPS_CACHED = SDL_RWOPS_UNKNOWN + 12;
+
+/* Stored in the ops, shared between copies of them */
+struct CachedReader {
+  EntryCache::Data data;
+  size_t pos;
+};
+
+static inline CachedReader *cachedReader(SDL_RWops *ops) {
+  return static_cast<CachedReader *>(ops->hidden.unknown.data1);
+}
+
+static Sint64 cachedSize(SDL_RWops *ops) {
+  CachedReader *reader = cachedReader(ops);
+
+  return reader ? (Sint64) reader->data->size() : -1;
+}
+
+static Sint64 cachedSeek(SDL_RWops *ops, int64_t offset, int whence) {
+  CachedReader *reader = cachedReader(ops);
+
+  if (!reader)
+    return -1;
+
+  int64_t base;
+
+  switch (whence) {
+  default:
+  case RW_SEEK_SET:
+    base = 0;
+    break;
+  case RW_SEEK_CUR:
+    base = reader->pos;
+    break;
+  case RW_SEEK_END:
+    base = reader->data->size();
+    break;
+  }
+
+  const int64_t pos = base + offset;
+
+  if (pos < 0 || pos > (int64_t) reader->data->size())
+    return -1;
+
+  reader->pos = pos;
+
+  return pos;
+}
+
+static size_t cachedRead(SDL_RWops *ops, void *buffer, size_t size,
+                         size_t maxnum) {
+  CachedReader *reader = cachedReader(ops);
+
+  if (!reader || size == 0)
+    return 0;
+
+  const size_t avail = reader->data->size() - reader->pos;
+  const size_t num = std::min(maxnum, avail / size);
+
+  memcpy(buffer, reader->data->data() + reader->pos, num * size);
+  reader->pos += num * size;
+
+  return num;
+}
+
+static size_t cachedWrite(SDL_RWops *, const void *, size_t, size_t) {
+  return 0;
+}
+
+static int cachedClose(SDL_RWops *ops) {
+  CachedReader *reader = cachedReader(ops);
+
+  if (!reader)
+    return -1;
+
+  delete reader;
+  ops->hidden.unknown.data1 = 0;
+
+  return 0;
+}
+
+static int cachedCloseFree(SDL_RWops *ops) {
+  int result = cachedClose(ops);
+
+  SDL_FreeRW(ops);
+
+  return result;
+}
+
+/* Sets up 'ops' to read the PhysFS file 'path' out of 'cache', reading
+ * it in first if need be. Returns false for files that aren't inside
+ * a wanted archive, or are too large to be kept */
+static bool initCachedOps(EntryCache *cache, const char *path, SDL_RWops &ops,
+                          bool freeOnClose) {
+  const char *realDir = PHYSFS_getRealDir(path);
+
+  if (!realDir || !EntryCache::wanted(realDir))
+    return false;
+
+  std::string key(realDir);
+  key += '\0';
+  key += path;
+
+  EntryCache::Data data = cache->find(key);
+
+  if (!data) {
+    PHYSFS_Stat info;
+
+    if (!PHYSFS_stat(path, &info) || info.filesize < 0 ||
+        (PHYSFS_uint64) info.filesize > cache->maxEntry())
+      return false;
+
+    PHYSFS_File *f = PHYSFS_openRead(path);
+
+    if (!f)
+      return false;
+
+    std::string *bytes = new std::string(info.filesize, '\0');
+    PHYSFS_sint64 result;
+
+    {
+      IOScheduler::Scope io(bytes->size());
+      result = PHYSFS_readBytes(f, &(*bytes)[0], bytes->size());
+    }
+
+    PHYSFS_close(f);
+
+    if (result != info.filesize) {
+      delete bytes;
+      return false;
+    }
+
+    data.reset(bytes);
+    cache->insert(key, data);
+  }
+
+  CachedReader *reader = new CachedReader;
+  reader->data = data;
+  reader->pos = 0;
+
+  ops.size = cachedSize;
+  ops.seek = cachedSeek;
+  ops.read = cachedRead;
+  ops.write = cachedWrite;
+  ops.close = freeOnClose ? cachedCloseFree : cachedClose;
+
+  ops.type = SDL_RWOPS_CACHED;
+  ops.hidden.unknown.data1 = reader;
+
+  return true;
+}
+
 const Uint32 SDL_RWOPS_PHYSFS = SDL_RWOPS_UNKNOWN + 10;
 
 struct FileSystemPrivate {
@@ -274,10 +732,131 @@ struct FileSystemPrivate {
   /* Maps: lower case directory path,
    * To:   list of lower case filenames */
   BoostHash<std::string, std::vector<std::string>> fileLists;
+  /* Maps: lower case full filepath, minus any number of extensions,
+   * To:   lower case full filepaths of all files it resolves to,
+   *       in search order */
+  BoostHash<std::string, std::vector<std::string>> stemIndex;
+
+  /* Names 'openRead()' (lower case) and 'exists()' (as given)
+   * found nothing for. Only kept while the path cache is active, which already
+   * doesn't see files created after it was built; emptied whenever
+   * the search path or the path cache changes */
+  BoostSet<std::string> openMisses;
+  BoostSet<std::string> existsMisses;
+  unsigned int missHits;
 
   /* This is for compatibility with games that take Windows'
    * case insensitivity for granted */
   bool havePathCache;
+
+  /* Where the path cache is persisted between runs, empty for nowhere */
+  std::string cacheFile;
+  /* The path cache was loaded from 'cacheFile' and hasn't been
+   * checked against the actual search path contents */
+  bool cacheFromDisk;
+
+  /* PhysFS buffer size of opened files, 0 for none */
+  size_t readAhead;
+
+  /* Loose files are read from memory mappings */
+  bool mapFiles;
+
+  /* Null if disabled */
+  EntryCache *entryCache;
+
+  /* Created on the first prefetch request */
+  struct FilePrefetcher *prefetcher;
+};
+
+/* Reads queued files from start to end on a background
+ * thread and throws the data away, so it is in the OS
+ * page cache by the time it is actually opened */
+struct FilePrefetcher {
+  SDL_Thread *thread;
+  std::deque<std::string> queue;
+
+  SDL_mutex *mutex;
+  SDL_cond *cond;
+  bool quit;
+
+  FilePrefetcher() : thread(0), quit(false) {
+    mutex = SDL_CreateMutex();
+    cond = SDL_CreateCond();
+  }
+
+  ~FilePrefetcher() {
+    SDL_LockMutex(mutex);
+    quit = true;
+    SDL_CondSignal(cond);
+    SDL_UnlockMutex(mutex);
+
+    if (thread)
+      SDL_WaitThread(thread, 0);
+
+    SDL_DestroyCond(cond);
+    SDL_DestroyMutex(mutex);
+  }
+
+  void push(const std::string &path) {
+    SDL_LockMutex(mutex);
+
+    if (!thread)
+      thread = createSDLThread<FilePrefetcher, &FilePrefetcher::work>(
+          this, "prefetch");
+
+    queue.push_back(path);
+    SDL_CondSignal(cond);
+
+    SDL_UnlockMutex(mutex);
+  }
+
+  void work() {
+    std::vector<char> buf(256 * 1024);
+
+    IOScheduler::setThreadPriority(IOScheduler::Speculative);
+
+    SDL_LockMutex(mutex);
+
+    while (true) {
+      while (!quit && queue.empty())
+        SDL_CondWait(cond, mutex);
+
+      if (quit)
+        break;
+
+      std::string path = queue.front();
+      queue.pop_front();
+
+      SDL_UnlockMutex(mutex);
+
+      PHYSFS_File *f = PHYSFS_openRead(path.c_str());
+
+      /* Checking 'quit' without the lock is fine here,
+       * it only makes shutting down a bit more eager */
+      while (f && !quit) {
+        IOScheduler::Scope io(buf.size());
+
+        if (PHYSFS_readBytes(f, buf.data(), buf.size()) <= 0)
+          break;
+      }
+
+      if (f)
+        PHYSFS_close(f);
+
+      SDL_LockMutex(mutex);
+    }
+
+    SDL_UnlockMutex(mutex);
+  }
+};
+
+/* One file or directory of the virtual file system,
+ * as recorded in the (persisted) path cache */
+struct PathCacheEntry {
+  std::string path;
+  bool dir;
+
+  PathCacheEntry(const std::string &path, bool dir) : path(path), dir(dir) {}
 };
 
 static void throwPhysfsError(const char *desc) {
@@ -294,7 +873,8 @@ static void throwPhysfsError(const char *desc) {
   throw Exception(Exception::PHYSFSError, "%s: %s", desc, englishStr);
 }
 
-FileSystem::FileSystem(const char *argv0, bool allowSymlinks) {
+FileSystem::FileSystem(const char *argv0, bool allowSymlinks, size_t readAhead,
+                       bool mapFiles, size_t entryCacheSize) {
   if (PHYSFS_init(argv0) == 0)
     throwPhysfsError("Error initializing PhysFS");
 
@@ -305,24 +885,42 @@ FileSystem::FileSystem(const char *argv0, bool allowSymlinks) {
   er *= PHYSFS_registerArchiver(&RGSS1_Archiver);
   er *= PHYSFS_registerArchiver(&RGSS2_Archiver);
   er *= PHYSFS_registerArchiver(&RGSS3_Archiver);
+  er *= PHYSFS_registerArchiver(&MKXPA_Archiver);
 
   if (er == 0)
     throwPhysfsError("Error registering PhysFS RGSS archiver");
 
   p = new FileSystemPrivate;
   p->havePathCache = false;
+  p->cacheFromDisk = false;
+  p->readAhead = readAhead;
+  p->mapFiles = mapFiles;
+  p->entryCache = entryCacheSize ? new EntryCache(entryCacheSize) : 0;
+  p->prefetcher = 0;
+  p->missHits = 0;
 
   if (allowSymlinks)
     PHYSFS_permitSymbolicLinks(1);
 }
 
 FileSystem::~FileSystem() {
+  delete p->prefetcher;
+  delete p->entryCache;
   delete p;
 
   if (PHYSFS_deinit() == 0)
     Debug() << "PhyFS failed to deinit.";
 }
 
+static void clearMissCache(FileSystemPrivate *p) {
+  p->openMisses.clear();
+  p->existsMisses.clear();
+
+  /* The same archive path may now hold something else */
+  if (p->entryCache)
+    p->entryCache->clear();
+}
+
 void FileSystem::addPath(const char *path, const char *mountpoint, bool reload) {
   /* Try the normal mount first */
     int state = PHYSFS_mount(path, mountpoint, 1);
@@ -339,6 +937,7 @@ void FileSystem::addPath(const char *path, const char *mountpoint, bool reload)
         throw Exception(Exception::PHYSFSError, "Failed to mount %s (%s)", path, PHYSFS_getErrorByCode(err));
     }
     
+    clearMissCache(p);
     if (reload) reloadPathCache();
 }
 
@@ -349,19 +948,55 @@ void FileSystem::removePath(const char *path, bool reload) {
         throw Exception(Exception::PHYSFSError, "Failed to unmount %s (%s)", path, PHYSFS_getErrorByCode(err));
     }
     
+    clearMissCache(p);
     if (reload) reloadPathCache();
 }
 
+/* Adds one mixed case path to the lookup tables */
+static void addCacheEntry(FileSystemPrivate *p, const std::string &mixedCase,
+                          bool dir) {
+  std::string lowerCase = mixedCase;
+  strTolower(lowerCase);
+
+  if (dir) {
+    /* Create a new list for this directory */
+    p->fileLists[lowerCase];
+    return;
+  }
+
+  size_t slash = lowerCase.rfind('/');
+  size_t nameStart = (slash == std::string::npos) ? 0 : slash + 1;
+
+  /* Append this filename to the list of its directory */
+  std::string lowerDir = nameStart ? lowerCase.substr(0, slash) : std::string();
+  p->fileLists[lowerDir].push_back(lowerCase.substr(nameStart));
+
+  /* Add the lower -> mixed mapping of the file's full path */
+  p->pathCache.insert(lowerCase, mixedCase);
+
+  /* Index the file under every name openRead() accepts for it,
+   * ie. its full path cut off at any '.' of the filename */
+  for (size_t i = nameStart; i <= lowerCase.size(); ++i)
+    if (i == lowerCase.size() || (lowerCase[i] == '.' && i > nameStart))
+      p->stemIndex[lowerCase.substr(0, i)].push_back(lowerCase);
+}
+
 struct CacheEnumData {
   FileSystemPrivate *p;
-  std::stack<std::vector<std::string> *> fileLists;
+
+  /* Everything added so far, in order */
+  std::vector<PathCacheEntry> entries;
+  BoostSet<std::string> seen;
+
+  /* Types of already scanned paths, saving a stat call each */
+  BoostHash<std::string, bool> *knownTypes;
 
 #ifdef __APPLE__
   iconv_t nfd2nfc;
   char buf[512];
 #endif
 
-  CacheEnumData(FileSystemPrivate *p) : p(p) {
+  CacheEnumData(FileSystemPrivate *p) : p(p), knownTypes(0) {
 #ifdef __APPLE__
     nfd2nfc = iconv_open("utf-8", "utf-8-mac");
 #endif
@@ -392,6 +1027,19 @@ struct CacheEnumData {
     (void)inout;
 #endif
   }
+
+  /* Returns false if 'path' was already added through another
+   * search path, as the union only contains it once */
+  bool add(const std::string &path, bool dir) {
+    if (seen.contains(path))
+      return false;
+
+    seen.insert(path);
+    entries.push_back(PathCacheEntry(path, dir));
+    addCacheEntry(p, path, dir);
+
+    return true;
+  }
 };
 
 static PHYSFS_EnumerateCallbackResult cacheEnumCB(void *d, const char *origdir,
@@ -408,40 +1056,307 @@ static PHYSFS_EnumerateCallbackResult cacheEnumCB(void *d, const char *origdir,
   data.toNFC(fullPath);
 
   std::string mixedCase(fullPath);
-  std::string lowerCase = mixedCase;
-  strTolower(lowerCase);
-
-  PHYSFS_Stat stat;
-  PHYSFS_stat(fullPath, &stat);
+  bool dir;
 
-  if (stat.filetype == PHYSFS_FILETYPE_DIRECTORY) {
-    /* Create a new list for this directory */
-    std::vector<std::string> &list = data.p->fileLists[lowerCase];
+  if (data.knownTypes && data.knownTypes->contains(mixedCase)) {
+    dir = data.knownTypes->value(mixedCase);
+  } else {
+    PHYSFS_Stat stat;
+    PHYSFS_stat(fullPath, &stat);
+    dir = (stat.filetype == PHYSFS_FILETYPE_DIRECTORY);
+  }
 
-    /* Iterate over its contents */
-    data.fileLists.push(&list);
+  /* Iterate over the contents of new directories */
+  if (data.add(mixedCase, dir) && dir)
     PHYSFS_enumerate(fullPath, cacheEnumCB, d);
-    data.fileLists.pop();
-  } else {
-    /* Get the file list for the directory we're currently
-     * traversing and append this filename to it */
-    std::vector<std::string> &list = *data.fileLists.top();
 
-    std::string lowerFilename(fname);
-    strTolower(lowerFilename);
-    list.push_back(lowerFilename);
+  return PHYSFS_ENUM_OK;
+}
+
+/* Walks one search path that is a plain directory on the host
+ * file system. These don't need PhysFS, and thus its global
+ * lock, so all of them can be scanned at the same time */
+struct MountScan {
+  std::string root;
+  /* Mount point in the virtual file system, "" or ending in '/' */
+  std::string prefix;
+  bool followSymlinks;
+
+  std::vector<PathCacheEntry> entries;
+
+  void run() {
+    std::error_code ec;
+    fs::directory_options opts = fs::directory_options::skip_permission_denied;
+
+    if (followSymlinks)
+      opts |= fs::directory_options::follow_directory_symlink;
+
+    const size_t rootLen = fs::path(root).generic_string().size();
+    fs::recursive_directory_iterator iter(root, opts, ec), end;
 
-    /* Add the lower -> mixed mapping of the file's full path */
-    data.p->pathCache.insert(lowerCase, mixedCase);
+    while (!ec && iter != end) {
+      std::error_code statEc;
+      const std::string path = iter->path().generic_string();
+
+      if (!followSymlinks && fs::is_symlink(iter->symlink_status(statEc))) {
+        iter.disable_recursion_pending();
+      } else if (path.size() > rootLen + 1) {
+        bool dir = fs::is_directory(iter->status(statEc));
+        entries.push_back(PathCacheEntry(prefix + path.substr(rootLen + 1), dir));
+      }
+
+      iter.increment(ec);
+    }
   }
+};
 
-  return PHYSFS_ENUM_OK;
+static int64_t fileMTime(const std::string &path) {
+  std::error_code ec;
+  fs::file_time_type time = fs::last_write_time(path, ec);
+
+  return ec ? 0 : (int64_t) time.time_since_epoch().count();
+}
+
+/* Identifies the current search path. For directories, the
+ * times of their immediate subdirectories are included too,
+ * as that is where files usually get added */
+static std::string searchPathKey() {
+  std::string key;
+  char **list = PHYSFS_getSearchPath();
+
+  for (char **i = list; *i; ++i) {
+    const char *mount = PHYSFS_getMountPoint(*i);
+    char buf[32];
+
+    key += *i;
+    key += '\n';
+    key += mount ? mount : "";
+
+    snprintf(buf, sizeof(buf), "\n%lld", (long long) fileMTime(*i));
+    key += buf;
+
+    std::error_code ec;
+
+    if (fs::is_directory(*i, ec)) {
+      fs::directory_iterator iter(*i, ec), end;
+
+      for (; !ec && iter != end; iter.increment(ec)) {
+        std::error_code statEc;
+
+        if (!fs::is_directory(iter->status(statEc)))
+          continue;
+
+        snprintf(buf, sizeof(buf), "/%lld",
+                 (long long) fileMTime(iter->path().string()));
+        key += buf;
+      }
+    }
+
+    key += '\n';
+  }
+
+  PHYSFS_freeList(list);
+
+  return key;
 }
 
-void FileSystem::createPathCache() {
+/* File layout (little endian):
+ *   char[8]  magic
+ *   uint32   key length, followed by the key itself
+ *   uint32   entry count, followed by each entry as
+ *            uint8 directory flag, uint32 path length, path */
+static const char pathCacheMagic[8] = { 'M', 'K', 'X', 'P', 'P', 'T', 'H', '1' };
+
+static void savePathCache(const std::string &file, const std::string &key,
+                          const std::vector<PathCacheEntry> &entries) {
+  SDL_RWops *ops = SDL_RWFromFile(file.c_str(), "wb");
+
+  if (!ops) {
+    Debug() << "Failed to write path cache:" << file;
+    return;
+  }
+
+  SDL_RWwrite(ops, pathCacheMagic, sizeof(pathCacheMagic), 1);
+  SDL_WriteLE32(ops, key.size());
+  SDL_RWwrite(ops, key.data(), 1, key.size());
+  SDL_WriteLE32(ops, entries.size());
+
+  for (size_t i = 0; i < entries.size(); ++i) {
+    SDL_WriteU8(ops, entries[i].dir);
+    SDL_WriteLE32(ops, entries[i].path.size());
+    SDL_RWwrite(ops, entries[i].path.data(), 1, entries[i].path.size());
+  }
+
+  SDL_RWclose(ops);
+}
+
+static bool loadPathCache(FileSystemPrivate *p, const std::string &key) {
+  SDL_RWops *ops = SDL_RWFromFile(p->cacheFile.c_str(), "rb");
+
+  if (!ops)
+    return false;
+
+  /* Everything in one read */
+  Sint64 size = SDL_RWsize(ops);
+  std::vector<char> data(size > 0 ? size : 0);
+  bool readOk = size > 0 && SDL_RWread(ops, data.data(), data.size(), 1) == 1;
+
+  SDL_RWclose(ops);
+
+  if (!readOk)
+    return false;
+
+  size_t pos = 0;
+
+  auto readLE32 = [&](uint32_t &v) {
+    if (pos + 4 > data.size())
+      return false;
+
+    const uint8_t *b = reinterpret_cast<const uint8_t *>(&data[pos]);
+    v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+    pos += 4;
+
+    return true;
+  };
+
+  auto readString = [&](std::string &str) {
+    uint32_t len;
+
+    if (!readLE32(len) || pos + len > data.size())
+      return false;
+
+    str.assign(&data[pos], len);
+    pos += len;
+
+    return true;
+  };
+
+  std::string fileKey;
+  uint32_t count;
+
+  if (data.size() < sizeof(pathCacheMagic) ||
+      memcmp(data.data(), pathCacheMagic, sizeof(pathCacheMagic)))
+    return false;
+
+  pos = sizeof(pathCacheMagic);
+
+  if (!readString(fileKey) || fileKey != key || !readLE32(count))
+    return false;
+
+  std::vector<PathCacheEntry> entries;
+  entries.reserve(std::min<size_t>(count, data.size() / 5));
+
+  for (uint32_t i = 0; i < count; ++i) {
+    std::string path;
+
+    if (pos >= data.size())
+      return false;
+
+    bool dir = data[pos++];
+
+    if (!readString(path))
+      return false;
+
+    entries.push_back(PathCacheEntry(path, dir));
+  }
+
+  p->fileLists[""];
+
+  for (size_t i = 0; i < entries.size(); ++i)
+    addCacheEntry(p, entries[i].path, entries[i].dir);
+
+  return true;
+}
+
+/* Saves the result if 'key' is given */
+static void buildPathCache(FileSystemPrivate *p,
+                           const std::string &key = std::string()) {
+  char **list = PHYSFS_getSearchPath();
+  std::vector<MountScan> scans;
+  bool allDirs = true;
+
+  for (char **i = list; *i; ++i) {
+    std::error_code ec;
+
+    if (!fs::is_directory(*i, ec)) {
+      allDirs = false;
+      continue;
+    }
+
+    const char *mount = PHYSFS_getMountPoint(*i);
+    std::string prefix = (mount && *mount == '/') ? mount + 1 : "";
+
+    MountScan scan;
+    scan.root = *i;
+    scan.prefix = prefix;
+    scan.followSymlinks = PHYSFS_symbolicLinksPermitted();
+    scans.push_back(scan);
+  }
+
+  PHYSFS_freeList(list);
+
+  std::vector<SDL_Thread *> threads(scans.size());
+
+  for (size_t i = 0; i < scans.size(); ++i)
+    threads[i] = createSDLThread<MountScan, &MountScan::run>(&scans[i], "pathcache");
+
+  for (size_t i = 0; i < scans.size(); ++i) {
+    if (threads[i])
+      SDL_WaitThread(threads[i], 0);
+    else
+      scans[i].run();
+  }
+
   CacheEnumData data(p);
-  data.fileLists.push(&p->fileLists[""]);
-  PHYSFS_enumerate("", cacheEnumCB, &data);
+  p->fileLists[""];
+
+  if (allDirs) {
+    /* The scans cover everything, merge them in search path order */
+    char buf[512];
+
+    for (size_t i = 0; i < scans.size(); ++i)
+      for (size_t j = 0; j < scans[i].entries.size(); ++j) {
+        strcpySafe(buf, scans[i].entries[j].path.c_str(), sizeof(buf), -1);
+        data.toNFC(buf);
+        data.add(buf, scans[i].entries[j].dir);
+      }
+  } else {
+    /* Archives can only be enumerated through the union, but at
+     * least their stat calls can be skipped for scanned paths */
+    BoostHash<std::string, bool> knownTypes;
+
+    for (size_t i = 0; i < scans.size(); ++i)
+      for (size_t j = 0; j < scans[i].entries.size(); ++j)
+        knownTypes.insert(scans[i].entries[j].path, scans[i].entries[j].dir);
+
+    data.knownTypes = &knownTypes;
+    PHYSFS_enumerate("", cacheEnumCB, &data);
+    data.knownTypes = 0;
+  }
+
+  if (!p->cacheFile.empty() && !key.empty())
+    savePathCache(p->cacheFile, key, data.entries);
+}
+
+static void clearPathCache(FileSystemPrivate *p) {
+  p->fileLists.clear();
+  p->pathCache.clear();
+  p->stemIndex.clear();
+  clearMissCache(p);
+}
+
+void FileSystem::createPathCache(const std::string &cacheDir) {
+  if (!cacheDir.empty())
+    p->cacheFile = cacheDir + "/pathcache.bin";
+
+  std::string key = searchPathKey();
+
+  p->cacheFromDisk = !p->cacheFile.empty() && loadPathCache(p, key);
+
+  if (!p->cacheFromDisk) {
+    clearPathCache(p);
+    buildPathCache(p, key);
+  }
 
   p->havePathCache = true;
 }
@@ -449,9 +1364,25 @@ void FileSystem::createPathCache() {
 void FileSystem::reloadPathCache() {
     if (!p->havePathCache) return;
     
-    p->fileLists.clear();
-    p->pathCache.clear();
-    createPathCache();
+    /* Mounts added at runtime shouldn't end up in the saved cache */
+    clearPathCache(p);
+    buildPathCache(p);
+    p->cacheFromDisk = false;
+}
+
+/* A persisted cache might be missing files added since, or list
+ * removed ones. Rebuilds it from the actual search path if so.
+ * Returns false if the cache was already up to date */
+static bool refreshPathCache(FileSystemPrivate *p) {
+  if (!p->cacheFromDisk)
+    return false;
+
+  p->cacheFromDisk = false;
+
+  clearPathCache(p);
+  buildPathCache(p, searchPathKey());
+
+  return true;
 }
 
 struct FontSetsCBData {
@@ -482,6 +1413,15 @@ static PHYSFS_EnumerateCallbackResult fontSetEnumCB(void *data, const char *dir,
   char filename[512];
   snprintf(filename, sizeof(filename), "%s/%s", dir, fname);
 
+  PHYSFS_Stat stat;
+
+  if (!PHYSFS_stat(filename, &stat))
+    return PHYSFS_ENUM_OK;
+
+  /* Family and style names are known from a previous run */
+  if (d->sfs->initFontSetCached(filename, stat.filesize, stat.modtime))
+    return PHYSFS_ENUM_OK;
+
   PHYSFS_File *handle = PHYSFS_openRead(filename);
 
   if (!handle)
@@ -490,7 +1430,7 @@ static PHYSFS_EnumerateCallbackResult fontSetEnumCB(void *data, const char *dir,
   SDL_RWops ops;
   initReadOps(handle, ops, false);
 
-  d->sfs->initFontSetCB(ops, filename);
+  d->sfs->initFontSetCB(ops, filename, stat.filesize, stat.modtime);
 
   SDL_RWclose(&ops);
 
@@ -534,6 +1474,10 @@ struct OpenReadEnumData {
    * (used with path cache) */
   BoostHash<std::string, std::string> *pathTrans;
 
+  size_t readAhead;
+  bool mapFiles;
+  EntryCache *entryCache;
+
   /* Number of files we've attempted to read and parse */
   size_t matchCount;
   bool stopSearching;
@@ -544,12 +1488,65 @@ struct OpenReadEnumData {
 
   OpenReadEnumData(FileSystem::OpenHandler &handler, const char *filename,
                    size_t filenameN,
-                   BoostHash<std::string, std::string> *pathTrans)
+                   BoostHash<std::string, std::string> *pathTrans,
+                   size_t readAhead, bool mapFiles, EntryCache *entryCache)
       : handler(handler), filename(filename), filenameN(filenameN),
-        pathTrans(pathTrans), matchCount(0), stopSearching(false),
+        pathTrans(pathTrans), readAhead(readAhead), mapFiles(mapFiles),
+        entryCache(entryCache),
+        matchCount(0), stopSearching(false),
         physfsError(0) {}
 };
 
+/* Hands the matching file at 'fullPath' to the handler */
+static PHYSFS_EnumerateCallbackResult
+openReadCandidate(OpenReadEnumData &data, const char *fullPath,
+                  const char *filename) {
+  /* If the path cache is active, translate from lower case
+   * to mixed case path */
+  if (data.pathTrans)
+    fullPath = (*data.pathTrans)[fullPath].c_str();
+
+  if (data.handler.tryPath(fullPath)) {
+    data.stopSearching = true;
+    ++data.matchCount;
+    return PHYSFS_ENUM_OK;
+  }
+
+  const char *ext = findExt(filename);
+
+  if ((data.mapFiles && initMappedOps(fullPath, data.ops, false)) ||
+      (data.entryCache && initCachedOps(data.entryCache, fullPath, data.ops, false))) {
+    if (data.handler.tryRead(data.ops, ext))
+      data.stopSearching = true;
+
+    ++data.matchCount;
+    return PHYSFS_ENUM_OK;
+  }
+
+  PHYSFS_File *phys = PHYSFS_openRead(fullPath);
+
+  if (!phys) {
+    /* Failing to open this file here means there must
+     * be a deeper rooted problem somewhere within PhysFS.
+     * Just abort alltogether. */
+    data.stopSearching = true;
+    data.physfsError = PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode());
+
+    return PHYSFS_ENUM_ERROR;
+  }
+
+  if (data.readAhead)
+    PHYSFS_setBuffer(phys, data.readAhead);
+
+  initReadOps(phys, data.ops, false);
+
+  if (data.handler.tryRead(data.ops, ext))
+    data.stopSearching = true;
+
+  ++data.matchCount;
+  return PHYSFS_ENUM_OK;
+}
+
 static PHYSFS_EnumerateCallbackResult
 openReadEnumCB(void *d, const char *dirpath, const char *filename) {
   OpenReadEnumData &data = *static_cast<OpenReadEnumData *>(d);
@@ -577,34 +1574,12 @@ openReadEnumCB(void *d, const char *dirpath, const char *filename) {
   if (last != '.' && last != '\0')
     return PHYSFS_ENUM_OK;
 
-  /* If the path cache is active, translate from lower case
-   * to mixed case path */
-  if (data.pathTrans)
-    fullPath = (*data.pathTrans)[fullPath].c_str();
-
-  PHYSFS_File *phys = PHYSFS_openRead(fullPath);
-
-  if (!phys) {
-    /* Failing to open this file here means there must
-     * be a deeper rooted problem somewhere within PhysFS.
-     * Just abort alltogether. */
-    data.stopSearching = true;
-    data.physfsError = PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode());
-
-    return PHYSFS_ENUM_ERROR;
-  }
-  initReadOps(phys, data.ops, false);
-
-  const char *ext = findExt(filename);
-
-  if (data.handler.tryRead(data.ops, ext))
-    data.stopSearching = true;
-
-  ++data.matchCount;
-  return PHYSFS_ENUM_OK;
+  return openReadCandidate(data, fullPath, filename);
 }
 
 void FileSystem::openRead(OpenHandler &handler, const char *filename) {
+  TRACE_ZONE("FileSystem::openRead");
+
   std::string filename_nm = normalize(filename, false, false);
   char buffer[512];
   size_t len = strcpySafe(buffer, filename_nm.c_str(), sizeof(buffer), -1);
@@ -621,6 +1596,18 @@ void FileSystem::openRead(OpenHandler &handler, const char *filename) {
 
   const bool root = (delim == buffer);
 
+  /* Probing for optional files fails the same way every time */
+  std::string missKey;
+
+  if (p->havePathCache) {
+    missKey.assign(buffer, len);
+
+    if (p->openMisses.contains(missKey)) {
+      ++p->missHits;
+      throw Exception(Exception::NoFileError, "%s", filename);
+    }
+  }
+
   const char *file = buffer;
   const char *dir = "";
 
@@ -632,45 +1619,126 @@ void FileSystem::openRead(OpenHandler &handler, const char *filename) {
     dir = buffer;
   }
   OpenReadEnumData data(handler, file, len + buffer - delim - !root,
-                        p->havePathCache ? &p->pathCache : 0);
+                        p->havePathCache ? &p->pathCache : 0, p->readAhead,
+                        p->mapFiles, p->entryCache);
 
   if (p->havePathCache) {
-    /* Get the list of files contained in this directory
-     * and manually iterate over them */
-    const std::vector<std::string> &fileList = p->fileLists[dir];
+    /* Look up all files this name resolves to, instead of
+     * going through the whole directory */
+    std::string stem = root ? std::string(file) : std::string(dir) + "/" + file;
+
+    if (p->stemIndex.contains(stem)) {
+      const std::vector<std::string> &matches = p->stemIndex[stem];
 
-    for (size_t i = 0; i < fileList.size(); ++i)
-      openReadEnumCB(&data, dir, fileList[i].c_str());
+      for (size_t i = 0; i < matches.size() && !data.stopSearching; ++i) {
+        const char *fullPath = matches[i].c_str();
+        const char *slash = strrchr(fullPath, '/');
+
+        if (openReadCandidate(data, fullPath, slash ? slash + 1 : fullPath) ==
+            PHYSFS_ENUM_ERROR)
+          break;
+      }
+    }
   } else {
     PHYSFS_enumerate(dir, openReadEnumCB, &data);
   }
 
+  if ((data.physfsError || data.matchCount == 0) && refreshPathCache(p))
+    return openRead(handler, filename);
+
   if (data.physfsError)
     throw Exception(Exception::PHYSFSError, "PhysFS: %s", data.physfsError);
 
-  if (data.matchCount == 0)
+  if (data.matchCount == 0) {
+    if (p->havePathCache)
+      p->openMisses.insert(missKey);
+
     throw Exception(Exception::NoFileError, "%s", filename);
+  }
 }
 
 void FileSystem::openReadRaw(SDL_RWops &ops, const char *filename,
                              bool freeOnClose) {
+  std::string path = normalize(filename, 0, 0);
+
+  if (p->mapFiles && initMappedOps(path.c_str(), ops, freeOnClose))
+    return;
 
-  PHYSFS_File *handle = PHYSFS_openRead(normalize(filename, 0, 0).c_str());
+  if (p->entryCache && initCachedOps(p->entryCache, path.c_str(), ops, freeOnClose))
+    return;
+
+  PHYSFS_File *handle = PHYSFS_openRead(path.c_str());
 
   if (!handle)
     throw Exception(Exception::NoFileError, "%s", filename);
 
+  if (p->readAhead)
+    PHYSFS_setBuffer(handle, p->readAhead);
+
   initReadOps(handle, ops, freeOnClose);
     return;
 }
 
+/* Resolves the path without opening the file */
+struct PrefetchPathHandler : FileSystem::OpenHandler {
+  std::string path;
+
+  bool tryRead(SDL_RWops &ops, const char *) {
+    SDL_RWclose(&ops);
+    return false;
+  }
+
+  bool tryPath(const char *fullPath) {
+    path = fullPath;
+    return true;
+  }
+};
+
+void FileSystem::prefetch(const char *filename) {
+  PrefetchPathHandler handler;
+
+  try {
+    openRead(handler, filename);
+  } catch (const Exception &) {
+    /* Missing files are only reported once they are really opened */
+    return;
+  }
+
+  if (!p->prefetcher)
+    p->prefetcher = new FilePrefetcher;
+
+  p->prefetcher->push(handler.path);
+}
+
 std::string FileSystem::normalize(const char *pathname, bool preferred,
                             bool absolute) {
     return filesystemImpl::normalizePath(pathname, preferred, absolute);
 }
 
 bool FileSystem::exists(const char *filename) {
-  return PHYSFS_exists(normalize(filename, false, false).c_str());
+  std::string path = normalize(filename, false, false);
+
+  if (!p->havePathCache)
+    return PHYSFS_exists(path.c_str());
+
+  if (p->existsMisses.contains(path)) {
+    ++p->missHits;
+    return false;
+  }
+
+  if (PHYSFS_exists(path.c_str()))
+    return true;
+
+  p->existsMisses.insert(path);
+  return false;
+}
+
+FileSystem::MissCacheStats FileSystem::missCacheStats() const {
+  MissCacheStats stats;
+  stats.hits = p->missHits;
+  stats.entries = p->openMisses.size() + p->existsMisses.size();
+
+  return stats;
 }
 
 const char *FileSystem::desensitize(const char *filename) {
@@ -35,15 +35,24 @@ class SharedFontState;
 class FileSystem
 {
 public:
+	/* Opened files read ahead by 'readAhead' bytes. With 'mapFiles',
+	 * files in mounted directories (not archives) are memory mapped
+	 * and read from there. Up to 'entryCacheSize' bytes of small
+	 * files from ZIP and 7z archives are kept decompressed */
 	FileSystem(const char *argv0,
-	           bool allowSymlinks);
+	           bool allowSymlinks,
+	           size_t readAhead = 0,
+	           bool mapFiles = false,
+	           size_t entryCacheSize = 0);
 	~FileSystem();
 
 	void addPath(const char *path, const char *mountpoint = 0, bool reload = false);
     void removePath(const char *path, bool reload = false);
 
-	/* Call these after the last 'addPath()' */
-	void createPathCache();
+	/* Call these after the last 'addPath()'. If 'cacheDir' is given,
+	 * the cache is saved there, and reused on the next run as long
+	 * as the search path didn't change */
+	void createPathCache(const std::string &cacheDir = std::string());
     
     void reloadPathCache();
 
@@ -62,6 +71,11 @@ public:
 		 * references to it. Instead, copy the structure without closing
 		 * if you need to further read from it later. */
 		virtual bool tryRead(SDL_RWops &ops, const char *ext) = 0;
+
+		/* Called with the full path of a matching file before it
+		 * is opened. Returning true accepts the file without ever
+		 * calling 'tryRead()' on it (eg. on a cache hit) */
+		virtual bool tryPath(const char * /* fullPath */) { return false; }
 	};
 
 	void openRead(OpenHandler &handler,
@@ -72,11 +86,29 @@ public:
 	                 const char *filename,
 	                 bool freeOnClose = false);
 
+	/* Reads the file (resolved like 'openRead()' does)
+	 * once in the background, so opening it later on
+	 * doesn't have to wait for the disk */
+	void prefetch(const char *filename);
+
 	std::string normalize(const char *pathname, bool preferred, bool absolute);
 
 	/* Does not perform extension supplementing */
 	bool exists(const char *filename);
 
+	/* While the path cache is active, names that 'openRead()' or
+	 * 'exists()' found nothing for are remembered until the search
+	 * path or the path cache changes */
+	struct MissCacheStats
+	{
+		/* Lookups answered from the cache */
+		unsigned int hits;
+		/* Names currently remembered */
+		unsigned int entries;
+	};
+
+	MissCacheStats missCacheStats() const;
+
 	const char *desensitize(const char *filename);
 
 private:
@@ -20,6 +20,13 @@ namespace fs = ghc::filesystem;
 #endif
 
 #include <fstream>
+#include <stdio.h>
+
+#ifdef __WIN32__
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 // https://stackoverflow.com/questions/12774207/fastest-way-to-check-if-a-file-exist-using-standard-c-c11-c
 bool filesystemImpl::fileExists(const char *path) {
@@ -42,6 +49,44 @@ std::string filesystemImpl::contentsOfFileAsString(const char *path) {
     return ret;
 }
 
+bool filesystemImpl::writeFileAtomic(const char *path, const void *data, size_t size) {
+    fs::path target(path);
+    fs::path temp(target);
+    temp += ".tmp";
+    
+#ifdef __WIN32__
+    FILE *f = _wfopen(temp.wstring().c_str(), L"wb");
+#else
+    FILE *f = fopen(temp.string().c_str(), "wb");
+#endif
+    
+    if (!f)
+        return false;
+    
+    bool ok = (fwrite(data, 1, size, f) == size) && (fflush(f) == 0);
+    
+    // Make sure the data is on disk before it replaces the old file
+#ifdef __WIN32__
+    ok = ok && (_commit(_fileno(f)) == 0);
+#else
+    ok = ok && (fsync(fileno(f)) == 0);
+#endif
+    
+    ok = (fclose(f) == 0) && ok;
+    
+    std::error_code ec;
+    
+    if (ok) {
+        fs::rename(temp, target, ec);
+        ok = !ec;
+    }
+    
+    if (!ok)
+        fs::remove(temp, ec);
+    
+    return ok;
+}
+
 // chdir and getcwd do not support unicode on Windows
 bool filesystemImpl::setCurrentDirectory(const char *path) {
     fs::path stdPath(path);
@@ -57,6 +102,16 @@ bool filesystemImpl::setCurrentDirectory(const char *path) {
     return ret;
 }
 
+bool filesystemImpl::createDirectories(const char *path) {
+    fs::path stdPath(path);
+    try {
+        fs::create_directories(stdPath);
+    } catch (...) {
+        Debug() << "Failed to create directory" << path;
+    }
+    return fs::is_directory(stdPath);
+}
+
 std::string filesystemImpl::getCurrentDirectory() {
     std::string ret;
     try {
@@ -9,6 +9,7 @@
 #define filesystemImpl_h
 
 #include <string>
+#include <stddef.h>
 #include <SDL_video.h>
 
 namespace filesystemImpl {
@@ -16,7 +17,13 @@ bool fileExists(const char *path);
 
 std::string contentsOfFileAsString(const char *path);
 
+/* Writes to a temporary file, flushes it to disk and renames it over
+ * 'path', so readers see either the old or the new file in full */
+bool writeFileAtomic(const char *path, const void *data, size_t size);
+
 bool setCurrentDirectory(const char *path);
+
+bool createDirectories(const char *path);
     
 std::string getCurrentDirectory();
     
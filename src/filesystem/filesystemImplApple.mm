@@ -38,6 +38,10 @@ bool filesystemImpl::setCurrentDirectory(const char *path) {
     return [NSFileManager.defaultManager changeCurrentDirectoryPath: PATHTONS(path)];
 }
 
+bool filesystemImpl::createDirectories(const char *path) {
+    return [NSFileManager.defaultManager createDirectoryAtPath:PATHTONS(path) withIntermediateDirectories:YES attributes:nil error:nil];
+}
+
 std::string filesystemImpl::getCurrentDirectory() {
     return std::string(NSTOPATH(NSFileManager.defaultManager.currentDirectoryPath));
 }
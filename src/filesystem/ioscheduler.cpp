@@ -0,0 +1,156 @@
+/*
+** ioscheduler.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ioscheduler.h"
+
+#include "trace.h"
+
+#include <SDL_mutex.h>
+#include <SDL_timer.h>
+
+#include <chrono>
+
+using namespace IOScheduler;
+
+typedef std::chrono::steady_clock Clock;
+
+struct SchedulerState
+{
+	SDL_mutex *mutex;
+	/* Signaled whenever a priority runs out of I/O in flight */
+	SDL_cond *idleCond;
+
+	/* I/O in flight, per priority */
+	int active[PriorityCount];
+
+	size_t bandwidth[PriorityCount];
+	/* When the bandwidth spent so far is paid off */
+	Clock::time_point nextFree[PriorityCount];
+
+	SchedulerState()
+	{
+		mutex = SDL_CreateMutex();
+		idleCond = SDL_CreateCond();
+
+		for (int i = 0; i < PriorityCount; ++i)
+		{
+			active[i] = 0;
+			bandwidth[i] = 0;
+		}
+	}
+
+	~SchedulerState()
+	{
+		SDL_DestroyCond(idleCond);
+		SDL_DestroyMutex(mutex);
+	}
+
+	bool higherActive(Priority prio) const
+	{
+		for (int i = 0; i < prio; ++i)
+			if (active[i] > 0)
+				return true;
+
+		return false;
+	}
+
+	/* Books 'bytes' against the limit of 'prio' and
+	 * returns how long to wait before doing them */
+	Clock::duration reserve(Priority prio, size_t bytes)
+	{
+		if (bandwidth[prio] == 0)
+			return Clock::duration::zero();
+
+		const Clock::time_point now = Clock::now();
+
+		if (nextFree[prio] < now)
+			nextFree[prio] = now;
+
+		const Clock::duration wait = nextFree[prio] - now;
+
+		nextFree[prio] += std::chrono::duration_cast<Clock::duration>(
+			std::chrono::duration<double>((double) bytes / bandwidth[prio]));
+
+		return wait;
+	}
+};
+
+static SchedulerState state;
+
+static thread_local Priority threadPrio = Blocking;
+
+void IOScheduler::setBandwidth(Priority prio, size_t bytesPerSec)
+{
+	if (prio < Visible)
+		return;
+
+	SDL_LockMutex(state.mutex);
+	state.bandwidth[prio] = bytesPerSec;
+	SDL_UnlockMutex(state.mutex);
+}
+
+void IOScheduler::setThreadPriority(Priority prio)
+{
+	threadPrio = prio;
+}
+
+void IOScheduler::begin(size_t bytes)
+{
+	const Priority prio = threadPrio;
+
+	SDL_LockMutex(state.mutex);
+
+	if (prio < Visible)
+	{
+		++state.active[prio];
+		SDL_UnlockMutex(state.mutex);
+
+		return;
+	}
+
+	const Clock::duration wait = state.reserve(prio, bytes);
+
+	if (wait > Clock::duration::zero())
+	{
+		TRACE_ZONE("IOScheduler::throttle");
+
+		SDL_UnlockMutex(state.mutex);
+		SDL_Delay(std::chrono::duration_cast<std::chrono::milliseconds>(wait).count());
+		SDL_LockMutex(state.mutex);
+	}
+
+	while (state.higherActive(prio))
+		SDL_CondWait(state.idleCond, state.mutex);
+
+	++state.active[prio];
+
+	SDL_UnlockMutex(state.mutex);
+}
+
+void IOScheduler::end()
+{
+	const Priority prio = threadPrio;
+
+	SDL_LockMutex(state.mutex);
+
+	if (--state.active[prio] == 0)
+		SDL_CondBroadcast(state.idleCond);
+
+	SDL_UnlockMutex(state.mutex);
+}
@@ -0,0 +1,75 @@
+/*
+** ioscheduler.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IOSCHEDULER_H
+#define IOSCHEDULER_H
+
+#include <stddef.h>
+
+/* Orders the file I/O of all threads by how soon its data is
+ * needed. Every thread does its I/O at one priority; reads and
+ * writes at the two lower ones wait for those of the higher
+ * ones to be done, and can be limited in bandwidth. This keeps
+ * background loading from starving audio buffer refills on
+ * slow disks */
+namespace IOScheduler
+{
+	enum Priority
+	{
+		/* Audio streaming. Never waits */
+		RealTime,
+		/* Loads the game thread is waiting on. Never waits */
+		Blocking,
+		/* Background loads of assets about to be used, saves */
+		Visible,
+		/* Prefetches that may never be used */
+		Speculative,
+
+		PriorityCount
+	};
+
+	/* Limits I/O at 'prio' to 'bytesPerSec', 0 for no limit.
+	 * Only honored for Visible and Speculative */
+	void setBandwidth(Priority prio, size_t bytesPerSec);
+
+	/* The priority of all I/O done on the calling
+	 * thread from now on. Blocking if never set */
+	void setThreadPriority(Priority prio);
+
+	/* Brackets a single read or write of 'bytes' on the calling
+	 * thread, which waits in 'begin()' for its turn. Must not be
+	 * nested, and nothing else may be waited on in between */
+	void begin(size_t bytes);
+	void end();
+
+	struct Scope
+	{
+		Scope(size_t bytes)
+		{
+			begin(bytes);
+		}
+
+		~Scope()
+		{
+			end();
+		}
+	};
+}
+
+#endif // IOSCHEDULER_H
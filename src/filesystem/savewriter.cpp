@@ -0,0 +1,274 @@
+/*
+** savewriter.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "savewriter.h"
+
+#include "filesystemImpl.h"
+#include "ioscheduler.h"
+#include "util/sdl-util.h"
+#include "util/debugwriter.h"
+
+#include <SDL_mutex.h>
+#include <zlib.h>
+
+#include <deque>
+#include <map>
+#include <utility>
+
+struct SaveJob
+{
+	unsigned int ticket;
+	std::string path;
+	std::string data;
+	bool compress;
+	bool notify;
+};
+
+struct SaveWriterPrivate
+{
+	SDL_Thread *thread;
+	std::deque<SaveJob> queue;
+	std::map<unsigned int, bool> results;
+	unsigned int nextTicket;
+
+	/* A job has been taken off the queue but isn't done yet */
+	bool busy;
+
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	SDL_cond *idleCond;
+	bool quit;
+
+	SaveWriterPrivate()
+	    : thread(0),
+	      nextTicket(1),
+	      busy(false),
+	      quit(false)
+	{
+		mutex = SDL_CreateMutex();
+		cond = SDL_CreateCond();
+		idleCond = SDL_CreateCond();
+	}
+
+	~SaveWriterPrivate()
+	{
+		SDL_LockMutex(mutex);
+		quit = true;
+		SDL_CondSignal(cond);
+		SDL_UnlockMutex(mutex);
+
+		if (thread)
+			SDL_WaitThread(thread, 0);
+
+		SDL_DestroyCond(idleCond);
+		SDL_DestroyCond(cond);
+		SDL_DestroyMutex(mutex);
+	}
+
+	void work()
+	{
+		IOScheduler::setThreadPriority(IOScheduler::Visible);
+
+		SDL_LockMutex(mutex);
+
+		while (true)
+		{
+			while (!quit && queue.empty())
+				SDL_CondWait(cond, mutex);
+
+			/* Pending saves are still written when quitting */
+			if (queue.empty())
+				break;
+
+			SaveJob job = std::move(queue.front());
+			queue.pop_front();
+
+			busy = true;
+			SDL_UnlockMutex(mutex);
+
+			const bool ok = write(job);
+
+			if (!ok)
+				Debug() << "Failed to write save file:" << job.path;
+
+			SDL_LockMutex(mutex);
+			busy = false;
+
+			if (job.notify)
+				results[job.ticket] = ok;
+
+			SDL_CondBroadcast(idleCond);
+		}
+
+		SDL_UnlockMutex(mutex);
+	}
+
+	static bool write(SaveJob &job)
+	{
+		if (!job.compress)
+		{
+			IOScheduler::Scope io(job.data.size());
+
+			return filesystemImpl::writeFileAtomic(job.path.c_str(),
+			                                       job.data.data(), job.data.size());
+		}
+
+		std::string packed;
+
+		if (!deflateGzip(job.data, packed))
+			return false;
+
+		IOScheduler::Scope io(packed.size());
+
+		return filesystemImpl::writeFileAtomic(job.path.c_str(),
+		                                       packed.data(), packed.size());
+	}
+
+	static bool deflateGzip(const std::string &in, std::string &out)
+	{
+		z_stream strm = z_stream();
+
+		/* 16 added to the window bits selects the gzip wrapper,
+		 * so Zlib::GzipReader can read the files as well */
+		if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		                 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return false;
+
+		out.resize(deflateBound(&strm, in.size()) + 32);
+
+		strm.next_in = (Bytef*) in.data();
+		strm.avail_in = in.size();
+		strm.next_out = (Bytef*) &out[0];
+		strm.avail_out = out.size();
+
+		const int result = deflate(&strm, Z_FINISH);
+		out.resize(strm.total_out);
+		deflateEnd(&strm);
+
+		return result == Z_STREAM_END;
+	}
+};
+
+SaveWriter::SaveWriter()
+{
+	p = new SaveWriterPrivate;
+}
+
+SaveWriter::~SaveWriter()
+{
+	delete p;
+}
+
+unsigned int SaveWriter::push(const char *path, const char *data, size_t size,
+                              bool compress, bool notify)
+{
+	SaveJob job;
+	job.path = path;
+	job.data.assign(data, size);
+	job.compress = compress;
+	job.notify = notify;
+
+	SDL_LockMutex(p->mutex);
+
+	if (!p->thread)
+		p->thread = createSDLThread
+			<SaveWriterPrivate, &SaveWriterPrivate::work>(p, "savewriter");
+
+	const unsigned int ticket = job.ticket = p->nextTicket++;
+	p->queue.push_back(std::move(job));
+
+	SDL_CondSignal(p->cond);
+	SDL_UnlockMutex(p->mutex);
+
+	return ticket;
+}
+
+bool SaveWriter::takeResult(unsigned int ticket, bool &ok)
+{
+	SDL_LockMutex(p->mutex);
+
+	std::map<unsigned int, bool>::iterator iter = p->results.find(ticket);
+	const bool found = (iter != p->results.end());
+
+	if (found)
+	{
+		ok = iter->second;
+		p->results.erase(iter);
+	}
+
+	SDL_UnlockMutex(p->mutex);
+
+	return found;
+}
+
+void SaveWriter::waitIdle()
+{
+	SDL_LockMutex(p->mutex);
+
+	while (p->thread && (p->busy || !p->queue.empty()))
+		SDL_CondWait(p->idleCond, p->mutex);
+
+	SDL_UnlockMutex(p->mutex);
+}
+
+bool SaveWriter::readFile(const char *path, std::string &out)
+{
+	std::string raw;
+
+	if (!readFileSDL(path, raw))
+		return false;
+
+	/* gzip magic; anything else was saved uncompressed */
+	if (raw.size() < 2 || (unsigned char) raw[0] != 0x1F
+	                   || (unsigned char) raw[1] != 0x8B)
+	{
+		out.swap(raw);
+		return true;
+	}
+
+	z_stream strm = z_stream();
+
+	if (inflateInit2(&strm, 15 + 16) != Z_OK)
+		return false;
+
+	strm.next_in = (Bytef*) raw.data();
+	strm.avail_in = raw.size();
+
+	out.clear();
+	char buf[64 * 1024];
+	int result;
+
+	do
+	{
+		strm.next_out = (Bytef*) buf;
+		strm.avail_out = sizeof(buf);
+
+		result = inflate(&strm, Z_NO_FLUSH);
+
+		if (result != Z_OK && result != Z_STREAM_END)
+			break;
+
+		out.append(buf, sizeof(buf) - strm.avail_out);
+	}
+	while (result != Z_STREAM_END);
+
+	inflateEnd(&strm);
+
+	return result == Z_STREAM_END;
+}
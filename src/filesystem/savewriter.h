@@ -0,0 +1,61 @@
+/*
+** savewriter.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SAVEWRITER_H
+#define SAVEWRITER_H
+
+#include <string>
+#include <stddef.h>
+
+struct SaveWriterPrivate;
+
+/* Writes save files on a background thread, in the order they
+ * were queued. Each file is optionally gzip compressed, written
+ * to a temporary file next to it, flushed to disk and then
+ * renamed over the target, so an interrupted save never leaves
+ * a truncated file behind. Queued saves are completed before
+ * the writer is destroyed */
+class SaveWriter
+{
+public:
+	SaveWriter();
+	~SaveWriter();
+
+	/* Copies 'data'. If 'notify' is set, the outcome can be
+	 * collected once through 'takeResult()' with the returned
+	 * ticket */
+	unsigned int push(const char *path, const char *data, size_t size,
+	                  bool compress, bool notify);
+
+	/* Returns true if the save for 'ticket' has completed,
+	 * with 'ok' telling whether it succeeded */
+	bool takeResult(unsigned int ticket, bool &ok);
+
+	/* Blocks until everything queued so far is on disk */
+	void waitIdle();
+
+	/* Reads a file written by 'push()', inflating it if it
+	 * was compressed. Plain files are returned as they are */
+	static bool readFile(const char *path, std::string &out);
+
+private:
+	SaveWriterPrivate *p;
+};
+
+#endif // SAVEWRITER_H
@@ -23,7 +23,9 @@
 #include "config.h"
 #include "sharedstate.h"
 #include "eventthread.h"
+#include "graphics.h"
 #include "input/keybindings.h"
+#include "input/replay.h"
 #include "util/exception.h"
 #include "util/util.h"
 
@@ -31,6 +33,7 @@
 #include <SDL_keyboard.h>
 #include <SDL_mouse.h>
 #include <SDL_clipboard.h>
+#include <SDL_timer.h>
 
 #include <vector>
 #include <cmath>
@@ -474,12 +477,15 @@ struct ButtonState
     bool triggered;
     bool repeated;
     bool released;
+    /* When the current press began, see Input::pressTime() */
+    double pressTime;
     
     ButtonState()
     : pressed(false),
     triggered(false),
     repeated(false),
-    released(false)
+    released(false),
+    pressTime(0)
     {}
 };
 
@@ -489,15 +495,87 @@ struct KbBindingData
     Input::ButtonCode target;
 };
 
+/* Flat form of a binding, evaluated every update without
+ * virtual calls. Only rebuilt when the bindings change */
+struct CompiledBinding
+{
+    enum Kind
+    {
+        Key,
+        CtrlButton,
+        CtrlAxis,
+        MsButton
+    };
+    
+    Kind kind;
+    /* Scancode, controller button / axis or mouse button */
+    int source;
+    /* Scancode that counts as the same key (eg. right shift
+     * for left shift), SDL_SCANCODE_UNKNOWN if there is none */
+    int alias;
+    AxisDir dir;
+    bool repeatable;
+    Input::ButtonCode target;
+    
+    bool active(const EventThread::InputState &s) const
+    {
+        switch (kind)
+        {
+            case Key :
+                return s.keyStates[source] || (alias && s.keyStates[alias]);
+                
+            case CtrlButton :
+                return s.controllerState.buttons[source];
+                
+            case CtrlAxis :
+            {
+                float val = s.controllerState.axes[source];
+                
+                if (dir == Negative)
+                    return val < -JAXIS_THRESHOLD;
+                else
+                    return val > JAXIS_THRESHOLD;
+            }
+                
+            case MsButton :
+                return s.mouseState.buttons[source];
+        }
+        
+        return false;
+    }
+    
+    /* SDL timestamp (in ms) of the event that made the
+     * source active, 0 if there is none (eg. for axes) */
+    uint32_t ticks(const EventThread::InputState &s) const
+    {
+        switch (kind)
+        {
+            case Key :
+                if (alias && s.keyStates[alias]
+                    && (!s.keyStates[source]
+                        || s.keyTimes[alias] < s.keyTimes[source]))
+                    return s.keyTimes[alias];
+                
+                return s.keyTimes[source];
+                
+            case CtrlButton :
+                return s.controllerState.buttonTimes[source];
+                
+            case MsButton :
+                return s.mouseState.buttonTimes[source];
+                
+            default :
+                return 0;
+        }
+    }
+};
+
 struct Binding
 {
     Binding(Input::ButtonCode target = Input::None)
     : target(target)
     {}
     
-    virtual bool sourceActive() const = 0;
-    virtual bool sourceRepeatable() const = 0;
-    
     Input::ButtonCode target;
 };
 
@@ -511,25 +589,20 @@ struct KbBinding : public Binding
     source(data.source)
     {}
     
-    bool sourceActive() const
+    void compile(CompiledBinding &out) const
     {
+        out.kind = CompiledBinding::Key;
+        out.source = source;
+        
         /* Special case aliases */
         if (source == SDL_SCANCODE_LSHIFT)
-            return EventThread::keyStates[source]
-            || EventThread::keyStates[SDL_SCANCODE_RSHIFT];
+            out.alias = SDL_SCANCODE_RSHIFT;
+        else if (source == SDL_SCANCODE_RETURN)
+            out.alias = SDL_SCANCODE_KP_ENTER;
         
-        if (source == SDL_SCANCODE_RETURN)
-            return EventThread::keyStates[source]
-            || EventThread::keyStates[SDL_SCANCODE_KP_ENTER];
-        
-        return EventThread::keyStates[source];
-    }
-    
-    bool sourceRepeatable() const
-    {
-        return true;
+        out.repeatable = true;
         /*
-         return (source >= SDL_SCANCODE_A     && source <= SDL_SCANCODE_0)    ||
+         out.repeatable = (source >= SDL_SCANCODE_A     && source <= SDL_SCANCODE_0)    ||
          (source >= SDL_SCANCODE_RIGHT && source <= SDL_SCANCODE_UP)   ||
          (source >= SDL_SCANCODE_F1    && source <= SDL_SCANCODE_F12);
          */
@@ -542,14 +615,11 @@ struct CtrlButtonBinding : public Binding
 {
     CtrlButtonBinding() {}
     
-    bool sourceActive() const
-    {
-        return EventThread::controllerState.buttons[source];
-    }
-    
-    bool sourceRepeatable() const
+    void compile(CompiledBinding &out) const
     {
-        return true;
+        out.kind = CompiledBinding::CtrlButton;
+        out.source = source;
+        out.repeatable = true;
     }
     
     SDL_GameControllerButton source;
@@ -562,18 +632,12 @@ struct CtrlAxisBinding : public Binding
     CtrlAxisBinding(uint8_t source, AxisDir dir, Input::ButtonCode target)
     : Binding(target), source(source), dir(dir) {}
     
-    bool sourceActive() const
+    void compile(CompiledBinding &out) const
     {
-        float val = EventThread::controllerState.axes[source];
-        
-        if (dir == Negative)
-            return val < -JAXIS_THRESHOLD;
-        else
-            return val > JAXIS_THRESHOLD;
-    }
-    
-    bool sourceRepeatable() const {
-        return true;
+        out.kind = CompiledBinding::CtrlAxis;
+        out.source = source;
+        out.dir = dir;
+        out.repeatable = true;
     }
     
     uint8_t source;
@@ -591,14 +655,11 @@ struct MsBinding : public Binding
     index(buttonIndex)
     {}
     
-    bool sourceActive() const
-    {
-        return EventThread::mouseState.buttons[index];
-    }
-    
-    bool sourceRepeatable() const
+    void compile(CompiledBinding &out) const
     {
-        return true;
+        out.kind = CompiledBinding::MsButton;
+        out.source = index;
+        out.repeatable = true;
     }
     
     int index;
@@ -675,7 +736,7 @@ struct InputPrivate
     std::vector<MsBinding> msBindings;
     
     /* Collective binding array */
-    std::vector<Binding*> bindings;
+    std::vector<CompiledBinding> bindings;
     
     ButtonState stateArray[BUTTON_CODE_COUNT*2];
     
@@ -713,6 +774,19 @@ struct InputPrivate
     unsigned int repeatDelay;
     
     double last_update;
+    
+    /* Input device states, as of the last update */
+    EventThread::InputState devices;
+    
+    /* Converts SDL timestamps to runTime(), renewed every update */
+    double ticksOffset;
+    
+    /* Button presses and releases of the last update, in order */
+    std::vector<EventThread::ButtonEvent> rawEvents;
+    std::vector<Input::Event> events;
+    
+    InputReplay replay;
+    bool replayReported;
 
     int vScrollDistance;
     
@@ -739,8 +813,12 @@ struct InputPrivate
     }
     
     InputPrivate(const RGSSThreadData &rtData)
+    : replay(rtData.config.inputRecord, rtData.config.inputReplay)
     {
         last_update = 0;
+        ticksOffset = 0;
+        replayReported = false;
+        memset(&devices, 0, sizeof(devices));
         
         initStaticKbBindings();
         initMsBindings();
@@ -900,10 +978,22 @@ struct InputPrivate
     }
     
     template<class B>
-    void appendBindings(std::vector<B> &bind)
+    void appendBindings(const std::vector<B> &bind)
     {
         for (size_t i = 0; i < bind.size(); ++i)
-            bindings.push_back(&bind[i]);
+        {
+            /* Unbound sources never change a button */
+            if (bind[i].target == Input::None)
+                continue;
+            
+            CompiledBinding c;
+            c.alias = SDL_SCANCODE_UNKNOWN;
+            c.dir = Negative;
+            c.target = bind[i].target;
+            bind[i].compile(c);
+            
+            bindings.push_back(c);
+        }
     }
     
     void applyBindingDesc(const BDescVec &d)
@@ -989,31 +1079,29 @@ struct InputPrivate
     
     void pollBindings(Input::ButtonCode &repeatCand)
     {
-        for (Binding *bind : bindings) {
+        const CompiledBinding *bind = bindings.data();
+        const size_t count = bindings.size();
+        
+        for (size_t i = 0; i < count; ++i) {
             // Get all binding states
-            pollBindingPriv(*bind, repeatCand);
+            pollBindingPriv(bind[i], repeatCand);
         }
         
-        for (Binding *bind : bindings) {
-            // Check for released buttons, now that all the bindings
-            // have been checked
-            ButtonState &state = getState(bind->target);
-            ButtonState &oldState = getOldState(bind->target);
-            if (!state.pressed && oldState.pressed)
-                state.released = true;
+        // Check for released buttons, now that all the bindings
+        // have been checked. Index 0 is Input::None
+        for (size_t i = 1; i < BUTTON_CODE_COUNT; ++i) {
+            if (!states[i].pressed && statesOld[i].pressed)
+                states[i].released = true;
         }
         
         updateDir4();
         updateDir8();
     }
     
-    void pollBindingPriv(const Binding &b,
+    void pollBindingPriv(const CompiledBinding &b,
                          Input::ButtonCode &repeatCand)
     {
-        if (!b.sourceActive())
-            return;
-        
-        if (b.target == Input::None)
+        if (!b.active(devices))
             return;
         
         ButtonState &state = getState(b.target);
@@ -1023,7 +1111,20 @@ struct InputPrivate
         
         /* Must have been released before to trigger */
         if (!oldState.pressed)
+        {
+            /* Several sources may press the same button,
+             * the earliest one counts */
+            double time = ticksToTime(b.ticks(devices));
+            
+            if (!state.triggered || time < state.pressTime)
+                state.pressTime = time;
+            
             state.triggered = true;
+        }
+        else
+        {
+            state.pressTime = oldState.pressTime;
+        }
         
         /* Unbound keys don't create/break repeat */
         if (repeatCand != Input::None)
@@ -1032,7 +1133,7 @@ struct InputPrivate
         if (repeating != b.target &&
             !oldState.pressed)
         {
-            if (b.sourceRepeatable())
+            if (b.repeatable)
                 repeatCand = b.target;
             else
             /* Unrepeatable keys still break current repeat */
@@ -1040,10 +1141,34 @@ struct InputPrivate
         }
     }
     
+    double ticksToTime(uint32_t ticks) const
+    {
+        if (ticks == 0)
+            return shState->runTime();
+        
+        return ticks / 1000.0 + ticksOffset;
+    }
+    
+    void updateEvents()
+    {
+        events.resize(rawEvents.size());
+        
+        for (size_t i = 0; i < rawEvents.size(); ++i)
+        {
+            const EventThread::ButtonEvent &raw = rawEvents[i];
+            Input::Event &ev = events[i];
+            
+            ev.source = (Input::Event::Source) raw.source;
+            ev.code = raw.code;
+            ev.down = raw.down;
+            ev.time = ticksToTime(raw.ticks);
+        }
+    }
+    
     void updateRaw()
     {
         
-        memcpy(rawStates, shState->eThread().keyStates, SDL_NUM_SCANCODES);
+        memcpy(rawStates, devices.keyStates, SDL_NUM_SCANCODES);
         
         for (int i = 0; i < SDL_NUM_SCANCODES; i++)
         {
@@ -1071,9 +1196,9 @@ struct InputPrivate
     void updateControllerRaw()
     {
         for (int i = 0; i < SDL_CONTROLLER_AXIS_MAX; i++)
-            axisStateArray[i] = shState->eThread().controllerState.axes[i];
+            axisStateArray[i] = devices.controllerState.axes[i];
         
-        memcpy(rawButtonStates, shState->eThread().controllerState.buttons, SDL_CONTROLLER_BUTTON_MAX);
+        memcpy(rawButtonStates, devices.controllerState.buttons, SDL_CONTROLLER_BUTTON_MAX);
         
         for (int i = 0; i < SDL_CONTROLLER_BUTTON_MAX; i++)
         {
@@ -1199,6 +1324,28 @@ void Input::update()
     p->swapBuffers();
     p->clearBuffer();
     
+    /* Both clocks are monotonic, so the offset only drifts
+     * by the millisecond resolution of the SDL timestamps */
+    p->ticksOffset = shState->runTime() - SDL_GetTicks() / 1000.0;
+    
+    shState->eThread().takeButtonEvents(p->rawEvents);
+    shState->eThread().readInputState(p->devices);
+    
+    if (!p->replay.frame(p->devices, p->rawEvents))
+    {
+        /* Stale input until the quit request arrives */
+        if (!p->replayReported)
+        {
+            p->replayReported = true;
+            shState->graphics().finishReplay(p->replay.frameCount());
+        }
+        
+        memset(&p->devices, 0, sizeof(p->devices));
+        p->rawEvents.clear();
+    }
+    
+    p->updateEvents();
+    
     ButtonCode repeatCand = None;
     
     /* Poll all bindings */
@@ -1209,9 +1356,9 @@ void Input::update()
     p->updateControllerRaw();
     
     // Record mouse positions
-    p->mousePos[0] = shState->eThread().mouseState.x;
-    p->mousePos[1] = shState->eThread().mouseState.y;
-    p->mouseInWindow = shState->eThread().mouseState.inWindow;
+    p->mousePos[0] = p->devices.mouseState.x;
+    p->mousePos[1] = p->devices.mouseState.y;
+    p->mouseInWindow = p->devices.mouseState.inWindow;
     
     
     /* Check for new repeating key */
@@ -1292,6 +1439,19 @@ bool Input::isReleased(int button) {
     return p->getStateCheck(button).released;
 }
 
+double Input::pressTime(int button) {
+    const ButtonState &state = p->getStateCheck(button);
+    
+    if (!state.pressed)
+        return 0;
+    
+    return state.pressTime;
+}
+
+const std::vector<Input::Event> &Input::events() const {
+    return p->events;
+}
+
 unsigned int Input::count(int button) {
     if (button != p->repeating)
         return 0;
@@ -1518,6 +1678,16 @@ const char *Input::getButtonName(SDL_GameControllerButton button) {
     return buttonNames[button];
 }
 
+bool Input::replaySeed(unsigned int &seed) const
+{
+    if (p->replay.mode() == InputReplay::Off)
+        return false;
+    
+    seed = p->replay.seed();
+    
+    return true;
+}
+
 Input::~Input()
 {
     delete p;
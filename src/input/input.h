@@ -56,6 +56,24 @@ public:
         MouseX1 = 41, MouseX2 = 42
 	};
     
+	/* Press or release of a key (by scancode), controller
+	 * or mouse button since the previous update */
+	struct Event
+	{
+		enum Source
+		{
+			Key,
+			ControllerButton,
+			MouseButton
+		};
+
+		Source source;
+		int code;
+		bool down;
+		/* As returned by SharedState::runTime() */
+		double time;
+	};
+    
     void recalcRepeat(unsigned int fps);
 
     double getDelta();
@@ -70,6 +88,18 @@ public:
     unsigned int count(int button);
     double repeatTime(int button);
     
+    /* When the button got pressed, in runTime() seconds and
+     * with the precision of the input events rather than the
+     * frame. 0 if it isn't pressed */
+    double pressTime(int button);
+    
+    /* All events of the last update, in the order they happened */
+    const std::vector<Event> &events() const;
+    
+    /* Seed to start the script side random generator with
+     * while recording or playing back input (see 'inputRecord') */
+    bool replaySeed(unsigned int &seed) const;
+    
     bool isPressedEx(int code, bool isVKey);
     bool isTriggeredEx(int code, bool isVKey);
     bool isRepeatedEx(int code, bool isVKey);
@@ -0,0 +1,177 @@
+/*
+** replay.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "replay.h"
+
+#include "debugwriter.h"
+
+#include <SDL_rwops.h>
+#include <SDL_timer.h>
+
+#include <string.h>
+#include <time.h>
+
+/* File layout (little endian):
+ *   magic, u32 seed, then per Input.update
+ *     u8 flag (0: state unchanged, 1: InputState follows)
+ *     [InputState], u32 event count, events
+ * The state is stored as it sits in memory, so recordings
+ * are only meant to be played back by the same build */
+static const char magic[8] = { 'm', 'k', 'x', 'p', 'R', 'P', 'L', '1' };
+
+InputReplay::InputReplay(const std::string &recordPath,
+                         const std::string &playPath)
+    : _mode(Off),
+      ops(0),
+      _seed(0),
+      _finished(false),
+      frames(0)
+{
+	memset(&last, 0, sizeof(last));
+
+	if (!playPath.empty())
+	{
+		ops = SDL_RWFromFile(playPath.c_str(), "rb");
+		char buf[sizeof(magic)];
+
+		if (!ops || SDL_RWread(ops, buf, sizeof(buf), 1) != 1
+		    || memcmp(buf, magic, sizeof(magic)))
+		{
+			Debug() << "Cannot play back input from" << playPath;
+			close();
+			return;
+		}
+
+		_seed = SDL_ReadLE32(ops);
+		_mode = Play;
+	}
+	else if (!recordPath.empty())
+	{
+		ops = SDL_RWFromFile(recordPath.c_str(), "wb");
+
+		if (!ops)
+		{
+			Debug() << "Cannot record input to" << recordPath;
+			return;
+		}
+
+		_seed = (uint32_t) time(0) ^ SDL_GetPerformanceCounter();
+
+		SDL_RWwrite(ops, magic, sizeof(magic), 1);
+		SDL_WriteLE32(ops, _seed);
+		_mode = Record;
+	}
+}
+
+InputReplay::~InputReplay()
+{
+	close();
+}
+
+void InputReplay::close()
+{
+	if (ops)
+		SDL_RWclose(ops);
+
+	ops = 0;
+}
+
+/* Event timestamps are stored relative to the update
+ * they were taken in, so they still line up with the
+ * clock when played back */
+static void writeEvent(SDL_RWops *ops, const EventThread::ButtonEvent &ev,
+                       uint32_t now)
+{
+	SDL_WriteU8(ops, ev.source);
+	SDL_WriteU8(ops, ev.down);
+	SDL_WriteLE32(ops, ev.code);
+	SDL_WriteLE32(ops, now - ev.ticks);
+}
+
+static void readEvent(SDL_RWops *ops, EventThread::ButtonEvent &ev,
+                      uint32_t now)
+{
+	ev.source = (EventThread::ButtonEvent::Source) SDL_ReadU8(ops);
+	ev.down = SDL_ReadU8(ops);
+	ev.code = (int) SDL_ReadLE32(ops);
+	ev.ticks = now - SDL_ReadLE32(ops);
+}
+
+bool InputReplay::frame(EventThread::InputState &state,
+                        std::vector<EventThread::ButtonEvent> &events)
+{
+	if (_mode == Off)
+		return true;
+
+	if (_finished)
+		return false;
+
+	const uint32_t now = SDL_GetTicks();
+
+	if (_mode == Record)
+	{
+		bool changed = memcmp(&state, &last, sizeof(state));
+
+		SDL_WriteU8(ops, changed);
+
+		if (changed)
+		{
+			SDL_RWwrite(ops, &state, sizeof(state), 1);
+			last = state;
+		}
+
+		SDL_WriteLE32(ops, events.size());
+
+		for (size_t i = 0; i < events.size(); ++i)
+			writeEvent(ops, events[i], now);
+
+		++frames;
+
+		return true;
+	}
+
+	uint8_t flag;
+
+	if (SDL_RWread(ops, &flag, 1, 1) != 1)
+	{
+		_finished = true;
+		close();
+
+		return false;
+	}
+
+	if (flag && SDL_RWread(ops, &last, sizeof(last), 1) != 1)
+	{
+		Debug() << "Input recording is truncated";
+		_finished = true;
+		close();
+
+		return false;
+	}
+
+	state = last;
+	events.resize(SDL_ReadLE32(ops));
+
+	for (size_t i = 0; i < events.size(); ++i)
+		readEvent(ops, events[i], now);
+
+	++frames;
+
+	return true;
+}
@@ -0,0 +1,82 @@
+/*
+** replay.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "eventthread.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct SDL_RWops;
+
+/* Records the device state seen by every Input.update into a
+ * file, or plays it back from one in place of the real devices.
+ * Together with the random seed stored in the file, scripts
+ * that only depend on input and frame count run the same
+ * way each time, which makes for repeatable benchmarks */
+class InputReplay
+{
+public:
+	enum Mode
+	{
+		Off,
+		Record,
+		Play
+	};
+
+	/* Playback takes precedence if both paths are given */
+	InputReplay(const std::string &recordPath,
+	            const std::string &playPath);
+	~InputReplay();
+
+	Mode mode() const { return _mode; }
+
+	/* Seed for the script side random generator */
+	uint32_t seed() const { return _seed; }
+
+	/* Called once per Input.update. Stores 'state' and 'events'
+	 * when recording, replaces them with the recorded ones when
+	 * playing back. Returns false once playback has run out */
+	bool frame(EventThread::InputState &state,
+	           std::vector<EventThread::ButtonEvent> &events);
+
+	/* Playback reached the end of the file */
+	bool finished() const { return _finished; }
+
+	/* Input.update calls so far */
+	unsigned int frameCount() const { return frames; }
+
+private:
+	void close();
+
+	Mode _mode;
+	SDL_RWops *ops;
+	uint32_t _seed;
+	bool _finished;
+	unsigned int frames;
+
+	/* Only states that differ from the previous frame are
+	 * written, the others are marked as unchanged */
+	EventThread::InputState last;
+};
+
+#endif // REPLAY_H
@@ -33,6 +33,8 @@
 #include <assert.h>
 #include <string.h>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <unistd.h>
 #include <regex>
 
@@ -41,8 +43,12 @@
 #include "eventthread.h"
 #include "util/debugwriter.h"
 #include "util/exception.h"
+#include "util/sdl-util.h"
+#include "util/trace.h"
+#include "util/startup-timer.h"
 #include "display/gl/gl-debug.h"
 #include "display/gl/gl-fun.h"
+#include "display/gl/gpu-profile.h"
 
 #include "filesystem/filesystem.h"
 
@@ -116,27 +122,63 @@ static void printGLInfo() {
 static SDL_GLContext initGL(SDL_Window *win, Config &conf,
                             RGSSThreadData *threadData);
 
+/* Context attributes for the audio device setup in 'conf' */
+static void alcContextAttribs(const Config &conf, ALCdevice *dev,
+                              std::vector<ALCint> &attribs) {
+  ALCint freq = conf.audioDevice.frequency;
+
+  if (freq > 0) {
+    attribs.push_back(ALC_FREQUENCY);
+    attribs.push_back(freq);
+  } else {
+    alcGetIntegerv(dev, ALC_FREQUENCY, 1, &freq);
+  }
+
+  /* The period is set through the mixing updates per second */
+  if (conf.audioDevice.periodSize > 0 && freq > 0) {
+    attribs.push_back(ALC_REFRESH);
+    attribs.push_back(std::max(freq / conf.audioDevice.periodSize, 1));
+  }
+
+  attribs.push_back(0);
+}
+
 int rgssThreadFun(void *userdata) {
   RGSSThreadData *threadData = static_cast<RGSSThreadData *>(userdata);
+  TRACE_THREAD("RGSS");
 
 #ifdef MKXPZ_INIT_GL_LATER
   threadData->glContext =
       initGL(threadData->window, threadData->config, threadData);
   if (!threadData->glContext)
     return 0;
+
+  StartupTimer::mark("GL context");
 #else
   SDL_GL_MakeCurrent(threadData->window, threadData->glContext);
 #endif
 
   /* Setup AL context */
-  ALCcontext *alcCtx = alcCreateContext(threadData->alcDev, 0);
+  std::vector<ALCint> alcAttribs;
+  alcContextAttribs(threadData->config, threadData->alcDev, alcAttribs);
+
+  ALCcontext *alcCtx = alcCreateContext(threadData->alcDev, alcAttribs.data());
 
   if (!alcCtx) {
     rgssThreadError(threadData, "Error creating OpenAL context");
     return 0;
   }
 
+  if (alcAttribs.size() > 1) {
+    ALCint freq = 0, refresh = 0;
+    alcGetIntegerv(threadData->alcDev, ALC_FREQUENCY, 1, &freq);
+    alcGetIntegerv(threadData->alcDev, ALC_REFRESH, 1, &refresh);
+
+    Debug() << "Audio device:" << freq << "Hz," << refresh << "updates/s";
+  }
+
   alcMakeContextCurrent(alcCtx);
+  StartupTimer::mark("OpenAL context");
 
   try {
     SharedState::initInstance(threadData);
@@ -181,6 +223,22 @@ static void showInitError(const std::string &msg) {
   SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "mkxp-z", msg.c_str(), 0);
 }
 
+/* Switches to SDL's offscreen video driver, which renders into
+ * EGL pbuffers and works without a display. If it isn't there,
+ * the regular driver is brought back and the window stays hidden */
+static void initHeadlessVideo() {
+  SDL_QuitSubSystem(SDL_INIT_VIDEO);
+  SDL_SetHint(SDL_HINT_VIDEODRIVER, "offscreen");
+
+  if (SDL_InitSubSystem(SDL_INIT_VIDEO) == 0)
+    return;
+
+  Debug() << "Offscreen video driver unavailable:" << SDL_GetError();
+
+  SDL_SetHint(SDL_HINT_VIDEODRIVER, "");
+  SDL_InitSubSystem(SDL_INIT_VIDEO);
+}
+
 static void setupWindowIcon(const Config &conf, SDL_Window *win) {
   SDL_RWops *iconSrc;
 
@@ -201,6 +259,76 @@ static void setupWindowIcon(const Config &conf, SDL_Window *win) {
   }
 }
 
+/* Opening the audio device can take a good while (the backend
+ * may have to connect to a sound server), and nothing needs it
+ * until the RGSS thread starts, so it's done in the background */
+struct AudioDeviceOpener {
+  ALCdevice *device;
+  SDL_Thread *thread;
+
+  AudioDeviceOpener() : device(0), thread(0) {}
+
+  ~AudioDeviceOpener() {
+    /* Startup was aborted before the device was used */
+    if (ALCdevice *dev = take())
+      alcCloseDevice(dev);
+  }
+
+  void start() {
+    thread = createSDLThread<AudioDeviceOpener, &AudioDeviceOpener::run>(
+        this, "alcopen");
+
+    if (!thread)
+      run();
+  }
+
+  /* Waits for the device to be opened and hands it over */
+  ALCdevice *take() {
+    if (thread) {
+      SDL_WaitThread(thread, 0);
+      thread = 0;
+    }
+
+    ALCdevice *dev = device;
+    device = 0;
+
+    return dev;
+  }
+
+  void run() { device = alcOpenDevice(0); }
+};
+
+/* Reads the key binding files while the window and
+ * GL context are set up. 'conf' must not change the
+ * binding related options after 'start()' */
+struct BindingLoader {
+  const Config &conf;
+  BDescVec bindings;
+  SDL_Thread *thread;
+
+  BindingLoader(const Config &conf) : conf(conf), thread(0) {}
+
+  ~BindingLoader() { wait(); }
+
+  void start() {
+    thread = createSDLThread<BindingLoader, &BindingLoader::run>(
+        this, "bindload");
+
+    if (!thread)
+      run();
+  }
+
+  void wait() {
+    if (!thread)
+      return;
+
+    SDL_WaitThread(thread, 0);
+    thread = 0;
+  }
+
+  void run() { bindings = loadBindings(conf); }
+};
+
 int main(int argc, char *argv[]) {
     SDL_SetHint(SDL_HINT_VIDEO_MINIMIZE_ON_FOCUS_LOSS, "0");
     SDL_SetHint(SDL_HINT_ACCELEROMETER_AS_JOYSTICK, "0");
@@ -220,6 +348,8 @@ int main(int argc, char *argv[]) {
       return 0;
     }
 
+    StartupTimer::mark("SDL init");
+
 #ifndef WORKDIR_CURRENT
     char dataDir[512]{};
 #if defined(__linux__)
@@ -238,6 +368,14 @@ int main(int argc, char *argv[]) {
     /* now we load the config */
     Config conf;
     conf.read(argc, argv);
+    StartupTimer::mark("config");
+    
+    /* Independent of everything below */
+    AudioDeviceOpener audioDevice;
+    audioDevice.start();
+    
+    if (conf.headless)
+      initHeadlessVideo();
 
 #if defined(__WIN32__)
     // Create a debug console in debug mode
@@ -318,6 +456,8 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
+    StartupTimer::mark("SDL libraries");
+
     SDL_Window *win;
     Uint32 winFlags = SDL_WINDOW_OPENGL | SDL_WINDOW_INPUT_FOCUS | SDL_WINDOW_ALLOW_HIGHDPI;
 
@@ -325,6 +465,8 @@ int main(int argc, char *argv[]) {
       winFlags |= SDL_WINDOW_RESIZABLE;
     if (conf.fullscreen)
       winFlags |= SDL_WINDOW_FULLSCREEN_DESKTOP;
+    if (conf.headless || !conf.inputReplay.empty())
+      winFlags |= SDL_WINDOW_HIDDEN;
     
 #ifdef GLES2_HEADER
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_ES);
@@ -351,6 +493,8 @@ int main(int argc, char *argv[]) {
 #endif
       return 0;
     }
+
+    StartupTimer::mark("window");
     
 #ifdef MKXPZ_BUILD_XCODE
     {
@@ -392,7 +536,13 @@ int main(int argc, char *argv[]) {
     (void)setupWindowIcon;
 #endif
 
-    ALCdevice *alcDev = alcOpenDevice(0);
+    /* The game folder (and with it the bindings location)
+     * is final now; GL initialization runs meanwhile */
+    BindingLoader bindingLoader(conf);
+    bindingLoader.start();
+
+    ALCdevice *alcDev = audioDevice.take();
+    StartupTimer::mark("audio device");
 
     if (!alcDev) {
       showInitError("Could not detect an available audio device.");
@@ -418,6 +568,7 @@ int main(int argc, char *argv[]) {
 
 #ifndef MKXPZ_INIT_GL_LATER
     SDL_GLContext glCtx = initGL(win, conf, 0);
+    StartupTimer::mark("GL context");
 #else
     SDL_GLContext glCtx = NULL;
 #endif
@@ -432,8 +583,10 @@ int main(int argc, char *argv[]) {
     SDL_GL_GetDrawableSize(win, &drwW, &drwH);
     rtData.drawableSizeMsg.post(Vec2i(drwW, drwH));
 
-    /* Load and post key bindings */
-    rtData.bindingUpdateMsg.post(loadBindings(conf));
+    /* Post key bindings */
+    bindingLoader.wait();
+    StartupTimer::mark("key bindings");
+    rtData.bindingUpdateMsg.post(bindingLoader.bindings);
     
 #ifdef MKXPZ_BUILD_XCODE
     // Create Touch Bar
@@ -521,8 +674,10 @@ static SDL_GLContext initGL(SDL_Window *win, Config &conf,
     return 0;
   }
 
+  gpuProfile.load(conf);
+
   try {
-    initGLFunctions();
+    initGLFunctions(gpuProfile);
   } catch (const Exception &exc) {
     GLINIT_SHOWERROR(exc.msg);
     SDL_GL_DeleteContext(glCtx);
@@ -537,6 +692,9 @@ static SDL_GLContext initGL(SDL_Window *win, Config &conf,
     gl.BlitFramebuffer = 0;
 #endif
 
+  gpuProfile.measure();
+  gpuProfile.apply(conf);
+
   gl.ClearColor(0, 0, 0, 1);
   gl.Clear(GL_COLOR_BUFFER_BIT);
   SDL_GL_SwapWindow(win);
@@ -544,6 +702,8 @@ static SDL_GLContext initGL(SDL_Window *win, Config &conf,
   printGLInfo();
 
   bool vsync = conf.vsync || conf.syncToRefreshrate;
+  if (conf.headless || !conf.inputReplay.empty())
+    vsync = false;
   SDL_GL_SetSwapInterval(vsync ? 1 : 0);
 
   // GLDebugLogger dLogger;
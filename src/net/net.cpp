@@ -10,8 +10,25 @@
 #if defined(MKXPZ_SSL)
 #define CPPHTTPLIB_OPENSSL_SUPPORT
 #endif
+/* Compressed responses are decoded as they arrive */
+#define CPPHTTPLIB_ZLIB_SUPPORT
+#if defined(MKXPZ_BROTLI)
+#define CPPHTTPLIB_BROTLI_SUPPORT
+#endif
 #include "httplib.h"
 
+#include <zlib.h>
+#include <time.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "util/exception.h"
 
 #include "LUrlParser.h"
@@ -112,46 +129,402 @@ StringMap &HTTPRequest::headers() {
     return _headers;
 }
 
+/* Reused connections, so repeated requests to the same
+ * server skip the DNS lookup and the TCP / TLS handshakes */
+class ClientPool {
+public:
+    static ClientPool &instance() {
+        /* Never destroyed, background requests may outlive main() */
+        static ClientPool *pool = new ClientPool;
+        return *pool;
+    }
+    
+    httplib::Client *acquire(const std::string &host) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            
+            auto it = idle.find(host);
+            if (it != idle.end()) {
+                httplib::Client *client = it->second;
+                idle.erase(it);
+                return client;
+            }
+        }
+        
+        httplib::Client *client = nullptr;
+        try {
+            client = new httplib::Client(host.c_str());
+        }
+        catch (std::exception &e) {
+            delete client;
+            throw Exception(Exception::MKXPError, "Failed to create HTTP client (%s)", e.what());
+        }
+        
+        // Seems to need to be disabled for now, at least on macOS
+#ifdef MKXPZ_SSL
+        client->enable_server_certificate_verification(false);
+#endif
+        client->set_keep_alive(true);
+        
+        return client;
+    }
+    
+    void release(const std::string &host, httplib::Client *client) {
+        std::lock_guard<std::mutex> lock(mutex);
+        
+        if (idle.count(host) >= MaxIdlePerHost) {
+            delete client;
+            return;
+        }
+        
+        idle.emplace(host, client);
+    }
+    
+private:
+    /* Idle clients kept per scheme://host:port */
+    static const size_t MaxIdlePerHost = 4;
+    
+    std::mutex mutex;
+    std::unordered_multimap<std::string, httplib::Client*> idle;
+};
+
+/* A client checked out for one request. It goes back to
+ * the pool only if the request went through; after an
+ * error, its connection state is unknown */
+struct PooledClient {
+    std::string host;
+    httplib::Client *client;
+    bool reusable;
+    
+    PooledClient(const std::string &host) :
+        host(host),
+        client(ClientPool::instance().acquire(host)),
+        reusable(false)
+    {}
+    
+    ~PooledClient() {
+        if (reusable)
+            ClientPool::instance().release(host, client);
+        else
+            delete client;
+    }
+    
+    httplib::Client *operator->() { return client; }
+};
+
+#ifdef CPPHTTPLIB_BROTLI_SUPPORT
+static const char *acceptEncoding = "br, gzip, deflate";
+#else
+static const char *acceptEncoding = "gzip, deflate";
+#endif
+
+/* Unless the caller asked for something else */
+static void acceptCompressed(httplib::Headers &head) {
+    if (head.find("Accept-Encoding") == head.end())
+        head.emplace("Accept-Encoding", acceptEncoding);
+}
+
+/* On-disk cache for GET responses, see setHTTPCacheDirectory() */
+namespace HTTPCache {
+
+/* Entry layout (little endian):
+ *   char[8]  magic
+ *   int64    time stored / last revalidated
+ *   int64    seconds fresh from then on
+ *   uint32   status
+ *   string   key
+ *   uint32   header count, followed by name / value strings
+ *   string   body
+ * where each string is a uint32 length followed by its bytes */
+static const char entryMagic[8] = { 'M', 'K', 'X', 'P', 'H', 'T', 'C', '1' };
+
+struct Entry {
+    int64_t stored;
+    int64_t maxAge;
+    int status;
+    std::string key;
+    StringMap headers;
+    std::string body;
+};
+
+static std::mutex mutex;
+static std::string directory;
+
+/* The request headers are part of the key, they may change the response */
+static std::string makeKey(const std::string &url, const StringMap &headers) {
+    std::map<std::string, std::string> sorted(headers.begin(), headers.end());
+    std::string key = url;
+    
+    for (auto const &h : sorted)
+        key += "\n" + h.first + ": " + h.second;
+    
+    return key;
+}
+
+static std::string entryPath(const std::string &key) {
+    /* FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    
+    for (size_t i = 0; i < key.size(); ++i) {
+        hash ^= (uint8_t) key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long) hash);
+    
+    return directory + "/" + name;
+}
+
+static bool writeU64(FILE *f, uint64_t value) {
+    unsigned char buf[8];
+    for (int i = 0; i < 8; ++i)
+        buf[i] = (unsigned char) (value >> (i * 8));
+    return fwrite(buf, 1, 8, f) == 8;
+}
+
+static bool readU64(FILE *f, uint64_t &value) {
+    unsigned char buf[8];
+    if (fread(buf, 1, 8, f) != 8)
+        return false;
+    value = 0;
+    for (int i = 7; i >= 0; --i)
+        value = (value << 8) | buf[i];
+    return true;
+}
+
+static bool writeU32(FILE *f, uint32_t value) {
+    unsigned char buf[4];
+    for (int i = 0; i < 4; ++i)
+        buf[i] = (unsigned char) (value >> (i * 8));
+    return fwrite(buf, 1, 4, f) == 4;
+}
+
+static bool readU32(FILE *f, uint32_t &value) {
+    unsigned char buf[4];
+    if (fread(buf, 1, 4, f) != 4)
+        return false;
+    value = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+    return true;
+}
+
+static bool writeString(FILE *f, const std::string &str) {
+    return writeU32(f, str.size()) &&
+        (str.empty() || fwrite(str.data(), 1, str.size(), f) == str.size());
+}
+
+static bool readString(FILE *f, std::string &str, uint32_t maxSize) {
+    uint32_t size;
+    if (!readU32(f, size) || size > maxSize)
+        return false;
+    str.resize(size);
+    return size == 0 || fread(&str[0], 1, size, f) == size;
+}
+
+static bool load(const std::string &key, Entry &entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    FILE *f = fopen(entryPath(key).c_str(), "rb");
+    
+    if (!f)
+        return false;
+    
+    char magic[sizeof(entryMagic)];
+    uint64_t stored, maxAge;
+    uint32_t status, headerCount;
+    
+    bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+        !memcmp(magic, entryMagic, sizeof(magic)) &&
+        readU64(f, stored) && readU64(f, maxAge) && readU32(f, status) &&
+        readString(f, entry.key, 1 << 16) && entry.key == key &&
+        readU32(f, headerCount) && headerCount < 1024;
+    
+    for (uint32_t i = 0; ok && i < headerCount; ++i) {
+        std::string name, value;
+        ok = readString(f, name, 1 << 16) && readString(f, value, 1 << 16);
+        entry.headers[name] = value;
+    }
+    
+    ok = ok && readString(f, entry.body, 0x7fffffff);
+    
+    fclose(f);
+    
+    entry.stored = (int64_t) stored;
+    entry.maxAge = (int64_t) maxAge;
+    entry.status = status;
+    
+    return ok;
+}
+
+static void store(const Entry &entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    /* Written aside first, so readers never see half an entry */
+    const std::string path = entryPath(entry.key);
+    const std::string tmpPath = path + ".tmp";
+    
+    FILE *f = fopen(tmpPath.c_str(), "wb");
+    
+    if (!f)
+        return;
+    
+    bool ok = fwrite(entryMagic, 1, sizeof(entryMagic), f) == sizeof(entryMagic) &&
+        writeU64(f, entry.stored) && writeU64(f, entry.maxAge) &&
+        writeU32(f, entry.status) && writeString(f, entry.key) &&
+        writeU32(f, entry.headers.size());
+    
+    for (auto const &h : entry.headers)
+        ok = ok && writeString(f, h.first) && writeString(f, h.second);
+    
+    ok = ok && writeString(f, entry.body);
+    ok = (fclose(f) == 0) && ok;
+    
+    if (ok) {
+        remove(path.c_str());
+        ok = rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+    
+    if (!ok)
+        remove(tmpPath.c_str());
+}
+
+/* Header names are case-insensitive */
+static StringMap::iterator findHeader(StringMap &headers, const char *name) {
+    for (auto it = headers.begin(); it != headers.end(); ++it)
+        if (!strcasecmp(it->first.c_str(), name))
+            return it;
+    
+    return headers.end();
+}
+
+static void eraseHeader(StringMap &headers, const char *name) {
+    auto it = findHeader(headers, name);
+    
+    if (it != headers.end())
+        headers.erase(it);
+}
+
+/* Seconds the response may be used without asking the server again,
+ * 0 to always revalidate, or -1 if it mustn't be stored at all */
+static int64_t freshness(const httplib::Response &response) {
+    const std::string cc = response.get_header_value("Cache-Control");
+    
+    if (cc.find("no-store") != std::string::npos)
+        return -1;
+    
+    if (cc.find("no-cache") != std::string::npos)
+        return 0;
+    
+    const size_t pos = cc.find("max-age=");
+    
+    if (pos != std::string::npos)
+        return std::max(0L, strtol(cc.c_str() + pos + 8, 0, 10));
+    
+    /* Without a lifetime, only worth keeping to revalidate */
+    if (response.has_header("ETag") || response.has_header("Last-Modified"))
+        return 0;
+    
+    return -1;
+}
+
+} // namespace HTTPCache
+
+void mkxp_net::setHTTPCacheDirectory(const char *path) {
+    std::lock_guard<std::mutex> lock(HTTPCache::mutex);
+    
+    HTTPCache::directory = path ? path : "";
+}
+
 HTTPResponse HTTPRequest::get() {
     HTTPResponse ret;
     auto target = readURL(destination.c_str());
     
-    httplib::Client *client = nullptr;
-    try {
-        client = new httplib::Client(getHost(target).c_str());
+    bool useCache;
+    {
+        std::lock_guard<std::mutex> lock(HTTPCache::mutex);
+        useCache = !HTTPCache::directory.empty() &&
+            HTTPCache::findHeader(_headers, "Authorization") == _headers.end();
     }
-    catch (std::exception &e) {
-        delete client;
-        throw Exception(Exception::MKXPError, "Failed to create HTTP client (%s)", e.what());
+    
+    const std::string cacheKey = useCache ? HTTPCache::makeKey(destination, _headers) : std::string();
+    HTTPCache::Entry cached;
+    const bool haveCached = useCache && HTTPCache::load(cacheKey, cached);
+    const int64_t now = time(0);
+    
+    if (haveCached && now >= cached.stored && now - cached.stored < cached.maxAge) {
+        ret._status = cached.status;
+        ret._body.swap(cached.body);
+        ret._headers.swap(cached.headers);
+        return ret;
     }
     
+    PooledClient client(getHost(target));
     httplib::Headers head;
     
-    // Seems to need to be disabled for now, at least on macOS
-#ifdef MKXPZ_SSL
-    client->enable_server_certificate_verification(false);
-#endif
     client->set_follow_location(follow_location);
     
     for (auto const &h : _headers)
         head.emplace(h.first, h.second);
+    
+    acceptCompressed(head);
+    
+    /* Stale, but the server may tell us it hasn't changed */
+    if (haveCached) {
+        auto etag = HTTPCache::findHeader(cached.headers, "ETag");
+        auto modified = HTTPCache::findHeader(cached.headers, "Last-Modified");
+        
+        if (etag != cached.headers.end())
+            head.emplace("If-None-Match", etag->second);
+        if (modified != cached.headers.end())
+            head.emplace("If-Modified-Since", modified->second);
+    }
         
     if (auto result = client->Get(getPath(target).c_str(), head)) {
         auto response = result.value();
+        
+        client.reusable = true;
+        
+        if (haveCached && response.status == 304) {
+            cached.stored = now;
+            cached.maxAge = std::max<int64_t>(HTTPCache::freshness(response), 0);
+            HTTPCache::store(cached);
+            
+            ret._status = cached.status;
+            ret._body.swap(cached.body);
+            ret._headers.swap(cached.headers);
+            return ret;
+        }
+        
         ret._status = response.status;
         ret._body = response.body;
         
         for (auto const &h : response.headers)
             ret._headers.emplace(h.first, h.second);
+        
+        int64_t maxAge;
+        
+        if (useCache && response.status == 200 && (maxAge = HTTPCache::freshness(response)) >= 0) {
+            HTTPCache::Entry entry;
+            entry.stored = now;
+            entry.maxAge = maxAge;
+            entry.status = response.status;
+            entry.key = cacheKey;
+            entry.headers = ret._headers;
+            entry.body = ret._body;
+            
+            /* The body is kept decoded */
+            HTTPCache::eraseHeader(entry.headers, "Content-Encoding");
+            HTTPCache::eraseHeader(entry.headers, "Content-Length");
+            
+            HTTPCache::store(entry);
+        }
     }
     else {
         int err = result.error();
         const char *errname = httpErrorNames[err];
-        delete client;
         throw Exception(Exception::MKXPError, "Failed to GET %s (%i: %s)", destination.c_str(), err, errname);
     }
     
-    delete client;
     return ret;
 }
 
@@ -159,27 +532,17 @@ HTTPResponse HTTPRequest::post(StringMap &postData) {
     HTTPResponse ret;
     auto target = readURL(destination.c_str());
     
-    httplib::Client *client = nullptr;
-    try {
-        client = new httplib::Client(getHost(target).c_str());
-    }
-    catch (std::exception &e) {
-        delete client;
-        throw Exception(Exception::MKXPError, "Failed to create HTTP client (%s)", e.what());
-    }
-    
+    PooledClient client(getHost(target));
     httplib::Headers head;
     httplib::Params params;
     
-    // Seems to need to be disabled for now, at least on macOS
-#ifdef MKXPZ_SSL
-    client->enable_server_certificate_verification(false);
-#endif
     client->set_follow_location(follow_location);
     
     for (auto const &h : _headers)
         head.emplace(h.first, h.second);
     
+    acceptCompressed(head);
+    
     for (auto const &p : postData)
         params.emplace(p.first, p.second);
     
@@ -188,16 +551,16 @@ HTTPResponse HTTPRequest::post(StringMap &postData) {
         ret._status = response.status;
         ret._body = response.body;
         
-        for (auto h : response.headers)
+        for (auto const &h : response.headers)
             ret._headers.emplace(h.first, h.second);
+        
+        client.reusable = true;
     }
     else {
         int err = result.error();
         const char *errname = httpErrorNames[err];
-        delete client;
         throw Exception(Exception::MKXPError, "Failed to POST %s (%i: %s)", destination.c_str(), err, errname);
     }
-    delete client;
     return ret;
 }
 
@@ -205,25 +568,15 @@ HTTPResponse HTTPRequest::post(const char *body, const char *content_type) {
     HTTPResponse ret;
     auto target = readURL(destination.c_str());
     
-    httplib::Client *client = nullptr;
-    try {
-        client = new httplib::Client(getHost(target).c_str());
-    }
-    catch (std::exception &e) {
-        delete client;
-        throw Exception(Exception::MKXPError, "Failed to create HTTP client (%s)", e.what());
-    }
-    
+    PooledClient client(getHost(target));
     httplib::Headers head;
     
-    // Seems to need to be disabled for now, at least on macOS
-#ifdef MKXPZ_SSL
-    client->enable_server_certificate_verification(false);
-#endif
     client->set_follow_location(true);
     
     for (auto const &h : _headers)
         head.emplace(h.first, h.second);
+    
+    acceptCompressed(head);
 
     if (auto result = client->Post(getPath(target).c_str(), head, body, content_type)) {
         auto response = result.value();
@@ -232,12 +585,311 @@ HTTPResponse HTTPRequest::post(const char *body, const char *content_type) {
         
         for (auto const &h : response.headers)
             ret._headers.emplace(h.first, h.second);
+        
+        client.reusable = true;
     }
     else {
         int err = result.error();
-        delete client;
         throw Exception(Exception::MKXPError, "Failed to POST %s (%i: %s)", destination.c_str(), err, httpErrorNames[err]);
     }
-    delete client;
     return ret;
 }
+
+HTTPResponse HTTPRequest::download(const char *path, bool resume,
+                                   const DownloadProgress &progress,
+                                   const uint32_t *expectedCRC32) {
+    HTTPResponse ret;
+    auto target = readURL(destination.c_str());
+    
+    PooledClient client(getHost(target));
+    httplib::Headers head;
+    
+    client->set_follow_location(follow_location);
+    
+    for (auto const &h : _headers)
+        head.emplace(h.first, h.second);
+    
+    /* Continue where an earlier attempt stopped */
+    uint64_t offset = 0;
+    
+    if (resume) {
+        if (FILE *f = fopen(path, "rb")) {
+            if (fseek(f, 0, SEEK_END) == 0) {
+                long size = ftell(f);
+                offset = size > 0 ? size : 0;
+            }
+            fclose(f);
+        }
+    }
+    
+    if (offset > 0)
+        head.emplace("Range", "bytes=" + std::to_string(offset) + "-");
+    
+    FILE *out = nullptr;
+    bool openFailed = false;
+    bool writeFailed = false;
+    
+    auto result = client->Get(getPath(target).c_str(), head,
+        [&](const httplib::Response &response) {
+            /* Error pages aren't written to the file */
+            if (response.status != 200 && response.status != 206)
+                return true;
+            
+            /* The server may ignore the range and send everything */
+            const bool append = (offset > 0 && response.status == 206);
+            
+            if (!append)
+                offset = 0;
+            
+            out = fopen(path, append ? "ab" : "wb");
+            openFailed = !out;
+            
+            return !openFailed;
+        },
+        [&](const char *data, size_t length) {
+            if (!out)
+                return true;
+            
+            writeFailed = (fwrite(data, 1, length, out) != length);
+            
+            return !writeFailed;
+        },
+        [&](uint64_t current, uint64_t total) {
+            if (!progress)
+                return true;
+            
+            return progress(offset + current, total ? offset + total : 0);
+        });
+    
+    if (out)
+        fclose(out);
+    
+    if (openFailed || writeFailed)
+        throw Exception(Exception::MKXPError, "Failed to write %s", path);
+    
+    if (!result) {
+        int err = result.error();
+        throw Exception(Exception::MKXPError, "Failed to download %s (%i: %s)", destination.c_str(), err, httpErrorNames[err]);
+    }
+    
+    auto response = result.value();
+    ret._status = response.status;
+    
+    for (auto const &h : response.headers)
+        ret._headers.emplace(h.first, h.second);
+    
+    client.reusable = true;
+    
+    if (expectedCRC32 && (ret._status == 200 || ret._status == 206)) {
+        uint32_t crc;
+        
+        if (!fileCRC32(path, crc) || crc != *expectedCRC32) {
+            /* Resuming a corrupt file would never succeed */
+            remove(path);
+            throw Exception(Exception::MKXPError, "Checksum mismatch for %s", path);
+        }
+    }
+    
+    return ret;
+}
+
+bool mkxp_net::fileCRC32(const char *path, uint32_t &crc) {
+    FILE *f = fopen(path, "rb");
+    
+    if (!f)
+        return false;
+    
+    std::vector<unsigned char> buffer(64 * 1024);
+    uLong value = crc32(0L, Z_NULL, 0);
+    size_t n;
+    
+    while ((n = fread(&buffer[0], 1, buffer.size(), f)) > 0)
+        value = crc32(value, &buffer[0], n);
+    
+    const bool ok = !ferror(f);
+    fclose(f);
+    
+    crc = value;
+    
+    return ok;
+}
+
+struct mkxp_net::HTTPTaskState {
+    HTTPRequest request;
+    HTTPTask::Method method;
+    
+    StringMap postData;
+    std::string body;
+    std::string contentType;
+    
+    std::string downloadPath;
+    bool resume;
+    bool checkCRC;
+    uint32_t expectedCRC;
+    std::atomic<uint64_t> received;
+    std::atomic<uint64_t> total;
+    
+    HTTPResponse response;
+    std::string error;
+    bool failed;
+    
+    /* Set by the worker once the fields above are final */
+    std::atomic<bool> done;
+    std::mutex doneMutex;
+    std::condition_variable doneCond;
+    
+    HTTPTaskState(const HTTPRequest &request, HTTPTask::Method method) :
+        request(request),
+        method(method),
+        resume(false),
+        checkCRC(false),
+        expectedCRC(0),
+        received(0),
+        total(0),
+        failed(false),
+        done(false)
+    {}
+    
+    void run() {
+        try {
+            switch (method) {
+                case HTTPTask::Get:
+                    response = request.get();
+                    break;
+                case HTTPTask::Post:
+                    response = request.post(postData);
+                    break;
+                case HTTPTask::PostBody:
+                    response = request.post(body.c_str(), contentType.c_str());
+                    break;
+                case HTTPTask::Download:
+                    response = request.download(downloadPath.c_str(), resume,
+                        [this](uint64_t cur, uint64_t tot) {
+                            received = cur;
+                            total = tot;
+                            return true;
+                        }, checkCRC ? &expectedCRC : 0);
+                    break;
+            }
+        }
+        catch (const Exception &e) {
+            error = e.msg;
+            failed = true;
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(doneMutex);
+            done.store(true, std::memory_order_release);
+        }
+        
+        doneCond.notify_all();
+    }
+};
+
+/* Carries out HTTPTasks in the background */
+class HTTPWorker {
+public:
+    static HTTPWorker &instance() {
+        /* Never destroyed, so threads stuck in
+         * a slow request can't hold up exit */
+        static HTTPWorker *worker = new HTTPWorker;
+        return *worker;
+    }
+    
+    void submit(const std::shared_ptr<HTTPTaskState> &task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(task);
+        }
+        
+        cond.notify_one();
+    }
+    
+private:
+    static const int ThreadCount = 2;
+    
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::shared_ptr<HTTPTaskState> > queue;
+    
+    HTTPWorker() {
+        for (int i = 0; i < ThreadCount; ++i)
+            std::thread(&HTTPWorker::work, this).detach();
+    }
+    
+    void work() {
+        for (;;) {
+            std::shared_ptr<HTTPTaskState> task;
+            
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return !queue.empty(); });
+                
+                task = queue.front();
+                queue.pop_front();
+            }
+            
+            task->run();
+        }
+    }
+};
+
+HTTPTask::HTTPTask(const HTTPRequest &request, Method method) :
+    state(std::make_shared<HTTPTaskState>(request, method)),
+    started(false)
+{}
+
+HTTPTask::~HTTPTask() {}
+
+StringMap &HTTPTask::postData() {
+    return state->postData;
+}
+
+void HTTPTask::setBody(const char *body, const char *content_type) {
+    state->body = body;
+    state->contentType = content_type;
+}
+
+void HTTPTask::setDownload(const char *path, bool resume,
+                           const uint32_t *expectedCRC32) {
+    state->downloadPath = path;
+    state->resume = resume;
+    state->checkCRC = (expectedCRC32 != 0);
+    state->expectedCRC = expectedCRC32 ? *expectedCRC32 : 0;
+}
+
+void HTTPTask::start() {
+    if (started)
+        return;
+    
+    started = true;
+    HTTPWorker::instance().submit(state);
+}
+
+void HTTPTask::wait() {
+    start();
+    
+    std::unique_lock<std::mutex> lock(state->doneMutex);
+    state->doneCond.wait(lock, [this] { return done(); });
+}
+
+bool HTTPTask::done() const {
+    return state->done.load(std::memory_order_acquire);
+}
+
+bool HTTPTask::failed() const {
+    return done() && state->failed;
+}
+
+const std::string &HTTPTask::error() const {
+    return state->error;
+}
+
+HTTPResponse &HTTPTask::response() {
+    return state->response;
+}
+
+void HTTPTask::progress(uint64_t &received, uint64_t &total) const {
+    received = state->received;
+    total = state->total;
+}
@@ -10,11 +10,28 @@
 
 #include <unordered_map>
 #include <string>
+#include <memory>
+#include <functional>
+#include <stdint.h>
 
 namespace mkxp_net {
 
 typedef std::unordered_map<std::string, std::string> StringMap;
 
+/* Called as a download proceeds, 'total' is 0 if unknown.
+ * Returning false cancels the download */
+typedef std::function<bool(uint64_t received, uint64_t total)> DownloadProgress;
+
+/* CRC-32 (as computed by zlib) of the file at 'path' */
+bool fileCRC32(const char *path, uint32_t &crc);
+
+/* GET responses are kept in the existing directory at 'path' and reused
+ * as Cache-Control allows, or revalidated by ETag / Last-Modified.
+ * Empty or null turns the cache off (the default) */
+void setHTTPCacheDirectory(const char *path);
+
+struct HTTPTaskState;
+
 class HTTPResponse {
 public:
     int status();
@@ -29,6 +46,7 @@ private:
     HTTPResponse();
     
     friend class HTTPRequest;
+    friend struct HTTPTaskState;
 };
 
 class HTTPRequest {
@@ -43,10 +61,105 @@ public:
     HTTPResponse get();
     HTTPResponse post(StringMap &postData);
     HTTPResponse post(const char *body, const char *content_type);
+    
+    /* Writes the body to the file at 'path' as it arrives instead of
+     * keeping it in the response. With 'resume', an existing partial
+     * file is completed with a Range request. If 'expectedCRC32' is
+     * given and doesn't match, the file is deleted and an error thrown */
+    HTTPResponse download(const char *path, bool resume,
+                          const DownloadProgress &progress = DownloadProgress(),
+                          const uint32_t *expectedCRC32 = 0);
 private:
     StringMap _headers;
     bool follow_location;
 };
+
+/* A request carried out on a background thread (connections are
+ * pooled either way). Poll 'done()'; once it returns true,
+ * 'response()' holds the result, unless 'failed()' */
+class HTTPTask {
+public:
+    enum Method {
+        Get,
+        Post,
+        PostBody,
+        Download
+    };
+    
+    HTTPTask(const HTTPRequest &request, Method method);
+    ~HTTPTask();
+    
+    /* Request data for 'Post' / 'PostBody', set before 'start()' */
+    StringMap &postData();
+    void setBody(const char *body, const char *content_type);
+    /* For 'Download', see HTTPRequest::download() */
+    void setDownload(const char *path, bool resume,
+                     const uint32_t *expectedCRC32 = 0);
+    
+    void start();
+    
+    /* Blocks until the request has finished */
+    void wait();
+    
+    bool done() const;
+    bool failed() const;
+    const std::string &error() const;
+    HTTPResponse &response();
+    
+    /* Bytes of a download written so far, and the expected
+     * size (0 if unknown). Safe to call while in progress */
+    void progress(uint64_t &received, uint64_t &total) const;
+    
+private:
+    /* Shared with the worker, which may still be
+     * busy with it when the task is destroyed */
+    std::shared_ptr<HTTPTaskState> state;
+    bool started;
+};
+
+struct SocketState;
+
+/* A UDP or WebSocket (ws://) connection, serviced by one background
+ * I/O thread shared by all sockets. Messages pass to and from it through
+ * fixed-size lock-free queues, so sending and receiving never block;
+ * the game drains the inbound queue once per frame */
+class Socket {
+public:
+    enum State {
+        Connecting,
+        Open,
+        Closed
+    };
+    
+    struct Message {
+        std::string data;
+        /* Always true for UDP; WebSocket text frames are false */
+        bool binary;
+    };
+    
+    /* Datagrams to and from 'host':'port', sent from 'localPort' (0 for any) */
+    Socket(const char *host, int port, int localPort = 0);
+    /* WebSocket connection to a ws:// URL */
+    Socket(const char *url, const StringMap &headers);
+    /* Closes the connection */
+    ~Socket();
+    
+    /* Queues 'data' to be sent. Messages queued while still connecting
+     * go out once open. False if closed or the outbound queue is full */
+    bool send(const char *data, size_t size, bool binary = true);
+    
+    /* Takes the oldest received message, false if there is none */
+    bool receive(Message &msg);
+    
+    State state() const;
+    /* Why the connection closed, empty if it was closed normally */
+    const std::string &error() const;
+    
+    void close();
+    
+private:
+    std::shared_ptr<SocketState> sstate;
+};
 }
 
 #endif /* net_h */
@@ -0,0 +1,857 @@
+//
+//  socket.cpp
+//  mkxp-z
+//
+//  UDP and WebSocket connections for real-time networking.
+//
+
+/* Same as in net.cpp, httplib's classes depend on these */
+#if defined(MKXPZ_SSL)
+#define CPPHTTPLIB_OPENSSL_SUPPORT
+#endif
+#define CPPHTTPLIB_ZLIB_SUPPORT
+#if defined(MKXPZ_BROTLI)
+#define CPPHTTPLIB_BROTLI_SUPPORT
+#endif
+#include "httplib.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "util/exception.h"
+
+#include "LUrlParser.h"
+#include "net.h"
+
+using namespace mkxp_net;
+
+/* From net.cpp */
+LUrlParser::ParseURL readURL(const char *url);
+std::string getPath(LUrlParser::ParseURL url);
+
+#ifdef MSG_NOSIGNAL
+#define SOCKET_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SOCKET_SEND_FLAGS 0
+#endif
+
+/* Larger incoming messages close the connection */
+#define MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
+/* Encoded WebSocket frames waiting on a slow connection; past
+ * this, further messages stay in the outbound queue */
+#define MAX_WRITE_BACKLOG (256 * 1024)
+
+#define HANDSHAKE_TIMEOUT 10
+
+static const char *wsGUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+enum WSOpcode {
+    WSContinuation = 0x0,
+    WSText = 0x1,
+    WSBinary = 0x2,
+    WSClose = 0x8,
+    WSPing = 0x9,
+    WSPong = 0xA
+};
+
+/* Single producer, single consumer. Neither side ever
+ * waits on the other; a full queue refuses new messages */
+class MessageQueue {
+public:
+    MessageQueue() : head(0), tail(0) {}
+    
+    /* Producer side. Takes the contents of 'msg' on success */
+    bool push(Socket::Message &msg) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        const size_t next = (h + 1) % Capacity;
+        
+        if (next == tail.load(std::memory_order_acquire))
+            return false;
+        
+        slots[h].data.swap(msg.data);
+        slots[h].binary = msg.binary;
+        head.store(next, std::memory_order_release);
+        
+        return true;
+    }
+    
+    bool full() const {
+        const size_t next = (head.load(std::memory_order_relaxed) + 1) % Capacity;
+        
+        return next == tail.load(std::memory_order_acquire);
+    }
+    
+    /* Consumer side */
+    bool pop(Socket::Message &msg) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        
+        if (t == head.load(std::memory_order_acquire))
+            return false;
+        
+        msg.data.clear();
+        msg.data.swap(slots[t].data);
+        msg.binary = slots[t].binary;
+        tail.store((t + 1) % Capacity, std::memory_order_release);
+        
+        return true;
+    }
+
+
+private:
+    static const size_t Capacity = 512;
+    
+    Socket::Message slots[Capacity];
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+};
+
+struct mkxp_net::SocketState {
+    bool udp;
+    std::string host;
+    int port;
+    int localPort;
+    std::string path;
+    StringMap headers;
+    
+    socket_t sock;
+    
+    /* Socket::State. 'error' is final once this reads Closed */
+    std::atomic<int> state;
+    std::string error;
+    
+    std::atomic<bool> closeRequested;
+    
+    MessageQueue inbound;
+    MessageQueue outbound;
+    
+    /* Only touched by the I/O thread once open */
+    std::string readBuf;
+    std::string writeBuf;
+    std::string fragment;
+    bool fragmentBinary;
+    
+    SocketState() :
+        udp(false),
+        port(0),
+        localPort(0),
+        sock(INVALID_SOCKET),
+        state(Socket::Connecting),
+        closeRequested(false),
+        fragmentBinary(false)
+    {}
+    
+    void fail(const std::string &why) {
+        if (sock != INVALID_SOCKET)
+            httplib::detail::close_socket(sock);
+        
+        sock = INVALID_SOCKET;
+        error = why;
+        state.store(Socket::Closed, std::memory_order_release);
+    }
+    
+    void connect();
+    bool handshake();
+};
+
+static uint32_t rotl(uint32_t value, int bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+/* Only used to check the WebSocket handshake */
+static std::string sha1(const std::string &in) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    
+    std::string msg = in;
+    const uint64_t bits = (uint64_t) in.size() * 8;
+    
+    msg += (char) 0x80;
+    while (msg.size() % 64 != 56)
+        msg += (char) 0;
+    for (int i = 7; i >= 0; --i)
+        msg += (char) (bits >> (i * 8));
+    
+    for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+        uint32_t w[80];
+        
+        for (int i = 0; i < 16; ++i) {
+            const unsigned char *p = (const unsigned char*) &msg[chunk + i * 4];
+            w[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+                   ((uint32_t) p[2] << 8) | p[3];
+        }
+        
+        for (int i = 16; i < 80; ++i)
+            w[i] = rotl(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+        
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            
+            const uint32_t t = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = t;
+        }
+        
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    
+    std::string out;
+    for (int i = 0; i < 5; ++i)
+        for (int j = 3; j >= 0; --j)
+            out += (char) (h[i] >> (j * 8));
+    
+    return out;
+}
+
+static bool wouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static bool bindLocal(socket_t sock, int family, int port) {
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    
+    socklen_t len;
+    
+    if (family == AF_INET6) {
+        sockaddr_in6 *in6 = (sockaddr_in6*) &addr;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr = in6addr_any;
+        in6->sin6_port = htons(port);
+        len = sizeof(sockaddr_in6);
+    }
+    else {
+        sockaddr_in *in = (sockaddr_in*) &addr;
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = htonl(INADDR_ANY);
+        in->sin_port = htons(port);
+        len = sizeof(sockaddr_in);
+    }
+    
+    return bind(sock, (sockaddr*) &addr, len) == 0;
+}
+
+/* Resolves 'host' and connects to the first address that takes.
+ * UDP sockets are connected too, so only the peer is heard from */
+static socket_t openSocket(const std::string &host, int port, bool udp, int localPort) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+    
+    addrinfo *result;
+    const std::string service = std::to_string(port);
+    
+    if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) != 0)
+        return INVALID_SOCKET;
+    
+    socket_t sock = INVALID_SOCKET;
+    
+    for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        
+        if (sock == INVALID_SOCKET)
+            continue;
+        
+        if ((localPort == 0 || bindLocal(sock, ai->ai_family, localPort)) &&
+            connect(sock, ai->ai_addr, (socklen_t) ai->ai_addrlen) == 0)
+            break;
+        
+        httplib::detail::close_socket(sock);
+        sock = INVALID_SOCKET;
+    }
+    
+    freeaddrinfo(result);
+    
+    if (sock == INVALID_SOCKET)
+        return sock;
+
+#ifdef SO_NOSIGPIPE
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (const char*) &yes, sizeof(yes));
+#endif
+    
+    if (!udp) {
+        /* Small messages are the whole point */
+        int nodelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*) &nodelay, sizeof(nodelay));
+    }
+    
+    return sock;
+}
+
+static bool sendAll(socket_t sock, const std::string &data) {
+    size_t sent = 0;
+    
+    while (sent < data.size()) {
+        const int res = ::send(sock, data.data() + sent, (int) (data.size() - sent), SOCKET_SEND_FLAGS);
+        
+        if (res <= 0)
+            return false;
+        
+        sent += res;
+    }
+    
+    return true;
+}
+
+/* Appends a client frame; those always have to be masked */
+static void encodeFrame(std::string &out, int opcode, const char *data, size_t size,
+                        std::mt19937 &rng) {
+    out += (char) (0x80 | opcode);
+    
+    if (size < 126) {
+        out += (char) (0x80 | size);
+    }
+    else if (size < 65536) {
+        out += (char) (0x80 | 126);
+        out += (char) (size >> 8);
+        out += (char) size;
+    }
+    else {
+        out += (char) (0x80 | 127);
+        for (int i = 7; i >= 0; --i)
+            out += (char) ((uint64_t) size >> (i * 8));
+    }
+    
+    const uint32_t maskKey = rng();
+    char mask[4];
+    for (int i = 0; i < 4; ++i)
+        mask[i] = (char) (maskKey >> (i * 8));
+    
+    out.append(mask, 4);
+    
+    const size_t start = out.size();
+    out.append(data, size);
+    
+    for (size_t i = 0; i < size; ++i)
+        out[start + i] ^= mask[i % 4];
+}
+
+bool SocketState::handshake() {
+    std::mt19937 rng(std::random_device{}());
+    
+    std::string key;
+    for (int i = 0; i < 16; ++i)
+        key += (char) rng();
+    key = httplib::detail::base64_encode(key);
+    
+    std::string request = "GET " + path + " HTTP/1.1\r\n";
+    request += "Host: " + host + ":" + std::to_string(port) + "\r\n";
+    request += "Upgrade: websocket\r\n";
+    request += "Connection: Upgrade\r\n";
+    request += "Sec-WebSocket-Key: " + key + "\r\n";
+    request += "Sec-WebSocket-Version: 13\r\n";
+    
+    for (auto const &item : headers)
+        request += item.first + ": " + item.second + "\r\n";
+    
+    request += "\r\n";
+    
+    if (!sendAll(sock, request)) {
+        fail("WebSocket handshake failed: could not send request");
+        return false;
+    }
+    
+    std::string response;
+    size_t headerEnd;
+    
+    while ((headerEnd = response.find("\r\n\r\n")) == std::string::npos) {
+        if (response.size() > 16384 ||
+            httplib::detail::select_read(sock, HANDSHAKE_TIMEOUT, 0) <= 0) {
+            fail("WebSocket handshake failed: no response");
+            return false;
+        }
+        
+        char buf[1024];
+        const int res = recv(sock, buf, sizeof(buf), 0);
+        
+        if (res <= 0) {
+            fail("WebSocket handshake failed: connection closed");
+            return false;
+        }
+        
+        response.append(buf, res);
+    }
+    
+    /* The server may have started sending right away */
+    readBuf = response.substr(headerEnd + 4);
+    response.resize(headerEnd);
+    
+    if (response.compare(0, 12, "HTTP/1.1 101") != 0) {
+        fail("WebSocket handshake failed: " + response.substr(0, response.find("\r\n")));
+        return false;
+    }
+    
+    std::string accept;
+    size_t lineStart = 0;
+    
+    while (lineStart < response.size()) {
+        size_t lineEnd = response.find("\r\n", lineStart);
+        if (lineEnd == std::string::npos)
+            lineEnd = response.size();
+        
+        const std::string line = response.substr(lineStart, lineEnd - lineStart);
+        const size_t colon = line.find(':');
+        
+        if (colon != std::string::npos &&
+            strcasecmp(line.substr(0, colon).c_str(), "Sec-WebSocket-Accept") == 0) {
+            accept = line.substr(colon + 1);
+            accept.erase(0, accept.find_first_not_of(' '));
+            accept.erase(accept.find_last_not_of(' ') + 1);
+        }
+        
+        lineStart = lineEnd + 2;
+    }
+    
+    if (accept != httplib::detail::base64_encode(sha1(key + wsGUID))) {
+        fail("WebSocket handshake failed: bad Sec-WebSocket-Accept");
+        return false;
+    }
+    
+    return true;
+}
+
+/* Runs on a thread of its own; DNS and TCP setup may take a while */
+void SocketState::connect() {
+    sock = openSocket(host, port, udp, localPort);
+    
+    if (sock == INVALID_SOCKET) {
+        fail("Could not connect to " + host + ":" + std::to_string(port));
+        return;
+    }
+    
+    if (!udp && !handshake())
+        return;
+    
+    httplib::detail::set_nonblocking(sock, true);
+}
+
+/* Services all open sockets from one thread, waiting on them
+ * and on a loopback socket poked whenever there is new work */
+class SocketWorker {
+public:
+    static SocketWorker &instance() {
+        /* Never destroyed, like the HTTP worker */
+        static SocketWorker *worker = new SocketWorker;
+        return *worker;
+    }
+    
+    void add(const std::shared_ptr<SocketState> &socket) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            added.push_back(socket);
+        }
+        
+        wake();
+    }
+    
+    void wake() {
+        if (wakePending.exchange(true))
+            return;
+        
+        const char byte = 0;
+        ::send(wakeSend, &byte, 1, SOCKET_SEND_FLAGS);
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::shared_ptr<SocketState> > added;
+    
+    /* Only touched by the worker thread */
+    std::vector<std::shared_ptr<SocketState> > sockets;
+    std::mt19937 rng;
+    
+    socket_t wakeRecv;
+    socket_t wakeSend;
+    std::atomic<bool> wakePending;
+    
+    SocketWorker() :
+        rng(std::random_device{}()),
+        wakePending(false)
+    {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        
+        socklen_t len = sizeof(addr);
+        
+        wakeRecv = socket(AF_INET, SOCK_DGRAM, 0);
+        bind(wakeRecv, (sockaddr*) &addr, len);
+        getsockname(wakeRecv, (sockaddr*) &addr, &len);
+        httplib::detail::set_nonblocking(wakeRecv, true);
+        
+        wakeSend = socket(AF_INET, SOCK_DGRAM, 0);
+        ::connect(wakeSend, (sockaddr*) &addr, len);
+        httplib::detail::set_nonblocking(wakeSend, true);
+        
+        std::thread(&SocketWorker::work, this).detach();
+    }
+    
+    void work() {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                sockets.insert(sockets.end(), added.begin(), added.end());
+                added.clear();
+            }
+            
+            /* Anything queued from here on pokes us again */
+            wakePending.store(false);
+            
+            fd_set readSet, writeSet;
+            FD_ZERO(&readSet);
+            FD_ZERO(&writeSet);
+            
+            FD_SET(wakeRecv, &readSet);
+            socket_t maxSock = wakeRecv;
+            
+            for (size_t i = 0; i < sockets.size();) {
+                SocketState &s = *sockets[i];
+                
+                if (s.closeRequested)
+                    shutdown(s);
+                else
+                    flush(s);
+                
+                if (s.state.load(std::memory_order_relaxed) == Socket::Closed) {
+                    sockets.erase(sockets.begin() + i);
+                    continue;
+                }
+                
+                /* Leave data in the kernel while the game is behind */
+                if (!s.inbound.full())
+                    FD_SET(s.sock, &readSet);
+                if (!s.writeBuf.empty())
+                    FD_SET(s.sock, &writeSet);
+                
+                maxSock = std::max(maxSock, s.sock);
+                ++i;
+            }
+            
+            timeval tv;
+            tv.tv_sec = 1;
+            tv.tv_usec = 0;
+            
+            if (select((int) maxSock + 1, &readSet, &writeSet, 0, &tv) <= 0)
+                continue;
+            
+            if (FD_ISSET(wakeRecv, &readSet)) {
+                char buf[64];
+                while (recv(wakeRecv, buf, sizeof(buf), 0) > 0) {}
+            }
+            
+            for (size_t i = 0; i < sockets.size(); ++i) {
+                SocketState &s = *sockets[i];
+                
+                if (FD_ISSET(s.sock, &readSet))
+                    receive(s);
+                
+                if (s.state.load(std::memory_order_relaxed) != Socket::Closed &&
+                    FD_ISSET(s.sock, &writeSet))
+                    flush(s);
+            }
+        }
+    }
+    
+    /* Sends what is queued, as far as the connection takes it */
+    void flush(SocketState &s) {
+        Socket::Message msg;
+        
+        if (s.udp) {
+            /* Datagrams that don't fit are dropped, as on any network */
+            while (s.outbound.pop(msg))
+                ::send(s.sock, msg.data.data(), (int) msg.data.size(), SOCKET_SEND_FLAGS);
+            
+            return;
+        }
+        
+        while (s.writeBuf.size() < MAX_WRITE_BACKLOG && s.outbound.pop(msg))
+            encodeFrame(s.writeBuf, msg.binary ? WSBinary : WSText,
+                        msg.data.data(), msg.data.size(), rng);
+        
+        if (s.writeBuf.empty())
+            return;
+        
+        const int res = ::send(s.sock, s.writeBuf.data(), (int) s.writeBuf.size(), SOCKET_SEND_FLAGS);
+        
+        if (res < 0 && !wouldBlock()) {
+            s.fail("Connection lost");
+            return;
+        }
+        
+        if (res > 0)
+            s.writeBuf.erase(0, res);
+    }
+    
+    void shutdown(SocketState &s) {
+        if (!s.udp) {
+            /* Going away (1001); best effort, we don't wait for the reply */
+            const char code[2] = { (char) 0x03, (char) 0xE9 };
+            std::string frame;
+            encodeFrame(frame, WSClose, code, sizeof(code), rng);
+            ::send(s.sock, frame.data(), (int) frame.size(), SOCKET_SEND_FLAGS);
+        }
+        
+        s.fail(std::string());
+    }
+    
+    void receive(SocketState &s) {
+        char buf[16384];
+        
+        if (s.udp) {
+            for (;;) {
+                const int res = recv(s.sock, buf, sizeof(buf), 0);
+                
+                /* Refused datagrams only tell that nobody listens yet */
+                if (res < 0)
+                    return;
+                
+                Socket::Message msg;
+                msg.data.assign(buf, res);
+                msg.binary = true;
+                
+                /* Dropped if the game doesn't keep up */
+                s.inbound.push(msg);
+            }
+        }
+        
+        const int res = recv(s.sock, buf, sizeof(buf), 0);
+        
+        if (res == 0) {
+            s.fail("Connection closed by peer");
+            return;
+        }
+        
+        if (res < 0) {
+            if (!wouldBlock())
+                s.fail("Connection lost");
+            return;
+        }
+        
+        s.readBuf.append(buf, res);
+        
+        while (!s.inbound.full() && s.state.load(std::memory_order_relaxed) != Socket::Closed) {
+            if (!parseFrame(s))
+                break;
+        }
+    }
+    
+    /* Handles one complete frame from 'readBuf', false if there is none yet */
+    bool parseFrame(SocketState &s) {
+        const unsigned char *p = (const unsigned char*) s.readBuf.data();
+        const size_t avail = s.readBuf.size();
+        
+        if (avail < 2)
+            return false;
+        
+        const bool fin = p[0] & 0x80;
+        const int opcode = p[0] & 0x0F;
+        const bool masked = p[1] & 0x80;
+        uint64_t size = p[1] & 0x7F;
+        size_t headerSize = 2;
+        
+        if (size == 126) {
+            if (avail < 4)
+                return false;
+            
+            size = (p[2] << 8) | p[3];
+            headerSize = 4;
+        }
+        else if (size == 127) {
+            if (avail < 10)
+                return false;
+            
+            size = 0;
+            for (int i = 0; i < 8; ++i)
+                size = (size << 8) | p[2 + i];
+            headerSize = 10;
+        }
+        
+        if (size + s.fragment.size() > MAX_MESSAGE_SIZE) {
+            s.fail("Message too large");
+            return false;
+        }
+        
+        const size_t maskOffset = headerSize;
+        if (masked)
+            headerSize += 4;
+        
+        if (avail < headerSize + size)
+            return false;
+        
+        std::string payload = s.readBuf.substr(headerSize, size);
+        
+        if (masked)
+            for (size_t i = 0; i < payload.size(); ++i)
+                payload[i] ^= s.readBuf[maskOffset + i % 4];
+        
+        s.readBuf.erase(0, headerSize + size);
+        
+        switch (opcode) {
+            case WSText:
+            case WSBinary:
+                s.fragment.clear();
+                s.fragmentBinary = (opcode == WSBinary);
+                /* Fall through */
+            case WSContinuation: {
+                s.fragment += payload;
+                
+                if (!fin)
+                    break;
+                
+                Socket::Message msg;
+                msg.data.swap(s.fragment);
+                msg.binary = s.fragmentBinary;
+                s.inbound.push(msg);
+                
+                break;
+            }
+            case WSPing:
+                encodeFrame(s.writeBuf, WSPong, payload.data(), payload.size(), rng);
+                break;
+            case WSPong:
+                break;
+            case WSClose:
+                /* Echo the status code back, then we're done */
+                encodeFrame(s.writeBuf, WSClose, payload.data(), std::min<size_t>(payload.size(), 2), rng);
+                ::send(s.sock, s.writeBuf.data(), (int) s.writeBuf.size(), SOCKET_SEND_FLAGS);
+                s.fail(std::string());
+                return false;
+            default:
+                s.fail("Unknown WebSocket opcode");
+                return false;
+        }
+        
+        return true;
+    }
+};
+
+static void startConnecting(const std::shared_ptr<SocketState> &state) {
+    std::thread([state] {
+        state->connect();
+        
+        if (state->state.load(std::memory_order_relaxed) == Socket::Closed)
+            return;
+        
+        state->state.store(Socket::Open, std::memory_order_release);
+        SocketWorker::instance().add(state);
+    }).detach();
+}
+
+Socket::Socket(const char *host, int port, int localPort) :
+    sstate(std::make_shared<SocketState>())
+{
+    if (port <= 0 || port > 65535 || localPort < 0 || localPort > 65535)
+        throw Exception(Exception::MKXPError, "Invalid port");
+    
+    sstate->udp = true;
+    sstate->host = host;
+    sstate->port = port;
+    sstate->localPort = localPort;
+    
+    startConnecting(sstate);
+}
+
+Socket::Socket(const char *url, const StringMap &headers) :
+    sstate(std::make_shared<SocketState>())
+{
+    LUrlParser::ParseURL p = readURL(url);
+    
+    if (p.scheme_ == "wss")
+        throw Exception(Exception::MKXPError, "Secure WebSockets (wss://) are not supported");
+    
+    if (p.scheme_ != "ws")
+        throw Exception(Exception::MKXPError, "Not a WebSocket URL: %s", url);
+    
+    int port = 80;
+    if (!p.port_.empty() && !p.getPort(&port))
+        throw Exception(Exception::MKXPError, "Invalid port");
+    
+    sstate->host = p.host_;
+    sstate->port = port;
+    sstate->path = getPath(p);
+    sstate->headers = headers;
+    
+    startConnecting(sstate);
+}
+
+Socket::~Socket() {
+    close();
+}
+
+bool Socket::send(const char *data, size_t size, bool binary) {
+    if (sstate->closeRequested || state() == Closed)
+        return false;
+    
+    Message msg;
+    msg.data.assign(data, size);
+    msg.binary = binary;
+    
+    if (!sstate->outbound.push(msg))
+        return false;
+    
+    /* Picked up once the connection is open otherwise */
+    if (state() == Open)
+        SocketWorker::instance().wake();
+    
+    return true;
+}
+
+bool Socket::receive(Message &msg) {
+    return sstate->inbound.pop(msg);
+}
+
+Socket::State Socket::state() const {
+    return (State) sstate->state.load(std::memory_order_acquire);
+}
+
+const std::string &Socket::error() const {
+    static const std::string none;
+    
+    return state() == Closed ? sstate->error : none;
+}
+
+void Socket::close() {
+    if (sstate->closeRequested.exchange(true))
+        return;
+    
+    /* Still connecting: the worker sees the request once added */
+    if (state() == Open)
+        SocketWorker::instance().wake();
+}
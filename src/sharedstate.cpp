@@ -29,23 +29,35 @@
 #include "glstate.h"
 #include "shader.h"
 #include "texpool.h"
+#include "bitmaploader.h"
+#include "savewriter.h"
+#include "ioscheduler.h"
+#include "profiler.h"
 #include "font.h"
+#include "bitmap.h"
 #include "eventthread.h"
 #include "gl-util.h"
 #include "global-ibo.h"
 #include "quad.h"
+#include "quadstream.h"
 #include "binding.h"
 #include "exception.h"
 #include "sharedmidistate.h"
+#include "preparable.h"
+#include "frame-arena.h"
+#include "startup-timer.h"
 
 #include <unistd.h>
 #include <stdio.h>
 #include <string>
+#include <deque>
+#include <algorithm>
 #include <chrono>
 
 SharedState *SharedState::instance = 0;
 int SharedState::rgssVersion = 0;
 static GlobalIBO *_globalIBO = 0;
+static QuadStream *_quadStream = 0;
 
 static const char *gameArchExt()
 {
@@ -67,6 +79,7 @@ struct SharedStatePrivate
 	Scene *screen;
 
 	FileSystem fileSystem;
+	StartupMark fileSystemDone{"filesystem"};
 
 	EventThread &eThread;
 	RGSSThreadData &rtData;
@@ -74,17 +87,30 @@ struct SharedStatePrivate
 
 	SharedMidiState midiState;
 
+	/* Outlives the audio thread */
+	Profiler profiler;
+
 	Graphics graphics;
+	StartupMark graphicsDone{"graphics"};
+
 	Input input;
 	Audio audio;
+	StartupMark audioDone{"input, audio"};
 
 	GLState _glState;
 
 	ShaderSet shaders;
+	StartupMark shadersDone{"shaders"};
 
 	TexPool texPool;
+	BitmapLoader bitmapLoader;
+
+	/* Finishes outstanding saves when destroyed */
+	SaveWriter saveWriter;
 
 	SharedFontState fontState;
+	StartupMark fontsDone{"texpool, font sets"};
+
 	Font *defaultFont;
 
 	TEX::ID globalTex;
@@ -93,40 +119,68 @@ struct SharedStatePrivate
 
 	TEXFBO gpTexFBO;
 
-	TEXFBO atlasTex;
+	/* Released atlases, most recently released first */
+	struct CachedAtlas
+	{
+		TEXFBO tex;
+		std::string key;
+	};
+
+	std::deque<CachedAtlas> atlasCache;
 
 	Quad gpQuad;
 
+	/* Everything with work pending for the next prepareDraw */
+	IntruList<Preparable> prepareList;
+
+	FrameArena frameArena;
+
 	unsigned int stampCounter;
+
+	/* Frames since resident memory was last checked */
+	int memCheckFrames;
     
     std::chrono::time_point<std::chrono::steady_clock> startupTime;
 
 	SharedStatePrivate(RGSSThreadData *threadData)
 	    : bindingData(0),
 	      sdlWindow(threadData->window),
-	      fileSystem(threadData->argv0, threadData->config.allowSymlinks),
+	      fileSystem(threadData->argv0, threadData->config.allowSymlinks,
+	                 threadData->config.readAhead * 1024,
+	                 threadData->config.mapFiles,
+	                 (size_t) threadData->config.archiveCache * 1024 * 1024),
 	      eThread(*threadData->ethread),
 	      rtData(*threadData),
 	      config(threadData->config),
 	      midiState(threadData->config),
+	      profiler(threadData->config.frameProfiler,
+	               threadData->config.dynamicResolution > 0
+	               || threadData->config.frameSkip),
 	      graphics(threadData),
 	      input(*threadData),
 	      audio(*threadData),
 	      _glState(threadData->config),
+	      shaders(threadData->config),
+	      bitmapLoader(threadData->config),
 	      fontState(threadData->config),
-	      stampCounter(0)
+	      stampCounter(0),
+	      memCheckFrames(0)
 	{
         
         startupTime = std::chrono::steady_clock::now();
         
-		/* Shaders have been compiled in ShaderSet's constructor */
-		if (gl.ReleaseShaderCompiler)
-			gl.ReleaseShaderCompiler();
+		/* Repacked archives take precedence over the original one */
+		std::string archPath = config.execName + ".mkxpa";
+
+		FILE *tmp = fopen(archPath.c_str(), "rb");
 
-		std::string archPath = config.execName + gameArchExt();
+		if (tmp)
+			fclose(tmp);
+		else
+			archPath = config.execName + gameArchExt();
 
 		/* Check if a game archive exists */
-		FILE *tmp = fopen(archPath.c_str(), "rb");
+		tmp = fopen(archPath.c_str(), "rb");
 		if (tmp)
 		{
 			fileSystem.addPath(archPath.c_str());
@@ -138,10 +192,20 @@ struct SharedStatePrivate
 		for (size_t i = 0; i < config.rtps.size(); ++i)
 			fileSystem.addPath(config.rtps[i].c_str());
 
+		StartupTimer::mark("archive mounts");
+
 		if (config.pathCache)
-			fileSystem.createPathCache();
+		{
+			fileSystem.createPathCache(config.customDataPath);
+			StartupTimer::mark("path cache");
+		}
 
-		fileSystem.initFontSets(fontState);
+		IOScheduler::setBandwidth(IOScheduler::Visible, config.ioBandwidth.visible * 1024);
+		IOScheduler::setBandwidth(IOScheduler::Speculative, config.ioBandwidth.speculative * 1024);
+
+		texPool.setBudget(TexPool::Bitmaps, config.texPoolBudget.bitmaps * 1000000);
+		texPool.setBudget(TexPool::Intermediates, config.texPoolBudget.intermediates * 1000000);
+		texPool.setBudget(TexPool::Atlases, config.texPoolBudget.atlases * 1000000);
 
 		globalTexW = 128;
 		globalTexH = 64;
@@ -158,17 +222,26 @@ struct SharedStatePrivate
 		TEXFBO::allocEmpty(gpTexFBO, globalTexW, globalTexH);
 		TEXFBO::linkFBO(gpTexFBO);
 
-		/* RGSS3 games will call setup_midi, so there's
-		 * no need to do it on startup */
-		if (rgssVer <= 2)
+		/* RGSS3 games will call setup_midi, so there's no need
+		 * to do it on startup, unless a SoundFont was set up
+		 * explicitly. The SoundFont loads in the background */
+		if (rgssVer <= 2 || !threadData->config.midi.soundFont.empty())
 			midiState.initIfNeeded(threadData->config);
+
+		StartupTimer::mark("shared state");
 	}
 
 	~SharedStatePrivate()
 	{
+		/* Leftover objects must not touch the list when they die */
+		while (!prepareList.isEmpty())
+			prepareList.remove(*prepareList.begin());
+
 		TEX::del(globalTex);
 		TEXFBO::fini(gpTexFBO);
-		TEXFBO::fini(atlasTex);
+
+		for (size_t i = 0; i < atlasCache.size(); ++i)
+			TEXFBO::fini(atlasCache[i].tex);
 	}
 };
 
@@ -176,12 +249,14 @@ void SharedState::initInstance(RGSSThreadData *threadData)
 {
 	/* This section is tricky because of dependencies:
 	 * SharedState depends on GlobalIBO existing,
+	 * QuadStream grows the GlobalIBO,
 	 * Font depends on SharedState existing */
 
 	rgssVersion = threadData->config.rgssVersion;
     
 	_globalIBO = new GlobalIBO();
 	_globalIBO->ensureSize(1);
+	_quadStream = new QuadStream(*_globalIBO);
 
 	SharedState::instance = 0;
 	Font *defaultFont = 0;
@@ -191,11 +266,13 @@ void SharedState::initInstance(RGSSThreadData *threadData)
 		SharedState::instance = new SharedState(threadData);
 		Font::initDefaults(instance->p->fontState);
 		defaultFont = new Font();
+		StartupTimer::mark("default font");
 	}
 	catch (const Exception &exc)
 	{
-		delete _globalIBO;
 		delete SharedState::instance;
+		delete _quadStream;
+		delete _globalIBO;
 		delete defaultFont;
 
 		throw exc;
@@ -210,6 +287,7 @@ void SharedState::finiInstance()
 
 	delete SharedState::instance;
 
+	delete _quadStream;
 	delete _globalIBO;
 }
 
@@ -218,6 +296,13 @@ void SharedState::setScreen(Scene &screen)
 	p->screen = &screen;
 }
 
+/* Released atlases kept for reuse, so switching back
+ * and forth between a few tilesets doesn't rebuild them */
+#define ATLAS_CACHE_SIZE 3
+
+/* Frames between checks against 'memoryBudget' */
+#define MEM_CHECK_PERIOD 60
+
 #define GSATT(type, lower) \
 	type SharedState :: lower() const \
 	{ \
@@ -237,6 +322,9 @@ GSATT(Audio&, audio)
 GSATT(GLState&, _glState)
 GSATT(ShaderSet&, shaders)
 GSATT(TexPool&, texPool)
+GSATT(BitmapLoader&, bitmapLoader)
+GSATT(SaveWriter&, saveWriter)
+GSATT(Profiler&, profiler)
 GSATT(Quad&, gpQuad)
 GSATT(SharedFontState&, fontState)
 GSATT(SharedMidiState&, midiState)
@@ -256,6 +344,16 @@ GlobalIBO &SharedState::globalIBO()
 	return *_globalIBO;
 }
 
+QuadStream &SharedState::quadStream()
+{
+	return *_quadStream;
+}
+
+FrameArena &SharedState::frameArena()
+{
+	return p->frameArena;
+}
+
 void SharedState::bindTex()
 {
 	TEX::bind(p->globalTex);
@@ -309,14 +407,24 @@ TEXFBO &SharedState::gpTexFBO(int minW, int minH)
 	return p->gpTexFBO;
 }
 
-void SharedState::requestAtlasTex(int w, int h, TEXFBO &out)
+void SharedState::requestAtlasTex(int w, int h, TEXFBO &out,
+                                  std::string *contentKey)
 {
 	TEXFBO tex;
+	std::string key;
+
+	std::deque<SharedStatePrivate::CachedAtlas> &cache = p->atlasCache;
+	size_t i;
+
+	for (i = 0; i < cache.size(); ++i)
+		if (w == cache[i].tex.width && h == cache[i].tex.height)
+			break;
 
-	if (w == p->atlasTex.width && h == p->atlasTex.height)
+	if (i < cache.size())
 	{
-		tex = p->atlasTex;
-		p->atlasTex = TEXFBO();
+		tex = cache[i].tex;
+		key.swap(cache[i].key);
+		cache.erase(cache.begin() + i);
 	}
 	else
 	{
@@ -326,17 +434,111 @@ void SharedState::requestAtlasTex(int w, int h, TEXFBO &out)
 	}
 
 	out = tex;
+
+	if (contentKey)
+		contentKey->swap(key);
 }
 
-void SharedState::releaseAtlasTex(TEXFBO &tex)
+void SharedState::releaseAtlasTex(TEXFBO &tex, const std::string &contentKey)
 {
 	/* No point in caching an invalid object */
 	if (tex.tex == TEX::ID(0))
 		return;
 
-	TEXFBO::fini(p->atlasTex);
+	SharedStatePrivate::CachedAtlas entry;
+	entry.tex = tex;
+	entry.key = contentKey;
+
+	std::deque<SharedStatePrivate::CachedAtlas> &cache = p->atlasCache;
+	cache.push_front(entry);
+
+	if (cache.size() > ATLAS_CACHE_SIZE)
+	{
+		TEXFBO::fini(cache.back().tex);
+		cache.pop_back();
+	}
+}
+
+bool SharedState::swapAtlasTex(TEXFBO &tex, std::string &texKey,
+                               const std::string &contentKey)
+{
+	std::deque<SharedStatePrivate::CachedAtlas> &cache = p->atlasCache;
+
+	for (size_t i = 0; i < cache.size(); ++i)
+	{
+		SharedStatePrivate::CachedAtlas &entry = cache[i];
+
+		if (entry.key != contentKey || entry.tex.width != tex.width
+		                            || entry.tex.height != tex.height)
+			continue;
+
+		std::swap(entry.tex, tex);
+		entry.key.swap(texKey);
+
+		/* The texture given up counts as just released */
+		SharedStatePrivate::CachedAtlas swapped = entry;
+		cache.erase(cache.begin() + i);
+		cache.push_front(swapped);
+
+		return true;
+	}
+
+	return false;
+}
+
+void SharedState::trimCaches()
+{
+	p->texPool.trim();
+
+	for (size_t i = 0; i < p->atlasCache.size(); ++i)
+		TEXFBO::fini(p->atlasCache[i].tex);
+
+	p->atlasCache.clear();
+
+	p->fontState.trimCaches();
+	p->audio.seTrimCache();
+	Bitmap::dropSurfaces();
+}
+
+/* Resident set size in bytes, 0 if unknown */
+static size_t residentMemory()
+{
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f)
+		return 0;
+
+	unsigned long size, resident;
+	const int read = fscanf(f, "%lu %lu", &size, &resident);
+	fclose(f);
+
+	if (read != 2)
+		return 0;
+
+	return (size_t) resident * sysconf(_SC_PAGESIZE);
+#else
+	return 0;
+#endif
+}
+
+void SharedState::checkMemoryPressure()
+{
+	if (p->rtData.rqTrimCaches)
+	{
+		p->rtData.rqTrimCaches.clear();
+		trimCaches();
+
+		return;
+	}
+
+	if (p->config.memoryBudget <= 0 || ++p->memCheckFrames < MEM_CHECK_PERIOD)
+		return;
+
+	p->memCheckFrames = 0;
 
-	p->atlasTex = tex;
+	if (residentMemory() > (size_t) p->config.memoryBudget * 1024 * 1024)
+		trimCaches();
 }
 
 void SharedState::checkShutdown()
@@ -369,6 +571,36 @@ double SharedState::runTime() {
     return std::chrono::duration_cast<std::chrono::microseconds>(now - p->startupTime).count() / 1000.0 / 1000.0;
 }
 
+void SharedState::prepareDraw()
+{
+	IntruList<Preparable> &list = p->prepareList;
+	IntruList<Preparable> kept;
+
+	/* Objects enrolled by others' 'prepare()' (eg. a
+	 * Tilemap drawing into a Bitmap) are still run
+	 * in this same pass */
+	while (!list.isEmpty())
+	{
+		Preparable *obj = list.begin()->data;
+		list.remove(obj->prepareLink);
+
+		if (obj->prepare() && !obj->prepareLink.next)
+			kept.append(obj->prepareLink);
+	}
+
+	while (!kept.isEmpty())
+	{
+		IntruListLink<Preparable> &link = *kept.begin();
+		kept.remove(link);
+		list.append(link);
+	}
+}
+
+void SharedState::enrollPrepare(Preparable &obj)
+{
+	p->prepareList.append(obj.prepareLink);
+}
+
 unsigned int SharedState::genTimeStamp()
 {
 	return p->stampCounter++;
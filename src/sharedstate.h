@@ -24,6 +24,8 @@
 
 #include "sigslot/signal.hpp"
 
+#include <string>
+
 #define shState SharedState::instance
 #define glState shState->_glState()
 #define rgssVer SharedState::rgssVersion
@@ -34,7 +36,10 @@ struct GlobalIBO;
 struct SDL_Window;
 struct TEXFBO;
 struct Quad;
+class QuadStream;
+class FrameArena;
 struct ShaderSet;
+struct Preparable;
 
 class Scene;
 class FileSystem;
@@ -44,6 +49,9 @@ class Input;
 class Audio;
 class GLState;
 class TexPool;
+class BitmapLoader;
+class SaveWriter;
+class Profiler;
 class Font;
 class SharedFontState;
 struct GlobalIBO;
@@ -76,12 +84,20 @@ struct SharedState
 	ShaderSet &shaders() const;
 
 	TexPool &texPool() const;
+	BitmapLoader &bitmapLoader() const;
+	SaveWriter &saveWriter() const;
+
+	Profiler &profiler() const;
 
 	SharedFontState &fontState() const;
 	Font &defaultFont() const;
 	SharedMidiState &midiState() const;
 
-	sigslot::signal<> prepareDraw;
+	/* Calls 'prepare()' on everything enrolled through
+	 * 'Preparable::requestPrepare()'. Fired immediately
+	 * before each frame draw */
+	void prepareDraw();
+	void enrollPrepare(Preparable &obj);
 
 	unsigned int genTimeStamp();
     
@@ -93,6 +109,12 @@ struct SharedState
 	void ensureQuadIBO(size_t minSize);
 	GlobalIBO &globalIBO();
 
+	/* Vertex ring that all 'Quad' draws go through */
+	QuadStream &quadStream();
+
+	/* Scratch memory valid until the next Graphics.update */
+	FrameArena &frameArena();
+
 	/* Global general purpose texture */
 	void bindTex();
 	void ensureTexSize(int minW, int minH, Vec2i &currentSizeOut);
@@ -102,9 +124,31 @@ struct SharedState
 	Quad &gpQuad() const;
 
 	/* Basically just a simple "TexPool"
-	 * replacement for Tilemap atlas use */
-	void requestAtlasTex(int w, int h, TEXFBO &out);
-	void releaseAtlasTex(TEXFBO &tex);
+	 * replacement for Tilemap atlas use.
+	 * A texture is released along with a key describing
+	 * what it holds (empty if nothing reusable); if it is
+	 * handed out again, 'contentKey' receives that key,
+	 * so an identical atlas need not be rebuilt */
+	void requestAtlasTex(int w, int h, TEXFBO &out,
+	                     std::string *contentKey = 0);
+	void releaseAtlasTex(TEXFBO &tex,
+	                     const std::string &contentKey = std::string());
+
+	/* If a released atlas of the same size holding 'contentKey'
+	 * is cached, exchanges it for 'tex' (which is cached under
+	 * 'texKey' in its place) and returns true */
+	bool swapAtlasTex(TEXFBO &tex, std::string &texKey,
+	                  const std::string &contentKey);
+
+	/* Frees everything kept around only for reuse: released
+	 * textures and atlases, cached text renders and sound
+	 * buffers, and the RAM copies of bitmaps */
+	void trimCaches();
+
+	/* Trims the caches if the OS reported low memory, or
+	 * (checked periodically) resident memory has grown past
+	 * 'memoryBudget'. Called once per frame */
+	void checkMemoryPressure();
 
 	/* Checks EventThread's shutdown request flag and if set,
 	 * requests the binding to terminate. In this case, this
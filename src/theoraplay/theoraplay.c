@@ -19,13 +19,12 @@
 #include <windows.h>
 #define THEORAPLAY_THREAD_T    HANDLE
 #define THEORAPLAY_MUTEX_T     HANDLE
-#define sleepms(x) Sleep(x)
+#define THEORAPLAY_WAKE_T      HANDLE
 #else
 #include <pthread.h>
-#include <unistd.h>
-#define sleepms(x) usleep((x) * 1000)
 #define THEORAPLAY_THREAD_T    pthread_t
 #define THEORAPLAY_MUTEX_T     pthread_mutex_t
+#define THEORAPLAY_WAKE_T      pthread_cond_t
 #endif
 
 #include "theoraplay.h"
@@ -39,11 +38,14 @@ typedef THEORAPLAY_AudioPacket AudioPacket;
 
 // !!! FIXME: these all count on the pixel format being TH_PF_420 for now.
 
+// 'reuse' is a buffer of a recycled frame of the same stream, or NULL.
 typedef unsigned char *(*ConvertVideoFrameFn)(const th_info *tinfo,
-                                              const th_ycbcr_buffer ycbcr);
+                                              const th_ycbcr_buffer ycbcr,
+                                              unsigned char *reuse);
 
 static unsigned char *ConvertVideoFrame420ToYUVPlanar(
                             const th_info *tinfo, const th_ycbcr_buffer ycbcr,
+                            unsigned char *reuse,
                             const int p0, const int p1, const int p2)
 {
     int i;
@@ -51,7 +53,7 @@ static unsigned char *ConvertVideoFrame420ToYUVPlanar(
     const int h = tinfo->pic_height;
     const int yoff = (tinfo->pic_x & ~1) + ycbcr[0].stride * (tinfo->pic_y & ~1);
     const int uvoff = (tinfo->pic_x / 2) + (ycbcr[1].stride) * (tinfo->pic_y / 2);
-    unsigned char *yuv = (unsigned char *) malloc(w * h * 2);
+    unsigned char *yuv = reuse ? reuse : (unsigned char *) malloc(w * h * 2);
     const unsigned char *p0data = ycbcr[p0].data + yoff;
     const int p0stride = ycbcr[p0].stride;
     const unsigned char *p1data = ycbcr[p1].data + uvoff;
@@ -75,16 +77,18 @@ static unsigned char *ConvertVideoFrame420ToYUVPlanar(
 
 
 static unsigned char *ConvertVideoFrame420ToYV12(const th_info *tinfo,
-                                                 const th_ycbcr_buffer ycbcr)
+                                                 const th_ycbcr_buffer ycbcr,
+                                                 unsigned char *reuse)
 {
-    return ConvertVideoFrame420ToYUVPlanar(tinfo, ycbcr, 0, 2, 1);
+    return ConvertVideoFrame420ToYUVPlanar(tinfo, ycbcr, reuse, 0, 2, 1);
 } // ConvertVideoFrame420ToYV12
 
 
 static unsigned char *ConvertVideoFrame420ToIYUV(const th_info *tinfo,
-                                                 const th_ycbcr_buffer ycbcr)
+                                                 const th_ycbcr_buffer ycbcr,
+                                                 unsigned char *reuse)
 {
-    return ConvertVideoFrame420ToYUVPlanar(tinfo, ycbcr, 0, 1, 2);
+    return ConvertVideoFrame420ToYUVPlanar(tinfo, ycbcr, reuse, 0, 1, 2);
 } // ConvertVideoFrame420ToIYUV
 
 
@@ -108,6 +112,9 @@ typedef struct TheoraDecoder
     // Thread wrangling...
     int thread_created;
     THEORAPLAY_MUTEX_T lock;
+    // Signaled when a buffered frame is taken or decoding is halted,
+    //  so a worker waiting for room in the video queue wakes up.
+    THEORAPLAY_WAKE_T room;
     volatile int halt;
     int thread_done;
     THEORAPLAY_THREAD_T worker;
@@ -128,6 +135,10 @@ typedef struct TheoraDecoder
     VideoFrame *videolist;
     VideoFrame *videolisttail;
 
+    // Frames handed back with THEORAPLAY_recycleVideo(), reused
+    //  (with their pixel buffers) instead of allocating new ones.
+    VideoFrame *framepool;
+
     AudioPacket *audiolist;
     AudioPacket *audiolisttail;
 } TheoraDecoder;
@@ -156,17 +167,38 @@ static inline int Mutex_Create(TheoraDecoder *ctx)
     ctx->lock = CreateMutex(NULL, FALSE, NULL);
     return (ctx->lock == NULL);
 }
-static inline void Mutex_Destroy(THEORAPLAY_MUTEX_T mutex)
+static inline void Mutex_Destroy(THEORAPLAY_MUTEX_T *mutex)
+{
+    CloseHandle(*mutex);
+}
+static inline void Mutex_Lock(THEORAPLAY_MUTEX_T *mutex)
 {
-    CloseHandle(mutex);
+    WaitForSingleObject(*mutex, INFINITE);
 }
-static inline void Mutex_Lock(THEORAPLAY_MUTEX_T mutex)
+static inline void Mutex_Unlock(THEORAPLAY_MUTEX_T *mutex)
 {
-    WaitForSingleObject(mutex, INFINITE);
+    ReleaseMutex(*mutex);
 }
-static inline void Mutex_Unlock(THEORAPLAY_MUTEX_T mutex)
+static inline int Wake_Create(TheoraDecoder *ctx)
 {
-    ReleaseMutex(mutex);
+    // Auto-reset, so a signal sent before the worker waits isn't lost.
+    ctx->room = CreateEvent(NULL, FALSE, FALSE, NULL);
+    return (ctx->room == NULL);
+}
+static inline void Wake_Destroy(THEORAPLAY_WAKE_T *wake)
+{
+    CloseHandle(*wake);
+}
+static inline void Wake_Signal(THEORAPLAY_WAKE_T *wake)
+{
+    SetEvent(*wake);
+}
+// Called with 'mutex' held; returns with it held again.
+static inline void Wake_Wait(THEORAPLAY_WAKE_T *wake, THEORAPLAY_MUTEX_T *mutex)
+{
+    ReleaseMutex(*mutex);
+    WaitForSingleObject(*wake, INFINITE);
+    WaitForSingleObject(*mutex, INFINITE);
 }
 #else
 static inline int Thread_Create(TheoraDecoder *ctx, void *(*routine) (void*))
@@ -181,17 +213,34 @@ static inline int Mutex_Create(TheoraDecoder *ctx)
 {
     return pthread_mutex_init(&ctx->lock, NULL);
 }
-static inline void Mutex_Destroy(THEORAPLAY_MUTEX_T mutex)
+static inline void Mutex_Destroy(THEORAPLAY_MUTEX_T *mutex)
+{
+    pthread_mutex_destroy(mutex);
+}
+static inline void Mutex_Lock(THEORAPLAY_MUTEX_T *mutex)
 {
-    pthread_mutex_destroy(&mutex);
+    pthread_mutex_lock(mutex);
 }
-static inline void Mutex_Lock(THEORAPLAY_MUTEX_T mutex)
+static inline void Mutex_Unlock(THEORAPLAY_MUTEX_T *mutex)
 {
-    pthread_mutex_lock(&mutex);
+    pthread_mutex_unlock(mutex);
 }
-static inline void Mutex_Unlock(THEORAPLAY_MUTEX_T mutex)
+static inline int Wake_Create(TheoraDecoder *ctx)
 {
-    pthread_mutex_unlock(&mutex);
+    return pthread_cond_init(&ctx->room, NULL);
+}
+static inline void Wake_Destroy(THEORAPLAY_WAKE_T *wake)
+{
+    pthread_cond_destroy(wake);
+}
+static inline void Wake_Signal(THEORAPLAY_WAKE_T *wake)
+{
+    pthread_cond_signal(wake);
+}
+// Called with 'mutex' held; returns with it held again.
+static inline void Wake_Wait(THEORAPLAY_WAKE_T *wake, THEORAPLAY_MUTEX_T *mutex)
+{
+    pthread_cond_wait(wake, mutex);
 }
 #endif
 
@@ -375,11 +424,11 @@ static void WorkerThread(TheoraDecoder *ctx)
     // Now we can start the actual decoding!
     // Note that audio and video don't _HAVE_ to start simultaneously.
 
-    Mutex_Lock(ctx->lock);
+    Mutex_Lock(&ctx->lock);
     ctx->prepped = 1;
     ctx->hasvideo = (tpackets != 0);
     ctx->hasaudio = (vpackets != 0);
-    Mutex_Unlock(ctx->lock);
+    Mutex_Unlock(&ctx->lock);
 
     while (!ctx->halt && !eos)
     {
@@ -424,7 +473,7 @@ static void WorkerThread(TheoraDecoder *ctx)
                 audioframes += frames;
 
                 //printf("Decoded %d frames of audio.\n", (int) frames);
-                Mutex_Lock(ctx->lock);
+                Mutex_Lock(&ctx->lock);
                 ctx->audioms += item->playms;
                 if (ctx->audiolisttail)
                 {
@@ -437,7 +486,7 @@ static void WorkerThread(TheoraDecoder *ctx)
                     ctx->audiolist = item;
                 } // else
                 ctx->audiolisttail = item;
-                Mutex_Unlock(ctx->lock);
+                Mutex_Unlock(&ctx->lock);
             } // if
 
             else  // no audio available left in current packet?
@@ -477,14 +526,26 @@ static void WorkerThread(TheoraDecoder *ctx)
                     if (th_decode_ycbcr_out(tdec, ycbcr) == 0)
                     {
                         const double videotime = th_granule_time(tdec, granulepos);
-                        VideoFrame *item = (VideoFrame *) malloc(sizeof (VideoFrame));
+                        VideoFrame *item;
+                        unsigned char *reuse = NULL;
+
+                        Mutex_Lock(&ctx->lock);
+                        item = ctx->framepool;
+                        if (item)
+                            ctx->framepool = item->next;
+                        Mutex_Unlock(&ctx->lock);
+
+                        if (item)
+                            reuse = item->pixels;
+                        else
+                            item = (VideoFrame *) malloc(sizeof (VideoFrame));
                         if (item == NULL) goto cleanup;
                         item->playms = (unsigned int) (videotime * 1000.0);
                         item->fps = fps;
                         item->width = tinfo.pic_width;
                         item->height = tinfo.pic_height;
                         item->format = ctx->vidfmt;
-                        item->pixels = ctx->vidcvt(&tinfo, ycbcr);
+                        item->pixels = ctx->vidcvt(&tinfo, ycbcr, reuse);
                         item->next = NULL;
 
                         if (item->pixels == NULL)
@@ -494,7 +555,7 @@ static void WorkerThread(TheoraDecoder *ctx)
                         } // if
 
                         //printf("Decoded another video frame.\n");
-                        Mutex_Lock(ctx->lock);
+                        Mutex_Lock(&ctx->lock);
                         if (ctx->videolisttail)
                         {
                             assert(ctx->videolist);
@@ -507,7 +568,7 @@ static void WorkerThread(TheoraDecoder *ctx)
                         } // else
                         ctx->videolisttail = item;
                         ctx->videocount++;
-                        Mutex_Unlock(ctx->lock);
+                        Mutex_Unlock(&ctx->lock);
 
                         saw_video_frame = 1;
                     } // if
@@ -532,17 +593,11 @@ static void WorkerThread(TheoraDecoder *ctx)
         // Sleep the process until we have space for more frames.
         if (saw_video_frame)
         {
-            int go_on = !ctx->halt;
             //printf("Sleeping.\n");
-            while (go_on)
-            {
-                // !!! FIXME: This is stupid. I should use a semaphore for this.
-                Mutex_Lock(ctx->lock);
-                go_on = !ctx->halt && (ctx->videocount >= ctx->maxframes);
-                Mutex_Unlock(ctx->lock);
-                if (go_on)
-                    sleepms(10);
-            } // while
+            Mutex_Lock(&ctx->lock);
+            while (!ctx->halt && (ctx->videocount >= ctx->maxframes))
+                Wake_Wait(&ctx->room, &ctx->lock);
+            Mutex_Unlock(&ctx->lock);
             //printf("Awake!\n");
         } // if
     } // while
@@ -647,13 +702,16 @@ THEORAPLAY_Decoder *THEORAPLAY_startDecode(THEORAPLAY_Io *io,
 
     if (Mutex_Create(ctx) == 0)
     {
-        ctx->thread_created = (Thread_Create(ctx, WorkerThreadEntry) == 0);
-        if (ctx->thread_created)
-            return (THEORAPLAY_Decoder *) ctx;
+        if (Wake_Create(ctx) == 0)
+        {
+            ctx->thread_created = (Thread_Create(ctx, WorkerThreadEntry) == 0);
+            if (ctx->thread_created)
+                return (THEORAPLAY_Decoder *) ctx;
+            Wake_Destroy(&ctx->room);
+        } // if
+        Mutex_Destroy(&ctx->lock);
     } // if
 
-    Mutex_Destroy(ctx->lock);
-
 startdecode_failed:
     io->close(io);
     free(ctx);
@@ -669,9 +727,13 @@ void THEORAPLAY_stopDecode(THEORAPLAY_Decoder *decoder)
 
     if (ctx->thread_created)
     {
+        Mutex_Lock(&ctx->lock);
         ctx->halt = 1;
+        Wake_Signal(&ctx->room);
+        Mutex_Unlock(&ctx->lock);
         Thread_Join(ctx->worker);
-        Mutex_Destroy(ctx->lock);
+        Wake_Destroy(&ctx->room);
+        Mutex_Destroy(&ctx->lock);
     } // if
 
     VideoFrame *videolist = ctx->videolist;
@@ -683,6 +745,15 @@ void THEORAPLAY_stopDecode(THEORAPLAY_Decoder *decoder)
         videolist = next;
     } // while
 
+    videolist = ctx->framepool;
+    while (videolist)
+    {
+        VideoFrame *next = videolist->next;
+        free(videolist->pixels);
+        free(videolist);
+        videolist = next;
+    } // while
+
     AudioPacket *audiolist = ctx->audiolist;
     while (audiolist)
     {
@@ -702,10 +773,10 @@ int THEORAPLAY_isDecoding(THEORAPLAY_Decoder *decoder)
     int retval = 0;
     if (ctx)
     {
-        Mutex_Lock(ctx->lock);
+        Mutex_Lock(&ctx->lock);
         retval = ( ctx && (ctx->audiolist || ctx->videolist ||
                    (ctx->thread_created && !ctx->thread_done)) );
-        Mutex_Unlock(ctx->lock);
+        Mutex_Unlock(&ctx->lock);
     } // if
     return retval;
 } // THEORAPLAY_isDecoding
@@ -715,9 +786,9 @@ int THEORAPLAY_isDecoding(THEORAPLAY_Decoder *decoder)
     TheoraDecoder *ctx = (TheoraDecoder *) decoder; \
     typ retval = defval; \
     if (ctx) { \
-        Mutex_Lock(ctx->lock); \
+        Mutex_Lock(&ctx->lock); \
         retval = ctx->member; \
-        Mutex_Unlock(ctx->lock); \
+        Mutex_Unlock(&ctx->lock); \
     } \
     return retval;
 
@@ -762,7 +833,7 @@ const THEORAPLAY_AudioPacket *THEORAPLAY_getAudio(THEORAPLAY_Decoder *decoder)
     TheoraDecoder *ctx = (TheoraDecoder *) decoder;
     AudioPacket *retval;
 
-    Mutex_Lock(ctx->lock);
+    Mutex_Lock(&ctx->lock);
     retval = ctx->audiolist;
     if (retval)
     {
@@ -772,7 +843,7 @@ const THEORAPLAY_AudioPacket *THEORAPLAY_getAudio(THEORAPLAY_Decoder *decoder)
         if (ctx->audiolist == NULL)
             ctx->audiolisttail = NULL;
     } // if
-    Mutex_Unlock(ctx->lock);
+    Mutex_Unlock(&ctx->lock);
 
     return retval;
 } // THEORAPLAY_getAudio
@@ -795,7 +866,7 @@ const THEORAPLAY_VideoFrame *THEORAPLAY_getVideo(THEORAPLAY_Decoder *decoder)
     TheoraDecoder *ctx = (TheoraDecoder *) decoder;
     VideoFrame *retval;
 
-    Mutex_Lock(ctx->lock);
+    Mutex_Lock(&ctx->lock);
     retval = ctx->videolist;
     if (retval)
     {
@@ -805,8 +876,9 @@ const THEORAPLAY_VideoFrame *THEORAPLAY_getVideo(THEORAPLAY_Decoder *decoder)
             ctx->videolisttail = NULL;
         assert(ctx->videocount > 0);
         ctx->videocount--;
+        Wake_Signal(&ctx->room);
     } // if
-    Mutex_Unlock(ctx->lock);
+    Mutex_Unlock(&ctx->lock);
 
     return retval;
 } // THEORAPLAY_getVideo
@@ -823,5 +895,30 @@ void THEORAPLAY_freeVideo(const THEORAPLAY_VideoFrame *_item)
     } // if
 } // THEORAPLAY_freeVideo
 
+void THEORAPLAY_recycleVideo(THEORAPLAY_Decoder *decoder,
+                             const THEORAPLAY_VideoFrame *_item)
+{
+    TheoraDecoder *ctx = (TheoraDecoder *) decoder;
+    VideoFrame *item = (VideoFrame *) _item;
+    if (item == NULL)
+        return;
+
+    assert(item->next == NULL);
+
+    // Only packed YUV frames have a fixed size buffer we know how to
+    //  refill; the RGB converters always allocate.
+    if (!ctx || (item->format != THEORAPLAY_VIDFMT_YV12 &&
+                 item->format != THEORAPLAY_VIDFMT_IYUV))
+    {
+        THEORAPLAY_freeVideo(item);
+        return;
+    } // if
+
+    Mutex_Lock(&ctx->lock);
+    item->next = ctx->framepool;
+    ctx->framepool = item;
+    Mutex_Unlock(&ctx->lock);
+} // THEORAPLAY_recycleVideo
+
 // end of theoraplay.cpp ...
 
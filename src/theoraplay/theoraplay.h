@@ -75,6 +75,12 @@ void THEORAPLAY_freeAudio(const THEORAPLAY_AudioPacket *item);
 const THEORAPLAY_VideoFrame *THEORAPLAY_getVideo(THEORAPLAY_Decoder *decoder);
 void THEORAPLAY_freeVideo(const THEORAPLAY_VideoFrame *item);
 
+/* Like THEORAPLAY_freeVideo(), but keeps the frame so the decoder can
+ * fill it again instead of allocating a new one. Must be called
+ * before THEORAPLAY_stopDecode() on the same decoder. */
+void THEORAPLAY_recycleVideo(THEORAPLAY_Decoder *decoder,
+                             const THEORAPLAY_VideoFrame *item);
+
 #ifdef __cplusplus
 }
 #endif
@@ -10,13 +10,15 @@
 #error Do not include this in your app. It is used internally by TheoraPlay.
 #endif
 
+// RGB frames are never recycled, so 'reuse' is always NULL here.
 static unsigned char *THEORAPLAY_CVT_FNNAME_420(const th_info *tinfo,
-                                                const th_ycbcr_buffer ycbcr)
+                                                const th_ycbcr_buffer ycbcr,
+                                                unsigned char *reuse)
 {
     const int w = tinfo->pic_width;
     const int h = tinfo->pic_height;
     const int halfw = w / 2;
-    unsigned char *pixels = (unsigned char *) malloc(w * h * 4);
+    unsigned char *pixels = reuse ? reuse : (unsigned char *) malloc(w * h * 4);
 
     // http://www.theora.org/doc/Theora.pdf, 1.1 spec,
     //  chapter 4.2 (Y'CbCr -> Y'PbPr -> R'G'B')
@@ -0,0 +1,58 @@
+/*
+** bindingslots.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BINDINGSLOTS_H
+#define BINDINGSLOTS_H
+
+#include <stdint.h>
+
+/* Storage owned by the language binding, which keeps the
+ * script side objects of an object's properties here (eg. the
+ * wrapped color, tone and bitmap of a Sprite) so it can return
+ * them without a lookup. Opaque to the core, and never copied
+ * along with the object it is part of */
+struct BindingSlots
+{
+	enum { Count = 8 };
+
+	uintptr_t slot[Count];
+
+	BindingSlots()
+	{
+		clear();
+	}
+
+	BindingSlots(const BindingSlots &)
+	{
+		clear();
+	}
+
+	BindingSlots &operator=(const BindingSlots &)
+	{
+		return *this;
+	}
+
+	void clear()
+	{
+		for (int i = 0; i < Count; ++i)
+			slot[i] = 0;
+	}
+};
+
+#endif // BINDINGSLOTS_H
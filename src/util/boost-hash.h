@@ -98,6 +98,11 @@ public:
     {
         p.clear();
     }
+
+	inline size_t size() const
+	{
+		return p.size();
+	}
 };
 
 template<typename K>
@@ -127,6 +132,16 @@ public:
 		p.erase(key);
 	}
 
+	inline void clear()
+	{
+		p.clear();
+	}
+
+	inline size_t size() const
+	{
+		return p.size();
+	}
+
 	inline const_iterator cbegin() const
 	{
 		return p.cbegin();
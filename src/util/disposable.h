@@ -23,6 +23,7 @@
 #define DISPOSABLE_H
 
 #include "intrulist.h"
+#include "bindingslots.h"
 #include "exception.h"
 #include "sharedstate.h"
 #include "graphics.h"
@@ -62,6 +63,8 @@ public:
 
     sigslot::signal<> wasDisposed;
 
+	BindingSlots bindingSlots;
+
 protected:
 	void guardDisposed() const
 	{
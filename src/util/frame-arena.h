@@ -0,0 +1,155 @@
+/*
+** frame-arena.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FRAMEARENA_H
+#define FRAMEARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <new>
+
+/* Bump allocator for memory that is only needed until the end
+ * of the current frame, such as vertices assembled for a buffer
+ * upload. Nothing is freed individually; 'reset()' releases
+ * all allocations at once. Blocks are kept across frames, so
+ * once warmed up, allocating involves no heap traffic */
+class FrameArena
+{
+	struct Block
+	{
+		uint8_t *data;
+		size_t size;
+		size_t used;
+	};
+
+	std::vector<Block> blocks;
+
+	/* Largest amount in use at a reset, and resets
+	 * since we last checked whether to shrink */
+	size_t highWater;
+	int resets;
+
+	enum
+	{
+		Align = 16,
+		MinBlockSize = 64 * 1024,
+		ShrinkPeriod = 600
+	};
+
+	void addBlock(size_t size)
+	{
+		Block block;
+		block.data = static_cast<uint8_t*>(malloc(size));
+		block.size = size;
+		block.used = 0;
+
+		if (!block.data)
+			throw std::bad_alloc();
+
+		blocks.push_back(block);
+	}
+
+	void freeBlocks()
+	{
+		for (size_t i = 0; i < blocks.size(); ++i)
+			free(blocks[i].data);
+
+		blocks.clear();
+	}
+
+	void *allocBytes(size_t bytes)
+	{
+		bytes = (bytes + Align - 1) & ~(size_t) (Align - 1);
+
+		if (blocks.empty() || blocks.back().used + bytes > blocks.back().size)
+		{
+			size_t size = blocks.empty() ? MinBlockSize : blocks.back().size * 2;
+			addBlock(std::max(size, bytes));
+		}
+
+		Block &block = blocks.back();
+		void *ptr = block.data + block.used;
+		block.used += bytes;
+
+		return ptr;
+	}
+
+public:
+	FrameArena()
+	    : highWater(0),
+	      resets(0)
+	{}
+
+	~FrameArena()
+	{
+		freeBlocks();
+	}
+
+	/* Uninitialized room for 'count' objects of the trivially
+	 * copyable type 'T', valid until the next 'reset()' */
+	template<typename T>
+	T *alloc(size_t count)
+	{
+		return static_cast<T*>(allocBytes(count * sizeof(T)));
+	}
+
+	void reset()
+	{
+		size_t used = 0;
+
+		for (size_t i = 0; i < blocks.size(); ++i)
+			used += blocks[i].used;
+
+		highWater = std::max(highWater, used);
+
+		/* Spilled into several blocks; replace them with one
+		 * that fits it all, so the next frame doesn't spill */
+		if (blocks.size() > 1)
+		{
+			size_t total = 0;
+
+			for (size_t i = 0; i < blocks.size(); ++i)
+				total += blocks[i].size;
+
+			freeBlocks();
+			addBlock(total);
+		}
+		/* Give memory back after a spike (eg. a huge map) */
+		else if (++resets >= ShrinkPeriod)
+		{
+			const size_t size = std::max<size_t>(highWater * 2, MinBlockSize);
+
+			if (!blocks.empty() && size < blocks[0].size / 2)
+			{
+				freeBlocks();
+				addBlock(size);
+			}
+
+			highWater = 0;
+			resets = 0;
+		}
+
+		if (!blocks.empty())
+			blocks[0].used = 0;
+	}
+};
+
+#endif // FRAMEARENA_H
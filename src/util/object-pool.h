@@ -0,0 +1,107 @@
+/*
+** object-pool.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OBJECTPOOL_H
+#define OBJECTPOOL_H
+
+#include <stddef.h>
+#include <new>
+
+/* Recycles the memory of freed objects of one class through an
+ * intrusive free list (the link is stored in the dead object
+ * itself), so objects created and disposed in bulk don't hit
+ * malloc every time. Classes opt in with DECL_POOLED_NEW; memory
+ * requests for derived classes of a different size bypass it */
+template<typename T>
+class ObjectPool
+{
+	struct FreeSlot
+	{
+		FreeSlot *next;
+	};
+
+	FreeSlot *head;
+	size_t count;
+
+	/* Slots beyond this are given back to the system */
+	enum { MaxFree = 512 };
+
+	ObjectPool()
+	    : head(0),
+	      count(0)
+	{}
+
+	~ObjectPool()
+	{
+		while (head)
+		{
+			FreeSlot *slot = head;
+			head = slot->next;
+			::operator delete(slot);
+		}
+	}
+
+	static ObjectPool &instance()
+	{
+		static ObjectPool pool;
+		return pool;
+	}
+
+public:
+	static void *alloc(size_t size)
+	{
+		ObjectPool &pool = instance();
+
+		if (size != sizeof(T) || !pool.head)
+			return ::operator new(size < sizeof(FreeSlot) ? sizeof(FreeSlot) : size);
+
+		FreeSlot *slot = pool.head;
+		pool.head = slot->next;
+		pool.count--;
+
+		return slot;
+	}
+
+	static void release(void *ptr, size_t size)
+	{
+		ObjectPool &pool = instance();
+
+		if (!ptr)
+			return;
+
+		if (size != sizeof(T) || pool.count >= MaxFree)
+		{
+			::operator delete(ptr);
+			return;
+		}
+
+		FreeSlot *slot = static_cast<FreeSlot*>(ptr);
+		slot->next = pool.head;
+		pool.head = slot;
+		pool.count++;
+	}
+};
+
+#define DECL_POOLED_NEW(klass) \
+	static void *operator new(size_t size) \
+	{ return ObjectPool<klass>::alloc(size); } \
+	static void operator delete(void *ptr, size_t size) \
+	{ ObjectPool<klass>::release(ptr, size); }
+
+#endif // OBJECTPOOL_H
@@ -6,6 +6,7 @@
 #include <SDL_rwops.h>
 
 #include <string>
+#include <string.h>
 #include <iostream>
 #include <unistd.h>
 
@@ -46,6 +47,34 @@ private:
 	mutable SDL_atomic_t atom;
 };
 
+/* A float that can be read and written from any thread */
+struct AtomicFloat
+{
+	AtomicFloat(float value = 0)
+	{
+		set(value);
+	}
+
+	void set(float value)
+	{
+		int bits;
+		memcpy(&bits, &value, sizeof(bits));
+		SDL_AtomicSet(&atom, bits);
+	}
+
+	operator float() const
+	{
+		int bits = SDL_AtomicGet(&atom);
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+
+		return value;
+	}
+
+private:
+	mutable SDL_atomic_t atom;
+};
+
 template<class C, void (C::*func)()>
 int __sdlThreadFun(void *obj)
 {
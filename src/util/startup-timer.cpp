@@ -0,0 +1,99 @@
+/*
+** startup-timer.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "startup-timer.h"
+
+#include "debugwriter.h"
+
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+
+typedef std::chrono::steady_clock Clock;
+
+struct Phase
+{
+	const char *name;
+	Clock::time_point end;
+};
+
+/* Static initialization is as close to process
+ * start as we can get without platform code */
+static const Clock::time_point processStart = Clock::now();
+static std::vector<Phase> phases;
+static bool reported = false;
+
+static double msBetween(Clock::time_point from, Clock::time_point to)
+{
+	return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+void StartupTimer::mark(const char *phase)
+{
+	if (reported)
+		return;
+
+	Phase p = { phase, Clock::now() };
+	phases.push_back(p);
+}
+
+void StartupTimer::report(bool enabled)
+{
+	if (reported)
+		return;
+
+	reported = true;
+
+	if (!enabled || phases.empty())
+		return;
+
+	FILE *log = fopen("startup.log", "a");
+	Clock::time_point last = processStart;
+	char line[128];
+
+	Debug() << "Startup times:";
+
+	if (log)
+		fprintf(log, "Startup times:\n");
+
+	for (size_t i = 0; i < phases.size(); ++i)
+	{
+		snprintf(line, sizeof(line), "  %-24s %9.1f ms",
+		         phases[i].name, msBetween(last, phases[i].end));
+		last = phases[i].end;
+
+		Debug() << line;
+
+		if (log)
+			fprintf(log, "%s\n", line);
+	}
+
+	snprintf(line, sizeof(line), "  %-24s %9.1f ms",
+	         "total", msBetween(processStart, last));
+
+	Debug() << line;
+
+	if (log)
+	{
+		fprintf(log, "%s\n\n", line);
+		fclose(log);
+	}
+
+	phases.clear();
+}
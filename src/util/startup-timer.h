@@ -0,0 +1,52 @@
+/*
+** startup-timer.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STARTUPTIMER_H
+#define STARTUPTIMER_H
+
+/* Records how long each part of startup takes, up to the point
+ * the game's scripts start running. Marks are cheap enough to
+ * always be taken; the 'printStartupTimes' option decides whether
+ * the breakdown is reported. The main thread marks until the RGSS
+ * thread is started, and only that thread after, so no locking
+ * is done */
+namespace StartupTimer
+{
+	/* Ends a phase that started at the previous mark (or
+	 * process start, for the first one). 'phase' must be
+	 * a string literal */
+	void mark(const char *phase);
+
+	/* Prints the breakdown to the console and appends it to
+	 * 'startup.log' in the game folder. Only the first call
+	 * does anything */
+	void report(bool enabled);
+}
+
+/* Declared as a member between others, to time how long the
+ * members constructed before it took */
+struct StartupMark
+{
+	StartupMark(const char *phase)
+	{
+		StartupTimer::mark(phase);
+	}
+};
+
+#endif // STARTUPTIMER_H
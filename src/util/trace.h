@@ -0,0 +1,53 @@
+/*
+** trace.h
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Zones for the Tracy profiler, compiled in with the 'tracy'
+ * build option. Unlike the frame profiler (see profiler.h),
+ * Tracy records a timeline across all threads, which is what
+ * cross-thread stalls show up in. Without the option, all of
+ * these expand to nothing */
+#ifdef MKXPZ_TRACY
+
+#include <tracy/Tracy.hpp>
+
+/* Lasts until the end of the enclosing scope.
+ * 'name' must be a string literal */
+#define TRACE_ZONE(name) ZoneScopedN(name)
+
+/* Same, for names only known at runtime */
+#define TRACE_ZONE_DYN(name) ZoneTransientN(__traceZone, name, true)
+
+/* Marks the end of one Graphics.update frame */
+#define TRACE_FRAME() FrameMark
+
+#define TRACE_THREAD(name) tracy::SetThreadName(name)
+
+#else
+
+#define TRACE_ZONE(name)
+#define TRACE_ZONE_DYN(name)
+#define TRACE_FRAME()
+#define TRACE_THREAD(name)
+
+#endif
+
+#endif // TRACE_H
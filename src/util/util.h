@@ -23,6 +23,7 @@
 #define UTIL_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string>
 #include <algorithm>
 #include <vector>
@@ -61,6 +62,53 @@ findNextPow2(int start)
 	return i;
 }
 
+/* Decodes the character at '_input', setting 'end_ptr' past it.
+ * Returns (uint16_t) -1 without moving 'end_ptr' on bytes that
+ * don't start a character.
+ * http://www.lemoda.net/c/utf8-to-ucs2/index.html */
+inline uint16_t utf8_to_ucs2(const char *_input,
+                             const char **end_ptr)
+{
+	const unsigned char *input =
+		reinterpret_cast<const unsigned char*>(_input);
+	*end_ptr = _input;
+
+	if (input[0] == 0)
+		return -1;
+
+	if (input[0] < 0x80)
+	{
+		*end_ptr = _input + 1;
+
+		return input[0];
+	}
+
+	if ((input[0] & 0xE0) == 0xE0)
+	{
+		if (input[1] == 0 || input[2] == 0)
+			return -1;
+
+		*end_ptr = _input + 3;
+
+		return (input[0] & 0x0F)<<12 |
+		       (input[1] & 0x3F)<<6  |
+		       (input[2] & 0x3F);
+	}
+
+	if ((input[0] & 0xC0) == 0xC0)
+	{
+		if (input[1] == 0)
+			return -1;
+
+		*end_ptr = _input + 2;
+
+		return (input[0] & 0x1F)<<6  |
+		       (input[1] & 0x3F);
+	}
+
+	return -1;
+}
+
 /* Reads the contents of the file at 'path' and
  * appends them to 'out'. Returns false on failure */
 inline bool readFile(const char *path,
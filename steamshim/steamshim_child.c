@@ -15,7 +15,6 @@ typedef unsigned __int64 uint64;
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
-#include <poll.h>
 #include <signal.h>
 typedef uint8_t uint8;
 typedef int32_t int32;
@@ -25,6 +24,10 @@ typedef int PipeType;
 #endif
 #include <stdlib.h>
 
+#include <SDL_thread.h>
+#include <SDL_mutex.h>
+#include <SDL_atomic.h>
+
 #include "steamshim_child.h"
 
 #ifdef STEAMSHIM_DEBUG
@@ -39,17 +42,10 @@ static int writePipe(PipeType fd, const void *buf, const unsigned int _len);
 static int readPipe(PipeType fd, void *buf, const unsigned int _len);
 static void closePipe(PipeType fd);
 static char *getEnvVar(const char *key, char *buf, const size_t buflen);
-static int pipeReady(PipeType fd);
 
 
 #ifdef _WIN32
 
-static int pipeReady(PipeType fd)
-{
-    DWORD avail = 0;
-    return (PeekNamedPipe(fd, NULL, 0, NULL, &avail, NULL) && (avail > 0));
-} /* pipeReady */
-
 static int writePipe(PipeType fd, const void *buf, const unsigned int _len) {
   const DWORD len = (DWORD)_len;
   DWORD bw = 0;
@@ -76,14 +72,6 @@ static char *getEnvVar(const char *key, char *buf, const size_t buflen)
 
 #else
 
-static int pipeReady(PipeType fd)
-{
-    int rc;
-    struct pollfd pfd = { fd, POLLIN | POLLERR | POLLHUP, 0 };
-    while (((rc = poll(&pfd, 1, 0)) == -1) && (errno == EINTR)) { /*spin*/ }
-    return (rc == 1);
-} /* pipeReady */
-
 static int writePipe(PipeType fd, const void *buf, const unsigned int _len)
 {
     const ssize_t len = (ssize_t) _len;
@@ -120,6 +108,29 @@ static char *getEnvVar(const char *key, char *buf, const size_t buflen)
 static PipeType GPipeRead = NULLPIPE;
 static PipeType GPipeWrite = NULLPIPE;
 
+/* Commands are appended to GOutBuf and written by the writer thread in
+ * batches, so a full pipe never stalls the caller. Events are read by
+ * the reader thread as they arrive and queued for STEAMSHIM_pump() and
+ * STEAMSHIM_waitEvent(). Everything below is guarded by GLock. */
+static SDL_mutex *GLock = NULL;
+static SDL_cond *GWriteCond = NULL;
+static SDL_cond *GEventCond = NULL;
+static SDL_sem *GReaderDone = NULL;
+static SDL_Thread *GWriterThread = NULL;
+static SDL_Thread *GReaderThread = NULL;
+static int GQuit = 0;
+
+static uint8 *GOutBuf = NULL;
+static size_t GOutLen = 0;
+static size_t GOutCap = 0;
+
+static STEAMSHIM_Event *GEvents = NULL;
+static size_t GEventCount = 0;
+static size_t GEventCap = 0;
+
+/* Set once either thread hits a broken pipe */
+static SDL_atomic_t GBroken;
+
 typedef enum ShimCmd
 {
     SHIMCMD_BYE,
@@ -137,16 +148,173 @@ typedef enum ShimCmd
     SHIMCMD_GETCURRENTGAMELANGUAGE,
 } ShimCmd;
 
+static int queueCommand(const uint8 *buf, const size_t len)
+{
+    int retval = 0;
+
+    SDL_LockMutex(GLock);
+
+    if (!GQuit && !SDL_AtomicGet(&GBroken))
+    {
+        if (GOutLen + len > GOutCap)
+        {
+            const size_t cap = (GOutLen + len) * 2;
+            uint8 *ptr = (uint8 *) realloc(GOutBuf, cap);
+            if (ptr)
+            {
+                GOutBuf = ptr;
+                GOutCap = cap;
+            } /* if */
+        } /* if */
+
+        if (GOutLen + len <= GOutCap)
+        {
+            memcpy(GOutBuf + GOutLen, buf, len);
+            GOutLen += len;
+            SDL_CondSignal(GWriteCond);
+            retval = 1;
+        } /* if */
+    } /* if */
+
+    SDL_UnlockMutex(GLock);
+
+    return retval;
+} /* queueCommand */
+
+static int writerThread(void *data)
+{
+    uint8 *batch = NULL;
+    size_t batchCap = 0;
+    (void) data;
+
+    SDL_LockMutex(GLock);
+
+    while (1)
+    {
+        uint8 *tmp;
+        size_t tmpCap, len;
+        int okay;
+
+        while (!GQuit && (GOutLen == 0))
+            SDL_CondWait(GWriteCond, GLock);
+
+        /* Queued commands (the final BYE) still go out when quitting */
+        if (GOutLen == 0)
+            break;
+
+        /* Swap buffers, so new commands can be queued while we write */
+        tmp = batch;
+        tmpCap = batchCap;
+        len = GOutLen;
+
+        batch = GOutBuf;
+        batchCap = GOutCap;
+        GOutBuf = tmp;
+        GOutCap = tmpCap;
+        GOutLen = 0;
+
+        SDL_UnlockMutex(GLock);
+
+        dbgpipe("Child writing %u bytes of commands.\n", (unsigned int) len);
+        okay = writePipe(GPipeWrite, batch, (unsigned int) len);
+
+        SDL_LockMutex(GLock);
+
+        if (!okay)
+        {
+            dbgpipe("Child writePipe failed!\n");
+            SDL_AtomicSet(&GBroken, 1);
+            SDL_CondBroadcast(GEventCond);
+            break;
+        } /* if */
+    } /* while */
+
+    SDL_UnlockMutex(GLock);
+
+    free(batch);
+    return 0;
+} /* writerThread */
+
+static void queueEvent(const STEAMSHIM_Event *event)
+{
+    SDL_LockMutex(GLock);
+
+    if (GEventCount == GEventCap)
+    {
+        const size_t cap = GEventCap ? GEventCap * 2 : 16;
+        STEAMSHIM_Event *ptr = (STEAMSHIM_Event *) realloc(GEvents, cap * sizeof (*ptr));
+        if (ptr)
+        {
+            GEvents = ptr;
+            GEventCap = cap;
+        } /* if */
+    } /* if */
+
+    if (GEventCount < GEventCap)
+        GEvents[GEventCount++] = *event;
+
+    SDL_CondBroadcast(GEventCond);
+    SDL_UnlockMutex(GLock);
+} /* queueEvent */
+
+static const STEAMSHIM_Event *processEvent(const uint8 *buf, size_t buflen);
+
+static int readerThread(void *data)
+{
+    uint8 buf[512];
+    int br = 0;
+    (void) data;
+
+    /* this read blocks. */
+    while (1)
+    {
+        const int morebr = readPipe(GPipeRead, buf + br, sizeof (buf) - br);
+        if (morebr <= 0)
+        {
+            dbgpipe("Child readPipe failed! Shutting down.\n");
+            break;
+        } /* if */
+
+        br += morebr;
+
+        /* One read may hold several events, the last one partially */
+        while (br > 0)
+        {
+            const int evlen = (int) buf[0];
+            const STEAMSHIM_Event *event;
+
+            if (br <= evlen)
+                break;
+
+            event = processEvent(buf+1, evlen);
+            if (event)
+                queueEvent(event);
+
+            br -= evlen + 1;
+            if (br > 0)
+                memmove(buf, buf+evlen+1, br);
+        } /* while */
+    } /* while */
+
+    SDL_LockMutex(GLock);
+    SDL_AtomicSet(&GBroken, 1);
+    SDL_CondBroadcast(GEventCond);
+    SDL_UnlockMutex(GLock);
+
+    SDL_SemPost(GReaderDone);
+    return 0;
+} /* readerThread */
+
 static int write1ByteCmd(const uint8 b1)
 {
     const uint8 buf[] = { 1, b1 };
-    return writePipe(GPipeWrite, buf, sizeof (buf));
+    return queueCommand(buf, sizeof (buf));
 } /* write1ByteCmd */
 
 static int write2ByteCmd(const uint8 b1, const uint8 b2)
 {
     const uint8 buf[] = { 2, b1, b2 };
-    return writePipe(GPipeWrite, buf, sizeof (buf));
+    return queueCommand(buf, sizeof (buf));
 } /* write2ByteCmd */
 
 static inline int writeBye(void)
@@ -184,21 +352,90 @@ int STEAMSHIM_init(void)
     signal(SIGPIPE, SIG_IGN);
 #endif
 
+    SDL_AtomicSet(&GBroken, 0);
+    GQuit = 0;
+
+    GLock = SDL_CreateMutex();
+    GWriteCond = SDL_CreateCond();
+    GEventCond = SDL_CreateCond();
+    GReaderDone = SDL_CreateSemaphore(0);
+
+    if (GLock && GWriteCond && GEventCond && GReaderDone)
+    {
+        GWriterThread = SDL_CreateThread(writerThread, "steamshim write", NULL);
+        GReaderThread = SDL_CreateThread(readerThread, "steamshim read", NULL);
+    } /* if */
+
+    if (!GWriterThread || !GReaderThread)
+    {
+        dbgpipe("Child init failed to start pipe threads.\n");
+        STEAMSHIM_deinit();
+        return 0;
+    } /* if */
+
     dbgpipe("Child init success!\n");
     return 1;
 } /* STEAMSHIM_init */
 
 void STEAMSHIM_deinit(void)
 {
+    int readerDone = 1;
+
     dbgpipe("Child deinit.\n");
-    if (GPipeWrite != NULLPIPE)
+
+    if (GWriterThread)
     {
         writeBye();
+
+        SDL_LockMutex(GLock);
+        GQuit = 1;
+        SDL_CondSignal(GWriteCond);
+        SDL_UnlockMutex(GLock);
+
+        /* Returns once the BYE is written */
+        SDL_WaitThread(GWriterThread, NULL);
+        GWriterThread = NULL;
+    } /* if */
+
+    if (GPipeWrite != NULLPIPE)
         closePipe(GPipeWrite);
+
+    if (GReaderThread)
+    {
+        /* The parent answers BYE and closes its end, which ends the
+         * reader. If it doesn't, the reader is left blocked in its
+         * read; its pipe and the shared state are then left alone */
+        if (SDL_SemWaitTimeout(GReaderDone, 1000) == 0)
+            SDL_WaitThread(GReaderThread, NULL);
+        else
+        {
+            SDL_DetachThread(GReaderThread);
+            readerDone = 0;
+        } /* else */
+
+        GReaderThread = NULL;
+    } /* if */
+
+    if (readerDone)
+    {
+        if (GPipeRead != NULLPIPE)
+            closePipe(GPipeRead);
+
+        if (GReaderDone) SDL_DestroySemaphore(GReaderDone);
+        if (GEventCond) SDL_DestroyCond(GEventCond);
+        if (GWriteCond) SDL_DestroyCond(GWriteCond);
+        if (GLock) SDL_DestroyMutex(GLock);
+
+        free(GOutBuf);
+        free(GEvents);
+        GOutBuf = NULL;
+        GEvents = NULL;
+        GOutLen = GOutCap = GEventCount = GEventCap = 0;
     } /* if */
 
-    if (GPipeRead != NULLPIPE)
-        closePipe(GPipeRead);
+    GReaderDone = NULL;
+    GEventCond = GWriteCond = NULL;
+    GLock = NULL;
 
     GPipeRead = GPipeWrite = NULLPIPE;
 
@@ -209,7 +446,8 @@ void STEAMSHIM_deinit(void)
 
 static inline int isAlive(void)
 {
-    return ((GPipeRead != NULLPIPE) && (GPipeWrite != NULLPIPE));
+    return ((GPipeRead != NULLPIPE) && (GPipeWrite != NULLPIPE) &&
+            GLock && !SDL_AtomicGet(&GBroken));
 } /* isAlive */
 
 static inline int isDead(void)
@@ -296,7 +534,7 @@ static const STEAMSHIM_Event *processEvent(const uint8 *buf, size_t buflen)
         case SHIMEVENT_SETSTATF:
         case SHIMEVENT_GETSTATF:
             event.okay = *(buf++) ? 1 : 0;
-            event.fvalue = (int) *((float *) buf);
+            event.fvalue = *((float *) buf);
             buf += sizeof (float);
             strcpy(event.name, (const char *) buf);
             break;
@@ -313,42 +551,58 @@ static const STEAMSHIM_Event *processEvent(const uint8 *buf, size_t buflen)
     return &event;
 } /* processEvent */
 
-const STEAMSHIM_Event *STEAMSHIM_pump(void)
+/* Removes the first queued event of 'type' (or any type if negative).
+ * GLock must be held. */
+static int takeEvent(const int type, STEAMSHIM_Event *out)
 {
-    static uint8 buf[256];
-    static int br = 0;
-    int evlen = (br > 0) ? ((int) buf[0]) : 0;
-
-    if (isDead())
-        return NULL;
+    size_t i;
 
-    if (br <= evlen)  /* we have an incomplete commmand. Try to read more. */
+    for (i = 0; i < GEventCount; i++)
     {
-        if (pipeReady(GPipeRead))
+        if ((type < 0) || (GEvents[i].type == (STEAMSHIM_EventType) type))
         {
-            const int morebr = readPipe(GPipeRead, buf + br, sizeof (buf) - br);
-            if (morebr > 0)
-                br += morebr;
-            else  /* uh oh */
-            {
-                dbgpipe("Child readPipe failed! Shutting down.\n");
-                STEAMSHIM_deinit();   /* kill it all. */
-            } /* else */
+            *out = GEvents[i];
+            GEventCount--;
+            memmove(&GEvents[i], &GEvents[i+1], (GEventCount - i) * sizeof (*GEvents));
+            return 1;
         } /* if */
-    } /* if */
+    } /* for */
 
-    if (evlen && (br > evlen))
-    {
-        const STEAMSHIM_Event *retval = processEvent(buf+1, evlen);
-        br -= evlen + 1;
-        if (br > 0)
-            memmove(buf, buf+evlen+1, br);
-        return retval;
-    } /* if */
+    return 0;
+} /* takeEvent */
 
-    return NULL;
+const STEAMSHIM_Event *STEAMSHIM_pump(void)
+{
+    static STEAMSHIM_Event event;
+    int found;
+
+    if (!GLock)
+        return NULL;
+
+    SDL_LockMutex(GLock);
+    found = takeEvent(-1, &event);
+    SDL_UnlockMutex(GLock);
+
+    return found ? &event : NULL;
 } /* STEAMSHIM_pump */
 
+int STEAMSHIM_waitEvent(const STEAMSHIM_EventType type, STEAMSHIM_Event *event)
+{
+    int found = 0;
+
+    if (!GLock)
+        return 0;
+
+    SDL_LockMutex(GLock);
+
+    while (!(found = takeEvent((int) type, event)) && !SDL_AtomicGet(&GBroken))
+        SDL_CondWait(GEventCond, GLock);
+
+    SDL_UnlockMutex(GLock);
+
+    return found;
+} /* STEAMSHIM_waitEvent */
+
 void STEAMSHIM_requestStats(void)
 {
     if (isDead()) return;
@@ -374,7 +628,7 @@ void STEAMSHIM_setAchievement(const char *name, const int enable)
     strcpy((char *) ptr, name);
     ptr += strlen(name) + 1;
     buf[0] = (uint8) ((ptr-1) - buf);
-    writePipe(GPipeWrite, buf, buf[0] + 1);
+    queueCommand(buf, buf[0] + 1);
 } /* STEAMSHIM_setAchievement */
 
 void STEAMSHIM_getAchievement(const char *name)
@@ -387,7 +641,7 @@ void STEAMSHIM_getAchievement(const char *name)
     strcpy((char *) ptr, name);
     ptr += strlen(name) + 1;
     buf[0] = (uint8) ((ptr-1) - buf);
-    writePipe(GPipeWrite, buf, buf[0] + 1);
+    queueCommand(buf, buf[0] + 1);
 } /* STEAMSHIM_getAchievement */
 
 void STEAMSHIM_resetStats(const int bAlsoAchievements)
@@ -411,7 +665,7 @@ static void writeStatThing(const ShimCmd cmd, const char *name, const void *val,
     strcpy((char *) ptr, name);
     ptr += strlen(name) + 1;
     buf[0] = (uint8) ((ptr-1) - buf);
-    writePipe(GPipeWrite, buf, buf[0] + 1);
+    queueCommand(buf, buf[0] + 1);
 } /* writeStatThing */
 
 void STEAMSHIM_setStatI(const char *name, const int _val)
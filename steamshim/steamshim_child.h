@@ -35,7 +35,13 @@ typedef struct STEAMSHIM_Event
 int STEAMSHIM_init(void);  /* non-zero on success, zero on failure. */
 void STEAMSHIM_deinit(void);
 int STEAMSHIM_alive(void);
+/* Commands below are queued and written on a background thread;
+ * their replies are read on another one. STEAMSHIM_pump() returns the
+ * oldest queued event without blocking (NULL if there is none), and
+ * STEAMSHIM_waitEvent() blocks until an event of 'type' arrives,
+ * leaving other events queued. It returns zero if the shim died. */
 const STEAMSHIM_Event *STEAMSHIM_pump(void);
+int STEAMSHIM_waitEvent(const STEAMSHIM_EventType type, STEAMSHIM_Event *event);
 void STEAMSHIM_requestStats(void);
 void STEAMSHIM_storeStats(void);
 void STEAMSHIM_setAchievement(const char *name, const int enable);
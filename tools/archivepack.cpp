@@ -0,0 +1,280 @@
+/*
+** archivepack.cpp
+**
+** This file is part of mkxp.
+**
+** mkxp is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** mkxp is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with mkxp.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Converts an RGSS archive (or any directory) into the
+ * indexed, compressed format described in mkxpa.h:
+ *
+ *   mkxpz-pack Game.rgss3a Game.mkxpa
+ *
+ * mkxp-z picks up '<Game>.mkxpa' in place of the original
+ * archive when it exists next to the executable. */
+
+#include "rgssad.h"
+#include "mkxpa.h"
+
+#include <physfs.h>
+#include <zlib.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+struct Chunk
+{
+	uint64_t offset;
+	uint32_t storedSize;
+	uint8_t method;
+};
+
+struct Entry
+{
+	std::string path;
+	uint64_t size;
+	std::vector<Chunk> chunks;
+};
+
+template<typename T>
+static void appendLE(std::vector<uint8_t> &buf, T value)
+{
+	for (size_t i = 0; i < sizeof(T); ++i)
+		buf.push_back((value >> (8 * i)) & 0xFF);
+}
+
+static PHYSFS_EnumerateCallbackResult
+collectCB(void *d, const char *origdir, const char *fname)
+{
+	std::vector<std::string> &files = *static_cast<std::vector<std::string>*>(d);
+
+	std::string path = *origdir ? std::string(origdir) + "/" + fname : fname;
+
+	PHYSFS_Stat stat;
+
+	if (!PHYSFS_stat(path.c_str(), &stat))
+		return PHYSFS_ENUM_OK;
+
+	if (stat.filetype == PHYSFS_FILETYPE_DIRECTORY)
+		PHYSFS_enumerate(path.c_str(), collectCB, d);
+	else
+		files.push_back(path);
+
+	return PHYSFS_ENUM_OK;
+}
+
+static bool
+writeAll(FILE *f, const void *data, size_t len, uint64_t &offset)
+{
+	if (len && fwrite(data, len, 1, f) != 1)
+		return false;
+
+	offset += len;
+
+	return true;
+}
+
+static const char *
+physfsError()
+{
+	return PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode());
+}
+
+static bool
+packFile(FILE *out, Entry &entry, int level, uint64_t &offset)
+{
+	PHYSFS_File *in = PHYSFS_openRead(entry.path.c_str());
+
+	if (!in)
+	{
+		fprintf(stderr, "Failed to open %s: %s\n", entry.path.c_str(), physfsError());
+		return false;
+	}
+
+	std::vector<uint8_t> raw(MKXPA_CHUNK_SIZE);
+	std::vector<uint8_t> packed(compressBound(MKXPA_CHUNK_SIZE));
+
+	entry.size = 0;
+
+	while (true)
+	{
+		PHYSFS_sint64 len = PHYSFS_readBytes(in, raw.data(), raw.size());
+
+		if (len < 0)
+		{
+			fprintf(stderr, "Failed to read %s: %s\n", entry.path.c_str(), physfsError());
+			PHYSFS_close(in);
+			return false;
+		}
+
+		if (len == 0)
+			break;
+
+		uLongf packedLen = packed.size();
+		Chunk chunk;
+		chunk.offset = offset;
+
+		/* Keep whatever doesn't shrink, eg. already compressed images */
+		if (compress2(packed.data(), &packedLen, raw.data(), len, level) == Z_OK &&
+		    packedLen < (uLongf) len)
+		{
+			chunk.method = MKXPA_Deflate;
+			chunk.storedSize = packedLen;
+
+			if (!writeAll(out, packed.data(), packedLen, offset))
+				break;
+		}
+		else
+		{
+			chunk.method = MKXPA_Stored;
+			chunk.storedSize = len;
+
+			if (!writeAll(out, raw.data(), len, offset))
+				break;
+		}
+
+		entry.chunks.push_back(chunk);
+		entry.size += len;
+
+		/* Only the last chunk may be short */
+		if (len < (PHYSFS_sint64) raw.size())
+			break;
+	}
+
+	PHYSFS_close(in);
+
+	return !ferror(out);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage: %s <archive or directory> <output.mkxpa> [level 0-9]\n", argv[0]);
+		return 1;
+	}
+
+	const int level = (argc > 3) ? atoi(argv[3]) : Z_BEST_COMPRESSION;
+
+	if (!PHYSFS_init(argv[0]))
+	{
+		fprintf(stderr, "Failed to initialize PhysFS: %s\n", physfsError());
+		return 1;
+	}
+
+	PHYSFS_registerArchiver(&RGSS1_Archiver);
+	PHYSFS_registerArchiver(&RGSS2_Archiver);
+	PHYSFS_registerArchiver(&RGSS3_Archiver);
+	PHYSFS_registerArchiver(&MKXPA_Archiver);
+
+	if (!PHYSFS_mount(argv[1], 0, 0))
+	{
+		fprintf(stderr, "Failed to open %s: %s\n", argv[1], physfsError());
+		PHYSFS_deinit();
+		return 1;
+	}
+
+	std::vector<std::string> files;
+	PHYSFS_enumerate("", collectCB, &files);
+
+	FILE *out = fopen(argv[2], "wb");
+
+	if (!out)
+	{
+		fprintf(stderr, "Failed to create %s\n", argv[2]);
+		PHYSFS_deinit();
+		return 1;
+	}
+
+	/* The header is filled in once everything else is written */
+	uint8_t header[MKXPA_HEADER_SIZE] = { 0 };
+	uint64_t offset = 0;
+	bool ok = writeAll(out, header, sizeof(header), offset);
+
+	std::vector<Entry> entries(files.size());
+	uint64_t inSize = 0;
+
+	for (size_t i = 0; ok && i < files.size(); ++i)
+	{
+		entries[i].path = files[i];
+		ok = packFile(out, entries[i], level, offset);
+		inSize += entries[i].size;
+	}
+
+	std::vector<uint8_t> toc;
+
+	for (size_t i = 0; ok && i < entries.size(); ++i)
+	{
+		const Entry &entry = entries[i];
+
+		appendLE<uint32_t>(toc, entry.path.size());
+		toc.insert(toc.end(), entry.path.begin(), entry.path.end());
+		appendLE<uint64_t>(toc, entry.size);
+		appendLE<uint32_t>(toc, entry.chunks.size());
+
+		for (size_t j = 0; j < entry.chunks.size(); ++j)
+		{
+			appendLE<uint64_t>(toc, entry.chunks[j].offset);
+			appendLE<uint32_t>(toc, entry.chunks[j].storedSize);
+			appendLE<uint8_t>(toc, entry.chunks[j].method);
+		}
+	}
+
+	std::vector<uint8_t> packedToc(compressBound(toc.size()));
+	uLongf packedTocLen = packedToc.size();
+	const uint64_t tocOffset = offset;
+
+	if (ok)
+		ok = compress2(packedToc.data(), &packedTocLen, toc.data(), toc.size(),
+		               Z_BEST_COMPRESSION) == Z_OK;
+
+	if (ok)
+		ok = writeAll(out, packedToc.data(), packedTocLen, offset);
+
+	if (ok)
+	{
+		std::vector<uint8_t> head(MKXPA_HEADER, MKXPA_HEADER + sizeof(MKXPA_HEADER));
+		head.push_back(MKXPA_VERSION);
+
+		appendLE<uint32_t>(head, MKXPA_CHUNK_SIZE);
+		appendLE<uint32_t>(head, entries.size());
+		appendLE<uint64_t>(head, tocOffset);
+		appendLE<uint32_t>(head, packedTocLen);
+		appendLE<uint32_t>(head, toc.size());
+
+		uint64_t unused = 0;
+		ok = fseek(out, 0, SEEK_SET) == 0 && writeAll(out, head.data(), head.size(), unused);
+	}
+
+	ok = (fclose(out) == 0) && ok;
+	PHYSFS_deinit();
+
+	if (!ok)
+	{
+		fprintf(stderr, "Failed to write %s\n", argv[2]);
+		remove(argv[2]);
+		return 1;
+	}
+
+	printf("Packed %u files, %llu -> %llu bytes\n", (unsigned) entries.size(),
+	       (unsigned long long) inSize, (unsigned long long) offset);
+
+	return 0;
+}